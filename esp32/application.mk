@@ -225,6 +225,7 @@ APP_UTIL_SRC_C = $(addprefix util/,\
 	socketfifo.c \
 	mpirq.c \
 	mpsleep.c \
+	mpwritebehind.c \
 	timeutils.c \
 	esp32chipinfo.c \
 	pycom_general_util.c \
@@ -233,6 +234,8 @@ APP_UTIL_SRC_C = $(addprefix util/,\
 
 APP_FATFS_SRC_C = $(addprefix fatfs/src/,\
 	drivers/sflash_diskio.c \
+	drivers/sflash_cache.c \
+	drivers/sflash_ftl.c \
 	drivers/sd_diskio.c \
 	)
 
@@ -246,6 +249,16 @@ APP_LITTLEFS_SRC_C = $(addprefix littlefs/,\
 
 APP_LORA_SRC_C = $(addprefix lora/,\
 	utilities.c \
+	lora_fsm.c \
+	lora_rx_ring.c \
+	lora_timer_heap.c \
+	lora_frag.c \
+	lora_fuota.c \
+	lora_aes_hw.c \
+	lora_tx_sched.c \
+	lora_aggr.c \
+	lora_session.c \
+	lora_capture.c \
 	timer-board.c \
 	gpio-board.c \
 	spi-board.c \
@@ -268,6 +281,7 @@ APP_MOD_MESH_SRC_C = $(addprefix mods/,\
 APP_LIB_LORA_SRC_C = $(addprefix lib/lora/,\
 	mac/LoRaMac.c \
 	mac/LoRaMacCrypto.c \
+	mac/lora_class_b.c \
 	mac/region/Region.c \
 	mac/region/RegionAS923.c \
 	mac/region/RegionAU915.c \
@@ -282,6 +296,7 @@ APP_LIB_LORA_SRC_C = $(addprefix lib/lora/,\
 	system/timer.c \
 	system/crypto/aes.c \
 	system/crypto/cmac.c \
+	system/crypto/lora_aes.c \
 	)
 
 APP_SX1308_SRC_C = $(addprefix drivers/sx1308/,\
@@ -367,10 +382,13 @@ APP_MODS_LTE_SRC_C = $(addprefix mods/,\
 
 APP_TELNET_SRC_C = $(addprefix telnet/,\
 	telnet.c \
+	telnet_proto.c \
 	)
 
 APP_FTP_SRC_C = $(addprefix ftp/,\
 	ftp.c \
+	ftp_server.c \
+	ota_session.c \
 	updater.c \
 	)
 
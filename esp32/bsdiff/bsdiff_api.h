@@ -2,6 +2,94 @@
 
 #define __BSDIFF_API__
 
-off_t offtin(u_char *buf);
+#include <stdint.h>
+#include <stdbool.h>
+
+// Size of the BSDIFF40 header: magic, the compressed lengths of the control
+// and diff blocks, and the size of the new file.
+#define BSPATCH_HEADER_LEN          (32)
+
+// The bsdiff tool's patches, with bzip2 blocks, and the same with zlib
+// blocks, as tools/bsdiff_zlib.py converts them to.  bzip2 needs SPIRAM,
+// zlib only its window per block and fits in the internal RAM.
+#define BSPATCH_MAGIC_BZIP2         "BSDIFF40"
+#define BSPATCH_MAGIC_ZLIB          "BSDIFZ40"
+
+// Compressed bytes read from the patch at a time, for each of its three
+// blocks.
+#ifndef BSPATCH_IN_SIZE
+#define BSPATCH_IN_SIZE             (512)
+#endif
+
+// The new file is handed to write_new in chunks of this size (the last one
+// may be shorter); a flash sector, so the updater can write it as it goes.
+#ifndef BSPATCH_OUT_SIZE
+#define BSPATCH_OUT_SIZE            (4096)
+#endif
+
+// The largest bzip2 block size accepted, in units of 100k: the level the
+// patch's blocks were compressed with, e.g. 9 for the bsdiff tool's output.
+// Each decompressor runs in bzip2's small mode, which takes about 250 KB per
+// 100k of block size, so 9 needs about 2.3 MB, 1 about 320 KB.
+#ifndef BSPATCH_BZIP2_MAX_BLOCK
+#define BSPATCH_BZIP2_MAX_BLOCK     (9)
+#endif
+
+// The largest zlib window accepted, in bytes.  Each of the three blocks
+// takes its window and about 1.3 KB of state: 4 KB windows, the converter's
+// default, make about 20 KB with the patcher's buffers.
+#ifndef BSPATCH_ZLIB_MAX_WINDOW
+#define BSPATCH_ZLIB_MAX_WINDOW     (32768)
+#endif
+
+#define BSPATCH_OK                  (0)
+#define BSPATCH_ERR_HEADER          (-1)    // not a BSDIFF40 or BSDIFZ40 patch, or inconsistent lengths
+#define BSPATCH_ERR_CORRUPT         (-2)    // control data out of range, or a block ended early
+#define BSPATCH_ERR_BZIP2           (-3)    // a block failed to decompress, bzip2 or zlib
+#define BSPATCH_ERR_NOMEM           (-4)
+#define BSPATCH_ERR_READ            (-5)
+#define BSPATCH_ERR_WRITE           (-6)
+#define BSPATCH_ERR_BLOCK_SIZE      (-7)    // a bzip2 block size or zlib window over the maximum
+#define BSPATCH_ERR_SCRATCH         (-8)    // the control and extra blocks don't fit in the scratch space
+
+// Where the patch and the old file are read from and the new file goes to;
+// the calls return true on success.  Offsets are relative to the start of
+// the patch and of the old file.  alloc and free are used for the patcher's
+// state and for the decompressors.  The scratch space, which may be
+// left out, is written once in order from offset 0, in chunks of up to
+// BSPATCH_OUT_SIZE, before the new file; then it is only read.
+typedef struct _bspatch_ops_t {
+    bool (*read_patch)(void *ctx, uint32_t offset, void *buf, uint32_t len);
+    bool (*read_old)(void *ctx, uint32_t offset, void *buf, uint32_t len);
+    bool (*write_new)(void *ctx, const void *buf, uint32_t len);
+    bool (*write_scratch)(void *ctx, uint32_t offset, const void *buf, uint32_t len);
+    bool (*read_scratch)(void *ctx, uint32_t offset, void *buf, uint32_t len);
+    void *(*alloc)(void *ctx, uint32_t size);
+    void (*free)(void *ctx, void *ptr);
+} bspatch_ops_t;
+
+// Reads an 8 byte offset of the patch; false if it doesn't fit in 32 bits.
+bool offtin(const unsigned char *buf, int32_t *value);
+
+// Reads the header of a patch; returns BSPATCH_OK and the size of the new
+// file if it is a valid BSDIFF40 or BSDIFZ40 patch of patch_size bytes.
+int bspatch_header(const bspatch_ops_t *ops, void *ctx, uint32_t patch_size, uint32_t *new_size);
+
+// Applies a patch of patch_size bytes to an old file of old_size bytes, and
+// writes the new file in order.  The blocks of the patch are read through
+// BSPATCH_IN_SIZE buffers, so besides the decompressors' state the memory
+// used is a few KB whatever the size of the files.
+//
+// For a bzip2 patch with scratch_size bytes of scratch space, the control
+// and extra blocks are first decompressed there, one after the other, and
+// only one bzip2 decompressor is live at a time (see
+// BSPATCH_BZIP2_MAX_BLOCK); the space needed is 24 bytes per control entry
+// plus the bytes new in the new file.  If they don't fit BSPATCH_ERR_SCRATCH
+// is returned before anything was written to the new file.  With no scratch
+// space, and always for a zlib patch, the three blocks are decompressed
+// side by side, which for bzip2 takes three times the memory.
+// Returns BSPATCH_OK or one of the BSPATCH_ERR_ codes.
+int bspatch_stream(const bspatch_ops_t *ops, void *ctx, uint32_t patch_size, uint32_t old_size,
+                   uint32_t scratch_size, uint32_t *new_size);
 
 #endif
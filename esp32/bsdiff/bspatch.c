@@ -28,12 +28,18 @@
 __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bspatch/bspatch.c,v 1.1 2005/08/06 01:59:06 cperciva Exp $");
 #endif
 
+#include <string.h>
+#include <stddef.h>
+
 #include <bzlib.h>
+#include "extmod/uzlib/uzlib.h"
+#include "bsdiff_api.h"
 
-int offtin(unsigned char *buf)
+bool offtin(const unsigned char *buf, int32_t *value)
 {
-	int y;
+	int64_t y;
 
+	/* 63 bits, which can't overflow */
 	y=buf[7]&0x7F;
 	y=y*256;y+=buf[6];
 	y=y*256;y+=buf[5];
@@ -43,7 +49,525 @@ int offtin(unsigned char *buf)
 	y=y*256;y+=buf[1];
 	y=y*256;y+=buf[0];
 
+	if(y>INT32_MAX) return false;
 	if(buf[7]&0x80) y=-y;
 
-	return y;
+	*value = (int32_t)y;
+	return true;
+}
+
+/* Streaming patcher: the new file is produced in BSPATCH_OUT_SIZE chunks.
+ * With scratch space the control and extra blocks of a bzip2 patch are
+ * first decompressed there, one after the other, and only the diff block's
+ * decompressor is live while patching; without, and for a zlib patch, the
+ * three blocks are decompressed side by side straight from the patch. */
+
+struct _bspatch_state_t;
+
+typedef struct {
+	union {
+		bz_stream bz;
+		TINF_DATA z;
+	} u;
+	struct _bspatch_state_t *st;		/* for the zlib input callback */
+	unsigned char *window;			/* zlib's dictionary */
+	bool zlib;
+	bool init;
+	bool end;
+	bool read_failed;
+	uint32_t offset;			/* next compressed byte in the patch */
+	uint32_t left;				/* compressed bytes not read yet */
+	unsigned char in[BSPATCH_IN_SIZE];
+} bspatch_block_t;
+
+typedef struct _bspatch_state_t {
+	const bspatch_ops_t *ops;
+	void *ctx;
+	bspatch_block_t ctrl, diff, xtra;
+	bool zlib;				/* the blocks are zlib streams */
+	bool scratch;				/* ctrl and xtra are in the scratch space */
+	uint32_t ctrl_pos, ctrl_len;		/* in the scratch space */
+	uint32_t xtra_pos, xtra_len;
+	uint32_t out_len;
+	unsigned char old[BSPATCH_IN_SIZE];
+	unsigned char out[BSPATCH_OUT_SIZE];
+} bspatch_state_t;
+
+static void *bspatch_bzalloc(void *opaque, int items, int size)
+{
+	bspatch_state_t *st = opaque;
+
+	return st->ops->alloc(st->ctx, (uint32_t)items * size);
+}
+
+static void bspatch_bzfree(void *opaque, void *addr)
+{
+	bspatch_state_t *st = opaque;
+
+	st->ops->free(st->ctx, addr);
+}
+
+/* Reads the patch for uzlib; -1 at the end of the block, or if the read
+ * failed, which is kept for bspatch_block_decompress to tell. */
+static int bspatch_zlib_read(TINF_DATA *d)
+{
+	bspatch_block_t *b = (bspatch_block_t *)((char *)d - offsetof(bspatch_block_t, u.z));
+	uint32_t n = b->left < BSPATCH_IN_SIZE ? b->left : BSPATCH_IN_SIZE;
+
+	if (n == 0) {
+		return -1;
+	}
+	if (!b->st->ops->read_patch(b->st->ctx, b->offset, b->in, n)) {
+		b->read_failed = true;
+		return -1;
+	}
+	b->offset += n;
+	b->left -= n;
+	d->source = b->in + 1;
+	d->source_limit = b->in + n;
+	return b->in[0];
+}
+
+static int bspatch_zlib_init(bspatch_state_t *st, bspatch_block_t *b)
+{
+	TINF_DATA *d = &b->u.z;
+	uint32_t window;
+	int ret;
+
+	uzlib_init();
+	d->source = NULL;
+	d->source_limit = NULL;
+	d->source_read_cb = bspatch_zlib_read;
+	ret = uzlib_zlib_parse_header(d);
+	if (b->read_failed) {
+		return BSPATCH_ERR_READ;
+	}
+	if (ret < 0) {
+		return BSPATCH_ERR_BZIP2;
+	}
+	/* the window the stream was compressed with, which back references
+	 * may reach up to across the chunks it is decompressed in */
+	window = 1 << (ret + 8);
+	if (window > BSPATCH_ZLIB_MAX_WINDOW) {
+		return BSPATCH_ERR_BLOCK_SIZE;
+	}
+	if ((b->window = st->ops->alloc(st->ctx, window)) == NULL) {
+		return BSPATCH_ERR_NOMEM;
+	}
+	memset(b->window, 0, window);
+	uzlib_uncompress_init(d, b->window, window);
+	b->init = true;
+	return BSPATCH_OK;
+}
+
+static int bspatch_block_init(bspatch_state_t *st, bspatch_block_t *b, uint32_t offset, uint32_t len)
+{
+	unsigned char magic[4];
+
+	b->st = st;
+	b->zlib = st->zlib;
+	b->offset = offset;
+	b->left = len;
+	if (b->zlib) {
+		return bspatch_zlib_init(st, b);
+	}
+
+	b->u.bz.bzalloc = bspatch_bzalloc;
+	b->u.bz.bzfree = bspatch_bzfree;
+	b->u.bz.opaque = st;
+	/* the block size is the digit after "BZh"; anything else is left for
+	 * bzip2 to refuse */
+	if (len >= sizeof(magic)) {
+		if (!st->ops->read_patch(st->ctx, offset, magic, sizeof(magic))) {
+			return BSPATCH_ERR_READ;
+		}
+		if (memcmp(magic, "BZh", 3) == 0 && magic[3] > '0' + BSPATCH_BZIP2_MAX_BLOCK) {
+			return BSPATCH_ERR_BLOCK_SIZE;
+		}
+	}
+	/* small mode: 2.5 bytes per byte of bzip2 block instead of 4 */
+	switch (BZ2_bzDecompressInit(&b->u.bz, 0, 1)) {
+	case BZ_OK:
+		b->init = true;
+		return BSPATCH_OK;
+	case BZ_MEM_ERROR:
+		return BSPATCH_ERR_NOMEM;
+	default:
+		return BSPATCH_ERR_BZIP2;
+	}
+}
+
+static int bspatch_zlib_decompress(bspatch_block_t *b, unsigned char *dst, uint32_t len, uint32_t *got)
+{
+	TINF_DATA *d = &b->u.z;
+
+	d->dest_start = dst;
+	d->dest = dst;
+	d->dest_limit = dst + len;
+
+	while (d->dest < d->dest_limit && !b->end) {
+		int ret = uzlib_uncompress_chksum(d);
+
+		if (b->read_failed) {
+			return BSPATCH_ERR_READ;
+		}
+		if (ret == TINF_DONE) {
+			b->end = true;
+		} else if (ret != TINF_OK) {
+			/* the block is truncated, or damaged */
+			return d->eof ? BSPATCH_ERR_CORRUPT : BSPATCH_ERR_BZIP2;
+		}
+	}
+	*got = d->dest - dst;
+	return BSPATCH_OK;
+}
+
+/* Decompresses up to len bytes of a block into dst, fewer only at the end
+ * of the block; *got is set to how many. */
+static int bspatch_block_decompress(bspatch_state_t *st, bspatch_block_t *b, unsigned char *dst, uint32_t len,
+                                    uint32_t *got)
+{
+	if (b->zlib) {
+		return bspatch_zlib_decompress(b, dst, len, got);
+	}
+
+	b->u.bz.next_out = (char *)dst;
+	b->u.bz.avail_out = len;
+
+	while (b->u.bz.avail_out > 0 && !b->end) {
+		unsigned int avail_out = b->u.bz.avail_out;
+		int ret;
+
+		if (b->u.bz.avail_in == 0 && b->left > 0) {
+			uint32_t n = b->left < BSPATCH_IN_SIZE ? b->left : BSPATCH_IN_SIZE;
+			if (!st->ops->read_patch(st->ctx, b->offset, b->in, n)) {
+				return BSPATCH_ERR_READ;
+			}
+			b->u.bz.next_in = (char *)b->in;
+			b->u.bz.avail_in = n;
+			b->offset += n;
+			b->left -= n;
+		}
+
+		ret = BZ2_bzDecompress(&b->u.bz);
+		if (ret == BZ_STREAM_END) {
+			b->end = true;
+		} else if (ret == BZ_MEM_ERROR) {
+			return BSPATCH_ERR_NOMEM;
+		} else if (ret != BZ_OK) {
+			return BSPATCH_ERR_BZIP2;
+		} else if (b->u.bz.avail_in == 0 && b->left == 0 && b->u.bz.avail_out == avail_out) {
+			/* the block is truncated */
+			return BSPATCH_ERR_CORRUPT;
+		}
+	}
+	*got = len - b->u.bz.avail_out;
+	return BSPATCH_OK;
+}
+
+/* Decompresses exactly len bytes of a block into dst. */
+static int bspatch_block_read(bspatch_state_t *st, bspatch_block_t *b, unsigned char *dst, uint32_t len)
+{
+	uint32_t got;
+	int ret;
+
+	if ((ret = bspatch_block_decompress(st, b, dst, len, &got)) != BSPATCH_OK) {
+		return ret;
+	}
+	return got == len ? BSPATCH_OK : BSPATCH_ERR_CORRUPT;
+}
+
+/* Checks that a block ends where the patch is done with it, which for zlib
+ * is also where its checksum is checked. */
+static int bspatch_block_check_end(bspatch_state_t *st, bspatch_block_t *b)
+{
+	unsigned char c;
+	uint32_t got;
+	int ret;
+
+	if (!b->init || b->end) {
+		return BSPATCH_OK;
+	}
+	if ((ret = bspatch_block_decompress(st, b, &c, 1, &got)) != BSPATCH_OK) {
+		return ret;
+	}
+	return got == 0 && b->end ? BSPATCH_OK : BSPATCH_ERR_CORRUPT;
+}
+
+static void bspatch_block_end(bspatch_block_t *b)
+{
+	if (b->init && !b->zlib) {
+		BZ2_bzDecompressEnd(&b->u.bz);
+	}
+	if (b->window != NULL) {
+		b->st->ops->free(b->st->ctx, b->window);
+		b->window = NULL;
+	}
+	b->init = false;
+}
+
+/* Decompresses a whole block to the scratch space from offset on, through
+ * the output buffer, and frees its decompressor; len is set to its size. */
+static int bspatch_block_to_scratch(bspatch_state_t *st, bspatch_block_t *b, uint32_t offset,
+                                    uint32_t scratch_size, uint32_t *len)
+{
+	*len = 0;
+	while (!b->end) {
+		uint32_t n;
+		int ret;
+
+		if ((ret = bspatch_block_decompress(st, b, st->out, BSPATCH_OUT_SIZE, &n)) != BSPATCH_OK) {
+			return ret;
+		}
+		if ((uint64_t)offset + *len + n > scratch_size) {
+			return BSPATCH_ERR_SCRATCH;
+		}
+		if (n > 0 && !st->ops->write_scratch(st->ctx, offset + *len, st->out, n)) {
+			return BSPATCH_ERR_WRITE;
+		}
+		*len += n;
+	}
+	bspatch_block_end(b);
+	return BSPATCH_OK;
+}
+
+static int bspatch_read_ctrl(bspatch_state_t *st, unsigned char *dst, uint32_t len)
+{
+	if (!st->scratch) {
+		return bspatch_block_read(st, &st->ctrl, dst, len);
+	}
+	if (len > st->ctrl_len - st->ctrl_pos) {
+		return BSPATCH_ERR_CORRUPT;
+	}
+	if (!st->ops->read_scratch(st->ctx, st->ctrl_pos, dst, len)) {
+		return BSPATCH_ERR_READ;
+	}
+	st->ctrl_pos += len;
+	return BSPATCH_OK;
+}
+
+static int bspatch_read_xtra(bspatch_state_t *st, unsigned char *dst, uint32_t len)
+{
+	if (!st->scratch) {
+		return bspatch_block_read(st, &st->xtra, dst, len);
+	}
+	if (len > st->xtra_len - st->xtra_pos) {
+		return BSPATCH_ERR_CORRUPT;
+	}
+	if (!st->ops->read_scratch(st->ctx, st->ctrl_len + st->xtra_pos, dst, len)) {
+		return BSPATCH_ERR_READ;
+	}
+	st->xtra_pos += len;
+	return BSPATCH_OK;
+}
+
+static int bspatch_flush(bspatch_state_t *st)
+{
+	if (st->out_len > 0) {
+		if (!st->ops->write_new(st->ctx, st->out, st->out_len)) {
+			return BSPATCH_ERR_WRITE;
+		}
+		st->out_len = 0;
+	}
+	return BSPATCH_OK;
+}
+
+/* Adds the old file from oldpos to the len diff bytes at dst; bytes outside
+ * of the old file are left as they are. */
+static int bspatch_add_old(bspatch_state_t *st, unsigned char *dst, int64_t oldpos, uint32_t len, uint32_t old_size)
+{
+	int64_t end = oldpos + len;
+	uint32_t i;
+
+	if (oldpos < 0) {
+		dst -= oldpos;
+		oldpos = 0;
+	}
+	if (end > old_size) {
+		end = old_size;
+	}
+	while (oldpos < end) {
+		uint32_t n = (end - oldpos) < BSPATCH_IN_SIZE ? (uint32_t)(end - oldpos) : BSPATCH_IN_SIZE;
+		if (!st->ops->read_old(st->ctx, (uint32_t)oldpos, st->old, n)) {
+			return BSPATCH_ERR_READ;
+		}
+		for (i = 0; i < n; i++) {
+			dst[i] += st->old[i];
+		}
+		dst += n;
+		oldpos += n;
+	}
+	return BSPATCH_OK;
+}
+
+static int bspatch_read_header(const bspatch_ops_t *ops, void *ctx, uint32_t patch_size,
+                               uint32_t *ctrl_len, uint32_t *data_len, uint32_t *new_size, bool *zlib)
+{
+	unsigned char header[BSPATCH_HEADER_LEN];
+	int32_t ctrllen, datalen, newsize;
+
+	/* File format:
+	 *	0	8	"BSDIFF40"
+	 *	8	8	X
+	 *	16	8	Y
+	 *	24	8	sizeof(newfile)
+	 *	32	X	bzip2(control block)
+	 *	32+X	Y	bzip2(diff block)
+	 *	32+X+Y	???	bzip2(extra block)
+	 * with control block a set of triples (x,y,z) meaning "add x bytes
+	 * from oldfile to x bytes from the diff block; copy y bytes from the
+	 * extra block; seek forwards in oldfile by z bytes".  "BSDIFZ40" is
+	 * the same with zlib blocks. */
+	if (patch_size < BSPATCH_HEADER_LEN) {
+		return BSPATCH_ERR_HEADER;
+	}
+	if (!ops->read_patch(ctx, 0, header, BSPATCH_HEADER_LEN)) {
+		return BSPATCH_ERR_READ;
+	}
+	if (memcmp(header, BSPATCH_MAGIC_BZIP2, 8) == 0) {
+		*zlib = false;
+	} else if (memcmp(header, BSPATCH_MAGIC_ZLIB, 8) == 0) {
+		*zlib = true;
+	} else {
+		return BSPATCH_ERR_HEADER;
+	}
+	if (!offtin(header + 8, &ctrllen) || !offtin(header + 16, &datalen) || !offtin(header + 24, &newsize) ||
+	    ctrllen < 0 || datalen < 0 || newsize < 0 ||
+	    (uint64_t)BSPATCH_HEADER_LEN + ctrllen + datalen > patch_size) {
+		return BSPATCH_ERR_HEADER;
+	}
+	*ctrl_len = ctrllen;
+	*data_len = datalen;
+	*new_size = newsize;
+	return BSPATCH_OK;
+}
+
+int bspatch_header(const bspatch_ops_t *ops, void *ctx, uint32_t patch_size, uint32_t *new_size)
+{
+	uint32_t ctrllen, datalen;
+	bool zlib;
+
+	return bspatch_read_header(ops, ctx, patch_size, &ctrllen, &datalen, new_size, &zlib);
+}
+
+int bspatch_stream(const bspatch_ops_t *ops, void *ctx, uint32_t patch_size, uint32_t old_size,
+                   uint32_t scratch_size, uint32_t *new_size)
+{
+	unsigned char buf[24];
+	bspatch_state_t *st;
+	uint32_t ctrllen, datalen, newsize;
+	int64_t oldpos = 0, newpos = 0;
+	bool zlib;
+	int ret;
+
+	if ((ret = bspatch_read_header(ops, ctx, patch_size, &ctrllen, &datalen, &newsize, &zlib)) != BSPATCH_OK) {
+		return ret;
+	}
+
+	if ((st = ops->alloc(ctx, sizeof(*st))) == NULL) {
+		return BSPATCH_ERR_NOMEM;
+	}
+	memset(st, 0, sizeof(*st));
+	st->ops = ops;
+	st->ctx = ctx;
+	st->zlib = zlib;
+	/* zlib's state is small enough for the three blocks side by side */
+	st->scratch = !zlib && scratch_size > 0 && ops->write_scratch != NULL && ops->read_scratch != NULL;
+
+	if (st->scratch) {
+		/* one decompressor at a time: the control block, then the extra
+		 * block after it, then the diff block while patching */
+		if ((ret = bspatch_block_init(st, &st->ctrl, BSPATCH_HEADER_LEN, ctrllen)) != BSPATCH_OK ||
+		    (ret = bspatch_block_to_scratch(st, &st->ctrl, 0, scratch_size, &st->ctrl_len)) != BSPATCH_OK ||
+		    (ret = bspatch_block_init(st, &st->xtra, BSPATCH_HEADER_LEN + ctrllen + datalen,
+		                              patch_size - (BSPATCH_HEADER_LEN + ctrllen + datalen))) != BSPATCH_OK ||
+		    (ret = bspatch_block_to_scratch(st, &st->xtra, st->ctrl_len, scratch_size, &st->xtra_len)) != BSPATCH_OK ||
+		    (ret = bspatch_block_init(st, &st->diff, BSPATCH_HEADER_LEN + ctrllen, datalen)) != BSPATCH_OK) {
+			goto done;
+		}
+	} else if ((ret = bspatch_block_init(st, &st->ctrl, BSPATCH_HEADER_LEN, ctrllen)) != BSPATCH_OK ||
+	           (ret = bspatch_block_init(st, &st->diff, BSPATCH_HEADER_LEN + ctrllen, datalen)) != BSPATCH_OK ||
+	           (ret = bspatch_block_init(st, &st->xtra, BSPATCH_HEADER_LEN + ctrllen + datalen,
+	                                     patch_size - (BSPATCH_HEADER_LEN + ctrllen + datalen))) != BSPATCH_OK) {
+		goto done;
+	}
+
+	while (newpos < newsize) {
+		int64_t ctrl[3];
+		int i;
+
+		/* Read control data */
+		if ((ret = bspatch_read_ctrl(st, buf, sizeof(buf))) != BSPATCH_OK) {
+			goto done;
+		}
+		for (i = 0; i < 3; i++) {
+			int32_t v;
+			if (!offtin(buf + 8 * i, &v)) {
+				ret = BSPATCH_ERR_CORRUPT;
+				goto done;
+			}
+			ctrl[i] = v;
+		}
+
+		/* Sanity-check */
+		if (ctrl[0] < 0 || ctrl[1] < 0 || newpos + ctrl[0] + ctrl[1] > newsize) {
+			ret = BSPATCH_ERR_CORRUPT;
+			goto done;
+		}
+
+		/* Read diff string and add old data on the fly */
+		while (ctrl[0] > 0) {
+			uint32_t n = BSPATCH_OUT_SIZE - st->out_len;
+			if (n > ctrl[0]) {
+				n = ctrl[0];
+			}
+			if ((ret = bspatch_block_read(st, &st->diff, st->out + st->out_len, n)) != BSPATCH_OK ||
+			    (ret = bspatch_add_old(st, st->out + st->out_len, oldpos, n, old_size)) != BSPATCH_OK) {
+				goto done;
+			}
+			st->out_len += n;
+			if (st->out_len == BSPATCH_OUT_SIZE && (ret = bspatch_flush(st)) != BSPATCH_OK) {
+				goto done;
+			}
+			oldpos += n;
+			newpos += n;
+			ctrl[0] -= n;
+		}
+
+		/* Read extra string */
+		while (ctrl[1] > 0) {
+			uint32_t n = BSPATCH_OUT_SIZE - st->out_len;
+			if (n > ctrl[1]) {
+				n = ctrl[1];
+			}
+			if ((ret = bspatch_read_xtra(st, st->out + st->out_len, n)) != BSPATCH_OK) {
+				goto done;
+			}
+			st->out_len += n;
+			if (st->out_len == BSPATCH_OUT_SIZE && (ret = bspatch_flush(st)) != BSPATCH_OK) {
+				goto done;
+			}
+			newpos += n;
+			ctrl[1] -= n;
+		}
+
+		/* Adjust pointers */
+		oldpos += ctrl[2];
+	}
+
+	if ((ret = bspatch_block_check_end(st, &st->ctrl)) != BSPATCH_OK ||
+	    (ret = bspatch_block_check_end(st, &st->diff)) != BSPATCH_OK ||
+	    (ret = bspatch_block_check_end(st, &st->xtra)) != BSPATCH_OK) {
+		goto done;
+	}
+	if ((ret = bspatch_flush(st)) == BSPATCH_OK && new_size != NULL) {
+		*new_size = newsize;
+	}
+
+done:
+	bspatch_block_end(&st->ctrl);
+	bspatch_block_end(&st->diff);
+	bspatch_block_end(&st->xtra);
+	ops->free(ctx, st);
+	return ret;
 }
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sflash_cache.h"
+
+bool sflash_cache_init(sflash_cache_t *cache, const sflash_cache_ops_t *ops, uint32_t block_size, uint32_t sector_size, uint32_t n_blocks) {
+    memset(cache, 0, sizeof(*cache));
+    cache->ops = ops;
+    cache->block_size = block_size;
+    cache->sector_size = sector_size;
+    cache->seq_next = UINT32_MAX;
+    if (n_blocks > SFLASH_CACHE_BLOCKS) {
+        n_blocks = SFLASH_CACHE_BLOCKS;
+    }
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        // run with fewer entries if the heap is short
+        uint8_t *data = malloc(block_size);
+        if (data == NULL) {
+            break;
+        }
+        cache->entry[i].data = data;
+        cache->entry[i].addr = UINT32_MAX;
+        cache->n_entries++;
+    }
+    return cache->n_entries > 0;
+}
+
+void sflash_cache_deinit(sflash_cache_t *cache) {
+    for (uint32_t i = 0; i < cache->n_entries; i++) {
+        free(cache->entry[i].data);
+        cache->entry[i].data = NULL;
+    }
+    cache->n_entries = 0;
+}
+
+static int sflash_cache_writeback(sflash_cache_t *cache, sflash_cache_entry_t *e) {
+    if (e->dirty) {
+        if (cache->ops->write_block(e->addr, e->data) != 0) {
+            return -1;
+        }
+        e->dirty = false;
+        cache->stats.writebacks++;
+    }
+    return 0;
+}
+
+// Returns the entry holding the block at addr, loading it (if load is set)
+// into the least recently used entry when it isn't cached.
+static sflash_cache_entry_t *sflash_cache_get(sflash_cache_t *cache, uint32_t addr, bool load) {
+    sflash_cache_entry_t *victim = &cache->entry[0];
+    for (uint32_t i = 0; i < cache->n_entries; i++) {
+        sflash_cache_entry_t *e = &cache->entry[i];
+        if (e->addr == addr) {
+            cache->stats.hits++;
+            e->stamp = ++cache->stamp;
+            return e;
+        }
+        // prefer unused entries, then the oldest one
+        if (victim->addr != UINT32_MAX && (e->addr == UINT32_MAX || e->stamp < victim->stamp)) {
+            victim = e;
+        }
+    }
+    cache->stats.misses++;
+    if (victim->addr != UINT32_MAX && sflash_cache_writeback(cache, victim) != 0) {
+        return NULL;
+    }
+    victim->addr = UINT32_MAX;
+    if (load && cache->ops->read(addr, victim->data, cache->block_size) != 0) {
+        return NULL;
+    }
+    victim->addr = addr;
+    victim->stamp = ++cache->stamp;
+    return victim;
+}
+
+int sflash_cache_read(sflash_cache_t *cache, uint32_t base, uint8_t *buf, uint32_t sector, uint32_t count) {
+    uint32_t spb = cache->block_size / cache->sector_size;
+    while (count > 0) {
+        uint32_t secindex = sector % spb;
+        uint32_t n = spb - secindex;
+        if (n > count) {
+            n = count;
+        }
+        sflash_cache_entry_t *e = sflash_cache_get(cache, base + (sector / spb) * cache->block_size, true);
+        if (e == NULL) {
+            return -1;
+        }
+        memcpy(buf, &e->data[secindex * cache->sector_size], n * cache->sector_size);
+        buf += n * cache->sector_size;
+        sector += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int sflash_cache_write(sflash_cache_t *cache, uint32_t base, const uint8_t *buf, uint32_t sector, uint32_t count) {
+    uint32_t spb = cache->block_size / cache->sector_size;
+
+    // Detect sequential writes (eg a large file being written out) so that
+    // the blocks they fill don't push the FAT and directory blocks out of
+    // the cache.
+    if (sector == cache->seq_next) {
+        cache->seq_run += count;
+    } else {
+        cache->seq_run = count;
+    }
+    cache->seq_next = sector + count;
+
+    while (count > 0) {
+        uint32_t secindex = sector % spb;
+        uint32_t n = spb - secindex;
+        if (n > count) {
+            n = count;
+        }
+        // a write covering the whole block doesn't need its old contents
+        sflash_cache_entry_t *e = sflash_cache_get(cache, base + (sector / spb) * cache->block_size, n < spb);
+        if (e == NULL) {
+            return -1;
+        }
+        memcpy(&e->data[secindex * cache->sector_size], buf, n * cache->sector_size);
+        e->dirty = true;
+        if (secindex + n == spb && cache->seq_run >= spb) {
+            // the block was completed by a sequential run: write it now and
+            // make it the first candidate for replacement
+            if (sflash_cache_writeback(cache, e) != 0) {
+                return -1;
+            }
+            e->stamp = 0;
+        }
+        buf += n * cache->sector_size;
+        sector += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int sflash_cache_flush(sflash_cache_t *cache) {
+    // write back in ascending address order, selecting the lowest dirty block each time
+    for (;;) {
+        sflash_cache_entry_t *next = NULL;
+        for (uint32_t i = 0; i < cache->n_entries; i++) {
+            sflash_cache_entry_t *e = &cache->entry[i];
+            if (e->dirty && (next == NULL || e->addr < next->addr)) {
+                next = e;
+            }
+        }
+        if (next == NULL) {
+            return 0;
+        }
+        if (sflash_cache_writeback(cache, next) != 0) {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef SFLASH_CACHE_H_
+#define SFLASH_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Write-back cache of erase blocks, sitting between the FAT sector interface
+// and the SPI flash.  It has no dependency on the IDF: the flash is accessed
+// through sflash_cache_ops_t so the cache can be exercised on a host against
+// a simulated flash.
+
+#ifndef SFLASH_CACHE_BLOCKS
+#define SFLASH_CACHE_BLOCKS             (4)
+#endif
+
+// both return 0 on success; addresses are byte addresses
+typedef struct _sflash_cache_ops_t {
+    int (*read)(uint32_t addr, void *buf, uint32_t len);
+    // replaces the contents of the whole block starting at addr
+    int (*write_block)(uint32_t addr, const void *buf);
+} sflash_cache_ops_t;
+
+typedef struct _sflash_cache_entry_t {
+    uint8_t *data;
+    uint32_t addr;                  // UINT32_MAX if the entry is unused
+    uint32_t stamp;                 // last use, for LRU replacement
+    bool dirty;
+} sflash_cache_entry_t;
+
+typedef struct _sflash_cache_stats_t {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writebacks;
+} sflash_cache_stats_t;
+
+typedef struct _sflash_cache_t {
+    const sflash_cache_ops_t *ops;
+    uint32_t block_size;
+    uint32_t sector_size;
+    uint32_t n_entries;
+    uint32_t stamp;
+    uint32_t seq_next;              // sector following the last one written
+    uint32_t seq_run;               // length of the current sequential run, in sectors
+    sflash_cache_stats_t stats;
+    sflash_cache_entry_t entry[SFLASH_CACHE_BLOCKS];
+} sflash_cache_t;
+
+// Allocates up to n_blocks (at most SFLASH_CACHE_BLOCKS) block buffers;
+// returns false if not even one could be allocated.
+bool sflash_cache_init(sflash_cache_t *cache, const sflash_cache_ops_t *ops, uint32_t block_size, uint32_t sector_size, uint32_t n_blocks);
+void sflash_cache_deinit(sflash_cache_t *cache);
+
+// sector addresses are relative to base, which is the byte address of sector 0
+int sflash_cache_read(sflash_cache_t *cache, uint32_t base, uint8_t *buf, uint32_t sector, uint32_t count);
+int sflash_cache_write(sflash_cache_t *cache, uint32_t base, const uint8_t *buf, uint32_t sector, uint32_t count);
+
+// Writes back all dirty blocks, in ascending address order.
+int sflash_cache_flush(sflash_cache_t *cache);
+
+#endif /* SFLASH_CACHE_H_ */
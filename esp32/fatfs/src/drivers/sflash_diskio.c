@@ -8,6 +8,8 @@
 #include "lib/oofatfs/diskio.h"
 #include "littlefs/lfs.h"
 #include "sflash_diskio.h"
+#include "sflash_cache.h"
+#include "sflash_ftl.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -18,50 +20,121 @@
 #include "esp_flash_encrypt.h"
 #include "esp32chipinfo.h"
 
-static uint8_t *sflash_block_cache;
-static bool sflash_cache_is_dirty;
-static uint32_t sflash_prev_block_addr;
+static sflash_cache_t sflash_cache;
+#if MICROPY_PORT_SFLASH_FTL
+static sflash_ftl_t sflash_ftl;
+#endif
 static bool sflash_init_done = false;
 
 static uint32_t sflash_start_address;
 static uint32_t sflash_fs_sector_count;
+// address of sector 0 as seen by the block cache
+static uint32_t sflash_cache_base;
 
+static int sflash_read_op(uint32_t addr, void *buf, uint32_t len) {
+    return spi_flash_read_encrypted(addr, buf, len) != ESP_OK;
+}
 
-static bool sflash_write (void) {
-    esp_err_t wr_result = ESP_FAIL;
+static int sflash_erase_op(uint32_t addr) {
+    return spi_flash_erase_sector(addr / SFLASH_BLOCK_SIZE) != ESP_OK;
+}
 
-    // erase the block first
-    if (ESP_OK == spi_flash_erase_sector(sflash_prev_block_addr / SFLASH_BLOCK_SIZE)) {
-            // then write it
-            if (esp_flash_encryption_enabled()) {
-                // sflash_prev_block_addr being 4KB block address is aligned 32B
-                wr_result = spi_flash_write_encrypted(sflash_prev_block_addr, (void *)sflash_block_cache, SFLASH_BLOCK_SIZE);
-            } else {
-                wr_result = spi_flash_write(sflash_prev_block_addr, (void *)sflash_block_cache, SFLASH_BLOCK_SIZE);
-            }
+static int sflash_write_op(uint32_t addr, const void *buf, uint32_t len) {
+    if (esp_flash_encryption_enabled()) {
+        // needs 16B aligned addresses and lengths, which all writes here have
+        return spi_flash_write_encrypted(addr, buf, len) != ESP_OK;
+    } else {
+        return spi_flash_write(addr, buf, len) != ESP_OK;
     }
-    return (wr_result == ESP_OK);
 }
 
+#if MICROPY_PORT_SFLASH_FTL
+
+// with flash encryption on, erased space only reads as 0xff this way
+static int sflash_read_raw_op(uint32_t addr, void *buf, uint32_t len) {
+    return spi_flash_read(addr, buf, len) != ESP_OK;
+}
+
+static const sflash_ftl_ops_t sflash_ftl_ops = {
+    .read = sflash_read_op,
+    .erase = sflash_erase_op,
+    .write = sflash_write_op,
+    .read_raw = sflash_read_raw_op,
+};
+
+static int sflash_cache_read_op(uint32_t addr, void *buf, uint32_t len) {
+    return sflash_ftl_read(&sflash_ftl, addr, buf, len);
+}
+
+static int sflash_cache_write_block_op(uint32_t addr, const void *buf) {
+    return sflash_ftl_write_block(&sflash_ftl, addr / SFLASH_BLOCK_SIZE, buf);
+}
+
+static const sflash_cache_ops_t sflash_cache_ops = {
+    .read = sflash_cache_read_op,
+    .write_block = sflash_cache_write_block_op,
+};
+
+#else
+
+static int sflash_cache_write_block_op(uint32_t addr, const void *buf) {
+    if (sflash_erase_op(addr) != 0) {
+        return -1;
+    }
+    return sflash_write_op(addr, buf, SFLASH_BLOCK_SIZE);
+}
+
+static const sflash_cache_ops_t sflash_cache_ops = {
+    .read = sflash_read_op,
+    .write_block = sflash_cache_write_block_op,
+};
+
+#endif
+
+// the region of /flash, which is the same for FAT and LittleFS
+static void sflash_disk_init_region (void) {
+    // this is how we diferentiate flash sizes in Pycom modules
+    if (esp32_get_chip_rev() > 0) {
+        sflash_start_address = SFLASH_START_ADDR_8MB;
+        sflash_fs_sector_count = SFLASH_FS_SECTOR_COUNT_8MB;
+    } else {
+        sflash_start_address = SFLASH_START_ADDR_4MB;
+        sflash_fs_sector_count = SFLASH_FS_SECTOR_COUNT_4MB;
+    }
+    sflash_cache_base = sflash_start_address;
+}
+
+// only for a FAT /flash, the block cache and the FTL are of no use to LittleFS
 DRESULT sflash_disk_init (void) {
 
     if (!sflash_init_done) {
-        // this is how we diferentiate flash sizes in Pycom modules
-        if (esp32_get_chip_rev() > 0) {
-            sflash_start_address = SFLASH_START_ADDR_8MB;
-            sflash_fs_sector_count = SFLASH_FS_SECTOR_COUNT_8MB;
-        } else {
-            sflash_start_address = SFLASH_START_ADDR_4MB;
-            sflash_fs_sector_count = SFLASH_FS_SECTOR_COUNT_4MB;
+        sflash_disk_init_region();
+        #if MICROPY_PORT_SFLASH_FTL
+        // the FAT volume sits on the logical blocks of the FTL, which are
+        // fewer than the physical ones; without FTL metadata the region is
+        // formatted, and the FAT volume then gets recreated on mount
+        if (!sflash_ftl_init(&sflash_ftl, &sflash_ftl_ops, sflash_start_address, SFLASH_BLOCK_SIZE,
+                sflash_fs_sector_count / SFLASH_SECTORS_PER_BLOCK)) {
+            return RES_ERROR;
+        }
+        if (sflash_ftl_mount(&sflash_ftl) != 0 && sflash_ftl_format(&sflash_ftl) != 0) {
+            return RES_ERROR;
+        }
+        sflash_fs_sector_count = sflash_ftl.n_logical * SFLASH_SECTORS_PER_BLOCK;
+        sflash_cache_base = 0;
+        #endif
+        if (!sflash_cache_init(&sflash_cache, &sflash_cache_ops, SFLASH_BLOCK_SIZE, SFLASH_FS_SECTOR_SIZE, SFLASH_CACHE_BLOCKS)) {
+            return RES_ERROR;
         }
-        sflash_block_cache = (uint8_t *)malloc(SFLASH_BLOCK_SIZE);
-        sflash_prev_block_addr = UINT32_MAX;
-        sflash_cache_is_dirty = false;
         sflash_init_done = true;
     }
     return RES_OK;
 }
 
+void sflash_disk_init_littlefs (void) {
+    sflash_disk_init_region();
+}
+
 DRESULT sflash_disk_status(void) {
     if (!sflash_init_done) {
         return STA_NOINIT;
@@ -70,8 +143,6 @@ DRESULT sflash_disk_status(void) {
 }
 
 DRESULT sflash_disk_read(BYTE *buff, DWORD sector, UINT count) {
-    uint32_t secindex;
-
     if ((sector + count > sflash_fs_sector_count) || !count) {
         // TODO sl_LockObjLock (&flash_LockObj, SL_OS_WAIT_FOREVER);
         sflash_disk_flush();
@@ -80,34 +151,12 @@ DRESULT sflash_disk_read(BYTE *buff, DWORD sector, UINT count) {
     }
 
     // TODO sl_LockObjLock (&flash_LockObj, SL_OS_WAIT_FOREVER);
-    for (int index = 0; index < count; index++) {
-        secindex = (sector + index) % SFLASH_SECTORS_PER_BLOCK;
-        uint32_t sflash_block_addr = sflash_start_address + (((sector + index) / SFLASH_SECTORS_PER_BLOCK) * SFLASH_BLOCK_SIZE);
-        // Check if it's a different block than last time
-        if (sflash_prev_block_addr != sflash_block_addr) {
-            if (sflash_disk_flush() != RES_OK) {
-                // TODO sl_LockObjUnlock (&flash_LockObj);
-                return RES_ERROR;
-            }
-            sflash_prev_block_addr = sflash_block_addr;
-            if (ESP_OK != spi_flash_read_encrypted(sflash_block_addr, (void *)sflash_block_cache, SFLASH_BLOCK_SIZE)) {
-                // TODO sl_LockObjUnlock (&flash_LockObj);
-                return RES_ERROR;
-            }
-        }
-        // Copy the requested sector from the block cache
-        memcpy (buff, (void *)&sflash_block_cache[secindex * SFLASH_FS_SECTOR_SIZE], SFLASH_FS_SECTOR_SIZE);
-        buff += SFLASH_FS_SECTOR_SIZE;
-    }
-
+    int ret = sflash_cache_read(&sflash_cache, sflash_cache_base, buff, sector, count);
     // TODO sl_LockObjUnlock (&flash_LockObj);
-    return RES_OK;
+    return ret == 0 ? RES_OK : RES_ERROR;
 }
 
 DRESULT sflash_disk_write(const BYTE *buff, DWORD sector, UINT count) {
-    uint32_t secindex;
-    uint32_t index = 0;
-
     if ((sector + count > sflash_fs_sector_count) || !count) {
         // TODO sl_LockObjLock (&flash_LockObj, SL_OS_WAIT_FOREVER);
         sflash_disk_flush();
@@ -116,40 +165,20 @@ DRESULT sflash_disk_write(const BYTE *buff, DWORD sector, UINT count) {
     }
 
     // TODO sl_LockObjLock (&flash_LockObj, SL_OS_WAIT_FOREVER);
-    do {
-        secindex = (sector + index) % SFLASH_SECTORS_PER_BLOCK;
-        uint32_t sflash_block_addr = sflash_start_address + (((sector + index) / SFLASH_SECTORS_PER_BLOCK) * SFLASH_BLOCK_SIZE);
-        // Check if it's a different block than last time
-        if (sflash_prev_block_addr != sflash_block_addr) {
-            if (sflash_disk_flush() != RES_OK) {
-                // TODO sl_LockObjUnlock (&flash_LockObj);
-                return RES_ERROR;
-            }
-            sflash_prev_block_addr = sflash_block_addr;
-            if (ESP_OK != spi_flash_read_encrypted(sflash_block_addr, (void *)sflash_block_cache, SFLASH_BLOCK_SIZE)) {
-//                // TODO sl_LockObjUnlock (&flash_LockObj);
-                return RES_ERROR;
-            }
-        }
-        // copy the input sector to the block cache
-        memcpy ((void *)&sflash_block_cache[secindex * SFLASH_FS_SECTOR_SIZE], buff, SFLASH_FS_SECTOR_SIZE);
-        buff += SFLASH_FS_SECTOR_SIZE;
-        sflash_cache_is_dirty = true;
-    } while (++index < count);
-
+    int ret = sflash_cache_write(&sflash_cache, sflash_cache_base, buff, sector, count);
     // TODO sl_LockObjUnlock (&flash_LockObj);
-    return RES_OK;
+    return ret == 0 ? RES_OK : RES_ERROR;
 }
 
-int sflash_disk_read_littlefs(const struct lfs_config *lfscfg, void* buff, uint32_t block, uint32_t size)
+int sflash_disk_read_littlefs(const struct lfs_config *lfscfg, void* buff, uint32_t block, uint32_t off, uint32_t size)
 {
     // TODO sl_LockObjLock (&flash_LockObj, SL_OS_WAIT_FOREVER);
     int ret = LFS_ERR_OK;
 
-    if(block >= lfscfg->block_count) {
+    if(block >= lfscfg->block_count || off + size > SFLASH_BLOCK_SIZE) {
         ret = LFS_ERR_IO;
     }
-    else if (ESP_OK != spi_flash_read(sflash_start_address + block*SFLASH_BLOCK_SIZE, buff, size)) {
+    else if (ESP_OK != spi_flash_read(sflash_start_address + block*SFLASH_BLOCK_SIZE + off, buff, size)) {
         ret = LFS_ERR_IO;
     }
 
@@ -173,15 +202,15 @@ int sflash_disk_erase_littlefs(const struct lfs_config *lfscfg, uint32_t block)
     return ret;
 }
 
-int sflash_disk_write_littlefs(const struct lfs_config *lfscfg, const void *buff, uint32_t block, uint32_t size) {
+int sflash_disk_write_littlefs(const struct lfs_config *lfscfg, const void *buff, uint32_t block, uint32_t off, uint32_t size) {
 
     // TODO sl_LockObjLock (&flash_LockObj, SL_OS_WAIT_FOREVER);
     int ret = LFS_ERR_OK;
 
-    if(block >= lfscfg->block_count) {
+    if(block >= lfscfg->block_count || off + size > SFLASH_BLOCK_SIZE) {
         ret = LFS_ERR_IO;
     }
-    else if(ESP_OK != spi_flash_write((sflash_start_address + block*SFLASH_BLOCK_SIZE), buff, size)) {
+    else if(ESP_OK != spi_flash_write((sflash_start_address + block*SFLASH_BLOCK_SIZE + off), buff, size)) {
         ret = LFS_ERR_IO;
     }
 
@@ -190,12 +219,9 @@ int sflash_disk_write_littlefs(const struct lfs_config *lfscfg, const void *buff
 }
 
 DRESULT sflash_disk_flush (void) {
-    // write back the cache if it's dirty
-    if (sflash_cache_is_dirty) {
-        if (!sflash_write()) {
-            return RES_ERROR;
-        }
-        sflash_cache_is_dirty = false;
+    // write back all dirty blocks
+    if (sflash_init_done && sflash_cache_flush(&sflash_cache) != 0) {
+        return RES_ERROR;
     }
     return RES_OK;
 }
@@ -203,3 +229,14 @@ DRESULT sflash_disk_flush (void) {
 uint32_t sflash_get_sector_count(void) {
     return sflash_fs_sector_count;
 }
+
+#if MICROPY_PORT_SFLASH_FTL
+bool sflash_disk_get_ftl_stats(sflash_ftl_stats_t *stats) {
+    // there's no FTL under a LittleFS /flash
+    if (!sflash_init_done) {
+        return false;
+    }
+    sflash_ftl_get_stats(&sflash_ftl, stats);
+    return true;
+}
+#endif
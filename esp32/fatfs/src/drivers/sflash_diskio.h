@@ -8,6 +8,7 @@
 #include "nvs_flash.h"
 #include "ff.h"
 #include "littlefs/lfs.h"
+#include "sflash_ftl.h"
 
 #include "mpconfigport.h"
 
@@ -28,14 +29,18 @@
 #define SFLASH_END_BLOCK_8MB            (SFLASH_START_BLOCK_8MB + (SFLASH_BLOCK_COUNT - 1))
 
 DRESULT sflash_disk_init(void);
+void sflash_disk_init_littlefs(void);
 DRESULT sflash_disk_status(void);
 DRESULT sflash_disk_read(BYTE *buff, DWORD sector, UINT count);
 DRESULT sflash_disk_write(const BYTE *buff, DWORD sector, UINT count);
 DRESULT sflash_disk_flush(void);
 uint32_t sflash_get_sector_count(void);
+#if MICROPY_PORT_SFLASH_FTL
+bool sflash_disk_get_ftl_stats(sflash_ftl_stats_t *stats);
+#endif
 
-extern int sflash_disk_read_littlefs(const struct lfs_config *lfscfg, void* buff, uint32_t block, uint32_t size);
-extern int sflash_disk_write_littlefs(const struct lfs_config *lfscfg, const void* buff, uint32_t block, uint32_t size);
+extern int sflash_disk_read_littlefs(const struct lfs_config *lfscfg, void* buff, uint32_t block, uint32_t off, uint32_t size);
+extern int sflash_disk_write_littlefs(const struct lfs_config *lfscfg, const void* buff, uint32_t block, uint32_t off, uint32_t size);
 extern int sflash_disk_erase_littlefs(const struct lfs_config *lfscfg, uint32_t block);
 
 #endif /* SFLASH_DISKIO_H_ */
@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sflash_ftl.h"
+
+#define FTL_MAGIC               (0x4c544650)    // "PFTL"
+#define FTL_HEADER_SIZE         (sizeof(ftl_header_t))
+#define FTL_RECORD_SIZE         (sizeof(ftl_record_t))
+#define FTL_MIN_LOG_RECORDS     (128)
+#define FTL_CHUNK               (256)
+
+// Slot layout: header, one ftl_entry_t per data block, then the record log.
+// All writes are multiples of 16 bytes at 16-byte aligned offsets, as
+// required for writes to encrypted flash.
+typedef struct _ftl_header_t {
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t n_data;
+    uint16_t n_logical;
+    uint32_t body_crc;
+    uint32_t reserved[3];
+    uint32_t crc;
+} ftl_header_t;
+
+typedef struct _ftl_entry_t {
+    uint16_t owner;
+    uint16_t reserved;
+    uint32_t erase_count;
+} ftl_entry_t;
+
+typedef struct _ftl_record_t {
+    uint32_t seq;
+    uint16_t logical;
+    uint16_t physical;
+    uint32_t erase_count;
+    uint32_t crc;
+} ftl_record_t;
+
+static uint32_t ftl_crc32(uint32_t crc, const void *data, uint32_t len) {
+    const uint8_t *p = data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t ftl_log_start(const sflash_ftl_t *ftl) {
+    uint32_t pos = FTL_HEADER_SIZE + ftl->n_data * sizeof(ftl_entry_t);
+    return (pos + FTL_RECORD_SIZE - 1) / FTL_RECORD_SIZE * FTL_RECORD_SIZE;
+}
+
+static uint32_t ftl_slot_addr(const sflash_ftl_t *ftl, int slot) {
+    return ftl->base + slot * ftl->slot_blocks * ftl->block_size;
+}
+
+static uint32_t ftl_data_addr(const sflash_ftl_t *ftl, uint32_t phys) {
+    return ftl->base + (2 * ftl->slot_blocks + phys) * ftl->block_size;
+}
+
+bool sflash_ftl_init(sflash_ftl_t *ftl, const sflash_ftl_ops_t *ops, uint32_t base, uint32_t block_size, uint32_t n_blocks) {
+    memset(ftl, 0, sizeof(*ftl));
+    ftl->ops = ops;
+    ftl->base = base;
+    ftl->block_size = block_size;
+
+    // size the slots for the snapshot of all blocks plus a minimum log
+    uint32_t slot_bytes = FTL_HEADER_SIZE + n_blocks * sizeof(ftl_entry_t) + FTL_MIN_LOG_RECORDS * FTL_RECORD_SIZE;
+    ftl->slot_blocks = (slot_bytes + block_size - 1) / block_size;
+    if (n_blocks <= 2u * ftl->slot_blocks + SFLASH_FTL_SPARE_BLOCKS || n_blocks >= SFLASH_FTL_UNMAPPED) {
+        return false;
+    }
+    ftl->n_data = n_blocks - 2 * ftl->slot_blocks;
+    ftl->n_logical = ftl->n_data - SFLASH_FTL_SPARE_BLOCKS;
+
+    ftl->map = malloc(ftl->n_logical * sizeof(uint16_t));
+    ftl->owner = malloc(ftl->n_data * sizeof(uint16_t));
+    ftl->erase_count = malloc(ftl->n_data * sizeof(uint32_t));
+    if (ftl->map == NULL || ftl->owner == NULL || ftl->erase_count == NULL) {
+        sflash_ftl_deinit(ftl);
+        return false;
+    }
+    return true;
+}
+
+void sflash_ftl_deinit(sflash_ftl_t *ftl) {
+    free(ftl->map);
+    free(ftl->owner);
+    free(ftl->erase_count);
+    ftl->map = NULL;
+    ftl->owner = NULL;
+    ftl->erase_count = NULL;
+}
+
+static void ftl_apply(sflash_ftl_t *ftl, uint32_t logical, uint32_t phys) {
+    uint16_t old = ftl->map[logical];
+    if (old != SFLASH_FTL_UNMAPPED) {
+        ftl->owner[old] = SFLASH_FTL_UNMAPPED;
+    }
+    ftl->map[logical] = phys;
+    ftl->owner[phys] = logical;
+}
+
+// Reads the snapshot in a slot into the RAM tables; returns its header
+// sequence number, or -1 if the slot doesn't hold a valid snapshot.
+static int64_t ftl_load_slot(sflash_ftl_t *ftl, int slot) {
+    ftl_header_t hdr;
+    uint32_t addr = ftl_slot_addr(ftl, slot);
+    if (ftl->ops->read(addr, &hdr, sizeof(hdr)) != 0
+        || hdr.magic != FTL_MAGIC || hdr.n_data != ftl->n_data || hdr.n_logical != ftl->n_logical
+        || hdr.crc != ftl_crc32(0, &hdr, offsetof(ftl_header_t, crc))) {
+        return -1;
+    }
+    uint32_t crc = 0;
+    addr += FTL_HEADER_SIZE;
+    for (uint32_t i = 0; i < ftl->n_logical; i++) {
+        ftl->map[i] = SFLASH_FTL_UNMAPPED;
+    }
+    for (uint32_t i = 0; i < ftl->n_data; i++, addr += sizeof(ftl_entry_t)) {
+        ftl_entry_t e;
+        if (ftl->ops->read(addr, &e, sizeof(e)) != 0) {
+            return -1;
+        }
+        crc = ftl_crc32(crc, &e, sizeof(e));
+        ftl->owner[i] = SFLASH_FTL_UNMAPPED;
+        ftl->erase_count[i] = e.erase_count;
+        if (e.owner < ftl->n_logical) {
+            ftl_apply(ftl, e.owner, i);
+        }
+    }
+    if (crc != hdr.body_crc) {
+        return -1;
+    }
+    return hdr.seq;
+}
+
+int sflash_ftl_mount(sflash_ftl_t *ftl) {
+    // use the valid slot with the newest snapshot
+    int64_t seq0 = ftl_load_slot(ftl, 0);
+    int64_t seq1 = ftl_load_slot(ftl, 1);
+    if (seq0 < 0 && seq1 < 0) {
+        return -1;
+    }
+    ftl->slot = seq1 > seq0;
+    ftl->seq = ftl_load_slot(ftl, ftl->slot);
+
+    // Replay the records appended since the snapshot, up to the erased end
+    // of the log.  Records torn by a power failure are skipped: appending
+    // carries on after them.
+    uint32_t slot_end = ftl->slot_blocks * ftl->block_size;
+    uint32_t addr = ftl_slot_addr(ftl, ftl->slot);
+    for (ftl->log_pos = ftl_log_start(ftl); ftl->log_pos + FTL_RECORD_SIZE <= slot_end; ftl->log_pos += FTL_RECORD_SIZE) {
+        ftl_record_t rec;
+        if (ftl->ops->read(addr + ftl->log_pos, &rec, sizeof(rec)) != 0) {
+            return -1;
+        }
+        if (rec.crc != ftl_crc32(0, &rec, offsetof(ftl_record_t, crc)) || rec.seq != ftl->seq + 1
+            || (rec.logical >= ftl->n_logical && rec.logical != SFLASH_FTL_UNMAPPED) || rec.physical >= ftl->n_data) {
+            // erased space only reads as 0xff without decryption
+            if (ftl->ops->read_raw != NULL && ftl->ops->read_raw(addr + ftl->log_pos, &rec, sizeof(rec)) != 0) {
+                return -1;
+            }
+            const uint8_t *p = (const uint8_t*)&rec;
+            uint32_t i = 0;
+            while (i < sizeof(rec) && p[i] == 0xff) {
+                i++;
+            }
+            if (i == sizeof(rec)) {
+                break;
+            }
+            continue;
+        }
+        ftl->seq = rec.seq;
+        ftl->erase_count[rec.physical] = rec.erase_count;
+        if (rec.logical != SFLASH_FTL_UNMAPPED) {
+            ftl_apply(ftl, rec.logical, rec.physical);
+        }
+    }
+    return 0;
+}
+
+// Writes a snapshot of the current state to the inactive slot and makes it
+// the active one.  The active slot stays valid until the new header is
+// written, which is the last step.
+static int ftl_write_snapshot(sflash_ftl_t *ftl) {
+    int slot = ftl->slot ^ 1;
+    uint32_t addr = ftl_slot_addr(ftl, slot);
+    for (uint32_t i = 0; i < ftl->slot_blocks; i++) {
+        if (ftl->ops->erase(addr + i * ftl->block_size) != 0) {
+            return -1;
+        }
+    }
+    ftl_entry_t chunk[FTL_CHUNK / sizeof(ftl_entry_t)];
+    uint32_t crc = 0;
+    uint32_t pos = addr + FTL_HEADER_SIZE;
+    for (uint32_t i = 0; i < ftl->n_data;) {
+        uint32_t n = 0;
+        memset(chunk, 0xff, sizeof(chunk));
+        for (; n < sizeof(chunk) / sizeof(chunk[0]) && i < ftl->n_data; n++, i++) {
+            chunk[n].owner = ftl->owner[i];
+            chunk[n].reserved = 0xffff;
+            chunk[n].erase_count = ftl->erase_count[i];
+        }
+        crc = ftl_crc32(crc, chunk, n * sizeof(ftl_entry_t));
+        // the last chunk is padded with 0xff, which stays in front of the log
+        if (ftl->ops->write(pos, chunk, (n * sizeof(ftl_entry_t) + 15) & ~15) != 0) {
+            return -1;
+        }
+        pos += n * sizeof(ftl_entry_t);
+    }
+    ftl_header_t hdr = {
+        .magic = FTL_MAGIC,
+        .seq = ftl->seq + 1,
+        .n_data = ftl->n_data,
+        .n_logical = ftl->n_logical,
+        .body_crc = crc,
+        .reserved = {0xffffffff, 0xffffffff, 0xffffffff},
+    };
+    hdr.crc = ftl_crc32(0, &hdr, offsetof(ftl_header_t, crc));
+    if (ftl->ops->write(addr, &hdr, sizeof(hdr)) != 0) {
+        return -1;
+    }
+    ftl->slot = slot;
+    ftl->seq = hdr.seq;
+    ftl->log_pos = ftl_log_start(ftl);
+    return 0;
+}
+
+int sflash_ftl_format(sflash_ftl_t *ftl) {
+    for (uint32_t i = 0; i < ftl->n_logical; i++) {
+        ftl->map[i] = SFLASH_FTL_UNMAPPED;
+    }
+    for (uint32_t i = 0; i < ftl->n_data; i++) {
+        ftl->owner[i] = SFLASH_FTL_UNMAPPED;
+        ftl->erase_count[i] = 0;
+    }
+    // invalidate any old metadata in slot 1, then write the new snapshot,
+    // which goes to slot 0 as that is the inactive one
+    ftl->slot = 1;
+    ftl->seq = 0;
+    if (ftl->ops->erase(ftl_slot_addr(ftl, 1)) != 0) {
+        return -1;
+    }
+    return ftl_write_snapshot(ftl);
+}
+
+int sflash_ftl_read(sflash_ftl_t *ftl, uint32_t addr, void *buf, uint32_t len) {
+    uint8_t *dest = buf;
+    while (len > 0) {
+        uint32_t block = addr / ftl->block_size;
+        uint32_t offset = addr % ftl->block_size;
+        uint32_t n = ftl->block_size - offset;
+        if (n > len) {
+            n = len;
+        }
+        if (block >= ftl->n_logical) {
+            return -1;
+        }
+        uint16_t phys = ftl->map[block];
+        if (phys == SFLASH_FTL_UNMAPPED) {
+            memset(dest, 0xff, n);
+        } else if (ftl->ops->read(ftl_data_addr(ftl, phys) + offset, dest, n) != 0) {
+            return -1;
+        }
+        dest += n;
+        addr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Appends a record that maps logical to phys, compacting the log first if
+// it's full.  With logical SFLASH_FTL_UNMAPPED the record only holds the
+// erase count of phys.
+static int ftl_commit(sflash_ftl_t *ftl, uint32_t logical, uint32_t phys) {
+    if (ftl->log_pos + FTL_RECORD_SIZE > ftl->slot_blocks * ftl->block_size) {
+        // the new snapshot includes the mapping, so no record is needed
+        if (logical != SFLASH_FTL_UNMAPPED) {
+            ftl_apply(ftl, logical, phys);
+        }
+        return ftl_write_snapshot(ftl);
+    }
+    ftl_record_t rec = {
+        .seq = ftl->seq + 1,
+        .logical = logical,
+        .physical = phys,
+        .erase_count = ftl->erase_count[phys],
+    };
+    rec.crc = ftl_crc32(0, &rec, offsetof(ftl_record_t, crc));
+    uint32_t addr = ftl_slot_addr(ftl, ftl->slot) + ftl->log_pos;
+    // never program the same place twice, even if this write fails
+    ftl->log_pos += FTL_RECORD_SIZE;
+    if (ftl->ops->write(addr, &rec, sizeof(rec)) != 0) {
+        return -1;
+    }
+    ftl->seq = rec.seq;
+    if (logical != SFLASH_FTL_UNMAPPED) {
+        ftl_apply(ftl, logical, phys);
+    }
+    return 0;
+}
+
+// Returns the free data block with the lowest (or highest) erase count.
+static uint32_t ftl_find_free(const sflash_ftl_t *ftl, bool most_worn) {
+    uint32_t best = SFLASH_FTL_UNMAPPED;
+    for (uint32_t i = 0; i < ftl->n_data; i++) {
+        if (ftl->owner[i] == SFLASH_FTL_UNMAPPED
+            && (best == SFLASH_FTL_UNMAPPED
+                || (most_worn ? ftl->erase_count[i] > ftl->erase_count[best] : ftl->erase_count[i] < ftl->erase_count[best]))) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// The new erase count is logged first: a power failure after the erase
+// can't lose it, and the free block choice only goes by counts on flash.
+static int ftl_erase_data(sflash_ftl_t *ftl, uint32_t phys) {
+    ftl->erase_count[phys]++;
+    if (ftl_commit(ftl, SFLASH_FTL_UNMAPPED, phys) != 0) {
+        ftl->erase_count[phys]--;
+        return -1;
+    }
+    return ftl->ops->erase(ftl_data_addr(ftl, phys));
+}
+
+// Static wear levelling: if the least worn mapped block lags far behind,
+// move its (presumably cold) data to the most worn free block so that the
+// little-worn block goes back into circulation.
+static int ftl_level(sflash_ftl_t *ftl) {
+    uint32_t cold = SFLASH_FTL_UNMAPPED;
+    for (uint32_t i = 0; i < ftl->n_data; i++) {
+        if (ftl->owner[i] != SFLASH_FTL_UNMAPPED && (cold == SFLASH_FTL_UNMAPPED || ftl->erase_count[i] < ftl->erase_count[cold])) {
+            cold = i;
+        }
+    }
+    uint32_t dest = ftl_find_free(ftl, true);
+    if (cold == SFLASH_FTL_UNMAPPED || ftl->erase_count[dest] < ftl->erase_count[cold] + SFLASH_FTL_WL_THRESHOLD) {
+        return 0;
+    }
+    if (ftl_erase_data(ftl, dest) != 0) {
+        return -1;
+    }
+    uint8_t chunk[FTL_CHUNK];
+    for (uint32_t off = 0; off < ftl->block_size; off += sizeof(chunk)) {
+        if (ftl->ops->read(ftl_data_addr(ftl, cold) + off, chunk, sizeof(chunk)) != 0
+            || ftl->ops->write(ftl_data_addr(ftl, dest) + off, chunk, sizeof(chunk)) != 0) {
+            return -1;
+        }
+    }
+    return ftl_commit(ftl, ftl->owner[cold], dest);
+}
+
+int sflash_ftl_write_block(sflash_ftl_t *ftl, uint32_t block, const void *data) {
+    if (block >= ftl->n_logical) {
+        return -1;
+    }
+    // data goes to a fresh block, then the remapping is committed; until
+    // then the old copy is still the current one
+    uint32_t phys = ftl_find_free(ftl, false);
+    if (ftl_erase_data(ftl, phys) != 0
+        || ftl->ops->write(ftl_data_addr(ftl, phys), data, ftl->block_size) != 0
+        || ftl_commit(ftl, block, phys) != 0) {
+        return -1;
+    }
+    if (++ftl->writes % SFLASH_FTL_WL_INTERVAL == 0) {
+        return ftl_level(ftl);
+    }
+    return 0;
+}
+
+void sflash_ftl_get_stats(const sflash_ftl_t *ftl, sflash_ftl_stats_t *stats) {
+    stats->min_erases = UINT32_MAX;
+    stats->max_erases = 0;
+    stats->total_erases = 0;
+    stats->n_blocks = ftl->n_data;
+    stats->erase_counts = ftl->erase_count;
+    for (uint32_t i = 0; i < ftl->n_data; i++) {
+        uint32_t n = ftl->erase_count[i];
+        stats->min_erases = n < stats->min_erases ? n : stats->min_erases;
+        stats->max_erases = n > stats->max_erases ? n : stats->max_erases;
+        stats->total_erases += n;
+    }
+}
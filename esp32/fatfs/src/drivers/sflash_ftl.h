@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef SFLASH_FTL_H_
+#define SFLASH_FTL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Flash translation layer with wear levelling for the FAT volume.
+//
+// Logical blocks are remapped to physical blocks: every write of a logical
+// block goes to the least worn free block and the old copy becomes free.
+// The mapping is kept in two metadata slots at the start of the region.  Each
+// slot has a snapshot of the map and erase counts followed by a log of
+// remapping records; a record is only appended after the new data has been
+// programmed, and a snapshot header is only written after its body, so after
+// a power failure the last complete state is recovered on mount.  The erase
+// count of a block is logged before the block is erased, so the counts never
+// go back.  Rarely
+// written blocks are moved from time to time so that their little-worn
+// physical blocks take a share of the erases too.
+
+#ifndef SFLASH_FTL_SPARE_BLOCKS
+#define SFLASH_FTL_SPARE_BLOCKS         (4)
+#endif
+
+// how often (in block writes) to look for a cold block to move, and the
+// difference in erase counts that makes it worth moving
+#ifndef SFLASH_FTL_WL_INTERVAL
+#define SFLASH_FTL_WL_INTERVAL          (64)
+#endif
+#ifndef SFLASH_FTL_WL_THRESHOLD
+#define SFLASH_FTL_WL_THRESHOLD         (16)
+#endif
+
+#define SFLASH_FTL_UNMAPPED             (0xffff)
+
+// raw flash access; byte addresses, 0 on success
+typedef struct _sflash_ftl_ops_t {
+    int (*read)(uint32_t addr, void *buf, uint32_t len);
+    int (*erase)(uint32_t addr);    // erases the block starting at addr
+    int (*write)(uint32_t addr, const void *buf, uint32_t len);
+    // reads the flash as stored, without decryption, to tell erased space
+    // (all 0xff) when read() decrypts; NULL if read() doesn't
+    int (*read_raw)(uint32_t addr, void *buf, uint32_t len);
+} sflash_ftl_ops_t;
+
+typedef struct _sflash_ftl_t {
+    const sflash_ftl_ops_t *ops;
+    uint32_t base;                  // address of the first block of the region
+    uint32_t block_size;
+    uint16_t n_data;                // physical blocks holding data
+    uint16_t n_logical;
+    uint16_t slot_blocks;           // blocks per metadata slot
+    uint8_t slot;                   // active metadata slot
+    uint32_t seq;                   // sequence number of the last record written
+    uint32_t log_pos;               // offset of the next record in the active slot
+    uint32_t writes;
+    uint16_t *map;                  // logical -> data block
+    uint16_t *owner;                // data block -> logical, or SFLASH_FTL_UNMAPPED
+    uint32_t *erase_count;          // per data block
+} sflash_ftl_t;
+
+typedef struct _sflash_ftl_stats_t {
+    uint32_t min_erases;
+    uint32_t max_erases;
+    uint32_t total_erases;
+    uint32_t n_blocks;
+    const uint32_t *erase_counts;   // per data block, n_blocks of them, owned by the FTL
+} sflash_ftl_stats_t;
+
+// Sets up an FTL over n_blocks blocks starting at base.  Returns false if
+// the region is too small or memory can't be allocated.
+bool sflash_ftl_init(sflash_ftl_t *ftl, const sflash_ftl_ops_t *ops, uint32_t base, uint32_t block_size, uint32_t n_blocks);
+void sflash_ftl_deinit(sflash_ftl_t *ftl);
+
+// Loads the mapping from flash; returns -1 if there is no valid metadata.
+int sflash_ftl_mount(sflash_ftl_t *ftl);
+// Writes fresh metadata with all logical blocks unmapped (reading as 0xff).
+int sflash_ftl_format(sflash_ftl_t *ftl);
+
+// addr is a logical byte address
+int sflash_ftl_read(sflash_ftl_t *ftl, uint32_t addr, void *buf, uint32_t len);
+// writes a whole logical block
+int sflash_ftl_write_block(sflash_ftl_t *ftl, uint32_t block, const void *data);
+
+void sflash_ftl_get_stats(const sflash_ftl_t *ftl, sflash_ftl_stats_t *stats);
+
+#endif /* SFLASH_FTL_H_ */
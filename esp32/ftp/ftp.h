@@ -16,7 +16,7 @@ extern void stoupper (char *str);
  DECLARE EXPORTED FUNCTIONS
  ******************************************************************************/
 extern void ftp_init (void);
-extern void ftp_run (void);
+extern bool ftp_run (void);
 extern void ftp_enable (void);
 extern void ftp_disable (void);
 extern void ftp_reset (void);
@@ -0,0 +1,854 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "ftp_server.h"
+
+/******************************************************************************
+ DEFINE PRIVATE CONSTANTS
+ ******************************************************************************/
+// buffers moved through a data connection per session and pass of the loop
+#define FTP_SERVER_BURST                    (4)
+
+/******************************************************************************
+ DEFINE PRIVATE TYPES
+ ******************************************************************************/
+typedef enum {
+    E_FTP_XFER_NONE = 0,
+    E_FTP_XFER_LIST,
+    E_FTP_XFER_RETR,
+    E_FTP_XFER_STOR,
+} ftp_xfer_t;
+
+typedef enum {
+    E_FTP_CMD_NOT_SUPPORTED = -1,
+    E_FTP_CMD_FEAT = 0,
+    E_FTP_CMD_SYST,
+    E_FTP_CMD_CDUP,
+    E_FTP_CMD_CWD,
+    E_FTP_CMD_PWD,
+    E_FTP_CMD_XPWD,
+    E_FTP_CMD_SIZE,
+    E_FTP_CMD_MDTM,
+    E_FTP_CMD_TYPE,
+    E_FTP_CMD_USER,
+    E_FTP_CMD_PASS,
+    E_FTP_CMD_PASV,
+    E_FTP_CMD_LIST,
+    E_FTP_CMD_RETR,
+    E_FTP_CMD_STOR,
+    E_FTP_CMD_DELE,
+    E_FTP_CMD_RMD,
+    E_FTP_CMD_MKD,
+    E_FTP_CMD_RNFR,
+    E_FTP_CMD_RNTO,
+    E_FTP_CMD_NOOP,
+    E_FTP_CMD_QUIT,
+    E_FTP_NUM_FTP_CMDS
+} ftp_cmd_index_t;
+
+/******************************************************************************
+ DECLARE PRIVATE DATA
+ ******************************************************************************/
+static const char ftp_cmd_table[E_FTP_NUM_FTP_CMDS][5] = {
+    "FEAT", "SYST", "CDUP", "CWD",  "PWD",  "XPWD", "SIZE", "MDTM",
+    "TYPE", "USER", "PASS", "PASV", "LIST", "RETR", "STOR", "DELE",
+    "RMD",  "MKD",  "RNFR", "RNTO", "NOOP", "QUIT"
+};
+
+static const char ftp_month[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static bool ftp_server_would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static void ftp_server_close_socket(ftp_server_t *srv, int *sd) {
+    if (*sd >= 0) {
+        srv->ops->socket_close(*sd);
+        *sd = -1;
+    }
+}
+
+static void ftp_server_set_non_blocking(int sd) {
+    int option = fcntl(sd, F_GETFL, 0);
+    fcntl(sd, F_SETFL, option | O_NONBLOCK);
+}
+
+static int ftp_server_listen(ftp_server_t *srv, uint16_t port, int backlog) {
+    struct sockaddr_in addr;
+    int option = 1;
+    int sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sd < 0) {
+        return -1;
+    }
+    srv->ops->socket_add(sd);
+    ftp_server_set_non_blocking(sd);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) != 0
+        || bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(sd, backlog) != 0) {
+        ftp_server_close_socket(srv, &sd);
+    }
+    return sd;
+}
+
+static int ftp_server_accept(ftp_server_t *srv, int l_sd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int sd = accept(l_sd, (struct sockaddr *)&addr, &addr_len);
+    if (sd >= 0) {
+        srv->ops->socket_add(sd);
+        ftp_server_set_non_blocking(sd);
+    }
+    return sd;
+}
+
+static void ftp_server_reply(ftp_server_session_t *s, uint32_t code, const char *message) {
+    int space = sizeof(s->reply) - s->reply_len;
+    int n = snprintf(&s->reply[s->reply_len], space, "%u %s\r\n", (unsigned)code, message ? message : "");
+    if (n >= space) {
+        // a message too long for the buffer (a long path) is cut short
+        n = space - 1;
+        memcpy(&s->reply[sizeof(s->reply) - 3], "\r\n", 2);
+    }
+    s->reply_len += n;
+}
+
+// Builds into out the absolute form of path, taken relative to cwd unless it
+// starts with a '/', resolving "." and ".." components.  out has no trailing
+// '/' except for the root.  Returns false if the result is too long.
+static bool ftp_server_append_path(char *out, uint32_t *n, const char *path) {
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        const char *end = path;
+        while (*end != '\0' && *end != '/') {
+            end++;
+        }
+        uint32_t len = end - path;
+        if (len == 2 && path[0] == '.' && path[1] == '.') {
+            while (*n > 0 && out[*n - 1] != '/') {
+                (*n)--;
+            }
+            if (*n > 0) {
+                (*n)--;
+            }
+        } else if (len > 0 && !(len == 1 && path[0] == '.')) {
+            if (*n + 1 + len >= FTP_SERVER_PATH_MAX) {
+                return false;
+            }
+            out[(*n)++] = '/';
+            memcpy(&out[*n], path, len);
+            *n += len;
+        }
+        path = end;
+    }
+    return true;
+}
+
+static bool ftp_server_make_path(const char *cwd, const char *path, char *out) {
+    uint32_t n = 0;
+    if (path[0] != '/' && !ftp_server_append_path(out, &n, cwd)) {
+        return false;
+    }
+    if (!ftp_server_append_path(out, &n, path)) {
+        return false;
+    }
+    if (n == 0) {
+        out[n++] = '/';
+    }
+    out[n] = '\0';
+    return true;
+}
+
+// days since 1980-01-01 of a FAT date
+static int32_t ftp_server_days(uint16_t fdate) {
+    static const uint16_t days_before_month[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+    uint32_t year = (fdate >> 9) & 0x7f;
+    uint32_t month = (fdate >> 5) & 0x0f;
+    if (month < 1 || month > 12) {
+        month = 1;
+    }
+    int32_t days = year * 365 + (year + 3) / 4 + days_before_month[month - 1] + (fdate & 0x1f);
+    if (month > 2 && (year % 4) == 0) {
+        days++;
+    }
+    return days;
+}
+
+// Formats a directory entry as a line of "ls -l" output; returns its length
+// or -1 if it doesn't fit in size bytes.
+static int ftp_server_format_entry(ftp_server_t *srv, char *dest, uint32_t size, const ftp_server_stat_t *st) {
+    uint32_t month = (st->fdate >> 5) & 0x0f;
+    uint32_t day = st->fdate & 0x1f;
+    const char *mname = ftp_month[(month >= 1 && month <= 12) ? month - 1 : 0];
+    int n;
+
+    if (day == 0) {
+        day = 1;
+    }
+    // entries older than 180 days show the year instead of the time
+    if (ftp_server_days(srv->ops->fattime() >> 16) - ftp_server_days(st->fdate) > 180) {
+        n = snprintf(dest, size, "%crw-rw-r--   1 root  root %9u %s %2u %5u %s\r\n",
+                     st->dir ? 'd' : '-', (unsigned)st->size, mname, (unsigned)day,
+                     (unsigned)(1980 + ((st->fdate >> 9) & 0x7f)), st->name);
+    } else {
+        n = snprintf(dest, size, "%crw-rw-r--   1 root  root %9u %s %2u %02u:%02u %s\r\n",
+                     st->dir ? 'd' : '-', (unsigned)st->size, mname, (unsigned)day,
+                     (unsigned)((st->ftime >> 11) & 0x1f), (unsigned)((st->ftime >> 5) & 0x3f), st->name);
+    }
+    if (n > 0 && (uint32_t)n < size) {
+        return n;
+    }
+    return -1;
+}
+
+static void ftp_server_close_data(ftp_server_t *srv, ftp_server_session_t *s) {
+    ftp_server_close_socket(srv, &s->d_sd);
+    ftp_server_close_socket(srv, &s->ld_sd);
+}
+
+// Releases the file and the updater held by the transfer.  A firmware update
+// is only finished when the whole image has been received.
+static bool ftp_server_release(ftp_server_t *srv, ftp_server_session_t *s, bool complete) {
+    bool ok = true;
+    if (s->file != NULL) {
+        if (s->xfer == E_FTP_XFER_LIST) {
+            srv->ops->closedir(s->file);
+        } else if (srv->ops->close(s->file) != 0) {
+            ok = false;
+        }
+        s->file = NULL;
+    }
+    if (s->update) {
+        if (complete && ok && !srv->ops->update_finish()) {
+            ok = false;
+        }
+        s->update = false;
+        srv->updater = NULL;
+    }
+    s->xfer = E_FTP_XFER_NONE;
+    s->len[0] = s->len[1] = 0;
+    s->off = 0;
+    s->cur = 0;
+    s->eof = false;
+    s->entry_pending = false;
+    return ok;
+}
+
+static void ftp_server_end_xfer(ftp_server_t *srv, ftp_server_session_t *s, uint32_t code) {
+    if (!ftp_server_release(srv, s, code == 226) && code == 226) {
+        code = 451;
+    }
+    ftp_server_close_data(srv, s);
+    ftp_server_reply(s, code, NULL);
+}
+
+static void ftp_server_close_session(ftp_server_t *srv, ftp_server_session_t *s) {
+    ftp_server_release(srv, s, false);
+    ftp_server_close_data(srv, s);
+    ftp_server_close_socket(srv, &s->c_sd);
+    free(s->buf[0]);
+    free(s->buf[1]);
+    s->buf[0] = s->buf[1] = NULL;
+}
+
+static void ftp_server_new_session(ftp_server_t *srv) {
+    int sd = ftp_server_accept(srv, srv->lc_sd);
+    int option = 1;
+    if (sd < 0) {
+        return;
+    }
+    // replies are short and often come in pairs (150 and 226): don't let
+    // them wait for the client's delayed acknowledgement
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        ftp_server_session_t *s = &srv->session[i];
+        if (s->c_sd >= 0) {
+            continue;
+        }
+        memset(s, 0, sizeof(*s));
+        s->ld_sd = s->d_sd = -1;
+        s->buf[0] = malloc(srv->buffer_size);
+        s->buf[1] = malloc(srv->buffer_size);
+        if (s->buf[0] == NULL || s->buf[1] == NULL) {
+            free(s->buf[0]);
+            free(s->buf[1]);
+            s->buf[0] = s->buf[1] = NULL;
+            break;
+        }
+        s->c_sd = sd;
+        s->c_time = srv->ops->ticks_ms();
+        strcpy(s->cwd, "/");
+        ftp_server_reply(s, 220, "Micropython FTP Server");
+        srv->stats.sessions++;
+        return;
+    }
+    // all sessions are busy (or there's no memory for another one)
+    static const char busy[] = "421 Too many connections\r\n";
+    send(sd, busy, sizeof(busy) - 1, 0);
+    srv->ops->socket_close(sd);
+    srv->stats.refused++;
+}
+
+static void ftp_server_begin_xfer(ftp_server_t *srv, ftp_server_session_t *s, uint8_t xfer, void *file) {
+    s->xfer = xfer;
+    s->file = file;
+    s->d_time = srv->ops->ticks_ms();
+    ftp_server_reply(s, 150, NULL);
+}
+
+static void ftp_server_cmd_pasv(ftp_server_t *srv, ftp_server_session_t *s) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    uint16_t port = srv->data_port + (s - srv->session);
+    char msg[32];
+
+    // some clients (e.g. google chrome) send PASV several times very quickly
+    ftp_server_close_socket(srv, &s->d_sd);
+    if (s->ld_sd < 0) {
+        s->ld_sd = ftp_server_listen(srv, port, 0);
+    }
+    // the data connection is made to the address the client reached us at
+    if (s->ld_sd < 0 || getsockname(s->c_sd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        ftp_server_close_socket(srv, &s->ld_sd);
+        ftp_server_reply(s, 425, NULL);
+        return;
+    }
+    uint8_t *ip = (uint8_t *)&addr.sin_addr.s_addr;
+    snprintf(msg, sizeof(msg), "(%u,%u,%u,%u,%u,%u)", ip[0], ip[1], ip[2], ip[3], port >> 8, port & 0xff);
+    s->d_time = srv->ops->ticks_ms();
+    ftp_server_reply(s, 227, msg);
+}
+
+static void ftp_server_cmd_stor(ftp_server_t *srv, ftp_server_session_t *s) {
+    // a software update is stored through the updater rather than a file
+    if (srv->ops->update_check(s->path)) {
+        if (srv->updater == NULL && srv->ops->update_start()) {
+            srv->updater = s;
+            s->update = true;
+            ftp_server_begin_xfer(srv, s, E_FTP_XFER_STOR, NULL);
+        } else {
+            ftp_server_reply(s, 550, NULL);
+        }
+        return;
+    }
+    void *file = srv->ops->open(s->path, true);
+    if (file != NULL) {
+        ftp_server_begin_xfer(srv, s, E_FTP_XFER_STOR, file);
+    } else {
+        ftp_server_reply(s, 550, NULL);
+    }
+}
+
+static ftp_cmd_index_t ftp_server_pop_command(char **line) {
+    char *cmd = *line;
+    char *p = cmd;
+    while (*p != '\0' && *p != ' ') {
+        *p = toupper((unsigned char)*p);
+        p++;
+    }
+    if (*p == ' ') {
+        *p++ = '\0';
+    }
+    *line = p;
+    for (int i = 0; i < E_FTP_NUM_FTP_CMDS; i++) {
+        if (!strcmp(cmd, ftp_cmd_table[i])) {
+            return i;
+        }
+    }
+    return E_FTP_CMD_NOT_SUPPORTED;
+}
+
+static void ftp_server_process_cmd(ftp_server_t *srv, ftp_server_session_t *s, char *line) {
+    ftp_server_stat_t st;
+    char msg[16];
+    char *param = line;
+    ftp_cmd_index_t cmd = ftp_server_pop_command(&param);
+
+    s->c_time = srv->ops->ticks_ms();
+    if (!s->passvalid && cmd != E_FTP_CMD_USER && cmd != E_FTP_CMD_PASS && cmd != E_FTP_CMD_QUIT) {
+        ftp_server_reply(s, 332, NULL);
+        return;
+    }
+    // the commands taking a path work on its absolute form
+    switch (cmd) {
+    case E_FTP_CMD_CDUP:
+        param = "..";
+        // fall through
+    case E_FTP_CMD_CWD:
+    case E_FTP_CMD_SIZE:
+    case E_FTP_CMD_MDTM:
+    case E_FTP_CMD_RETR:
+    case E_FTP_CMD_STOR:
+    case E_FTP_CMD_DELE:
+    case E_FTP_CMD_RMD:
+    case E_FTP_CMD_MKD:
+    case E_FTP_CMD_RNFR:
+    case E_FTP_CMD_RNTO:
+        if (!ftp_server_make_path(s->cwd, param, s->path)) {
+            ftp_server_reply(s, 550, NULL);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    switch (cmd) {
+    case E_FTP_CMD_FEAT:
+        ftp_server_reply(s, 211, "no-features");
+        break;
+    case E_FTP_CMD_SYST:
+        ftp_server_reply(s, 215, "UNIX Type: L8");
+        break;
+    case E_FTP_CMD_CDUP:
+    case E_FTP_CMD_CWD:
+        {
+            void *dir = srv->ops->opendir(s->path);
+            if (dir != NULL) {
+                srv->ops->closedir(dir);
+                strcpy(s->cwd, s->path);
+                ftp_server_reply(s, 250, NULL);
+            } else {
+                ftp_server_reply(s, 550, NULL);
+            }
+        }
+        break;
+    case E_FTP_CMD_PWD:
+    case E_FTP_CMD_XPWD:
+        ftp_server_reply(s, 257, s->cwd);
+        break;
+    case E_FTP_CMD_SIZE:
+        if (srv->ops->stat(s->path, &st) == 0) {
+            snprintf(msg, sizeof(msg), "%u", (unsigned)st.size);
+            ftp_server_reply(s, 213, msg);
+        } else {
+            ftp_server_reply(s, 550, NULL);
+        }
+        break;
+    case E_FTP_CMD_MDTM:
+        if (srv->ops->stat(s->path, &st) == 0) {
+            snprintf(msg, sizeof(msg), "%u%02u%02u%02u%02u%02u",
+                     1980 + ((st.fdate >> 9) & 0x7f), (st.fdate >> 5) & 0x0f, st.fdate & 0x1f,
+                     (st.ftime >> 11) & 0x1f, (st.ftime >> 5) & 0x3f, 2 * (st.ftime & 0x1f));
+            ftp_server_reply(s, 213, msg);
+        } else {
+            ftp_server_reply(s, 550, NULL);
+        }
+        break;
+    case E_FTP_CMD_TYPE:
+    case E_FTP_CMD_NOOP:
+        ftp_server_reply(s, 200, NULL);
+        break;
+    case E_FTP_CMD_USER:
+        s->passvalid = false;
+        strncpy(s->user, param, sizeof(s->user) - 1);
+        s->user[sizeof(s->user) - 1] = '\0';
+        ftp_server_reply(s, 331, NULL);
+        break;
+    case E_FTP_CMD_PASS:
+        s->passvalid = srv->ops->login(s->user, param);
+        ftp_server_reply(s, s->passvalid ? 230 : 530, NULL);
+        break;
+    case E_FTP_CMD_PASV:
+        ftp_server_cmd_pasv(srv, s);
+        break;
+    case E_FTP_CMD_LIST:
+    case E_FTP_CMD_RETR:
+    case E_FTP_CMD_STOR:
+        if (s->ld_sd < 0 && s->d_sd < 0) {
+            ftp_server_reply(s, 425, NULL);
+        } else if (cmd == E_FTP_CMD_STOR) {
+            ftp_server_cmd_stor(srv, s);
+        } else {
+            void *file = (cmd == E_FTP_CMD_LIST) ? srv->ops->opendir(s->cwd) : srv->ops->open(s->path, false);
+            if (file != NULL) {
+                ftp_server_begin_xfer(srv, s, cmd == E_FTP_CMD_LIST ? E_FTP_XFER_LIST : E_FTP_XFER_RETR, file);
+            } else {
+                ftp_server_reply(s, 550, NULL);
+            }
+        }
+        break;
+    case E_FTP_CMD_DELE:
+    case E_FTP_CMD_RMD:
+        ftp_server_reply(s, srv->ops->remove(s->path) == 0 ? 250 : 550, NULL);
+        break;
+    case E_FTP_CMD_MKD:
+        ftp_server_reply(s, srv->ops->mkdir(s->path) == 0 ? 250 : 550, NULL);
+        break;
+    case E_FTP_CMD_RNFR:
+        if (srv->ops->stat(s->path, &st) == 0) {
+            strcpy(s->rnfr, s->path);
+            ftp_server_reply(s, 350, NULL);
+        } else {
+            ftp_server_reply(s, 550, NULL);
+        }
+        break;
+    case E_FTP_CMD_RNTO:
+        ftp_server_reply(s, (s->rnfr[0] != '\0' && srv->ops->rename(s->rnfr, s->path) == 0) ? 250 : 550, NULL);
+        s->rnfr[0] = '\0';
+        break;
+    case E_FTP_CMD_QUIT:
+        ftp_server_reply(s, 221, NULL);
+        s->quit = true;
+        break;
+    default:
+        // command not implemented
+        ftp_server_reply(s, 502, NULL);
+        break;
+    }
+}
+
+// Runs the next complete command line received, if the session is ready
+// for one.  Returns true if a command was run.
+static bool ftp_server_next_cmd(ftp_server_t *srv, ftp_server_session_t *s) {
+    if (s->xfer != E_FTP_XFER_NONE || s->reply_len > 0 || s->quit) {
+        return false;
+    }
+    char *eol = memchr(s->cmd, '\n', s->cmd_len);
+    if (eol == NULL) {
+        return false;
+    }
+    uint32_t len = eol + 1 - s->cmd;
+    *eol = '\0';
+    if (eol > s->cmd && eol[-1] == '\r') {
+        eol[-1] = '\0';
+    }
+    ftp_server_process_cmd(srv, s, s->cmd);
+    s->cmd_len -= len;
+    memmove(s->cmd, &s->cmd[len], s->cmd_len);
+    return true;
+}
+
+static bool ftp_server_recv_cmd(ftp_server_t *srv, ftp_server_session_t *s) {
+    if (s->cmd_len == sizeof(s->cmd)) {
+        if (memchr(s->cmd, '\n', s->cmd_len) != NULL) {
+            // run the commands already received first
+            return true;
+        }
+        // a line longer than any valid command: drop it
+        s->cmd_len = 0;
+        ftp_server_reply(s, 500, NULL);
+    }
+    int n = recv(s->c_sd, &s->cmd[s->cmd_len], sizeof(s->cmd) - s->cmd_len, 0);
+    if (n > 0) {
+        s->cmd_len += n;
+        return true;
+    }
+    return n < 0 && ftp_server_would_block();
+}
+
+static bool ftp_server_send_reply(ftp_server_t *srv, ftp_server_session_t *s) {
+    int n = send(s->c_sd, s->reply, s->reply_len, 0);
+    if (n > 0) {
+        s->reply_len -= n;
+        memmove(s->reply, &s->reply[n], s->reply_len);
+        return true;
+    }
+    return n < 0 && ftp_server_would_block();
+}
+
+// Fills buffer i with the next block of the file or of the listing.
+static int ftp_server_fill(ftp_server_t *srv, ftp_server_session_t *s, uint8_t i) {
+    uint32_t len = 0;
+    if (s->xfer == E_FTP_XFER_RETR) {
+        srv->stats.file_reads++;
+        if (srv->ops->read(s->file, s->buf[i], srv->buffer_size, &len) != 0) {
+            return -1;
+        }
+        if (len < srv->buffer_size) {
+            s->eof = true;
+        }
+    } else {
+        while (true) {
+            if (!s->entry_pending) {
+                int res = srv->ops->readdir(s->file, &s->entry);
+                if (res < 0) {
+                    return -1;
+                } else if (res == 0) {
+                    s->eof = true;
+                    break;
+                }
+            }
+            int n = ftp_server_format_entry(srv, (char *)&s->buf[i][len], srv->buffer_size - len, &s->entry);
+            // an entry that doesn't fit goes in the next buffer, unless it
+            // doesn't fit even in an empty one
+            s->entry_pending = (n < 0 && len > 0);
+            if (s->entry_pending) {
+                break;
+            } else if (n > 0) {
+                len += n;
+            }
+        }
+    }
+    s->len[i] = len;
+    return 0;
+}
+
+// Sends the file or listing, reading the next buffer while the socket is
+// busy with the previous one.
+static void ftp_server_send_data(ftp_server_t *srv, ftp_server_session_t *s) {
+    for (int burst = FTP_SERVER_BURST; burst > 0; burst--) {
+        if (s->off == s->len[s->cur]) {
+            // this buffer has been sent, go on with the other one
+            s->len[s->cur] = 0;
+            s->off = 0;
+            s->cur ^= 1;
+            if (s->len[s->cur] == 0) {
+                if (s->eof) {
+                    ftp_server_end_xfer(srv, s, 226);
+                    return;
+                }
+                if (ftp_server_fill(srv, s, s->cur) != 0) {
+                    ftp_server_end_xfer(srv, s, 451);
+                    return;
+                }
+                if (s->len[s->cur] == 0) {
+                    continue;
+                }
+            }
+        }
+        int n = send(s->d_sd, &s->buf[s->cur][s->off], s->len[s->cur] - s->off, 0);
+        if (n > 0) {
+            s->off += n;
+            s->d_time = s->c_time = srv->ops->ticks_ms();
+        } else if (n < 0 && ftp_server_would_block()) {
+            break;
+        } else {
+            ftp_server_end_xfer(srv, s, 426);
+            return;
+        }
+    }
+    uint8_t spare = s->cur ^ 1;
+    if (!s->eof && s->len[spare] == 0) {
+        srv->stats.read_ahead++;
+        if (ftp_server_fill(srv, s, spare) != 0) {
+            ftp_server_end_xfer(srv, s, 451);
+        }
+    }
+}
+
+// Writes the received data out to the file or the updater.
+static bool ftp_server_store(ftp_server_t *srv, ftp_server_session_t *s) {
+    bool ok = true;
+    if (s->len[0] > 0) {
+        srv->stats.file_writes++;
+        if (s->update) {
+            ok = srv->ops->update_write(s->buf[0], s->len[0]);
+        } else {
+            ok = srv->ops->write(s->file, s->buf[0], s->len[0]) == 0;
+        }
+        s->len[0] = 0;
+    }
+    return ok;
+}
+
+// Receives a file, gathering the data into full buffers so that it is
+// written in as few operations as possible.
+static void ftp_server_recv_data(ftp_server_t *srv, ftp_server_session_t *s) {
+    for (int burst = FTP_SERVER_BURST; burst > 0; burst--) {
+        int n = recv(s->d_sd, &s->buf[0][s->len[0]], srv->buffer_size - s->len[0], 0);
+        if (n > 0) {
+            s->len[0] += n;
+            s->d_time = s->c_time = srv->ops->ticks_ms();
+            if (s->len[0] == srv->buffer_size && !ftp_server_store(srv, s)) {
+                ftp_server_end_xfer(srv, s, 451);
+                return;
+            }
+        } else if (n == 0) {
+            // the client closes the data connection at the end of the file
+            ftp_server_end_xfer(srv, s, ftp_server_store(srv, s) ? 226 : 451);
+            return;
+        } else if (ftp_server_would_block()) {
+            return;
+        } else {
+            ftp_server_end_xfer(srv, s, 426);
+            return;
+        }
+    }
+}
+
+static void ftp_server_check_timeouts(ftp_server_t *srv, ftp_server_session_t *s) {
+    uint32_t now = srv->ops->ticks_ms();
+    if ((s->ld_sd >= 0 || s->d_sd >= 0 || s->xfer != E_FTP_XFER_NONE)
+        && now - s->d_time > FTP_SERVER_DATA_TIMEOUT_MS) {
+        if (s->xfer != E_FTP_XFER_NONE) {
+            ftp_server_end_xfer(srv, s, s->d_sd < 0 ? 425 : 426);
+        } else {
+            ftp_server_close_data(srv, s);
+        }
+    }
+    if (s->xfer == E_FTP_XFER_NONE && !s->quit && now - s->c_time > srv->ops->timeout_ms()) {
+        ftp_server_reply(s, 221, NULL);
+        s->quit = true;
+    }
+}
+
+// Adds the sockets the session is waiting for to the sets; returns true if
+// the session can make progress without waiting.
+static bool ftp_server_watch(ftp_server_session_t *s, fd_set *rfds, fd_set *wfds, int *maxfd) {
+    bool ready = false;
+    #define FTP_WATCH(sd, set) do { FD_SET(sd, set); if (sd > *maxfd) { *maxfd = sd; } } while (0)
+    if (s->reply_len > 0) {
+        FTP_WATCH(s->c_sd, wfds);
+    } else if (s->quit) {
+        ready = true;
+    } else if (s->xfer == E_FTP_XFER_NONE) {
+        FTP_WATCH(s->c_sd, rfds);
+        ready = memchr(s->cmd, '\n', s->cmd_len) != NULL;
+    }
+    if (s->d_sd < 0 && s->ld_sd >= 0) {
+        FTP_WATCH(s->ld_sd, rfds);
+    } else if (s->d_sd >= 0 && s->xfer == E_FTP_XFER_STOR) {
+        FTP_WATCH(s->d_sd, rfds);
+    } else if (s->d_sd >= 0 && s->xfer != E_FTP_XFER_NONE) {
+        FTP_WATCH(s->d_sd, wfds);
+    }
+    #undef FTP_WATCH
+    return ready;
+}
+
+static void ftp_server_service(ftp_server_t *srv, ftp_server_session_t *s, fd_set *rfds, fd_set *wfds) {
+    if (FD_ISSET(s->c_sd, wfds) && !ftp_server_send_reply(srv, s)) {
+        ftp_server_close_session(srv, s);
+        return;
+    }
+    if (s->quit && s->reply_len == 0) {
+        ftp_server_close_session(srv, s);
+        return;
+    }
+    if (FD_ISSET(s->c_sd, rfds) && !ftp_server_recv_cmd(srv, s)) {
+        ftp_server_close_session(srv, s);
+        return;
+    }
+    if (s->d_sd < 0 && s->ld_sd >= 0 && FD_ISSET(s->ld_sd, rfds)) {
+        // one data connection per PASV
+        s->d_sd = ftp_server_accept(srv, s->ld_sd);
+        ftp_server_close_socket(srv, &s->ld_sd);
+        s->d_time = srv->ops->ticks_ms();
+    }
+    ftp_server_next_cmd(srv, s);
+    if (s->d_sd >= 0) {
+        if (s->xfer == E_FTP_XFER_STOR) {
+            ftp_server_recv_data(srv, s);
+        } else if (s->xfer != E_FTP_XFER_NONE) {
+            ftp_server_send_data(srv, s);
+        }
+    }
+    ftp_server_check_timeouts(srv, s);
+    // try to send the replies straight away
+    if (s->reply_len > 0 && !ftp_server_send_reply(srv, s)) {
+        ftp_server_close_session(srv, s);
+    }
+}
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void ftp_server_init(ftp_server_t *srv, const ftp_server_ops_t *ops, uint16_t cmd_port, uint16_t data_port, uint32_t buffer_size) {
+    memset(srv, 0, sizeof(*srv));
+    srv->ops = ops;
+    srv->cmd_port = cmd_port;
+    srv->data_port = data_port;
+    srv->buffer_size = buffer_size ? buffer_size : FTP_SERVER_BUFFER_SIZE;
+    srv->lc_sd = -1;
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        srv->session[i].c_sd = srv->session[i].ld_sd = srv->session[i].d_sd = -1;
+    }
+}
+
+bool ftp_server_start(ftp_server_t *srv) {
+    if (srv->lc_sd < 0) {
+        srv->lc_sd = ftp_server_listen(srv, srv->cmd_port, FTP_SERVER_SESSIONS);
+    }
+    return srv->lc_sd >= 0;
+}
+
+void ftp_server_stop(ftp_server_t *srv) {
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        if (srv->session[i].c_sd >= 0) {
+            ftp_server_close_session(srv, &srv->session[i]);
+        }
+    }
+    ftp_server_close_socket(srv, &srv->lc_sd);
+}
+
+bool ftp_server_is_started(ftp_server_t *srv) {
+    return srv->lc_sd >= 0;
+}
+
+void ftp_server_run(ftp_server_t *srv, uint32_t timeout_ms) {
+    fd_set rfds, wfds;
+    int maxfd = srv->lc_sd;
+    bool ready = false;
+
+    if (srv->lc_sd < 0) {
+        return;
+    }
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_SET(srv->lc_sd, &rfds);
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        if (srv->session[i].c_sd >= 0) {
+            ready |= ftp_server_watch(&srv->session[i], &rfds, &wfds, &maxfd);
+        }
+    }
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
+    if (!ready) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+    }
+    int n = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+    if (n < 0) {
+        if (errno != EINTR) {
+            // the network went away under us: start all over again
+            ftp_server_stop(srv);
+        }
+        return;
+    }
+    if (n == 0) {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+    }
+    if (FD_ISSET(srv->lc_sd, &rfds)) {
+        ftp_server_new_session(srv);
+    }
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        if (srv->session[i].c_sd >= 0) {
+            ftp_server_service(srv, &srv->session[i], &rfds, &wfds);
+        }
+    }
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef FTP_SERVER_H_
+#define FTP_SERVER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// FTP protocol engine: sessions, commands and passive mode data transfers,
+// run from a select() loop over BSD sockets.  It has no dependency on the IDF
+// or on the VFS: files, the firmware updater and the clock are reached
+// through ftp_server_ops_t, so the server can be run on a host against
+// loopback sockets and a stubbed filesystem.
+
+#ifndef FTP_SERVER_SESSIONS
+#define FTP_SERVER_SESSIONS             (2)
+#endif
+
+// Size of each of the two transfer buffers of a session, allocated while
+// the session is connected.  A file is read into one of them while the
+// other is being sent.
+#ifndef FTP_SERVER_BUFFER_SIZE
+#define FTP_SERVER_BUFFER_SIZE          (4096)
+#endif
+
+#ifndef FTP_SERVER_PATH_MAX
+#define FTP_SERVER_PATH_MAX             (128 + 1)
+#endif
+
+#define FTP_SERVER_USER_MAX             (32 + 1)
+#define FTP_SERVER_CMD_MAX              (FTP_SERVER_PATH_MAX + 8)
+#define FTP_SERVER_REPLY_MAX            (FTP_SERVER_PATH_MAX + 64)
+#define FTP_SERVER_DATA_TIMEOUT_MS      (10000)
+
+// A directory entry or the result of stat; dates and times are in the FAT
+// format.  For readdir, name stays valid until the next call on the
+// directory.
+typedef struct _ftp_server_stat_t {
+    const char *name;
+    uint32_t size;
+    uint16_t fdate;
+    uint16_t ftime;
+    bool dir;
+} ftp_server_stat_t;
+
+// Paths are absolute.  open and opendir return NULL on failure, the others
+// return 0 on success unless noted.
+typedef struct _ftp_server_ops_t {
+    void *(*open)(const char *path, bool write);
+    int (*read)(void *file, void *buf, uint32_t size, uint32_t *actual);
+    int (*write)(void *file, const void *buf, uint32_t size);
+    int (*close)(void *file);
+    // "/" lists the mounted volumes.  readdir returns 1 and fills in st for
+    // the next entry ("." and ".." are skipped), 0 at the end or <0 on error.
+    void *(*opendir)(const char *path);
+    int (*readdir)(void *dir, ftp_server_stat_t *st);
+    void (*closedir)(void *dir);
+    int (*stat)(const char *path, ftp_server_stat_t *st);
+    int (*mkdir)(const char *path);
+    int (*remove)(const char *path);
+    int (*rename)(const char *old_path, const char *new_path);
+    // firmware update, received by a STOR to the path update_check accepts;
+    // the other calls return true on success
+    bool (*update_check)(const char *path);
+    bool (*update_start)(void);
+    bool (*update_write)(const void *buf, uint32_t len);
+    bool (*update_finish)(void);
+    bool (*login)(const char *user, const char *pass);
+    uint32_t (*ticks_ms)(void);
+    uint32_t (*fattime)(void);          // current date and time, as FatFs get_fattime()
+    uint32_t (*timeout_ms)(void);       // idle time after which a session is closed
+    // called for every socket the server opens and to close them
+    void (*socket_add)(int sd);
+    void (*socket_close)(int sd);
+} ftp_server_ops_t;
+
+typedef struct _ftp_server_session_t {
+    int c_sd;                           // control connection, -1 if the session is free
+    int ld_sd;                          // passive mode listening socket
+    int d_sd;                           // data connection
+    uint32_t c_time;                    // last command received
+    uint32_t d_time;                    // last progress of the data connection
+    uint8_t xfer;                       // transfer in progress
+    bool uservalid;
+    bool passvalid;
+    bool update;                        // the STOR is a firmware update
+    bool eof;                           // the file or listing has been read to the end
+    bool quit;                          // close once the queued replies are sent
+    bool entry_pending;                 // entry didn't fit in the last listing buffer
+    void *file;                         // file or directory being transferred
+    uint8_t *buf[2];
+    uint32_t len[2];
+    uint32_t off;                       // bytes of buf[cur] already sent
+    uint8_t cur;
+    uint16_t cmd_len;
+    uint16_t reply_len;
+    ftp_server_stat_t entry;
+    char cmd[FTP_SERVER_CMD_MAX];
+    char reply[FTP_SERVER_REPLY_MAX];
+    char cwd[FTP_SERVER_PATH_MAX];
+    char path[FTP_SERVER_PATH_MAX];     // argument of the current command
+    char rnfr[FTP_SERVER_PATH_MAX];
+    char user[FTP_SERVER_USER_MAX];
+} ftp_server_session_t;
+
+typedef struct _ftp_server_stats_t {
+    uint32_t sessions;                  // sessions accepted
+    uint32_t refused;                   // connections refused because all sessions were busy
+    uint32_t file_reads;
+    uint32_t file_writes;
+    uint32_t read_ahead;                // buffers filled while the socket was busy sending
+} ftp_server_stats_t;
+
+typedef struct _ftp_server_t {
+    const ftp_server_ops_t *ops;
+    uint32_t buffer_size;
+    uint16_t cmd_port;
+    uint16_t data_port;                 // session n listens on data_port + n
+    int lc_sd;
+    ftp_server_session_t *updater;      // session holding the firmware updater
+    ftp_server_stats_t stats;
+    ftp_server_session_t session[FTP_SERVER_SESSIONS];
+} ftp_server_t;
+
+// buffer_size of 0 selects FTP_SERVER_BUFFER_SIZE
+void ftp_server_init(ftp_server_t *srv, const ftp_server_ops_t *ops, uint16_t cmd_port, uint16_t data_port, uint32_t buffer_size);
+
+// Opens the command port; returns false if it couldn't.
+bool ftp_server_start(ftp_server_t *srv);
+
+// Closes all sessions and the command port.
+void ftp_server_stop(ftp_server_t *srv);
+
+bool ftp_server_is_started(ftp_server_t *srv);
+
+// Waits up to timeout_ms for any of the server's sockets to be ready and
+// services them.  Returns without waiting while a session has work to do.
+void ftp_server_run(ftp_server_t *srv, uint32_t timeout_ms);
+
+#endif /* FTP_SERVER_H_ */
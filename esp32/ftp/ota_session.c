@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ota_session.h"
+// as extmod/moduhashlib.c does, which isn't built on this port
+#include "extmod/crypto-algorithms/sha256.c"
+
+/******************************************************************************
+ DEFINE PRIVATE CONSTANTS
+ ******************************************************************************/
+#define OTA_SESSION_MAGIC               (0x4F544153)    // "OTAS", changes with the layout of the state
+
+#define OTA_IMAGE_MAGIC                 (0xE9)
+#define OTA_IMAGE_HASH_APPENDED_OFFSET  (23)
+
+_Static_assert(sizeof(((ota_hash_t *)0)->file) >= sizeof(CRYAL_SHA256_CTX), "ota_hash_t too small");
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t ota_session_crc(const ota_session_state_t *state);
+static bool ota_session_save(ota_session_t *s);
+static void ota_hash_sha256(void *state, const uint8_t *buf, uint32_t len);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void ota_hash_init(ota_hash_t *h) {
+    CRYAL_SHA256_CTX ctx;
+
+    memset(h, 0, sizeof(*h));
+    sha256_init(&ctx);
+    memcpy(h->file, &ctx, sizeof(ctx));
+    memcpy(h->image, &ctx, sizeof(ctx));
+}
+
+void ota_hash_update(ota_hash_t *h, const uint8_t *buf, uint32_t len) {
+    ota_hash_sha256(h->file, buf, len);
+
+    if (h->len < sizeof(h->head)) {
+        uint32_t n = sizeof(h->head) - h->len;
+        memcpy(h->head + h->len, buf, n < len ? n : len);
+    }
+
+    // the image hash lags 32 bytes behind: the last 32 bytes seen are kept
+    // in tail, and only hashed when more data pushes them out
+    uint32_t have = h->len < OTA_SESSION_DIGEST_LEN ? h->len : OTA_SESSION_DIGEST_LEN;
+    if (len >= OTA_SESSION_DIGEST_LEN) {
+        ota_hash_sha256(h->image, h->tail, have);
+        ota_hash_sha256(h->image, buf, len - OTA_SESSION_DIGEST_LEN);
+        memcpy(h->tail, buf + len - OTA_SESSION_DIGEST_LEN, OTA_SESSION_DIGEST_LEN);
+    } else {
+        uint32_t out = have + len > OTA_SESSION_DIGEST_LEN ? have + len - OTA_SESSION_DIGEST_LEN : 0;
+        ota_hash_sha256(h->image, h->tail, out);
+        memmove(h->tail, h->tail + out, have - out);
+        memcpy(h->tail + have - out, buf, len);
+    }
+    h->len += len;
+}
+
+void ota_hash_file_digest(const ota_hash_t *h, uint8_t *digest) {
+    CRYAL_SHA256_CTX ctx;
+
+    memcpy(&ctx, h->file, sizeof(ctx));
+    sha256_final(&ctx, digest);
+}
+
+bool ota_hash_image_ok(const ota_hash_t *h) {
+    uint8_t digest[OTA_SESSION_DIGEST_LEN];
+    CRYAL_SHA256_CTX ctx;
+
+    if (h->len < sizeof(h->head) + OTA_SESSION_DIGEST_LEN || h->head[0] != OTA_IMAGE_MAGIC ||
+        h->head[OTA_IMAGE_HASH_APPENDED_OFFSET] != 1) {
+        return false;
+    }
+    memcpy(&ctx, h->image, sizeof(ctx));
+    sha256_final(&ctx, digest);
+    return memcmp(digest, h->tail, OTA_SESSION_DIGEST_LEN) == 0;
+}
+
+int ota_session_begin(ota_session_t *s, const ota_session_ops_t *ops, void *ctx, uint32_t slot,
+                      uint32_t size, uint32_t chunk_size, const uint8_t *digest) {
+    ota_session_state_t *state = &s->state;
+
+    if (chunk_size == 0) {
+        chunk_size = OTA_SESSION_CHUNK_SIZE;
+    }
+    if (size == 0 || chunk_size % OTA_SESSION_SECTOR_SIZE != 0) {
+        return OTA_SESSION_ERR_PARAM;
+    }
+
+    s->ops = ops;
+    s->ctx = ctx;
+    s->active = true;
+
+    // carry on with the saved session if it is the same image
+    if (ops->load(ctx, state, sizeof(*state)) && state->magic == OTA_SESSION_MAGIC &&
+        state->crc == ota_session_crc(state) && state->slot == slot && state->size == size &&
+        state->chunk_size == chunk_size && memcmp(state->digest, digest, OTA_SESSION_DIGEST_LEN) == 0 &&
+        state->chunks <= ota_session_chunks(s) &&
+        state->hash.len == (state->chunks * chunk_size < size ? state->chunks * chunk_size : size)) {
+        return state->chunks;
+    }
+
+    memset(state, 0, sizeof(*state));
+    state->magic = OTA_SESSION_MAGIC;
+    state->slot = slot;
+    state->size = size;
+    state->chunk_size = chunk_size;
+    memcpy(state->digest, digest, OTA_SESSION_DIGEST_LEN);
+    ota_hash_init(&state->hash);
+    if (!ota_session_save(s)) {
+        s->active = false;
+        return OTA_SESSION_ERR_SAVE;
+    }
+    return 0;
+}
+
+int ota_session_write(ota_session_t *s, uint32_t index, const uint8_t *buf, uint32_t len, const uint8_t *digest) {
+    ota_session_state_t *state = &s->state;
+    uint32_t offset = index * state->chunk_size;
+    uint32_t expected;
+
+    if (!s->active) {
+        return OTA_SESSION_ERR_ORDER;
+    }
+    if (index < state->chunks) {
+        // sent again after a restart
+        return state->chunks;
+    }
+    if (index != state->chunks || index >= ota_session_chunks(s)) {
+        return OTA_SESSION_ERR_ORDER;
+    }
+    expected = state->size - offset < state->chunk_size ? state->size - offset : state->chunk_size;
+    if (len != expected) {
+        return OTA_SESSION_ERR_PARAM;
+    }
+    if (digest != NULL) {
+        uint8_t check[OTA_SESSION_DIGEST_LEN];
+        CRYAL_SHA256_CTX ctx;
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, buf, len);
+        sha256_final(&ctx, check);
+        if (memcmp(check, digest, OTA_SESSION_DIGEST_LEN) != 0) {
+            return OTA_SESSION_ERR_CHUNK_DIGEST;
+        }
+    }
+
+    // the chunk's sectors may hold a part of it written before a restart
+    uint32_t erase_len = (len + OTA_SESSION_SECTOR_SIZE - 1) & ~(OTA_SESSION_SECTOR_SIZE - 1);
+    if (!s->ops->erase(s->ctx, offset, erase_len) || !s->ops->write(s->ctx, offset, buf, len)) {
+        return OTA_SESSION_ERR_FLASH;
+    }
+
+    ota_hash_update(&state->hash, buf, len);
+    state->chunks++;
+    // if this fails, at worst the chunk is sent again after a restart
+    ota_session_save(s);
+    return state->chunks;
+}
+
+int ota_session_finish(ota_session_t *s) {
+    ota_session_state_t *state = &s->state;
+    uint8_t digest[OTA_SESSION_DIGEST_LEN];
+
+    if (!s->active) {
+        return OTA_SESSION_ERR_ORDER;
+    }
+    if (state->chunks != ota_session_chunks(s)) {
+        return OTA_SESSION_ERR_INCOMPLETE;
+    }
+    ota_hash_file_digest(&state->hash, digest);
+    if (memcmp(digest, state->digest, OTA_SESSION_DIGEST_LEN) != 0) {
+        return OTA_SESSION_ERR_DIGEST;
+    }
+    s->active = false;
+    s->ops->save(s->ctx, NULL, 0);
+    return OTA_SESSION_OK;
+}
+
+void ota_session_abort(ota_session_t *s) {
+    if (s->ops != NULL) {
+        s->ops->save(s->ctx, NULL, 0);
+    }
+    s->active = false;
+}
+
+uint32_t ota_session_chunks(const ota_session_t *s) {
+    return (s->state.size + s->state.chunk_size - 1) / s->state.chunk_size;
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t ota_session_crc(const ota_session_state_t *state) {
+    const uint8_t *p = (const uint8_t *)state;
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (uint32_t i = 0; i < offsetof(ota_session_state_t, crc); i++) {
+        crc ^= p[i];
+        for (int b = 0; b < 8; b++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static void ota_hash_sha256(void *state, const uint8_t *buf, uint32_t len) {
+    CRYAL_SHA256_CTX ctx;
+
+    if (len > 0) {
+        memcpy(&ctx, state, sizeof(ctx));
+        sha256_update(&ctx, buf, len);
+        memcpy(state, &ctx, sizeof(ctx));
+    }
+}
+
+static bool ota_session_save(ota_session_t *s) {
+    s->state.crc = ota_session_crc(&s->state);
+    return s->ops->save(s->ctx, &s->state, sizeof(s->state));
+}
+
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef OTA_SESSION_H_
+#define OTA_SESSION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Resumable OTA downloads.  The image is sent as numbered chunks of a fixed
+// size (the last one may be shorter).  A chunk may come with its own
+// SHA-256, checked before it is written; the progress is saved after every
+// chunk that checks out, so a download that is cut off carries on from the
+// first chunk not yet written.  The chunks are hashed as they are received,
+// not read back: the session compares the SHA-256 of the whole file with the
+// digest it was started with at the end, and only then forgets the saved
+// progress; ota_hash_image_ok() checks the digest an app image carries,
+// which the bootloader checks again against the flash.  No IDF dependency:
+// the slot and the saved progress are reached through ota_session_ops_t.
+
+#define OTA_SESSION_DIGEST_LEN          (32)
+#define OTA_SESSION_SECTOR_SIZE         (4096)
+#define OTA_SESSION_CHUNK_SIZE          (16 * 1024)
+
+#define OTA_SESSION_OK                  (0)
+#define OTA_SESSION_ERR_PARAM           (-1)    // bad size, chunk size or chunk length
+#define OTA_SESSION_ERR_ORDER           (-2)    // no session, or a chunk past the next one
+#define OTA_SESSION_ERR_FLASH           (-3)    // erasing or writing failed
+#define OTA_SESSION_ERR_DIGEST          (-4)    // the file doesn't match the digest it was started with
+#define OTA_SESSION_ERR_INCOMPLETE      (-5)    // finished before all the chunks were written
+#define OTA_SESSION_ERR_SAVE            (-6)    // the progress couldn't be saved
+#define OTA_SESSION_ERR_CHUNK_DIGEST    (-7)    // the chunk doesn't match its digest
+
+// Incremental hash of an image: of the whole file, and of all of it but the
+// last 32 bytes, which is what an app image with a digest appended carries
+// in those bytes.  The SHA-256 contexts are kept opaque, the header of the
+// implementation can't be mixed with FatFs's.
+typedef struct _ota_hash_t {
+    uint64_t file[14];
+    uint64_t image[14];
+    uint32_t len;
+    uint8_t head[24];                   // start of the image header
+    uint8_t tail[OTA_SESSION_DIGEST_LEN];
+} ota_hash_t;
+
+void ota_hash_init(ota_hash_t *h);
+void ota_hash_update(ota_hash_t *h, const uint8_t *buf, uint32_t len);
+void ota_hash_file_digest(const ota_hash_t *h, uint8_t *digest);
+
+// Returns true if the data hashed is an app image with a SHA-256 appended
+// and the digest matches; false if it doesn't match or there is none.
+bool ota_hash_image_ok(const ota_hash_t *h);
+
+// Offsets are relative to the start of the slot.  erase is given whole
+// sectors.  load returns false if no progress was saved; save with a len of
+// 0 forgets it.  The calls return true on success.
+typedef struct _ota_session_ops_t {
+    bool (*write)(void *ctx, uint32_t offset, const void *buf, uint32_t len);
+    bool (*erase)(void *ctx, uint32_t offset, uint32_t len);
+    bool (*load)(void *ctx, void *data, uint32_t len);
+    bool (*save)(void *ctx, const void *data, uint32_t len);
+} ota_session_ops_t;
+
+// The progress, as saved after each chunk.
+typedef struct _ota_session_state_t {
+    uint32_t magic;
+    uint32_t slot;                      // where the image is being written
+    uint32_t size;
+    uint32_t chunk_size;
+    uint32_t chunks;                    // chunks written
+    uint8_t digest[OTA_SESSION_DIGEST_LEN];
+    ota_hash_t hash;                    // of those chunks
+    uint32_t crc;
+} ota_session_state_t;
+
+typedef struct _ota_session_t {
+    const ota_session_ops_t *ops;
+    void *ctx;
+    bool active;
+    ota_session_state_t state;
+} ota_session_t;
+
+// Starts writing an image of size bytes, whose SHA-256 is digest, to the
+// slot at the given offset.  If the progress saved is of the same image in
+// the same slot it carries on from there.  chunk_size is a multiple of the
+// sector size; 0 selects OTA_SESSION_CHUNK_SIZE.  Returns the index of the
+// first chunk to send, or an OTA_SESSION_ERR_ code.
+int ota_session_begin(ota_session_t *s, const ota_session_ops_t *ops, void *ctx, uint32_t slot,
+                      uint32_t size, uint32_t chunk_size, const uint8_t *digest);
+
+// Writes chunk index, if digest is NULL or its SHA-256.  A chunk that was
+// already written is accepted and ignored, as a download that restarts may
+// send it again.  Returns the index of the next chunk to send, or an
+// OTA_SESSION_ERR_ code; after an error the same chunk can be sent again.
+int ota_session_write(ota_session_t *s, uint32_t index, const uint8_t *buf, uint32_t len, const uint8_t *digest);
+
+// Checks that all the chunks were written and that the file matches the
+// digest, and then forgets the saved progress.  On a digest mismatch the
+// progress is kept, ota_session_abort() starts the download over.
+int ota_session_finish(ota_session_t *s);
+
+// Forgets the saved progress; the next session starts from the beginning.
+void ota_session_abort(ota_session_t *s);
+
+uint32_t ota_session_chunks(const ota_session_t *s);
+
+#endif /* OTA_SESSION_H_ */
@@ -18,13 +18,15 @@
 #include "esp_spi_flash.h"
 #include "esp_flash_encrypt.h"
 #include "esp_image_format.h"
+#include "esp_secure_boot.h"
+#include "nvs.h"
 //#define LOG_LOCAL_LEVEL ESP_LOG_INFO
 #include "esp_log.h"
 #include "rom/crc.h"
 #include "esp32chipinfo.h"
+#include "ota_session.h"
 
 #ifdef DIFF_UPDATE_ENABLED
-#include "bzlib.h"
 #include "bsdiff_api.h"
 #endif
 
@@ -34,6 +36,9 @@
 static const char *TAG = "updater";
 #define UPDATER_IMG_PATH                                "/flash/sys/appimg.bin"
 
+#define UPDATER_NVS_NAMESPACE                           "PY_OTA"
+#define UPDATER_NVS_SESSION_KEY                         "session"
+
 /* if flash is encrypted, it requires the flash_write operation to be done in 16 Bytes chunks */
 #define ENCRYP_FLASH_MIN_CHUNK                            16
 
@@ -46,8 +51,32 @@ typedef struct {
     uint32_t offset_start_upd;
     uint32_t chunk_size;
     uint32_t current_chunk;
+    ota_hash_t hash;                        // of everything written since updater_start()
+    bool hashed;
 } updater_data_t;
 
+// an image written in any order, by updater_frag_write(); the sectors are
+// erased as they're first written to, as erasing the whole slot up front
+// would stall the caller for seconds
+typedef struct {
+    uint32_t slot;
+    uint32_t size;
+    bool active;
+    uint8_t erased[(IMG_SIZE_8MB / SPI_FLASH_SEC_SIZE + 7) / 8];
+} updater_frag_t;
+
+#ifdef DIFF_UPDATE_ENABLED
+// where the patcher reads the patch file and the old image from, and the
+// free sectors of the slot it decompresses the control and extra blocks to
+typedef struct {
+    uint32_t offset;                        // of the patch file in the flash...
+    uint8_t *buf;                           // ...or of its copy in SPIRAM
+    uint32_t old_offset;
+    uint32_t scratch_offset;
+    uint32_t scratch_erased;                // end of the sectors erased so far
+} updater_patch_t;
+#endif
+
 /******************************************************************************
  DECLARE PRIVATE DATA
  ******************************************************************************/
@@ -58,6 +87,11 @@ static updater_data_t updater_data = {
     .chunk_size = 0,
     .current_chunk = 0 };
 
+static ota_session_t updater_session;
+static updater_frag_t updater_frag;
+static nvs_handle updater_nvs_handle;
+static bool updater_nvs_opened;
+
 //static OsiLockObj_t updater_LockObj;
 static boot_info_t boot_info;
 static uint32_t boot_info_offset;
@@ -68,6 +102,39 @@ static uint32_t boot_info_offset;
 static esp_err_t updater_spi_flash_read(size_t src, void *dest, size_t size, bool allow_decrypt);
 static esp_err_t updater_spi_flash_write(size_t dest_addr, void *src, size_t size, bool write_encrypted);
 static bool updater_is_delta_file(void);
+static bool updater_session_write_flash(void *ctx, uint32_t offset, const void *buf, uint32_t len);
+static bool updater_session_erase(void *ctx, uint32_t offset, uint32_t len);
+static bool updater_session_load(void *ctx, void *data, uint32_t len);
+static bool updater_session_save(void *ctx, const void *data, uint32_t len);
+static bool updater_frag_range(uint32_t offset, uint32_t len);
+
+static const ota_session_ops_t updater_session_ops = {
+    .write = updater_session_write_flash,
+    .erase = updater_session_erase,
+    .load = updater_session_load,
+    .save = updater_session_save,
+};
+#ifdef DIFF_UPDATE_ENABLED
+static bool updater_patch_move(uint32_t from, uint32_t to, uint32_t size);
+static bool updater_patch_read_patch(void *ctx, uint32_t offset, void *buf, uint32_t len);
+static bool updater_patch_read_old(void *ctx, uint32_t offset, void *buf, uint32_t len);
+static bool updater_patch_write_new(void *ctx, const void *buf, uint32_t len);
+static bool updater_patch_write_scratch(void *ctx, uint32_t offset, const void *buf, uint32_t len);
+static bool updater_patch_read_scratch(void *ctx, uint32_t offset, void *buf, uint32_t len);
+static uint32_t updater_patch_old_size(uint32_t old_offset, uint32_t slot_size);
+static void *updater_patch_alloc(void *ctx, uint32_t size);
+static void updater_patch_free(void *ctx, void *ptr);
+
+static const bspatch_ops_t updater_patch_ops = {
+    .read_patch = updater_patch_read_patch,
+    .read_old = updater_patch_read_old,
+    .write_new = updater_patch_write_new,
+    .write_scratch = updater_patch_write_scratch,
+    .read_scratch = updater_patch_read_scratch,
+    .alloc = updater_patch_alloc,
+    .free = updater_patch_free,
+};
+#endif
 
 /******************************************************************************
  DEFINE PUBLIC FUNCTIONS
@@ -105,7 +172,7 @@ bool updater_check_path (void *path) {
 
 bool updater_start (void) {
 
-    updater_data.size = (esp32_get_chip_rev() > 0 ? IMG_SIZE_8MB : IMG_SIZE_4MB);
+    updater_data.size = updater_slot_size();
     // check which one should be the next active image
     updater_data.offset = updater_ota_next_slot_address();
 
@@ -124,6 +191,10 @@ bool updater_start (void) {
 
     boot_info.size = 0;
     updater_data.current_chunk = 0;
+    ota_hash_init(&updater_data.hash);
+    updater_data.hashed = true;
+    // a chunked session's saved progress is kept, but it must be started again
+    updater_session.active = false;
 
     return true;
 }
@@ -137,6 +208,7 @@ bool updater_write (uint8_t *buf, uint32_t len) {
         return false;
     }
 
+    ota_hash_update(&updater_data.hash, buf, len);
     updater_data.offset += len;
     updater_data.current_chunk += len;
     boot_info.size += len;
@@ -156,296 +228,108 @@ bool updater_write (uint8_t *buf, uint32_t len) {
 #ifdef DIFF_UPDATE_ENABLED
 bool updater_patch(void) {
 
-    const int HEADER_LEN            = 32;
-    const int MAGIC_BYTES_LEN       = 8;
-    const int CTRLEN_OFFSET         = 8;
-    const int DATALEN_OFFSET        = 16;
-    const int NEWFILE_SIZE_OFFSET   = 24;
-
     bool status = false;                    // Status to be returned (true for success, false otherwise)
-    unsigned char header[HEADER_LEN], buf[8];
-
-    uint32_t patch_offset;                  // Offset of the patch file in the flash
+    updater_patch_t patch = { .buf = NULL };
+    uint32_t slot_offset;                   // Offset of the slot holding the patch file, where the new image goes
+    uint32_t slot_size;
     uint32_t patch_size;                    // Size of the patch file
-    uint32_t old_bin_offset;                // Offset of the old/current binary image in the flash
+    uint32_t patch_area;                    // Sectors taken by the patch file
+    uint32_t scratch_size;
+    uint32_t old_size;
     uint32_t newsize;
-    uint32_t bzctrllen, bzdatalen, xtralen; // Lengths of various blocks in the patch file
+    int ret;
 
     printf("Patching the binary...\n");
     // Since we haven't switched the active partition, the next partition
     // returned by this function will be the one containing the downloaded patch
     // file NOTE: This also reads the BOOT INFO so we don't have to explicitly
     // read it
-    patch_offset = updater_ota_next_slot_address();
+    slot_offset = updater_ota_next_slot_address();
+    slot_size = updater_slot_size();
     patch_size = boot_info.size;            // boot_info.patch_size;
+    patch.offset = slot_offset;
 
     // Getting the offset of the current image in the flash
     if (boot_info.ActiveImg == IMG_ACT_FACTORY) {
-        old_bin_offset = IMG_FACTORY_OFFSET;
+        patch.old_offset = IMG_FACTORY_OFFSET;
     } else {
-        old_bin_offset = (esp32_get_chip_rev() > 0 ? IMG_UPDATE1_OFFSET_8MB : IMG_UPDATE1_OFFSET_4MB);
+        patch.old_offset = (esp32_get_chip_rev() > 0 ? IMG_UPDATE1_OFFSET_8MB : IMG_UPDATE1_OFFSET_4MB);
     }
 
-    ESP_LOGI(TAG, "Old_Offset: %d, Offset: %d, Size: %d, ChunkSize: %d, Chunk: %d\n",
-             old_bin_offset, updater_data.offset, updater_data.size, updater_data.chunk_size, updater_data.current_chunk);
-    ESP_LOGI(TAG, "BootInfoSize: %d, BootInfoActiveImg: %d\n",
-             boot_info.size, boot_info.ActiveImg);
-
-    // File format:
-    //     0   8   "BSDIFF40"
-    //     8   8   X
-    //     16  8   Y
-    //     24  8   sizeof(newfile)
-    //     32  X   bzip2(control block)
-    //     32+X    Y   bzip2(diff block)
-    //     32+X+Y  ??? bzip2(extra block)
-    // with control block a set of triples (x,y,z) meaning "add x bytes
-    // from oldfile to x bytes from the diff block; copy y bytes from the
-    // extra block; seek forwards in oldfile by z bytes".
+    ESP_LOGI(TAG, "Old_Offset: %d, Offset: %d, Size: %d\n", patch.old_offset, slot_offset, patch_size);
 
-    // Reading header of the patch file
-
-    if (ESP_OK != updater_spi_flash_read(patch_offset, header, HEADER_LEN, false)) {
-        printf("Error while reading patch file header\n");
+    if ((ret = bspatch_header(&updater_patch_ops, &patch, patch_size, &newsize)) != BSPATCH_OK) {
+        printf("Invalid patch file header: %d\n", ret);
         goto return_status;
     }
 
-    // Check for the appropriate magic
-    if (memcmp(header, "BSDIFF40", MAGIC_BYTES_LEN) != 0) {
-        printf("Invalid header\n");
+    // The new image is written from the start of the slot, where the patch
+    // file is, erasing a sector ahead as it goes.  If there is room, move the
+    // patch to the end of the slot and read it from there while patching;
+    // otherwise fall back to a copy of the whole patch in SPIRAM, which
+    // only boards with SPIRAM have.  The sectors left between the new image
+    // and the patch are the scratch space, with which the patcher needs one
+    // bzip2 decompressor instead of three: 2.3 MB for the bsdiff tool's
+    // bzip2 -9 blocks, about 320 KB for -1.  That is more than the internal
+    // RAM has free, so without SPIRAM the patch must have zlib blocks
+    // (tools/bsdiff_zlib.py), which take about 22 KB, and room in the slot
+    // for both the new image and the patch.
+    patch_area = (patch_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    patch.scratch_offset = slot_offset + ((newsize + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1)) + SPI_FLASH_SEC_SIZE;
+    if (newsize > slot_size) {
+        printf("The patched image of %d bytes doesn't fit in the slot\n", newsize);
         goto return_status;
-    }
-
-    ESP_LOGI(TAG,"Header Verified\n");
-
-    // Reading lengths from header
-    bzctrllen = offtin(header + CTRLEN_OFFSET);
-    bzdatalen = offtin(header + DATALEN_OFFSET);
-    newsize = offtin(header + NEWFILE_SIZE_OFFSET);
-
-    xtralen = patch_size - (HEADER_LEN + bzctrllen + bzdatalen);
-
-    ESP_LOGD(TAG, "CtrlLen: %d, DataLen: %d, NewSize: %d, ExtraLen: %d\n", bzctrllen, bzdatalen, newsize, xtralen);
-
-    if ((bzctrllen < 0) || (bzdatalen < 0) || (newsize < 0) || (xtralen < 0)) {
-        printf("Invalid Block Sizes CtrlLen: %d, DataLen: %d, NewSize: %d, ExtraLen: %d\n", bzctrllen, bzdatalen, newsize, xtralen);
-        goto return_status;
-    }
-
-    // Header is valid, reading the contents of the patch file
-    {
-        const int FLASH_READ_WRITE_SIZE = 512;              // Number of bytes read/written to flash at a time
-
-        uint16_t i = 0;
-        unsigned char *out_buf = NULL;
-        unsigned char *diff_ptr = NULL;
-        unsigned char *xtra_ptr = NULL;
-        unsigned char old_bin_buf[FLASH_READ_WRITE_SIZE];   // Buffer to read parts of old binary
-
-        unsigned char *patch_buf;
-
-        void *ctrl_strm = NULL;
-        void *diff_strm = NULL;
-        void *xtra_strm = NULL;
-
-        int ctrl[3];                                        // Buffer to read control block values from the patch file (NOTE: Its value can be negative)
-                                                            // Used to read (x,y,z) tuples from the Control Block
-        int oldpos = 0;                                     // Read pointer for old binary
-        int newpos = 0;                                     // Read pointer for the patched binary
-
-        unsigned int ctrl_len, diff_len, xtra_len;
-        int ret = 0;
-
-        // Reading the complete patch file
-        patch_buf = heap_caps_malloc(patch_size, MALLOC_CAP_SPIRAM);
-        if (patch_buf == NULL) {
-            printf("Failed to allocate %d bytes for the Patch File\n", patch_size);
-            goto free_mem_and_ret;
-        }
-
-        updater_spi_flash_read(patch_offset, patch_buf, patch_size, false);
-
-        // Creating BZLIB streams for decompression
-        ret = BZ2_bzDecompressStreamInit(&ctrl_strm, (char *)patch_buf + 32, bzctrllen);
-        if (ret != BZ_OK) {
-            printf("Failed to init stream for CTRL block. Error code: %d\n", ret);
-            goto free_mem_and_ret;
-        }
-        ret = BZ2_bzDecompressStreamInit(&diff_strm, (char *)patch_buf + 32 + bzctrllen, bzdatalen);
-        if (ret != BZ_OK) {
-            printf("Failed to init stream for DIFF block. Error code: %d\n", ret);
-            goto free_mem_and_ret;
-        }
-        ret = BZ2_bzDecompressStreamInit(&xtra_strm, (char *)patch_buf + 32 + bzctrllen + bzdatalen, xtralen);
-        if (ret != BZ_OK) {
-            printf("Failed to init stream for EXTRA block. Error code: %d\n", ret);
-            goto free_mem_and_ret;
+    } else if (patch.scratch_offset + patch_area <= slot_offset + slot_size) {
+        patch.offset = slot_offset + slot_size - patch_area;
+        if (!updater_patch_move(slot_offset, patch.offset, patch_area)) {
+            printf("Failed to move the patch file\n");
+            goto return_status;
         }
-
-        // Memory for the buffer to store the decompressed blocks
-        const int AVAIL_MEM = 100 * 1024;
-
-        ESP_LOGD(TAG, "Going to allocate memory for decompressed blocks buffer: %d\n", AVAIL_MEM);
-        out_buf = heap_caps_malloc(AVAIL_MEM, MALLOC_CAP_SPIRAM);
-
-        if (out_buf == NULL) {
-            printf("Failed to allocate the buffer memory of size %d\n", AVAIL_MEM);
-            goto free_mem_and_ret;
+        scratch_size = patch.offset - patch.scratch_offset;
+    } else {
+        patch.buf = heap_caps_malloc(patch_size, MALLOC_CAP_SPIRAM);
+        if (patch.buf == NULL) {
+            printf("Failed to allocate %d bytes for the Patch File\n", patch_size);
+            goto return_status;
         }
-
-        // Starting the patching
-
-        // Initializing the parameters of the updater so that the next write is
-        // done from the start of the partition
-        if (!updater_start()) {
-            printf("Failed to START UPDATER\n");
-            goto free_mem_and_ret;
+        if (ESP_OK != updater_spi_flash_read(slot_offset, patch.buf, patch_size, false)) {
+            printf("Error while reading the patch file\n");
+            goto return_status;
         }
+        // the patch file's sectors past the new image are free once copied
+        scratch_size = patch.scratch_offset < slot_offset + slot_size ? slot_offset + slot_size - patch.scratch_offset : 0;
+    }
+    patch.scratch_erased = patch.scratch_offset;
 
-        while (newpos < newsize) {
-            // Reading the control data
-            for (i = 0; i <= 2; i++) {
-                ctrl_len = 8;
-                ret = BZ2_bzDecompressRead(ctrl_strm, (char *)buf, &ctrl_len);
-                if (ret != BZ_OK || ctrl_len != 8) {
-                    printf("PATCHING: Unable to decompress required bytes. ret: %d, ctrl_len: %d, i: %d\n", ret, ctrl_len, i);
-                    goto free_mem_and_ret;
-                }
-
-                ctrl[i] = offtin(buf);
-            }
-
-            // Sanity-check
-            if (newpos + ctrl[0] > newsize) {
-                printf("PATCHING: Corrupt Patch. Violated newsize: %d, ctrl[0]: %d\n", newsize, ctrl[0]);
-                goto free_mem_and_ret;
-            }
-
-            // Decompressing ctrl[0] bytes of diff block
-            while (ctrl[0] > 0) {
-                unsigned int byte_count = 0;
-
-                if (ctrl[0] > AVAIL_MEM) {
-                    ctrl[0] -= AVAIL_MEM;
-                    diff_len = AVAIL_MEM;
-                }
-                else {
-                    diff_len = ctrl[0];
-                    ctrl[0] = 0;
-                }
-
-                ret = BZ2_bzDecompressRead(diff_strm, (char *)out_buf, &diff_len);
-
-                if (ret != BZ_OK) {
-                    printf("PATCHING: Unable to decompress required bytes. ret: %d, ctrl[0]: %d, diff_len: %d\n", ret, ctrl[0], diff_len);
-                    goto free_mem_and_ret;
-                }
-                diff_ptr = out_buf;
-
-                // Reading old binary file in chunks combining it with the Diff
-                // bytes
-                do {
-                    int bytes_to_read = 0;
-
-                    if ((diff_len - byte_count) > FLASH_READ_WRITE_SIZE) {
-                        bytes_to_read = FLASH_READ_WRITE_SIZE;
-                    } else {
-                        bytes_to_read = diff_len - byte_count;
-                    }
-
-                    if (ESP_OK != updater_spi_flash_read(old_bin_offset + oldpos, old_bin_buf, bytes_to_read, false)) {
-                        printf("Error while reading old bin block. old_bin_offset: %u, oldpos: %u, bytes_to_read: %d\n", old_bin_offset, oldpos, bytes_to_read);
-                        goto free_mem_and_ret;
-                    }
-
-                    for (i = 0; i < bytes_to_read; i++) {
-                        *(diff_ptr + i) += old_bin_buf[i];
-                    }
-
-                    if (!updater_write(diff_ptr, bytes_to_read)) {
-                        printf("Failed to write %d bytes to the Flash\n", bytes_to_read);
-                        goto free_mem_and_ret;
-                    }
-
-                    diff_ptr += bytes_to_read;
-                    oldpos += bytes_to_read;
-                    newpos += bytes_to_read;
-                    byte_count += bytes_to_read;
-
-                } while (byte_count < diff_len);
-            }
-
-            // Sanity-check
-            if (newpos + ctrl[1] > newsize) {
-                printf("PATCHING: Corrupt patch, ctrl[1]: %d violated newsize: %d\n", (int)ctrl[1], (int)newsize);
-                goto free_mem_and_ret;
-            }
-
-            // Decompressing Extra Bytes of size ctrl[1]
-            while (ctrl[1] > 0) {
-                if (ctrl[1] > AVAIL_MEM) {
-                    ctrl[1] -= AVAIL_MEM;
-                    xtra_len = AVAIL_MEM;
-                } else {
-                    xtra_len = ctrl[1];
-                    ctrl[1] = 0;
-                }
-
-                ret = BZ2_bzDecompressRead(xtra_strm, (char *)out_buf, &xtra_len);
-
-                if (ret != BZ_OK) {
-                    printf("PATCHING: Unable to decompress required bytes. ret: %d, ctrl[1]: %d, xtra_len: %d\n", ret, ctrl[1], xtra_len);
-                    goto free_mem_and_ret;
-                }
-                xtra_ptr = out_buf;
-
-                // Writing the bytes from the Extra Block
-                int write_size = xtra_len;
-                while (write_size > FLASH_READ_WRITE_SIZE) {
-                    if (!updater_write(xtra_ptr + xtra_len - write_size, FLASH_READ_WRITE_SIZE)) {
-                        printf("Failed to write %d bytes from Extra Block to the Flash\n", FLASH_READ_WRITE_SIZE);
-                        goto free_mem_and_ret;
-                    }
-                    write_size -= FLASH_READ_WRITE_SIZE;
-                }
-
-                if (write_size) {
-                    if (!updater_write(xtra_ptr + xtra_len - write_size, write_size)) {
-                        printf("Failed to write %d bytes from Extra Block to the Flash\n", write_size);
-                        goto free_mem_and_ret;
-                    }
-                }
-                newpos += xtra_len;
-            }
+    // bsdiff was given the image file, which is shorter than its slot
+    old_size = updater_patch_old_size(patch.old_offset, slot_size);
 
-            // Adjust the pointers
-            oldpos += ctrl[2];
-        }
+    // Initializing the parameters of the updater so that the next write is
+    // done from the start of the partition
+    if (!updater_start()) {
+        printf("Failed to START UPDATER\n");
+        goto return_status;
+    }
 
-        ESP_LOGI(TAG, "UPDATER_PATCH: PATCHED: %10d sized file\n", (int)newpos);
+    // nothing has been written to the new image if the scratch space is too
+    // small, patch again with the three blocks side by side
+    ret = bspatch_stream(&updater_patch_ops, &patch, patch_size, old_size, scratch_size, &newsize);
+    if (ret == BSPATCH_ERR_SCRATCH) {
+        ESP_LOGI(TAG, "No room to decompress the patch to the flash, patching in RAM\n");
+        ret = bspatch_stream(&updater_patch_ops, &patch, patch_size, old_size, 0, &newsize);
+    }
+    if (ret != BSPATCH_OK) {
+        printf("PATCHING: failed with error %d at offset %d\n", ret, updater_data.offset - slot_offset);
+        goto return_status;
+    }
 
-        ESP_LOGD(TAG, "UPDATER_PATCH: Old_Offset: %d, Offset: %d, Size: %d, ChunkSize: %d, Chunk: %d\n",
-                 old_bin_offset, updater_data.offset, updater_data.size,
-                 updater_data.chunk_size, updater_data.current_chunk);
+    ESP_LOGI(TAG, "UPDATER_PATCH: PATCHED: %10d sized file\n", (int)newsize);
 
-        status = true;
-        printf("Patching SUCCESSFUL.\n");
-
-    free_mem_and_ret:
-        heap_caps_free(patch_buf);
-        heap_caps_free(out_buf);
-        if (ctrl_strm) {
-            BZ2_bzDecompressStreamEnd(ctrl_strm);
-        }
-        if (diff_strm) {
-            BZ2_bzDecompressStreamEnd(diff_strm);
-        }
-        if (xtra_strm) {
-            BZ2_bzDecompressStreamEnd(xtra_strm);
-        }
-    }
+    status = true;
+    printf("Patching SUCCESSFUL.\n");
 
 return_status:
+    heap_caps_free(patch.buf);
     if (status) {
         // Updating BOOT INFO
         boot_info.PrevImg = boot_info.ActiveImg;
@@ -511,7 +395,120 @@ bool updater_finish (void) {
     return true;
 }
 
+int updater_session_start (uint32_t size, uint32_t chunk_size, const uint8_t *digest) {
+    uint32_t slot = updater_ota_next_slot_address();
+    int ret;
+
+    if (size > updater_slot_size()) {
+        return OTA_SESSION_ERR_PARAM;
+    }
+    ret = ota_session_begin(&updater_session, &updater_session_ops, NULL, slot, size, chunk_size, digest);
+    ESP_LOGI(TAG, "OTA session of %d bytes at 0x%X, resuming at chunk %d\n", size, slot, ret);
+    if (ret >= 0) {
+        // a plain updater_write() sequence can't be mixed with a session
+        updater_data.offset = 0;
+        updater_data.hashed = false;
+    }
+    return ret;
+}
+
+int updater_session_write (uint32_t index, const uint8_t *buf, uint32_t len, const uint8_t *digest) {
+    return ota_session_write(&updater_session, index, buf, len, digest);
+}
+
+void updater_session_abort (void) {
+    ota_session_abort(&updater_session);
+}
+
+bool updater_session_active (void) {
+    return updater_session.active;
+}
+
+bool updater_session_finish (void) {
+    int ret = ota_session_finish(&updater_session);
+
+    if (ret != OTA_SESSION_OK) {
+        ESP_LOGE(TAG, "OTA session failed: %d\n", ret);
+        return false;
+    }
+
+    // hand the image over to updater_finish() as if it had been written
+    // with updater_write()
+    updater_data.offset_start_upd = updater_session.state.slot;
+    updater_data.offset = updater_session.state.slot + updater_session.state.size;
+    updater_data.hash = updater_session.state.hash;
+    updater_data.hashed = true;
+    boot_info.size = updater_session.state.size;
+    return updater_finish();
+}
+
+bool updater_frag_start (uint32_t size) {
+    if (size > updater_slot_size()) {
+        return false;
+    }
+    updater_frag.slot = updater_ota_next_slot_address();
+    updater_frag.size = size;
+    memset(updater_frag.erased, 0, sizeof(updater_frag.erased));
+    updater_frag.active = true;
+    ESP_LOGI(TAG, "Fragmented image of %d bytes at 0x%X\n", size, updater_frag.slot);
+
+    // neither a plain updater_write() sequence nor a session can be mixed with it
+    updater_data.offset = 0;
+    updater_data.hashed = false;
+    updater_session.active = false;
+    return true;
+}
+
+bool updater_frag_write (uint32_t offset, const uint8_t *buf, uint32_t len) {
+    if (!updater_frag_range(offset, len)) {
+        return false;
+    }
+    for (uint32_t sector = offset / SPI_FLASH_SEC_SIZE; sector <= (offset + len - 1) / SPI_FLASH_SEC_SIZE; sector++) {
+        if (!(updater_frag.erased[sector / 8] & (1 << (sector % 8)))) {
+            if (ESP_OK != spi_flash_erase_sector(updater_frag.slot / SPI_FLASH_SEC_SIZE + sector)) {
+                ESP_LOGE(TAG, "Erasing sector failed!\n");
+                return false;
+            }
+            updater_frag.erased[sector / 8] |= 1 << (sector % 8);
+        }
+    }
+    // written as it is, as with updater_write()
+    return (ESP_OK == updater_spi_flash_write(updater_frag.slot + offset, (void *)buf, len, false));
+}
+
+bool updater_frag_read (uint32_t offset, uint8_t *buf, uint32_t len) {
+    return updater_frag_range(offset, len) &&
+           ESP_OK == updater_spi_flash_read(updater_frag.slot + offset, buf, len, false);
+}
+
+bool updater_frag_finish (uint32_t size) {
+    if (!updater_frag.active || size > updater_frag.size) {
+        return false;
+    }
+    updater_frag.active = false;
+
+    // there's no digest computed while writing, the image is read back
+    updater_data.offset_start_upd = updater_frag.slot;
+    updater_data.offset = updater_frag.slot + size;
+    updater_data.hashed = false;
+    boot_info.size = size;
+    if (!updater_verify()) {
+        ESP_LOGE(TAG, "Fragmented image is not valid\n");
+        updater_data.offset = 0;
+        return false;
+    }
+    return updater_finish();
+}
+
 bool updater_verify (void) {
+    // the image was hashed while it was written; if it carries its digest
+    // and that matches there is no need to read it back.  With secure boot
+    // the signature has to be checked as well.
+    if (updater_data.hashed && !esp_secure_boot_enabled() && ota_hash_image_ok(&updater_data.hash)) {
+        ESP_LOGI(TAG, "Image digest verified while writing\n");
+        return true;
+    }
+
     // bootloader verifies anyway the image, but the user can check himself
     // so, the next code is adapted from bootloader/bootloader.c,
 
@@ -580,6 +577,10 @@ bool updater_write_boot_info(boot_info_t *boot_info, uint32_t boot_info_offset)
     return (ESP_OK == ret);
 }
 
+uint32_t updater_slot_size (void) {
+    return (esp32_get_chip_rev() > 0 ? IMG_SIZE_8MB : IMG_SIZE_4MB);
+}
+
 int updater_ota_next_slot_address() {
 
     int ota_offset = (esp32_get_chip_rev() > 0 ? IMG_UPDATE1_OFFSET_8MB : IMG_UPDATE1_OFFSET_4MB);
@@ -694,3 +695,168 @@ static bool updater_is_delta_file(void)
 
     return true;
 }
+
+#ifdef DIFF_UPDATE_ENABLED
+/* @brief Moves size bytes (a whole number of sectors) of the slot up from
+ * 'from' to 'to'. The sectors are copied from the last one down, so that
+ * the ones still to be copied are never overwritten.
+ * @note If power is lost while moving, the patch file is left damaged and
+ * patching fails on the next boot, on a CRC error of its bzip2 blocks.
+ */
+static bool updater_patch_move(uint32_t from, uint32_t to, uint32_t size)
+{
+    bool ret = true;
+    uint8_t *buf = malloc(SPI_FLASH_SEC_SIZE);
+
+    if (buf == NULL) {
+        return false;
+    }
+
+    for (uint32_t off = size; ret && off > 0; ) {
+        off -= SPI_FLASH_SEC_SIZE;
+        ret = (ESP_OK == updater_spi_flash_read(from + off, buf, SPI_FLASH_SEC_SIZE, false)) &&
+              (ESP_OK == spi_flash_erase_sector((to + off) / SPI_FLASH_SEC_SIZE)) &&
+              (ESP_OK == updater_spi_flash_write(to + off, buf, SPI_FLASH_SEC_SIZE, false));
+    }
+
+    free(buf);
+    return ret;
+}
+
+static bool updater_patch_read_patch(void *ctx, uint32_t offset, void *buf, uint32_t len)
+{
+    updater_patch_t *patch = ctx;
+
+    if (patch->buf != NULL) {
+        memcpy(buf, patch->buf + offset, len);
+        return true;
+    }
+    return (ESP_OK == updater_spi_flash_read(patch->offset + offset, buf, len, false));
+}
+
+static bool updater_patch_read_old(void *ctx, uint32_t offset, void *buf, uint32_t len)
+{
+    updater_patch_t *patch = ctx;
+
+    return (ESP_OK == updater_spi_flash_read(patch->old_offset + offset, buf, len, false));
+}
+
+/* @brief The patcher hands over the new image in BSPATCH_OUT_SIZE chunks,
+ * the flash sector size that updater_write() expects at most.
+ */
+static bool updater_patch_write_new(void *ctx, const void *buf, uint32_t len)
+{
+    return updater_write((uint8_t *)buf, len);
+}
+
+/* @brief The scratch space is written once, in order, so its sectors are
+ * erased as they're reached.
+ */
+static bool updater_patch_write_scratch(void *ctx, uint32_t offset, const void *buf, uint32_t len)
+{
+    updater_patch_t *patch = ctx;
+    uint32_t addr = patch->scratch_offset + offset;
+
+    while (patch->scratch_erased < addr + len) {
+        if (ESP_OK != spi_flash_erase_sector(patch->scratch_erased / SPI_FLASH_SEC_SIZE)) {
+            return false;
+        }
+        patch->scratch_erased += SPI_FLASH_SEC_SIZE;
+    }
+    return (ESP_OK == updater_spi_flash_write(addr, (void *)buf, len, false));
+}
+
+static bool updater_patch_read_scratch(void *ctx, uint32_t offset, void *buf, uint32_t len)
+{
+    updater_patch_t *patch = ctx;
+
+    return (ESP_OK == updater_spi_flash_read(patch->scratch_offset + offset, buf, len, false));
+}
+
+/* @brief The length of the running image, as esp_image_verify() finds it by
+ * walking its segments; the whole slot if that fails.
+ */
+static uint32_t updater_patch_old_size(uint32_t old_offset, uint32_t slot_size)
+{
+    esp_image_metadata_t data;
+    const esp_partition_pos_t part_pos = {
+        .offset = old_offset,
+        .size = slot_size,
+    };
+
+    if (ESP_OK == esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &part_pos, &data) && data.image_len <= slot_size) {
+        return data.image_len;
+    }
+    return slot_size;
+}
+
+/* @brief The decompressors' state goes to SPIRAM if there is some, else to
+ * internal RAM, as does the patcher's own few KB.
+ */
+static void *updater_patch_alloc(void *ctx, uint32_t size)
+{
+    void *ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+
+    if (ptr == NULL) {
+        ptr = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    return ptr;
+}
+
+static void updater_patch_free(void *ctx, void *ptr)
+{
+    heap_caps_free(ptr);
+}
+#endif
+
+/* @note As with updater_write(), the data is written as it is, already
+ * encrypted by the OTA server if flash encryption is enabled.
+ */
+static bool updater_session_write_flash(void *ctx, uint32_t offset, const void *buf, uint32_t len)
+{
+    return (ESP_OK == updater_spi_flash_write(updater_session.state.slot + offset, (void *)buf, len, false));
+}
+
+static bool updater_session_erase(void *ctx, uint32_t offset, uint32_t len)
+{
+    for (uint32_t off = 0; off < len; off += SPI_FLASH_SEC_SIZE) {
+        if (ESP_OK != spi_flash_erase_sector((updater_session.state.slot + offset + off) / SPI_FLASH_SEC_SIZE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool updater_frag_range(uint32_t offset, uint32_t len)
+{
+    return updater_frag.active && len > 0 && offset < updater_frag.size && len <= updater_frag.size - offset;
+}
+
+static bool updater_session_nvs_open(void)
+{
+    if (!updater_nvs_opened) {
+        updater_nvs_opened = (ESP_OK == nvs_open(UPDATER_NVS_NAMESPACE, NVS_READWRITE, &updater_nvs_handle));
+    }
+    return updater_nvs_opened;
+}
+
+static bool updater_session_load(void *ctx, void *data, uint32_t len)
+{
+    size_t length = len;
+
+    return updater_session_nvs_open() &&
+           ESP_OK == nvs_get_blob(updater_nvs_handle, UPDATER_NVS_SESSION_KEY, data, &length) && length == len;
+}
+
+static bool updater_session_save(void *ctx, const void *data, uint32_t len)
+{
+    if (!updater_session_nvs_open()) {
+        return false;
+    }
+    if (len == 0) {
+        nvs_erase_key(updater_nvs_handle, UPDATER_NVS_SESSION_KEY);
+    } else if (ESP_OK != nvs_set_blob(updater_nvs_handle, UPDATER_NVS_SESSION_KEY, data, len)) {
+        return false;
+    }
+    return (ESP_OK == nvs_commit(updater_nvs_handle));
+}
@@ -56,12 +56,94 @@ extern bool updater_finish(void);
  * @brief  Verifies the newly written OTA image.
  *
  * @note If Secure Boot is enabled the signature is checked.
- *          Anyway the image integrity (SHA256) is checked.
+ *          Anyway the image integrity (SHA256) is checked; it is computed while the
+ *          image is written, so the image is only read back again if it has no
+ *          digest appended, it doesn't match or Secure Boot is enabled.
  *
  * @return true if boot info was saved successful; false otherwise.
  */
 extern bool updater_verify(void);
 
+/**
+ * @brief  Starts, or resumes, a chunked OTA update of an image of size bytes.
+ *
+ * @note The image is sent as chunks of chunk_size bytes (a multiple of the flash
+ *        sector size, 0 for the default of 16 KB), the last one possibly shorter.
+ *        The progress is saved in NVS after each chunk, so if the download was cut
+ *        off before, the same image is resumed from the first chunk not written.
+ *
+ * @param  size        size of the image
+ * @param  chunk_size  size of the chunks
+ * @param  digest      SHA-256 of the whole image, 32 bytes
+ *
+ * @return the index of the first chunk to send, or a negative OTA_SESSION_ERR_ code.
+ */
+extern int updater_session_start(uint32_t size, uint32_t chunk_size, const uint8_t *digest);
+
+/**
+ * @brief  Writes a chunk of the image started with updater_session_start().
+ *
+ * @note Each chunk is hashed as received, not read back; the file digest is checked
+ *        by updater_session_finish(). A chunk given with its own digest is checked
+ *        before it is written, and the progress only saved if it matches. Chunks
+ *        already written are ignored.
+ *
+ * @param  digest      SHA-256 of the chunk, 32 bytes, or NULL
+ *
+ * @return the index of the next chunk to send, or a negative OTA_SESSION_ERR_ code.
+ */
+extern int updater_session_write(uint32_t index, const uint8_t *buf, uint32_t len, const uint8_t *digest);
+
+/**
+ * @brief  Forgets the progress of a chunked OTA update, the next one starts over.
+ */
+extern void updater_session_abort(void);
+
+/**
+ * @brief  Checks whether a chunked OTA update is in progress.
+ */
+extern bool updater_session_active(void);
+
+/**
+ * @brief  Closes a chunked OTA update: checks that all the chunks were written and
+ *          the image's SHA-256, then updates the boot info as updater_finish().
+ *
+ * @note The saved progress is only forgotten once the SHA-256 matches; after a
+ *        mismatch the update stays open until updater_session_abort().
+ *
+ * @return true if the image is complete and the boot info was saved.
+ */
+extern bool updater_session_finish(void);
+
+/**
+ * @brief  Starts an update of an image written in any order, in pieces at any
+ *          offset, such as the one rebuilt from a LoRaWAN fragmented data block.
+ *
+ * @note Each place of the size bytes from the start of the next OTA slot can be
+ *        written once; they may hold more than the image, as scratch space.
+ *
+ * @return true if it fits in the slot.
+ */
+extern bool updater_frag_start(uint32_t size);
+
+/**
+ * @brief  Writes len bytes at offset, of the image started with updater_frag_start().
+ */
+extern bool updater_frag_write(uint32_t offset, const uint8_t *buf, uint32_t len);
+
+/**
+ * @brief  Reads back len bytes at offset, that were written with updater_frag_write().
+ */
+extern bool updater_frag_read(uint32_t offset, uint8_t *buf, uint32_t len);
+
+/**
+ * @brief  Closes an update started with updater_frag_start(): the image, the first
+ *          size bytes, is verified, then the boot info updated as updater_finish().
+ *
+ * @return true if the image is valid and the boot info was saved.
+ */
+extern bool updater_frag_finish(uint32_t size);
+
 /**
  * @brief  Reads the boot information, what partition is going to be booted from.
  *
@@ -79,6 +161,11 @@ extern bool updater_read_boot_info(boot_info_t *boot_info, uint32_t *boot_info_o
  */
 extern int updater_ota_next_slot_address();
 
+/**
+ * @brief  Returns the size of an OTA partition, the largest image it takes.
+ */
+extern uint32_t updater_slot_size(void);
+
 /**
  * @brief  Writes the boot information into the otadata partition.
  *
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flash_sim.h"
+
+flash_sim_t flash_sim;
+
+void flash_sim_init(uint32_t n_blocks) {
+    flash_sim.size = n_blocks * FLASH_SIM_BLOCK_SIZE;
+    flash_sim.mem = malloc(flash_sim.size);
+    memset(flash_sim.mem, 0xff, flash_sim.size);
+    flash_sim.block_erases = calloc(n_blocks, sizeof(uint32_t));
+    flash_sim_reset_stats();
+    flash_sim_power_on();
+}
+
+void flash_sim_deinit(void) {
+    free(flash_sim.mem);
+    free(flash_sim.block_erases);
+    memset(&flash_sim, 0, sizeof(flash_sim));
+}
+
+void flash_sim_reset_stats(void) {
+    flash_sim.erases = 0;
+    flash_sim.bytes_written = 0;
+    flash_sim.bytes_read = 0;
+    memset(flash_sim.block_erases, 0, flash_sim.size / FLASH_SIM_BLOCK_SIZE * sizeof(uint32_t));
+}
+
+uint32_t flash_sim_max_erases(void) {
+    uint32_t max = 0;
+    for (uint32_t i = 0; i < flash_sim.size / FLASH_SIM_BLOCK_SIZE; i++) {
+        if (flash_sim.block_erases[i] > max) {
+            max = flash_sim.block_erases[i];
+        }
+    }
+    return max;
+}
+
+void flash_sim_power_fail_after(int32_t n) {
+    flash_sim.fail_after = n;
+}
+
+void flash_sim_power_on(void) {
+    flash_sim.fail_after = -1;
+    flash_sim.powered_off = 0;
+}
+
+// Returns non-zero if the operation must fail, and whether it is torn
+static int flash_sim_check_power(int *torn) {
+    *torn = 0;
+    if (flash_sim.powered_off) {
+        return 1;
+    }
+    if (flash_sim.fail_after == 0) {
+        flash_sim.powered_off = 1;
+        *torn = 1;
+        return 1;
+    }
+    if (flash_sim.fail_after > 0) {
+        flash_sim.fail_after--;
+    }
+    return 0;
+}
+
+int flash_sim_read(uint32_t addr, void *buf, uint32_t len) {
+    if (addr + len > flash_sim.size) {
+        return -1;
+    }
+    memcpy(buf, flash_sim.mem + addr, len);
+    flash_sim.bytes_read += len;
+    return 0;
+}
+
+int flash_sim_erase(uint32_t addr) {
+    if (addr % FLASH_SIM_BLOCK_SIZE != 0 || addr >= flash_sim.size) {
+        return -1;
+    }
+    int torn;
+    if (flash_sim_check_power(&torn)) {
+        if (torn) {
+            memset(flash_sim.mem + addr, 0xff, FLASH_SIM_BLOCK_SIZE / 2);
+        }
+        return -1;
+    }
+    memset(flash_sim.mem + addr, 0xff, FLASH_SIM_BLOCK_SIZE);
+    flash_sim.block_erases[addr / FLASH_SIM_BLOCK_SIZE]++;
+    flash_sim.erases++;
+    return 0;
+}
+
+int flash_sim_write(uint32_t addr, const void *buf, uint32_t len) {
+    if (addr + len > flash_sim.size) {
+        return -1;
+    }
+    const uint8_t *src = buf;
+    int torn;
+    if (flash_sim_check_power(&torn)) {
+        for (uint32_t i = 0; torn && i < len / 2; i++) {
+            flash_sim.mem[addr + i] &= src[i];
+        }
+        return -1;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        flash_sim.mem[addr + i] &= src[i];
+    }
+    flash_sim.bytes_written += len;
+    return 0;
+}
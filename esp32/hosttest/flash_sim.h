@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef FLASH_SIM_H_
+#define FLASH_SIM_H_
+
+#include <stdint.h>
+
+// RAM-backed NOR flash standing in for the spi_flash_* functions on a host.
+// Programming can only clear bits, like the real part, and every operation
+// is counted.
+
+#define FLASH_SIM_BLOCK_SIZE    (4096)
+
+typedef struct _flash_sim_t {
+    uint8_t *mem;
+    uint32_t size;
+    uint32_t *block_erases;         // erase count per block
+    uint32_t erases;
+    uint32_t bytes_written;
+    uint32_t bytes_read;
+    int32_t fail_after;             // operations left before power fails, -1 for never
+    int powered_off;
+} flash_sim_t;
+
+extern flash_sim_t flash_sim;
+
+void flash_sim_init(uint32_t n_blocks);
+void flash_sim_deinit(void);
+void flash_sim_reset_stats(void);
+uint32_t flash_sim_max_erases(void);
+
+// Simulates a power failure during the n-th erase or write from now: that
+// operation is only half done and it and all later ones fail, until
+// flash_sim_power_on() is called.
+void flash_sim_power_fail_after(int32_t n);
+void flash_sim_power_on(void);
+
+// same conventions as sflash_cache_ops_t: byte addresses, 0 on success
+int flash_sim_read(uint32_t addr, void *buf, uint32_t len);
+int flash_sim_erase(uint32_t addr);
+int flash_sim_write(uint32_t addr, const void *buf, uint32_t len);
+
+#endif /* FLASH_SIM_H_ */
@@ -0,0 +1,923 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The streaming patcher used for differential updates, against patches made
+// by bsdiff's own algorithm (the generator below is bsdiff 4.3 with its
+// output in memory) and compressed with the bundled bzlib, and the same
+// converted to zlib blocks as tools/bsdiff_zlib.py does.  Checks that the
+// new file comes out in order and in whole sectors, that the memory used
+// stays bounded, with and without scratch space, and that damaged patches
+// are refused.
+//
+// Run as "test_bspatch oldfile newfile patchfile" it applies a patch made by
+// the bsdiff tool, the same way the updater does; "test_bspatch -images
+// oldfile newfile" writes a pair of images to make one from, and
+// "test_bspatch -fixture oldfile newfile patchfile" a small pair and their
+// patch (see the Makefile's test_bspatch_fixture and test_bspatch_tool).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <zlib.h>
+
+#include "bzlib.h"
+#include "bsdiff_api.h"
+
+#define IMG_SIZE            (300 * 1024)
+#define SECTOR_SIZE         (4096)
+#define FIXTURE_SIZE        (32 * 1024)
+
+// the converter's default window
+#define ZLIB_WBITS          (12)
+
+/******************************************************************************
+ bsdiff
+ ******************************************************************************/
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+static void split(int64_t *I, int64_t *V, int64_t start, int64_t len, int64_t h) {
+    int64_t i, j, k, x, tmp, jj, kk;
+
+    if (len < 16) {
+        for (k = start; k < start + len; k += j) {
+            j = 1;
+            x = V[I[k] + h];
+            for (i = 1; k + i < start + len; i++) {
+                if (V[I[k + i] + h] < x) {
+                    x = V[I[k + i] + h];
+                    j = 0;
+                }
+                if (V[I[k + i] + h] == x) {
+                    tmp = I[k + j]; I[k + j] = I[k + i]; I[k + i] = tmp;
+                    j++;
+                }
+            }
+            for (i = 0; i < j; i++) {
+                V[I[k + i]] = k + j - 1;
+            }
+            if (j == 1) {
+                I[k] = -1;
+            }
+        }
+        return;
+    }
+
+    x = V[I[start + len / 2] + h];
+    jj = 0;
+    kk = 0;
+    for (i = start; i < start + len; i++) {
+        if (V[I[i] + h] < x) {
+            jj++;
+        }
+        if (V[I[i] + h] == x) {
+            kk++;
+        }
+    }
+    jj += start;
+    kk += jj;
+
+    i = start;
+    j = 0;
+    k = 0;
+    while (i < jj) {
+        if (V[I[i] + h] < x) {
+            i++;
+        } else if (V[I[i] + h] == x) {
+            tmp = I[i]; I[i] = I[jj + j]; I[jj + j] = tmp;
+            j++;
+        } else {
+            tmp = I[i]; I[i] = I[kk + k]; I[kk + k] = tmp;
+            k++;
+        }
+    }
+    while (jj + j < kk) {
+        if (V[I[jj + j] + h] == x) {
+            j++;
+        } else {
+            tmp = I[jj + j]; I[jj + j] = I[kk + k]; I[kk + k] = tmp;
+            k++;
+        }
+    }
+
+    if (jj > start) {
+        split(I, V, start, jj - start, h);
+    }
+    for (i = 0; i < kk - jj; i++) {
+        V[I[jj + i]] = kk - 1;
+    }
+    if (jj == kk - 1) {
+        I[jj] = -1;
+    }
+    if (start + len > kk) {
+        split(I, V, kk, start + len - kk, h);
+    }
+}
+
+static void qsufsort(int64_t *I, int64_t *V, const uint8_t *old, int64_t oldsize) {
+    int64_t buckets[256];
+    int64_t i, h, len;
+
+    memset(buckets, 0, sizeof(buckets));
+    for (i = 0; i < oldsize; i++) {
+        buckets[old[i]]++;
+    }
+    for (i = 1; i < 256; i++) {
+        buckets[i] += buckets[i - 1];
+    }
+    for (i = 255; i > 0; i--) {
+        buckets[i] = buckets[i - 1];
+    }
+    buckets[0] = 0;
+
+    for (i = 0; i < oldsize; i++) {
+        I[++buckets[old[i]]] = i;
+    }
+    I[0] = oldsize;
+    for (i = 0; i < oldsize; i++) {
+        V[i] = buckets[old[i]];
+    }
+    V[oldsize] = 0;
+    for (i = 1; i < 256; i++) {
+        if (buckets[i] == buckets[i - 1] + 1) {
+            I[buckets[i]] = -1;
+        }
+    }
+    I[0] = -1;
+
+    for (h = 1; I[0] != -(oldsize + 1); h += h) {
+        len = 0;
+        for (i = 0; i < oldsize + 1;) {
+            if (I[i] < 0) {
+                len -= I[i];
+                i -= I[i];
+            } else {
+                if (len) {
+                    I[i - len] = -len;
+                }
+                len = V[I[i]] + 1 - i;
+                split(I, V, i, len, h);
+                i += len;
+                len = 0;
+            }
+        }
+        if (len) {
+            I[i - len] = -len;
+        }
+    }
+
+    for (i = 0; i < oldsize + 1; i++) {
+        I[V[i]] = i;
+    }
+}
+
+static int64_t matchlen(const uint8_t *old, int64_t oldsize, const uint8_t *new, int64_t newsize) {
+    int64_t i;
+
+    for (i = 0; i < oldsize && i < newsize; i++) {
+        if (old[i] != new[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int64_t search(const int64_t *I, const uint8_t *old, int64_t oldsize,
+                      const uint8_t *new, int64_t newsize, int64_t st, int64_t en, int64_t *pos) {
+    int64_t x, y;
+
+    if (en - st < 2) {
+        x = matchlen(old + I[st], oldsize - I[st], new, newsize);
+        y = matchlen(old + I[en], oldsize - I[en], new, newsize);
+        if (x > y) {
+            *pos = I[st];
+            return x;
+        } else {
+            *pos = I[en];
+            return y;
+        }
+    }
+
+    x = st + (en - st) / 2;
+    if (memcmp(old + I[x], new, MIN(oldsize - I[x], newsize)) < 0) {
+        return search(I, old, oldsize, new, newsize, x, en, pos);
+    } else {
+        return search(I, old, oldsize, new, newsize, st, x, pos);
+    }
+}
+
+static void offtout(int64_t x, uint8_t *buf) {
+    uint64_t y = x < 0 ? -x : x;
+
+    for (int i = 0; i < 8; i++) {
+        buf[i] = y & 0xff;
+        y >>= 8;
+    }
+    if (x < 0) {
+        buf[7] |= 0x80;
+    }
+}
+
+static uint8_t *bz_compress(const uint8_t *src, uint32_t len, int level, uint32_t *out_len) {
+    unsigned int dest_len = len + len / 100 + 600;
+    uint8_t *dest = malloc(dest_len);
+
+    assert(BZ2_bzBuffToBuffCompress((char *)dest, &dest_len, (char *)src, len, level, 0, 0) == BZ_OK);
+    *out_len = dest_len;
+    return dest;
+}
+
+// Makes a BSDIFF40 patch from old to new, with its blocks compressed at the
+// given bzip2 level; returns it in a malloc'ed buffer.
+static uint8_t *bsdiff(const uint8_t *old, int64_t oldsize, const uint8_t *new, int64_t newsize,
+                       int level, uint32_t *patch_len) {
+    int64_t *I = malloc((oldsize + 1) * sizeof(int64_t));
+    int64_t *V = malloc((oldsize + 1) * sizeof(int64_t));
+    uint8_t *db = malloc(newsize + 1);
+    uint8_t *eb = malloc(newsize + 1);
+    uint8_t *cb = malloc((newsize + 1) * 24);
+    int64_t dblen = 0, eblen = 0, cblen = 0;
+    int64_t scan = 0, pos = 0, len = 0;
+    int64_t lastscan = 0, lastpos = 0, lastoffset = 0;
+    int64_t oldscore, scsc;
+    int64_t s, Sf, lenf, Sb, lenb;
+    int64_t overlap, Ss, lens;
+    int64_t i;
+
+    qsufsort(I, V, old, oldsize);
+    free(V);
+
+    while (scan < newsize) {
+        oldscore = 0;
+
+        for (scsc = scan += len; scan < newsize; scan++) {
+            len = search(I, old, oldsize, new + scan, newsize - scan, 0, oldsize, &pos);
+
+            for (; scsc < scan + len; scsc++) {
+                if (scsc + lastoffset < oldsize && old[scsc + lastoffset] == new[scsc]) {
+                    oldscore++;
+                }
+            }
+            if ((len == oldscore && len != 0) || len > oldscore + 8) {
+                break;
+            }
+            if (scan + lastoffset < oldsize && old[scan + lastoffset] == new[scan]) {
+                oldscore--;
+            }
+        }
+
+        if (len != oldscore || scan == newsize) {
+            s = 0;
+            Sf = 0;
+            lenf = 0;
+            for (i = 0; lastscan + i < scan && lastpos + i < oldsize;) {
+                if (old[lastpos + i] == new[lastscan + i]) {
+                    s++;
+                }
+                i++;
+                if (s * 2 - i > Sf * 2 - lenf) {
+                    Sf = s;
+                    lenf = i;
+                }
+            }
+
+            lenb = 0;
+            if (scan < newsize) {
+                s = 0;
+                Sb = 0;
+                for (i = 1; scan >= lastscan + i && pos >= i; i++) {
+                    if (old[pos - i] == new[scan - i]) {
+                        s++;
+                    }
+                    if (s * 2 - i > Sb * 2 - lenb) {
+                        Sb = s;
+                        lenb = i;
+                    }
+                }
+            }
+
+            if (lastscan + lenf > scan - lenb) {
+                overlap = (lastscan + lenf) - (scan - lenb);
+                s = 0;
+                Ss = 0;
+                lens = 0;
+                for (i = 0; i < overlap; i++) {
+                    if (new[lastscan + lenf - overlap + i] == old[lastpos + lenf - overlap + i]) {
+                        s++;
+                    }
+                    if (new[scan - lenb + i] == old[pos - lenb + i]) {
+                        s--;
+                    }
+                    if (s > Ss) {
+                        Ss = s;
+                        lens = i + 1;
+                    }
+                }
+                lenf += lens - overlap;
+                lenb -= lens;
+            }
+
+            for (i = 0; i < lenf; i++) {
+                db[dblen + i] = new[lastscan + i] - old[lastpos + i];
+            }
+            for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++) {
+                eb[eblen + i] = new[lastscan + lenf + i];
+            }
+            dblen += lenf;
+            eblen += (scan - lenb) - (lastscan + lenf);
+
+            offtout(lenf, cb + cblen);
+            offtout((scan - lenb) - (lastscan + lenf), cb + cblen + 8);
+            offtout((pos - lenb) - (lastpos + lenf), cb + cblen + 16);
+            cblen += 24;
+
+            lastscan = scan - lenb;
+            lastpos = pos - lenb;
+            lastoffset = pos - scan;
+        }
+    }
+    free(I);
+
+    uint32_t zc_len, zd_len, ze_len;
+    uint8_t *zc = bz_compress(cb, cblen, level, &zc_len);
+    uint8_t *zd = bz_compress(db, dblen, level, &zd_len);
+    uint8_t *ze = bz_compress(eb, eblen, level, &ze_len);
+    free(cb);
+    free(db);
+    free(eb);
+
+    *patch_len = BSPATCH_HEADER_LEN + zc_len + zd_len + ze_len;
+    uint8_t *patch = malloc(*patch_len);
+    memcpy(patch, "BSDIFF40", 8);
+    offtout(zc_len, patch + 8);
+    offtout(zd_len, patch + 16);
+    offtout(newsize, patch + 24);
+    memcpy(patch + BSPATCH_HEADER_LEN, zc, zc_len);
+    memcpy(patch + BSPATCH_HEADER_LEN + zc_len, zd, zd_len);
+    memcpy(patch + BSPATCH_HEADER_LEN + zc_len + zd_len, ze, ze_len);
+    free(zc);
+    free(zd);
+    free(ze);
+    return patch;
+}
+
+static uint8_t *deflate_block(const uint8_t *src, uint32_t len, int wbits, uint32_t *out_len) {
+    z_stream z;
+    uint8_t *dest;
+
+    memset(&z, 0, sizeof(z));
+    assert(deflateInit2(&z, 9, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    dest = malloc(deflateBound(&z, len));
+    z.next_in = (uint8_t *)src;
+    z.avail_in = len;
+    z.next_out = dest;
+    z.avail_out = deflateBound(&z, len);
+    assert(deflate(&z, Z_FINISH) == Z_STREAM_END);
+    *out_len = z.total_out;
+    deflateEnd(&z);
+    return dest;
+}
+
+// Converts a BSDIFF40 patch to BSDIFZ40, the blocks recompressed with zlib
+// and the given window, as tools/bsdiff_zlib.py does.
+static uint8_t *bsdiff_zlib(const uint8_t *patch, uint32_t patch_len, int wbits, uint32_t *out_len) {
+    uint32_t offset[4], zlen[3];
+    uint8_t *z[3];
+    int32_t ctrl_len, diff_len;
+
+    assert(memcmp(patch, "BSDIFF40", 8) == 0);
+    assert(offtin(patch + 8, &ctrl_len) && offtin(patch + 16, &diff_len));
+    offset[0] = BSPATCH_HEADER_LEN;
+    offset[1] = offset[0] + ctrl_len;
+    offset[2] = offset[1] + diff_len;
+    offset[3] = patch_len;
+    *out_len = BSPATCH_HEADER_LEN;
+    for (int i = 0; i < 3; i++) {
+        unsigned int len = 2 * IMG_SIZE * 24;
+        uint8_t *raw = malloc(len);
+        assert(BZ2_bzBuffToBuffDecompress((char *)raw, &len, (char *)patch + offset[i], offset[i + 1] - offset[i],
+                                          0, 0) == BZ_OK);
+        z[i] = deflate_block(raw, len, wbits, &zlen[i]);
+        *out_len += zlen[i];
+        free(raw);
+    }
+
+    uint8_t *out = malloc(*out_len);
+    uint8_t *o = out + BSPATCH_HEADER_LEN;
+    memcpy(out, "BSDIFZ40", 8);
+    offtout(zlen[0], out + 8);
+    offtout(zlen[1], out + 16);
+    memcpy(out + 24, patch + 24, 8);
+    for (int i = 0; i < 3; i++) {
+        memcpy(o, z[i], zlen[i]);
+        o += zlen[i];
+        free(z[i]);
+    }
+    return out;
+}
+
+/******************************************************************************
+ patcher ops, over memory
+ ******************************************************************************/
+
+typedef struct _patch_ctx_t {
+    const uint8_t *patch;
+    uint32_t patch_len;
+    const uint8_t *old;
+    uint32_t old_len;
+    uint8_t *new;
+    uint32_t new_max;
+    uint32_t new_len;
+    uint32_t writes;
+    uint32_t short_writes;          // writes of less than a sector
+    uint8_t *scratch;
+    uint32_t scratch_len;           // written so far, in order
+    size_t mem;                     // currently allocated
+    size_t mem_peak;
+} patch_ctx_t;
+
+static bool ops_read_patch(void *ctx, uint32_t offset, void *buf, uint32_t len) {
+    patch_ctx_t *p = ctx;
+
+    assert(len <= BSPATCH_IN_SIZE || (offset == 0 && len == BSPATCH_HEADER_LEN));
+    if ((uint64_t)offset + len > p->patch_len) {
+        return false;
+    }
+    memcpy(buf, p->patch + offset, len);
+    return true;
+}
+
+static bool ops_read_old(void *ctx, uint32_t offset, void *buf, uint32_t len) {
+    patch_ctx_t *p = ctx;
+
+    assert(len <= BSPATCH_IN_SIZE);
+    assert((uint64_t)offset + len <= p->old_len);
+    memcpy(buf, p->old + offset, len);
+    return true;
+}
+
+static bool ops_write_new(void *ctx, const void *buf, uint32_t len) {
+    patch_ctx_t *p = ctx;
+
+    assert(len > 0 && len <= BSPATCH_OUT_SIZE);
+    if (p->new_len + len > p->new_max) {
+        return false;
+    }
+    memcpy(p->new + p->new_len, buf, len);
+    p->new_len += len;
+    p->writes++;
+    if (len < BSPATCH_OUT_SIZE) {
+        p->short_writes++;
+    }
+    return true;
+}
+
+static bool ops_write_scratch(void *ctx, uint32_t offset, const void *buf, uint32_t len) {
+    patch_ctx_t *p = ctx;
+
+    // once, in order, and all of it before the new file
+    assert(len > 0 && len <= BSPATCH_OUT_SIZE);
+    assert(offset == p->scratch_len);
+    assert(p->new_len == 0);
+    p->scratch = realloc(p->scratch, offset + len);
+    memcpy(p->scratch + offset, buf, len);
+    p->scratch_len += len;
+    return true;
+}
+
+static bool ops_read_scratch(void *ctx, uint32_t offset, void *buf, uint32_t len) {
+    patch_ctx_t *p = ctx;
+
+    assert((uint64_t)offset + len <= p->scratch_len);
+    memcpy(buf, p->scratch + offset, len);
+    return true;
+}
+
+static void *ops_alloc(void *ctx, uint32_t size) {
+    patch_ctx_t *p = ctx;
+    size_t *m = malloc(sizeof(size_t) + size);
+
+    if (m == NULL) {
+        return NULL;
+    }
+    *m = size;
+    p->mem += size;
+    if (p->mem > p->mem_peak) {
+        p->mem_peak = p->mem;
+    }
+    return m + 1;
+}
+
+static void ops_free(void *ctx, void *ptr) {
+    patch_ctx_t *p = ctx;
+
+    if (ptr != NULL) {
+        size_t *m = (size_t *)ptr - 1;
+        p->mem -= *m;
+        free(m);
+    }
+}
+
+static const bspatch_ops_t ops = {
+    .read_patch = ops_read_patch,
+    .read_old = ops_read_old,
+    .write_new = ops_write_new,
+    .write_scratch = ops_write_scratch,
+    .read_scratch = ops_read_scratch,
+    .alloc = ops_alloc,
+    .free = ops_free,
+};
+
+static int apply_scratch(patch_ctx_t *p, const uint8_t *patch, uint32_t patch_len, const uint8_t *old, uint32_t old_len,
+                         uint8_t *new, uint32_t new_max, uint32_t scratch_size) {
+    uint32_t new_size = 0;
+    int ret;
+
+    memset(p, 0, sizeof(*p));
+    p->patch = patch;
+    p->patch_len = patch_len;
+    p->old = old;
+    p->old_len = old_len;
+    p->new = new;
+    p->new_max = new_max;
+    ret = bspatch_stream(&ops, p, patch_len, old_len, scratch_size, &new_size);
+    assert(p->mem == 0);
+    assert(p->scratch_len <= scratch_size);
+    free(p->scratch);
+    p->scratch = NULL;
+    if (ret == BSPATCH_OK) {
+        assert(new_size == p->new_len);
+        // every write but the last is a full sector
+        assert(p->short_writes <= 1);
+    }
+    return ret;
+}
+
+// the three blocks side by side
+static int apply(patch_ctx_t *p, const uint8_t *patch, uint32_t patch_len, const uint8_t *old, uint32_t old_len,
+                 uint8_t *new, uint32_t new_max) {
+    return apply_scratch(p, patch, patch_len, old, old_len, new, new_max, 0);
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void) {
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return rnd_state >> 8;
+}
+
+// Something with the structure of a firmware image: runs of "code" words
+// from a small vocabulary, some zero padding and a few random tables.
+static void make_image(uint8_t *img, uint32_t len) {
+    static const uint32_t words[] = {
+        0x004136e1, 0x1df0b0a1, 0xc0200000, 0x81ff7f20, 0x0088a2c0, 0x3c0c8101, 0x00051ce5, 0xf01d0000,
+    };
+    uint32_t i = 0;
+
+    while (i < len) {
+        uint32_t kind = rnd() % 16;
+        uint32_t n = 64 + rnd() % 2048;
+        if (n > len - i) {
+            n = len - i;
+        }
+        for (uint32_t j = 0; j < n; j++) {
+            if (kind == 0) {
+                img[i + j] = 0;
+            } else if (kind == 1) {
+                img[i + j] = rnd();
+            } else {
+                img[i + j] = words[((i + j) / 4 + kind) % 8] >> (8 * ((i + j) % 4));
+            }
+        }
+        i += n;
+    }
+}
+
+// A new version of an image: a few patched bytes, inserted and removed
+// ranges (which shift everything after them) and, if grow, a longer tail.
+static uint32_t make_new_image(uint8_t *new, const uint8_t *old, uint32_t old_len, bool grow) {
+    uint32_t o = 0, n = 0;
+
+    while (o < old_len) {
+        uint32_t run = 1000 + rnd() % 20000;
+        if (run > old_len - o) {
+            run = old_len - o;
+        }
+        memcpy(new + n, old + o, run);
+        o += run;
+        n += run;
+        switch (rnd() % 4) {
+            case 0:
+                // changed addresses
+                for (uint32_t j = 0; j < 20 && n > 4; j++) {
+                    new[n - 1 - rnd() % (run < 4 ? 1 : run / 4) * 4] += 4;
+                }
+                break;
+            case 1: {
+                uint32_t ins = 1 + rnd() % 300;
+                for (uint32_t j = 0; j < ins; j++) {
+                    new[n++] = rnd();
+                }
+                break;
+            }
+            case 2:
+                o += rnd() % 200;
+                break;
+        }
+    }
+    if (grow) {
+        for (uint32_t j = 0; j < 10000; j++) {
+            new[n++] = rnd();
+        }
+    }
+    return n;
+}
+
+static uint8_t *old_img, *new_img, *out_img;
+
+static void check_patch(const char *name, const uint8_t *old, uint32_t old_len, const uint8_t *new, uint32_t new_len,
+                        int level) {
+    patch_ctx_t p;
+    uint32_t patch_len;
+    uint8_t *patch = bsdiff(old, old_len, new, new_len, level, &patch_len);
+
+    memset(out_img, 0xA5, 2 * IMG_SIZE);
+    assert(apply(&p, patch, patch_len, old, old_len, out_img, 2 * IMG_SIZE) == BSPATCH_OK);
+    assert(p.new_len == new_len);
+    assert(memcmp(out_img, new, new_len) == 0);
+    printf("%-18s bz%d: old %6u new %6u patch %6u bytes, %4u writes, peak memory %7u bytes",
+           name, level, old_len, new_len, patch_len, p.writes, (unsigned)p.mem_peak);
+    // the patcher's own state is a few KB; the rest is the bzip2 state in
+    // small mode, 2.5 bytes per byte of bzip2 block and some tables
+    assert(p.mem_peak < 3 * (level * 250000 + 70000) + 8192);
+
+    // with scratch space, one decompressor at a time
+    memset(out_img, 0xA5, 2 * IMG_SIZE);
+    assert(apply_scratch(&p, patch, patch_len, old, old_len, out_img, 2 * IMG_SIZE, 2 * IMG_SIZE) == BSPATCH_OK);
+    assert(p.new_len == new_len);
+    assert(memcmp(out_img, new, new_len) == 0);
+    printf(", %7u with %6u bytes of scratch\n", (unsigned)p.mem_peak, p.scratch_len);
+    assert(p.mem_peak < level * 250000 + 70000 + 8192);
+
+    // the same with zlib blocks, which fits in the internal RAM: the three
+    // windows, the patcher's state with the three inflaters in it, and no
+    // scratch space used even if there is some
+    uint32_t zpatch_len;
+    uint8_t *zpatch = bsdiff_zlib(patch, patch_len, ZLIB_WBITS, &zpatch_len);
+    memset(out_img, 0xA5, 2 * IMG_SIZE);
+    assert(apply_scratch(&p, zpatch, zpatch_len, old, old_len, out_img, 2 * IMG_SIZE, 2 * IMG_SIZE) == BSPATCH_OK);
+    assert(p.new_len == new_len);
+    assert(memcmp(out_img, new, new_len) == 0);
+    assert(p.scratch_len == 0);
+    printf("%-18s zlib: patch %6u bytes, peak memory %7u bytes\n", name, zpatch_len, (unsigned)p.mem_peak);
+    assert(p.mem_peak < 3 * (1 << ZLIB_WBITS) + 16384);
+    free(zpatch);
+    free(patch);
+}
+
+static void test_patches(void) {
+    uint32_t new_len;
+
+    make_image(old_img, IMG_SIZE);
+
+    new_len = make_new_image(new_img, old_img, IMG_SIZE, false);
+    check_patch("edits", old_img, IMG_SIZE, new_img, new_len, 1);
+    // what the bsdiff tool makes
+    check_patch("edits", old_img, IMG_SIZE, new_img, new_len, 9);
+
+    new_len = make_new_image(new_img, old_img, IMG_SIZE, true);
+    check_patch("edits, grown", old_img, IMG_SIZE, new_img, new_len, 1);
+
+    check_patch("shrunk", old_img, IMG_SIZE, old_img + 1000, IMG_SIZE / 2, 1);
+    check_patch("unchanged", old_img, IMG_SIZE, old_img, IMG_SIZE, 1);
+
+    for (uint32_t i = 0; i < 50000; i++) {
+        new_img[i] = rnd();
+    }
+    check_patch("unrelated", old_img, 20000, new_img, 50000, 1);
+    check_patch("not a sector", old_img, IMG_SIZE, old_img, 3 * SECTOR_SIZE + 7, 1);
+    check_patch("empty", old_img, IMG_SIZE, new_img, 0, 1);
+}
+
+static void test_offtin(void) {
+    uint8_t buf[8];
+    int32_t v;
+
+    offtout(INT32_MAX, buf);
+    assert(offtin(buf, &v) && v == INT32_MAX);
+    offtout(-INT32_MAX, buf);
+    assert(offtin(buf, &v) && v == -INT32_MAX);
+    offtout((int64_t)INT32_MAX + 1, buf);
+    assert(!offtin(buf, &v));
+    offtout(-((int64_t)1 << 62), buf);
+    assert(!offtin(buf, &v));
+    memset(buf, 0xff, sizeof(buf));
+    assert(!offtin(buf, &v));
+    printf("offsets beyond 32 bits refused\n");
+}
+
+static void test_bad_patches(void) {
+    patch_ctx_t p;
+    uint32_t patch_len, new_len;
+    uint8_t *patch;
+
+    make_image(old_img, IMG_SIZE);
+    new_len = make_new_image(new_img, old_img, IMG_SIZE, true);
+    patch = bsdiff(old_img, IMG_SIZE, new_img, new_len, 1, &patch_len);
+
+    // too short, bad magic, block lengths beyond the end of the patch
+    assert(apply(&p, patch, 16, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_ERR_HEADER);
+    patch[0] ^= 1;
+    assert(apply(&p, patch, patch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_ERR_HEADER);
+    patch[0] ^= 1;
+    int32_t ctrl_len;
+    assert(offtin(patch + 8, &ctrl_len));
+    assert(apply(&p, patch, ctrl_len + 40, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_ERR_HEADER);
+
+    // lengths that don't fit in 32 bits, with or without the sign bit
+    uint8_t saved[8];
+    memcpy(saved, patch + 24, 8);
+    patch[24 + 4] = 0x80;
+    assert(apply(&p, patch, patch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_ERR_HEADER);
+    patch[24 + 7] = 0xff;
+    assert(apply(&p, patch, patch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_ERR_HEADER);
+    memcpy(patch + 24, saved, 8);
+
+    // truncated extra block
+    int ret = apply(&p, patch, patch_len - 100, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE);
+    assert(ret == BSPATCH_ERR_CORRUPT || ret == BSPATCH_ERR_BZIP2);
+
+    // a damaged byte in each block is caught by bzip2's CRCs, or shows up as
+    // control data out of range
+    uint32_t at[3] = {
+        BSPATCH_HEADER_LEN + 20,
+        BSPATCH_HEADER_LEN + ctrl_len + 200,
+        patch_len - 200,
+    };
+    for (int i = 0; i < 3; i++) {
+        patch[at[i]] ^= 0x10;
+        ret = apply(&p, patch, patch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE);
+        assert(ret == BSPATCH_ERR_CORRUPT || ret == BSPATCH_ERR_BZIP2);
+        patch[at[i]] ^= 0x10;
+    }
+
+    // no room for the new file
+    assert(apply(&p, patch, patch_len, old_img, IMG_SIZE, out_img, new_len / 2) == BSPATCH_ERR_WRITE);
+
+    // no room for the control and extra blocks: refused before anything is
+    // written, and fine without scratch space; the same truncated block as
+    // above is refused too
+    assert(apply_scratch(&p, patch, patch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE, 10000) == BSPATCH_ERR_SCRATCH);
+    assert(p.new_len == 0);
+    ret = apply_scratch(&p, patch, patch_len - 100, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE, 2 * IMG_SIZE);
+    assert(ret == BSPATCH_ERR_CORRUPT || ret == BSPATCH_ERR_BZIP2);
+    assert(p.new_len == 0);
+
+    assert(apply(&p, patch, patch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_OK);
+    assert(memcmp(out_img, new_img, new_len) == 0);
+
+    // the zlib blocks: damaged, truncated, or with a window over the maximum
+    uint32_t zpatch_len;
+    uint8_t *zpatch = bsdiff_zlib(patch, patch_len, ZLIB_WBITS, &zpatch_len);
+    assert(apply(&p, zpatch, zpatch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_OK);
+    assert(offtin(zpatch + 8, &ctrl_len));
+    ret = apply(&p, zpatch, zpatch_len - 100, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE);
+    assert(ret == BSPATCH_ERR_CORRUPT || ret == BSPATCH_ERR_BZIP2);
+    at[1] = BSPATCH_HEADER_LEN + ctrl_len + 200;
+    at[2] = zpatch_len - 200;
+    for (int i = 0; i < 3; i++) {
+        zpatch[at[i]] ^= 0x10;
+        ret = apply(&p, zpatch, zpatch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE);
+        assert(ret == BSPATCH_ERR_CORRUPT || ret == BSPATCH_ERR_BZIP2);
+        zpatch[at[i]] ^= 0x10;
+    }
+    // a zlib header that isn't one
+    zpatch[BSPATCH_HEADER_LEN] ^= 0x01;
+    assert(apply(&p, zpatch, zpatch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_ERR_BZIP2);
+    zpatch[BSPATCH_HEADER_LEN] ^= 0x01;
+    free(zpatch);
+#if BSPATCH_ZLIB_MAX_WINDOW < 32768
+    zpatch = bsdiff_zlib(patch, patch_len, 15, &zpatch_len);
+    assert(apply(&p, zpatch, zpatch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_ERR_BLOCK_SIZE);
+    free(zpatch);
+#endif
+    free(patch);
+
+#if BSPATCH_BZIP2_MAX_BLOCK < 9
+    // compressed with blocks too large for the memory there is
+    patch = bsdiff(old_img, IMG_SIZE, new_img, new_len, BSPATCH_BZIP2_MAX_BLOCK + 1, &patch_len);
+    assert(apply(&p, patch, patch_len, old_img, IMG_SIZE, out_img, 2 * IMG_SIZE) == BSPATCH_ERR_BLOCK_SIZE);
+    free(patch);
+#endif
+    printf("bad patches refused\n");
+}
+
+static void write_file(const char *path, const uint8_t *buf, uint32_t len) {
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL || fwrite(buf, 1, len, f) != len || fclose(f) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+static uint8_t *read_file(const char *path, uint32_t *len) {
+    FILE *f = fopen(path, "rb");
+    uint8_t *buf;
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(*len + 1);
+    if (fread(buf, 1, *len, f) != *len) {
+        perror(path);
+        exit(1);
+    }
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 4 && strcmp(argv[1], "-images") != 0) {
+        patch_ctx_t p;
+        uint32_t old_len, patch_len, new_size;
+        uint8_t *old = read_file(argv[1], &old_len);
+        uint8_t *patch = read_file(argv[3], &patch_len);
+        int ret;
+
+        memset(&p, 0, sizeof(p));
+        p.patch = patch;
+        p.patch_len = patch_len;
+        if ((ret = bspatch_header(&ops, &p, patch_len, &new_size)) == BSPATCH_OK) {
+            uint8_t *new = malloc(new_size + 1);
+            ret = apply(&p, patch, patch_len, old, old_len, new, new_size);
+            if (ret == BSPATCH_OK) {
+                printf("%u bytes written, peak memory %u bytes", p.new_len, (unsigned)p.mem_peak);
+                // again as the updater does when there's room in the slot
+                ret = apply_scratch(&p, patch, patch_len, old, old_len, new, new_size, 2 * new_size + 4096);
+            }
+            if (ret == BSPATCH_OK) {
+                printf(", %u with scratch space\n", (unsigned)p.mem_peak);
+                write_file(argv[2], new, p.new_len);
+            }
+        }
+        if (ret != BSPATCH_OK) {
+            fprintf(stderr, "patching failed: %d\n", ret);
+            return 1;
+        }
+        return 0;
+    }
+
+    old_img = malloc(2 * IMG_SIZE);
+    new_img = malloc(2 * IMG_SIZE);
+    out_img = malloc(2 * IMG_SIZE);
+
+    if (argc == 4 && strcmp(argv[1], "-images") == 0) {
+        make_image(old_img, IMG_SIZE);
+        write_file(argv[2], old_img, IMG_SIZE);
+        write_file(argv[3], new_img, make_new_image(new_img, old_img, IMG_SIZE, true));
+        return 0;
+    }
+    if (argc == 5 && strcmp(argv[1], "-fixture") == 0) {
+        uint32_t new_len, patch_len;
+        uint8_t *patch;
+
+        make_image(old_img, FIXTURE_SIZE);
+        new_len = make_new_image(new_img, old_img, FIXTURE_SIZE, false);
+        // as the bsdiff tool makes it, bzip2 -9
+        patch = bsdiff(old_img, FIXTURE_SIZE, new_img, new_len, 9, &patch_len);
+        write_file(argv[2], old_img, FIXTURE_SIZE);
+        write_file(argv[3], new_img, new_len);
+        write_file(argv[4], patch, patch_len);
+        free(patch);
+        return 0;
+    }
+
+    test_offtin();
+    test_patches();
+    test_bad_patches();
+
+    free(old_img);
+    free(new_img);
+    free(out_img);
+    printf("OK\n");
+    return 0;
+}
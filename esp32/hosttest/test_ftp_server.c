@@ -0,0 +1,671 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The FTP server run on loopback sockets, with a stubbed filesystem that
+// keeps its files in RAM under /flash.  The server loop runs in its own
+// thread and the clients in others, as several sessions would on the device.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ftp_server.h"
+
+#define CMD_PORT            (52121)
+#define DATA_PORT           (52124)
+#define MAX_FILES           (160)
+#define BIG_SIZE            (1024 * 1024)
+
+// Estimated cost of a flash read: a fixed overhead per call plus the SPI
+// transfer itself, charged by the stub with usleep
+#define READ_CALL_US        (150)
+#define READ_NS_PER_BYTE    (50)
+
+/******************************************************************************
+ stubbed filesystem
+ ******************************************************************************/
+typedef struct {
+    char path[FTP_SERVER_PATH_MAX];
+    uint8_t *data;
+    uint32_t size;
+    bool dir;
+    bool used;
+} stub_file_t;
+
+typedef struct {
+    stub_file_t *f;
+    uint32_t pos;
+    bool write;
+} stub_handle_t;
+
+typedef struct {
+    char path[FTP_SERVER_PATH_MAX];
+    int next;
+    bool root;
+} stub_dir_t;
+
+static stub_file_t files[MAX_FILES];
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool charge_reads;
+
+static uint8_t *update_data;
+static uint32_t update_size;
+static bool update_finished;
+
+static stub_file_t *stub_find(const char *path) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used && !strcmp(files[i].path, path)) {
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+static stub_file_t *stub_create(const char *path, bool dir) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!files[i].used) {
+            memset(&files[i], 0, sizeof(files[i]));
+            strcpy(files[i].path, path);
+            files[i].dir = dir;
+            files[i].used = true;
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+// only paths in an existing directory can be created
+static bool stub_parent_exists(const char *path) {
+    char parent[FTP_SERVER_PATH_MAX];
+    strcpy(parent, path);
+    *strrchr(parent, '/') = '\0';
+    stub_file_t *f = stub_find(parent);
+    return f != NULL && f->dir;
+}
+
+static void *stub_open(const char *path, bool write) {
+    pthread_mutex_lock(&fs_lock);
+    stub_file_t *f = stub_find(path);
+    if (write && f == NULL && stub_parent_exists(path)) {
+        f = stub_create(path, false);
+    }
+    stub_handle_t *h = NULL;
+    if (f != NULL && !f->dir) {
+        h = calloc(1, sizeof(*h));
+        h->f = f;
+        h->write = write;
+        if (write) {
+            free(f->data);
+            f->data = NULL;
+            f->size = 0;
+        }
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return h;
+}
+
+static int stub_read(void *file, void *buf, uint32_t size, uint32_t *actual) {
+    stub_handle_t *h = file;
+    pthread_mutex_lock(&fs_lock);
+    uint32_t n = h->f->size - h->pos;
+    if (n > size) {
+        n = size;
+    }
+    memcpy(buf, h->f->data + h->pos, n);
+    h->pos += n;
+    *actual = n;
+    pthread_mutex_unlock(&fs_lock);
+    if (charge_reads) {
+        usleep(READ_CALL_US + (uint64_t)size * READ_NS_PER_BYTE / 1000);
+    }
+    return 0;
+}
+
+static int stub_write(void *file, const void *buf, uint32_t size) {
+    stub_handle_t *h = file;
+    pthread_mutex_lock(&fs_lock);
+    h->f->data = realloc(h->f->data, h->f->size + size);
+    memcpy(h->f->data + h->f->size, buf, size);
+    h->f->size += size;
+    pthread_mutex_unlock(&fs_lock);
+    return 0;
+}
+
+static int stub_close(void *file) {
+    free(file);
+    return 0;
+}
+
+static void *stub_opendir(const char *path) {
+    pthread_mutex_lock(&fs_lock);
+    stub_file_t *f = stub_find(path);
+    stub_dir_t *d = NULL;
+    if (!strcmp(path, "/") || (f != NULL && f->dir)) {
+        d = calloc(1, sizeof(*d));
+        strcpy(d->path, path);
+        d->root = !strcmp(path, "/");
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return d;
+}
+
+static int stub_readdir(void *dir, ftp_server_stat_t *st) {
+    stub_dir_t *d = dir;
+    size_t len = strlen(d->path);
+    int res = 0;
+    pthread_mutex_lock(&fs_lock);
+    for ( ; d->next < MAX_FILES; d->next++) {
+        stub_file_t *f = &files[d->next];
+        // the entries directly under the directory
+        const char *name = f->path + (d->root ? 1 : len + 1);
+        if (f->used && !strncmp(f->path, d->path, len) && (d->root || f->path[len] == '/')
+            && strlen(f->path) > len + 1 && strchr(name, '/') == NULL) {
+            st->name = name;
+            st->size = f->size;
+            st->dir = f->dir;
+            st->fdate = ((2020 - 1980) << 9) | (5 << 5) | 20;
+            st->ftime = (10 << 11) | (30 << 5);
+            d->next++;
+            res = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
+
+static void stub_closedir(void *dir) {
+    free(dir);
+}
+
+static int stub_stat(const char *path, ftp_server_stat_t *st) {
+    pthread_mutex_lock(&fs_lock);
+    stub_file_t *f = stub_find(path);
+    if (f != NULL) {
+        st->size = f->size;
+        st->dir = f->dir;
+        st->fdate = ((2020 - 1980) << 9) | (5 << 5) | 20;
+        st->ftime = (10 << 11) | (30 << 5) | 7;
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return f != NULL ? 0 : -1;
+}
+
+static int stub_mkdir(const char *path) {
+    pthread_mutex_lock(&fs_lock);
+    int res = (stub_find(path) == NULL && stub_parent_exists(path) && stub_create(path, true) != NULL) ? 0 : -1;
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
+
+static int stub_remove(const char *path) {
+    pthread_mutex_lock(&fs_lock);
+    stub_file_t *f = stub_find(path);
+    if (f != NULL) {
+        free(f->data);
+        f->data = NULL;
+        f->used = false;
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return f != NULL ? 0 : -1;
+}
+
+static int stub_rename(const char *old_path, const char *new_path) {
+    pthread_mutex_lock(&fs_lock);
+    stub_file_t *f = stub_find(old_path);
+    int res = -1;
+    if (f != NULL && stub_find(new_path) == NULL) {
+        strcpy(f->path, new_path);
+        res = 0;
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
+
+static bool stub_update_check(const char *path) {
+    return !strcmp(path, "/flash/sys/appimg.bin");
+}
+
+static bool stub_update_start(void) {
+    free(update_data);
+    update_data = NULL;
+    update_size = 0;
+    update_finished = false;
+    return true;
+}
+
+static bool stub_update_write(const void *buf, uint32_t len) {
+    update_data = realloc(update_data, update_size + len);
+    memcpy(update_data + update_size, buf, len);
+    update_size += len;
+    return true;
+}
+
+static bool stub_update_finish(void) {
+    update_finished = true;
+    return true;
+}
+
+static bool stub_login(const char *user, const char *pass) {
+    return !strcmp(user, "micro") && !strcmp(pass, "python");
+}
+
+static uint32_t stub_ticks_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t stub_fattime(void) {
+    return ((uint32_t)(((2020 - 1980) << 9) | (6 << 5) | 1) << 16) | (12 << 11);
+}
+
+static uint32_t stub_timeout_ms(void) {
+    return 300000;
+}
+
+static void stub_socket_add(int sd) {
+}
+
+static void stub_socket_close(int sd) {
+    close(sd);
+}
+
+static const ftp_server_ops_t stub_ops = {
+    .open = stub_open,
+    .read = stub_read,
+    .write = stub_write,
+    .close = stub_close,
+    .opendir = stub_opendir,
+    .readdir = stub_readdir,
+    .closedir = stub_closedir,
+    .stat = stub_stat,
+    .mkdir = stub_mkdir,
+    .remove = stub_remove,
+    .rename = stub_rename,
+    .update_check = stub_update_check,
+    .update_start = stub_update_start,
+    .update_write = stub_update_write,
+    .update_finish = stub_update_finish,
+    .login = stub_login,
+    .ticks_ms = stub_ticks_ms,
+    .fattime = stub_fattime,
+    .timeout_ms = stub_timeout_ms,
+    .socket_add = stub_socket_add,
+    .socket_close = stub_socket_close,
+};
+
+/******************************************************************************
+ server thread
+ ******************************************************************************/
+static ftp_server_t server;
+static volatile bool server_stop;
+static pthread_t server_thread;
+
+static void *server_main(void *arg) {
+    while (!server_stop) {
+        ftp_server_run(&server, 10);
+    }
+    ftp_server_stop(&server);
+    return NULL;
+}
+
+static void server_begin(uint32_t buffer_size) {
+    ftp_server_init(&server, &stub_ops, CMD_PORT, DATA_PORT, buffer_size);
+    assert(ftp_server_start(&server));
+    server_stop = false;
+    assert(pthread_create(&server_thread, NULL, server_main, NULL) == 0);
+}
+
+static void server_end(void) {
+    server_stop = true;
+    pthread_join(server_thread, NULL);
+}
+
+/******************************************************************************
+ client
+ ******************************************************************************/
+typedef struct {
+    int sd;
+    char line[512];
+} client_t;
+
+static int tcp_connect(uint32_t addr, uint16_t port) {
+    struct sockaddr_in sa;
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(sd >= 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = addr;
+    sa.sin_port = htons(port);
+    assert(connect(sd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    return sd;
+}
+
+// reads a reply line and returns its code
+static int client_reply(client_t *c) {
+    size_t n = 0;
+    while (n < sizeof(c->line) - 1) {
+        assert(recv(c->sd, &c->line[n], 1, 0) == 1);
+        if (c->line[n++] == '\n') {
+            break;
+        }
+    }
+    c->line[n] = '\0';
+    return atoi(c->line);
+}
+
+static int client_cmd(client_t *c, const char *fmt, ...) {
+    char cmd[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(cmd, sizeof(cmd) - 2, fmt, ap);
+    va_end(ap);
+    strcpy(&cmd[n], "\r\n");
+    assert(send(c->sd, cmd, n + 2, 0) == n + 2);
+    return client_reply(c);
+}
+
+static int client_connect(client_t *c) {
+    c->sd = tcp_connect(htonl(INADDR_LOOPBACK), CMD_PORT);
+    return client_reply(c);
+}
+
+static void client_login(client_t *c) {
+    assert(client_connect(c) == 220);
+    assert(client_cmd(c, "USER micro") == 331);
+    assert(client_cmd(c, "PASS python") == 230);
+}
+
+static void client_quit(client_t *c) {
+    assert(client_cmd(c, "QUIT") == 221);
+    char b;
+    assert(recv(c->sd, &b, 1, 0) == 0);
+    close(c->sd);
+}
+
+static int client_pasv(client_t *c) {
+    unsigned a[6];
+    assert(client_cmd(c, "PASV") == 227);
+    assert(sscanf(strchr(c->line, '('), "(%u,%u,%u,%u,%u,%u)", &a[0], &a[1], &a[2], &a[3], &a[4], &a[5]) == 6);
+    uint32_t addr = htonl((a[0] << 24) | (a[1] << 16) | (a[2] << 8) | a[3]);
+    return tcp_connect(addr, (a[4] << 8) | a[5]);
+}
+
+// returns the number of bytes received, or -1 if the command was refused
+static int client_get(client_t *c, const char *cmd, uint8_t *buf, uint32_t size) {
+    int d_sd = client_pasv(c);
+    uint32_t len = 0;
+    if (client_cmd(c, "%s", cmd) != 150) {
+        close(d_sd);
+        return -1;
+    }
+    for (;;) {
+        int n = recv(d_sd, buf + len, size - len, 0);
+        assert(n >= 0);
+        if (n == 0) {
+            break;
+        }
+        len += n;
+        assert(len < size);
+    }
+    close(d_sd);
+    assert(client_reply(c) == 226);
+    return len;
+}
+
+static int client_put(client_t *c, const char *path, const uint8_t *data, uint32_t size) {
+    int d_sd = client_pasv(c);
+    int code = client_cmd(c, "STOR %s", path);
+    if (code == 150) {
+        for (uint32_t off = 0; off < size; ) {
+            // odd sized writes, as the data arrives from the network
+            uint32_t n = size - off < 1460 ? size - off : 1460;
+            assert(send(d_sd, data + off, n, 0) == n);
+            off += n;
+        }
+        close(d_sd);
+        code = client_reply(c);
+    } else {
+        close(d_sd);
+    }
+    return code;
+}
+
+static uint8_t *random_data(uint32_t size, unsigned seed) {
+    uint8_t *data = malloc(size);
+    srand(seed);
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = rand();
+    }
+    return data;
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_commands(void) {
+    client_t c;
+    static uint8_t buf[64 * 1024];
+
+    assert(client_connect(&c) == 220);
+    assert(client_cmd(&c, "PWD") == 332);
+    assert(client_cmd(&c, "USER micro") == 331);
+    assert(client_cmd(&c, "PASS wrong") == 530);
+    assert(client_cmd(&c, "USER micro") == 331);
+    assert(client_cmd(&c, "PASS python") == 230);
+    assert(client_cmd(&c, "SYST") == 215);
+    assert(client_cmd(&c, "TYPE I") == 200);
+    assert(client_cmd(&c, "FOO") == 502);
+
+    // paths
+    assert(client_cmd(&c, "PWD") == 257 && !strcmp(c.line, "257 /\r\n"));
+    assert(client_cmd(&c, "CWD flash") == 250);
+    assert(client_cmd(&c, "CWD nothere") == 550);
+    assert(client_cmd(&c, "MKD lib") == 250);
+    assert(client_cmd(&c, "MKD /flash/lib/sub/") == 250);
+    assert(client_cmd(&c, "CWD lib/./sub") == 250);
+    assert(client_cmd(&c, "PWD") == 257 && !strcmp(c.line, "257 /flash/lib/sub\r\n"));
+    assert(client_cmd(&c, "CWD ../..") == 250);
+    assert(client_cmd(&c, "XPWD") == 257 && !strcmp(c.line, "257 /flash\r\n"));
+    assert(client_cmd(&c, "CDUP") == 250);
+    assert(client_cmd(&c, "CDUP") == 250);
+    assert(client_cmd(&c, "PWD") == 257 && !strcmp(c.line, "257 /\r\n"));
+    assert(client_cmd(&c, "CWD /flash") == 250);
+
+    // a file in and out, renamed and removed
+    assert(client_cmd(&c, "RETR main.py") == 425);
+    const char *text = "print('hello')\n";
+    assert(client_put(&c, "main.py", (const uint8_t *)text, strlen(text)) == 226);
+    assert(client_get(&c, "RETR main.py", buf, sizeof(buf)) == strlen(text) && !memcmp(buf, text, strlen(text)));
+    assert(client_get(&c, "RETR none.py", buf, sizeof(buf)) == -1);
+    assert(client_cmd(&c, "SIZE main.py") == 213 && !strcmp(c.line, "213 15\r\n"));
+    assert(client_cmd(&c, "MDTM /flash/main.py") == 213 && !strcmp(c.line, "213 20200520103014\r\n"));
+    assert(client_cmd(&c, "RNFR main.py") == 350);
+    assert(client_cmd(&c, "RNTO boot.py") == 250);
+    assert(client_cmd(&c, "SIZE main.py") == 550);
+    assert(client_cmd(&c, "DELE boot.py") == 250);
+    assert(client_cmd(&c, "DELE boot.py") == 550);
+    assert(client_put(&c, "/nodir/x.py", (const uint8_t *)text, strlen(text)) == 550);
+
+    // a listing larger than a transfer buffer
+    uint8_t module[100];
+    memset(module, '#', sizeof(module));
+    for (int i = 0; i < 100; i++) {
+        char name[32];
+        sprintf(name, "lib/module_%03d.py", i);
+        assert(client_put(&c, name, module, i) == 226);
+    }
+    int len = client_get(&c, "LIST", buf, sizeof(buf));
+    buf[len] = '\0';
+    assert(strstr((char *)buf, "drw-rw-r--   1 root  root         0 May 20 10:30 lib\r\n") != NULL);
+    assert(client_cmd(&c, "CWD lib") == 250);
+    len = client_get(&c, "LIST", buf, sizeof(buf));
+    buf[len] = '\0';
+    for (int i = 0; i < 100; i++) {
+        char line[80];
+        sprintf(line, "-rw-rw-r--   1 root  root %9d May 20 10:30 module_%03d.py\r\n", i, i);
+        assert(strstr((char *)buf, line) != NULL);
+    }
+    assert(strstr((char *)buf, "sub\r\n") != NULL);
+    assert(client_cmd(&c, "CWD /") == 250);
+    len = client_get(&c, "LIST", buf, sizeof(buf));
+    buf[len] = '\0';
+    assert(strstr((char *)buf, " flash\r\n") != NULL && strchr((char *)buf, '\n') == (char *)&buf[len - 1]);
+
+    // the data connection is made before or after the transfer command
+    int d_sd = client_pasv(&c);
+    close(d_sd);
+    assert(client_cmd(&c, "NOOP") == 200);
+    client_quit(&c);
+}
+
+typedef struct {
+    int n;
+    uint8_t *data;
+    uint8_t *back;
+} session_arg_t;
+
+static void *session_main(void *arg) {
+    session_arg_t *a = arg;
+    client_t c;
+    char path[32];
+    sprintf(path, "/flash/big%d.bin", a->n);
+    client_login(&c);
+    assert(client_put(&c, path, a->data, BIG_SIZE) == 226);
+    char cmd[48];
+    sprintf(cmd, "RETR %s", path);
+    assert(client_get(&c, cmd, a->back, BIG_SIZE + 1) == BIG_SIZE);
+    client_quit(&c);
+    return NULL;
+}
+
+static void test_sessions(void) {
+    pthread_t threads[FTP_SERVER_SESSIONS];
+    session_arg_t args[FTP_SERVER_SESSIONS];
+
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        args[i].n = i;
+        args[i].data = random_data(BIG_SIZE, i + 1);
+        args[i].back = malloc(BIG_SIZE + 1);
+        assert(pthread_create(&threads[i], NULL, session_main, &args[i]) == 0);
+    }
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        pthread_join(threads[i], NULL);
+        assert(!memcmp(args[i].data, args[i].back, BIG_SIZE));
+        stub_file_t *f = stub_find(args[i].n ? "/flash/big1.bin" : "/flash/big0.bin");
+        assert(f != NULL && f->size == BIG_SIZE && !memcmp(f->data, args[i].data, BIG_SIZE));
+        free(args[i].data);
+        free(args[i].back);
+    }
+    printf("  %u sessions of 1 MB each way: %u file reads, %u file writes\n",
+        FTP_SERVER_SESSIONS, server.stats.file_reads, server.stats.file_writes);
+
+    // with all sessions taken, another client is turned away
+    client_t c[FTP_SERVER_SESSIONS + 1];
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        client_login(&c[i]);
+    }
+    assert(client_connect(&c[FTP_SERVER_SESSIONS]) == 421);
+    close(c[FTP_SERVER_SESSIONS].sd);
+    for (int i = 0; i < FTP_SERVER_SESSIONS; i++) {
+        client_quit(&c[i]);
+    }
+}
+
+static void test_update(void) {
+    client_t a, b;
+    uint8_t *image = random_data(300 * 1024 + 17, 99);
+
+    client_login(&a);
+    client_login(&b);
+    // the updater is held by one session at a time
+    int d_sd = client_pasv(&a);
+    assert(client_cmd(&a, "STOR /flash/sys/appimg.bin") == 150);
+    assert(client_put(&b, "/flash/sys/appimg.bin", image, 10) == 550);
+    for (uint32_t off = 0; off < 300 * 1024 + 17; off += 1024) {
+        uint32_t n = 300 * 1024 + 17 - off < 1024 ? 300 * 1024 + 17 - off : 1024;
+        assert(send(d_sd, image + off, n, 0) == n);
+    }
+    close(d_sd);
+    assert(client_reply(&a) == 226);
+    assert(update_finished && update_size == 300 * 1024 + 17 && !memcmp(update_data, image, update_size));
+
+    // an update aborted by resetting the data connection isn't finished
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    d_sd = client_pasv(&b);
+    assert(client_cmd(&b, "STOR /flash/sys/appimg.bin") == 150);
+    assert(send(d_sd, image, 1000, 0) == 1000);
+    usleep(50000);
+    setsockopt(d_sd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(d_sd);
+    assert(client_reply(&b) == 426);
+    assert(!update_finished && update_size == 0);
+    client_quit(&b);
+    assert(client_put(&a, "/flash/sys/appimg.bin", image, 5000) == 226);
+    assert(update_finished && update_size == 5000);
+    client_quit(&a);
+    free(image);
+}
+
+static void test_throughput(void) {
+    client_t c;
+    uint8_t *back = malloc(BIG_SIZE + 1);
+    static const uint32_t sizes[] = { 512, 1024, 4096 };
+    uint32_t reads[3];
+    uint32_t ms[3];
+
+    // against a stub that charges a flash read its cost in time
+    charge_reads = true;
+    for (int i = 0; i < 3; i++) {
+        server_begin(sizes[i]);
+        client_login(&c);
+        uint32_t t = stub_ticks_ms();
+        assert(client_get(&c, "RETR /flash/big0.bin", back, BIG_SIZE + 1) == BIG_SIZE);
+        ms[i] = stub_ticks_ms() - t;
+        reads[i] = server.stats.file_reads;
+        client_quit(&c);
+        server_end();
+        printf("  RETR 1 MB, %4u byte buffers: %4u reads, %3u read ahead, %4u ms\n",
+            sizes[i], reads[i], server.stats.read_ahead, ms[i]);
+    }
+    charge_reads = false;
+    assert(reads[2] * 4 < reads[0]);
+    assert(ms[2] < ms[0]);
+    free(back);
+}
+
+int main(void) {
+    signal(SIGPIPE, SIG_IGN);
+    stub_create("/flash", true);
+    stub_create("/flash/sys", true);
+
+    server_begin(0);
+    printf("commands\n");
+    test_commands();
+    printf("sessions\n");
+    test_sessions();
+    printf("update\n");
+    test_update();
+    server_end();
+    printf("throughput\n");
+    test_throughput();
+    printf("OK\n");
+    return 0;
+}
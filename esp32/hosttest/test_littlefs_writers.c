@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// Several files being written at the same time on littlefs over the
+// simulated flash, each with its own cache buffer as the VFS gives them,
+// with and without block-level wear levelling.  Loggers append a record to
+// their file and sync it; state files are small enough to be stored inline
+// and are rewritten in place, so all their updates land on the directory's
+// metadata blocks.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "flash_sim.h"
+#include "lfs.h"
+#include "sflash_diskio_littlefs.h"
+
+#define N_BLOCKS        (64)
+#define MAX_WRITERS     (8)
+#define ROUNDS          (3000)      // records per run, over all the writers
+#define FILE_LIMIT      (6 * 1024)  // files are truncated when they reach this size
+
+// Estimated SPI flash timings in ns, as in test_littlefs.c
+#define NS_PER_BYTE_READ    (50)
+#define NS_PER_BYTE_PROG    (2700)
+#define NS_PER_ERASE        (45000000)
+
+static int sim_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+    return flash_sim_read(block * c->block_size + off, buffer, size) ? LFS_ERR_IO : 0;
+}
+
+static int sim_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size) {
+    return flash_sim_write(block * c->block_size + off, buffer, size) ? LFS_ERR_IO : 0;
+}
+
+static int sim_erase(const struct lfs_config *c, lfs_block_t block) {
+    return flash_sim_erase(block * c->block_size) ? LFS_ERR_IO : 0;
+}
+
+static int sim_sync(const struct lfs_config *c) {
+    return 0;
+}
+
+typedef struct _writer_t {
+    lfs_file_t f;
+    struct lfs_file_config cfg;
+    uint8_t cache[SFLASH_LITTLEFS_CACHE_SIZE];
+    char name[16];
+    uint32_t written;
+    uint32_t seq;
+} writer_t;
+
+static writer_t writers[MAX_WRITERS];
+
+static void writer_open(lfs_t *lfs, writer_t *w, int flags) {
+    memset(&w->cfg, 0, sizeof(w->cfg));
+    w->cfg.buffer = w->cache;
+    assert(lfs_file_opencfg(lfs, &w->f, w->name, LFS_O_WRONLY | LFS_O_CREAT | flags, &w->cfg) == 0);
+}
+
+// n_writers files are open at once; each round writes a record to every
+// file and syncs it, appending it to the file or (state) replacing its
+// contents
+static void run(unsigned n_writers, bool state, uint32_t rounds, uint32_t block_cycles, uint32_t *max_erases) {
+    struct lfs_config cfg = {
+        .read = sim_read,
+        .prog = sim_prog,
+        .erase = sim_erase,
+        .sync = sim_sync,
+        .read_size = SFLASH_LITTLEFS_READ_SIZE,
+        .prog_size = SFLASH_LITTLEFS_PROG_SIZE,
+        .block_size = FLASH_SIM_BLOCK_SIZE,
+        .block_count = N_BLOCKS,
+        .block_cycles = block_cycles,
+        .cache_size = SFLASH_LITTLEFS_CACHE_SIZE,
+        .lookahead_size = N_BLOCKS / 8,
+    };
+    lfs_t lfs;
+    char rec[48];
+
+    flash_sim_init(N_BLOCKS);
+    assert(lfs_format(&lfs, &cfg) == 0);
+    assert(lfs_mount(&lfs, &cfg) == 0);
+    for (unsigned i = 0; i < n_writers; i++) {
+        writer_t *w = &writers[i];
+        sprintf(w->name, "w%u.log", i);
+        w->written = 0;
+        w->seq = 0;
+        writer_open(&lfs, w, LFS_O_TRUNC);
+    }
+
+    flash_sim_reset_stats();
+    for (unsigned r = 0; r < rounds / n_writers; r++) {
+        for (unsigned i = 0; i < n_writers; i++) {
+            writer_t *w = &writers[i];
+            if (state) {
+                assert(lfs_file_rewind(&lfs, &w->f) == 0);
+            } else if (w->written >= FILE_LIMIT) {
+                // start the log over, as a rotating logger would
+                assert(lfs_file_close(&lfs, &w->f) == 0);
+                writer_open(&lfs, w, LFS_O_TRUNC);
+                w->written = 0;
+            }
+            int n = sprintf(rec, "%u,%u,21.5,1013.2,48\n", i, w->seq++);
+            assert(lfs_file_write(&lfs, &w->f, rec, n) == n);
+            assert(lfs_file_sync(&lfs, &w->f) == 0);
+            w->written += n;
+        }
+    }
+    uint64_t us = ((uint64_t)flash_sim.bytes_read * NS_PER_BYTE_READ
+        + (uint64_t)flash_sim.bytes_written * NS_PER_BYTE_PROG
+        + (uint64_t)flash_sim.erases * NS_PER_ERASE) / 1000;
+    *max_erases = flash_sim_max_erases();
+    printf("  %u %s, block_cycles %3u: %5u erases, max %4u per block, ~%llu ms per 1000 records\n",
+        n_writers, state ? "state files" : "loggers", block_cycles, flash_sim.erases, *max_erases,
+        (unsigned long long)us / (rounds / n_writers * n_writers));
+
+    // every file reads back its last record after a remount
+    for (unsigned i = 0; i < n_writers; i++) {
+        assert(lfs_file_close(&lfs, &writers[i].f) == 0);
+    }
+    assert(lfs_unmount(&lfs) == 0);
+    assert(lfs_mount(&lfs, &cfg) == 0);
+    for (unsigned i = 0; i < n_writers; i++) {
+        writer_t *w = &writers[i];
+        lfs_file_t f;
+        char line[48];
+        int n = sprintf(rec, "%u,%u,21.5,1013.2,48\n", i, w->seq - 1);
+        assert(lfs_file_open(&lfs, &f, w->name, LFS_O_RDONLY) == 0);
+        assert(lfs_file_seek(&lfs, &f, state ? 0 : -n, state ? LFS_SEEK_SET : LFS_SEEK_END) >= 0);
+        assert(lfs_file_read(&lfs, &f, line, n) == n && memcmp(line, rec, n) == 0);
+        assert(lfs_file_close(&lfs, &f) == 0);
+    }
+    assert(lfs_unmount(&lfs) == 0);
+    flash_sim_deinit();
+}
+
+int main(void) {
+    uint32_t max_off, max_on;
+    printf("loggers:\n");
+    for (unsigned n = 1; n <= MAX_WRITERS; n *= 2) {
+        run(n, false, ROUNDS, SFLASH_LITTLEFS_BLOCK_CYCLES, &max_on);
+    }
+    // Without wear levelling the directory's two metadata blocks take all
+    // the erases of the state files; with it they are moved every
+    // block_cycles erases (the first time by expanding the superblock).
+    printf("state files:\n");
+    run(MAX_WRITERS, true, 20 * ROUNDS, 0, &max_off);
+    run(MAX_WRITERS, true, 20 * ROUNDS, SFLASH_LITTLEFS_BLOCK_CYCLES, &max_on);
+    assert(max_on < max_off);
+    run(MAX_WRITERS, true, 20 * ROUNDS, 100, &max_on);
+    assert(max_on < max_off);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The table driven AES and CMAC of the LoRaWAN MAC, on the vectors of
+// FIPS-197, SP 800-38A and RFC 4493, then against aes.c and cmac.c, which
+// they replace, on random keys and frames, through LoRaMacCrypto as well.
+// The throughput of both is printed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+
+#include "lora_aes.h"
+#include "aes.h"
+#include "cmac.h"
+#include "lora/mac/LoRaMacCrypto.h"
+
+/******************************************************************************
+ what utilities.c has on the board
+ ******************************************************************************/
+void memcpy1(uint8_t *dst, const uint8_t *src, uint16_t size) {
+    memcpy(dst, src, size);
+}
+
+void memset1(uint8_t *dst, uint8_t value, uint16_t size) {
+    memset(dst, value, size);
+}
+
+/******************************************************************************
+ helpers
+ ******************************************************************************/
+static void hex(const char *s, uint8_t *out) {
+    for (uint32_t i = 0; s[2 * i]; i++) {
+        unsigned v;
+        sscanf(s + 2 * i, "%2x", &v);
+        out[i] = v;
+    }
+}
+
+static void random_bytes(uint8_t *buf, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        buf[i] = rand();
+    }
+}
+
+// aes.c loads words, it's given aligned copies
+static void ref_encrypt(const uint8_t *key, const uint8_t *in, uint8_t *out) {
+    aes_context aes;
+    uint32_t aes_key[4], block_in[4], block_out[4];
+
+    memcpy(aes_key, key, 16);
+    memcpy(block_in, in, 16);
+    aes_set_key_lora((uint8_t *)aes_key, 16, &aes);
+    aes_encrypt_lora((uint8_t *)block_in, (uint8_t *)block_out, &aes);
+    memcpy(out, block_out, 16);
+}
+
+static void ref_cmac(const uint8_t *key, const uint8_t *b0, const uint8_t *data, uint32_t len, uint8_t *mac) {
+    static AES_CMAC_CTX ctx;
+    uint32_t aes_key[4], buf[64], digest[4];
+
+    assert(len <= sizeof(buf));
+    memcpy(aes_key, key, 16);
+    AES_CMAC_Init(&ctx);
+    AES_CMAC_SetKey(&ctx, (uint8_t *)aes_key);
+    if (b0) {
+        memcpy(buf, b0, 16);
+        AES_CMAC_Update(&ctx, (uint8_t *)buf, 16);
+    }
+    memcpy(buf, data, len);
+    AES_CMAC_Update(&ctx, (uint8_t *)buf, len);
+    AES_CMAC_Final((uint8_t *)digest, &ctx);
+    memcpy(mac, digest, 16);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the library's LORA_AES_IN_ISR()
+bool test_lora_aes_in_isr;
+
+// counts the blocks, on the software tables
+static uint32_t counted;
+
+static void counting_set_key(lora_aes_key_t *k) {
+    lora_aes_soft.set_key(k);
+}
+
+static void counting_encrypt(const lora_aes_key_t *k, const uint8_t *in, uint8_t *out) {
+    counted++;
+    lora_aes_soft.encrypt(k, in, out);
+}
+
+static const lora_aes_backend_t counting_backend = {
+    .set_key = counting_set_key,
+    .encrypt = counting_encrypt,
+};
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_vectors(void) {
+    uint8_t key[16], in[16], out[16], expect[16];
+
+    // FIPS-197 appendix C.1
+    hex("000102030405060708090a0b0c0d0e0f", key);
+    hex("00112233445566778899aabbccddeeff", in);
+    hex("69c4e0d86a7b0430d8cdb78070b4c55a", expect);
+    lora_aes_key_t k;
+    lora_aes_key(key, &k);
+    lora_aes_encrypt(&k, in, out);
+    assert(memcmp(out, expect, 16) == 0);
+    // in place, and unaligned
+    uint8_t buf[17];
+    memcpy(buf + 1, in, 16);
+    lora_aes_encrypt(&k, buf + 1, buf + 1);
+    assert(memcmp(buf + 1, expect, 16) == 0);
+
+    // SP 800-38A F.1.1
+    const char *ecb[][2] = {
+        { "6bc1bee22e409f96e93d7e117393172a", "3ad77bb40d7a3660a89ecaf32466ef97" },
+        { "ae2d8a571e03ac9c9eb76fac45af8e51", "f5d3d58503b9699de785895a96fdbaaf" },
+        { "30c81c46a35ce411e5fbc1191a0a52ef", "43b1cd7f598ece23881b00e3ed030688" },
+        { "f69f2445df4f9b17ad2b417be66c3710", "7b0c785e27e8ad3f8223207104725dd4" },
+    };
+    hex("2b7e151628aed2a6abf7158809cf4f3c", key);
+    lora_aes_key(key, &k);
+    for (uint32_t i = 0; i < 4; i++) {
+        hex(ecb[i][0], in);
+        hex(ecb[i][1], expect);
+        lora_aes_encrypt(&k, in, out);
+        assert(memcmp(out, expect, 16) == 0);
+    }
+
+    // RFC 4493 section 4, the subkeys then the four examples
+    hex("fbeed618357133667c85e08f7236a8de", expect);
+    assert(memcmp(k.k1, expect, 16) == 0);
+    hex("f7ddac306ae266ccf90bc11ee46d513b", expect);
+    assert(memcmp(k.k2, expect, 16) == 0);
+
+    uint8_t msg[64];
+    hex("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+        "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", msg);
+    const struct {
+        uint32_t len;
+        const char *mac;
+    } cmac[] = {
+        { 0, "bb1d6929e95937287fa37d129b756746" },
+        { 16, "070a16b46b4d4144f79bdd9dd04a287c" },
+        { 40, "dfa66747de9ae63030ca32611497c827" },
+        { 64, "51f0bebf7e3b9d92fc49741779363cfe" },
+    };
+    for (uint32_t i = 0; i < 4; i++) {
+        hex(cmac[i].mac, expect);
+        lora_aes_cmac(&k, NULL, msg, cmac[i].len, out);
+        assert(memcmp(out, expect, 16) == 0);
+        // the first block apart
+        if (cmac[i].len >= 16) {
+            lora_aes_cmac(&k, msg, msg + 16, cmac[i].len - 16, out);
+            assert(memcmp(out, expect, 16) == 0);
+        }
+    }
+}
+
+static void test_reference(void) {
+    uint8_t key[16], b0[16], data[64], out[16], expect[16];
+    lora_aes_key_t k;
+
+    for (uint32_t i = 0; i < 20000; i++) {
+        random_bytes(key, 16);
+        random_bytes(b0, 16);
+        random_bytes(data, sizeof(data));
+        uint32_t len = rand() % (sizeof(data) + 1);
+
+        ref_encrypt(key, b0, expect);
+        lora_aes_key(key, &k);
+        lora_aes_encrypt(&k, b0, out);
+        assert(memcmp(out, expect, 16) == 0);
+
+        ref_cmac(key, (i & 1) ? b0 : NULL, data, len, expect);
+        lora_aes_cmac(&k, (i & 1) ? b0 : NULL, data, len, out);
+        assert(memcmp(out, expect, 16) == 0);
+    }
+}
+
+// LoRaMacCrypto as it was, on aes.c and cmac.c
+static uint32_t ref_frame_mic(const uint8_t *buf, uint16_t size, const uint8_t *key, uint32_t addr, uint8_t dir, uint32_t fcnt) {
+    uint8_t b0[16] = { 0x49, 0, 0, 0, 0, dir, addr, addr >> 8, addr >> 16, addr >> 24, fcnt, fcnt >> 8, fcnt >> 16, fcnt >> 24, 0, size };
+    uint8_t mac[16];
+    ref_cmac(key, b0, buf, size, mac);
+    return mac[0] | mac[1] << 8 | mac[2] << 16 | (uint32_t)mac[3] << 24;
+}
+
+static void ref_frame_encrypt(const uint8_t *buf, uint16_t size, const uint8_t *key, uint32_t addr, uint8_t dir, uint32_t fcnt, uint8_t *out) {
+    uint8_t a[16] = { 0x01, 0, 0, 0, 0, dir, addr, addr >> 8, addr >> 16, addr >> 24, fcnt, fcnt >> 8, fcnt >> 16, fcnt >> 24, 0, 0 };
+    uint8_t s[16];
+    for (uint32_t i = 0; i < size; i++) {
+        if (i % 16 == 0) {
+            a[15] = i / 16 + 1;
+            ref_encrypt(key, a, s);
+        }
+        out[i] = buf[i] ^ s[i % 16];
+    }
+}
+
+static void test_loramac(void) {
+    uint8_t nwk_skey[16], app_skey[16], app_key[16];
+    uint8_t frame[255], enc[256], expect[256];
+
+    for (uint32_t i = 0; i < 2000; i++) {
+        random_bytes(nwk_skey, 16);
+        random_bytes(app_skey, 16);
+        random_bytes(frame, sizeof(frame));
+        uint16_t size = rand() % 243;
+        uint32_t addr = rand();
+        uint32_t fcnt = rand() & 0xffff;
+        uint8_t dir = rand() & 1;
+        uint32_t mic;
+
+        LoRaMacComputeMic(frame, size, nwk_skey, addr, dir, fcnt, &mic);
+        assert(mic == ref_frame_mic(frame, size, nwk_skey, addr, dir, fcnt));
+        // unaligned, as a frame's payload is in the middle of the buffer
+        LoRaMacPayloadEncrypt(frame + 9, size, app_skey, addr, dir, fcnt, enc + 1);
+        ref_frame_encrypt(frame + 9, size, app_skey, addr, dir, fcnt, expect);
+        assert(memcmp(enc + 1, expect, size) == 0);
+        LoRaMacPayloadDecrypt(enc + 1, size, app_skey, addr, dir, fcnt, enc + 1);
+        assert(memcmp(enc + 1, frame + 9, size) == 0);
+    }
+
+    // the join, which decrypts with AES encrypt
+    uint8_t nonce[16], nwk[16], app[16];
+    uint8_t app_nonce[6] = { 1, 2, 3, 4, 5, 6 };
+    uint16_t dev_nonce = 0x1234;
+    uint32_t mic;
+    random_bytes(app_key, 16);
+    random_bytes(frame, 33);
+    LoRaMacJoinComputeMic(frame, 33, app_key, &mic);
+    ref_cmac(app_key, NULL, frame, 33, expect);
+    assert(mic == (expect[0] | expect[1] << 8 | expect[2] << 16 | (uint32_t)expect[3] << 24));
+    LoRaMacJoinDecrypt(frame + 1, 32, app_key, enc);
+    ref_encrypt(app_key, frame + 1, expect);
+    ref_encrypt(app_key, frame + 17, expect + 16);
+    assert(memcmp(enc, expect, 32) == 0);
+    LoRaMacJoinComputeSKeys(app_key, app_nonce, dev_nonce, nwk, app);
+    memset(nonce, 0, 16);
+    nonce[0] = 0x01;
+    memcpy(nonce + 1, app_nonce, 6);
+    memcpy(nonce + 7, &dev_nonce, 2);
+    ref_encrypt(app_key, nonce, expect);
+    assert(memcmp(nwk, expect, 16) == 0);
+    nonce[0] = 0x02;
+    ref_encrypt(app_key, nonce, expect);
+    assert(memcmp(app, expect, 16) == 0);
+}
+
+static void test_cache(void) {
+    uint8_t keys[LORA_AES_KEY_CACHE_SIZE + 1][16];
+    lora_aes_stats_t before;
+    lora_aes_key_t k, k0;
+
+    lora_aes_flush();
+    for (uint32_t i = 0; i <= LORA_AES_KEY_CACHE_SIZE; i++) {
+        memset(keys[i], i, 16);
+    }
+    before = *lora_aes_get_stats();
+    for (uint32_t i = 0; i < LORA_AES_KEY_CACHE_SIZE; i++) {
+        lora_aes_key(keys[i], &k);
+    }
+    assert(lora_aes_get_stats()->misses == before.misses + LORA_AES_KEY_CACHE_SIZE);
+
+    // all there; key 0 is used again, key 1 is then the oldest
+    lora_aes_key(keys[0], &k0);
+    assert(lora_aes_get_stats()->hits == before.hits + 1);
+    lora_aes_key(keys[LORA_AES_KEY_CACHE_SIZE], &k);
+    lora_aes_key(keys[0], &k);
+    assert(memcmp(k.rk, k0.rk, sizeof(k.rk)) == 0 && memcmp(k.k1, k0.k1, 16) == 0);
+    assert(lora_aes_get_stats()->hits == before.hits + 2);
+    lora_aes_key(keys[1], &k);
+    assert(lora_aes_get_stats()->misses == before.misses + LORA_AES_KEY_CACHE_SIZE + 2);
+
+    // a session: two keys a frame, the schedules are made once
+    uint8_t frame[50] = { 0 };
+    uint8_t enc[50], expect[50];
+    uint32_t mic, expect_mic;
+    lora_aes_flush();
+    before = *lora_aes_get_stats();
+    for (uint32_t i = 0; i < 100; i++) {
+        LoRaMacPayloadEncrypt(frame, sizeof(frame), keys[1], 1, 0, i, enc);
+        LoRaMacComputeMic(enc, sizeof(enc), keys[2], 1, 0, i, &mic);
+    }
+    assert(lora_aes_get_stats()->misses == before.misses + 2);
+    assert(lora_aes_get_stats()->hits == before.hits + 198);
+
+    // another backend: the cache is emptied, and it does the blocks
+    lora_aes_key(keys[1], &k);
+    lora_aes_set_backend(&counting_backend);
+    before = *lora_aes_get_stats();
+    counted = 0;
+    LoRaMacPayloadEncrypt(frame, sizeof(frame), keys[1], 1, 0, 1, enc);
+    assert(lora_aes_get_stats()->misses == before.misses + 1);
+    // the CMAC subkeys, then 4 blocks
+    assert(counted == 5);
+
+    // from the radio interrupt the software backend does the blocks, with
+    // the same results; a key first seen there isn't cached, the backend's
+    // set_key didn't run
+    memcpy(expect, enc, sizeof(enc));
+    LoRaMacComputeMic(enc, sizeof(enc), keys[2], 1, 0, 1, &expect_mic);
+    lora_aes_flush();
+    before = *lora_aes_get_stats();
+    counted = 0;
+    test_lora_aes_in_isr = true;
+    LoRaMacPayloadDecrypt(expect, sizeof(expect), keys[1], 1, 0, 1, enc);
+    LoRaMacComputeMic(expect, sizeof(expect), keys[2], 1, 0, 1, &mic);
+    test_lora_aes_in_isr = false;
+    assert(counted == 0);
+    assert(memcmp(enc, frame, sizeof(frame)) == 0);
+    assert(mic == expect_mic);
+    lora_aes_key(keys[1], &k);
+    assert(lora_aes_get_stats()->misses == before.misses + 3);
+
+    // a key cached by the task is used by the interrupt as it is
+    before = *lora_aes_get_stats();
+    test_lora_aes_in_isr = true;
+    LoRaMacComputeMic(expect, sizeof(expect), keys[1], 1, 0, 1, &mic);
+    test_lora_aes_in_isr = false;
+    assert(lora_aes_get_stats()->hits == before.hits + 1);
+    // only the subkeys of the task's miss
+    assert(counted == 1);
+    lora_aes_set_backend(&lora_aes_soft);
+}
+
+static void test_benchmark(void) {
+    uint8_t key[16], block[16], frame[64];
+    const uint32_t blocks = 400000;
+    const uint32_t frames = 50000;
+    uint32_t mic = 0;
+    double t;
+
+    random_bytes(key, 16);
+    random_bytes(block, 16);
+    random_bytes(frame, sizeof(frame));
+
+    // one key, block after block
+    aes_context aes;
+    uint32_t aes_key[4], aes_block[4];
+    memcpy(aes_key, key, 16);
+    memcpy(aes_block, block, 16);
+    aes_set_key_lora((uint8_t *)aes_key, 16, &aes);
+    t = now();
+    for (uint32_t i = 0; i < blocks; i++) {
+        aes_encrypt_lora((uint8_t *)aes_block, (uint8_t *)aes_block, &aes);
+    }
+    double ref_block = (now() - t) / blocks;
+
+    lora_aes_key_t k;
+    lora_aes_key(key, &k);
+    t = now();
+    for (uint32_t i = 0; i < blocks; i++) {
+        lora_aes_encrypt(&k, block, block);
+    }
+    double new_block = (now() - t) / blocks;
+    assert(memcmp(block, aes_block, 16) == 0);
+
+    // a 64 byte uplink, encrypted then its MIC, as the MAC did it: a key
+    // schedule for each, and the CMAC subkeys
+    uint8_t enc[64];
+    t = now();
+    for (uint32_t i = 0; i < frames; i++) {
+        ref_frame_encrypt(frame, sizeof(frame), key, 1, 0, i, enc);
+        mic ^= ref_frame_mic(enc, sizeof(enc), block, 1, 0, i);
+    }
+    double ref_frame = (now() - t) / frames;
+
+    uint32_t new_mic = 0;
+    t = now();
+    for (uint32_t i = 0; i < frames; i++) {
+        uint32_t m;
+        LoRaMacPayloadEncrypt(frame, sizeof(frame), key, 1, 0, i, enc);
+        LoRaMacComputeMic(enc, sizeof(enc), block, 1, 0, i, &m);
+        new_mic ^= m;
+    }
+    double new_frame = (now() - t) / frames;
+    assert(mic == new_mic);
+
+    printf("  block: aes.c %.0f ns, tables %.0f ns (%.1f MB/s)\n",
+           ref_block * 1e9, new_block * 1e9, 16 / new_block / 1e6);
+    printf("  64 byte frame: aes.c and cmac.c %.0f ns, tables and cached keys %.0f ns\n",
+           ref_frame * 1e9, new_frame * 1e9);
+}
+
+int main(void) {
+    srand(1);
+    printf("vectors\n");
+    test_vectors();
+    printf("reference\n");
+    test_reference();
+    printf("loramac\n");
+    test_loramac();
+    printf("cache\n");
+    test_cache();
+    printf("benchmark\n");
+    test_benchmark();
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The uplink aggregation on the EU868 data rates: the records read back as
+// they were put, the frames close when they're full, their time comes or
+// what they carry changes, and a day of a slowly changing sensor costs a
+// fraction of the air time of a frame per reading.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "lora_aggr.h"
+
+/******************************************************************************
+ EU868
+ ******************************************************************************/
+static const uint8_t datarates[] = { 12, 11, 10, 9, 8, 7, 7, 50 };
+static const uint32_t bandwidths[] = { 125000, 125000, 125000, 125000, 125000, 125000, 250000, 0 };
+static const uint32_t max_payloads[] = { 51, 51, 51, 115, 242, 242, 242, 242 };
+
+static uint32_t stub_time_on_air(void *ctx, uint8_t dr, uint32_t len) {
+    return lora_tx_sched_air_time(datarates[dr], bandwidths[dr], len + LORA_TX_SCHED_FRAME_OVERHEAD);
+}
+
+static uint32_t stub_max_payload(void *ctx, uint8_t dr) {
+    return max_payloads[dr];
+}
+
+static const lora_tx_sched_ops_t stub_ops = {
+    .time_on_air = stub_time_on_air,
+    .max_payload = stub_max_payload,
+};
+
+static lora_aggr_t aggr;
+
+static lora_tx_msg_t record(uint8_t port, uint8_t dr, const void *data, uint32_t len) {
+    lora_tx_msg_t m;
+    memset(&m, 0, sizeof(m));
+    m.port = port;
+    m.dr = dr;
+    m.len = len;
+    memcpy(m.data, data, len);
+    return m;
+}
+
+static lora_tx_msg_t bytes(uint8_t port, uint8_t dr, uint32_t len, uint8_t first) {
+    uint8_t data[LORA_TX_SCHED_PAYLOAD_MAX];
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = first + i;
+    }
+    return record(port, dr, data, len);
+}
+
+// the records of a frame
+static uint32_t read_all(const lora_tx_msg_t *frame, uint8_t records[][LORA_TX_SCHED_PAYLOAD_MAX], uint32_t *lens, uint32_t max) {
+    lora_aggr_reader_t r;
+    uint32_t n = 0;
+    int32_t len;
+
+    assert(lora_aggr_reader_init(&r, frame->data, frame->len));
+    while ((len = lora_aggr_read(&r, records[n])) > 0) {
+        lens[n++] = len;
+        assert(n <= max);
+    }
+    assert(len == 0);
+    return n;
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_round_trip(void) {
+    static const uint8_t widths[] = { 0, 1, 2, 4 };
+    static uint8_t put[64][LORA_TX_SCHED_PAYLOAD_MAX];
+    static uint8_t got[64][LORA_TX_SCHED_PAYLOAD_MAX];
+    static uint32_t put_lens[64], got_lens[64];
+    lora_tx_msg_t out;
+    uint32_t wait;
+
+    for (uint32_t round = 0; round < 2000; round++) {
+        uint8_t width = widths[rand() % 4];
+        uint8_t dr = rand() % 8;
+        uint32_t n = 0;
+        lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+
+        while (n < 64) {
+            uint32_t fields = 1 + rand() % 8;
+            uint32_t len = (width) ? fields * width : fields;
+            lora_tx_msg_t m;
+            // mostly small steps from the record before, with extremes
+            if (n > 0 && put_lens[n - 1] == len && rand() % 4) {
+                m = record(1, dr, put[n - 1], len);
+                for (uint32_t i = 0; i < len; i++) {
+                    m.data[i] += (rand() % 5) - 2;
+                }
+            } else {
+                m = bytes(1, dr, len, 0);
+                for (uint32_t i = 0; i < len; i++) {
+                    m.data[i] = (rand() % 3 == 0) ? (rand() % 2) * 0xFF : rand();
+                }
+            }
+            memcpy(put[n], m.data, len);
+            put_lens[n] = len;
+            lora_aggr_result_t result = lora_aggr_put(&aggr, &m, width, 0, &out);
+            assert(result != E_LORA_AGGR_INVALID);
+            if (result == E_LORA_AGGR_CLOSED) {
+                break;
+            }
+            n++;
+            if (lora_aggr_due(&aggr, 0, 0, &out, &wait)) {
+                break;
+            }
+        }
+        assert(out.len <= max_payloads[dr]);
+        assert(out.data[0] == width);
+        uint32_t got_n = read_all(&out, got, got_lens, 64);
+        assert(got_n == n);
+        for (uint32_t i = 0; i < n; i++) {
+            assert(got_lens[i] == put_lens[i]);
+            assert(memcmp(got[i], put[i], put_lens[i]) == 0);
+        }
+    }
+}
+
+static void test_encoding(void) {
+    lora_tx_msg_t out, m;
+    int16_t values[3] = { 215, 480, 10132 };
+
+    lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+    m = record(2, 5, values, sizeof(values));
+    assert(lora_aggr_put(&aggr, &m, 2, 0, &out) == E_LORA_AGGR_ADDED);
+    values[0]++;
+    values[2]--;
+    m = record(2, 5, values, sizeof(values));
+    assert(lora_aggr_put(&aggr, &m, 2, 0, &out) == E_LORA_AGGR_ADDED);
+    assert(lora_aggr_flush(&aggr, &out));
+    assert(!lora_aggr_flush(&aggr, &out));
+
+    // the width, then 3 fields as they are and 3 fields of differences
+    static const uint8_t expect[] = {
+        2,
+        3 << 1, 0xAE, 0x03, 0xC0, 0x07, 0xA8, 0x9E, 0x01,
+        3 << 1 | 1, 0x02, 0x00, 0x01,
+    };
+    assert(out.len == sizeof(expect));
+    assert(memcmp(out.data, expect, sizeof(expect)) == 0);
+    assert(out.port == 2 && out.dr == 5 && !out.coalesce);
+    assert(aggr.stats.frames == 1 && aggr.stats.records == 2);
+    assert(aggr.stats.bytes_in == 12 && aggr.stats.bytes_out == sizeof(expect));
+
+    // with no shorter difference, the values themselves
+    lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+    int8_t small[2] = { 1, 1 };
+    m = record(2, 5, small, 2);
+    lora_aggr_put(&aggr, &m, 1, 0, &out);
+    small[0] = -128;
+    small[1] = 127;
+    m = record(2, 5, small, 2);
+    lora_aggr_put(&aggr, &m, 1, 0, &out);
+    assert(lora_aggr_flush(&aggr, &out));
+    assert(out.data[4] == (2 << 1));
+
+    // raw records keep their bytes
+    lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+    m = bytes(2, 5, 3, 'a');
+    lora_aggr_put(&aggr, &m, 0, 0, &out);
+    assert(lora_aggr_flush(&aggr, &out));
+    assert(out.len == 5 && out.data[0] == 0 && out.data[1] == 3 << 1 && memcmp(&out.data[2], "abc", 3) == 0);
+
+    // whole fields only, and what fits in a frame
+    lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+    m = bytes(2, 5, 3, 0);
+    assert(lora_aggr_put(&aggr, &m, 2, 0, &out) == E_LORA_AGGR_INVALID);
+    assert(lora_aggr_put(&aggr, &m, 3, 0, &out) == E_LORA_AGGR_INVALID);
+    m = bytes(2, 0, 49, 0);
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_ADDED);
+    assert(lora_aggr_flush(&aggr, &out) && out.len == 51);
+    m = bytes(2, 0, 50, 0);
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_INVALID);
+    m.len = 0;
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_INVALID);
+    assert(!lora_aggr_flush(&aggr, &out));
+}
+
+static void test_closing(void) {
+    lora_tx_msg_t out, m;
+    uint32_t wait;
+
+    // 4 records of 11 bytes and the width fill 45 of the 51 bytes of DR0
+    lora_aggr_init(&aggr, &stub_ops, NULL, 60000);
+    for (uint32_t i = 0; i < 4; i++) {
+        m = bytes(3, 0, 10, i * 10);
+        assert(lora_aggr_put(&aggr, &m, 0, 100, &out) == E_LORA_AGGR_ADDED);
+        assert(!lora_aggr_due(&aggr, 100, 0, &out, &wait));
+        assert(wait == 60000);
+    }
+    m = bytes(3, 0, 10, 40);
+    assert(lora_aggr_put(&aggr, &m, 0, 200, &out) == E_LORA_AGGR_CLOSED);
+    assert(out.len == 45 && out.port == 3);
+    // the new frame started with it
+    assert(!lora_aggr_due(&aggr, 200, 0, &out, &wait) && wait == 60000);
+    // with 50 bytes, there's no room for another, it's due at once
+    m = bytes(3, 0, 37, 0);
+    assert(lora_aggr_put(&aggr, &m, 0, 200, &out) == E_LORA_AGGR_ADDED);
+    assert(lora_aggr_due(&aggr, 200, 0, &out, &wait));
+    assert(out.len == 50);
+    assert(!lora_aggr_due(&aggr, 200, 0, &out, &wait) && wait == LORA_TX_SCHED_NEVER);
+
+    // the hold time, across the wrap of the clock
+    lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+    m = bytes(3, 5, 4, 0);
+    lora_aggr_put(&aggr, &m, 0, 0xFFFFFE00, &out);
+    assert(!lora_aggr_due(&aggr, 0xFFFFFF00, 0, &out, &wait) && wait == 0x2E8);
+    assert(!lora_aggr_due(&aggr, 0x1E7, 0, &out, &wait) && wait == 1);
+    assert(lora_aggr_due(&aggr, 0x1E8, 0, &out, &wait));
+
+    // a deadline brings it forward by the queue's wait and the air time,
+    // and the frame carries the earliest
+    lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+    m = bytes(3, 5, 4, 0);
+    m.has_deadline = true;
+    m.deadline = 700;
+    m.priority = 2;
+    lora_aggr_put(&aggr, &m, 0, 0, &out);
+    m.deadline = 900;
+    m.priority = 1;
+    lora_aggr_put(&aggr, &m, 0, 0, &out);
+    uint32_t t = stub_time_on_air(NULL, 5, aggr.frame.len);
+    assert(!lora_aggr_due(&aggr, 0, 100, &out, &wait) && wait == 600 - t);
+    assert(!lora_aggr_due(&aggr, 599 - t, 100, &out, &wait) && wait == 1);
+    assert(lora_aggr_due(&aggr, 600 - t, 100, &out, &wait));
+    assert(out.has_deadline && out.deadline == 700 && out.priority == 2);
+    // one already late goes at once
+    m.deadline = 10;
+    lora_aggr_put(&aggr, &m, 0, 0, &out);
+    assert(lora_aggr_due(&aggr, 0, 0, &out, &wait));
+
+    // records with and without a deadline don't share a frame, the queue
+    // would drop them all when it passed
+    lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+    m = bytes(3, 5, 4, 0);
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_ADDED);
+    m.has_deadline = true;
+    m.deadline = 5000;
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_CLOSED);
+    assert(!out.has_deadline);
+    m.has_deadline = false;
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_CLOSED);
+    assert(out.has_deadline && out.deadline == 5000);
+
+    // another port, data rate, confirmation or width starts a new frame
+    lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+    m = bytes(3, 5, 4, 0);
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_ADDED);
+    m.port = 4;
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_CLOSED && out.port == 3);
+    m.dr = 4;
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_CLOSED && out.dr == 5);
+    m.confirmed = true;
+    assert(lora_aggr_put(&aggr, &m, 0, 0, &out) == E_LORA_AGGR_CLOSED && !out.confirmed);
+    assert(lora_aggr_put(&aggr, &m, 2, 0, &out) == E_LORA_AGGR_CLOSED && out.data[0] == 0);
+    assert(lora_aggr_put(&aggr, &m, 2, 0, &out) == E_LORA_AGGR_ADDED);
+    assert(aggr.stats.frames == 4);
+
+    // dropped, nothing is left to flush
+    lora_aggr_drop(&aggr);
+    assert(!lora_aggr_flush(&aggr, &out));
+    assert(lora_aggr_put(&aggr, &m, 2, 0, &out) == E_LORA_AGGR_ADDED);
+    assert(lora_aggr_flush(&aggr, &out) && out.data[1] == (2 << 1));
+}
+
+static void test_malformed(void) {
+    static uint8_t rec[LORA_TX_SCHED_PAYLOAD_MAX];
+    lora_aggr_reader_t r;
+    lora_tx_msg_t out, m;
+    uint8_t frame[LORA_TX_SCHED_PAYLOAD_MAX] = { 0 };
+
+    assert(!lora_aggr_reader_init(&r, frame, 0));
+    frame[0] = 3;
+    assert(!lora_aggr_reader_init(&r, frame, 1));
+    // a delta first
+    static const uint8_t first_delta[] = { 1, 1 << 1 | 1, 0x02 };
+    assert(lora_aggr_reader_init(&r, first_delta, sizeof(first_delta)));
+    assert(lora_aggr_read(&r, rec) == -1);
+    // an empty record, and a raw delta
+    static const uint8_t empty[] = { 0, 0 };
+    assert(lora_aggr_reader_init(&r, empty, sizeof(empty)));
+    assert(lora_aggr_read(&r, rec) == -1);
+    static const uint8_t raw_delta[] = { 0, 1 << 1 | 1, 0x02 };
+    assert(lora_aggr_reader_init(&r, raw_delta, sizeof(raw_delta)));
+    assert(lora_aggr_read(&r, rec) == -1);
+
+    // cut anywhere, or corrupted, a frame never reads out of bounds
+    for (uint32_t round = 0; round < 500; round++) {
+        uint8_t width = (uint8_t[]){ 0, 1, 2, 4 }[round % 4];
+        lora_aggr_init(&aggr, &stub_ops, NULL, 1000);
+        for (uint32_t i = 0; i < 6; i++) {
+            m = bytes(1, 3, 8, rand());
+            lora_aggr_put(&aggr, &m, width, 0, &out);
+        }
+        assert(lora_aggr_flush(&aggr, &out));
+        for (uint32_t len = 1; len <= out.len; len++) {
+            memcpy(frame, out.data, len);
+            if (round & 1) {
+                frame[1 + rand() % (out.len - 1)] = rand();
+            }
+            assert(lora_aggr_reader_init(&r, frame, len));
+            for (uint32_t i = 0; i < 100 && lora_aggr_read(&r, rec) > 0; i++) {
+                assert(r.pos <= len);
+            }
+        }
+    }
+}
+
+// a reading a minute of temperature, humidity and pressure, in int16,
+// which change a little at a time; a frame every 15 minutes at most
+static void test_air_time_saved(void) {
+    lora_tx_msg_t out, m;
+    uint32_t wait, frames = 0;
+    int16_t values[3] = { 2150, 480, 10132 };
+
+    for (uint32_t dr = 0; dr < 6; dr += 5) {
+        lora_aggr_init(&aggr, &stub_ops, NULL, 15 * 60 * 1000);
+        for (uint32_t minute = 0; minute < 24 * 60; minute++) {
+            uint32_t now = minute * 60 * 1000;
+            values[0] += (rand() % 7) - 3;
+            values[1] += (rand() % 3) - 1;
+            values[2] += (rand() % 5) - 2;
+            m = record(2, dr, values, sizeof(values));
+            if (lora_aggr_put(&aggr, &m, 2, now, &out) == E_LORA_AGGR_CLOSED) {
+                frames++;
+            }
+            if (lora_aggr_due(&aggr, now, 0, &out, &wait)) {
+                frames++;
+            }
+        }
+        if (lora_aggr_flush(&aggr, &out)) {
+            frames++;
+        }
+        const lora_aggr_stats_t *stats = &aggr.stats;
+        assert(stats->records == 24 * 60);
+        assert(stats->frames == frames);
+        printf("  DR%u: %u readings in %u frames, %u bytes for %u, %u ms on air for %u\n",
+               (unsigned)dr, (unsigned)stats->records, (unsigned)stats->frames, (unsigned)stats->bytes_out,
+               (unsigned)stats->bytes_in, (unsigned)stats->air_sent, (unsigned)stats->air_alone);
+        // the differences take a byte a field, the first record of a frame more
+        assert(stats->bytes_out * 5 < stats->bytes_in * 4);
+        assert(stats->air_sent * 5 < stats->air_alone);
+        frames = 0;
+    }
+}
+
+int main(void) {
+    srand(1);
+    printf("round trip\n");
+    test_round_trip();
+    printf("encoding\n");
+    test_encoding();
+    printf("closing\n");
+    test_closing();
+    printf("malformed\n");
+    test_malformed();
+    printf("air time saved\n");
+    test_air_time_saved();
+    printf("OK\n");
+    return 0;
+}
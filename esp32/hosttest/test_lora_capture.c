@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The capture of the received frames' metadata: the record layout read by
+// ustruct, bulk reads across the end of the ring, overruns told by the
+// records that follow, then a writer thread in place of the radio
+// interrupt racing the main thread reading as MicroPython would.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "lora_capture.h"
+
+#define RING_SIZE           (64)
+#define STRESS_RECORDS      (500000)
+
+static lora_capture_t capture;
+static lora_capture_rec_t recs[RING_SIZE];
+
+static lora_capture_rec_t record(uint32_t seq) {
+    lora_capture_rec_t rec = {
+        .timestamp = seq * 1000,
+        .frequency = 868100000 + (seq % 3) * 200000,
+        .rssi = -120 + (int16_t)(seq % 100),
+        .snr = -20 + (int8_t)(seq % 30),
+        .sf = 7 + seq % 6,
+        .len = seq % 256,
+        .dropped = 0x55,                // the capture sets it
+        .rfu = 0,
+    };
+    return rec;
+}
+
+static bool same(const lora_capture_rec_t *rec, uint32_t seq) {
+    lora_capture_rec_t expected = record(seq);
+    return rec->timestamp == expected.timestamp && rec->frequency == expected.frequency &&
+           rec->rssi == expected.rssi && rec->snr == expected.snr && rec->sf == expected.sf &&
+           rec->len == expected.len;
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_layout(void) {
+    // what the Python side unpacks with "<IIhbBHBx"
+    assert(sizeof(lora_capture_rec_t) == 16);
+    assert(offsetof(lora_capture_rec_t, frequency) == 4);
+    assert(offsetof(lora_capture_rec_t, rssi) == 8);
+    assert(offsetof(lora_capture_rec_t, snr) == 10);
+    assert(offsetof(lora_capture_rec_t, sf) == 11);
+    assert(offsetof(lora_capture_rec_t, len) == 12);
+    assert(offsetof(lora_capture_rec_t, dropped) == 14);
+}
+
+static void test_bulk(void) {
+    lora_capture_rec_t out[RING_SIZE];
+    uint8_t bytes[10 * sizeof(lora_capture_rec_t) + 1];
+    uint32_t seq = 0, next = 0;
+
+    lora_capture_init(&capture, recs, RING_SIZE);
+    assert(lora_capture_count(&capture) == 0);
+    assert(lora_capture_read(&capture, out, RING_SIZE) == 0);
+
+    // around the ring a few times, in reads of any size
+    for (uint32_t round = 0; round < 50; round++) {
+        uint32_t put = 1 + rand() % RING_SIZE;
+        for (uint32_t i = 0; i < put && lora_capture_count(&capture) < RING_SIZE; i++) {
+            lora_capture_rec_t rec = record(seq++);
+            assert(lora_capture_put(&capture, &rec));
+        }
+        uint32_t n = lora_capture_read(&capture, out, 1 + rand() % RING_SIZE);
+        for (uint32_t i = 0; i < n; i++) {
+            assert(same(&out[i], next) && out[i].dropped == 0);
+            next++;
+        }
+    }
+    next += lora_capture_read(&capture, out, RING_SIZE);
+    assert(next == seq && capture.stats.captured == seq && capture.stats.dropped == 0);
+
+    // into a buffer of bytes with no alignment, the whole records only
+    for (uint32_t i = 0; i < 20; i++) {
+        lora_capture_rec_t rec = record(seq++);
+        assert(lora_capture_put(&capture, &rec));
+    }
+    assert(lora_capture_read(&capture, bytes + 1, 10) == 10);
+    memcpy(out, bytes + 1, 10 * sizeof(lora_capture_rec_t));
+    for (uint32_t i = 0; i < 10; i++) {
+        assert(same(&out[i], next++));
+    }
+    assert(lora_capture_count(&capture) == 10);
+    lora_capture_clear(&capture);
+    assert(lora_capture_count(&capture) == 0 && lora_capture_read(&capture, out, RING_SIZE) == 0);
+}
+
+static void test_overrun(void) {
+    lora_capture_rec_t out[RING_SIZE];
+    lora_capture_rec_t rec;
+
+    lora_capture_init(&capture, recs, RING_SIZE);
+    for (uint32_t i = 0; i < RING_SIZE; i++) {
+        rec = record(i);
+        assert(lora_capture_put(&capture, &rec));
+    }
+    // full, these are dropped
+    for (uint32_t i = 0; i < 3; i++) {
+        rec = record(RING_SIZE + i);
+        assert(!lora_capture_put(&capture, &rec));
+    }
+    assert(capture.stats.dropped == 3 && capture.stats.high_water == RING_SIZE);
+
+    assert(lora_capture_read(&capture, out, 1) == 1 && same(&out[0], 0));
+    rec = record(1000);
+    assert(lora_capture_put(&capture, &rec));
+    // many more, the count saturates
+    for (uint32_t i = 0; i < 300; i++) {
+        assert(!lora_capture_put(&capture, &rec));
+    }
+    assert(lora_capture_read(&capture, out, RING_SIZE) == RING_SIZE);
+    assert(same(&out[RING_SIZE - 1], 1000) && out[RING_SIZE - 1].dropped == 3);
+    rec = record(2000);
+    assert(lora_capture_put(&capture, &rec));
+    assert(lora_capture_read(&capture, out, RING_SIZE) == 1 && out[0].dropped == 0xFF);
+
+    lora_capture_error(&capture);
+    assert(capture.stats.errors == 1 && capture.stats.dropped == 303);
+}
+
+static bool writer_done;
+static uint32_t writer_dropped;
+
+static void *writer_main(void *arg) {
+    for (uint32_t seq = 0; seq < STRESS_RECORDS; seq++) {
+        lora_capture_rec_t rec = record(seq);
+        if (!lora_capture_put(&capture, &rec)) {
+            writer_dropped++;
+        }
+        if ((seq & 0x3F) == 0) {
+            sched_yield();
+        }
+    }
+    __atomic_store_n(&writer_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void test_threads(void) {
+    pthread_t writer;
+    lora_capture_rec_t out[RING_SIZE];
+    uint32_t next = 0;
+    uint32_t received = 0;
+
+    lora_capture_init(&capture, recs, RING_SIZE);
+    writer_done = false;
+    writer_dropped = 0;
+    assert(pthread_create(&writer, NULL, writer_main, NULL) == 0);
+
+    // in order, the gaps where the records say
+    for (;;) {
+        bool done = __atomic_load_n(&writer_done, __ATOMIC_ACQUIRE);
+        uint32_t n = lora_capture_read(&capture, out, 1 + rand() % RING_SIZE);
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t seq = out[i].timestamp / 1000;
+            assert(seq >= next && same(&out[i], seq));
+            assert(out[i].dropped == ((seq - next > 0xFF) ? 0xFF : seq - next));
+            next = seq + 1;
+        }
+        received += n;
+        if (done && n == 0) {
+            break;
+        }
+    }
+    pthread_join(writer, NULL);
+
+    assert(received + writer_dropped == STRESS_RECORDS);
+    assert(capture.stats.captured == received && capture.stats.dropped == writer_dropped);
+    printf("  %u records, %u dropped\n", (unsigned)received, (unsigned)writer_dropped);
+}
+
+int main(void) {
+    srand(1);
+    printf("layout\n");
+    test_layout();
+    printf("bulk\n");
+    test_bulk();
+    printf("overrun\n");
+    test_overrun();
+    printf("threads\n");
+    test_threads();
+    printf("OK\n");
+    return 0;
+}
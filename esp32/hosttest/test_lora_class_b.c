@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The Class B timing against a simulated network: a gateway sends the
+// beacons on the GPS time and the network server works the ping slots out
+// from the specification, while the device's clock drifts and wraps.  Every
+// beacon and every ping slot has to fall in the device's windows, through
+// hours of beacons received and missed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "lora_class_b.h"
+#include "aes.h"
+
+// what the MAC adds to the windows for the radio and its timestamps
+#define RX_MARGIN                       (10)
+
+/******************************************************************************
+ THE NETWORK
+ ******************************************************************************/
+static void put24(uint8_t *buf, int32_t v) {
+    buf[0] = v;
+    buf[1] = v >> 8;
+    buf[2] = v >> 16;
+}
+
+static void build_beacon(const lora_class_b_region_t *r, uint32_t time, uint8_t *buf) {
+    uint32_t crc1_at = r->rfu1 + 4;
+    uint32_t gw_at = crc1_at + 2;
+    uint16_t crc;
+
+    memset(buf, 0, r->size);
+    for (uint32_t i = 0; i < 4; i++) {
+        buf[r->rfu1 + i] = time >> (8 * i);
+    }
+    crc = lora_class_b_crc(buf, crc1_at);
+    buf[crc1_at] = crc;
+    buf[crc1_at + 1] = crc >> 8;
+    buf[gw_at] = 0;
+    put24(&buf[gw_at + 1], 4823449);        // 51.75 N
+    put24(&buf[gw_at + 4], -92);            // 0.002 W
+    crc = lora_class_b_crc(&buf[gw_at], r->size - 2 - gw_at);
+    buf[r->size - 2] = crc;
+    buf[r->size - 1] = crc >> 8;
+}
+
+// the ping offset as the specification puts it, with the reference AES
+static uint32_t network_ping_offset(uint32_t beacon_time, uint32_t dev_addr, uint32_t ping_period) {
+    uint8_t key[16] = { 0 };
+    uint8_t in[16] = { 0 };
+    uint8_t out[16];
+    aes_context aes;
+
+    memcpy(in, &beacon_time, 4);
+    memcpy(in + 4, &dev_addr, 4);
+    aes_set_key_lora(key, 16, &aes);
+    aes_encrypt_lora(in, out, &aes);
+    return (out[0] + 256 * out[1]) % ping_period;
+}
+
+/******************************************************************************
+ THE DEVICE'S CLOCK
+ ******************************************************************************/
+static double drift;                    // ppm
+static double clock_origin;             // ms of GPS time when the clock read local_origin
+static uint32_t local_origin;
+
+// GPS time in ms to the device's clock
+static uint32_t local(double gps_ms) {
+    double elapsed = (gps_ms - clock_origin) * (1.0 + drift / 1e6);
+    return local_origin + (uint32_t)(int64_t)elapsed;
+}
+
+static void check_within(uint32_t actual, uint32_t at, uint32_t error) {
+    int32_t off = actual - at;
+    if (abs(off) > (int32_t)(error + RX_MARGIN)) {
+        printf("  off by %d ms, window of %u\n", off, error);
+        assert(false);
+    }
+}
+
+/******************************************************************************
+ TESTS
+ ******************************************************************************/
+static void test_crc(void) {
+    assert(lora_class_b_crc((const uint8_t *)"123456789", 9) == 0x31C3);
+    assert(lora_class_b_crc(NULL, 0) == 0);
+}
+
+static void test_parse(void) {
+    const lora_class_b_region_t *regions[] = { &lora_class_b_eu868, &lora_class_b_us915 };
+    lora_class_b_beacon_t b;
+    uint8_t buf[32];
+
+    for (uint32_t i = 0; i < 2; i++) {
+        const lora_class_b_region_t *r = regions[i];
+        build_beacon(r, 1280000128, buf);
+        assert(lora_class_b_parse(r, buf, r->size, &b));
+        assert(b.time == 1280000128);
+        assert(b.info_desc == 0);
+        assert(b.lat == 4823449 && b.lng == -92);
+
+        // too short, or from the other region
+        assert(!lora_class_b_parse(r, buf, r->size - 1, &b));
+        assert(!lora_class_b_parse(regions[1 - i], buf, r->size, &b));
+
+        // a bit flipped in the time
+        buf[r->rfu1] ^= 0x10;
+        assert(!lora_class_b_parse(r, buf, r->size, &b));
+        buf[r->rfu1] ^= 0x10;
+
+        // the gateway's part alone is wrong, the time still holds
+        buf[r->size - 3] ^= 0x01;
+        assert(lora_class_b_parse(r, buf, r->size, &b));
+        assert(b.time == 1280000128 && b.info_desc == 0xFF && b.lat == 0);
+
+        // a time that isn't a period's start, with a good CRC
+        build_beacon(r, 1280000129, buf);
+        assert(!lora_class_b_parse(r, buf, r->size, &b));
+    }
+}
+
+static void test_frequencies(void) {
+    lora_class_b_t cb;
+
+    lora_class_b_init(&cb, &lora_class_b_eu868);
+    assert(lora_class_b_beacon_freq(&cb, 0) == 869525000);
+    assert(lora_class_b_ping_freq(&cb, 128) == 869525000);
+    assert(lora_class_b_ping_dr(&cb) == 3);
+    cb.beacon_freq = 869100000;
+    cb.ping_freq = 869300000;
+    cb.ping_dr = 5;
+    assert(lora_class_b_beacon_freq(&cb, 0) == 869100000);
+    assert(lora_class_b_ping_freq(&cb, 0) == 869300000);
+    assert(lora_class_b_ping_dr(&cb) == 5);
+
+    // the beacon hops every period, the pings too, shifted by the DevAddr
+    lora_class_b_init(&cb, &lora_class_b_us915);
+    lora_class_b_start(&cb, 0xFFFFFFFE, 0);
+    for (uint32_t p = 0; p < 16; p++) {
+        uint32_t t = 1280000000 + p * 128;
+        assert(lora_class_b_beacon_freq(&cb, t) == 923300000 + 600000 * ((t / 128) % 8));
+        assert(lora_class_b_ping_freq(&cb, t) == 923300000 + 600000 * (uint32_t)(((uint64_t)(t / 128) + 0xFFFFFFFE) % 8));
+    }
+}
+
+static void test_ping_slots(void) {
+    lora_class_b_t cb;
+    uint8_t buf[32];
+
+    lora_class_b_init(&cb, &lora_class_b_eu868);
+    for (uint8_t p = 0; p <= LORA_CLASS_B_PERIODICITY_MAX; p++) {
+        uint32_t period = lora_class_b_ping_period(p);
+        uint32_t at, error, n = 0, last = 0;
+
+        lora_class_b_start(&cb, 0x26011F2A, p);
+        build_beacon(cb.region, 1280000000 + p * 128, buf);
+        assert(lora_class_b_beacon_rx(&cb, buf, cb.region->size, 1000));
+        assert(cb.ping_offset == network_ping_offset(1280000000 + p * 128, 0x26011F2A, period));
+
+        for (uint32_t from = 1000; lora_class_b_next_ping(&cb, from, &at, &error); from = at + 1) {
+            if (n > 0) {
+                assert(at - last == period * LORA_CLASS_B_SLOT_LEN);
+            }
+            // none reaches into the guard time of the next beacon
+            assert(at + LORA_CLASS_B_SLOT_LEN <= 1000 + LORA_CLASS_B_BEACON_INTERVAL - LORA_CLASS_B_BEACON_GUARD);
+            last = at;
+            n++;
+        }
+        // 2^(7 - p) of them
+        assert(n == (128u >> p));
+    }
+
+    // asked from the middle of a slot's gap it gives the next one
+    lora_class_b_set_periodicity(&cb, 5);
+    uint32_t first, second, error;
+    assert(lora_class_b_next_ping(&cb, 0, &first, &error));
+    assert(lora_class_b_next_ping(&cb, first + 1, &second, &error));
+    assert(second == first + 1024 * LORA_CLASS_B_SLOT_LEN);
+    assert(lora_class_b_next_ping(&cb, second, &second, &error) && second == first + 1024 * LORA_CLASS_B_SLOT_LEN);
+}
+
+// Hours of beacons with a drifting clock: found from the RTC's time, then
+// tracked, through a long gap without them, until they stop for good.
+static void simulate(const lora_class_b_region_t *region, double ppm, uint8_t periodicity, uint32_t dev_addr) {
+    lora_class_b_t cb;
+    uint8_t buf[32];
+    uint32_t at, error, widest = 0, pings = 0;
+
+    drift = ppm;
+    clock_origin = 1280000000.0 * 1000 + 77777.5;
+    local_origin = 0xFFFF0000;                  // it wraps in a minute
+
+    lora_class_b_init(&cb, region);
+    lora_class_b_start(&cb, dev_addr, periodicity);
+    assert(!lora_class_b_next_beacon(&cb, &at, &error));
+    assert(!lora_class_b_next_ping(&cb, local_origin, &at, &error));
+
+    // the RTC keeps whole seconds
+    double now = clock_origin + 5000.25;
+    lora_class_b_set_time(&cb, (uint32_t)(now / 1000), local(now), 1000);
+
+    uint32_t period_s = LORA_CLASS_B_BEACON_INTERVAL / 1000;
+    uint32_t beacon_time = ((uint32_t)(now / 1000) / period_s + 1) * period_s;
+    for (uint32_t n = 0; ; n++, beacon_time += period_s) {
+        double gps_ms = beacon_time * 1000.0;
+        uint32_t arrives = local(gps_ms);
+
+        // the window for it is where it comes
+        assert(lora_class_b_next_beacon(&cb, &at, &error));
+        check_within(arrives, at, error);
+        if (cb.state == E_LORA_CLASS_B_LOCKED && error > widest) {
+            widest = error;
+        }
+        assert(lora_class_b_beacon_freq(&cb, cb.beacon_time + period_s) == lora_class_b_beacon_freq(&cb, beacon_time));
+
+        // the 2nd is lost, then 40 in a row, and from the 100th on all of them
+        bool received = n != 1 && !(n >= 20 && n < 60) && n < 100;
+        if (received) {
+            build_beacon(region, beacon_time, buf);
+            // the radio's timestamp is a few ms off
+            assert(lora_class_b_beacon_rx(&cb, buf, region->size, arrives + (n % 7) - 3));
+        } else if (!lora_class_b_beacon_missed(&cb)) {
+            // two hours after the last one
+            assert(n == 100 + LORA_CLASS_B_MAX_MISSED - 1);
+            assert(cb.state == E_LORA_CLASS_B_OFF);
+            break;
+        }
+        assert(cb.beacon_time == beacon_time);
+        assert(cb.state == E_LORA_CLASS_B_LOCKED);
+
+        // the network's ping slots of the period, each where the device listens
+        uint32_t period = lora_class_b_ping_period(periodicity);
+        uint32_t offset = network_ping_offset(beacon_time, dev_addr, period);
+        uint32_t from = cb.beacon_at;
+        for (uint32_t k = 0; k < LORA_CLASS_B_SLOTS / period; k++) {
+            double slot_ms = gps_ms + LORA_CLASS_B_BEACON_RESERVED + (offset + k * period) * LORA_CLASS_B_SLOT_LEN;
+            assert(lora_class_b_next_ping(&cb, from, &at, &error));
+            check_within(local(slot_ms), at, error);
+            from = at + 1;
+            pings++;
+        }
+        assert(!lora_class_b_next_ping(&cb, from, &at, &error));
+    }
+    assert(cb.stats.beacons == 100 - 40 - 1);
+    assert(cb.stats.lost == 1);
+    printf("  %s %+.0f ppm, periodicity %u: %u pings, beacon windows up to +/-%u ms\n",
+           region == &lora_class_b_eu868 ? "EU868" : "US915", ppm, periodicity, pings, widest);
+}
+
+static void test_acquire_fails(void) {
+    lora_class_b_t cb;
+    uint32_t at, error;
+
+    lora_class_b_init(&cb, &lora_class_b_eu868);
+    lora_class_b_start(&cb, 1, 0);
+    lora_class_b_set_time(&cb, 1280000000, 0, 1000);
+    assert(lora_class_b_next_beacon(&cb, &at, &error) && at == LORA_CLASS_B_BEACON_INTERVAL);
+    assert(lora_class_b_beacon_missed(&cb));
+    assert(lora_class_b_beacon_missed(&cb));
+    assert(lora_class_b_beacon_missed(&cb));
+    assert(!lora_class_b_beacon_missed(&cb));
+    assert(cb.state == E_LORA_CLASS_B_OFF);
+    assert(cb.stats.lost == 0);
+}
+
+int main(void) {
+    printf("crc\n");
+    test_crc();
+    printf("parse\n");
+    test_parse();
+    printf("frequencies\n");
+    test_frequencies();
+    printf("ping slots\n");
+    test_ping_slots();
+    printf("simulation\n");
+    simulate(&lora_class_b_eu868, 40, 0, 0x26011F2A);
+    simulate(&lora_class_b_eu868, -95, 5, 0x00000001);
+    simulate(&lora_class_b_us915, 20, 7, 0xFEDCBA98);
+    printf("acquire\n");
+    test_acquire_fails();
+    printf("OK\n");
+    return 0;
+}
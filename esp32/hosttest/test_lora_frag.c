@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The decoder of fragmented data blocks, on a storage that, like erased
+// flash, can only be written once in each place.  Blocks are sent as the
+// server would, their fragments then coded ones, through a link that loses
+// some at random, and must come out whole.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "lora_frag.h"
+
+#define STORAGE_SIZE        (LORA_FRAG_MAX_FRAGS * 64 + LORA_FRAG_MAX_LOST * 64)
+
+/******************************************************************************
+ write once storage
+ ******************************************************************************/
+static uint8_t storage[STORAGE_SIZE];
+static bool written[STORAGE_SIZE];
+static bool fail_writes;
+static uint32_t reads;
+
+static bool stub_write(void *ctx, uint32_t offset, const uint8_t *buf, uint32_t len) {
+    assert(ctx == storage);
+    assert(offset + len <= STORAGE_SIZE);
+    if (fail_writes) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        assert(!written[offset + i]);
+        written[offset + i] = true;
+    }
+    memcpy(storage + offset, buf, len);
+    return true;
+}
+
+static bool stub_read(void *ctx, uint32_t offset, uint8_t *buf, uint32_t len) {
+    assert(offset + len <= STORAGE_SIZE);
+    for (uint32_t i = 0; i < len; i++) {
+        assert(written[offset + i]);
+    }
+    memcpy(buf, storage + offset, len);
+    reads++;
+    return true;
+}
+
+static const lora_frag_ops_t stub_ops = {
+    .write = stub_write,
+    .read = stub_read,
+};
+
+static lora_frag_t frag;
+static uint8_t block[LORA_FRAG_MAX_FRAGS * 64];
+
+static void setup(uint32_t nb_frag, uint32_t frag_size, uint32_t max_lost) {
+    memset(written, 0, sizeof(written));
+    fail_writes = false;
+    reads = 0;
+    for (uint32_t i = 0; i < nb_frag * frag_size; i++) {
+        block[i] = rand();
+    }
+    assert(lora_frag_init(&frag, &stub_ops, storage, nb_frag, frag_size, max_lost));
+}
+
+// coded fragment n of the block, as the server makes it
+static void coded(uint32_t nb_frag, uint32_t frag_size, uint32_t n, uint8_t *out) {
+    uint8_t row[LORA_FRAG_MAX_FRAGS / 8];
+    lora_frag_parity_row(n, nb_frag, row);
+    memset(out, 0, frag_size);
+    for (uint32_t i = 0; i < nb_frag; i++) {
+        if ((row[i / 8] >> (i % 8)) & 1) {
+            for (uint32_t j = 0; j < frag_size; j++) {
+                out[j] ^= block[i * frag_size + j];
+            }
+        }
+    }
+}
+
+static lora_frag_result_t send(uint32_t n, uint32_t nb_frag, uint32_t frag_size) {
+    uint8_t data[LORA_FRAG_MAX_SIZE];
+    if (n <= nb_frag) {
+        memcpy(data, block + (n - 1) * frag_size, frag_size);
+    } else {
+        coded(nb_frag, frag_size, n - nb_frag, data);
+    }
+    return lora_frag_process(&frag, n, data, frag_size);
+}
+
+static void check_block(uint32_t nb_frag, uint32_t frag_size) {
+    assert(lora_frag_done(&frag));
+    assert(lora_frag_missing(&frag) == 0);
+    assert(memcmp(storage, block, nb_frag * frag_size) == 0);
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_parity(void) {
+    uint8_t row[LORA_FRAG_MAX_FRAGS / 8];
+    uint8_t other[LORA_FRAG_MAX_FRAGS / 8];
+
+    // about half the fragments are in each row, and the rows differ
+    uint32_t sizes[] = { 2, 3, 10, 64, 100, 1000, LORA_FRAG_MAX_FRAGS };
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t m = sizes[s];
+        for (uint32_t n = 1; n <= 20; n++) {
+            lora_frag_parity_row(n, m, row);
+            uint32_t ones = 0;
+            for (uint32_t i = 0; i < m; i++) {
+                ones += (row[i / 8] >> (i % 8)) & 1;
+            }
+            assert(ones >= 1 && ones <= m / 2);
+            if (m >= 64) {
+                assert(ones >= m / 4);
+            }
+            // nothing past the last fragment
+            for (uint32_t i = m; i < (m + 7) / 8 * 8; i++) {
+                assert(!((row[i / 8] >> (i % 8)) & 1));
+            }
+            if (n > 1 && m >= 10) {
+                assert(memcmp(row, other, (m + 7) / 8) != 0);
+            }
+            memcpy(other, row, (m + 7) / 8);
+        }
+    }
+}
+
+static void test_no_loss(void) {
+    setup(100, 50, 20);
+    for (uint32_t n = 1; n <= 100; n++) {
+        assert(lora_frag_missing(&frag) == 101 - n);
+        assert(send(n, 100, 50) == (n == 100 ? E_LORA_FRAG_DONE : E_LORA_FRAG_ONGOING));
+    }
+    check_block(100, 50);
+
+    // what comes after is ignored
+    assert(send(3, 100, 50) == E_LORA_FRAG_DONE);
+    assert(send(101, 100, 50) == E_LORA_FRAG_DONE);
+    assert(frag.stats.duplicates == 2);
+    assert(frag.stats.rebuilt == 0);
+
+    // and so are fragments of the wrong size
+    uint8_t data[10] = { 0 };
+    assert(lora_frag_process(&frag, 5, data, sizeof(data)) == E_LORA_FRAG_DONE);
+}
+
+static void test_one_lost(void) {
+    setup(10, 20, 10);
+    for (uint32_t n = 1; n <= 10; n++) {
+        if (n != 4) {
+            assert(send(n, 10, 20) == E_LORA_FRAG_ONGOING);
+        }
+    }
+    assert(lora_frag_missing(&frag) == 1);
+    // the coded ones without fragment 4 bring nothing
+    lora_frag_result_t res = E_LORA_FRAG_ONGOING;
+    for (uint32_t n = 11; res == E_LORA_FRAG_ONGOING; n++) {
+        assert(n < 40);
+        res = send(n, 10, 20);
+    }
+    assert(res == E_LORA_FRAG_DONE);
+    check_block(10, 20);
+    assert(frag.stats.rebuilt == 1);
+}
+
+// a lost fragment comes late, after the coded ones started
+static void test_late(void) {
+    setup(30, 16, 10);
+    for (uint32_t n = 1; n <= 30; n++) {
+        if (n % 10 != 0) {
+            send(n, 30, 16);
+        }
+    }
+    assert(send(31, 30, 16) == E_LORA_FRAG_ONGOING);
+    assert(lora_frag_missing(&frag) <= 2);
+    // each is an equation of its own; sent twice, it brings nothing new
+    send(10, 30, 16);
+    send(20, 30, 16);
+    uint32_t useless = frag.stats.useless;
+    send(20, 30, 16);
+    assert(lora_frag_done(&frag) || frag.stats.useless == useless + 1);
+    lora_frag_result_t res = lora_frag_done(&frag) ? E_LORA_FRAG_DONE : E_LORA_FRAG_ONGOING;
+    for (uint32_t n = 1; res == E_LORA_FRAG_ONGOING; n++) {
+        assert(n < 100);
+        res = send(30 + n, 30, 16);
+    }
+    check_block(30, 16);
+}
+
+// more lost than the scratch area takes: nothing's rebuilt, until enough of
+// them are sent again
+static void test_too_many(void) {
+    setup(50, 10, 4);
+    for (uint32_t n = 1; n <= 50; n++) {
+        if (n % 5 != 0) {
+            send(n, 50, 10);
+        }
+    }
+    for (uint32_t n = 51; n < 80; n++) {
+        assert(send(n, 50, 10) == E_LORA_FRAG_ONGOING);
+    }
+    assert(frag.too_many_lost);
+    assert(lora_frag_missing(&frag) == 10);
+    for (uint32_t n = 5; n <= 30; n += 5) {
+        send(n, 50, 10);
+    }
+    assert(lora_frag_missing(&frag) == 4);
+    lora_frag_result_t res = E_LORA_FRAG_ONGOING;
+    for (uint32_t n = 80; res == E_LORA_FRAG_ONGOING; n++) {
+        assert(n < 200);
+        res = send(n, 50, 10);
+    }
+    assert(!frag.too_many_lost);
+    check_block(50, 10);
+}
+
+static void test_error(void) {
+    setup(10, 10, 10);
+    fail_writes = true;
+    assert(send(1, 10, 10) == E_LORA_FRAG_ERROR);
+    fail_writes = false;
+    assert(send(1, 10, 10) == E_LORA_FRAG_ONGOING);
+}
+
+// blocks of every shape through links losing up to a third of the frames;
+// with a margin as large as the loss, they come out whole, needing little
+// more coded fragments than were lost
+static void test_lossy(void) {
+    struct {
+        uint32_t nb_frag;
+        uint32_t frag_size;
+        uint32_t loss;                  // %
+    } runs[] = {
+        { 2, 8, 30 }, { 7, 51, 10 }, { 64, 222, 20 }, { 100, 50, 5 }, { 300, 100, 30 },
+        { 1000, 64, 10 }, { 1000, 64, 1 }, { 4096, 32, 2 }, { LORA_FRAG_MAX_FRAGS, 50, 1 },
+    };
+    for (uint32_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        uint32_t nb_frag = runs[r].nb_frag;
+        uint32_t frag_size = runs[r].frag_size;
+        for (uint32_t trial = 0; trial < 4; trial++) {
+            uint32_t lost = 0;
+            uint32_t extra = 0;
+            setup(nb_frag, frag_size, LORA_FRAG_MAX_LOST);
+            lora_frag_result_t res = E_LORA_FRAG_ONGOING;
+            for (uint32_t n = 1; n <= nb_frag; n++) {
+                if ((uint32_t)(rand() % 100) < runs[r].loss) {
+                    lost++;
+                } else {
+                    res = send(n, nb_frag, frag_size);
+                }
+            }
+            if (lost > LORA_FRAG_MAX_LOST) {
+                continue;
+            }
+            for (uint32_t n = nb_frag + 1; res == E_LORA_FRAG_ONGOING; n++) {
+                assert(n < 4 * nb_frag + 100);
+                if ((uint32_t)(rand() % 100) >= runs[r].loss) {
+                    res = send(n, nb_frag, frag_size);
+                    extra++;
+                }
+            }
+            assert(res == E_LORA_FRAG_DONE);
+            check_block(nb_frag, frag_size);
+            assert(frag.stats.rebuilt == lost);
+            assert(extra == lost + frag.stats.useless);
+            if (trial == 0) {
+                printf("  %u fragments of %u bytes, %u lost, rebuilt from %u coded, %u reads\n",
+                       nb_frag, frag_size, lost, extra, reads);
+            }
+        }
+    }
+}
+
+int main(void) {
+    srand(1);
+    printf("  decoder: %u bytes\n", (unsigned)sizeof(lora_frag_t));
+    assert(sizeof(lora_frag_t) < 6 * 1024);
+    printf("parity\n");
+    test_parity();
+    printf("no loss\n");
+    test_no_loss();
+    printf("one lost\n");
+    test_one_lost();
+    printf("late\n");
+    test_late();
+    printf("too many\n");
+    test_too_many();
+    printf("error\n");
+    test_error();
+    printf("lossy\n");
+    test_lossy();
+    printf("OK\n");
+    return 0;
+}
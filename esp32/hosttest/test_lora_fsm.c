@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The LoRa task's state machine, run by a thread in place of the task,
+// with task notifications made of a condition variable and a simulated
+// radio whose interrupts come from another thread after the air time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lora_fsm.h"
+
+#define CMD_QUEUE_SIZE      (8)
+
+enum {
+    CMD_TX = 0,
+    CMD_SLEEP,
+    CMD_CONFIG,
+};
+
+typedef struct {
+    int cmd;
+    int busy;                   // times listen-before-talk finds the channel busy
+    uint32_t air_ms;
+    lora_state_t result;        // E_LORA_STATE_TX_DONE or E_LORA_STATE_TX_TIMEOUT
+} sim_cmd_t;
+
+/******************************************************************************
+ task notifications
+ ******************************************************************************/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notified = PTHREAD_COND_INITIALIZER;
+static uint32_t notification;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t stub_ticks_ms(void) {
+    return now_us() / 1000;
+}
+
+static uint32_t stub_wait(uint32_t timeout_ms) {
+    struct timespec ts;
+    uint32_t events;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (timeout_ms != LORA_FSM_WAIT_FOREVER) {
+        uint64_t ns = ts.tv_nsec + (uint64_t)timeout_ms * 1000000;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+    }
+    pthread_mutex_lock(&lock);
+    while (notification == 0) {
+        if (timeout_ms == LORA_FSM_WAIT_FOREVER) {
+            pthread_cond_wait(&notified, &lock);
+        } else if (pthread_cond_timedwait(&notified, &lock, &ts) != 0) {
+            break;
+        }
+    }
+    events = notification;
+    notification = 0;
+    pthread_mutex_unlock(&lock);
+    return events;
+}
+
+static void stub_notify(uint32_t events) {
+    pthread_mutex_lock(&lock);
+    notification |= events;
+    pthread_cond_signal(&notified);
+    pthread_mutex_unlock(&lock);
+}
+
+/******************************************************************************
+ simulated radio, its interrupts come from a thread
+ ******************************************************************************/
+static lora_fsm_t fsm;
+static pthread_mutex_t radio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t radio_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t irq_at;         // 0 if none pending
+static lora_state_t irq_state;
+static volatile bool radio_stop;
+static pthread_t radio_thread;
+
+static int radio_resets;
+static int radio_sleeps;
+static int radio_rx_starts;
+
+static void radio_irq_after(uint32_t ms, lora_state_t state) {
+    pthread_mutex_lock(&radio_lock);
+    irq_at = now_us() + ms * 1000;
+    irq_state = state;
+    pthread_cond_signal(&radio_cond);
+    pthread_mutex_unlock(&radio_lock);
+}
+
+static void *radio_main(void *arg) {
+    pthread_mutex_lock(&radio_lock);
+    while (!radio_stop) {
+        if (irq_at == 0) {
+            pthread_cond_wait(&radio_cond, &radio_lock);
+            continue;
+        }
+        uint64_t now = now_us();
+        if (now < irq_at) {
+            pthread_mutex_unlock(&radio_lock);
+            usleep(irq_at - now < 1000 ? irq_at - now : 1000);
+            pthread_mutex_lock(&radio_lock);
+            continue;
+        }
+        irq_at = 0;
+        // what the interrupt handler does
+        fsm.state = irq_state;
+        stub_notify(LORA_FSM_EVENT_STATE);
+    }
+    pthread_mutex_unlock(&radio_lock);
+    return NULL;
+}
+
+static void stub_radio_reset(void) {
+    radio_resets++;
+}
+
+static void stub_radio_sleep(void) {
+    radio_sleeps++;
+}
+
+static void stub_radio_rx(void) {
+    radio_rx_starts++;
+}
+
+/******************************************************************************
+ commands, as modlora runs them
+ ******************************************************************************/
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_cmd_t queue[CMD_QUEUE_SIZE];
+static uint32_t queue_head;
+static uint32_t queue_tail;
+static sim_cmd_t task_cmd;
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int done_count;
+static int done_timeouts;
+
+static uint64_t queued_at;
+static uint64_t sent_at;
+static int mac_states;
+
+static void signal_done(bool timeout) {
+    pthread_mutex_lock(&done_lock);
+    done_count++;
+    done_timeouts += timeout;
+    pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+}
+
+static lora_fsm_cmd_result_t stub_command(bool retry) {
+    if (!retry) {
+        pthread_mutex_lock(&queue_lock);
+        if (queue_head == queue_tail) {
+            pthread_mutex_unlock(&queue_lock);
+            return E_LORA_FSM_CMD_NONE;
+        }
+        task_cmd = queue[queue_tail++ % CMD_QUEUE_SIZE];
+        pthread_mutex_unlock(&queue_lock);
+    }
+    switch (task_cmd.cmd) {
+    case CMD_TX:
+        if (task_cmd.busy > 0) {
+            task_cmd.busy--;
+            return E_LORA_FSM_CMD_RETRY;
+        }
+        sent_at = now_us();
+        fsm.state = E_LORA_STATE_TX;
+        radio_irq_after(task_cmd.air_ms, task_cmd.result);
+        break;
+    case CMD_SLEEP:
+        stub_radio_sleep();
+        fsm.state = E_LORA_STATE_SLEEP;
+        signal_done(false);
+        break;
+    default:
+        signal_done(false);
+        break;
+    }
+    return E_LORA_FSM_CMD_DONE;
+}
+
+static void stub_mac_state(lora_state_t state) {
+    mac_states++;
+    fsm.state = E_LORA_STATE_IDLE;
+    signal_done(false);
+}
+
+static void stub_tx_end(bool timeout) {
+    signal_done(timeout);
+}
+
+static const lora_fsm_ops_t stub_ops = {
+    .wait = stub_wait,
+    .notify = stub_notify,
+    .ticks_ms = stub_ticks_ms,
+    .command = stub_command,
+    .mac_state = stub_mac_state,
+    .radio_reset = stub_radio_reset,
+    .radio_sleep = stub_radio_sleep,
+    .radio_rx = stub_radio_rx,
+    .tx_end = stub_tx_end,
+};
+
+/******************************************************************************
+ the task, and the MicroPython side
+ ******************************************************************************/
+static volatile bool task_stop;
+static pthread_t task_thread;
+
+static void *task_main(void *arg) {
+    while (!task_stop) {
+        lora_fsm_step(&fsm);
+    }
+    return NULL;
+}
+
+static void start(lora_state_t state) {
+    lora_fsm_init(&fsm, &stub_ops);
+    fsm.state = state;
+    notification = 0;
+    queue_head = queue_tail = 0;
+    done_count = done_timeouts = 0;
+    radio_resets = radio_sleeps = radio_rx_starts = 0;
+    mac_states = 0;
+    irq_at = 0;
+    task_stop = false;
+    radio_stop = false;
+    assert(pthread_create(&radio_thread, NULL, radio_main, NULL) == 0);
+    assert(pthread_create(&task_thread, NULL, task_main, NULL) == 0);
+}
+
+static void stop(void) {
+    task_stop = true;
+    stub_notify(LORA_FSM_EVENT_CMD);
+    pthread_join(task_thread, NULL);
+    pthread_mutex_lock(&radio_lock);
+    radio_stop = true;
+    pthread_cond_signal(&radio_cond);
+    pthread_mutex_unlock(&radio_lock);
+    pthread_join(radio_thread, NULL);
+}
+
+static void queue_cmd(sim_cmd_t cmd) {
+    pthread_mutex_lock(&queue_lock);
+    assert(queue_head - queue_tail < CMD_QUEUE_SIZE);
+    queue[queue_head++ % CMD_QUEUE_SIZE] = cmd;
+    pthread_mutex_unlock(&queue_lock);
+    lora_fsm_command_queued(&fsm);
+}
+
+static void wait_done(int count) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 5;
+    pthread_mutex_lock(&done_lock);
+    while (done_count < count) {
+        assert(pthread_cond_timedwait(&done_cond, &done_lock, &ts) == 0);
+    }
+    pthread_mutex_unlock(&done_lock);
+}
+
+static void settle(void) {
+    usleep(20000);
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+// with nothing to do the task doesn't wake up at all
+static void test_idle(void) {
+    start(E_LORA_STATE_RX);
+    usleep(300000);
+    assert(fsm.stats.wakeups == 0 && fsm.stats.states == 0);
+    stop();
+}
+
+// a raw TX goes out as soon as it's queued, and its end restarts the
+// receiver and wakes the caller
+static void test_tx(void) {
+    uint64_t worst = 0;
+    uint64_t total = 0;
+    const int n = 50;
+
+    start(E_LORA_STATE_RX);
+    for (int i = 0; i < n; i++) {
+        queued_at = now_us();
+        queue_cmd((sim_cmd_t){ .cmd = CMD_TX, .air_ms = 5, .result = E_LORA_STATE_TX_DONE });
+        wait_done(i + 1);
+        uint64_t latency = sent_at - queued_at;
+        total += latency;
+        worst = latency > worst ? latency : worst;
+        // the receiver is restarted right after the caller is woken
+        usleep(1000);
+        assert(fsm.state == E_LORA_STATE_RX);
+    }
+    settle();
+    printf("  %d TX: latency %u us average, %u us worst; %u wakeups\n",
+        n, (unsigned)(total / n), (unsigned)worst, fsm.stats.wakeups);
+    assert(done_timeouts == 0);
+    assert(radio_rx_starts == n && radio_sleeps == n);
+    // the command and the end of the TX, no polling in between
+    assert(fsm.stats.wakeups <= 2 * n + 1);
+    assert(worst < 5000);
+    stop();
+}
+
+static void test_tx_timeout(void) {
+    start(E_LORA_STATE_RX);
+    queue_cmd((sim_cmd_t){ .cmd = CMD_TX, .air_ms = 10, .result = E_LORA_STATE_TX_TIMEOUT });
+    wait_done(1);
+    settle();
+    assert(done_timeouts == 1 && fsm.state == E_LORA_STATE_RX && radio_rx_starts == 1);
+    stop();
+}
+
+// a TX that finds the channel busy is kept and tried again a little later
+static void test_busy_channel(void) {
+    start(E_LORA_STATE_RX);
+    queued_at = now_us();
+    queue_cmd((sim_cmd_t){ .cmd = CMD_TX, .busy = 3, .air_ms = 5, .result = E_LORA_STATE_TX_DONE });
+    wait_done(1);
+    settle();
+    uint32_t delay_ms = (sent_at - queued_at) / 1000;
+    printf("  sent after %u ms, %u retries, %u wakeups\n", delay_ms, fsm.stats.retries, fsm.stats.wakeups);
+    assert(fsm.stats.retries == 3 && fsm.stats.commands == 1);
+    assert(delay_ms >= 3 * LORA_FSM_RETRY_MS - 1 && delay_ms < 3 * LORA_FSM_RETRY_MS + 50);
+    // a timed wait per retry
+    assert(fsm.stats.wakeups <= 3 + 2 + 1);
+    stop();
+}
+
+// commands queued in a burst all run, one event for all of them is enough
+static void test_burst(void) {
+    start(E_LORA_STATE_IDLE);
+    pthread_mutex_lock(&queue_lock);
+    for (int i = 0; i < CMD_QUEUE_SIZE; i++) {
+        queue[queue_head++ % CMD_QUEUE_SIZE] = (sim_cmd_t){ .cmd = CMD_CONFIG };
+    }
+    pthread_mutex_unlock(&queue_lock);
+    lora_fsm_command_queued(&fsm);
+    wait_done(CMD_QUEUE_SIZE);
+    settle();
+    assert(fsm.stats.commands == CMD_QUEUE_SIZE && fsm.stats.wakeups == 1);
+    stop();
+}
+
+// each packet received restarts the receiver
+static void test_rx(void) {
+    const int n = 100;
+
+    start(E_LORA_STATE_RX);
+    for (int i = 0; i < n; i++) {
+        radio_irq_after(0, (i % 3 == 0) ? E_LORA_STATE_RX_TIMEOUT : E_LORA_STATE_RX_DONE);
+        usleep(2000);
+    }
+    settle();
+    assert(radio_rx_starts == n && fsm.state == E_LORA_STATE_RX);
+    assert(fsm.stats.states == n && fsm.stats.wakeups <= n);
+    stop();
+}
+
+// the MAC's timers (the LoRa timer task) move the state on to a join
+static void test_mac_state(void) {
+    start(E_LORA_STATE_IDLE);
+    lora_fsm_set_state(&fsm, E_LORA_STATE_JOIN);
+    wait_done(1);
+    settle();
+    assert(mac_states == 1 && fsm.state == E_LORA_STATE_IDLE);
+    stop();
+}
+
+// a reset drops the command being retried, and commands run after it
+static void test_reset(void) {
+    start(E_LORA_STATE_RX);
+    queue_cmd((sim_cmd_t){ .cmd = CMD_TX, .busy = 1000000 });
+    usleep(50000);
+    assert(fsm.stats.retries > 0 && fsm.retry);
+    lora_fsm_reset(&fsm);
+    settle();
+    uint32_t retries = fsm.stats.retries;
+    assert(radio_resets == 1 && fsm.state == E_LORA_STATE_RESET && !fsm.retry);
+    queue_cmd((sim_cmd_t){ .cmd = CMD_SLEEP });
+    wait_done(1);
+    settle();
+    assert(fsm.state == E_LORA_STATE_SLEEP && fsm.stats.retries == retries);
+    stop();
+}
+
+int main(void) {
+    printf("idle\n");
+    test_idle();
+    printf("tx\n");
+    test_tx();
+    printf("tx timeout\n");
+    test_tx_timeout();
+    printf("busy channel\n");
+    test_busy_channel();
+    printf("burst\n");
+    test_burst();
+    printf("rx\n");
+    test_rx();
+    printf("mac state\n");
+    test_mac_state();
+    printf("reset\n");
+    test_reset();
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The FUOTA packages as a server drives them: a multicast group and its
+// class C session, then a fragmentation session whose image comes as
+// fragments to the group through a link that loses some, and must be
+// rebuilt whole in a storage written once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "lora_fuota.h"
+#include "aes.h"
+
+#define BLOCK_MAX           (64 * 1024)
+#define SCRATCH_FRAGS       (40)
+
+/******************************************************************************
+ stubs
+ ******************************************************************************/
+static lora_fuota_t fuota;
+
+static uint8_t sent[LORA_FUOTA_ANS_MAX];
+static uint32_t sent_len;
+static uint8_t sent_port;
+static uint32_t sent_count;
+
+static int mc_set_id;
+static const lora_fuota_mc_group_t *mc_set_group;
+static int mc_session_id;
+static uint32_t mc_session_start_in;
+static uint32_t gps_now;
+
+static uint8_t storage[BLOCK_MAX + SCRATCH_FRAGS * 255];
+static bool written[sizeof(storage)];
+static uint32_t storage_size;
+static uint32_t done_size;
+static uint32_t done_descriptor;
+static uint32_t done_count;
+
+static void stub_send(void *ctx, uint8_t port, const uint8_t *data, uint32_t len) {
+    assert(len <= LORA_FUOTA_ANS_MAX);
+    memcpy(sent, data, len);
+    sent_len = len;
+    sent_port = port;
+    sent_count++;
+}
+
+// aes.c loads words, it's given aligned copies
+static void stub_encrypt(void *ctx, const uint8_t *key, const uint8_t *in, uint8_t *out) {
+    aes_context aes;
+    uint32_t block_in[4], block_out[4];
+    memcpy(block_in, in, 16);
+    aes_set_key_lora(key, 16, &aes);
+    aes_encrypt_lora((uint8_t *)block_in, (uint8_t *)block_out, &aes);
+    memcpy(out, block_out, 16);
+}
+
+static void stub_mc_set(void *ctx, uint8_t id, const lora_fuota_mc_group_t *group) {
+    mc_set_id = id;
+    mc_set_group = group;
+}
+
+static void stub_mc_session(void *ctx, uint8_t id, const lora_fuota_mc_group_t *group, uint32_t start_in) {
+    assert(group->session);
+    mc_session_id = id;
+    mc_session_start_in = start_in;
+}
+
+// EU868 like
+static bool stub_freq_ok(void *ctx, uint32_t freq) {
+    return freq >= 863000000 && freq <= 870000000;
+}
+
+static bool stub_dr_ok(void *ctx, uint8_t dr) {
+    return dr <= 7;
+}
+
+static uint32_t stub_gps_time(void *ctx) {
+    return gps_now;
+}
+
+static int32_t stub_block_open(void *ctx, uint32_t size, uint32_t frag_size) {
+    if (size > BLOCK_MAX) {
+        return -1;
+    }
+    memset(written, 0, sizeof(written));
+    storage_size = size;
+    return SCRATCH_FRAGS;
+}
+
+static bool stub_write(void *ctx, uint32_t offset, const uint8_t *buf, uint32_t len) {
+    assert(offset + len <= storage_size + SCRATCH_FRAGS * 255);
+    for (uint32_t i = 0; i < len; i++) {
+        assert(!written[offset + i]);
+        written[offset + i] = true;
+    }
+    memcpy(storage + offset, buf, len);
+    return true;
+}
+
+static bool stub_read(void *ctx, uint32_t offset, uint8_t *buf, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        assert(written[offset + i]);
+    }
+    memcpy(buf, storage + offset, len);
+    return true;
+}
+
+static void stub_block_done(void *ctx, uint32_t size, uint32_t descriptor) {
+    done_size = size;
+    done_descriptor = descriptor;
+    done_count++;
+}
+
+static const lora_fuota_ops_t stub_ops = {
+    .send = stub_send,
+    .encrypt = stub_encrypt,
+    .mc_set = stub_mc_set,
+    .mc_session = stub_mc_session,
+    .freq_ok = stub_freq_ok,
+    .dr_ok = stub_dr_ok,
+    .gps_time = stub_gps_time,
+    .block_open = stub_block_open,
+    .block = {
+        .write = stub_write,
+        .read = stub_read,
+    },
+    .block_done = stub_block_done,
+};
+
+static const uint8_t gen_app_key[16] = {
+    0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C
+};
+
+static void setup(void) {
+    lora_fuota_init(&fuota, &stub_ops, NULL, gen_app_key);
+    sent_count = 0;
+    done_count = 0;
+    gps_now = 0;
+}
+
+// a downlink, and whether it got an answer
+static bool downlink(uint8_t port, const uint8_t *data, uint32_t len, bool multicast) {
+    uint32_t count = sent_count;
+    assert(lora_fuota_input(&fuota, port, data, len, multicast));
+    if (sent_count != count) {
+        assert(sent_port == port);
+        return true;
+    }
+    return false;
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_versions(void) {
+    setup();
+
+    // other ports aren't the packages'
+    uint8_t cmd[] = { 0x00, 0x00 };
+    assert(!lora_fuota_input(&fuota, 2, cmd, 1, false));
+    assert(sent_count == 0);
+
+    // two commands in a downlink, two answers in the uplink
+    assert(downlink(LORA_FUOTA_PORT_FRAG, cmd, 2, false));
+    assert(sent_len == 6);
+    assert(sent[0] == 0x00 && sent[1] == 3 && sent[2] == 1);
+    assert(sent[3] == 0x00 && sent[4] == 3 && sent[5] == 1);
+    assert(downlink(LORA_FUOTA_PORT_MC, cmd, 1, false));
+    assert(sent_len == 3 && sent[1] == 2 && sent[2] == 1);
+
+    // what follows a command not understood is dropped
+    uint8_t unknown[] = { 0x00, 0x7F, 0x00 };
+    assert(downlink(LORA_FUOTA_PORT_MC, unknown, 3, false));
+    assert(sent_len == 3);
+    assert(fuota.stats.unknown == 1);
+
+    // and so is a command cut short
+    uint8_t short_setup[] = { 0x02, 0x00, 0x01 };
+    assert(!downlink(LORA_FUOTA_PORT_MC, short_setup, 3, false));
+    assert(fuota.stats.unknown == 2);
+}
+
+static void test_mc_group(void) {
+    setup();
+
+    uint8_t setup_req[30] = { 0x02, 0x01, 0x78, 0x56, 0x34, 0x12 };
+    for (int i = 0; i < 16; i++) {
+        setup_req[6 + i] = 0xA0 + i;
+    }
+    setup_req[22] = 0x10;               // min fcnt 16
+    setup_req[26] = 0xFF;               // max fcnt 255
+    assert(downlink(LORA_FUOTA_PORT_MC, setup_req, 30, false));
+    assert(sent_len == 2 && sent[0] == 0x02 && sent[1] == 0x01);
+    assert(mc_set_id == 1 && mc_set_group == &fuota.groups[1]);
+    assert(fuota.groups[1].addr == 0x12345678);
+    assert(fuota.groups[1].min_fcnt == 16 && fuota.groups[1].max_fcnt == 255);
+
+    // the keys, TS005 section 3.2
+    uint8_t block[16] = { 0 };
+    uint8_t mc_root_key[16], mc_ke_key[16], mc_key[16], key[16];
+    stub_encrypt(NULL, gen_app_key, block, mc_root_key);
+    stub_encrypt(NULL, mc_root_key, block, mc_ke_key);
+    stub_encrypt(NULL, mc_ke_key, &setup_req[6], mc_key);
+    uint8_t app[16] = { 0x01, 0x78, 0x56, 0x34, 0x12 };
+    stub_encrypt(NULL, mc_key, app, key);
+    assert(memcmp(key, fuota.groups[1].app_skey, 16) == 0);
+    uint8_t nwk[16] = { 0x02, 0x78, 0x56, 0x34, 0x12 };
+    stub_encrypt(NULL, mc_key, nwk, key);
+    assert(memcmp(key, fuota.groups[1].nwk_skey, 16) == 0);
+
+    // the groups can't be set up by multicast
+    setup_req[1] = 0x02;
+    assert(!downlink(LORA_FUOTA_PORT_MC, setup_req, 30, true));
+    assert(!fuota.groups[2].defined);
+
+    // status of groups 0 and 1: one defined
+    uint8_t status_req[] = { 0x01, 0x03 };
+    assert(downlink(LORA_FUOTA_PORT_MC, status_req, 2, false));
+    assert(sent_len == 7);
+    assert(sent[1] == ((1 << 4) | 0x02));
+    assert(sent[2] == 1 && sent[3] == 0x78 && sent[6] == 0x12);
+
+    // a class C session in 100 s, for 2^5 s on 869.525 MHz at DR0
+    uint8_t session_req[] = { 0x04, 0x01, 0x64, 0x00, 0x01, 0x00, 0x05, 0xD2, 0xAD, 0x84, 0x00 };
+    gps_now = 0x10000;
+    assert(downlink(LORA_FUOTA_PORT_MC, session_req, 11, false));
+    assert(sent_len == 5 && sent[1] == 0x01);
+    assert(sent[2] == 100 && sent[3] == 0 && sent[4] == 0);
+    assert(mc_session_id == 1 && mc_session_start_in == 100);
+    assert(fuota.groups[1].freq == 869525000 && fuota.groups[1].timeout == 32 && fuota.groups[1].dr == 0);
+
+    // passed, or without the time, it starts right away
+    gps_now = 0x20000;
+    assert(downlink(LORA_FUOTA_PORT_MC, session_req, 11, false));
+    assert(mc_session_start_in == 0 && sent[2] == 0);
+
+    // errors: group not defined, frequency, data rate
+    session_req[1] = 0x03;
+    session_req[7] = 0x00;
+    session_req[8] = 0x00;
+    session_req[9] = 0x00;
+    session_req[10] = 12;
+    mc_session_id = -1;
+    assert(downlink(LORA_FUOTA_PORT_MC, session_req, 11, false));
+    assert(sent_len == 2 && sent[1] == (0x03 | 0x10 | 0x08 | 0x04));
+    assert(mc_session_id == -1);
+
+    // deleted, then deleted again
+    uint8_t delete_req[] = { 0x03, 0x01 };
+    assert(downlink(LORA_FUOTA_PORT_MC, delete_req, 2, false));
+    assert(sent[1] == 0x01 && mc_set_id == 1 && mc_set_group == NULL);
+    assert(!fuota.groups[1].defined);
+    assert(downlink(LORA_FUOTA_PORT_MC, delete_req, 2, false));
+    assert(sent[1] == (0x01 | 0x04));
+}
+
+static void frag_setup_req(uint8_t *req, uint8_t index, uint16_t nb_frag, uint8_t frag_size, uint8_t algo, uint8_t padding) {
+    req[0] = 0x02;
+    req[1] = (index << 4) | 0x01;
+    req[2] = nb_frag;
+    req[3] = nb_frag >> 8;
+    req[4] = frag_size;
+    req[5] = algo << 3;
+    req[6] = padding;
+    req[7] = 0xEF;
+    req[8] = 0xBE;
+    req[9] = 0xAD;
+    req[10] = 0xDE;
+}
+
+static void test_frag_setup(void) {
+    uint8_t req[11];
+    setup();
+
+    // another encoding
+    frag_setup_req(req, 1, 100, 50, 1, 0);
+    assert(downlink(LORA_FUOTA_PORT_FRAG, req, 11, false));
+    assert(sent_len == 2 && sent[1] == ((1 << 6) | 0x01));
+    assert(!fuota.session.active);
+
+    // too large
+    frag_setup_req(req, 1, 2000, 50, 0, 0);
+    assert(downlink(LORA_FUOTA_PORT_FRAG, req, 11, false));
+    assert(sent[1] == ((1 << 6) | 0x02));
+
+    // fine
+    frag_setup_req(req, 1, 100, 50, 0, 10);
+    assert(downlink(LORA_FUOTA_PORT_FRAG, req, 11, false));
+    assert(sent[1] == (1 << 6));
+    assert(fuota.session.active && fuota.session.index == 1 && fuota.session.descriptor == 0xDEADBEEF);
+
+    // a second one while it's in progress
+    frag_setup_req(req, 2, 100, 50, 0, 0);
+    assert(downlink(LORA_FUOTA_PORT_FRAG, req, 11, false));
+    assert(sent[1] == ((2 << 6) | 0x04));
+    assert(fuota.session.index == 1);
+
+    // deleted, then deleted again
+    uint8_t delete_req[] = { 0x03, 0x01 };
+    assert(downlink(LORA_FUOTA_PORT_FRAG, delete_req, 2, false));
+    assert(sent[1] == 0x01 && !fuota.session.active);
+    assert(downlink(LORA_FUOTA_PORT_FRAG, delete_req, 2, false));
+    assert(sent[1] == (0x01 | 0x04));
+}
+
+// a block of nb_frag fragments sent by multicast, with coded ones until
+// every device has it
+static void test_transfer(uint16_t nb_frag, uint8_t frag_size, uint8_t padding, uint32_t loss) {
+    static uint8_t image[BLOCK_MAX];
+    uint8_t req[11];
+    uint8_t frame[3 + 255];
+    uint8_t row[LORA_FRAG_MAX_FRAGS / 8];
+
+    setup();
+    uint32_t size = nb_frag * frag_size - padding;
+    for (uint32_t i = 0; i < nb_frag * frag_size; i++) {
+        image[i] = (i < size) ? rand() : 0;
+    }
+    frag_setup_req(req, 2, nb_frag, frag_size, 0, padding);
+    assert(downlink(LORA_FUOTA_PORT_FRAG, req, 11, false));
+    assert(sent[1] == (2 << 6));
+
+    uint32_t lost = 0;
+    for (uint32_t n = 1; done_count == 0; n++) {
+        assert(n < 4u * nb_frag + 100);
+        frame[0] = 0x08;
+        frame[1] = n;
+        frame[2] = (n >> 8) | (2 << 6);
+        if (n <= nb_frag) {
+            memcpy(&frame[3], &image[(n - 1) * frag_size], frag_size);
+        } else {
+            lora_frag_parity_row(n - nb_frag, nb_frag, row);
+            memset(&frame[3], 0, frag_size);
+            for (uint32_t i = 0; i < nb_frag; i++) {
+                if ((row[i / 8] >> (i % 8)) & 1) {
+                    for (uint32_t j = 0; j < frag_size; j++) {
+                        frame[3 + j] ^= image[i * frag_size + j];
+                    }
+                }
+            }
+        }
+        if ((uint32_t)(rand() % 100) < loss) {
+            lost++;
+            continue;
+        }
+        // fragments get no answer
+        assert(!downlink(LORA_FUOTA_PORT_FRAG, frame, 3 + frag_size, true));
+
+        // halfway, the server asks those missing some
+        if (n == nb_frag / 2) {
+            uint8_t status_req[] = { 0x01, (2 << 1) };
+            assert(downlink(LORA_FUOTA_PORT_FRAG, status_req, 2, true));
+            assert(sent_len == 5);
+            assert((sent[1] | ((sent[2] & 0x3F) << 8)) == n - lost);
+            assert((sent[2] >> 6) == 2);
+            assert(sent[3] == nb_frag - (n - lost) || sent[3] == 0xFF);
+            assert(sent[4] == 0);
+        }
+    }
+    assert(done_count == 1);
+    assert(done_size == size && done_descriptor == 0xDEADBEEF);
+    assert(memcmp(storage, image, size) == 0);
+    assert(fuota.stats.blocks == 1);
+
+    // once done, it answers only if all are asked
+    uint8_t status_req[] = { 0x01, (2 << 1) };
+    assert(!downlink(LORA_FUOTA_PORT_FRAG, status_req, 2, true));
+    status_req[1] |= 0x01;
+    assert(downlink(LORA_FUOTA_PORT_FRAG, status_req, 2, true));
+    assert(sent[3] == 0);
+
+    // more fragments change nothing
+    assert(!downlink(LORA_FUOTA_PORT_FRAG, frame, 3 + frag_size, true));
+    assert(done_count == 1);
+    printf("  %u fragments of %u bytes, %u lost\n", nb_frag, frag_size, lost);
+}
+
+int main(void) {
+    srand(1);
+    printf("  fuota: %u bytes\n", (unsigned)sizeof(lora_fuota_t));
+    printf("versions\n");
+    test_versions();
+    printf("mc group\n");
+    test_mc_group();
+    printf("frag setup\n");
+    test_frag_setup();
+    printf("transfer\n");
+    test_transfer(10, 20, 0, 0);
+    test_transfer(200, 51, 13, 5);
+    test_transfer(500, 100, 99, 3);
+    printf("OK\n");
+    return 0;
+}
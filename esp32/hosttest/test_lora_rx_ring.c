@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The queue of received LoRa packets: packing, partial reads, overflow and
+// flushes on their own, then a writer thread in place of the radio
+// interrupt racing the main thread reading as MicroPython would.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "lora_rx_ring.h"
+
+#define RING_SIZE           (512)
+#define STRESS_PACKETS      (200000)
+
+static lora_rx_ring_t ring;
+static uint8_t ring_buf[RING_SIZE];
+
+static uint8_t pattern(uint32_t seq, uint32_t i) {
+    return (seq * 31 + i * 7) % 251;
+}
+
+static uint32_t packet_len(uint32_t seq) {
+    return (seq * 37) % 256;
+}
+
+static bool put(uint32_t seq, uint8_t port) {
+    uint8_t data[256];
+    uint32_t len = packet_len(seq);
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = pattern(seq, i);
+    }
+    return lora_rx_ring_put(&ring, data, len, port);
+}
+
+static void check(const uint8_t *data, uint32_t seq, uint32_t from, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        assert(data[i] == pattern(seq, from + i));
+    }
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_packets(void) {
+    uint8_t buf[256];
+    uint8_t port = 0xFF;
+
+    lora_rx_ring_init(&ring, ring_buf, RING_SIZE);
+    assert(!lora_rx_ring_any(&ring));
+    assert(lora_rx_ring_read(&ring, buf, sizeof(buf), &port) == -1);
+    assert(port == 0xFF);
+
+    // short packets take little more than their length
+    for (uint32_t seq = 1; seq <= 20; seq++) {
+        uint8_t data[16];
+        memset(data, seq, sizeof(data));
+        assert(lora_rx_ring_put(&ring, data, 1 + seq % 12, seq));
+    }
+    assert(ring.stats.packets == 20);
+    assert(ring.stats.high_water <= RING_SIZE / 2);
+    for (uint32_t seq = 1; seq <= 20; seq++) {
+        assert(lora_rx_ring_any(&ring));
+        assert(lora_rx_ring_read(&ring, buf, sizeof(buf), &port) == 1 + seq % 12);
+        assert(port == seq);
+        assert(buf[0] == seq && buf[seq % 12] == seq);
+    }
+    assert(!lora_rx_ring_any(&ring));
+
+    // an empty packet is a packet
+    assert(lora_rx_ring_put(&ring, NULL, 0, 3));
+    assert(lora_rx_ring_any(&ring));
+    assert(lora_rx_ring_read(&ring, buf, sizeof(buf), &port) == 0);
+    assert(port == 3);
+    assert(!lora_rx_ring_any(&ring));
+
+    // the packets wrap around the end of the buffer, at every offset
+    for (uint32_t seq = 0; seq < 400; seq++) {
+        assert(put(seq, seq % 224));
+        int32_t n = lora_rx_ring_read(&ring, buf, sizeof(buf), &port);
+        assert(n == packet_len(seq));
+        assert(port == seq % 224);
+        check(buf, seq, 0, n);
+    }
+    assert(ring.stats.dropped == 0);
+}
+
+static void test_partial(void) {
+    uint8_t buf[256];
+    uint8_t port;
+
+    lora_rx_ring_init(&ring, ring_buf, RING_SIZE);
+    assert(put(7, 1));
+    assert(put(8, 2));
+
+    // the rest of a packet comes on the following reads, with its port
+    uint32_t len = packet_len(7);
+    uint32_t done = 0;
+    while (done < len) {
+        port = 0;
+        int32_t n = lora_rx_ring_read(&ring, buf, 10, &port);
+        assert(n == (len - done < 10 ? len - done : 10));
+        assert(port == 1);
+        check(buf, 7, done, n);
+        done += n;
+    }
+    assert(lora_rx_ring_read(&ring, buf, 0, &port) == 0);
+    assert(port == 2);
+    assert(lora_rx_ring_read(&ring, buf, sizeof(buf), NULL) == packet_len(8));
+    check(buf, 8, 0, packet_len(8));
+    assert(!lora_rx_ring_any(&ring));
+}
+
+static void test_overflow(void) {
+    uint8_t data[200];
+    uint8_t buf[256];
+
+    lora_rx_ring_init(&ring, ring_buf, RING_SIZE);
+    memset(data, 0xA5, sizeof(data));
+
+    // two fit, the third is dropped and counted
+    assert(lora_rx_ring_put(&ring, data, 200, 1));
+    assert(lora_rx_ring_put(&ring, data, 200, 2));
+    assert(!lora_rx_ring_put(&ring, data, 200, 3));
+    assert(ring.stats.dropped == 1);
+    assert(ring.stats.dropped_bytes == 200);
+    assert(ring.stats.packets == 2);
+    assert(ring.stats.bytes == 400);
+    assert(ring.stats.high_water == 2 * 204);
+
+    // a smaller one still fits in what's left
+    assert(lora_rx_ring_put(&ring, data, 50, 4));
+
+    // the packets kept are whole
+    uint8_t port;
+    assert(lora_rx_ring_read(&ring, buf, sizeof(buf), &port) == 200 && port == 1);
+    assert(lora_rx_ring_read(&ring, buf, sizeof(buf), &port) == 200 && port == 2);
+    assert(lora_rx_ring_read(&ring, buf, sizeof(buf), &port) == 50 && port == 4);
+    assert(!lora_rx_ring_any(&ring));
+
+    // with room again, packets are taken
+    assert(lora_rx_ring_put(&ring, data, 200, 5));
+    assert(ring.stats.dropped == 1);
+}
+
+static void test_flush(void) {
+    uint8_t buf[256];
+    uint8_t port;
+
+    lora_rx_ring_init(&ring, ring_buf, RING_SIZE);
+    assert(put(1, 1));
+    assert(put(2, 1));
+    // the reader is half way through the first one
+    assert(lora_rx_ring_read(&ring, buf, 5, &port) == 5);
+
+    // the writer flushes, then queues more, all before the next read
+    lora_rx_ring_flush(&ring);
+    assert(put(3, 9));
+    assert(lora_rx_ring_read(&ring, buf, sizeof(buf), &port) == packet_len(3));
+    assert(port == 9);
+    check(buf, 3, 0, packet_len(3));
+    assert(!lora_rx_ring_any(&ring));
+
+    // a flush of an empty ring is harmless
+    lora_rx_ring_flush(&ring);
+    assert(!lora_rx_ring_any(&ring));
+    assert(put(4, 2));
+    assert(lora_rx_ring_read(&ring, buf, sizeof(buf), &port) == packet_len(4));
+}
+
+static volatile bool writer_done;
+static uint32_t writer_dropped;
+
+// the packets of the threads test start with their sequence number
+static bool put_numbered(uint32_t seq) {
+    uint8_t data[256];
+    uint32_t len = 4 + packet_len(seq) % 252;
+    memcpy(data, &seq, 4);
+    for (uint32_t i = 4; i < len; i++) {
+        data[i] = pattern(seq, i);
+    }
+    return lora_rx_ring_put(&ring, data, len, seq & 0xFF);
+}
+
+static void *writer_main(void *arg) {
+    for (uint32_t seq = 0; seq < STRESS_PACKETS; seq++) {
+        // the radio doesn't wait: a packet is dropped if there's no room
+        if (!put_numbered(seq)) {
+            writer_dropped++;
+        }
+        if (seq % 64 == 0) {
+            sched_yield();
+        }
+    }
+    writer_done = true;
+    return NULL;
+}
+
+static void test_threads(void) {
+    pthread_t writer;
+    uint8_t buf[256];
+    uint32_t next = 0;
+    uint32_t received = 0;
+    uint32_t reads = 0;
+
+    lora_rx_ring_init(&ring, ring_buf, RING_SIZE);
+    writer_done = false;
+    writer_dropped = 0;
+    assert(pthread_create(&writer, NULL, writer_main, NULL) == 0);
+
+    // every packet is read whole and in order, in pieces of any size; the
+    // missing ones were dropped
+    for (;;) {
+        bool done = writer_done;
+        uint8_t port;
+        int32_t n = lora_rx_ring_read(&ring, buf, 4 + reads++ % 300, &port);
+        if (n < 0) {
+            if (done) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        uint32_t seq;
+        assert(n >= 4);
+        memcpy(&seq, buf, 4);
+        assert(seq >= next && seq < STRESS_PACKETS);
+        assert(port == (seq & 0xFF));
+        uint32_t len = 4 + packet_len(seq) % 252;
+        uint32_t from = n;
+        check(buf + 4, seq, 4, n - 4);
+        while (from < len) {
+            n = lora_rx_ring_read(&ring, buf, 1 + reads++ % 300, &port);
+            assert(n > 0 && from + n <= len && port == (seq & 0xFF));
+            check(buf, seq, from, n);
+            from += n;
+        }
+        next = seq + 1;
+        received++;
+    }
+    pthread_join(writer, NULL);
+
+    assert(received + writer_dropped == STRESS_PACKETS);
+    assert(ring.stats.packets == received);
+    assert(ring.stats.dropped == writer_dropped);
+    printf("  %u packets received, %u dropped\n", received, writer_dropped);
+}
+
+int main(void) {
+    printf("packets\n");
+    test_packets();
+    printf("partial\n");
+    test_partial();
+    printf("overflow\n");
+    test_overflow();
+    printf("flush\n");
+    test_flush();
+    printf("threads\n");
+    test_threads();
+    printf("OK\n");
+    return 0;
+}
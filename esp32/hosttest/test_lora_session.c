@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The LoRaWAN session store against an NVS that counts its writes and can
+// lose power between two of them: a device waking from deep sleep to send
+// an uplink writes the counters once every few uplinks and nothing else,
+// a frame counter is never used twice across power losses, and a torn
+// save or a session of another version or region isn't restored, nor any
+// of its fields.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "lora_session.h"
+
+/******************************************************************************
+ NVS
+ ******************************************************************************/
+#define NVS_KEYS                        (16)
+#define NVS_VALUE_MAX                   (512)
+
+typedef struct {
+    char key[16];
+    uint8_t value[NVS_VALUE_MAX];
+    uint32_t len;
+} nvs_entry_t;
+
+static nvs_entry_t nvs[NVS_KEYS];
+static uint32_t nvs_keys;
+static uint32_t nvs_writes;
+static uint32_t nvs_bytes;
+static int32_t nvs_power_left = -1;     // writes before the power goes, -1 for never
+
+static nvs_entry_t *nvs_find(const char *key) {
+    for (uint32_t i = 0; i < nvs_keys; i++) {
+        if (!strcmp(nvs[i].key, key)) {
+            return &nvs[i];
+        }
+    }
+    return NULL;
+}
+
+static bool stub_get(void *ctx, const char *key, void *buf, uint32_t *len) {
+    nvs_entry_t *e = nvs_find(key);
+    if (!e || e->len > *len) {
+        return false;
+    }
+    memcpy(buf, e->value, e->len);
+    *len = e->len;
+    return true;
+}
+
+static bool stub_set(void *ctx, const char *key, const void *buf, uint32_t len) {
+    nvs_entry_t *e = nvs_find(key);
+    if (nvs_power_left == 0) {
+        return false;
+    }
+    if (nvs_power_left > 0) {
+        nvs_power_left--;
+    }
+    if (!e) {
+        assert(nvs_keys < NVS_KEYS);
+        e = &nvs[nvs_keys++];
+        strcpy(e->key, key);
+    }
+    assert(len <= NVS_VALUE_MAX);
+    memcpy(e->value, buf, len);
+    e->len = len;
+    nvs_writes++;
+    nvs_bytes += len;
+    return true;
+}
+
+static bool stub_commit(void *ctx) {
+    return nvs_power_left != 0;
+}
+
+static const lora_session_ops_t stub_ops = {
+    .get = stub_get,
+    .set = stub_set,
+    .commit = stub_commit,
+};
+
+static void nvs_erase(void) {
+    nvs_keys = 0;
+    nvs_writes = 0;
+    nvs_bytes = 0;
+    nvs_power_left = -1;
+}
+
+/******************************************************************************
+ the MAC
+ ******************************************************************************/
+typedef struct {
+    uint32_t dev_addr;
+    uint32_t net_id;
+    uint8_t nwk_skey[16];
+    uint8_t app_skey[16];
+} keys_t;
+
+typedef struct {
+    uint8_t srv_ack_req;
+    uint8_t next_tx;
+    uint8_t index;
+    uint8_t repeat_index;
+    uint8_t buffer[128];
+    uint8_t repeat[128];
+} mac_t;
+
+static keys_t keys;
+static uint8_t params[60];
+static uint8_t channels[16 * 12];
+static mac_t mac;
+static uint8_t scratch[sizeof(keys) + sizeof(params) + sizeof(channels) + sizeof(mac)];
+
+// as the MAC was set up by the join, and as a reboot leaves it
+static void mac_join(uint32_t dev_addr) {
+    keys.dev_addr = dev_addr;
+    keys.net_id = 0x13;
+    for (uint32_t i = 0; i < 16; i++) {
+        keys.nwk_skey[i] = dev_addr + i;
+        keys.app_skey[i] = dev_addr * 3 + i;
+    }
+    for (uint32_t i = 0; i < sizeof(params); i++) {
+        params[i] = i;
+    }
+    for (uint32_t i = 0; i < sizeof(channels); i++) {
+        channels[i] = i * 7;
+    }
+    memset(&mac, 0, sizeof(mac));
+}
+
+static void mac_reboot(void) {
+    memset(&keys, 0, sizeof(keys));
+    memset(params, 0, sizeof(params));
+    memset(channels, 0, sizeof(channels));
+    memset(&mac, 0xAA, sizeof(mac));
+}
+
+static void session_setup(lora_session_t *s, uint8_t region) {
+    lora_session_init(s, &stub_ops, NULL, region);
+    assert(lora_session_add(s, "LS_KEYS", &keys, sizeof(keys)));
+    assert(lora_session_add(s, "LS_PARAMS", params, sizeof(params)));
+    assert(lora_session_add(s, "LS_CHAN", channels, sizeof(channels)));
+    assert(lora_session_add(s, "LS_MAC", &mac, sizeof(mac)));
+    assert(lora_session_size(s) == sizeof(scratch));
+}
+
+static uint32_t session_bytes(void) {
+    return sizeof(keys) + sizeof(params) + sizeof(channels) + sizeof(mac) + sizeof(lora_session_counters_t);
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_round_trip(void) {
+    lora_session_t s;
+    lora_session_rtc_t rtc;
+    lora_session_counters_t c = { .up = 10, .down = 3, .adr_ack = 2 }, r;
+
+    nvs_erase();
+    memset(&rtc, 0, sizeof(rtc));
+    mac_join(0x26011234);
+    mac.srv_ack_req = 1;
+    mac.index = 5;
+    memcpy(mac.buffer, "\x03\x07\x02\x05\x01", 5);
+    session_setup(&s, 5);
+    assert(lora_session_save(&s, &c, &rtc));
+    assert(nvs_writes == 6);
+
+    keys_t k = keys;
+    uint8_t p[sizeof(params)], ch[sizeof(channels)];
+    mac_t m = mac;
+    memcpy(p, params, sizeof(p));
+    memcpy(ch, channels, sizeof(ch));
+
+    mac_reboot();
+    session_setup(&s, 5);
+    assert(lora_session_restore(&s, &r, &rtc, scratch));
+    assert(!memcmp(&k, &keys, sizeof(k)) && !memcmp(p, params, sizeof(p)) && !memcmp(ch, channels, sizeof(ch)));
+    assert(!memcmp(&m, &mac, sizeof(m)));
+    assert(s.stats.from_rtc && !memcmp(&r, &c, sizeof(r)));
+
+    // without the RTC copy, past the counters that may have been used since
+    memset(&rtc, 0, sizeof(rtc));
+    mac_reboot();
+    session_setup(&s, 5);
+    assert(lora_session_restore(&s, &r, &rtc, scratch));
+    assert(!s.stats.from_rtc);
+    assert(r.up == c.up + LORA_SESSION_FCNT_GAP && r.down == c.down && r.adr_ack == c.adr_ack);
+    // stored at once, the next restore may not know the uplinks from here
+    nvs_writes = 0;
+    memset(&rtc, 0, sizeof(rtc));
+    session_setup(&s, 5);
+    assert(lora_session_restore(&s, &r, &rtc, scratch));
+    assert(r.up == c.up + 2 * LORA_SESSION_FCNT_GAP && nvs_writes == 1);
+
+    // nothing changed, nothing written
+    nvs_writes = 0;
+    assert(lora_session_save(&s, &r, &rtc));
+    assert(nvs_writes == 0 && s.stats.skipped == 4);
+}
+
+static void test_dirty_fields(void) {
+    lora_session_t s;
+    lora_session_rtc_t rtc;
+    lora_session_counters_t c = { .up = 100, .down = 7 };
+
+    nvs_erase();
+    mac_join(0x26015678);
+    session_setup(&s, 5);
+    assert(lora_session_save(&s, &c, &rtc));
+
+    // a NewChannelReq, the channels and the header
+    nvs_writes = 0;
+    channels[40] ^= 0xFF;
+    c.up++;
+    assert(lora_session_save(&s, &c, &rtc));
+    assert(nvs_writes == 2 && nvs_find("LS_CHAN") && nvs_find("LS_HEAD"));
+
+    // a downlink, the counters only
+    nvs_writes = 0;
+    c.up++;
+    c.down++;
+    assert(lora_session_save(&s, &c, &rtc));
+    assert(nvs_writes == 1);
+
+    // the uplinks, every LORA_SESSION_FCNT_STEP of them
+    nvs_writes = 0;
+    for (uint32_t i = 0; i < LORA_SESSION_FCNT_STEP * 10; i++) {
+        c.up++;
+        assert(lora_session_save(&s, &c, &rtc));
+    }
+    assert(nvs_writes == 10);
+}
+
+static void test_deep_sleep(void) {
+    lora_session_rtc_t rtc;
+    lora_session_counters_t c = { 0 };
+    const uint32_t wakes = 24 * 60;
+
+    nvs_erase();
+    memset(&rtc, 0, sizeof(rtc));
+    mac_join(0x26019ABC);
+    {
+        lora_session_t s;
+        session_setup(&s, 5);
+        assert(lora_session_save(&s, &c, &rtc));
+    }
+    nvs_writes = 0;
+    nvs_bytes = 0;
+
+    // an uplink a minute for a day, a save before every sleep
+    for (uint32_t i = 0; i < wakes; i++) {
+        lora_session_t s;
+        mac_reboot();
+        session_setup(&s, 5);
+        assert(lora_session_restore(&s, &c, &rtc, scratch));
+        assert(s.stats.from_rtc && c.up == i);
+        c.up++;
+        lora_session_rtc_update(&rtc, &c);
+        assert(lora_session_save(&s, &c, &rtc));
+    }
+    printf("  %u wakes: %u writes, %u bytes, %u bytes with all of it each time\n",
+           (unsigned)wakes, (unsigned)nvs_writes, (unsigned)nvs_bytes, (unsigned)(wakes * session_bytes()));
+    assert(nvs_writes == wakes / LORA_SESSION_FCNT_STEP);
+    assert(nvs_bytes == nvs_writes * sizeof(lora_session_counters_t));
+}
+
+static void test_power_loss(void) {
+    lora_session_rtc_t rtc;
+    lora_session_counters_t c = { 0 };
+    uint32_t next = 0;                  // the first counter not used yet
+
+    nvs_erase();
+    memset(&rtc, 0, sizeof(rtc));
+    mac_join(0x2601DEF0);
+    {
+        lora_session_t s;
+        session_setup(&s, 5);
+        assert(lora_session_save(&s, &c, &rtc));
+    }
+
+    for (uint32_t i = 0; i < 2000; i++) {
+        lora_session_t s;
+        mac_reboot();
+        if (rand() % 8 == 0) {
+            // the RTC memory doesn't survive that
+            memset(&rtc, rand(), sizeof(rtc));
+        }
+        session_setup(&s, 5);
+        assert(lora_session_restore(&s, &c, &rtc, scratch));
+        assert(c.up >= next);
+        // a few uplinks, then a save, or not
+        uint32_t uplinks = 1 + rand() % 3;
+        for (uint32_t j = 0; j < uplinks; j++) {
+            next = ++c.up;
+            lora_session_rtc_update(&rtc, &c);
+        }
+        if (rand() % 16) {
+            assert(lora_session_save(&s, &c, &rtc));
+        }
+    }
+
+    // the uplinks sent since the last save are covered up to the gap
+    {
+        lora_session_t s;
+        session_setup(&s, 5);
+        assert(lora_session_restore(&s, &c, &rtc, scratch));
+        assert(lora_session_save(&s, &c, &rtc));
+        next = c.up + LORA_SESSION_FCNT_GAP - LORA_SESSION_FCNT_STEP;
+        memset(&rtc, 0, sizeof(rtc));
+        assert(lora_session_restore(&s, &c, &rtc, scratch));
+        assert(c.up >= next);
+    }
+}
+
+static void test_torn_save(void) {
+    lora_session_t s;
+    lora_session_rtc_t rtc;
+    lora_session_counters_t c = { .up = 500 }, r;
+
+    // the new keys, the header and the counters
+    for (int32_t left = 0; left < 3; left++) {
+        nvs_erase();
+        mac_join(0x26011111);
+        session_setup(&s, 5);
+        assert(lora_session_save(&s, &c, &rtc));
+
+        // joined again, the power goes before the save is done
+        mac_join(0x26012222);
+        c.up = 0;
+        nvs_power_left = left;
+        assert(!lora_session_save(&s, &c, &rtc));
+        nvs_power_left = -1;
+
+        mac_reboot();
+        session_setup(&s, 5);
+        bool restored = lora_session_restore(&s, &r, &rtc, scratch);
+        assert(!s.stats.from_rtc);
+        if (left == 0) {
+            // nothing written, the old session
+            assert(restored && keys.dev_addr == 0x26011111 && r.up == 500 + LORA_SESSION_FCNT_GAP);
+        } else if (left == 1) {
+            // keys that don't match the header, nothing is taken from it
+            assert(!restored);
+            assert(keys.dev_addr == 0 && mac.index == 0xAA);
+        } else {
+            // only the counters missing, the old ones are higher
+            assert(restored && keys.dev_addr == 0x26012222 && r.up == 500 + LORA_SESSION_FCNT_GAP);
+        }
+        c.up = 500;
+    }
+}
+
+static void test_mismatch(void) {
+    lora_session_t s;
+    lora_session_rtc_t rtc;
+    lora_session_counters_t c = { .up = 1 }, r;
+    uint8_t extra[4];
+
+    nvs_erase();
+    mac_join(0x26013333);
+    session_setup(&s, 5);
+    assert(lora_session_save(&s, &c, &rtc));
+
+    // another region
+    session_setup(&s, 1);
+    assert(!lora_session_restore(&s, &r, &rtc, scratch));
+
+    // a field more
+    session_setup(&s, 5);
+    assert(lora_session_add(&s, "LS_EXTRA", extra, sizeof(extra)));
+    assert(!lora_session_restore(&s, &r, &rtc, scratch));
+
+    // another version
+    nvs_entry_t *e = nvs_find(LORA_SESSION_HEADER_KEY);
+    e->value[0]++;
+    session_setup(&s, 5);
+    assert(!lora_session_restore(&s, &r, &rtc, scratch));
+    e->value[0]--;
+    assert(lora_session_restore(&s, &r, &rtc, scratch));
+
+    // a field that doesn't match its CRC, the ones before it aren't taken
+    nvs_find("LS_PARAMS")->value[3] ^= 1;
+    mac_reboot();
+    assert(!lora_session_restore(&s, &r, &rtc, scratch));
+    assert(keys.dev_addr == 0 && params[3] == 0);
+
+    // nor without the counters
+    nvs_find("LS_PARAMS")->value[3] ^= 1;
+    nvs_find(LORA_SESSION_FCNT_KEY)->key[0] = 0;
+    assert(!lora_session_restore(&s, &r, &rtc, scratch));
+    assert(keys.dev_addr == 0 && params[3] == 0 && channels[1] == 0 && mac.index == 0xAA);
+
+    // nothing at all
+    nvs_erase();
+    assert(!lora_session_restore(&s, &r, &rtc, scratch));
+}
+
+int main(void) {
+    srand(1);
+    printf("round trip\n");
+    test_round_trip();
+    printf("dirty fields\n");
+    test_dirty_fields();
+    printf("deep sleep\n");
+    test_deep_sleep();
+    printf("power loss\n");
+    test_power_loss();
+    printf("torn save\n");
+    test_torn_save();
+    printf("mismatch\n");
+    test_mismatch();
+    printf("OK\n");
+    return 0;
+}
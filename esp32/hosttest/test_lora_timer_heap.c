@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The heap of LoRa timers, on a fake clock ticking once a ms like the
+// board's, with a hardware timer that fires no sooner than 2 ticks after
+// it's programmed as timer-board.c does.  The random test checks every
+// expiry against a plain list of the running timers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "lora_timer_heap.h"
+
+#define N_TIMERS            (24)
+#define RANDOM_STEPS        (200000)
+
+/******************************************************************************
+ fake clock and hardware timer
+ ******************************************************************************/
+static uint32_t fake_now;
+static uint32_t hw_at;
+static bool hw_armed;
+static lora_timer_heap_t heap;
+
+static TimerEvent_t timers[N_TIMERS];
+static uint32_t fired_at[N_TIMERS];
+static uint32_t fired_count[N_TIMERS];
+static int fired_order[N_TIMERS * 4];
+static int fired_n;
+
+static uint32_t stub_now(void) {
+    return fake_now;
+}
+
+static void stub_hw_start(uint32_t delay) {
+    hw_at = fake_now + (delay <= 1 ? 2 : delay);
+    hw_armed = true;
+}
+
+static void stub_expired(TimerEvent_t *obj) {
+    int i = obj - timers;
+    assert(i >= 0 && i < N_TIMERS);
+    assert(!obj->IsRunning);
+    fired_at[i] = fake_now;
+    fired_count[i]++;
+    if (fired_n < N_TIMERS * 4) {
+        fired_order[fired_n++] = i;
+    }
+}
+
+static const lora_timer_heap_ops_t stub_ops = {
+    .now = stub_now,
+    .hw_start = stub_hw_start,
+    .expired = stub_expired,
+};
+
+static void tick(void) {
+    fake_now++;
+    if (hw_armed && fake_now == hw_at) {
+        hw_armed = false;
+        lora_timer_heap_expire(&heap);
+    }
+}
+
+static void run(uint32_t ms) {
+    while (ms--) {
+        tick();
+    }
+}
+
+static void setup(uint32_t now) {
+    fake_now = now;
+    hw_armed = false;
+    lora_timer_heap_init(&heap, &stub_ops);
+    memset(timers, 0, sizeof(timers));
+    memset(fired_count, 0, sizeof(fired_count));
+    fired_n = 0;
+}
+
+static void start(int i, uint32_t value) {
+    timers[i].ReloadValue = value;
+    assert(lora_timer_heap_start(&heap, &timers[i]));
+}
+
+// the heap property holds and every running timer knows its place
+static void check_heap(void) {
+    for (uint32_t i = 0; i < heap.count; i++) {
+        assert(heap.heap[i]->IsRunning);
+        assert(heap.heap[i]->HeapIndex == i);
+        if (i > 0) {
+            int32_t d = heap.heap[(i - 1) / 2]->Timestamp - heap.heap[i]->Timestamp;
+            assert(d <= 0);
+        }
+    }
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_order(void) {
+    setup(1000);
+
+    // started out of order, they expire in order
+    start(0, 300);
+    start(1, 100);
+    start(2, 200);
+    start(3, 50);
+    check_heap();
+    assert(heap.count == 4);
+    run(400);
+    assert(fired_n == 4);
+    assert(fired_order[0] == 3 && fired_order[1] == 1 && fired_order[2] == 2 && fired_order[3] == 0);
+    assert(fired_at[3] == 1050 && fired_at[1] == 1100 && fired_at[2] == 1200 && fired_at[0] == 1300);
+    assert(heap.count == 0);
+
+    // due at the same time, they expire together in the order they started
+    fired_n = 0;
+    start(5, 20);
+    start(4, 20);
+    start(6, 20);
+    uint32_t irqs = heap.stats.irqs;
+    run(30);
+    assert(fired_n == 3);
+    assert(fired_order[0] == 5 && fired_order[1] == 4 && fired_order[2] == 6);
+    assert(heap.stats.irqs == irqs + 1);
+
+    // a short timer expires as soon as the hardware can
+    fired_n = 0;
+    start(7, 0);
+    start(8, 1);
+    run(2);
+    assert(fired_n == 2 && fired_order[0] == 7 && fired_order[1] == 8);
+}
+
+static void test_stop(void) {
+    setup(0);
+
+    start(0, 100);
+    start(1, 200);
+    start(2, 300);
+
+    // stopping one that's not first doesn't touch the hardware
+    uint32_t at = hw_at;
+    lora_timer_heap_stop(&heap, &timers[1]);
+    assert(!timers[1].IsRunning && hw_at == at);
+    check_heap();
+
+    // stopping the first programs the next one
+    lora_timer_heap_stop(&heap, &timers[0]);
+    assert(hw_at == 300);
+    check_heap();
+
+    // stopping one that's not running, or twice, is harmless
+    lora_timer_heap_stop(&heap, &timers[0]);
+    lora_timer_heap_stop(&heap, &timers[5]);
+    assert(heap.count == 1);
+
+    run(400);
+    assert(fired_n == 1 && fired_order[0] == 2 && fired_at[2] == 300);
+
+    // a timer being initialized may hold anything
+    timers[9].IsRunning = true;
+    timers[9].HeapIndex = 0xA5A5;
+    lora_timer_heap_stop(&heap, &timers[9]);
+    timers[9].HeapIndex = 0;
+    lora_timer_heap_stop(&heap, &timers[9]);
+    assert(heap.count == 0);
+}
+
+static void test_restart(void) {
+    setup(0);
+
+    // starting a running timer does nothing
+    start(0, 100);
+    run(50);
+    start(0, 100);
+    run(60);
+    assert(fired_count[0] == 1 && fired_at[0] == 100);
+
+    // stopped and started again, it's due a full period later
+    start(0, 100);
+    run(50);
+    lora_timer_heap_stop(&heap, &timers[0]);
+    start(0, 100);
+    run(200);
+    assert(fired_count[0] == 2 && fired_at[0] == 260);
+}
+
+static void test_full(void) {
+    static TimerEvent_t many[LORA_TIMER_HEAP_SIZE + 1];
+    setup(0);
+    memset(many, 0, sizeof(many));
+
+    for (int i = 0; i < LORA_TIMER_HEAP_SIZE; i++) {
+        many[i].ReloadValue = 10 + i;
+        assert(lora_timer_heap_start(&heap, &many[i]));
+    }
+    many[LORA_TIMER_HEAP_SIZE].ReloadValue = 5;
+    assert(!lora_timer_heap_start(&heap, &many[LORA_TIMER_HEAP_SIZE]));
+    assert(!many[LORA_TIMER_HEAP_SIZE].IsRunning);
+    assert(heap.stats.full == 1);
+    assert(heap.stats.high_water == LORA_TIMER_HEAP_SIZE);
+}
+
+// the clock wraps around while timers are running
+static void test_wrap(void) {
+    setup(0xFFFFFF00);
+
+    start(0, 0x80);
+    start(1, 0x180);
+    start(2, 0x100);
+    check_heap();
+    run(0x200);
+    assert(fired_n == 3);
+    assert(fired_order[0] == 0 && fired_order[1] == 2 && fired_order[2] == 1);
+    assert(fired_at[0] == 0xFFFFFF80 && fired_at[2] == 0 && fired_at[1] == 0x80);
+}
+
+// random starts and stops, against a plain list of the expected expiries
+static void test_random(void) {
+    uint32_t expect[N_TIMERS];
+    bool running[N_TIMERS];
+    uint32_t expired = 0;
+
+    setup(0xFFF00000);
+    srand(1);
+    memset(running, 0, sizeof(running));
+
+    for (int step = 0; step < RANDOM_STEPS; step++) {
+        int i = rand() % N_TIMERS;
+        switch (rand() % 4) {
+        case 0:
+        case 1:
+            if (!running[i]) {
+                uint32_t value = rand() % 4 == 0 ? rand() % 3 : rand() % 5000;
+                uint32_t before = fired_count[i];
+                start(i, value);
+                assert(fired_count[i] == before);
+                running[i] = true;
+                expect[i] = fake_now + value;
+            }
+            break;
+        case 2:
+            lora_timer_heap_stop(&heap, &timers[i]);
+            running[i] = false;
+            break;
+        default:
+            break;
+        }
+        check_heap();
+
+        uint32_t counts[N_TIMERS];
+        memcpy(counts, fired_count, sizeof(counts));
+        run(rand() % 40);
+        for (int j = 0; j < N_TIMERS; j++) {
+            if (fired_count[j] != counts[j]) {
+                // once, when due, or 2 ticks at most after it for the
+                // shortest ones
+                assert(fired_count[j] == counts[j] + 1);
+                assert(running[j]);
+                int32_t late = fired_at[j] - expect[j];
+                assert(late >= 0 && late <= 2);
+                running[j] = false;
+                expired++;
+            } else if (running[j]) {
+                int32_t left = expect[j] - fake_now;
+                assert(left >= -2);
+            }
+        }
+        fired_n = 0;
+    }
+    assert(heap.stats.expired == expired);
+    printf("  %u starts, %u stops, %u expired in %u irqs, %u at most running\n",
+           heap.stats.starts, heap.stats.stops, heap.stats.expired, heap.stats.irqs, heap.stats.high_water);
+}
+
+int main(void) {
+    printf("order\n");
+    test_order();
+    printf("stop\n");
+    test_stop();
+    printf("restart\n");
+    test_restart();
+    printf("full\n");
+    test_full();
+    printf("wrap\n");
+    test_wrap();
+    printf("random\n");
+    test_random();
+    printf("OK\n");
+    return 0;
+}
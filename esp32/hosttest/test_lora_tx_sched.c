@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The uplink queue, on a simulated clock and the EU868 data rates: the
+// order messages go in, the duty cycle of the bands over hours of traffic,
+// deadlines and coalescing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "lora_tx_sched.h"
+
+/******************************************************************************
+ EU868
+ ******************************************************************************/
+static const uint8_t datarates[] = { 12, 11, 10, 9, 8, 7, 7, 50 };
+static const uint32_t bandwidths[] = { 125000, 125000, 125000, 125000, 125000, 125000, 250000, 0 };
+static const uint32_t max_payloads[] = { 51, 51, 51, 115, 242, 242, 242, 242 };
+
+static uint32_t bands_mask;
+static uint32_t expired_ids[16];
+static uint32_t nb_expired;
+
+static uint32_t stub_time_on_air(void *ctx, uint8_t dr, uint32_t len) {
+    return lora_tx_sched_air_time(datarates[dr], bandwidths[dr], len + LORA_TX_SCHED_FRAME_OVERHEAD);
+}
+
+static uint32_t stub_max_payload(void *ctx, uint8_t dr) {
+    return max_payloads[dr];
+}
+
+static uint32_t stub_bands_in_use(void *ctx) {
+    return bands_mask;
+}
+
+static void stub_expired(void *ctx, const lora_tx_msg_t *msg) {
+    assert(nb_expired < 16);
+    expired_ids[nb_expired++] = msg->id;
+}
+
+static const lora_tx_sched_ops_t stub_ops = {
+    .time_on_air = stub_time_on_air,
+    .max_payload = stub_max_payload,
+    .bands_in_use = stub_bands_in_use,
+    .expired = stub_expired,
+};
+
+static lora_tx_sched_t sched;
+
+static void setup(void) {
+    lora_tx_sched_init(&sched, &stub_ops, NULL);
+    bands_mask = 0x01;
+    nb_expired = 0;
+}
+
+static lora_tx_msg_t msg(uint8_t port, uint8_t dr, uint32_t len, uint8_t priority) {
+    lora_tx_msg_t m;
+    memset(&m, 0, sizeof(m));
+    m.port = port;
+    m.dr = dr;
+    m.len = len;
+    m.priority = priority;
+    for (uint32_t i = 0; i < len; i++) {
+        m.data[i] = port + i;
+    }
+    return m;
+}
+
+static uint32_t put(lora_tx_msg_t m) {
+    return lora_tx_sched_put(&sched, &m);
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static void test_air_time(void) {
+    // the Semtech calculator: 23 bytes at SF7 and SF12, 125 kHz
+    assert(lora_tx_sched_air_time(7, 125000, 23) == 62);
+    assert(lora_tx_sched_air_time(12, 125000, 23) == 1483);
+    // 13 bytes at SF9, 64 at SF10, and 23 at SF7 and 250 kHz
+    assert(lora_tx_sched_air_time(9, 125000, 13) == 165);
+    assert(lora_tx_sched_air_time(10, 125000, 64) == 699);
+    assert(lora_tx_sched_air_time(7, 250000, 23) == 31);
+    // FSK at 50 kbps
+    assert(lora_tx_sched_air_time(50, 0, 23) == 6);
+    // longer frames never take less
+    for (uint32_t dr = 0; dr < 8; dr++) {
+        uint32_t last = 0;
+        for (uint32_t len = 0; len <= max_payloads[dr]; len++) {
+            uint32_t t = stub_time_on_air(NULL, dr, len);
+            assert(t >= last);
+            last = t;
+        }
+    }
+}
+
+static void test_order(void) {
+    lora_tx_msg_t out;
+    uint32_t wait;
+
+    setup();
+    assert(!lora_tx_sched_take(&sched, 0, &out, &wait));
+    assert(wait == LORA_TX_SCHED_NEVER);
+    assert(lora_tx_sched_eta(&sched, 0) == LORA_TX_SCHED_NEVER);
+
+    uint32_t a = put(msg(1, 5, 10, 0));
+    uint32_t b = put(msg(2, 5, 10, 2));
+    uint32_t c = put(msg(3, 5, 10, 0));
+    lora_tx_msg_t m = msg(4, 5, 10, 0);
+    m.has_deadline = true;
+    m.deadline = 5000;
+    uint32_t d = put(m);
+    m.deadline = 3000;
+    uint32_t e = put(m);
+    assert(a && b && c && d && e);
+    assert(lora_tx_sched_depth(&sched) == 5);
+    assert(lora_tx_sched_eta(&sched, 0) == 0);
+
+    // one more would go after those of its rank
+    uint32_t t = stub_time_on_air(NULL, 5, 10);
+    m = msg(4, 5, 10, 0);
+    assert(lora_tx_sched_eta_msg(&sched, &m, 0) == 5 * t);
+    m.deadline = 4000;
+    m.has_deadline = true;
+    assert(lora_tx_sched_eta_msg(&sched, &m, 0) == 2 * t);
+    m.priority = 3;
+    assert(lora_tx_sched_eta_msg(&sched, &m, 0) == 0);
+
+    // priority first, then the earliest deadline, then in order
+    uint32_t expect[] = { b, e, d, a, c };
+    for (uint32_t i = 0; i < 5; i++) {
+        assert(lora_tx_sched_take(&sched, 0, &out, &wait));
+        assert(out.id == expect[i]);
+        assert(out.len == 10 && out.data[0] == out.port);
+    }
+    assert(lora_tx_sched_depth(&sched) == 0);
+
+    // full
+    for (uint32_t i = 0; i < LORA_TX_SCHED_DEPTH; i++) {
+        assert(put(msg(1, 5, 10, 0)) != 0);
+    }
+    assert(put(msg(1, 5, 10, 0)) == 0);
+    assert(sched.stats.full == 1);
+    lora_tx_sched_flush(&sched);
+    assert(lora_tx_sched_depth(&sched) == 0);
+    assert(nb_expired == 0);
+    assert(put(msg(1, 5, 10, 0)) != 0);
+}
+
+// against a sort of what's queued, with random puts and takes
+static void test_heap(void) {
+    lora_tx_msg_t queued[LORA_TX_SCHED_DEPTH];
+    uint32_t n = 0;
+    lora_tx_msg_t out;
+    uint32_t wait;
+
+    setup();
+    for (uint32_t i = 0; i < 100000; i++) {
+        if (n < LORA_TX_SCHED_DEPTH && (n == 0 || rand() % 2)) {
+            lora_tx_msg_t m = msg(1 + rand() % 10, 5, 1, rand() % LORA_TX_SCHED_PRIORITIES);
+            m.has_deadline = rand() % 2;
+            m.deadline = 1000000 + rand() % 50;
+            m.id = put(m);
+            queued[n++] = m;
+        } else {
+            assert(lora_tx_sched_take(&sched, 0, &out, &wait));
+            uint32_t best = 0;
+            for (uint32_t j = 1; j < n; j++) {
+                lora_tx_msg_t *x = &queued[j], *y = &queued[best];
+                bool before;
+                if (x->priority != y->priority) {
+                    before = x->priority > y->priority;
+                } else if (x->has_deadline != y->has_deadline) {
+                    before = x->has_deadline;
+                } else if (x->has_deadline && x->deadline != y->deadline) {
+                    before = x->deadline < y->deadline;
+                } else {
+                    before = x->id < y->id;
+                }
+                if (before) {
+                    best = j;
+                }
+            }
+            assert(out.id == queued[best].id);
+            queued[best] = queued[--n];
+        }
+        assert(lora_tx_sched_depth(&sched) == n);
+    }
+}
+
+// Sending all it can on a 1% band for ten hours: never more than its share
+// and a frame in any hour, and close to its share overall.  Whenever it
+// says to wait, a take any earlier fails and one then succeeds.
+static void test_duty_cycle(void) {
+    const uint32_t hours = 10;
+    static uint32_t on_air[10 * 3600];      // ms sent in each second
+    uint32_t now = 0;
+    uint32_t total = 0;
+    lora_tx_msg_t out;
+    uint32_t wait;
+    uint32_t max_frame = stub_time_on_air(NULL, 0, 51);
+
+    setup();
+    memset(on_air, 0, sizeof(on_air));
+    lora_tx_sched_set_band(&sched, 0, 100, 100 * max_frame, now);
+
+    while (now < hours * 3600 * 1000) {
+        if (lora_tx_sched_depth(&sched) == 0) {
+            put(msg(1, rand() % 6, 1 + rand() % 51, 0));
+        }
+        if (!lora_tx_sched_take(&sched, now, &out, &wait)) {
+            assert(wait > 0 && wait != LORA_TX_SCHED_NEVER);
+            assert(lora_tx_sched_eta(&sched, now) == wait);
+            if (wait > 1) {
+                assert(!lora_tx_sched_take(&sched, now + wait - 1, &out, &wait));
+            }
+            now += lora_tx_sched_eta(&sched, now);
+            continue;
+        }
+        uint32_t t = stub_time_on_air(NULL, out.dr, out.len);
+        for (uint32_t ms = 0; ms < t; ms += 1000) {
+            uint32_t s = (now + ms) / 1000;
+            if (s < hours * 3600) {
+                on_air[s] += (t - ms < 1000) ? t - ms : 1000;
+            }
+        }
+        total += t;
+        now += t;
+        lora_tx_sched_sent(&sched, 0, t, now);
+    }
+
+    uint32_t worst = 0;
+    for (uint32_t start = 0; start + 3600 <= hours * 3600; start += 60) {
+        uint32_t sum = 0;
+        for (uint32_t s = start; s < start + 3600; s++) {
+            sum += on_air[s];
+        }
+        worst = (sum > worst) ? sum : worst;
+    }
+    printf("  %u ms on air in %u hours, %u at most in an hour\n", total, hours, worst);
+    assert(worst <= 36000 + max_frame + 1000);
+    assert(total >= hours * 36000 * 95 / 100);
+    assert(total <= hours * 36000 + max_frame);
+}
+
+// a frame waits for every band the MAC may pick
+static void test_bands(void) {
+    lora_tx_msg_t out;
+    uint32_t wait;
+    uint32_t t = stub_time_on_air(NULL, 5, 10);
+
+    setup();
+    lora_tx_sched_set_band(&sched, 0, 100, 100 * t, 0);
+    lora_tx_sched_set_band(&sched, 1, 1000, 1000 * t, 0);
+    bands_mask = 0x03;
+    put(msg(1, 5, 10, 0));
+    assert(lora_tx_sched_take(&sched, 0, &out, &wait));
+    lora_tx_sched_sent(&sched, 1, t, 0);
+
+    // band 0 is ready, 1 isn't until it earned its 0.1 %
+    put(msg(1, 5, 10, 0));
+    assert(lora_tx_sched_eta(&sched, 0) == 1000 * t);
+    bands_mask = 0x01;
+    assert(lora_tx_sched_eta(&sched, 0) == 0);
+    bands_mask = 0x03;
+    assert(!lora_tx_sched_take(&sched, 999 * t, &out, &wait));
+    assert(wait == t);
+    assert(lora_tx_sched_take(&sched, 1000 * t, &out, &wait));
+
+    // a band at 100 % or without limit doesn't hold anything
+    setup();
+    lora_tx_sched_set_band(&sched, 0, 1, 1000, 0);
+    for (uint32_t i = 0; i < 10; i++) {
+        put(msg(1, 0, 51, 0));
+        assert(lora_tx_sched_take(&sched, 0, &out, &wait));
+        lora_tx_sched_sent(&sched, 0, 3000, 0);
+    }
+}
+
+static void test_deadline(void) {
+    lora_tx_msg_t out;
+    uint32_t wait;
+    uint32_t t = stub_time_on_air(NULL, 0, 51);
+
+    setup();
+    lora_tx_sched_set_band(&sched, 0, 100, 100 * t, 0);
+    put(msg(1, 0, 51, 0));
+    assert(lora_tx_sched_take(&sched, 0, &out, &wait));
+    lora_tx_sched_sent(&sched, 0, t, 0);
+
+    // the band is empty for 100 * t; the urgent one can't make it and the
+    // other one goes when it's dropped
+    lora_tx_msg_t m = msg(2, 0, 51, 3);
+    m.has_deadline = true;
+    m.deadline = 1000;
+    uint32_t urgent = put(m);
+    uint32_t other = put(msg(3, 0, 51, 0));
+    assert(!lora_tx_sched_take(&sched, 10, &out, &wait));
+    assert(wait == 1000 - 10 + 1);
+    assert(nb_expired == 0);
+    assert(!lora_tx_sched_take(&sched, 1001, &out, &wait));
+    assert(nb_expired == 1 && expired_ids[0] == urgent);
+    assert(sched.stats.expired == 1);
+    assert(wait == 100 * t - 1001);
+    assert(lora_tx_sched_take(&sched, 100 * t, &out, &wait));
+    assert(out.id == other);
+
+    // expired ones deep in the queue go too
+    setup();
+    for (uint32_t i = 0; i < 6; i++) {
+        m = msg(1, 5, 1, i % 4);
+        m.has_deadline = true;
+        m.deadline = (i % 2) ? 100 : 10000;
+        put(m);
+    }
+    assert(lora_tx_sched_take(&sched, 101, &out, &wait));
+    assert(nb_expired == 3);
+    assert(lora_tx_sched_depth(&sched) == 2);
+}
+
+static void test_coalesce(void) {
+    lora_tx_msg_t out;
+    uint32_t wait;
+
+    setup();
+    lora_tx_msg_t m = msg(7, 0, 20, 0);
+    m.coalesce = true;
+    uint32_t first = put(m);
+    uint32_t other_port = put(msg(8, 0, 20, 1));
+    m.data[0] = 0xAA;
+    assert(put(m) == first);
+    assert(lora_tx_sched_depth(&sched) == 2);
+    assert(sched.stats.coalesced == 1);
+    // it would go past the 51 bytes of DR0
+    uint32_t third = put(m);
+    assert(third != first);
+    // not asked to coalesce
+    m.coalesce = false;
+    assert(put(m) != first);
+    // a more urgent one takes the first up with it
+    m = msg(7, 0, 5, 2);
+    m.coalesce = true;
+    m.has_deadline = true;
+    m.deadline = 500;
+    assert(put(m) == first);
+    assert(lora_tx_sched_take(&sched, 0, &out, &wait));
+    assert(out.id == first);
+    assert(out.len == 45 && out.priority == 2 && out.has_deadline && out.deadline == 500);
+    assert(out.data[0] == 7 && out.data[20] == 0xAA && out.data[40] == 7);
+    assert(lora_tx_sched_take(&sched, 0, &out, &wait));
+    assert(out.id == other_port);
+    // confirmed and unconfirmed aren't mixed
+    setup();
+    m = msg(7, 5, 10, 0);
+    m.coalesce = true;
+    first = put(m);
+    m.confirmed = true;
+    assert(put(m) != first);
+}
+
+int main(void) {
+    srand(1);
+    printf("air time\n");
+    test_air_time();
+    printf("order\n");
+    test_order();
+    printf("heap\n");
+    test_heap();
+    printf("duty cycle\n");
+    test_duty_cycle();
+    printf("bands\n");
+    test_bands();
+    printf("deadline\n");
+    test_deadline();
+    printf("coalesce\n");
+    test_coalesce();
+    printf("OK\n");
+    return 0;
+}
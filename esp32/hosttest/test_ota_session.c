@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// Resumable OTA sessions over an image slot on the simulated flash, with
+// the progress saved to a RAM stand-in for NVS.  Downloads are cut off at
+// chunk boundaries, in the middle of a flash write and between a write and
+// the save of the progress, and the device "reboots" (a fresh session
+// reading the saved progress) before carrying on.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "flash_sim.h"
+#include "ota_session.h"
+#include "extmod/crypto-algorithms/sha256.h"
+
+#define SLOT_BLOCKS         (128)
+#define SLOT_SIZE           (SLOT_BLOCKS * FLASH_SIM_BLOCK_SIZE)
+#define IMG_SIZE            (300 * 1024 + 123)
+#define CHUNK_SIZE          (16 * 1024)
+
+static uint8_t nvs[sizeof(ota_session_state_t)];
+static bool nvs_valid;
+static int save_fail;               // saves left before they fail, -1 for never
+
+static bool sim_write(void *ctx, uint32_t offset, const void *buf, uint32_t len) {
+    return flash_sim_write(offset, buf, len) == 0;
+}
+
+static bool sim_erase(void *ctx, uint32_t offset, uint32_t len) {
+    assert(offset % FLASH_SIM_BLOCK_SIZE == 0 && len % FLASH_SIM_BLOCK_SIZE == 0);
+    for (uint32_t off = 0; off < len; off += FLASH_SIM_BLOCK_SIZE) {
+        if (flash_sim_erase(offset + off) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool nvs_load(void *ctx, void *data, uint32_t len) {
+    if (!nvs_valid) {
+        return false;
+    }
+    assert(len == sizeof(nvs));
+    memcpy(data, nvs, len);
+    return true;
+}
+
+static bool nvs_save(void *ctx, const void *data, uint32_t len) {
+    if (save_fail >= 0 && save_fail-- == 0) {
+        return false;
+    }
+    if (len == 0) {
+        nvs_valid = false;
+    } else {
+        assert(len == sizeof(nvs));
+        memcpy(nvs, data, len);
+        nvs_valid = true;
+    }
+    return true;
+}
+
+static const ota_session_ops_t ops = {
+    .write = sim_write,
+    .erase = sim_erase,
+    .load = nvs_load,
+    .save = nvs_save,
+};
+
+static uint8_t image[IMG_SIZE];
+static uint8_t digest[OTA_SESSION_DIGEST_LEN];
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void) {
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return rnd_state >> 8;
+}
+
+// An app image: magic, hash_appended set, and the SHA-256 of the rest at
+// the end.
+static void make_image(uint8_t *img, uint32_t len) {
+    CRYAL_SHA256_CTX ctx;
+
+    for (uint32_t i = 0; i < len; i++) {
+        img[i] = rnd();
+    }
+    img[0] = 0xE9;
+    img[23] = 1;
+    sha256_init(&ctx);
+    sha256_update(&ctx, img, len - 32);
+    sha256_final(&ctx, img + len - 32);
+}
+
+static void file_digest(const uint8_t *buf, uint32_t len, uint8_t *out) {
+    CRYAL_SHA256_CTX ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, buf, len);
+    sha256_final(&ctx, out);
+}
+
+static uint32_t chunk_len(uint32_t index) {
+    uint32_t off = index * CHUNK_SIZE;
+    return IMG_SIZE - off < CHUNK_SIZE ? IMG_SIZE - off : CHUNK_SIZE;
+}
+
+static int send(ota_session_t *s, uint32_t index) {
+    return ota_session_write(s, index, image + index * CHUNK_SIZE, chunk_len(index), NULL);
+}
+
+// Sends chunks from first until the session ends or limit chunks were sent;
+// returns the next chunk.
+static int send_from(ota_session_t *s, int first, int limit) {
+    int next = first;
+
+    for (int n = 0; n < limit && next < (int)ota_session_chunks(s); n++) {
+        int ret = send(s, next);
+        assert(ret == next + 1);
+        next = ret;
+    }
+    return next;
+}
+
+static void check_flash(void) {
+    uint8_t *buf = malloc(IMG_SIZE);
+    assert(flash_sim_read(0, buf, IMG_SIZE) == 0);
+    assert(memcmp(buf, image, IMG_SIZE) == 0);
+    free(buf);
+}
+
+static void reset(void) {
+    flash_sim_deinit();
+    flash_sim_init(SLOT_BLOCKS);
+    nvs_valid = false;
+    save_fail = -1;
+}
+
+static void test_straight(void) {
+    ota_session_t s;
+    int chunks;
+
+    reset();
+    flash_sim_reset_stats();
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+    chunks = ota_session_chunks(&s);
+    assert(chunks == (IMG_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    assert(send_from(&s, 0, chunks) == chunks);
+    assert(ota_session_finish(&s) == OTA_SESSION_OK);
+    assert(!nvs_valid);
+    assert(ota_hash_image_ok(&s.state.hash));
+    // nothing is read back, the chunks are hashed as they are received
+    printf("straight: %d chunks, %u bytes written, %u read back\n", chunks,
+           flash_sim.bytes_written, flash_sim.bytes_read);
+    assert(flash_sim.bytes_read == 0);
+    check_flash();
+}
+
+static void test_resume(void) {
+    ota_session_t s;
+    int next;
+
+    reset();
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+    next = send_from(&s, 0, 7);
+    assert(next == 7);
+
+    // reboot: the new session carries on from chunk 7, and a chunk sent
+    // again is acknowledged without being written
+    memset(&s, 0xAA, sizeof(s));
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 7);
+    flash_sim_reset_stats();
+    assert(send(&s, 6) == 7);
+    assert(flash_sim.bytes_written == 0);
+    assert(ota_session_write(&s, 9, image, CHUNK_SIZE, NULL) == OTA_SESSION_ERR_ORDER);
+    assert(ota_session_write(&s, 7, image, CHUNK_SIZE - 1, NULL) == OTA_SESSION_ERR_PARAM);
+    assert(ota_session_finish(&s) == OTA_SESSION_ERR_INCOMPLETE);
+    next = send_from(&s, 7, 5);
+
+    // cut off in the middle of a chunk's flash write
+    flash_sim_power_fail_after(3);
+    assert(send(&s, next) == OTA_SESSION_ERR_FLASH);
+    flash_sim_power_on();
+    memset(&s, 0, sizeof(s));
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == next);
+
+    // cut off between writing a chunk and saving the progress: the chunk is
+    // sent again
+    save_fail = 0;
+    assert(send(&s, next) == next + 1);
+    memset(&s, 0, sizeof(s));
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == next);
+
+    next = send_from(&s, next, 1000);
+    // everything written, but not finished before a reboot
+    memset(&s, 0, sizeof(s));
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == next);
+    assert(ota_session_finish(&s) == OTA_SESSION_OK);
+    assert(ota_hash_image_ok(&s.state.hash));
+    check_flash();
+    printf("resumed after reboots, a torn write and a lost save\n");
+}
+
+static void test_restart(void) {
+    ota_session_t s;
+    uint8_t other[OTA_SESSION_DIGEST_LEN];
+
+    reset();
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+    assert(send_from(&s, 0, 3) == 3);
+
+    // another image, slot, size or chunk size starts from the beginning
+    memcpy(other, digest, sizeof(other));
+    other[5] ^= 1;
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, other) == 0);
+    assert(send_from(&s, 0, 3) == 3);
+    assert(ota_session_begin(&s, &ops, NULL, 0x20000, IMG_SIZE, CHUNK_SIZE, other) == 0);
+    assert(send_from(&s, 0, 3) == 3);
+    assert(ota_session_begin(&s, &ops, NULL, 0x20000, IMG_SIZE - 1, CHUNK_SIZE, other) == 0);
+    assert(send_from(&s, 0, 3) == 3);
+    assert(ota_session_begin(&s, &ops, NULL, 0x20000, IMG_SIZE - 1, 2 * CHUNK_SIZE, other) == 0);
+
+    // damaged progress is ignored
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+    assert(send_from(&s, 0, 3) == 3);
+    nvs[20] ^= 1;
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+
+    // after abort, a new session starts over
+    assert(send_from(&s, 0, 3) == 3);
+    ota_session_abort(&s);
+    assert(!nvs_valid);
+    assert(send(&s, 3) == OTA_SESSION_ERR_ORDER);
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, 1000, digest) == OTA_SESSION_ERR_PARAM);
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, 0, CHUNK_SIZE, digest) == OTA_SESSION_ERR_PARAM);
+    save_fail = 0;
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, other) == OTA_SESSION_ERR_SAVE);
+    assert(send(&s, 0) == OTA_SESSION_ERR_ORDER);
+    printf("other images and damaged progress start over\n");
+}
+
+static void test_bad_data(void) {
+    ota_session_t s;
+    uint8_t other[OTA_SESSION_DIGEST_LEN];
+    uint8_t chunk_digest[OTA_SESSION_DIGEST_LEN];
+    uint8_t saved[sizeof(nvs)];
+    int next;
+
+    reset();
+    // a bit flipped in a chunk sent with its digest is refused before it is
+    // written, the progress stays at the last chunk that checked out, and
+    // the chunk can be sent again
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+    next = send_from(&s, 0, 2);
+    file_digest(image + next * CHUNK_SIZE, chunk_len(next), chunk_digest);
+    memcpy(saved, nvs, sizeof(nvs));
+    image[next * CHUNK_SIZE + 10] ^= 0x04;
+    flash_sim_reset_stats();
+    assert(ota_session_write(&s, next, image + next * CHUNK_SIZE, chunk_len(next), chunk_digest) == OTA_SESSION_ERR_CHUNK_DIGEST);
+    image[next * CHUNK_SIZE + 10] ^= 0x04;
+    assert(flash_sim.bytes_written == 0);
+    assert(memcmp(saved, nvs, sizeof(nvs)) == 0);
+    memset(&s, 0, sizeof(s));
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == next);
+    assert(ota_session_write(&s, next, image + next * CHUNK_SIZE, chunk_len(next), chunk_digest) == next + 1);
+    send_from(&s, next + 1, 1000);
+    assert(ota_session_finish(&s) == OTA_SESSION_OK);
+    assert(!nvs_valid);
+    check_flash();
+
+    // without chunk digests, a bit flipped on its way in is caught by the
+    // file digest at the end; the progress is kept until the download is
+    // aborted
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+    next = send_from(&s, 0, 2);
+    image[next * CHUNK_SIZE + 10] ^= 0x04;
+    next = send_from(&s, next, 1);
+    image[(next - 1) * CHUNK_SIZE + 10] ^= 0x04;
+    send_from(&s, next, 1000);
+    assert(ota_session_finish(&s) == OTA_SESSION_ERR_DIGEST);
+    assert(nvs_valid && s.active);
+    memset(&s, 0, sizeof(s));
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == (int)ota_session_chunks(&s));
+    assert(ota_session_finish(&s) == OTA_SESSION_ERR_DIGEST);
+    ota_session_abort(&s);
+    assert(!nvs_valid);
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, digest) == 0);
+    send_from(&s, 0, 1000);
+    assert(ota_session_finish(&s) == OTA_SESSION_OK);
+
+    // a file that doesn't match the digest it was started with
+    memcpy(other, digest, sizeof(other));
+    other[0] ^= 1;
+    assert(ota_session_begin(&s, &ops, NULL, 0x10000, IMG_SIZE, CHUNK_SIZE, other) == 0);
+    send_from(&s, 0, 1000);
+    assert(ota_session_finish(&s) == OTA_SESSION_ERR_DIGEST);
+    assert(nvs_valid);
+    ota_session_abort(&s);
+    assert(!nvs_valid);
+    printf("bad chunks and digests refused\n");
+}
+
+// The incremental hash as updater_write() uses it, with writes of any size.
+static void test_hash(void) {
+    ota_hash_t h;
+    uint8_t d[OTA_SESSION_DIGEST_LEN];
+
+    ota_hash_init(&h);
+    for (uint32_t off = 0; off < IMG_SIZE; ) {
+        uint32_t n = 1 + rnd() % (rnd() % 2 ? 40 : 5000);
+        if (n > IMG_SIZE - off) {
+            n = IMG_SIZE - off;
+        }
+        ota_hash_update(&h, image + off, n);
+        off += n;
+    }
+    assert(ota_hash_image_ok(&h));
+    ota_hash_file_digest(&h, d);
+    assert(memcmp(d, digest, sizeof(d)) == 0);
+
+    image[1000] ^= 1;
+    ota_hash_init(&h);
+    ota_hash_update(&h, image, IMG_SIZE);
+    assert(!ota_hash_image_ok(&h));
+    image[1000] ^= 1;
+
+    // no digest appended
+    image[23] = 0;
+    ota_hash_init(&h);
+    ota_hash_update(&h, image, IMG_SIZE);
+    assert(!ota_hash_image_ok(&h));
+    image[23] = 1;
+
+    ota_hash_init(&h);
+    ota_hash_update(&h, image, 40);
+    assert(!ota_hash_image_ok(&h));
+    printf("incremental hash checked\n");
+}
+
+int main(void) {
+    flash_sim_init(SLOT_BLOCKS);
+    make_image(image, IMG_SIZE);
+    file_digest(image, IMG_SIZE, digest);
+
+    test_straight();
+    test_resume();
+    test_restart();
+    test_bad_data();
+    test_hash();
+
+    flash_sim_deinit();
+    printf("OK\n");
+    return 0;
+}
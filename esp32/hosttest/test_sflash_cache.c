@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// Tests of the FAT block cache against the simulated flash.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "flash_sim.h"
+#include "sflash_cache.h"
+
+#define SECTOR_SIZE     (512)
+#define SPB             (FLASH_SIM_BLOCK_SIZE / SECTOR_SIZE)
+#define N_BLOCKS        (64)
+#define N_SECTORS       (N_BLOCKS * SPB)
+
+static int write_block(uint32_t addr, const void *buf) {
+    if (flash_sim_erase(addr) != 0) {
+        return -1;
+    }
+    return flash_sim_write(addr, buf, FLASH_SIM_BLOCK_SIZE);
+}
+
+static const sflash_cache_ops_t ops = {
+    .read = flash_sim_read,
+    .write_block = write_block,
+};
+
+static uint8_t ref[N_SECTORS * SECTOR_SIZE];
+
+static void fill_sector(uint8_t *buf, uint32_t sector, uint32_t seq) {
+    for (int i = 0; i < SECTOR_SIZE; i++) {
+        buf[i] = sector * 31 + seq * 7 + i;
+    }
+}
+
+static void write_sectors(sflash_cache_t *cache, uint32_t sector, uint32_t count, uint32_t seq) {
+    static uint8_t buf[SPB * 4 * SECTOR_SIZE];
+    assert(count <= SPB * 4);
+    for (uint32_t i = 0; i < count; i++) {
+        fill_sector(buf + i * SECTOR_SIZE, sector + i, seq);
+    }
+    assert(sflash_cache_write(cache, 0, buf, sector, count) == 0);
+    memcpy(ref + sector * SECTOR_SIZE, buf, count * SECTOR_SIZE);
+}
+
+// Appends n records to a log file the way FatFs does with a sync after
+// every record: the data sector being appended to, then the FAT sector and
+// the directory entry.  Returns the number of erases.
+static uint32_t log_workload(uint32_t n_cache, uint32_t n) {
+    sflash_cache_t cache;
+    flash_sim_init(N_BLOCKS);
+    memset(ref, 0xff, sizeof(ref));
+    assert(sflash_cache_init(&cache, &ops, FLASH_SIM_BLOCK_SIZE, SECTOR_SIZE, n_cache));
+    for (uint32_t i = 0; i < n; i++) {
+        write_sectors(&cache, 64 + i / 4, 1, i);    // 4 records per data sector
+        write_sectors(&cache, 1, 1, i);             // FAT
+        write_sectors(&cache, 16, 1, i);            // directory
+    }
+    assert(sflash_cache_flush(&cache) == 0);
+    assert(memcmp(flash_sim.mem, ref, sizeof(ref)) == 0);
+    uint32_t erases = flash_sim.erases;
+    printf("log workload, %u cache block(s): %u erases, %u bytes written, %u bytes read\n",
+        n_cache, erases, flash_sim.bytes_written, flash_sim.bytes_read);
+    sflash_cache_deinit(&cache);
+    flash_sim_deinit();
+    return erases;
+}
+
+// Writes a large file in 4-block chunks, updating the FAT after each chunk;
+// the FAT block must stay cached while the data streams past.
+static void test_sequential(void) {
+    sflash_cache_t cache;
+    flash_sim_init(N_BLOCKS);
+    memset(ref, 0xff, sizeof(ref));
+    assert(sflash_cache_init(&cache, &ops, FLASH_SIM_BLOCK_SIZE, SECTOR_SIZE, 4));
+    write_sectors(&cache, 1, 1, 0);
+    for (uint32_t i = 0; i < 8; i++) {
+        write_sectors(&cache, 64 + i * SPB * 4, SPB * 4, i);
+        write_sectors(&cache, 1, 1, i + 1);
+    }
+    // only the FAT block was read; the data blocks went straight out and the
+    // FAT block was only written by the final flush
+    assert(flash_sim.bytes_read == FLASH_SIM_BLOCK_SIZE);
+    assert(flash_sim.erases == 8 * 4);
+    assert(sflash_cache_flush(&cache) == 0);
+    assert(flash_sim.erases == 8 * 4 + 1);
+    assert(memcmp(flash_sim.mem, ref, sizeof(ref)) == 0);
+    sflash_cache_deinit(&cache);
+    flash_sim_deinit();
+}
+
+// Random reads and writes checked against a reference image.
+static void test_random(void) {
+    sflash_cache_t cache;
+    static uint8_t buf[SPB * 4 * SECTOR_SIZE];
+    flash_sim_init(N_BLOCKS);
+    memset(ref, 0xff, sizeof(ref));
+    assert(sflash_cache_init(&cache, &ops, FLASH_SIM_BLOCK_SIZE, SECTOR_SIZE, 3));
+    srand(1);
+    for (int i = 0; i < 20000; i++) {
+        uint32_t count = 1 + rand() % (SPB * 4);
+        uint32_t sector = rand() % (N_SECTORS - count);
+        switch (rand() % 8) {
+            case 0:
+                assert(sflash_cache_flush(&cache) == 0);
+                assert(memcmp(flash_sim.mem, ref, sizeof(ref)) == 0);
+                break;
+            case 1: case 2: case 3:
+                assert(sflash_cache_read(&cache, 0, buf, sector, count) == 0);
+                assert(memcmp(buf, ref + sector * SECTOR_SIZE, count * SECTOR_SIZE) == 0);
+                break;
+            default:
+                write_sectors(&cache, sector, count, i);
+                break;
+        }
+    }
+    assert(sflash_cache_flush(&cache) == 0);
+    assert(memcmp(flash_sim.mem, ref, sizeof(ref)) == 0);
+    sflash_cache_deinit(&cache);
+    flash_sim_deinit();
+}
+
+int main(void) {
+    test_random();
+    test_sequential();
+    uint32_t e1 = log_workload(1, 400);
+    uint32_t e4 = log_workload(4, 400);
+    // a single block cache erases on nearly every write
+    assert(e4 * 10 < e1);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// Tests of the wear-levelling FTL against the simulated flash, including
+// power failures at every point of a write sequence, and a replay of a
+// logging workload through the block cache comparing block wear with the
+// direct mapping.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "flash_sim.h"
+#include "sflash_cache.h"
+#include "sflash_ftl.h"
+
+#define BS              FLASH_SIM_BLOCK_SIZE
+#define SECTOR_SIZE     (512)
+#define N_BLOCKS        (64)
+
+static const sflash_ftl_ops_t ftl_ops = {
+    .read = flash_sim_read,
+    .erase = flash_sim_erase,
+    .write = flash_sim_write,
+};
+
+static uint8_t ref[N_BLOCKS][BS];
+static uint8_t buf[BS];
+
+static void fill_block(uint8_t *data, uint32_t block, uint32_t seq) {
+    for (int i = 0; i < BS; i++) {
+        data[i] = block * 13 + seq * 5 + (i >> 3);
+    }
+}
+
+static void check_all(sflash_ftl_t *ftl) {
+    for (uint32_t b = 0; b < ftl->n_logical; b++) {
+        assert(sflash_ftl_read(ftl, b * BS, buf, BS) == 0);
+        assert(memcmp(buf, ref[b], BS) == 0);
+    }
+}
+
+static void remount(sflash_ftl_t *ftl) {
+    sflash_ftl_deinit(ftl);
+    assert(sflash_ftl_init(ftl, &ftl_ops, 0, BS, N_BLOCKS));
+    assert(sflash_ftl_mount(ftl) == 0);
+}
+
+static void test_basic(void) {
+    sflash_ftl_t ftl;
+    flash_sim_init(N_BLOCKS);
+    assert(sflash_ftl_init(&ftl, &ftl_ops, 0, BS, N_BLOCKS));
+    assert(sflash_ftl_mount(&ftl) == -1);
+    assert(sflash_ftl_format(&ftl) == 0);
+    printf("%u blocks: %u logical, %u per metadata slot\n", N_BLOCKS, ftl.n_logical, ftl.slot_blocks);
+    memset(ref, 0xff, sizeof(ref));
+    check_all(&ftl);
+
+    // enough writes to go through the log several times
+    srand(2);
+    for (uint32_t i = 0; i < 3000; i++) {
+        uint32_t b = rand() % 8 == 0 ? rand() % ftl.n_logical : rand() % 4;
+        fill_block(ref[b], b, i);
+        assert(sflash_ftl_write_block(&ftl, b, ref[b]) == 0);
+        if (i % 500 == 0) {
+            remount(&ftl);
+            check_all(&ftl);
+        }
+    }
+    // unaligned reads spanning blocks
+    assert(sflash_ftl_read(&ftl, BS - 100, buf, 200) == 0);
+    assert(memcmp(buf, &ref[0][BS - 100], 100) == 0 && memcmp(buf + 100, ref[1], 100) == 0);
+    remount(&ftl);
+    check_all(&ftl);
+    sflash_ftl_deinit(&ftl);
+    flash_sim_deinit();
+}
+
+// Runs a write sequence with the power failing at operation n, then checks
+// that every block holds either its last completed write or (for the block
+// being written) the new data, and that writing carries on correctly.
+static int power_fail_run(int32_t n) {
+    sflash_ftl_t ftl;
+    flash_sim_init(N_BLOCKS);
+    assert(sflash_ftl_init(&ftl, &ftl_ops, 0, BS, N_BLOCKS));
+    assert(sflash_ftl_format(&ftl) == 0);
+    memset(ref, 0xff, sizeof(ref));
+    flash_sim_power_fail_after(n);
+    srand(3);
+    int32_t pending = -1;
+    static uint8_t pending_data[BS];
+    for (uint32_t i = 0; i < 600; i++) {
+        uint32_t b = rand() % 3 == 0 ? rand() % ftl.n_logical : rand() % 2;
+        fill_block(pending_data, b, i);
+        if (sflash_ftl_write_block(&ftl, b, pending_data) != 0) {
+            pending = b;
+            break;
+        }
+        memcpy(ref[b], pending_data, BS);
+    }
+    if (pending < 0) {
+        // the sequence finished before the failure point
+        sflash_ftl_deinit(&ftl);
+        flash_sim_deinit();
+        return 0;
+    }
+
+    flash_sim_power_on();
+    remount(&ftl);
+    // no erase that happened is missing from the counts
+    for (uint32_t i = 0; i < ftl.n_data; i++) {
+        assert(ftl.erase_count[i] >= flash_sim.block_erases[2 * ftl.slot_blocks + i]);
+    }
+    assert(sflash_ftl_read(&ftl, pending * BS, buf, BS) == 0);
+    if (memcmp(buf, pending_data, BS) == 0) {
+        memcpy(ref[pending], pending_data, BS);
+    }
+    check_all(&ftl);
+
+    // carry on writing after the recovery
+    for (uint32_t i = 0; i < 300; i++) {
+        uint32_t b = i % ftl.n_logical;
+        fill_block(ref[b], b, i + 1000);
+        assert(sflash_ftl_write_block(&ftl, b, ref[b]) == 0);
+    }
+    remount(&ftl);
+    check_all(&ftl);
+    sflash_ftl_deinit(&ftl);
+    flash_sim_deinit();
+    return 1;
+}
+
+static void test_power_fail(void) {
+    int runs = 0;
+    for (int32_t n = 0; power_fail_run(n); n++) {
+        runs++;
+    }
+    printf("power failure recovered at %d points\n", runs);
+    assert(runs > 1000);
+}
+
+// Flash encryption: read() decrypts, so the erased end of the log reads
+// as something else than 0xff and only read_raw() tells it.
+static void crypt(void *buf, uint32_t len) {
+    uint8_t *p = buf;
+    while (len--) {
+        *p++ ^= 0x5a;
+    }
+}
+
+static int enc_read(uint32_t addr, void *buf, uint32_t len) {
+    if (flash_sim_read(addr, buf, len) != 0) {
+        return -1;
+    }
+    crypt(buf, len);
+    return 0;
+}
+
+static int enc_write(uint32_t addr, const void *buf, uint32_t len) {
+    static uint8_t data[BS];
+    assert(len <= BS);
+    memcpy(data, buf, len);
+    crypt(data, len);
+    return flash_sim_write(addr, data, len);
+}
+
+static const sflash_ftl_ops_t enc_ops = {
+    .read = enc_read,
+    .erase = flash_sim_erase,
+    .write = enc_write,
+    .read_raw = flash_sim_read,
+};
+
+static void test_encrypted(void) {
+    sflash_ftl_t ftl;
+    flash_sim_init(N_BLOCKS);
+    assert(sflash_ftl_init(&ftl, &enc_ops, 0, BS, N_BLOCKS));
+    assert(sflash_ftl_format(&ftl) == 0);
+    memset(ref, 0xff, sizeof(ref));
+    for (uint32_t i = 0; i < 200; i++) {
+        uint32_t b = i % 5;
+        fill_block(ref[b], b, i);
+        assert(sflash_ftl_write_block(&ftl, b, ref[b]) == 0);
+    }
+    // the log carries on where it ended
+    uint32_t log_pos = ftl.log_pos;
+    uint32_t seq = ftl.seq;
+    sflash_ftl_deinit(&ftl);
+    assert(sflash_ftl_init(&ftl, &enc_ops, 0, BS, N_BLOCKS));
+    assert(sflash_ftl_mount(&ftl) == 0);
+    assert(ftl.log_pos == log_pos && ftl.seq == seq);
+    check_all(&ftl);
+    sflash_ftl_deinit(&ftl);
+    flash_sim_deinit();
+}
+
+// Block cache on top of either the FTL or the flash directly
+static sflash_ftl_t wl_ftl;
+
+static int direct_write_block(uint32_t addr, const void *data) {
+    if (flash_sim_erase(addr) != 0) {
+        return -1;
+    }
+    return flash_sim_write(addr, data, BS);
+}
+
+static int ftl_cache_read(uint32_t addr, void *data, uint32_t len) {
+    return sflash_ftl_read(&wl_ftl, addr, data, len);
+}
+
+static int ftl_cache_write_block(uint32_t addr, const void *data) {
+    return sflash_ftl_write_block(&wl_ftl, addr / BS, data);
+}
+
+static const sflash_cache_ops_t direct_ops = {
+    .read = flash_sim_read,
+    .write_block = direct_write_block,
+};
+
+static const sflash_cache_ops_t ftl_cache_ops = {
+    .read = ftl_cache_read,
+    .write_block = ftl_cache_write_block,
+};
+
+// A data logger on FAT: the volume is mostly filled with files that never
+// change, then records are appended to a log with a sync after each one,
+// which rewrites the data, FAT and directory blocks.
+static void logging_workload(const sflash_cache_ops_t *ops, uint32_t n_logical, uint32_t records) {
+    static uint8_t sector[SECTOR_SIZE];
+    sflash_cache_t cache;
+    assert(sflash_cache_init(&cache, ops, BS, SECTOR_SIZE, 4));
+    uint32_t spb = BS / SECTOR_SIZE;
+    uint32_t data_start = 4 * spb;
+    uint32_t cold_end = data_start + (n_logical - 4) * spb * 3 / 4;
+    memset(sector, 0x5a, sizeof(sector));
+    for (uint32_t s = data_start; s < cold_end; s++) {
+        assert(sflash_cache_write(&cache, 0, sector, s, 1) == 0);
+    }
+    assert(sflash_cache_flush(&cache) == 0);
+    uint32_t log_sectors = n_logical * spb - cold_end;
+    for (uint32_t i = 0; i < records; i++) {
+        sector[0] = i;
+        // 8 records per sector, and the log wraps around its area
+        assert(sflash_cache_write(&cache, 0, sector, cold_end + (i / 8) % log_sectors, 1) == 0);
+        assert(sflash_cache_write(&cache, 0, sector, 1, 1) == 0);        // FAT
+        assert(sflash_cache_write(&cache, 0, sector, 2 * spb, 1) == 0);  // directory
+        assert(sflash_cache_flush(&cache) == 0);
+    }
+    sflash_cache_deinit(&cache);
+}
+
+static void test_wear(void) {
+    const uint32_t records = 20000;
+
+    flash_sim_init(N_BLOCKS);
+    logging_workload(&direct_ops, N_BLOCKS, records);
+    uint32_t direct_max = flash_sim_max_erases();
+    printf("direct: max erases %u, total %u\n", direct_max, flash_sim.erases);
+    flash_sim_deinit();
+
+    flash_sim_init(N_BLOCKS);
+    assert(sflash_ftl_init(&wl_ftl, &ftl_ops, 0, BS, N_BLOCKS));
+    assert(sflash_ftl_format(&wl_ftl) == 0);
+    logging_workload(&ftl_cache_ops, wl_ftl.n_logical, records);
+    sflash_ftl_stats_t stats;
+    sflash_ftl_get_stats(&wl_ftl, &stats);
+    assert(stats.n_blocks == wl_ftl.n_data);
+    uint32_t counts[N_BLOCKS], total = 0;
+    memcpy(counts, stats.erase_counts, stats.n_blocks * sizeof(uint32_t));
+    for (uint32_t i = 0; i < stats.n_blocks; i++) {
+        assert(counts[i] >= stats.min_erases && counts[i] <= stats.max_erases);
+        total += counts[i];
+    }
+    assert(total == stats.total_erases);
+    uint32_t ftl_max = flash_sim_max_erases();
+    printf("ftl: data blocks min/max erases %u/%u, total %u; max erases including metadata %u\n",
+        stats.min_erases, stats.max_erases, stats.total_erases, ftl_max);
+    // the counts survive a remount
+    sflash_ftl_stats_t stats2;
+    sflash_ftl_deinit(&wl_ftl);
+    assert(sflash_ftl_init(&wl_ftl, &ftl_ops, 0, BS, N_BLOCKS));
+    assert(sflash_ftl_mount(&wl_ftl) == 0);
+    sflash_ftl_get_stats(&wl_ftl, &stats2);
+    assert(stats2.min_erases == stats.min_erases && stats2.max_erases == stats.max_erases);
+    assert(stats2.total_erases == stats.total_erases && stats2.n_blocks == stats.n_blocks);
+    assert(memcmp(counts, stats2.erase_counts, stats.n_blocks * sizeof(uint32_t)) == 0);
+    sflash_ftl_deinit(&wl_ftl);
+    flash_sim_deinit();
+
+    // the hottest block wears many times slower, and the cold data moved
+    assert(ftl_max * 10 < direct_max);
+    assert((stats.max_erases - stats.min_erases) * 10 < stats.max_erases);
+}
+
+int main(void) {
+    test_basic();
+    test_power_fail();
+    test_encrypted();
+    test_wear();
+    printf("OK\n");
+    return 0;
+}
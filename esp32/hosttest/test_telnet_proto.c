@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// The telnet protocol layer: the input parser on its own, and the output
+// queue on a loopback connection, written by the main thread as the
+// MicroPython task would and flushed by another in place of the servers
+// task.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "telnet_proto.h"
+
+#define FLUSH_CYCLE_US      (2000)
+
+/******************************************************************************
+ stubs
+ ******************************************************************************/
+static int interrupts;
+static int safe_boots;
+
+static void stub_interrupt(void) {
+    interrupts++;
+}
+
+static void stub_safe_boot(void) {
+    safe_boots++;
+}
+
+static int stub_interrupt_char(void) {
+    return 0x03;
+}
+
+static uint32_t stub_ticks_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void stub_wait(void) {
+    usleep(1000);
+}
+
+static const telnet_proto_ops_t stub_ops = {
+    .interrupt = stub_interrupt,
+    .safe_boot = stub_safe_boot,
+    .interrupt_char = stub_interrupt_char,
+    .ticks_ms = stub_ticks_ms,
+    .wait = stub_wait,
+};
+
+/******************************************************************************
+ loopback connection and sender
+ ******************************************************************************/
+static telnet_proto_t proto;
+static int server_sd;
+static int client_sd;
+static volatile bool sender_stop;
+static pthread_t sender_thread;
+
+static void *sender_main(void *arg) {
+    while (!sender_stop) {
+        assert(telnet_proto_flush(&proto, server_sd) == 0);
+        usleep(FLUSH_CYCLE_US);
+    }
+    return NULL;
+}
+
+// small socket buffers make a client that doesn't read stall quickly
+static void connection_open(uint8_t *buf, uint32_t size, int sock_buf) {
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(sa);
+    int one = 1;
+
+    int ld = socket(AF_INET, SOCK_STREAM, 0);
+    assert(ld >= 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(ld, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    assert(listen(ld, 1) == 0);
+    assert(getsockname(ld, (struct sockaddr *)&sa, &sa_len) == 0);
+
+    client_sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_buf > 0) {
+        setsockopt(client_sd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    }
+    assert(connect(client_sd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    server_sd = accept(ld, NULL, NULL);
+    assert(server_sd >= 0);
+    close(ld);
+    if (sock_buf > 0) {
+        setsockopt(server_sd, SOL_SOCKET, SO_SNDBUF, &sock_buf, sizeof(sock_buf));
+    }
+    fcntl(server_sd, F_SETFL, fcntl(server_sd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(server_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    telnet_proto_init(&proto, &stub_ops, buf, size);
+    telnet_proto_open(&proto);
+    sender_stop = false;
+    assert(pthread_create(&sender_thread, NULL, sender_main, NULL) == 0);
+}
+
+static void connection_close(void) {
+    sender_stop = true;
+    pthread_join(sender_thread, NULL);
+    telnet_proto_close(&proto);
+    close(server_sd);
+    close(client_sd);
+}
+
+static uint8_t pattern(uint32_t i) {
+    return (i * 7 + (i >> 8)) % 251;
+}
+
+/******************************************************************************
+ tests
+ ******************************************************************************/
+static int parse(uint8_t *buf, const char *in, int len, bool logged_in) {
+    memcpy(buf, in, len);
+    return telnet_proto_parse(&proto, buf, len, logged_in);
+}
+
+static void test_parse(void) {
+    static uint8_t txbuf[256];
+    uint8_t buf[64];
+    int n;
+
+    telnet_proto_init(&proto, &stub_ops, txbuf, sizeof(txbuf));
+    telnet_proto_open(&proto);
+
+    // plain text, with 8-bit and NUL chars dropped outside of binary mode
+    n = parse(buf, "ab\x80\x00" "c", 5, true);
+    assert(n == 3 && memcmp(buf, "abc", 3) == 0);
+
+    // Ctrl-C and Ctrl-F only once logged in
+    interrupts = safe_boots = 0;
+    n = parse(buf, "x\x03y", 3, false);
+    assert(n == 3 && interrupts == 0);
+    n = parse(buf, "x\x03y\x06", 4, true);
+    assert(n == 3 && memcmp(buf, "xy\x04", 3) == 0 && interrupts == 1 && safe_boots == 1);
+
+    // an escaped 0xFF, an AYT echoed back, options other than binary ignored
+    n = parse(buf, "a\xff\xff" "b\xff\xf6" "c\xff\xfb\x01" "d", 11, true);
+    assert(n == 5 && memcmp(buf, "a\xff" "bcd", 5) == 0);
+    assert(proto.ctrl_len == 2 && memcmp(proto.ctrl, "\xff\xf6", 2) == 0);
+    proto.ctrl_len = 0;
+
+    // binary mode asked for and granted, with the command split over three calls
+    n = parse(buf, "e\xff", 2, true);
+    assert(n == 1 && buf[0] == 'e');
+    n = parse(buf, "\xfb", 1, true);
+    assert(n == 0);
+    n = parse(buf, "\x00" "f\x80\x03", 4, true);
+    assert(n == 3 && memcmp(buf, "f\x80\x03", 3) == 0 && proto.binary_mode);
+    assert(proto.ctrl_len == 3 && memcmp(proto.ctrl, "\xff\xfd\x00", 3) == 0);
+    proto.ctrl_len = 0;
+    n = parse(buf, "\xff\xfc\x00", 3, true);
+    assert(n == 0 && !proto.binary_mode);
+    assert(proto.ctrl_len == 3 && memcmp(proto.ctrl, "\xff\xfe\x00", 3) == 0);
+    proto.ctrl_len = 0;
+
+    // a subnegotiation is skipped whole, even if it holds an IAC IAC
+    n = parse(buf, "g\xff\xfa\x18\xff\xff" "abc\xff\xf0" "h", 12, true);
+    assert(n == 2 && memcmp(buf, "gh", 2) == 0);
+
+    // a connection starts in the data state, out of binary mode
+    parse(buf, "\xff\xfb\x00\xff", 4, true);
+    telnet_proto_open(&proto);
+    assert(!proto.binary_mode && proto.ctrl_len == 0);
+    n = parse(buf, "\xfb", 1, true);
+    assert(n == 0);
+    n = parse(buf, "\xfbz", 2, true);
+    assert(n == 1 && buf[0] == 'z');
+}
+
+static void test_replies(void) {
+    static uint8_t txbuf[256];
+    uint8_t buf[16];
+
+    // flushed from here, as replies are queued by the task that sends them
+    connection_open(txbuf, sizeof(txbuf), 0);
+    sender_stop = true;
+    pthread_join(sender_thread, NULL);
+    telnet_proto_write(&proto, "out", 3);
+    parse(buf, "\xff\xfb\x00", 3, true);
+    // the reply goes ahead of the output queued before it, which is held
+    // back for a moment
+    assert(telnet_proto_flush(&proto, server_sd) == 0);
+    usleep((TELNET_PROTO_TX_DELAY_MS + 1) * 1000);
+    assert(telnet_proto_flush(&proto, server_sd) == 0);
+    assert(recv(client_sd, buf, 6, MSG_WAITALL) == 6);
+    assert(memcmp(buf, "\xff\xfd\x00" "out", 6) == 0);
+    telnet_proto_close(&proto);
+    close(server_sd);
+    close(client_sd);
+}
+
+typedef struct {
+    uint32_t total;
+    uint32_t received;
+    bool ok;
+} reader_t;
+
+static void *reader_main(void *arg) {
+    reader_t *r = arg;
+    uint8_t buf[1500];
+
+    r->ok = true;
+    while (r->received < r->total) {
+        int n = recv(client_sd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            r->ok &= buf[i] == pattern(r->received + i);
+        }
+        r->received += n;
+    }
+    return NULL;
+}
+
+// lots of short writes, as the REPL prints, go out in a few segments
+static void test_coalescing(void) {
+    static uint8_t txbuf[2048];
+    uint8_t data[64];
+    reader_t reader = { .total = 0 };
+    pthread_t reader_thread;
+    uint32_t writes = 0;
+    uint32_t sent = 0;
+
+    for (int i = 0; i < 4000; i++) {
+        reader.total += 1 + (i * 13) % 40;
+    }
+
+    connection_open(txbuf, sizeof(txbuf), 0);
+    assert(pthread_create(&reader_thread, NULL, reader_main, &reader) == 0);
+    uint32_t t = stub_ticks_ms();
+    for (int i = 0; i < 4000; i++) {
+        uint32_t n = 1 + (i * 13) % 40;
+        for (uint32_t j = 0; j < n; j++) {
+            data[j] = pattern(sent + j);
+        }
+        assert(telnet_proto_write(&proto, data, n) == n);
+        sent += n;
+        writes++;
+        if (i % 64 == 0) {
+            usleep(500);
+        }
+    }
+    pthread_join(reader_thread, NULL);
+    t = stub_ticks_ms() - t;
+    connection_close();
+    assert(reader.received == reader.total && reader.ok);
+    printf("  %u writes, %u bytes: %u sends, %u waits, %u ms\n",
+        writes, sent, proto.stats.sends, proto.stats.waits, t);
+    assert(proto.stats.sends * 10 < writes);
+    assert(proto.stats.dropped == 0);
+}
+
+// a client that doesn't read holds the writer up for a while, then the
+// output is dropped without waiting until it reads again
+static void test_backpressure(void) {
+    static uint8_t txbuf[1024];
+    uint8_t data[256];
+    uint8_t buf[4096];
+    uint32_t queued = 0;
+    uint32_t received = 0;
+    uint32_t n;
+
+    memset(data, 'x', sizeof(data));
+    connection_open(txbuf, sizeof(txbuf), 4096);
+    uint32_t t = stub_ticks_ms();
+    while ((n = telnet_proto_write(&proto, data, sizeof(data))) == sizeof(data)) {
+        queued += n;
+        assert(stub_ticks_ms() - t < 5000);
+    }
+    queued += n;
+    t = stub_ticks_ms() - t;
+    printf("  stalled after %u bytes, %u waits, %u ms\n", queued, proto.stats.waits, t);
+    assert(t >= TELNET_PROTO_TX_STALL_MS);
+    // not spinning: about one wait per millisecond
+    assert(proto.stats.waits > 0 && proto.stats.waits <= t + 1);
+
+    uint32_t waits = proto.stats.waits;
+    t = stub_ticks_ms();
+    assert(telnet_proto_write(&proto, data, sizeof(data)) == 0);
+    assert(stub_ticks_ms() - t < 20 && proto.stats.waits == waits);
+
+    // the client catches up, the output flows again
+    while (received < queued) {
+        int r = recv(client_sd, buf, sizeof(buf), 0);
+        assert(r > 0);
+        received += r;
+    }
+    assert(received == queued);
+    usleep(10 * FLUSH_CYCLE_US);
+    assert(telnet_proto_write(&proto, data, sizeof(data)) == sizeof(data));
+    assert(recv(client_sd, buf, sizeof(data), MSG_WAITALL) == sizeof(data));
+    connection_close();
+}
+
+static void *closer_main(void *arg) {
+    usleep(50000);
+    telnet_proto_close(&proto);
+    return NULL;
+}
+
+// a writer waiting for room returns when the client goes away
+static void test_close(void) {
+    static uint8_t txbuf[1024];
+    uint8_t data[256];
+    pthread_t closer_thread;
+
+    memset(data, 'y', sizeof(data));
+    connection_open(txbuf, sizeof(txbuf), 4096);
+    sender_stop = true;
+    pthread_join(sender_thread, NULL);
+    assert(pthread_create(&closer_thread, NULL, closer_main, NULL) == 0);
+    uint32_t t = stub_ticks_ms();
+    while (telnet_proto_write(&proto, data, sizeof(data)) == sizeof(data)) {
+    }
+    t = stub_ticks_ms() - t;
+    pthread_join(closer_thread, NULL);
+    assert(t < TELNET_PROTO_TX_STALL_MS);
+    assert(telnet_proto_write(&proto, data, sizeof(data)) == 0);
+    close(server_sd);
+    close(client_sd);
+}
+
+int main(void) {
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("parse\n");
+    test_parse();
+    printf("replies\n");
+    test_replies();
+    printf("coalescing\n");
+    test_coalescing();
+    printf("backpressure\n");
+    test_backpressure();
+    printf("close\n");
+    test_close();
+    printf("OK\n");
+    return 0;
+}
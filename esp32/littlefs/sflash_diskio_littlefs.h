@@ -4,6 +4,24 @@
 
 #include "lfs.h"
 
+// Read and program granularity: the SPI flash can read any byte and program
+// any byte once after an erase; 16 bytes keeps commits small while staying
+// aligned for encrypted flash writes.
+#define SFLASH_LITTLEFS_READ_SIZE       (16)
+#define SFLASH_LITTLEFS_PROG_SIZE       (16)
+// Files up to the smallest of this and block_size / 8 are stored inline in
+// their directory's metadata block, and are only read back if the cache can
+// hold them: volumes written with the 4 KB cache of older firmware have
+// inline files of up to 512 bytes, so this can't be any smaller.
+#define SFLASH_LITTLEFS_CACHE_SIZE      (512)
+// Erase cycles after which a metadata block is moved to another block, so
+// the superblock and directories don't wear out long before the data blocks;
+// 0 disables block-level wear levelling.  Can be changed at runtime with
+// uos.fsconfig(), it isn't stored on the flash.
+#ifndef SFLASH_LITTLEFS_BLOCK_CYCLES
+#define SFLASH_LITTLEFS_BLOCK_CYCLES    (500)
+#endif
+
 extern int littlefs_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
 extern int littlefs_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
 extern int littlefs_erase(const struct lfs_config *c, lfs_block_t block);
@@ -748,6 +748,39 @@ STATIC mp_obj_t littlefs_vfs_fsformat(mp_obj_t vfs_in)
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(littlefs_vfs_fsformat_obj, littlefs_vfs_fsformat);
 
+// Tunes the mounted file system; returns the current settings
+STATIC mp_obj_t littlefs_vfs_fsconfig(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+    enum { ARG_block_cycles };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_block_cycles, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_PTR(&mp_const_none_obj)} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    fs_user_mount_t *self = MP_OBJ_TO_PTR(pos_args[0]);
+
+    if (args[ARG_block_cycles].u_obj != mp_const_none) {
+        mp_int_t block_cycles = mp_obj_get_int(args[ARG_block_cycles].u_obj);
+        if (block_cycles < 0) {
+            mp_raise_ValueError("invalid block_cycles");
+        }
+        // block_cycles is only used when a metadata block is compacted, so it can change while mounted;
+        // lfs_t only keeps a const pointer to the config this volume was mounted with, which isn't const
+        xSemaphoreTake(self->fs.littlefs.mutex, portMAX_DELAY);
+            ((struct lfs_config *)self->fs.littlefs.lfs.cfg)->block_cycles = block_cycles;
+        xSemaphoreGive(self->fs.littlefs.mutex);
+    }
+
+    const struct lfs_config *cfg = self->fs.littlefs.lfs.cfg;
+    mp_obj_t dict = mp_obj_new_dict(4);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_block_cycles), mp_obj_new_int_from_uint(cfg->block_cycles));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_read_size), MP_OBJ_NEW_SMALL_INT(cfg->read_size));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_prog_size), MP_OBJ_NEW_SMALL_INT(cfg->prog_size));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cache_size), MP_OBJ_NEW_SMALL_INT(cfg->cache_size));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(littlefs_vfs_fsconfig_obj, 1, littlefs_vfs_fsconfig);
+
 STATIC const mp_rom_map_elem_t littlefs_vfs_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_open),        MP_ROM_PTR(&littlefs_vfs_open_obj) },
     { MP_ROM_QSTR(MP_QSTR_ilistdir),    MP_ROM_PTR(&littlefs_vfs_ilistdir_obj) },
@@ -761,7 +794,8 @@ STATIC const mp_rom_map_elem_t littlefs_vfs_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_statvfs),     MP_ROM_PTR(&littlefs_vfs_statvfs_obj) },
     { MP_ROM_QSTR(MP_QSTR_getfree),     MP_ROM_PTR(&littlefs_vfs_getfree_obj) },
     { MP_ROM_QSTR(MP_QSTR_umount),      MP_ROM_PTR(&littlefs_vfs_umount_obj) },
-    { MP_ROM_QSTR(MP_QSTR_fsformat),    MP_ROM_PTR(&littlefs_vfs_fsformat_obj) }
+    { MP_ROM_QSTR(MP_QSTR_fsformat),    MP_ROM_PTR(&littlefs_vfs_fsformat_obj) },
+    { MP_ROM_QSTR(MP_QSTR_fsconfig),    MP_ROM_PTR(&littlefs_vfs_fsconfig_obj) }
 
 };
 STATIC MP_DEFINE_CONST_DICT(littlefs_vfs_locals_dict, littlefs_vfs_locals_dict_table);
@@ -4,6 +4,7 @@
 #include "py/obj.h"
 #include "lib/oofatfs/ff.h" //Needed for FatFs types
 #include "lfs.h"
+#include "sflash_diskio_littlefs.h"
 
 #define LFS_ATTRIBUTE_TIMESTAMP     ((uint8_t)1)
 
@@ -13,6 +14,7 @@ typedef struct pycom_lfs_file_s {
     lfs_file_t fp;
     struct lfs_file_config cfg;  // Attributes of the file, e.g.: timestamp
     bool timestamp_update;  // For requesting timestamp update when closing the file
+    uint8_t cache[SFLASH_LITTLEFS_CACHE_SIZE];  // The file's own cache, used via cfg.buffer
 } pycom_lfs_file_t;
 
 typedef struct vfs_lfs_struct_s
@@ -50,6 +52,8 @@ extern lfs_timestamp_attribute_t littlefs_get_timestamp_fp(lfs_file_t* fp);
 
 
 extern const mp_obj_type_t mp_littlefs_vfs_type;
+extern const mp_obj_type_t mp_type_vfs_lfs_fileio;
+extern const mp_obj_type_t mp_type_vfs_lfs_textio;
 MP_DECLARE_CONST_FUN_OBJ_3(littlefs_vfs_open_obj);
 
 
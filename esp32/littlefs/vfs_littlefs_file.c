@@ -10,16 +10,13 @@
 #include "extmod/vfs.h"
 #include "vfs_littlefs.h"
 
-extern const mp_obj_type_t mp_type_vfs_lfs_fileio;
-extern const mp_obj_type_t mp_type_vfs_lfs_textio;
-
-
 typedef struct _pyb_file_obj_t {
     mp_obj_base_t base;
     lfs_file_t fp;
     vfs_lfs_struct_t* littlefs;
     struct lfs_file_config cfg;  // Attributes of the file, e.g.: timestamp
     bool timestamp_update;  // For requesting timestamp update when closing the file
+    uint8_t cache[SFLASH_LITTLEFS_CACHE_SIZE];  // The file's own cache, so open files don't need heap allocations from littlefs
 } pyb_file_obj_t;
 
 STATIC void file_obj_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
@@ -165,6 +162,7 @@ STATIC mp_obj_t file_open(fs_user_mount_t *vfs, const mp_obj_type_t *type, mp_ar
     pyb_file_obj_t *o = m_new_obj_with_finaliser(pyb_file_obj_t);
     o->base.type = type;
     o->timestamp_update = false;
+    o->cfg.buffer = o->cache;
 
     xSemaphoreTake(vfs->fs.littlefs.mutex, portMAX_DELAY);
         const char *fname = concat_with_cwd(&vfs->fs.littlefs, mp_obj_str_get_str(args[0].u_obj));
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hwcrypto/aes.h"
+
+#include "lora_aes_hw.h"
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static void lora_aes_hw_encrypt(const lora_aes_key_t *k, const uint8_t *in, uint8_t *out);
+
+/******************************************************************************
+ DECLARE PUBLIC DATA
+ ******************************************************************************/
+// the peripheral is given the key with each block, there's no schedule
+const lora_aes_backend_t lora_aes_hw = {
+    .set_key = NULL,
+    .encrypt = lora_aes_hw_encrypt,
+};
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+// the driver loads words from the buffers, it's given aligned copies
+static void lora_aes_hw_encrypt(const lora_aes_key_t *k, const uint8_t *in, uint8_t *out) {
+    esp_aes_context ctx;
+    uint32_t block_in[4], block_out[4];
+
+    esp_aes_init(&ctx);
+    esp_aes_setkey(&ctx, k->key, LORA_AES_KEY_SIZE * 8);
+    memcpy(block_in, in, sizeof(block_in));
+    esp_aes_crypt_ecb(&ctx, ESP_AES_ENCRYPT, (const unsigned char *)block_in, (unsigned char *)block_out);
+    memcpy(out, block_out, sizeof(block_out));
+    esp_aes_free(&ctx);
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_AES_HW_H_
+#define LORA_AES_HW_H_
+
+#include "lora/system/crypto/lora_aes.h"
+
+// The AES peripheral of the ESP32 as the backend of lora_aes.  It's shared
+// with mbedTLS and ucrypto, each block takes and releases it, so it's only
+// used from tasks; in the radio interrupt lora_aes uses its tables.
+extern const lora_aes_backend_t lora_aes_hw;
+
+#endif /* LORA_AES_HW_H_ */
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lora_aggr.h"
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t lora_aggr_max_payload(lora_aggr_t *a, uint8_t dr);
+static void lora_aggr_close(lora_aggr_t *a, lora_tx_msg_t *out);
+static uint32_t lora_aggr_encode(const lora_aggr_t *a, const uint8_t *rec, uint32_t len, uint8_t width, bool delta, uint8_t *dst);
+static int32_t lora_aggr_get(const uint8_t *buf, uint32_t i, uint8_t width);
+static void lora_aggr_set(uint8_t *buf, uint32_t i, uint8_t width, uint32_t value);
+static uint32_t lora_aggr_varint(uint8_t *dst, uint32_t value);
+static bool lora_aggr_read_varint(lora_aggr_reader_t *r, uint32_t *value);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_aggr_init(lora_aggr_t *a, const lora_tx_sched_ops_t *ops, void *ctx, uint32_t hold) {
+    memset(a, 0, sizeof(*a));
+    a->ops = ops;
+    a->ctx = ctx;
+    a->hold = hold;
+}
+
+void lora_aggr_set_hold(lora_aggr_t *a, uint32_t hold) {
+    // an open frame keeps the time it was given
+    a->hold = hold;
+}
+
+lora_aggr_result_t lora_aggr_put(lora_aggr_t *a, const lora_tx_msg_t *msg, uint8_t width, uint32_t now, lora_tx_msg_t *out) {
+    lora_aggr_result_t result = E_LORA_AGGR_ADDED;
+    uint32_t max = lora_aggr_max_payload(a, msg->dr);
+    uint32_t size;
+    bool delta = false;
+
+    if (msg->len == 0 || (width != 0 && width != 1 && width != 2 && width != 4) || (width && (msg->len % width))) {
+        return E_LORA_AGGR_INVALID;
+    }
+    // in a frame of its own
+    if (1 + lora_aggr_encode(a, msg->data, msg->len, width, false, NULL) > max) {
+        return E_LORA_AGGR_INVALID;
+    }
+
+    if (a->frame.len > 0 && (a->frame.port != msg->port || a->frame.dr != msg->dr ||
+        a->frame.confirmed != msg->confirmed || a->width != width || a->frame.has_deadline != msg->has_deadline)) {
+        lora_aggr_close(a, out);
+        result = E_LORA_AGGR_CLOSED;
+    }
+    if (a->frame.len > 0) {
+        size = lora_aggr_encode(a, msg->data, msg->len, width, false, NULL);
+        if (width && a->prev_len == msg->len) {
+            uint32_t delta_size = lora_aggr_encode(a, msg->data, msg->len, width, true, NULL);
+            if (delta_size < size) {
+                size = delta_size;
+                delta = true;
+            }
+        }
+        if (a->frame.len + size > max) {
+            lora_aggr_close(a, out);
+            result = E_LORA_AGGR_CLOSED;
+        }
+    }
+    if (a->frame.len == 0) {
+        memset(&a->frame, 0, sizeof(a->frame) - sizeof(a->frame.data));
+        a->frame.port = msg->port;
+        a->frame.dr = msg->dr;
+        a->frame.confirmed = msg->confirmed;
+        a->frame.priority = msg->priority;
+        a->frame.data[0] = width;
+        a->frame.len = 1;
+        a->width = width;
+        a->due_at = now + a->hold;
+        a->records = 0;
+        a->bytes_in = 0;
+        a->air_alone = 0;
+        size = lora_aggr_encode(a, msg->data, msg->len, width, false, NULL);
+        delta = false;
+    }
+
+    lora_aggr_encode(a, msg->data, msg->len, width, delta, &a->frame.data[a->frame.len]);
+    a->frame.len += size;
+    // the frame goes with the most urgent of its records
+    if (msg->priority > a->frame.priority) {
+        a->frame.priority = msg->priority;
+    }
+    if (msg->has_deadline && (!a->frame.has_deadline || (int32_t)(msg->deadline - a->frame.deadline) < 0)) {
+        a->frame.has_deadline = true;
+        a->frame.deadline = msg->deadline;
+    }
+    memcpy(a->prev, msg->data, msg->len);
+    a->prev_len = msg->len;
+    a->records++;
+    a->bytes_in += msg->len;
+    a->air_alone += a->ops->time_on_air(a->ctx, msg->dr, msg->len);
+    return result;
+}
+
+bool lora_aggr_due(lora_aggr_t *a, uint32_t now, uint32_t lead, lora_tx_msg_t *out, uint32_t *wait) {
+    uint32_t due_at = a->due_at;
+
+    if (a->frame.len == 0) {
+        *wait = LORA_TX_SCHED_NEVER;
+        return false;
+    }
+    if (a->frame.has_deadline) {
+        // out of the queue and on air by the earliest deadline
+        uint32_t latest = a->frame.deadline - lead - a->ops->time_on_air(a->ctx, a->frame.dr, a->frame.len);
+        if ((int32_t)(latest - due_at) < 0) {
+            due_at = latest;
+        }
+    }
+    if (a->frame.len + LORA_AGGR_RECORD_MIN > lora_aggr_max_payload(a, a->frame.dr) ||
+        (int32_t)(now - due_at) >= 0) {
+        lora_aggr_close(a, out);
+        return true;
+    }
+    *wait = due_at - now;
+    return false;
+}
+
+bool lora_aggr_flush(lora_aggr_t *a, lora_tx_msg_t *out) {
+    if (a->frame.len == 0) {
+        return false;
+    }
+    lora_aggr_close(a, out);
+    return true;
+}
+
+void lora_aggr_drop(lora_aggr_t *a) {
+    a->frame.len = 0;
+    a->prev_len = 0;
+}
+
+bool lora_aggr_reader_init(lora_aggr_reader_t *r, const uint8_t *frame, uint32_t len) {
+    if (len < 1 || (frame[0] != 0 && frame[0] != 1 && frame[0] != 2 && frame[0] != 4)) {
+        return false;
+    }
+    r->frame = frame;
+    r->len = len;
+    r->pos = 1;
+    r->width = frame[0];
+    r->prev_len = 0;
+    return true;
+}
+
+int32_t lora_aggr_read(lora_aggr_reader_t *r, uint8_t *buf) {
+    uint32_t header, n, len;
+    bool delta;
+
+    if (r->pos == r->len) {
+        return 0;
+    }
+    if (!lora_aggr_read_varint(r, &header)) {
+        return -1;
+    }
+    n = header >> 1;
+    delta = header & 1;
+    len = (r->width) ? n * r->width : n;
+    if (n == 0 || len > LORA_TX_SCHED_PAYLOAD_MAX) {
+        return -1;
+    }
+
+    if (r->width == 0) {
+        if (delta || r->len - r->pos < len) {
+            return -1;
+        }
+        memcpy(buf, &r->frame[r->pos], len);
+        r->pos += len;
+    } else {
+        if (delta && r->prev_len != len) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t value;
+            if (!lora_aggr_read_varint(r, &value)) {
+                return -1;
+            }
+            value = (value >> 1) ^ -(value & 1);
+            if (delta) {
+                value += lora_aggr_get(r->prev, i, r->width);
+            }
+            lora_aggr_set(buf, i, r->width, value);
+        }
+    }
+    memcpy(r->prev, buf, len);
+    r->prev_len = len;
+    return len;
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t lora_aggr_max_payload(lora_aggr_t *a, uint8_t dr) {
+    uint32_t max = a->ops->max_payload(a->ctx, dr);
+    return (max < LORA_TX_SCHED_PAYLOAD_MAX) ? max : LORA_TX_SCHED_PAYLOAD_MAX;
+}
+
+static void lora_aggr_close(lora_aggr_t *a, lora_tx_msg_t *out) {
+    memcpy(out, &a->frame, sizeof(*out));
+    a->stats.frames++;
+    a->stats.records += a->records;
+    a->stats.bytes_in += a->bytes_in;
+    a->stats.bytes_out += a->frame.len;
+    a->stats.air_alone += a->air_alone;
+    a->stats.air_sent += a->ops->time_on_air(a->ctx, a->frame.dr, a->frame.len);
+    a->frame.len = 0;
+    a->prev_len = 0;
+}
+
+// the size of the record, dst may be NULL
+static uint32_t lora_aggr_encode(const lora_aggr_t *a, const uint8_t *rec, uint32_t len, uint8_t width, bool delta, uint8_t *dst) {
+    uint32_t n = (width) ? len / width : len;
+    uint32_t size = lora_aggr_varint(dst, (n << 1) | delta);
+
+    if (width == 0) {
+        if (dst) {
+            memcpy(dst + size, rec, len);
+        }
+        return size + len;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        int32_t value = lora_aggr_get(rec, i, width);
+        if (delta) {
+            // modulo 2^32, as it's read back
+            value = (int32_t)((uint32_t)value - (uint32_t)lora_aggr_get(a->prev, i, width));
+        }
+        size += lora_aggr_varint(dst ? dst + size : NULL, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+    }
+    return size;
+}
+
+// field i, sign extended
+static int32_t lora_aggr_get(const uint8_t *buf, uint32_t i, uint8_t width) {
+    const uint8_t *p = &buf[i * width];
+
+    switch (width) {
+    case 1:
+        return (int8_t)p[0];
+    case 2:
+        return (int16_t)(p[0] | (p[1] << 8));
+    default:
+        return (int32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+    }
+}
+
+static void lora_aggr_set(uint8_t *buf, uint32_t i, uint8_t width, uint32_t value) {
+    for (uint32_t j = 0; j < width; j++) {
+        buf[i * width + j] = value >> (8 * j);
+    }
+}
+
+static uint32_t lora_aggr_varint(uint8_t *dst, uint32_t value) {
+    uint32_t size = 0;
+
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (dst) {
+            dst[size] = byte | (value ? 0x80 : 0);
+        }
+        size++;
+    } while (value);
+    return size;
+}
+
+static bool lora_aggr_read_varint(lora_aggr_reader_t *r, uint32_t *value) {
+    *value = 0;
+    for (uint32_t shift = 0; shift < 35; shift += 7) {
+        if (r->pos == r->len) {
+            return false;
+        }
+        uint8_t byte = r->frame[r->pos++];
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
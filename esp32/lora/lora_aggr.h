@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_AGGR_H_
+#define LORA_AGGR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lora_tx_sched.h"
+
+// Packs the records of the application in LoRaWAN frames, with no
+// dependency on the IDF, so that many small readings share the header and
+// the MIC of one uplink.  The frame being filled goes to the uplink queue
+// when the next record doesn't fit the data rate's payload, when it's been
+// open for the hold time, early enough for the queue's wait and its air
+// time to end before the earliest deadline of its records, or when it's
+// flushed.  A record for another port, data rate, confirmation or width
+// closes it too, as does one with a deadline in a frame without and the
+// other way round: the queue drops a frame whose deadline passed, with
+// all its records.
+//
+// The frame is a byte with the width of the records, then the records,
+// each a varint header (n << 1 | delta) and its n fields:
+//  - width 0: n bytes, as they were given
+//  - width 1, 2 or 4: n zigzag varints, the record is n little endian
+//    signed integers of that size; with delta, they're the differences with
+//    the fields of the record before, which had n fields too, otherwise the
+//    values themselves.  Delta is used when it's shorter.
+//
+// The caller keeps the calls from running concurrently.
+
+// a record whose fields are all 0 takes 2 bytes, with less left the frame goes
+#define LORA_AGGR_RECORD_MIN            (2)
+
+typedef enum {
+    E_LORA_AGGR_INVALID = 0,            // too big for a frame, or not a whole number of fields
+    E_LORA_AGGR_ADDED,
+    E_LORA_AGGR_CLOSED,                 // added to a new frame, *out is the one it didn't fit in
+} lora_aggr_result_t;
+
+typedef struct _lora_aggr_stats_t {
+    uint32_t records;
+    uint32_t frames;
+    uint32_t bytes_in;                  // of the records
+    uint32_t bytes_out;                 // of the frames
+    uint32_t air_alone;                 // ms the records would have been on air, a frame each
+    uint32_t air_sent;                  // ms the frames were
+} lora_aggr_stats_t;
+
+typedef struct _lora_aggr_t {
+    const lora_tx_sched_ops_t *ops;     // time_on_air and max_payload only
+    void *ctx;
+    uint32_t hold;                      // ms a frame stays open
+    lora_tx_msg_t frame;                // len is 0 when there's none open
+    uint32_t due_at;                    // for the hold time
+    uint8_t width;
+    uint8_t prev[LORA_TX_SCHED_PAYLOAD_MAX];    // the last record of the frame
+    uint32_t prev_len;
+    uint32_t records;                   // in the frame
+    uint32_t bytes_in;
+    uint32_t air_alone;
+    lora_aggr_stats_t stats;
+} lora_aggr_t;
+
+// Reads the records of a frame back.
+typedef struct _lora_aggr_reader_t {
+    const uint8_t *frame;
+    uint32_t len;
+    uint32_t pos;
+    uint8_t width;
+    uint8_t prev[LORA_TX_SCHED_PAYLOAD_MAX];
+    uint32_t prev_len;
+} lora_aggr_reader_t;
+
+void lora_aggr_init(lora_aggr_t *a, const lora_tx_sched_ops_t *ops, void *ctx, uint32_t hold);
+
+void lora_aggr_set_hold(lora_aggr_t *a, uint32_t hold);
+
+// Adds the record in msg, which also tells how and where it goes, its
+// fields width bytes each.
+lora_aggr_result_t lora_aggr_put(lora_aggr_t *a, const lora_tx_msg_t *msg, uint8_t width, uint32_t now, lora_tx_msg_t *out);
+
+// Takes the open frame if it's full or its time came, lead being the ms
+// the uplink queue would keep it (see lora_tx_sched_eta_msg()).  Otherwise
+// *wait is set to when to ask again, LORA_TX_SCHED_NEVER if there's none
+// open.
+bool lora_aggr_due(lora_aggr_t *a, uint32_t now, uint32_t lead, lora_tx_msg_t *out, uint32_t *wait);
+
+// Takes the open frame, false if there's none.
+bool lora_aggr_flush(lora_aggr_t *a, lora_tx_msg_t *out);
+
+// Drops the open frame.
+void lora_aggr_drop(lora_aggr_t *a);
+
+bool lora_aggr_reader_init(lora_aggr_reader_t *r, const uint8_t *frame, uint32_t len);
+
+// Copies the next record to buf, which takes LORA_TX_SCHED_PAYLOAD_MAX
+// bytes.  Returns its length, 0 at the end of the frame, -1 if it's
+// malformed.
+int32_t lora_aggr_read(lora_aggr_reader_t *r, uint8_t *buf);
+
+#endif /* LORA_AGGR_H_ */
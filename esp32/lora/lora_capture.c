@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#include "lora_capture.h"
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t lora_capture_load(volatile uint32_t *v);
+static void lora_capture_store(volatile uint32_t *v, uint32_t value);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_capture_init(lora_capture_t *c, lora_capture_rec_t *recs, uint32_t size) {
+    memset(c, 0, sizeof(*c));
+    c->recs = recs;
+    c->size = size;
+}
+
+// kept in IRAM, it runs in the radio interrupt
+IRAM_ATTR bool lora_capture_put(lora_capture_t *c, const lora_capture_rec_t *rec) {
+    uint32_t head = c->head;
+    uint32_t tail = lora_capture_load(&c->tail);
+
+    if (head - tail == c->size) {
+        c->pending_drops++;
+        c->stats.dropped++;
+        return false;
+    }
+
+    lora_capture_rec_t *dst = &c->recs[head & (c->size - 1)];
+    memcpy(dst, rec, sizeof(*dst));
+    dst->dropped = (c->pending_drops > 0xFF) ? 0xFF : c->pending_drops;
+    c->pending_drops = 0;
+    lora_capture_store(&c->head, head + 1);
+
+    c->stats.captured++;
+    if (head + 1 - tail > c->stats.high_water) {
+        c->stats.high_water = head + 1 - tail;
+    }
+    return true;
+}
+
+IRAM_ATTR void lora_capture_error(lora_capture_t *c) {
+    c->stats.errors++;
+}
+
+uint32_t lora_capture_count(lora_capture_t *c) {
+    return lora_capture_load(&c->head) - c->tail;
+}
+
+uint32_t lora_capture_read(lora_capture_t *c, void *buf, uint32_t max) {
+    uint32_t tail = c->tail;
+    uint32_t n = lora_capture_load(&c->head) - tail;
+    uint32_t off = tail & (c->size - 1);
+    uint32_t first;
+
+    if (n > max) {
+        n = max;
+    }
+    first = (c->size - off < n) ? c->size - off : n;
+    memcpy(buf, &c->recs[off], first * sizeof(lora_capture_rec_t));
+    memcpy((uint8_t *)buf + first * sizeof(lora_capture_rec_t), c->recs, (n - first) * sizeof(lora_capture_rec_t));
+    // their room goes back to the writer
+    lora_capture_store(&c->tail, tail + n);
+    return n;
+}
+
+void lora_capture_clear(lora_capture_t *c) {
+    lora_capture_store(&c->tail, lora_capture_load(&c->head));
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+// The head and tail are shared between the writer and the reader: the
+// record must be visible before the index that hands it over.
+static IRAM_ATTR uint32_t lora_capture_load(volatile uint32_t *v) {
+    return __atomic_load_n(v, __ATOMIC_ACQUIRE);
+}
+
+static IRAM_ATTR void lora_capture_store(volatile uint32_t *v, uint32_t value) {
+    __atomic_store_n(v, value, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_CAPTURE_H_
+#define LORA_CAPTURE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The capture of the frames received in raw LoRa mode, with no dependency
+// on the IDF: a ring of fixed size records, one per frame, with what the
+// radio measured.  The records are read in bulk, as they're laid out in
+// memory, so a reader gets thousands of them with a copy.  When the ring is
+// full the new records are dropped, the next one kept says how many.
+//
+// There is one writer and one reader at a time: the radio interrupt writes,
+// MicroPython reads.
+
+// 16 bytes, little endian: "<IIhbBHBx" for ustruct
+typedef struct _lora_capture_rec_t {
+    uint32_t timestamp;                 // us, when the radio raised RxDone
+    uint32_t frequency;                 // Hz
+    int16_t rssi;                       // dBm
+    int8_t snr;                         // dB
+    uint8_t sf;
+    uint16_t len;                       // of the payload
+    uint8_t dropped;                    // records dropped just before this one, 255 for more
+    uint8_t rfu;
+} lora_capture_rec_t;
+
+typedef struct _lora_capture_stats_t {
+    uint32_t captured;                  // records written
+    uint32_t dropped;                   // records dropped, the ring being full
+    uint32_t errors;                    // frames received with a wrong CRC
+    uint32_t high_water;                // the most records the ring ever held
+} lora_capture_stats_t;
+
+typedef struct _lora_capture_t {
+    lora_capture_rec_t *recs;
+    uint32_t size;                      // a power of 2
+    // free running; the head is moved by the writer, the tail by the reader
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t pending_drops;             // for the next record
+    lora_capture_stats_t stats;
+} lora_capture_t;
+
+// recs holds size records, a power of 2
+void lora_capture_init(lora_capture_t *c, lora_capture_rec_t *recs, uint32_t size);
+
+// For the writer: returns false if the record was dropped.
+bool lora_capture_put(lora_capture_t *c, const lora_capture_rec_t *rec);
+
+// For the writer: a frame whose CRC was wrong.
+void lora_capture_error(lora_capture_t *c);
+
+// For the reader: the records pending.
+uint32_t lora_capture_count(lora_capture_t *c);
+
+// For the reader: copies up to max records to buf, which needs no
+// alignment, oldest first.  Returns how many.
+uint32_t lora_capture_read(lora_capture_t *c, void *buf, uint32_t max);
+
+// For the reader: drops the records pending.
+void lora_capture_clear(lora_capture_t *c);
+
+#endif /* LORA_CAPTURE_H_ */
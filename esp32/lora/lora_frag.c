@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lora_frag.h"
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static bool bit_get(const uint8_t *bits, uint32_t i);
+static void bit_set(uint8_t *bits, uint32_t i);
+static void xor_into(uint8_t *dest, const uint8_t *src, uint32_t len);
+static uint32_t prbs23(uint32_t x);
+static bool lora_frag_freeze_lost(lora_frag_t *f);
+static int32_t lora_frag_lost_index(lora_frag_t *f, uint32_t frag);
+static lora_frag_result_t lora_frag_equation(lora_frag_t *f, uint8_t *row);
+static lora_frag_result_t lora_frag_solve(lora_frag_t *f);
+static uint32_t lora_frag_scratch(lora_frag_t *f, uint32_t row);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+bool lora_frag_init(lora_frag_t *f, const lora_frag_ops_t *ops, void *ctx, uint32_t nb_frag, uint32_t frag_size, uint32_t max_lost) {
+    memset(f, 0, sizeof(*f));
+    if (nb_frag == 0 || nb_frag > LORA_FRAG_MAX_FRAGS || frag_size == 0 || frag_size > LORA_FRAG_MAX_SIZE) {
+        return false;
+    }
+    f->ops = ops;
+    f->ctx = ctx;
+    f->nb_frag = nb_frag;
+    f->frag_size = frag_size;
+    f->max_lost = (max_lost < LORA_FRAG_MAX_LOST) ? max_lost : LORA_FRAG_MAX_LOST;
+    return true;
+}
+
+lora_frag_result_t lora_frag_process(lora_frag_t *f, uint32_t n, const uint8_t *data, uint32_t len) {
+    if (n == 0 || len != f->frag_size) {
+        return lora_frag_done(f) ? E_LORA_FRAG_DONE : E_LORA_FRAG_ONGOING;
+    }
+    f->stats.frames++;
+    if (lora_frag_done(f)) {
+        f->stats.duplicates++;
+        return E_LORA_FRAG_DONE;
+    }
+
+    uint8_t row[LORA_FRAG_MAX_LOST / 8];
+    memcpy(f->data, data, len);
+
+    if (n <= f->nb_frag) {
+        uint32_t frag = n - 1;
+        if (bit_get(f->have, frag)) {
+            f->stats.duplicates++;
+            return E_LORA_FRAG_ONGOING;
+        }
+        if (!f->lost_known) {
+            // the usual case: it goes straight to its place
+            if (!f->ops->write(f->ctx, frag * f->frag_size, f->data, len)) {
+                return E_LORA_FRAG_ERROR;
+            }
+            bit_set(f->have, frag);
+            f->nb_have++;
+            return lora_frag_done(f) ? E_LORA_FRAG_DONE : E_LORA_FRAG_ONGOING;
+        }
+        // one of the lost ones, late: an equation over it alone, as its
+        // place may already be in others
+        memset(row, 0, sizeof(row));
+        bit_set(row, lora_frag_lost_index(f, frag));
+        return lora_frag_equation(f, row);
+    }
+
+    f->stats.coded++;
+    if (!f->lost_known && !lora_frag_freeze_lost(f)) {
+        return E_LORA_FRAG_ONGOING;
+    }
+
+    // take the fragments received out of it, what's left is over the lost ones
+    lora_frag_parity_row(n - f->nb_frag, f->nb_frag, f->parity);
+    for (uint32_t i = 0; i < f->nb_frag; i++) {
+        if (bit_get(f->parity, i) && bit_get(f->have, i)) {
+            if (!f->ops->read(f->ctx, i * f->frag_size, f->other, f->frag_size)) {
+                return E_LORA_FRAG_ERROR;
+            }
+            xor_into(f->data, f->other, f->frag_size);
+        }
+    }
+    memset(row, 0, sizeof(row));
+    for (uint32_t k = 0; k < f->nb_lost; k++) {
+        if (bit_get(f->parity, f->lost[k])) {
+            bit_set(row, k);
+        }
+    }
+    return lora_frag_equation(f, row);
+}
+
+uint32_t lora_frag_missing(lora_frag_t *f) {
+    if (lora_frag_done(f)) {
+        return 0;
+    }
+    if (!f->lost_known) {
+        return f->nb_frag - f->nb_have;
+    }
+    return f->nb_lost - f->nb_rows;
+}
+
+bool lora_frag_done(lora_frag_t *f) {
+    return f->nb_frag > 0 && f->nb_have == f->nb_frag;
+}
+
+// TS004 section 2.1 (the matrix of the FEC)
+void lora_frag_parity_row(uint32_t n, uint32_t m, uint8_t *row) {
+    // with m a power of 2 the modulo would pick the same few bits
+    uint32_t m_temp = ((m & (m - 1)) == 0) ? 1 : 0;
+    uint32_t x = 1 + 1001 * n;
+
+    memset(row, 0, (m + 7) / 8);
+    for (uint32_t nb_coeff = 0; nb_coeff < m / 2; nb_coeff++) {
+        uint32_t r = 1 << 16;
+        while (r >= m) {
+            x = prbs23(x);
+            r = x % (m + m_temp);
+        }
+        bit_set(row, r);
+    }
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static bool bit_get(const uint8_t *bits, uint32_t i) {
+    return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+static void bit_set(uint8_t *bits, uint32_t i) {
+    bits[i / 8] |= 1 << (i % 8);
+}
+
+static void xor_into(uint8_t *dest, const uint8_t *src, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        dest[i] ^= src[i];
+    }
+}
+
+static uint32_t prbs23(uint32_t x) {
+    uint32_t b0 = x & 1;
+    uint32_t b1 = (x & 0x20) >> 5;
+    return (x >> 1) + ((b0 ^ b1) << 22);
+}
+
+// The fragments not received by the first coded one are the unknowns of the
+// equations.  If there are more than can be rebuilt, the next coded one tries
+// again, some may have come late.
+static bool lora_frag_freeze_lost(lora_frag_t *f) {
+    uint32_t nb_lost = f->nb_frag - f->nb_have;
+    if (nb_lost > f->max_lost) {
+        f->too_many_lost = true;
+        return false;
+    }
+    f->too_many_lost = false;
+    f->nb_lost = 0;
+    for (uint32_t i = 0; i < f->nb_frag; i++) {
+        if (!bit_get(f->have, i)) {
+            f->lost[f->nb_lost++] = i;
+        }
+    }
+    f->lost_known = true;
+    return true;
+}
+
+static int32_t lora_frag_lost_index(lora_frag_t *f, uint32_t frag) {
+    for (uint32_t k = 0; k < f->nb_lost; k++) {
+        if (f->lost[k] == frag) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+// A new equation, row over the lost fragments and its value in f->data.  It's
+// reduced by those kept, in the order they were, each of which is zero on the
+// columns of those before it: once past one it stays zero on its column.
+static lora_frag_result_t lora_frag_equation(lora_frag_t *f, uint8_t *row) {
+    uint32_t row_bytes = (f->nb_lost + 7) / 8;
+
+    for (uint32_t i = 0; i < f->nb_rows; i++) {
+        if (bit_get(row, f->pivot[i])) {
+            xor_into(row, f->rows[i], row_bytes);
+            if (!f->ops->read(f->ctx, lora_frag_scratch(f, i), f->other, f->frag_size)) {
+                return E_LORA_FRAG_ERROR;
+            }
+            xor_into(f->data, f->other, f->frag_size);
+        }
+    }
+
+    int32_t pivot = -1;
+    for (uint32_t k = 0; k < f->nb_lost; k++) {
+        if (bit_get(row, k)) {
+            pivot = k;
+            break;
+        }
+    }
+    if (pivot < 0) {
+        f->stats.useless++;
+        return E_LORA_FRAG_ONGOING;
+    }
+
+    if (!f->ops->write(f->ctx, lora_frag_scratch(f, f->nb_rows), f->data, f->frag_size)) {
+        return E_LORA_FRAG_ERROR;
+    }
+    memcpy(f->rows[f->nb_rows], row, row_bytes);
+    f->pivot[f->nb_rows] = pivot;
+    f->nb_rows++;
+
+    if (f->nb_rows < f->nb_lost) {
+        return E_LORA_FRAG_ONGOING;
+    }
+    return lora_frag_solve(f);
+}
+
+// As many equations as lost fragments: the last one kept is on its column
+// alone, and each before it only on its column and those of the ones after
+// it, already solved.  Each lost fragment is written once, to its place.
+static lora_frag_result_t lora_frag_solve(lora_frag_t *f) {
+    for (int32_t i = f->nb_rows - 1; i >= 0; i--) {
+        if (!f->ops->read(f->ctx, lora_frag_scratch(f, i), f->data, f->frag_size)) {
+            return E_LORA_FRAG_ERROR;
+        }
+        for (uint32_t k = 0; k < f->nb_lost; k++) {
+            if (k != f->pivot[i] && bit_get(f->rows[i], k)) {
+                if (!f->ops->read(f->ctx, f->lost[k] * f->frag_size, f->other, f->frag_size)) {
+                    return E_LORA_FRAG_ERROR;
+                }
+                xor_into(f->data, f->other, f->frag_size);
+            }
+        }
+        if (!f->ops->write(f->ctx, f->lost[f->pivot[i]] * f->frag_size, f->data, f->frag_size)) {
+            return E_LORA_FRAG_ERROR;
+        }
+        f->stats.rebuilt++;
+    }
+    f->nb_have = f->nb_frag;
+    return E_LORA_FRAG_DONE;
+}
+
+static uint32_t lora_frag_scratch(lora_frag_t *f, uint32_t row) {
+    return (f->nb_frag + row) * f->frag_size;
+}
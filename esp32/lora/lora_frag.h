@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_FRAG_H_
+#define LORA_FRAG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The decoder of a fragmented data block (LoRa Alliance TS004, Fragmented
+// Data Block Transport), with no dependency on the IDF.  A block of nb_frag
+// fragments is sent as the fragments themselves followed by coded ones,
+// each the XOR of about half of them picked by the parity matrix of the
+// spec.  Any set of enough fragments rebuilds the block, whichever were
+// lost.
+//
+// The fragments are written straight to their place in the storage, and
+// each place is written once, so it can be erased flash such as an OTA
+// partition.  The coded fragments, reduced against the ones received and
+// the ones kept before, are written to a scratch area after the block, at
+// most max_lost of them.  Only the equations over the missing fragments
+// are kept in RAM, so a decoder takes a few KB whatever the block's size.
+
+#ifndef LORA_FRAG_MAX_FRAGS
+#define LORA_FRAG_MAX_FRAGS             (8192)
+#endif
+
+// the most fragments that can be lost and rebuilt
+#ifndef LORA_FRAG_MAX_LOST
+#define LORA_FRAG_MAX_LOST              (128)
+#endif
+
+#define LORA_FRAG_MAX_SIZE              (255)
+
+typedef enum {
+    E_LORA_FRAG_ONGOING = 0,
+    E_LORA_FRAG_DONE,                   // the whole block is in the storage
+    E_LORA_FRAG_ERROR,                  // the storage failed
+} lora_frag_result_t;
+
+typedef struct _lora_frag_ops_t {
+    // the block is at offset 0 in the storage, the scratch area right
+    // after it; every place is written once
+    bool (*write)(void *ctx, uint32_t offset, const uint8_t *buf, uint32_t len);
+    bool (*read)(void *ctx, uint32_t offset, uint8_t *buf, uint32_t len);
+} lora_frag_ops_t;
+
+typedef struct _lora_frag_stats_t {
+    uint32_t frames;                    // fragments given, coded or not
+    uint32_t coded;
+    uint32_t duplicates;                // fragments given again, or once the block was done
+    uint32_t useless;                   // coded fragments that brought nothing new
+    uint32_t rebuilt;                   // lost fragments rebuilt
+} lora_frag_stats_t;
+
+typedef struct _lora_frag_t {
+    const lora_frag_ops_t *ops;
+    void *ctx;
+    uint16_t nb_frag;
+    uint8_t frag_size;
+    uint16_t max_lost;                  // room in the scratch area, in fragments
+    uint16_t nb_have;                   // fragments in the storage
+    // the fragments lost, frozen when the first coded one comes
+    bool lost_known;
+    bool too_many_lost;                 // more than max_lost, the block can't be rebuilt
+    uint16_t nb_lost;
+    uint16_t nb_rows;                   // equations kept
+    uint16_t lost[LORA_FRAG_MAX_LOST];
+    uint8_t pivot[LORA_FRAG_MAX_LOST];  // the lost fragment each equation solves
+    // the equations, over the lost fragments; their data is in the scratch area
+    uint8_t rows[LORA_FRAG_MAX_LOST][LORA_FRAG_MAX_LOST / 8];
+    uint8_t have[LORA_FRAG_MAX_FRAGS / 8];
+    uint8_t parity[LORA_FRAG_MAX_FRAGS / 8];
+    uint8_t data[LORA_FRAG_MAX_SIZE];
+    uint8_t other[LORA_FRAG_MAX_SIZE];
+    lora_frag_stats_t stats;
+} lora_frag_t;
+
+// A block of nb_frag fragments of frag_size bytes, with room in the scratch
+// area for max_lost of them.  Returns false if it's larger than the decoder
+// can take.
+bool lora_frag_init(lora_frag_t *f, const lora_frag_ops_t *ops, void *ctx, uint32_t nb_frag, uint32_t frag_size, uint32_t max_lost);
+
+// Takes fragment number n (from 1, those after nb_frag are coded).
+lora_frag_result_t lora_frag_process(lora_frag_t *f, uint32_t n, const uint8_t *data, uint32_t len);
+
+// How many more fragments are needed, at least.
+uint32_t lora_frag_missing(lora_frag_t *f);
+
+bool lora_frag_done(lora_frag_t *f);
+
+// Row n (from 1) of the parity matrix of a block of m fragments, as m bits:
+// the fragments coded fragment nb_frag + n is the XOR of.
+void lora_frag_parity_row(uint32_t n, uint32_t m, uint8_t *row);
+
+#endif /* LORA_FRAG_H_ */
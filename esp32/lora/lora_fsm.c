@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lora_fsm.h"
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static void lora_fsm_run_state(lora_fsm_t *f, lora_state_t state);
+static bool lora_fsm_takes_commands(lora_state_t state);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_fsm_init(lora_fsm_t *f, const lora_fsm_ops_t *ops) {
+    memset(f, 0, sizeof(*f));
+    f->ops = ops;
+    f->state = E_LORA_STATE_NOINIT;
+}
+
+void lora_fsm_step(lora_fsm_t *f) {
+    const lora_fsm_ops_t *ops = f->ops;
+    uint32_t timeout = LORA_FSM_WAIT_FOREVER;
+    lora_state_t state;
+
+    if (f->reset) {
+        f->reset = false;
+        f->retry = false;
+        ops->radio_reset();
+        f->state = E_LORA_STATE_RESET;
+    }
+
+    state = f->state;
+    if (state != E_LORA_STATE_TX && !lora_fsm_takes_commands(state)) {
+        // the state the last event led to, run it right away
+        f->stats.states++;
+        lora_fsm_run_state(f, state);
+        return;
+    }
+
+    if (lora_fsm_takes_commands(state)) {
+        if (f->retry) {
+            uint32_t now = ops->ticks_ms();
+            if ((int32_t)(now - f->retry_at) < 0) {
+                timeout = f->retry_at - now;
+            } else {
+                f->stats.retries++;
+                f->retry = false;
+                if (ops->command(true) == E_LORA_FSM_CMD_RETRY) {
+                    f->retry = true;
+                    f->retry_at = ops->ticks_ms() + LORA_FSM_RETRY_MS;
+                }
+                return;
+            }
+        } else if (f->cmd_pending) {
+            // one at a time, the queue may hold more than one event said
+            switch (ops->command(false)) {
+            case E_LORA_FSM_CMD_NONE:
+                f->cmd_pending = false;
+                break;
+            case E_LORA_FSM_CMD_DONE:
+                f->stats.commands++;
+                return;
+            case E_LORA_FSM_CMD_RETRY:
+                f->stats.commands++;
+                f->retry = true;
+                f->retry_at = ops->ticks_ms() + LORA_FSM_RETRY_MS;
+                return;
+            }
+        }
+    }
+
+    // rest until something happens; a notification given since the state
+    // was read ends the wait at once
+    uint32_t events = ops->wait(timeout);
+    f->stats.wakeups++;
+    if (events & LORA_FSM_EVENT_CMD) {
+        f->cmd_pending = true;
+    }
+}
+
+void lora_fsm_command_queued(lora_fsm_t *f) {
+    f->ops->notify(LORA_FSM_EVENT_CMD);
+}
+
+void lora_fsm_reset(lora_fsm_t *f) {
+    f->reset = true;
+    f->ops->notify(LORA_FSM_EVENT_RESET);
+}
+
+void lora_fsm_set_state(lora_fsm_t *f, lora_state_t state) {
+    f->state = state;
+    f->ops->notify(LORA_FSM_EVENT_STATE);
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static bool lora_fsm_takes_commands(lora_state_t state) {
+    switch (state) {
+    case E_LORA_STATE_NOINIT:
+    case E_LORA_STATE_IDLE:
+    case E_LORA_STATE_RX:
+    case E_LORA_STATE_SLEEP:
+    case E_LORA_STATE_RESET:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void lora_fsm_run_state(lora_fsm_t *f, lora_state_t state) {
+    const lora_fsm_ops_t *ops = f->ops;
+
+    switch (state) {
+    case E_LORA_STATE_JOIN:
+    case E_LORA_STATE_LINK_CHECK:
+        ops->mac_state(state);
+        break;
+    case E_LORA_STATE_RX_DONE:
+    case E_LORA_STATE_RX_TIMEOUT:
+    case E_LORA_STATE_RX_ERROR:
+        // we need to perform a mode transition in order to clear the TxRx FIFO
+        ops->radio_sleep();
+        f->state = E_LORA_STATE_RX;
+        ops->radio_rx();
+        break;
+    case E_LORA_STATE_TX_DONE:
+    case E_LORA_STATE_TX_TIMEOUT:
+        ops->radio_sleep();
+        f->state = E_LORA_STATE_RX;
+        ops->radio_rx();
+        ops->tx_end(state == E_LORA_STATE_TX_TIMEOUT);
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_FSM_H_
+#define LORA_FSM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The state machine of the LoRa task, with no dependency on the IDF.  The
+// task sleeps until it's given an event: a command queued by MicroPython,
+// a radio interrupt or a MAC timer changing the state, or a reset.  It then
+// runs the states the event leads to until it rests again, so it doesn't
+// poll and a command is taken as soon as it's queued.  The commands and the
+// MAC states are run by modlora through the ops; the end of a raw radio TX
+// or RX is handled here.
+
+typedef enum {
+    E_LORA_STATE_NOINIT = 0,
+    E_LORA_STATE_IDLE,
+    E_LORA_STATE_JOIN,
+    E_LORA_STATE_LINK_CHECK,
+    E_LORA_STATE_RX,
+    E_LORA_STATE_RX_DONE,
+    E_LORA_STATE_RX_TIMEOUT,
+    E_LORA_STATE_RX_ERROR,
+    E_LORA_STATE_TX,
+    E_LORA_STATE_TX_DONE,
+    E_LORA_STATE_TX_TIMEOUT,
+    E_LORA_STATE_SLEEP,
+    E_LORA_STATE_RESET
+} lora_state_t;
+
+// the events, bits of the task's notification value
+#define LORA_FSM_EVENT_CMD              (0x01)  // a command was queued
+#define LORA_FSM_EVENT_STATE            (0x02)  // a radio or MAC callback changed the state
+#define LORA_FSM_EVENT_RESET            (0x04)
+
+#define LORA_FSM_WAIT_FOREVER           (0xFFFFFFFF)
+
+// A command that can't run yet (listen-before-talk found the channel busy)
+// is tried again after this long.
+#ifndef LORA_FSM_RETRY_MS
+#define LORA_FSM_RETRY_MS               (5)
+#endif
+
+typedef enum {
+    E_LORA_FSM_CMD_NONE = 0,            // the command queue is empty
+    E_LORA_FSM_CMD_DONE,                // a command was run
+    E_LORA_FSM_CMD_RETRY,               // it couldn't run yet, it's kept to be tried again
+} lora_fsm_cmd_result_t;
+
+typedef struct _lora_fsm_ops_t {
+    // waits for events for up to timeout_ms (LORA_FSM_WAIT_FOREVER), and
+    // returns them, 0 on a timeout
+    uint32_t (*wait)(uint32_t timeout_ms);
+    // gives the task events, from another task
+    void (*notify)(uint32_t events);
+    uint32_t (*ticks_ms)(void);
+    // runs the next queued command, or the one kept if retry
+    lora_fsm_cmd_result_t (*command)(bool retry);
+    // runs E_LORA_STATE_JOIN or E_LORA_STATE_LINK_CHECK, which go through
+    // the MAC, and moves on to another state
+    void (*mac_state)(lora_state_t state);
+    void (*radio_reset)(void);
+    void (*radio_sleep)(void);
+    void (*radio_rx)(void);
+    // a raw TX is over, sent or timed out: wakes the MicroPython call
+    // waiting on it, and the radio may be lent to Sigfox
+    void (*tx_end)(bool timeout);
+} lora_fsm_ops_t;
+
+typedef struct _lora_fsm_stats_t {
+    uint32_t wakeups;                   // waits that ended, on events or a timeout
+    uint32_t commands;                  // commands run
+    uint32_t retries;                   // commands tried again
+    uint32_t states;                    // states run without waiting
+} lora_fsm_stats_t;
+
+typedef struct _lora_fsm_t {
+    const lora_fsm_ops_t *ops;
+    // set by the LoRa task, and by the callbacks, which give it
+    // LORA_FSM_EVENT_STATE right after
+    volatile lora_state_t state;
+    volatile bool reset;
+    bool cmd_pending;                   // commands may be queued
+    bool retry;                         // a command is kept, to be tried at retry_at
+    uint32_t retry_at;
+    lora_fsm_stats_t stats;
+} lora_fsm_t;
+
+void lora_fsm_init(lora_fsm_t *f, const lora_fsm_ops_t *ops);
+
+// Runs what's due, or waits for the next event: the body of the task's
+// loop.
+void lora_fsm_step(lora_fsm_t *f);
+
+// For the MicroPython task and the LoRa timer task: a command was queued,
+// a reset is wanted, or a callback moves the state on.  Interrupt handlers
+// set the state and notify the task themselves.
+void lora_fsm_command_queued(lora_fsm_t *f);
+void lora_fsm_reset(lora_fsm_t *f);
+void lora_fsm_set_state(lora_fsm_t *f, lora_state_t state);
+
+#endif /* LORA_FSM_H_ */
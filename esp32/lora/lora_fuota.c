@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lora_fuota.h"
+
+/******************************************************************************
+ DEFINE PRIVATE CONSTANTS
+ ******************************************************************************/
+// TS004, Fragmented Data Block Transport
+#define FRAG_PACKAGE_ID                 (3)
+#define FRAG_PACKAGE_VERSION            (1)
+#define FRAG_PACKAGE_VERSION_REQ        (0x00)
+#define FRAG_SESSION_STATUS_REQ         (0x01)
+#define FRAG_SESSION_SETUP_REQ          (0x02)
+#define FRAG_SESSION_DELETE_REQ         (0x03)
+#define FRAG_DATA_FRAGMENT              (0x08)
+
+#define FRAG_SETUP_ENCODING_UNSUPPORTED (0x01)
+#define FRAG_SETUP_NOT_ENOUGH_MEMORY    (0x02)
+#define FRAG_SETUP_INDEX_UNSUPPORTED    (0x04)
+#define FRAG_STATUS_NOT_ENOUGH_MATRIX   (0x01)
+#define FRAG_DELETE_NO_SESSION          (0x04)
+
+// TS005, Remote Multicast Setup
+#define MC_PACKAGE_ID                   (2)
+#define MC_PACKAGE_VERSION              (1)
+#define MC_PACKAGE_VERSION_REQ          (0x00)
+#define MC_GROUP_STATUS_REQ             (0x01)
+#define MC_GROUP_SETUP_REQ              (0x02)
+#define MC_GROUP_DELETE_REQ             (0x03)
+#define MC_CLASS_C_SESSION_REQ          (0x04)
+
+#define MC_DELETE_UNDEFINED             (0x04)
+#define MC_SESSION_DR_ERROR             (0x04)
+#define MC_SESSION_FREQ_ERROR           (0x08)
+#define MC_SESSION_UNDEFINED            (0x10)
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t get_le(const uint8_t *buf, uint32_t n);
+static void put_le(uint8_t *buf, uint32_t value, uint32_t n);
+static void lora_fuota_answer(lora_fuota_t *f, const uint8_t *ans, uint32_t len);
+static int32_t lora_fuota_frag_command(lora_fuota_t *f, const uint8_t *cmd, uint32_t len);
+static int32_t lora_fuota_mc_command(lora_fuota_t *f, const uint8_t *cmd, uint32_t len);
+static uint8_t lora_fuota_frag_setup(lora_fuota_t *f, const uint8_t *req);
+static void lora_fuota_fragment(lora_fuota_t *f, const uint8_t *cmd, uint32_t len);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_fuota_init(lora_fuota_t *f, const lora_fuota_ops_t *ops, void *ctx, const uint8_t *gen_app_key) {
+    memset(f, 0, sizeof(*f));
+    f->ops = ops;
+    f->ctx = ctx;
+    memcpy(f->gen_app_key, gen_app_key, sizeof(f->gen_app_key));
+}
+
+bool lora_fuota_input(lora_fuota_t *f, uint8_t port, const uint8_t *data, uint32_t len, bool multicast) {
+    int32_t (*command)(lora_fuota_t *, const uint8_t *, uint32_t);
+
+    if (port == LORA_FUOTA_PORT_FRAG) {
+        command = lora_fuota_frag_command;
+    } else if (port == LORA_FUOTA_PORT_MC) {
+        // the groups are only set up by unicast
+        if (multicast) {
+            return true;
+        }
+        command = lora_fuota_mc_command;
+    } else {
+        return false;
+    }
+
+    // several commands may come in a downlink, their answers go in one uplink
+    f->ans_len = 0;
+    while (len > 0) {
+        int32_t used = command(f, data, len);
+        if (used < 0) {
+            f->stats.unknown++;
+            break;
+        }
+        f->stats.commands++;
+        data += used;
+        len -= used;
+    }
+    if (f->ans_len > 0) {
+        f->ops->send(f->ctx, port, f->ans, f->ans_len);
+    }
+    return true;
+}
+
+// McRootKey and McKEKey as for a LoRaWAN 1.0 device, the McKey is sent
+// encrypted with aes128_decrypt so that it's recovered with an encryption
+void lora_fuota_mc_keys(lora_fuota_t *f, uint32_t addr, const uint8_t *mc_key_encrypted, uint8_t *nwk_skey, uint8_t *app_skey) {
+    uint8_t block[16] = { 0 };
+    uint8_t mc_root_key[16];
+    uint8_t mc_ke_key[16];
+    uint8_t mc_key[16];
+
+    f->ops->encrypt(f->ctx, f->gen_app_key, block, mc_root_key);
+    f->ops->encrypt(f->ctx, mc_root_key, block, mc_ke_key);
+    f->ops->encrypt(f->ctx, mc_ke_key, mc_key_encrypted, mc_key);
+
+    put_le(&block[1], addr, 4);
+    block[0] = 0x01;
+    f->ops->encrypt(f->ctx, mc_key, block, app_skey);
+    block[0] = 0x02;
+    f->ops->encrypt(f->ctx, mc_key, block, nwk_skey);
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t get_le(const uint8_t *buf, uint32_t n) {
+    uint32_t value = 0;
+    while (n--) {
+        value = (value << 8) | buf[n];
+    }
+    return value;
+}
+
+static void put_le(uint8_t *buf, uint32_t value, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        buf[i] = value >> (8 * i);
+    }
+}
+
+// an answer that doesn't fit is dropped, the server asks again
+static void lora_fuota_answer(lora_fuota_t *f, const uint8_t *ans, uint32_t len) {
+    if (f->ans_len + len <= LORA_FUOTA_ANS_MAX) {
+        memcpy(&f->ans[f->ans_len], ans, len);
+        f->ans_len += len;
+    }
+}
+
+// returns the length of the command, or -1 if it's not understood
+static int32_t lora_fuota_frag_command(lora_fuota_t *f, const uint8_t *cmd, uint32_t len) {
+    uint8_t ans[5];
+
+    ans[0] = cmd[0];
+    switch (cmd[0]) {
+    case FRAG_PACKAGE_VERSION_REQ:
+        ans[1] = FRAG_PACKAGE_ID;
+        ans[2] = FRAG_PACKAGE_VERSION;
+        lora_fuota_answer(f, ans, 3);
+        return 1;
+    case FRAG_SESSION_STATUS_REQ: {
+        if (len < 2) {
+            return -1;
+        }
+        bool all = cmd[1] & 0x01;
+        uint8_t index = (cmd[1] >> 1) & 0x03;
+        if (!f->session.active || index != f->session.index) {
+            return 2;
+        }
+        // when all aren't asked, only those still missing some answer
+        uint32_t missing = lora_frag_missing(&f->frag);
+        if (all || missing > 0) {
+            put_le(&ans[1], (f->frag.stats.frames & 0x3FFF) | (index << 14), 2);
+            ans[3] = (missing < 0xFF) ? missing : 0xFF;
+            ans[4] = f->frag.too_many_lost ? FRAG_STATUS_NOT_ENOUGH_MATRIX : 0;
+            lora_fuota_answer(f, ans, 5);
+        }
+        return 2;
+    }
+    case FRAG_SESSION_SETUP_REQ:
+        if (len < 11) {
+            return -1;
+        }
+        ans[1] = lora_fuota_frag_setup(f, &cmd[1]);
+        lora_fuota_answer(f, ans, 2);
+        return 11;
+    case FRAG_SESSION_DELETE_REQ: {
+        if (len < 2) {
+            return -1;
+        }
+        uint8_t index = cmd[1] & 0x03;
+        ans[1] = index;
+        if (f->session.active && index == f->session.index) {
+            f->session.active = false;
+        } else {
+            ans[1] |= FRAG_DELETE_NO_SESSION;
+        }
+        lora_fuota_answer(f, ans, 2);
+        return 2;
+    }
+    case FRAG_DATA_FRAGMENT:
+        // takes the rest of the downlink
+        if (len < 3) {
+            return -1;
+        }
+        lora_fuota_fragment(f, &cmd[1], len - 1);
+        return len;
+    default:
+        return -1;
+    }
+}
+
+// returns the status of the answer
+static uint8_t lora_fuota_frag_setup(lora_fuota_t *f, const uint8_t *req) {
+    uint8_t index = (req[0] >> 4) & 0x03;
+    uint8_t mc_mask = req[0] & 0x0F;
+    uint32_t nb_frag = get_le(&req[1], 2);
+    uint32_t frag_size = req[3];
+    uint8_t algo = (req[4] >> 3) & 0x07;
+    uint32_t padding = req[5];
+    uint8_t status = index << 6;
+
+    // only the FEC of the spec
+    if (algo != 0) {
+        status |= FRAG_SETUP_ENCODING_UNSUPPORTED;
+    }
+    // one session at a time, though a finished one may be replaced
+    if (f->session.active && !f->session.done && !f->session.failed && index != f->session.index) {
+        status |= FRAG_SETUP_INDEX_UNSUPPORTED;
+    }
+    if (status & 0x3F) {
+        return status;
+    }
+
+    int32_t max_lost = -1;
+    if (nb_frag > 0 && nb_frag <= LORA_FRAG_MAX_FRAGS && frag_size > 0 && padding < frag_size) {
+        max_lost = f->ops->block_open(f->ctx, nb_frag * frag_size, frag_size);
+    }
+    if (max_lost < 0 || !lora_frag_init(&f->frag, &f->ops->block, f->ctx, nb_frag, frag_size, max_lost)) {
+        f->session.active = false;
+        return status | FRAG_SETUP_NOT_ENOUGH_MEMORY;
+    }
+
+    f->session.active = true;
+    f->session.done = false;
+    f->session.failed = false;
+    f->session.index = index;
+    f->session.mc_mask = mc_mask;
+    f->session.nb_frag = nb_frag;
+    f->session.frag_size = frag_size;
+    f->session.padding = padding;
+    f->session.descriptor = get_le(&req[6], 4);
+    return status;
+}
+
+static void lora_fuota_fragment(lora_fuota_t *f, const uint8_t *cmd, uint32_t len) {
+    uint32_t index_and_n = get_le(cmd, 2);
+
+    if (!f->session.active || f->session.done || f->session.failed || (index_and_n >> 14) != f->session.index) {
+        return;
+    }
+    switch (lora_frag_process(&f->frag, index_and_n & 0x3FFF, &cmd[2], len - 2)) {
+    case E_LORA_FRAG_DONE:
+        f->session.done = true;
+        f->stats.blocks++;
+        f->ops->block_done(f->ctx, f->session.nb_frag * f->session.frag_size - f->session.padding,
+                           f->session.descriptor);
+        break;
+    case E_LORA_FRAG_ERROR:
+        f->session.failed = true;
+        break;
+    default:
+        break;
+    }
+}
+
+// returns the length of the command, or -1 if it's not understood
+static int32_t lora_fuota_mc_command(lora_fuota_t *f, const uint8_t *cmd, uint32_t len) {
+    uint8_t ans[2 + 5 * LORA_FUOTA_MC_GROUPS];
+
+    ans[0] = cmd[0];
+    switch (cmd[0]) {
+    case MC_PACKAGE_VERSION_REQ:
+        ans[1] = MC_PACKAGE_ID;
+        ans[2] = MC_PACKAGE_VERSION;
+        lora_fuota_answer(f, ans, 3);
+        return 1;
+    case MC_GROUP_STATUS_REQ: {
+        if (len < 2) {
+            return -1;
+        }
+        uint8_t mask = cmd[1] & 0x0F;
+        uint8_t ans_mask = 0;
+        uint32_t total = 0;
+        uint32_t ans_len = 2;
+        for (uint8_t id = 0; id < LORA_FUOTA_MC_GROUPS; id++) {
+            if (f->groups[id].defined) {
+                total++;
+                if (mask & (1 << id)) {
+                    ans_mask |= 1 << id;
+                    ans[ans_len] = id;
+                    put_le(&ans[ans_len + 1], f->groups[id].addr, 4);
+                    ans_len += 5;
+                }
+            }
+        }
+        ans[1] = ((total < 3 ? total : 3) << 4) | ans_mask;
+        lora_fuota_answer(f, ans, ans_len);
+        return 2;
+    }
+    case MC_GROUP_SETUP_REQ: {
+        if (len < 30) {
+            return -1;
+        }
+        uint8_t id = cmd[1] & 0x03;
+        lora_fuota_mc_group_t *group = &f->groups[id];
+        memset(group, 0, sizeof(*group));
+        group->addr = get_le(&cmd[2], 4);
+        lora_fuota_mc_keys(f, group->addr, &cmd[6], group->nwk_skey, group->app_skey);
+        group->min_fcnt = get_le(&cmd[22], 4);
+        group->max_fcnt = get_le(&cmd[26], 4);
+        group->defined = true;
+        f->ops->mc_set(f->ctx, id, group);
+        ans[1] = id;
+        lora_fuota_answer(f, ans, 2);
+        return 30;
+    }
+    case MC_GROUP_DELETE_REQ: {
+        if (len < 2) {
+            return -1;
+        }
+        uint8_t id = cmd[1] & 0x03;
+        ans[1] = id;
+        if (f->groups[id].defined) {
+            memset(&f->groups[id], 0, sizeof(f->groups[id]));
+            f->ops->mc_set(f->ctx, id, NULL);
+        } else {
+            ans[1] |= MC_DELETE_UNDEFINED;
+        }
+        lora_fuota_answer(f, ans, 2);
+        return 2;
+    }
+    case MC_CLASS_C_SESSION_REQ: {
+        if (len < 11) {
+            return -1;
+        }
+        uint8_t id = cmd[1] & 0x03;
+        uint32_t session_time = get_le(&cmd[2], 4);
+        uint32_t timeout = 1 << (cmd[6] & 0x0F);
+        uint32_t freq = get_le(&cmd[7], 3) * 100;
+        uint8_t dr = cmd[10];
+        lora_fuota_mc_group_t *group = &f->groups[id];
+
+        ans[1] = id;
+        if (!group->defined) {
+            ans[1] |= MC_SESSION_UNDEFINED;
+        }
+        if (!f->ops->freq_ok(f->ctx, freq)) {
+            ans[1] |= MC_SESSION_FREQ_ERROR;
+        }
+        if (!f->ops->dr_ok(f->ctx, dr)) {
+            ans[1] |= MC_SESSION_DR_ERROR;
+        }
+        if (ans[1] != id) {
+            lora_fuota_answer(f, ans, 2);
+            return 11;
+        }
+
+        // without the time, or if it's passed, it starts right away
+        uint32_t now = f->ops->gps_time(f->ctx);
+        uint32_t start_in = 0;
+        if (now != 0 && (int32_t)(session_time - now) > 0) {
+            start_in = session_time - now;
+        }
+        group->session = true;
+        group->session_time = session_time;
+        group->timeout = timeout;
+        group->freq = freq;
+        group->dr = dr;
+        f->ops->mc_session(f->ctx, id, group, start_in);
+        put_le(&ans[2], start_in, 3);
+        lora_fuota_answer(f, ans, 5);
+        return 11;
+    }
+    default:
+        return -1;
+    }
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_FUOTA_H_
+#define LORA_FUOTA_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lora_frag.h"
+
+// The application layer packages of a LoRaWAN firmware update over the air,
+// with no dependency on the IDF: Remote Multicast Setup (TS005, port 200)
+// and Fragmented Data Block Transport (TS004, port 201).  The server sets up
+// a multicast group and its keys, derived from GenAppKey, and a class C
+// session for it, then a fragmentation session, and sends the image as
+// fragments to the group; lora_frag rebuilds it in the block storage of the
+// ops.  The answers go back as uplinks on the same port.
+//
+// One fragmentation session is kept at a time.
+
+#define LORA_FUOTA_PORT_MC              (200)
+#define LORA_FUOTA_PORT_FRAG            (201)
+
+#define LORA_FUOTA_MC_GROUPS            (4)
+
+// the answers to one downlink, sent in one uplink; fits at any data rate
+#define LORA_FUOTA_ANS_MAX              (48)
+
+typedef struct _lora_fuota_mc_group_t {
+    bool defined;
+    uint32_t addr;
+    uint8_t nwk_skey[16];
+    uint8_t app_skey[16];
+    uint32_t min_fcnt;
+    uint32_t max_fcnt;
+    // the class C session, if one is set
+    bool session;
+    uint32_t session_time;              // GPS seconds
+    uint32_t timeout;                   // seconds
+    uint32_t freq;                      // Hz
+    uint8_t dr;
+} lora_fuota_mc_group_t;
+
+typedef struct _lora_fuota_ops_t {
+    // queues an uplink
+    void (*send)(void *ctx, uint8_t port, const uint8_t *data, uint32_t len);
+    // AES-128 of one block, for the keys of the groups; the buffers may
+    // not be aligned
+    void (*encrypt)(void *ctx, const uint8_t *key, const uint8_t *in, uint8_t *out);
+    // group id was set up, or deleted if group is NULL
+    void (*mc_set)(void *ctx, uint8_t id, const lora_fuota_mc_group_t *group);
+    // the class C session of group id starts in start_in seconds
+    void (*mc_session)(void *ctx, uint8_t id, const lora_fuota_mc_group_t *group, uint32_t start_in);
+    // whether the region can receive on freq, and at dr
+    bool (*freq_ok)(void *ctx, uint32_t freq);
+    bool (*dr_ok)(void *ctx, uint8_t dr);
+    // GPS seconds, 0 if the time isn't known
+    uint32_t (*gps_time)(void *ctx);
+    // the block storage, size bytes, returns how many fragments of frag_size
+    // fit in a scratch area after it, or -1 if it doesn't fit
+    int32_t (*block_open)(void *ctx, uint32_t size, uint32_t frag_size);
+    lora_frag_ops_t block;
+    // the block is complete, its first size bytes; descriptor is as the
+    // server set it
+    void (*block_done)(void *ctx, uint32_t size, uint32_t descriptor);
+} lora_fuota_ops_t;
+
+typedef struct _lora_fuota_stats_t {
+    uint32_t commands;
+    uint32_t unknown;                   // commands not understood, the rest of their downlinks is dropped
+    uint32_t blocks;                    // completed
+} lora_fuota_stats_t;
+
+typedef struct _lora_fuota_t {
+    const lora_fuota_ops_t *ops;
+    void *ctx;
+    uint8_t gen_app_key[16];
+    lora_fuota_mc_group_t groups[LORA_FUOTA_MC_GROUPS];
+    struct {
+        bool active;
+        bool done;
+        bool failed;                    // the storage failed, the block is lost
+        uint8_t index;
+        uint8_t mc_mask;
+        uint16_t nb_frag;
+        uint8_t frag_size;
+        uint8_t padding;
+        uint32_t descriptor;
+    } session;
+    lora_frag_t frag;
+    uint8_t ans[LORA_FUOTA_ANS_MAX];
+    uint32_t ans_len;
+    lora_fuota_stats_t stats;
+} lora_fuota_t;
+
+void lora_fuota_init(lora_fuota_t *f, const lora_fuota_ops_t *ops, void *ctx, const uint8_t *gen_app_key);
+
+// A downlink on port, with multicast set if it came to a group.  Returns
+// false if the port isn't one of the packages'.
+bool lora_fuota_input(lora_fuota_t *f, uint8_t port, const uint8_t *data, uint32_t len, bool multicast);
+
+// Derives the keys of a group from its encrypted McKey (TS005 section 3.2).
+void lora_fuota_mc_keys(lora_fuota_t *f, uint32_t addr, const uint8_t *mc_key_encrypted, uint8_t *nwk_skey, uint8_t *app_skey);
+
+#endif /* LORA_FUOTA_H_ */
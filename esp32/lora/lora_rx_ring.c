@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#include "lora_rx_ring.h"
+
+/******************************************************************************
+ DEFINE PRIVATE CONSTANTS
+ ******************************************************************************/
+// the header of a packet: its length (2 bytes, little endian), its port and
+// a spare byte; the packets are padded to it, so a header never wraps
+#define LORA_RX_RING_HDR_SIZE           (4)
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t lora_rx_ring_record_size(uint32_t len);
+static void lora_rx_ring_copy_in(lora_rx_ring_t *r, uint32_t pos, const uint8_t *data, uint32_t len);
+static void lora_rx_ring_copy_out(lora_rx_ring_t *r, uint32_t pos, uint8_t *data, uint32_t len);
+static uint32_t lora_rx_ring_reader_tail(lora_rx_ring_t *r);
+static uint32_t lora_rx_ring_load(volatile uint32_t *v);
+static void lora_rx_ring_store(volatile uint32_t *v, uint32_t value);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_rx_ring_init(lora_rx_ring_t *r, uint8_t *buf, uint32_t size) {
+    memset(r, 0, sizeof(*r));
+    r->buf = buf;
+    r->size = size;
+}
+
+// kept in IRAM, it runs in the radio interrupt
+IRAM_ATTR bool lora_rx_ring_put(lora_rx_ring_t *r, const uint8_t *data, uint32_t len, uint8_t port) {
+    uint32_t head = r->head;
+    uint32_t tail = lora_rx_ring_load(&r->tail);
+    uint32_t record = lora_rx_ring_record_size(len);
+
+    if (len > 0xFFFF || record > r->size - (head - tail)) {
+        r->stats.dropped++;
+        r->stats.dropped_bytes += len;
+        return false;
+    }
+
+    uint8_t *hdr = r->buf + (head & (r->size - 1));
+    hdr[0] = len & 0xFF;
+    hdr[1] = len >> 8;
+    hdr[2] = port;
+    hdr[3] = 0;
+    lora_rx_ring_copy_in(r, head + LORA_RX_RING_HDR_SIZE, data, len);
+    lora_rx_ring_store(&r->head, head + record);
+
+    r->stats.packets++;
+    r->stats.bytes += len;
+    if (head + record - tail > r->stats.high_water) {
+        r->stats.high_water = head + record - tail;
+    }
+    return true;
+}
+
+void lora_rx_ring_flush(lora_rx_ring_t *r) {
+    lora_rx_ring_store(&r->flush_to, r->head);
+}
+
+bool lora_rx_ring_any(lora_rx_ring_t *r) {
+    return lora_rx_ring_reader_tail(r) != lora_rx_ring_load(&r->head);
+}
+
+int32_t lora_rx_ring_read(lora_rx_ring_t *r, uint8_t *buf, uint32_t len, uint8_t *port) {
+    uint32_t tail = lora_rx_ring_reader_tail(r);
+    if (tail == lora_rx_ring_load(&r->head)) {
+        return -1;
+    }
+
+    const uint8_t *hdr = r->buf + (tail & (r->size - 1));
+    uint32_t packet_len = hdr[0] | (hdr[1] << 8);
+    if (port != NULL) {
+        *port = hdr[2];
+    }
+
+    uint32_t left = packet_len - r->offset;
+    if (len > left) {
+        len = left;
+    }
+    lora_rx_ring_copy_out(r, tail + LORA_RX_RING_HDR_SIZE + r->offset, buf, len);
+
+    r->offset += len;
+    if (r->offset == packet_len) {
+        // the whole packet was read, its room goes back to the writer
+        r->offset = 0;
+        lora_rx_ring_store(&r->tail, tail + lora_rx_ring_record_size(packet_len));
+    }
+    return len;
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static IRAM_ATTR uint32_t lora_rx_ring_record_size(uint32_t len) {
+    return (LORA_RX_RING_HDR_SIZE + len + (LORA_RX_RING_HDR_SIZE - 1)) & ~(LORA_RX_RING_HDR_SIZE - 1);
+}
+
+static IRAM_ATTR void lora_rx_ring_copy_in(lora_rx_ring_t *r, uint32_t pos, const uint8_t *data, uint32_t len) {
+    uint32_t off = pos & (r->size - 1);
+    uint32_t first = r->size - off < len ? r->size - off : len;
+    memcpy(r->buf + off, data, first);
+    memcpy(r->buf, data + first, len - first);
+}
+
+static void lora_rx_ring_copy_out(lora_rx_ring_t *r, uint32_t pos, uint8_t *data, uint32_t len) {
+    uint32_t off = pos & (r->size - 1);
+    uint32_t first = r->size - off < len ? r->size - off : len;
+    memcpy(data, r->buf + off, first);
+    memcpy(data + first, r->buf, len - first);
+}
+
+// The tail, once a flush asked by the writer is done.  The writer keeps to
+// the tail, so the packets flushed are never overwritten under the reader.
+static uint32_t lora_rx_ring_reader_tail(lora_rx_ring_t *r) {
+    uint32_t tail = r->tail;
+    uint32_t flush_to = lora_rx_ring_load(&r->flush_to);
+    if ((int32_t)(flush_to - tail) > 0) {
+        tail = flush_to;
+        r->offset = 0;
+        lora_rx_ring_store(&r->tail, tail);
+    }
+    return tail;
+}
+
+// The head and tail are shared between the writer and the reader: the data
+// in the buffer must be visible before the index that hands it over.
+static IRAM_ATTR uint32_t lora_rx_ring_load(volatile uint32_t *v) {
+    return __atomic_load_n(v, __ATOMIC_ACQUIRE);
+}
+
+static IRAM_ATTR void lora_rx_ring_store(volatile uint32_t *v, uint32_t value) {
+    __atomic_store_n(v, value, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_RX_RING_H_
+#define LORA_RX_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The queue of received LoRa packets, with no dependency on the IDF.  The
+// packets are stored back to back in a byte ring, each behind a small
+// header, so a short packet takes little more than its length and there's
+// room for as many as fit.  The payload is copied in once by the radio
+// interrupt or the MAC, and out once by the reader, straight into the
+// caller's buffer.  A reader that takes less than a whole packet gets the
+// rest on the following reads.  A packet that doesn't fit is dropped and
+// counted.
+//
+// There is one writer and one reader at a time: the radio interrupt (raw
+// LoRa) or the LoRa task (LoRaWAN) writes, MicroPython reads.
+
+typedef struct _lora_rx_ring_stats_t {
+    uint32_t packets;                   // packets queued
+    uint32_t bytes;                     // payload queued
+    uint32_t dropped;                   // packets dropped, the ring being full
+    uint32_t dropped_bytes;             // their payload
+    uint32_t high_water;                // the most the ring ever held, headers included
+} lora_rx_ring_stats_t;
+
+typedef struct _lora_rx_ring_t {
+    uint8_t *buf;
+    uint32_t size;                      // a power of 2
+    // free running; the head is moved by the writer, the tail by the reader
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    // set by the writer to discard what's before it, done by the reader
+    volatile uint32_t flush_to;
+    uint32_t offset;                    // how much of the packet at the tail was read
+    lora_rx_ring_stats_t stats;
+} lora_rx_ring_t;
+
+// buf of size bytes (a power of 2) holds the packets
+void lora_rx_ring_init(lora_rx_ring_t *r, uint8_t *buf, uint32_t size);
+
+// For the writer: queues a packet received on port (0 in raw LoRa mode).
+// Returns false if it was dropped.
+bool lora_rx_ring_put(lora_rx_ring_t *r, const uint8_t *data, uint32_t len, uint8_t port);
+
+// For the writer: what's queued so far is discarded, before the next read.
+void lora_rx_ring_flush(lora_rx_ring_t *r);
+
+// For the reader: whether a packet, or what's left of one, is pending.
+bool lora_rx_ring_any(lora_rx_ring_t *r);
+
+// For the reader: copies up to len bytes of the pending packet into buf,
+// and its port into port if not NULL.  Returns the number of bytes copied,
+// or -1 if nothing's pending.
+int32_t lora_rx_ring_read(lora_rx_ring_t *r, uint8_t *buf, uint32_t len, uint8_t *port);
+
+#endif /* LORA_RX_RING_H_ */
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lora_session.h"
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static bool lora_session_write(lora_session_t *s, const char *key, const void *buf, uint32_t len);
+static void lora_session_make_header(lora_session_t *s, lora_session_header_t *h);
+static void lora_session_rtc_set(lora_session_rtc_t *rtc, uint32_t id, const lora_session_counters_t *counters);
+static bool lora_session_rtc_valid(const lora_session_rtc_t *rtc, uint32_t id);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_session_init(lora_session_t *s, const lora_session_ops_t *ops, void *ctx, uint8_t region) {
+    memset(s, 0, sizeof(*s));
+    s->ops = ops;
+    s->ctx = ctx;
+    s->region = region;
+}
+
+bool lora_session_add(lora_session_t *s, const char *key, void *data, uint32_t len) {
+    if (s->nb_fields == LORA_SESSION_FIELDS_MAX || len > UINT16_MAX) {
+        return false;
+    }
+    s->fields[s->nb_fields].key = key;
+    s->fields[s->nb_fields].data = data;
+    s->fields[s->nb_fields].len = len;
+    s->nb_fields++;
+    return true;
+}
+
+bool lora_session_save(lora_session_t *s, const lora_session_counters_t *counters, lora_session_rtc_t *rtc) {
+    lora_session_header_t header;
+    bool new_session, written = false;
+
+    s->stats.saves++;
+    lora_session_make_header(s, &header);
+    new_session = !s->stored_known || s->stored.crc[0] != header.crc[0];
+
+    for (uint32_t i = 0; i < s->nb_fields; i++) {
+        if (s->stored_known && s->stored.len[i] == header.len[i] && s->stored.crc[i] == header.crc[i]) {
+            s->stats.skipped++;
+            continue;
+        }
+        if (!lora_session_write(s, s->fields[i].key, s->fields[i].data, s->fields[i].len)) {
+            goto failed;
+        }
+        written = true;
+    }
+    // last, it's what makes the fields valid
+    if (!s->stored_known || memcmp(&s->stored, &header, sizeof(header))) {
+        if (!lora_session_write(s, LORA_SESSION_HEADER_KEY, &header, sizeof(header))) {
+            goto failed;
+        }
+        memcpy(&s->stored, &header, sizeof(header));
+        s->stored_known = true;
+        written = true;
+    }
+
+    // a new session starts over from 0
+    if (new_session || !s->counters_known || counters->down != s->counters.down ||
+        (int32_t)(counters->up - s->counters.up) < 0 ||
+        counters->up - s->counters.up >= LORA_SESSION_FCNT_STEP) {
+        if (!lora_session_write(s, LORA_SESSION_FCNT_KEY, counters, sizeof(*counters))) {
+            goto failed;
+        }
+        memcpy(&s->counters, counters, sizeof(*counters));
+        s->counters_known = true;
+        written = true;
+    }
+
+    if (written && !s->ops->commit(s->ctx)) {
+        goto failed;
+    }
+    if (rtc) {
+        lora_session_rtc_set(rtc, header.crc[0], counters);
+    }
+    return true;
+
+failed:
+    // what the store holds isn't known anymore
+    s->stored_known = false;
+    s->counters_known = false;
+    if (rtc) {
+        rtc->check = ~lora_session_crc(rtc, offsetof(lora_session_rtc_t, check));
+    }
+    return false;
+}
+
+uint32_t lora_session_size(const lora_session_t *s) {
+    uint32_t size = 0;
+
+    for (uint32_t i = 0; i < s->nb_fields; i++) {
+        size += s->fields[i].len;
+    }
+    return size;
+}
+
+bool lora_session_restore(lora_session_t *s, lora_session_counters_t *counters, lora_session_rtc_t *rtc, void *scratch) {
+    lora_session_header_t header;
+    lora_session_counters_t stored;
+    uint8_t *data = scratch;
+    uint32_t len;
+
+    s->stored_known = false;
+    s->counters_known = false;
+    s->stats.from_rtc = false;
+
+    len = sizeof(header);
+    if (!s->ops->get(s->ctx, LORA_SESSION_HEADER_KEY, &header, &len) || len != sizeof(header) ||
+        header.version != LORA_SESSION_VERSION || header.region != s->region || header.nb_fields != s->nb_fields) {
+        return false;
+    }
+    for (uint32_t i = 0; i < s->nb_fields; i++) {
+        if (header.len[i] != s->fields[i].len) {
+            return false;
+        }
+        len = s->fields[i].len;
+        if (!s->ops->get(s->ctx, s->fields[i].key, data, &len) || len != s->fields[i].len ||
+            lora_session_crc(data, len) != header.crc[i]) {
+            return false;
+        }
+        data += len;
+    }
+    len = sizeof(stored);
+    if (!s->ops->get(s->ctx, LORA_SESSION_FCNT_KEY, &stored, &len) || len != sizeof(stored)) {
+        return false;
+    }
+    // all of it is there, it replaces what the fields held
+    data = scratch;
+    for (uint32_t i = 0; i < s->nb_fields; i++) {
+        memcpy(s->fields[i].data, data, s->fields[i].len);
+        data += s->fields[i].len;
+    }
+
+    memcpy(&s->stored, &header, sizeof(header));
+    s->stored_known = true;
+    memcpy(&s->counters, &stored, sizeof(stored));
+    s->counters_known = true;
+
+    if (rtc && lora_session_rtc_valid(rtc, header.crc[0]) && (int32_t)(rtc->counters.up - stored.up) >= 0) {
+        memcpy(counters, &rtc->counters, sizeof(*counters));
+        s->stats.from_rtc = true;
+    } else {
+        // the uplinks sent since the counters were stored aren't known, and
+        // the next restore may not know the ones sent from here either
+        memcpy(counters, &stored, sizeof(*counters));
+        counters->up += LORA_SESSION_FCNT_GAP;
+        if (lora_session_write(s, LORA_SESSION_FCNT_KEY, counters, sizeof(*counters)) && s->ops->commit(s->ctx)) {
+            memcpy(&s->counters, counters, sizeof(*counters));
+        } else {
+            s->counters_known = false;
+        }
+    }
+    if (rtc) {
+        lora_session_rtc_set(rtc, header.crc[0], counters);
+    }
+    return true;
+}
+
+void lora_session_rtc_update(lora_session_rtc_t *rtc, const lora_session_counters_t *counters) {
+    if (lora_session_rtc_valid(rtc, rtc->id)) {
+        lora_session_rtc_set(rtc, rtc->id, counters);
+    }
+}
+
+void lora_session_forget(lora_session_t *s) {
+    s->stored_known = false;
+    s->counters_known = false;
+}
+
+uint32_t lora_session_crc(const void *buf, uint32_t len) {
+    const uint8_t *p = buf;
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (uint32_t j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static bool lora_session_write(lora_session_t *s, const char *key, const void *buf, uint32_t len) {
+    if (!s->ops->set(s->ctx, key, buf, len)) {
+        return false;
+    }
+    s->stats.writes++;
+    s->stats.bytes += len;
+    return true;
+}
+
+static void lora_session_make_header(lora_session_t *s, lora_session_header_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->version = LORA_SESSION_VERSION;
+    h->region = s->region;
+    h->nb_fields = s->nb_fields;
+    for (uint32_t i = 0; i < s->nb_fields; i++) {
+        h->len[i] = s->fields[i].len;
+        h->crc[i] = lora_session_crc(s->fields[i].data, s->fields[i].len);
+    }
+}
+
+static void lora_session_rtc_set(lora_session_rtc_t *rtc, uint32_t id, const lora_session_counters_t *counters) {
+    rtc->id = id;
+    memcpy(&rtc->counters, counters, sizeof(*counters));
+    rtc->check = lora_session_crc(rtc, offsetof(lora_session_rtc_t, check));
+}
+
+static bool lora_session_rtc_valid(const lora_session_rtc_t *rtc, uint32_t id) {
+    return rtc->id == id && rtc->check == lora_session_crc(rtc, offsetof(lora_session_rtc_t, check));
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_SESSION_H_
+#define LORA_SESSION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Keeps a LoRaWAN session in a key value store (NVS on the device), with no
+// dependency on the IDF.  The session is a list of fields, each a key of
+// its own, and a header with the version, the region and the size and CRC
+// of every field.  A save writes the fields whose CRC changed, then the
+// header if it did, so that a save interrupted half way leaves fields that
+// don't match the header and the restore refuses them.  The first field
+// identifies the session, it should hold the address and the keys.
+//
+// The frame counters change with every uplink, they have a key of their
+// own which is only written every LORA_SESSION_FCNT_STEP uplinks, or when
+// the downlink counter moved.  The caller keeps an exact copy in memory
+// that survives deep sleep (RTC memory on the device), updated after every
+// uplink; when that's lost, the restore adds LORA_SESSION_FCNT_GAP to the
+// stored uplink counter, and stores that, so that no counter is used twice
+// with the same keys.
+
+#define LORA_SESSION_VERSION            (1)
+#define LORA_SESSION_FIELDS_MAX         (8)
+
+#ifndef LORA_SESSION_FCNT_STEP
+#define LORA_SESSION_FCNT_STEP          (16)
+#endif
+
+// more than the step, the rest covers the uplinks sent after the last save
+#ifndef LORA_SESSION_FCNT_GAP
+#define LORA_SESSION_FCNT_GAP           (64)
+#endif
+
+#define LORA_SESSION_HEADER_KEY         "LS_HEAD"
+#define LORA_SESSION_FCNT_KEY           "LS_FCNT"
+
+typedef struct _lora_session_ops_t {
+    // *len is the size of buf, then the size of the value
+    bool (*get)(void *ctx, const char *key, void *buf, uint32_t *len);
+    bool (*set)(void *ctx, const char *key, const void *buf, uint32_t len);
+    bool (*commit)(void *ctx);
+} lora_session_ops_t;
+
+typedef struct _lora_session_counters_t {
+    uint32_t up;
+    uint32_t down;
+    uint32_t adr_ack;
+} lora_session_counters_t;
+
+// The copy of the counters kept across deep sleep.
+typedef struct _lora_session_rtc_t {
+    uint32_t id;                        // the CRC of the first field
+    lora_session_counters_t counters;
+    uint32_t check;                     // CRC of the above
+} lora_session_rtc_t;
+
+typedef struct _lora_session_field_t {
+    const char *key;
+    void *data;
+    uint32_t len;
+} lora_session_field_t;
+
+typedef struct _lora_session_header_t {
+    uint8_t version;
+    uint8_t region;
+    uint8_t nb_fields;
+    uint8_t rfu;
+    uint16_t len[LORA_SESSION_FIELDS_MAX];
+    uint32_t crc[LORA_SESSION_FIELDS_MAX];
+} lora_session_header_t;
+
+typedef struct _lora_session_stats_t {
+    uint32_t saves;
+    uint32_t writes;                    // keys written
+    uint32_t bytes;                     // in them
+    uint32_t skipped;                   // fields that hadn't changed
+    bool from_rtc;                      // the last restore took the counters from RTC memory
+} lora_session_stats_t;
+
+typedef struct _lora_session_t {
+    const lora_session_ops_t *ops;
+    void *ctx;
+    uint8_t region;
+    lora_session_field_t fields[LORA_SESSION_FIELDS_MAX];
+    uint32_t nb_fields;
+    lora_session_header_t stored;       // what the store holds, when known
+    bool stored_known;
+    lora_session_counters_t counters;
+    bool counters_known;
+    lora_session_stats_t stats;
+} lora_session_t;
+
+void lora_session_init(lora_session_t *s, const lora_session_ops_t *ops, void *ctx, uint8_t region);
+
+// Adds a field, the data stays where it is and is read on save, written on
+// restore.
+bool lora_session_add(lora_session_t *s, const char *key, void *data, uint32_t len);
+
+// Writes what changed and updates *rtc.  False if a write failed, the next
+// save writes everything again.
+bool lora_session_save(lora_session_t *s, const lora_session_counters_t *counters, lora_session_rtc_t *rtc);
+
+// The bytes of all the fields.
+uint32_t lora_session_size(const lora_session_t *s);
+
+// Reads the fields back and sets *counters, from *rtc if it belongs to
+// this session, then *rtc to them.  The fields are read into scratch,
+// lora_session_size() bytes, and copied to their data once they all match
+// the header.  False if there's no session of this version and region, or
+// it's incomplete; the fields are left as they were then.
+bool lora_session_restore(lora_session_t *s, lora_session_counters_t *counters, lora_session_rtc_t *rtc, void *scratch);
+
+// Updates the counters of *rtc after an uplink, if it holds a session.
+void lora_session_rtc_update(lora_session_rtc_t *rtc, const lora_session_counters_t *counters);
+
+// The store was erased.
+void lora_session_forget(lora_session_t *s);
+
+uint32_t lora_session_crc(const void *buf, uint32_t len);
+
+#endif /* LORA_SESSION_H_ */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#include "lora_timer_heap.h"
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static bool lora_timer_heap_holds(lora_timer_heap_t *h, const TimerEvent_t *obj);
+static bool lora_timer_heap_before(const TimerEvent_t *a, const TimerEvent_t *b);
+static void lora_timer_heap_place(lora_timer_heap_t *h, TimerEvent_t *obj, uint32_t i);
+static void lora_timer_heap_up(lora_timer_heap_t *h, uint32_t i);
+static void lora_timer_heap_down(lora_timer_heap_t *h, uint32_t i);
+static void lora_timer_heap_remove(lora_timer_heap_t *h, uint32_t i);
+static void lora_timer_heap_program(lora_timer_heap_t *h, uint32_t now);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_timer_heap_init(lora_timer_heap_t *h, const lora_timer_heap_ops_t *ops) {
+    memset(h, 0, sizeof(*h));
+    h->ops = ops;
+}
+
+// all of these run in the timer interrupt or with it masked, so they're
+// kept in IRAM
+IRAM_ATTR bool lora_timer_heap_start(lora_timer_heap_t *h, TimerEvent_t *obj) {
+    if (lora_timer_heap_holds(h, obj)) {
+        return true;
+    }
+    if (h->count == LORA_TIMER_HEAP_SIZE) {
+        h->stats.full++;
+        return false;
+    }
+
+    uint32_t now = h->ops->now();
+    obj->Timestamp = now + obj->ReloadValue;
+    obj->Seq = h->seq++;
+    obj->IsRunning = true;
+    lora_timer_heap_place(h, obj, h->count++);
+    lora_timer_heap_up(h, obj->HeapIndex);
+
+    h->stats.starts++;
+    if (h->count > h->stats.high_water) {
+        h->stats.high_water = h->count;
+    }
+    // only a new first timer changes what the hardware waits for
+    if (h->heap[0] == obj) {
+        lora_timer_heap_program(h, now);
+    }
+    return true;
+}
+
+IRAM_ATTR void lora_timer_heap_stop(lora_timer_heap_t *h, TimerEvent_t *obj) {
+    if (!lora_timer_heap_holds(h, obj)) {
+        return;
+    }
+    bool first = (obj->HeapIndex == 0);
+    lora_timer_heap_remove(h, obj->HeapIndex);
+    h->stats.stops++;
+    // the hardware would fire early otherwise; with no timers left, letting
+    // it fire for nothing is harmless
+    if (first && h->count > 0) {
+        lora_timer_heap_program(h, h->ops->now());
+    }
+}
+
+IRAM_ATTR void lora_timer_heap_expire(lora_timer_heap_t *h) {
+    uint32_t now = h->ops->now();
+
+    h->stats.irqs++;
+    // a callback may start or stop timers, the heap is consistent each time
+    while (h->count > 0 && (int32_t)(h->heap[0]->Timestamp - now) <= 0) {
+        TimerEvent_t *obj = h->heap[0];
+        lora_timer_heap_remove(h, 0);
+        h->stats.expired++;
+        h->ops->expired(obj);
+    }
+    if (h->count > 0) {
+        lora_timer_heap_program(h, now);
+    }
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+// a timer being initialized may hold anything, it's only trusted if the
+// heap agrees
+static IRAM_ATTR bool lora_timer_heap_holds(lora_timer_heap_t *h, const TimerEvent_t *obj) {
+    return obj->IsRunning && obj->HeapIndex < h->count && h->heap[obj->HeapIndex] == obj;
+}
+
+static IRAM_ATTR bool lora_timer_heap_before(const TimerEvent_t *a, const TimerEvent_t *b) {
+    int32_t diff = (int32_t)(a->Timestamp - b->Timestamp);
+    if (diff != 0) {
+        return diff < 0;
+    }
+    return (int32_t)(a->Seq - b->Seq) < 0;
+}
+
+static IRAM_ATTR void lora_timer_heap_place(lora_timer_heap_t *h, TimerEvent_t *obj, uint32_t i) {
+    h->heap[i] = obj;
+    obj->HeapIndex = i;
+}
+
+static IRAM_ATTR void lora_timer_heap_up(lora_timer_heap_t *h, uint32_t i) {
+    TimerEvent_t *obj = h->heap[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!lora_timer_heap_before(obj, h->heap[parent])) {
+            break;
+        }
+        lora_timer_heap_place(h, h->heap[parent], i);
+        i = parent;
+    }
+    lora_timer_heap_place(h, obj, i);
+}
+
+static IRAM_ATTR void lora_timer_heap_down(lora_timer_heap_t *h, uint32_t i) {
+    TimerEvent_t *obj = h->heap[i];
+    for ( ; ; ) {
+        uint32_t child = 2 * i + 1;
+        if (child >= h->count) {
+            break;
+        }
+        if (child + 1 < h->count && lora_timer_heap_before(h->heap[child + 1], h->heap[child])) {
+            child++;
+        }
+        if (!lora_timer_heap_before(h->heap[child], obj)) {
+            break;
+        }
+        lora_timer_heap_place(h, h->heap[child], i);
+        i = child;
+    }
+    lora_timer_heap_place(h, obj, i);
+}
+
+static IRAM_ATTR void lora_timer_heap_remove(lora_timer_heap_t *h, uint32_t i) {
+    h->heap[i]->IsRunning = false;
+    h->count--;
+    if (i < h->count) {
+        // the last one takes its place, and goes whichever way it must
+        TimerEvent_t *last = h->heap[h->count];
+        lora_timer_heap_place(h, last, i);
+        lora_timer_heap_up(h, i);
+        lora_timer_heap_down(h, last->HeapIndex);
+    }
+    h->heap[h->count] = NULL;
+}
+
+static IRAM_ATTR void lora_timer_heap_program(lora_timer_heap_t *h, uint32_t now) {
+    int32_t delay = (int32_t)(h->heap[0]->Timestamp - now);
+    h->ops->hw_start(delay > 0 ? delay : 0);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_TIMER_HEAP_H_
+#define LORA_TIMER_HEAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lora/system/timer.h"
+
+// The running timers of the LoRa stack (lib/lora/system/timer.c), with no
+// dependency on the IDF.  They're kept in a binary heap ordered by the time
+// they expire at, each knowing its place in it, so a timer is started or
+// stopped in O(log n) and without a search, and the hardware is only
+// programmed for the first one.  When it fires, every timer that's due is
+// taken out in one go and handed to the expired op, in the order they were
+// due, those due at the same time in the order they were started.
+//
+// The caller keeps the calls from running concurrently: timer.c runs them
+// in an atomic section or in the timer interrupt.
+
+#ifndef LORA_TIMER_HEAP_SIZE
+#define LORA_TIMER_HEAP_SIZE            (32)
+#endif
+
+typedef struct _lora_timer_heap_ops_t {
+    // the time in ms, free running
+    uint32_t (*now)(void);
+    // programs the hardware to call lora_timer_heap_expire in delay ms
+    void (*hw_start)(uint32_t delay);
+    // a timer expired
+    void (*expired)(TimerEvent_t *obj);
+} lora_timer_heap_ops_t;
+
+typedef struct _lora_timer_heap_stats_t {
+    uint32_t starts;
+    uint32_t stops;                     // timers stopped while running
+    uint32_t expired;
+    uint32_t irqs;                      // calls to lora_timer_heap_expire
+    uint32_t full;                      // timers that couldn't be started
+    uint32_t high_water;                // the most timers ever running
+} lora_timer_heap_stats_t;
+
+typedef struct _lora_timer_heap_t {
+    const lora_timer_heap_ops_t *ops;
+    TimerEvent_t *heap[LORA_TIMER_HEAP_SIZE];
+    uint32_t count;
+    uint32_t seq;                       // stamps the starts, to order the ties
+    lora_timer_heap_stats_t stats;
+} lora_timer_heap_t;
+
+void lora_timer_heap_init(lora_timer_heap_t *h, const lora_timer_heap_ops_t *ops);
+
+// Starts obj, to expire in obj->ReloadValue ms.  Does nothing if it's
+// already running; returns false if the heap is full.
+bool lora_timer_heap_start(lora_timer_heap_t *h, TimerEvent_t *obj);
+
+// Stops obj, if it's running.  obj may be a timer that was never
+// initialized.
+void lora_timer_heap_stop(lora_timer_heap_t *h, TimerEvent_t *obj);
+
+// The hardware timer fired: the timers that are due expire, and it's
+// programmed for the next one.
+void lora_timer_heap_expire(lora_timer_heap_t *h);
+
+#endif /* LORA_TIMER_HEAP_H_ */
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lora_tx_sched.h"
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static int32_t lora_tx_sched_cmp(const lora_tx_msg_t *ma, const lora_tx_msg_t *mb);
+static bool lora_tx_sched_before(lora_tx_sched_t *s, uint32_t a, uint32_t b);
+static void lora_tx_sched_swap(lora_tx_sched_t *s, uint32_t i, uint32_t j);
+static void lora_tx_sched_up(lora_tx_sched_t *s, uint32_t i);
+static void lora_tx_sched_down(lora_tx_sched_t *s, uint32_t i);
+static void lora_tx_sched_remove(lora_tx_sched_t *s, uint32_t i);
+static void lora_tx_sched_expire(lora_tx_sched_t *s, uint32_t now);
+static void lora_tx_sched_refill(lora_tx_sched_t *s, uint32_t now);
+static uint32_t lora_tx_sched_wait(lora_tx_sched_t *s, const lora_tx_msg_t *msg);
+static uint32_t lora_tx_sched_wait_air(lora_tx_sched_t *s, uint32_t air_time);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_tx_sched_init(lora_tx_sched_t *s, const lora_tx_sched_ops_t *ops, void *ctx) {
+    memset(s, 0, sizeof(*s));
+    s->ops = ops;
+    s->ctx = ctx;
+    s->next_id = 1;
+    for (uint32_t i = 0; i < LORA_TX_SCHED_DEPTH; i++) {
+        s->free[i] = i;
+    }
+}
+
+void lora_tx_sched_set_band(lora_tx_sched_t *s, uint32_t band, uint32_t dcycle, uint32_t window, uint32_t now) {
+    if (band >= LORA_TX_SCHED_BANDS) {
+        return;
+    }
+    lora_tx_band_t *b = &s->bands[band];
+    b->dcycle = (dcycle > 1) ? dcycle : 0;
+    b->window = window;
+    b->credit = window;
+    b->updated_at = now;
+}
+
+uint32_t lora_tx_sched_put(lora_tx_sched_t *s, const lora_tx_msg_t *msg) {
+    if (msg->coalesce) {
+        for (uint32_t i = 0; i < s->count; i++) {
+            lora_tx_msg_t *m = &s->msgs[s->heap[i]];
+            if (m->coalesce && m->port == msg->port && m->dr == msg->dr && m->confirmed == msg->confirmed &&
+                m->len + msg->len <= s->ops->max_payload(s->ctx, m->dr)) {
+                memcpy(m->data + m->len, msg->data, msg->len);
+                m->len += msg->len;
+                // it goes with the more urgent of the two, which only moves it up
+                if (msg->priority > m->priority) {
+                    m->priority = msg->priority;
+                }
+                if (msg->has_deadline && (!m->has_deadline || (int32_t)(msg->deadline - m->deadline) < 0)) {
+                    m->has_deadline = true;
+                    m->deadline = msg->deadline;
+                }
+                lora_tx_sched_up(s, i);
+                s->stats.coalesced++;
+                return m->id;
+            }
+        }
+    }
+
+    if (s->count == LORA_TX_SCHED_DEPTH) {
+        s->stats.full++;
+        return 0;
+    }
+    uint32_t slot = s->free[LORA_TX_SCHED_DEPTH - 1 - s->count];
+    lora_tx_msg_t *m = &s->msgs[slot];
+    memcpy(m, msg, sizeof(*m));
+    if (m->priority >= LORA_TX_SCHED_PRIORITIES) {
+        m->priority = LORA_TX_SCHED_PRIORITIES - 1;
+    }
+    m->id = s->next_id++;
+    if (s->next_id == 0) {
+        s->next_id = 1;
+    }
+    s->heap[s->count] = slot;
+    lora_tx_sched_up(s, s->count++);
+    s->stats.queued++;
+    return m->id;
+}
+
+bool lora_tx_sched_take(lora_tx_sched_t *s, uint32_t now, lora_tx_msg_t *msg, uint32_t *wait) {
+    lora_tx_sched_expire(s, now);
+    if (s->count == 0) {
+        *wait = LORA_TX_SCHED_NEVER;
+        return false;
+    }
+
+    lora_tx_sched_refill(s, now);
+    lora_tx_msg_t *head = &s->msgs[s->heap[0]];
+    uint32_t w = lora_tx_sched_wait(s, head);
+    if (w > 0) {
+        s->stats.delayed++;
+        // it may expire first
+        if (head->has_deadline && (int32_t)(head->deadline - now) >= 0 && head->deadline - now + 1 < w) {
+            w = head->deadline - now + 1;
+        }
+        *wait = w;
+        return false;
+    }
+
+    memcpy(msg, head, sizeof(*msg));
+    lora_tx_sched_remove(s, 0);
+    s->stats.sent++;
+    return true;
+}
+
+void lora_tx_sched_sent(lora_tx_sched_t *s, uint32_t band, uint32_t air_time, uint32_t now) {
+    if (band >= LORA_TX_SCHED_BANDS) {
+        return;
+    }
+    lora_tx_sched_refill(s, now);
+    lora_tx_band_t *b = &s->bands[band];
+    if (b->dcycle) {
+        b->credit -= air_time * b->dcycle;
+    }
+}
+
+uint32_t lora_tx_sched_depth(lora_tx_sched_t *s) {
+    return s->count;
+}
+
+uint32_t lora_tx_sched_eta(lora_tx_sched_t *s, uint32_t now) {
+    if (s->count == 0) {
+        return LORA_TX_SCHED_NEVER;
+    }
+    lora_tx_sched_refill(s, now);
+    return lora_tx_sched_wait(s, &s->msgs[s->heap[0]]);
+}
+
+uint32_t lora_tx_sched_eta_msg(lora_tx_sched_t *s, const lora_tx_msg_t *msg, uint32_t now) {
+    uint32_t ahead = 0;
+
+    lora_tx_sched_refill(s, now);
+    // queued after the others of its rank
+    for (uint32_t i = 0; i < s->count; i++) {
+        const lora_tx_msg_t *m = &s->msgs[s->heap[i]];
+        if (lora_tx_sched_cmp(m, msg) <= 0) {
+            ahead += s->ops->time_on_air(s->ctx, m->dr, m->len);
+        }
+    }
+    return ahead + lora_tx_sched_wait_air(s, ahead + s->ops->time_on_air(s->ctx, msg->dr, msg->len));
+}
+
+void lora_tx_sched_flush(lora_tx_sched_t *s) {
+    while (s->count > 0) {
+        lora_tx_sched_remove(s, s->count - 1);
+    }
+}
+
+// Semtech AN1200.13
+uint32_t lora_tx_sched_air_time(uint32_t sf, uint32_t bw, uint32_t len) {
+    if (bw == 0) {
+        // preamble, sync word, length, payload and CRC
+        uint32_t bits = (5 + 3 + 1 + len + 2) * 8;
+        return (bits + sf - 1) / sf;
+    }
+
+    uint32_t t_sym = ((1 << sf) * 1000000ULL) / bw;        // us
+    uint32_t de = (t_sym >= 16000) ? 1 : 0;
+    int32_t num = 8 * len - 4 * sf + 28 + 16;
+    int32_t den = 4 * (sf - 2 * de);
+    uint32_t symbols = 8;
+    if (num > 0) {
+        symbols += ((num + den - 1) / den) * 5;
+    }
+    // the preamble is 8 + 4.25 symbols
+    uint32_t us = symbols * t_sym + (49 * t_sym) / 4;
+    return (us + 999) / 1000;
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+// < 0 if ma goes first: the higher priority, then the earlier deadline
+static int32_t lora_tx_sched_cmp(const lora_tx_msg_t *ma, const lora_tx_msg_t *mb) {
+    if (ma->priority != mb->priority) {
+        return (ma->priority > mb->priority) ? -1 : 1;
+    }
+    if (ma->has_deadline != mb->has_deadline) {
+        return (ma->has_deadline) ? -1 : 1;
+    }
+    if (ma->has_deadline && ma->deadline != mb->deadline) {
+        return ((int32_t)(ma->deadline - mb->deadline) < 0) ? -1 : 1;
+    }
+    return 0;
+}
+
+// then the first queued
+static bool lora_tx_sched_before(lora_tx_sched_t *s, uint32_t a, uint32_t b) {
+    const lora_tx_msg_t *ma = &s->msgs[s->heap[a]];
+    const lora_tx_msg_t *mb = &s->msgs[s->heap[b]];
+    int32_t cmp = lora_tx_sched_cmp(ma, mb);
+
+    if (cmp != 0) {
+        return cmp < 0;
+    }
+    return (int32_t)(ma->id - mb->id) < 0;
+}
+
+static void lora_tx_sched_swap(lora_tx_sched_t *s, uint32_t i, uint32_t j) {
+    uint8_t t = s->heap[i];
+    s->heap[i] = s->heap[j];
+    s->heap[j] = t;
+}
+
+static void lora_tx_sched_up(lora_tx_sched_t *s, uint32_t i) {
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!lora_tx_sched_before(s, i, parent)) {
+            break;
+        }
+        lora_tx_sched_swap(s, i, parent);
+        i = parent;
+    }
+}
+
+static void lora_tx_sched_down(lora_tx_sched_t *s, uint32_t i) {
+    for ( ; ; ) {
+        uint32_t first = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
+        if (left < s->count && lora_tx_sched_before(s, left, first)) {
+            first = left;
+        }
+        if (right < s->count && lora_tx_sched_before(s, right, first)) {
+            first = right;
+        }
+        if (first == i) {
+            break;
+        }
+        lora_tx_sched_swap(s, i, first);
+        i = first;
+    }
+}
+
+static void lora_tx_sched_remove(lora_tx_sched_t *s, uint32_t i) {
+    uint8_t slot = s->heap[i];
+
+    s->count--;
+    s->free[LORA_TX_SCHED_DEPTH - 1 - s->count] = slot;
+    if (i < s->count) {
+        s->heap[i] = s->heap[s->count];
+        lora_tx_sched_up(s, i);
+        lora_tx_sched_down(s, i);
+    }
+}
+
+static void lora_tx_sched_expire(lora_tx_sched_t *s, uint32_t now) {
+    for (uint32_t i = 0; i < s->count; ) {
+        lora_tx_msg_t *m = &s->msgs[s->heap[i]];
+        if (m->has_deadline && (int32_t)(now - m->deadline) > 0) {
+            s->stats.expired++;
+            s->ops->expired(s->ctx, m);
+            // what took its place is looked at again
+            lora_tx_sched_remove(s, i);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
+
+static void lora_tx_sched_refill(lora_tx_sched_t *s, uint32_t now) {
+    for (uint32_t i = 0; i < LORA_TX_SCHED_BANDS; i++) {
+        lora_tx_band_t *b = &s->bands[i];
+        int32_t elapsed = now - b->updated_at;
+        if (elapsed <= 0) {
+            continue;
+        }
+        b->updated_at = now;
+        if (elapsed >= (int32_t)b->window - b->credit) {
+            b->credit = b->window;
+        } else {
+            b->credit += elapsed;
+        }
+    }
+}
+
+// how long msg waits for the bands in use to have its air time
+static uint32_t lora_tx_sched_wait(lora_tx_sched_t *s, const lora_tx_msg_t *msg) {
+    return lora_tx_sched_wait_air(s, s->ops->time_on_air(s->ctx, msg->dr, msg->len));
+}
+
+static uint32_t lora_tx_sched_wait_air(lora_tx_sched_t *s, uint32_t air_time) {
+    uint32_t mask = s->ops->bands_in_use(s->ctx);
+    uint32_t wait = 0;
+
+    for (uint32_t i = 0; i < LORA_TX_SCHED_BANDS; i++) {
+        lora_tx_band_t *b = &s->bands[i];
+        if (!(mask & (1 << i)) || b->dcycle == 0) {
+            continue;
+        }
+        int32_t cost = air_time * b->dcycle;
+        // more than the band ever holds, it goes when it's full
+        if (cost > (int32_t)b->window) {
+            cost = b->window;
+        }
+        if (b->credit < cost && (uint32_t)(cost - b->credit) > wait) {
+            wait = cost - b->credit;
+        }
+    }
+    return wait;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_TX_SCHED_H_
+#define LORA_TX_SCHED_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The queue of the LoRaWAN uplinks waiting for their turn, with no
+// dependency on the IDF.  It's a binary heap ordered by priority, then by
+// deadline, then by the order they were queued in.  The first one is sent
+// as soon as the duty cycle allows it: each band earns air time as a
+// fraction of the time that passes, up to what it earns over a window, and
+// spends it when a frame goes out on it.  With a window of about a frame's
+// air time times the duty cycle, a band never sends more than its share over
+// an hour and one frame, as with the MAC's own time-off.  As the MAC picks
+// the channel, a frame waits until every band in use can take it.
+//
+// A message that passes its deadline before it could go is dropped.  One
+// queued with coalesce is appended to a message waiting for the same port,
+// if the two fit in a frame.
+//
+// The caller keeps the calls from running concurrently.
+
+#ifndef LORA_TX_SCHED_DEPTH
+#define LORA_TX_SCHED_DEPTH             (8)
+#endif
+
+#define LORA_TX_SCHED_PAYLOAD_MAX       (255)
+#define LORA_TX_SCHED_BANDS             (6)
+#define LORA_TX_SCHED_PRIORITIES        (4)
+
+#define LORA_TX_SCHED_NEVER             (0xFFFFFFFF)
+
+// the header and MIC of a LoRaWAN frame, without options
+#define LORA_TX_SCHED_FRAME_OVERHEAD    (13)
+
+typedef struct _lora_tx_msg_t {
+    uint32_t id;                        // set when it's queued
+    uint32_t deadline;                  // ms, if has_deadline
+    bool has_deadline;
+    bool confirmed;
+    bool coalesce;
+    uint8_t priority;                   // 0 is the lowest
+    uint8_t port;
+    uint8_t dr;
+    uint16_t len;
+    uint8_t data[LORA_TX_SCHED_PAYLOAD_MAX];
+} lora_tx_msg_t;
+
+typedef struct _lora_tx_sched_ops_t {
+    // ms on air of a frame carrying len bytes at dr
+    uint32_t (*time_on_air)(void *ctx, uint8_t dr, uint32_t len);
+    // the most bytes a frame carries at dr
+    uint32_t (*max_payload)(void *ctx, uint8_t dr);
+    // the bands with a channel the MAC may pick, a bit each
+    uint32_t (*bands_in_use)(void *ctx);
+    // msg passed its deadline and was dropped
+    void (*expired)(void *ctx, const lora_tx_msg_t *msg);
+} lora_tx_sched_ops_t;
+
+typedef struct _lora_tx_band_t {
+    uint32_t dcycle;                    // sends 1/dcycle of the time, 0 if not limited
+    uint32_t window;                    // ms, the most credit it keeps
+    int32_t credit;                     // ms of time passed, a frame costs its air time * dcycle
+    uint32_t updated_at;
+} lora_tx_band_t;
+
+typedef struct _lora_tx_sched_stats_t {
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t expired;
+    uint32_t coalesced;
+    uint32_t full;                      // messages refused
+    uint32_t delayed;                   // takes that found the head waiting for the duty cycle
+} lora_tx_sched_stats_t;
+
+typedef struct _lora_tx_sched_t {
+    const lora_tx_sched_ops_t *ops;
+    void *ctx;
+    lora_tx_msg_t msgs[LORA_TX_SCHED_DEPTH];
+    uint8_t heap[LORA_TX_SCHED_DEPTH];  // indexes in msgs
+    uint8_t free[LORA_TX_SCHED_DEPTH];
+    uint32_t count;
+    uint32_t next_id;
+    lora_tx_band_t bands[LORA_TX_SCHED_BANDS];
+    lora_tx_sched_stats_t stats;
+} lora_tx_sched_t;
+
+void lora_tx_sched_init(lora_tx_sched_t *s, const lora_tx_sched_ops_t *ops, void *ctx);
+
+// Limits band to 1/dcycle of the time over window ms, starting with full
+// credit; 0 or 1 takes the limit off.
+void lora_tx_sched_set_band(lora_tx_sched_t *s, uint32_t band, uint32_t dcycle, uint32_t window, uint32_t now);
+
+// Queues a copy of msg.  Returns its id, or the id of the message it was
+// appended to, 0 if the queue is full.
+uint32_t lora_tx_sched_put(lora_tx_sched_t *s, const lora_tx_msg_t *msg);
+
+// Takes the message to send now, if there's one, and drops the expired
+// ones.  Otherwise *wait is set to when to ask again, LORA_TX_SCHED_NEVER
+// if the queue is empty.
+bool lora_tx_sched_take(lora_tx_sched_t *s, uint32_t now, lora_tx_msg_t *msg, uint32_t *wait);
+
+// A frame spent air_time ms on band.
+void lora_tx_sched_sent(lora_tx_sched_t *s, uint32_t band, uint32_t air_time, uint32_t now);
+
+uint32_t lora_tx_sched_depth(lora_tx_sched_t *s);
+
+// ms until the first message can go, LORA_TX_SCHED_NEVER if there's none.
+uint32_t lora_tx_sched_eta(lora_tx_sched_t *s, uint32_t now);
+
+// About how many ms msg would wait if it were queued now: the air time of
+// the messages that go before it, and the duty cycle's wait for theirs and
+// its own.
+uint32_t lora_tx_sched_eta_msg(lora_tx_sched_t *s, const lora_tx_msg_t *msg, uint32_t now);
+
+// Drops every message, without calling expired.
+void lora_tx_sched_flush(lora_tx_sched_t *s);
+
+// ms on air of a LoRa frame of len bytes, LoRaWAN style: 8 symbols of
+// preamble, explicit header, CRC, coding rate 4/5, and low data rate
+// optimization from 16 ms symbols.  With bw 0, sf is an FSK bit rate in
+// kbps, as in the regions' tables.
+uint32_t lora_tx_sched_air_time(uint32_t sf, uint32_t bw, uint32_t len);
+
+#endif /* LORA_TX_SCHED_H_ */
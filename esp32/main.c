@@ -212,3 +212,61 @@ void app_sys_register_evt_cb(main_app_sys_evt_t sys_evt, system_event_cb_t cb)
         main_evt_cb_list[sys_evt] = cb;
     }
 }
+
+#if MICROPY_EMIT_NATIVE
+// each block of code in IRAM is kept in a list so they can all be freed when
+// the VM goes away at a soft reset
+typedef struct _native_code_node_t {
+    struct _native_code_node_t *next;
+    uint32_t data[];
+} native_code_node_t;
+
+static native_code_node_t *native_code_head = NULL;
+
+/******************************************************************************
+ * FunctionName : esp_native_code_commit
+ * Description  : copies native machine code (compiled at runtime or loaded
+ *                from an .mpy file) into executable IRAM. The code is fully
+ *                position independent (runtime helpers are reached through
+ *                mp_fun_table in the const table and qstrs are already linked)
+ *                so a plain copy is enough. IRAM only supports 32-bit
+ *                accesses, hence the word-by-word copy; the last word is
+ *                padded with zeros rather than read past the end of buf.
+ * Parameters   : buf - the code buffer, len - its length in bytes
+ * Returns      : pointer to the executable copy of the code
+*******************************************************************************/
+void *esp_native_code_commit(void *buf, size_t len) {
+    size_t words = (len + 3) / 4;
+    native_code_node_t *node = heap_caps_malloc(sizeof(native_code_node_t) + words * 4, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+    if (node == NULL) {
+        m_malloc_fail(len);
+    }
+    const uint8_t *src = buf;
+    for (size_t i = 0; i < len / 4; ++i, src += 4) {
+        node->data[i] = src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+    }
+    if (len % 4 != 0) {
+        uint32_t w = 0;
+        for (size_t i = 0; i < len % 4; ++i) {
+            w |= (uint32_t)src[i] << (8 * i);
+        }
+        node->data[words - 1] = w;
+    }
+    node->next = native_code_head;
+    native_code_head = node;
+    return node->data;
+}
+
+/******************************************************************************
+ * FunctionName : esp_native_code_free_all
+ * Description  : frees the IRAM of all the native code committed, called at a
+ *                soft reset once nothing can reference it any more
+*******************************************************************************/
+void esp_native_code_free_all(void) {
+    while (native_code_head != NULL) {
+        native_code_node_t *next = native_code_head->next;
+        heap_caps_free(native_code_head);
+        native_code_head = next;
+    }
+}
+#endif
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #include "py/mpconfig.h"
 #include "py/mpstate.h"
@@ -29,6 +30,15 @@
 #include "pycom_config.h"
 #include "mpirq.h"
 #include "modlora.h"
+#include "lora_fsm.h"
+#include "lora_rx_ring.h"
+#include "lora_fuota.h"
+#include "lora_aes_hw.h"
+#include "lora_tx_sched.h"
+#include "lora_aggr.h"
+#include "lora_session.h"
+#include "lora_capture.h"
+#include "updater.h"
 
 #include "esp_heap_caps.h"
 #include "sdkconfig.h"
@@ -42,9 +52,11 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/event_groups.h"
 
 #include "lora/mac/LoRaMacTest.h"
+#include "lora/system/crypto/lora_aes.h"
 #include "lora/mac/region/Region.h"
 #include "lora/mac/region/RegionAS923.h"
 #include "lora/mac/region/RegionAU915.h"
@@ -89,6 +101,9 @@
 
 #define LORA_JOIN_WAIT_MS                           (50)
 
+// the size of the MAC commands buffers of LoRaMac.c
+#define LORAWAN_SESSION_MAC_CMD_SIZE                (128)
+
 #define LORAWAN_SOCKET_GET_FD(sd)                   (sd & 0xFF)
 
 #define LORAWAN_SOCKET_IS_CONFIRMED(sd)             ((sd & 0x40000000) == 0x40000000)
@@ -106,11 +121,38 @@
 
 #define LORAWAN_SOCKET_GET_DR(sd)                   ((sd >> 16) & 0xFF)
 
+#define LORAWAN_SOCKET_SET_PRIORITY(sd, prio)       (sd &= 0xFCFFFFFF); \
+                                                    (sd |= ((prio & 0x03) << 24))
+
+#define LORAWAN_SOCKET_GET_PRIORITY(sd)             ((sd >> 24) & 0x03)
+
+#define LORAWAN_SOCKET_IS_COALESCE(sd)              ((sd & 0x04000000) == 0x04000000)
+#define LORAWAN_SOCKET_SET_COALESCE(sd)             (sd |= 0x04000000)
+#define LORAWAN_SOCKET_CLR_COALESCE(sd)             (sd &= ~0x04000000)
+
+#define LORAWAN_SOCKET_IS_AGGREGATE(sd)             ((sd & 0x08000000) == 0x08000000)
+#define LORAWAN_SOCKET_SET_AGGREGATE(sd)            (sd |= 0x08000000)
+#define LORAWAN_SOCKET_CLR_AGGREGATE(sd)            (sd &= ~0x08000000)
+
+// the width of the fields of the aggregated records, 0, 1, 2 or 4 bytes
+#define LORAWAN_SOCKET_SET_PACK(sd, width)          (sd &= 0xCFFFFFFF); \
+                                                    (sd |= (((width == 4) ? 3 : width) << 28))
+
+#define LORAWAN_SOCKET_GET_PACK(sd)                 ((((sd >> 28) & 0x03) == 3) ? 4 : ((sd >> 28) & 0x03))
+
 
 // callback events
 #define MODLORA_RX_EVENT                            (0x01)
 #define MODLORA_TX_EVENT                            (0x02)
 #define MODLORA_TX_FAILED_EVENT                     (0x04)
+#define MODLORA_FUOTA_EVENT                         (0x08)
+#define MODLORA_BEACON_EVENT                        (0x10)
+
+// how long an aggregated frame waits for more records by default, in ms
+#define MODLORA_AGGR_HOLD_MS                        (60000)
+
+// the longest the session timer of FUOTA is set for, in s
+#define MODLORA_FUOTA_TIMER_STEP_S                  (3600)
 
 #define MODLORA_NVS_NAMESPACE                       "LORA_NVM"
 
@@ -124,22 +166,6 @@ typedef enum {
     E_LORA_STACK_MODE_LORAWAN
 } lora_stack_mode_t;
 
-typedef enum {
-    E_LORA_STATE_NOINIT = 0,
-    E_LORA_STATE_IDLE,
-    E_LORA_STATE_JOIN,
-    E_LORA_STATE_LINK_CHECK,
-    E_LORA_STATE_RX,
-    E_LORA_STATE_RX_DONE,
-    E_LORA_STATE_RX_TIMEOUT,
-    E_LORA_STATE_RX_ERROR,
-    E_LORA_STATE_TX,
-    E_LORA_STATE_TX_DONE,
-    E_LORA_STATE_TX_TIMEOUT,
-    E_LORA_STATE_SLEEP,
-    E_LORA_STATE_RESET
-} lora_state_t;
-
 typedef enum {
     E_LORA_MODE_ALWAYS_ON = 0,
     E_LORA_MODE_TX_ONLY,
@@ -171,7 +197,6 @@ typedef struct {
     LoRaMacRegion_t   region;
     lora_stack_mode_t stack_mode;
     DeviceClass_t     device_class;
-    lora_state_t      state;
     uint32_t          frequency;
     uint32_t          rx_timestamp;
     uint32_t          net_id;
@@ -225,24 +250,16 @@ typedef struct {
     bool              adr;
     bool              public;
     bool              joined;
-    bool              reset;
     uint8_t           events;
     uint8_t           trigger;
     uint8_t           tx_trials;
 } lora_obj_t;
 
-typedef struct {
-    uint32_t    index;
-    uint32_t    size;
-    uint8_t     data[LORA_PAYLOAD_SIZE_MAX];
-    uint8_t     port;
-} lora_partial_rx_packet_t;
-
 /******************************************************************************
  DECLARE PRIVATE DATA
  ******************************************************************************/
 static QueueHandle_t xCmdQueue;
-static QueueHandle_t xRxQueue;
+static SemaphoreHandle_t xRxSem;
 static QueueHandle_t xCbQueue;
 static EventGroupHandle_t LoRaEvents;
 
@@ -252,17 +269,82 @@ static LoRaMacPrimitives_t LoRaMacPrimitives;
 static LoRaMacCallback_t LoRaMacCallbacks;
 
 static lora_obj_t lora_obj;
-static lora_partial_rx_packet_t lora_partial_rx_packet;
-static lora_rx_data_t rx_data_isr;
+// the received packets, waiting for MicroPython; xRxSem is given when one
+// is queued
+static lora_rx_ring_t lora_rx_ring;
+static uint8_t lora_rx_ring_buf[LORA_RX_RING_SIZE];
+// the metadata of every frame received in raw LoRa mode, when capture() is
+// on; the records are allocated the first time
+static lora_capture_t lora_capture;
+static lora_capture_rec_t *lora_capture_recs;
+static volatile bool lora_capture_on;
 
 static TimerEvent_t TxNextActReqTimer;
 
+// the LoRaWAN uplinks waiting for their turn under the duty cycle; MicroPython
+// puts them and the LoRa task takes them, holding xTxSchedMutex
+static lora_tx_sched_t lora_tx_sched;
+static SemaphoreHandle_t xTxSchedMutex;
+static TimerEvent_t TxSchedTimer;
+static lora_tx_msg_t lora_tx_sched_msg;
+static volatile uint32_t lora_tx_sending_id;        // 0 if the uplink on air isn't from the queue
+static volatile uint32_t lora_tx_done_id;
+static volatile EventBits_t lora_tx_done_status;
+
+// the frame the records of the aggregating sockets are packed in, under
+// xTxSchedMutex too
+static lora_aggr_t lora_aggr;
+static lora_tx_msg_t lora_aggr_frame;
+
+// firmware updates over the air (TS004 and TS005), allocated when enabled
+static lora_fuota_t *lora_fuota;
+static bool lora_fuota_enabled;
+static bool lora_fuota_updated;
+static MulticastParams_t lora_fuota_mc[LORA_FUOTA_MC_GROUPS];
+static bool lora_fuota_mc_linked[LORA_FUOTA_MC_GROUPS];
+static TimerEvent_t FuotaSessionTimer;
+static struct {
+    int8_t group;                   // of the class C session, -1 if none
+    bool running;
+    uint32_t wait_s;                // left after the timer expires
+    DeviceClass_t prev_class;
+    Rx2ChannelParams_t prev_rx2;
+} lora_fuota_session = { .group = -1 };
+
+static lora_fsm_t lora_fsm;
+
+// the session kept by nvram_save(), only the fields that changed are written;
+// the frame counters are also in RTC memory, which deep sleep keeps
+static lora_session_t lora_session;
+static RTC_DATA_ATTR lora_session_rtc_t lora_session_rtc;
+static struct {
+    uint32_t dev_addr;
+    uint32_t net_id;
+    uint8_t nwk_skey[16];
+    uint8_t app_skey[16];
+} lorawan_session_keys;
+static struct {
+    uint8_t srv_ack_req;
+    uint8_t next_tx;
+    uint8_t index;
+    uint8_t repeat_index;
+    uint8_t buffer[LORAWAN_SESSION_MAC_CMD_SIZE];
+    uint8_t repeat[LORAWAN_SESSION_MAC_CMD_SIZE];
+} lorawan_session_mac;
+// the keys of the session as firmware before the versioned store kept it,
+// a key per value; erased once it's taken, so that it's never taken over a
+// newer session
+static const char *lorawan_legacy_keys[] = {
+    "UPLNK", "DWLNK", "DEVADDR", "NWSKEY", "APPSKEY", "NETID", "ADRACK", "MACPARAMS", "CHANNELS",
+    "SRVACK", "MACNXTTX", "MACBUFIDX", "MACRPTIDX", "MACBUF", "MACRPTBUF", "CHANMASK", "CHANMASKREM"
+};
+static bool lorawan_legacy_gone;                    // erased since the boot
+static bool lorawan_session_restored;
+static uint32_t lorawan_session_restore_ms;
+static uint32_t lorawan_session_wake_to_tx_ms;      // 0 until the first uplink after the restore
+
 static nvs_handle modlora_nvs_handle;
-static const char *modlora_nvs_data_key[E_LORA_NVS_NUM_KEYS] = { "JOINED", "UPLNK", "DWLNK", "DEVADDR",
-                                                                 "NWSKEY", "APPSKEY", "NETID", "ADRACK",
-                                                                 "MACPARAMS", "CHANNELS", "SRVACK", "MACNXTTX",
-                                                                 "MACBUFIDX", "MACRPTIDX", "MACBUF", "MACRPTBUF",
-                                                                 "REGION", "CHANMASK", "CHANMASKREM" };
+static const char *modlora_nvs_data_key[E_LORA_NVS_NUM_KEYS] = { "JOINED", "REGION" };
 /******************************************************************************
  DECLARE PUBLIC DATA
  ******************************************************************************/
@@ -273,6 +355,16 @@ extern TaskHandle_t xLoRaTaskHndl;
  ******************************************************************************/
 static void TASK_LoRa (void *pvParameters);
 static void TASK_LoRa_Timer (void *pvParameters);
+static lora_fsm_cmd_result_t lora_task_command (bool retry);
+static void lora_task_mac_state (lora_state_t state);
+static uint32_t lora_task_wait (uint32_t timeout_ms);
+static void lora_task_notify (uint32_t events);
+static uint32_t lora_task_ticks_ms (void);
+static void lora_task_radio_reset (void);
+static void lora_task_radio_sleep (void);
+static void lora_task_radio_rx (void);
+static void lora_task_tx_end (bool timeout);
+static void lora_state_from_isr (lora_state_t state);
 static void OnTxDone (void);
 static void OnRxDone (uint8_t *payload, uint32_t timestamp, uint16_t size, int16_t rssi, int8_t snr, uint8_t sf);
 static void OnTxTimeout (void);
@@ -294,6 +386,43 @@ static bool lora_rx_any (void);
 static bool lora_tx_space (void);
 static void lora_callback_handler (void *arg);
 static bool lorawan_nvs_open (void);
+static bool lorawan_nvs_get (void *ctx, const char *key, void *buf, uint32_t *len);
+static bool lorawan_nvs_set (void *ctx, const char *key, const void *buf, uint32_t len);
+static bool lorawan_nvs_commit (void *ctx);
+static void lorawan_session_setup (LoRaMacRegion_t region);
+static bool lorawan_session_load (void);
+static bool lorawan_session_store (void);
+static void lorawan_session_counters (lora_session_counters_t *counters);
+static void lorawan_session_uplink (void);
+static bool lorawan_legacy_get_u32 (const char *key, uint32_t *value);
+static bool lorawan_legacy_read (void *scratch, lora_session_counters_t *counters);
+static void lorawan_legacy_upgrade (void *scratch);
+static void lorawan_legacy_erase (void);
+static int32_t lorawan_send_aggregated (const lora_tx_msg_t *msg, uint8_t width);
+static bool lorawan_flush (void);
+static void lora_fuota_send (void *ctx, uint8_t port, const uint8_t *data, uint32_t len);
+static void lora_fuota_encrypt (void *ctx, const uint8_t *key, const uint8_t *in, uint8_t *out);
+static void lora_fuota_mc_set (void *ctx, uint8_t id, const lora_fuota_mc_group_t *group);
+static void lora_fuota_mc_session (void *ctx, uint8_t id, const lora_fuota_mc_group_t *group, uint32_t start_in);
+static bool lora_fuota_freq_ok (void *ctx, uint32_t freq);
+static bool lora_fuota_dr_ok (void *ctx, uint8_t dr);
+static uint32_t lora_fuota_gps_time (void *ctx);
+static uint32_t lora_gps_time (void);
+static int32_t lora_fuota_block_open (void *ctx, uint32_t size, uint32_t frag_size);
+static bool lora_fuota_block_write (void *ctx, uint32_t offset, const uint8_t *buf, uint32_t len);
+static bool lora_fuota_block_read (void *ctx, uint32_t offset, uint8_t *buf, uint32_t len);
+static void lora_fuota_block_done (void *ctx, uint32_t size, uint32_t descriptor);
+static void lora_fuota_session_step (void);
+static void lora_fuota_session_stop (void);
+static uint32_t lora_tx_sched_time_on_air (void *ctx, uint8_t dr, uint32_t len);
+static uint32_t lora_tx_sched_max_payload (void *ctx, uint8_t dr);
+static uint32_t lora_tx_sched_bands_in_use (void *ctx);
+static void lora_tx_sched_expired (void *ctx, const lora_tx_msg_t *msg);
+static void lora_tx_sched_setup (void);
+static bool lora_tx_sched_next (void);
+static void lora_tx_sched_spent (uint32_t frequency, uint32_t air_time);
+static void lora_tx_end (EventBits_t status);
+static void OnTxSchedTimerEvent (void);
 
 static int lora_socket_socket (mod_network_socket_obj_t *s, int *_errno);
 static void lora_socket_close (mod_network_socket_obj_t *s);
@@ -309,6 +438,47 @@ static int lora_socket_sendto (struct _mod_network_socket_obj_t *s, const byte *
 static bool lora_lbt_is_free(void);
 STATIC mp_obj_t lora_nvram_erase (mp_obj_t self_in);
 
+static const lora_fsm_ops_t lora_fsm_ops = {
+    .wait = lora_task_wait,
+    .notify = lora_task_notify,
+    .ticks_ms = lora_task_ticks_ms,
+    .command = lora_task_command,
+    .mac_state = lora_task_mac_state,
+    .radio_reset = lora_task_radio_reset,
+    .radio_sleep = lora_task_radio_sleep,
+    .radio_rx = lora_task_radio_rx,
+    .tx_end = lora_task_tx_end,
+};
+
+static const lora_fuota_ops_t lora_fuota_ops = {
+    .send = lora_fuota_send,
+    .encrypt = lora_fuota_encrypt,
+    .mc_set = lora_fuota_mc_set,
+    .mc_session = lora_fuota_mc_session,
+    .freq_ok = lora_fuota_freq_ok,
+    .dr_ok = lora_fuota_dr_ok,
+    .gps_time = lora_fuota_gps_time,
+    .block_open = lora_fuota_block_open,
+    .block = {
+        .write = lora_fuota_block_write,
+        .read = lora_fuota_block_read,
+    },
+    .block_done = lora_fuota_block_done,
+};
+
+static const lora_session_ops_t lora_session_ops = {
+    .get = lorawan_nvs_get,
+    .set = lorawan_nvs_set,
+    .commit = lorawan_nvs_commit,
+};
+
+static const lora_tx_sched_ops_t lora_tx_sched_ops = {
+    .time_on_air = lora_tx_sched_time_on_air,
+    .max_payload = lora_tx_sched_max_payload,
+    .bands_in_use = lora_tx_sched_bands_in_use,
+    .expired = lora_tx_sched_expired,
+};
+
 /******************************************************************************
  DECLARE PUBLIC DATA
  ******************************************************************************/
@@ -321,9 +491,13 @@ SemaphoreHandle_t xLoRaSigfoxSem;
  ******************************************************************************/
 void modlora_init0(void) {
     xCmdQueue = xQueueCreate(LORA_CMD_QUEUE_SIZE_MAX, sizeof(lora_cmd_data_t));
-    xRxQueue = xQueueCreate(LORA_DATA_QUEUE_SIZE_MAX, sizeof(lora_rx_data_t));
+    xRxSem = xSemaphoreCreateBinary();
+    lora_rx_ring_init(&lora_rx_ring, lora_rx_ring_buf, LORA_RX_RING_SIZE);
     xCbQueue = xQueueCreate(LORA_CB_QUEUE_SIZE_MAX, sizeof(modlora_timerCallback));
     LoRaEvents = xEventGroupCreate();
+    xTxSchedMutex = xSemaphoreCreateMutex();
+    lora_tx_sched_init(&lora_tx_sched, &lora_tx_sched_ops, NULL);
+    lora_aggr_init(&lora_aggr, &lora_tx_sched_ops, NULL, MODLORA_AGGR_HOLD_MS);
 #if defined(FIPY) || defined(LOPY4)
     xLoRaSigfoxSem = xSemaphoreCreateMutex();
 #endif
@@ -336,6 +510,11 @@ void modlora_init0(void) {
     BoardInitMcu();
     BoardInitPeriph();
 
+    // the MIC and encryption of the uplinks in the AES peripheral, the
+    // downlinks are checked in the radio interrupt with the tables
+    lora_aes_set_backend(&lora_aes_hw);
+
+    lora_fsm_init(&lora_fsm, &lora_fsm_ops);
     xTaskCreatePinnedToCore(TASK_LoRa, "LoRa", LORA_STACK_SIZE / sizeof(StackType_t), NULL, LORA_TASK_PRIORITY, &xLoRaTaskHndl, 1);
     xTaskCreatePinnedToCore(TASK_LoRa_Timer, "LoRa_Timer_callback", LORA_TIMER_STACK_SIZE / sizeof(StackType_t), NULL, LORA_TIMER_TASK_PRIORITY, &xLoRaTimerTaskHndl, 1);
 }
@@ -382,7 +561,7 @@ void modlora_sleep_module(void)
 
 bool modlora_is_module_sleep(void)
 {
-    if (lora_obj.state == E_LORA_STATE_SLEEP)
+    if (lora_fsm.state == E_LORA_STATE_SLEEP)
     {
         return true;
     }
@@ -457,36 +636,331 @@ static bool lorawan_nvs_open (void) {
     return true;
 }
 
-static int32_t lorawan_send (const byte *buf, uint32_t len, uint32_t timeout_ms, bool confirmed, uint32_t dr, uint32_t port) {
-    lora_cmd_data_t cmd_data;
+static bool lorawan_nvs_get (void *ctx, const char *key, void *buf, uint32_t *len) {
+    size_t length = *len;
+    if (ESP_OK != nvs_get_blob(modlora_nvs_handle, key, buf, &length)) {
+        return false;
+    }
+    *len = length;
+    return true;
+}
 
-    cmd_data.cmd = E_LORA_CMD_LORAWAN_TX;
-    memcpy (cmd_data.info.tx.data, buf, len);
-    cmd_data.info.tx.len = len;
-    cmd_data.info.tx.dr = dr;
+static bool lorawan_nvs_set (void *ctx, const char *key, const void *buf, uint32_t len) {
+    return ESP_OK == nvs_set_blob(modlora_nvs_handle, key, buf, len);
+}
+
+static bool lorawan_nvs_commit (void *ctx) {
+    return ESP_OK == nvs_commit(modlora_nvs_handle);
+}
+
+// the fields of the session, for the MAC of the region just initialized
+static void lorawan_session_setup (LoRaMacRegion_t region) {
+    ChannelParams_t *channels;
+    uint16_t *channelmask;
+    uint32_t length;
+
+    lora_session_init(&lora_session, &lora_session_ops, NULL, region);
+    // first, it tells the sessions apart
+    lora_session_add(&lora_session, "LS_KEYS", &lorawan_session_keys, sizeof(lorawan_session_keys));
+    lora_session_add(&lora_session, "LS_PARAMS", LoRaMacGetMacParams(), sizeof(LoRaMacParams_t));
+    LoRaMacGetChannelList(&channels, &length);
+    lora_session_add(&lora_session, "LS_CHAN", channels, length);
+    if (LoRaMacGetChannelsMask(&channelmask, &length)) {
+        lora_session_add(&lora_session, "LS_MASK", channelmask, length);
+    }
+    if (LoRaMacGetChannelsMaskRemaining(&channelmask, &length)) {
+        lora_session_add(&lora_session, "LS_MASKREM", channelmask, length);
+    }
+    lora_session_add(&lora_session, "LS_MAC", &lorawan_session_mac, sizeof(lorawan_session_mac));
+}
+
+// the MAC parameters and channels are copied in place, the rest is set here
+static bool lorawan_session_load (void) {
+    MibRequestConfirm_t mibReq;
+    lora_session_counters_t counters;
+    uint32_t start = mp_hal_ticks_ms();
+    void *scratch;
+    bool restored;
+
+    scratch = heap_caps_malloc(lora_session_size(&lora_session), MALLOC_CAP_8BIT);
+    if (!scratch) {
+        return false;
+    }
+    lorawan_legacy_upgrade(scratch);
+    restored = lora_session_restore(&lora_session, &counters, &lora_session_rtc, scratch);
+    heap_caps_free(scratch);
+    if (!restored) {
+        return false;
+    }
+    lora_obj.net_id = lorawan_session_keys.net_id;
+    lora_obj.u.abp.DevAddr = lorawan_session_keys.dev_addr;
+    memcpy(lora_obj.u.abp.NwkSKey, lorawan_session_keys.nwk_skey, sizeof(lora_obj.u.abp.NwkSKey));
+    memcpy(lora_obj.u.abp.AppSKey, lorawan_session_keys.app_skey, sizeof(lora_obj.u.abp.AppSKey));
+
+    mibReq.Type = MIB_UPLINK_COUNTER;
+    mibReq.Param.UpLinkCounter = counters.up;
+    LoRaMacMibSetRequestConfirm(&mibReq);
+    mibReq.Type = MIB_DOWNLINK_COUNTER;
+    mibReq.Param.DownLinkCounter = counters.down;
+    LoRaMacMibSetRequestConfirm(&mibReq);
+    *LoRaMacGetAdrAckCounter() = counters.adr_ack;
+
+    *LoRaMacGetSrvAckRequested() = lorawan_session_mac.srv_ack_req;
+    *LoRaMacGetMacCmdNextTx() = lorawan_session_mac.next_tx;
+    *LoRaMacGetMacCmdBufferIndex() = lorawan_session_mac.index;
+    *LoRaMacGetMacCmdBufferRepeatIndex() = lorawan_session_mac.repeat_index;
+    memcpy(LoRaMacGetMacCmdBuffer(), lorawan_session_mac.buffer, LORAWAN_SESSION_MAC_CMD_SIZE);
+    memcpy(LoRaMacGetMacCmdBufferRepeat(), lorawan_session_mac.repeat, LORAWAN_SESSION_MAC_CMD_SIZE);
+
+    lorawan_session_restored = true;
+    lorawan_session_restore_ms = mp_hal_ticks_ms() - start;
+    lorawan_session_wake_to_tx_ms = 0;
+    return true;
+}
+
+static bool lorawan_session_store (void) {
+    MibRequestConfirm_t mibReq;
+    lora_session_counters_t counters;
+
+    mibReq.Type = MIB_DEV_ADDR;
+    LoRaMacMibGetRequestConfirm(&mibReq);
+    lorawan_session_keys.dev_addr = mibReq.Param.DevAddr;
+    mibReq.Type = MIB_NET_ID;
+    LoRaMacMibGetRequestConfirm(&mibReq);
+    lorawan_session_keys.net_id = mibReq.Param.NetID;
+    mibReq.Type = MIB_NWK_SKEY;
+    LoRaMacMibGetRequestConfirm(&mibReq);
+    memcpy(lorawan_session_keys.nwk_skey, mibReq.Param.NwkSKey, sizeof(lorawan_session_keys.nwk_skey));
+    mibReq.Type = MIB_APP_SKEY;
+    LoRaMacMibGetRequestConfirm(&mibReq);
+    memcpy(lorawan_session_keys.app_skey, mibReq.Param.AppSKey, sizeof(lorawan_session_keys.app_skey));
+
+    lorawan_session_mac.srv_ack_req = *LoRaMacGetSrvAckRequested();
+    lorawan_session_mac.next_tx = *LoRaMacGetMacCmdNextTx();
+    lorawan_session_mac.index = *LoRaMacGetMacCmdBufferIndex();
+    lorawan_session_mac.repeat_index = *LoRaMacGetMacCmdBufferRepeatIndex();
+    memcpy(lorawan_session_mac.buffer, LoRaMacGetMacCmdBuffer(), LORAWAN_SESSION_MAC_CMD_SIZE);
+    memcpy(lorawan_session_mac.repeat, LoRaMacGetMacCmdBufferRepeat(), LORAWAN_SESSION_MAC_CMD_SIZE);
+
+    lorawan_session_counters(&counters);
+    return lora_session_save(&lora_session, &counters, &lora_session_rtc);
+}
+
+static void lorawan_session_counters (lora_session_counters_t *counters) {
+    MibRequestConfirm_t mibReq;
+
+    mibReq.Type = MIB_UPLINK_COUNTER;
+    LoRaMacMibGetRequestConfirm(&mibReq);
+    counters->up = mibReq.Param.UpLinkCounter;
+    mibReq.Type = MIB_DOWNLINK_COUNTER;
+    LoRaMacMibGetRequestConfirm(&mibReq);
+    counters->down = mibReq.Param.DownLinkCounter;
+    counters->adr_ack = *LoRaMacGetAdrAckCounter();
+}
+
+static bool lorawan_legacy_get_u32 (const char *key, uint32_t *value) {
+    return ESP_OK == nvs_get_u32(modlora_nvs_handle, key, value);
+}
+
+// reads the legacy session into scratch and the fields of the store; the
+// MAC parameters and channels are only copied in place once every value is
+// there, with the size it has in this firmware
+static bool lorawan_legacy_read (void *scratch, lora_session_counters_t *counters) {
+    struct {
+        const char *key;
+        void *data;
+        uint32_t len;
+    } blobs[4];
+    ChannelParams_t *channels;
+    uint16_t *channelmask;
+    uint32_t nb_blobs = 0, flags[4], length;
+    uint8_t *data = scratch;
+
+    blobs[nb_blobs].key = "MACPARAMS";
+    blobs[nb_blobs].data = LoRaMacGetMacParams();
+    blobs[nb_blobs++].len = sizeof(LoRaMacParams_t);
+    LoRaMacGetChannelList(&channels, &length);
+    blobs[nb_blobs].key = "CHANNELS";
+    blobs[nb_blobs].data = channels;
+    blobs[nb_blobs++].len = length;
+    if (LoRaMacGetChannelsMask(&channelmask, &length)) {
+        blobs[nb_blobs].key = "CHANMASK";
+        blobs[nb_blobs].data = channelmask;
+        blobs[nb_blobs++].len = length;
+    }
+    if (LoRaMacGetChannelsMaskRemaining(&channelmask, &length)) {
+        blobs[nb_blobs].key = "CHANMASKREM";
+        blobs[nb_blobs].data = channelmask;
+        blobs[nb_blobs++].len = length;
+    }
+
+    if (!lorawan_legacy_get_u32("UPLNK", &counters->up) || !lorawan_legacy_get_u32("DWLNK", &counters->down) ||
+        !lorawan_legacy_get_u32("ADRACK", &counters->adr_ack) ||
+        !lorawan_legacy_get_u32("DEVADDR", &lorawan_session_keys.dev_addr) ||
+        !lorawan_legacy_get_u32("NETID", &lorawan_session_keys.net_id) ||
+        !lorawan_legacy_get_u32("SRVACK", &flags[0]) || !lorawan_legacy_get_u32("MACNXTTX", &flags[1]) ||
+        !lorawan_legacy_get_u32("MACBUFIDX", &flags[2]) || !lorawan_legacy_get_u32("MACRPTIDX", &flags[3])) {
+        return false;
+    }
+    length = sizeof(lorawan_session_keys.nwk_skey);
+    if (!lorawan_nvs_get(NULL, "NWSKEY", lorawan_session_keys.nwk_skey, &length) || length != sizeof(lorawan_session_keys.nwk_skey)) {
+        return false;
+    }
+    length = sizeof(lorawan_session_keys.app_skey);
+    if (!lorawan_nvs_get(NULL, "APPSKEY", lorawan_session_keys.app_skey, &length) || length != sizeof(lorawan_session_keys.app_skey)) {
+        return false;
+    }
+    length = LORAWAN_SESSION_MAC_CMD_SIZE;
+    if (!lorawan_nvs_get(NULL, "MACBUF", lorawan_session_mac.buffer, &length) || length != LORAWAN_SESSION_MAC_CMD_SIZE) {
+        return false;
+    }
+    length = LORAWAN_SESSION_MAC_CMD_SIZE;
+    if (!lorawan_nvs_get(NULL, "MACRPTBUF", lorawan_session_mac.repeat, &length) || length != LORAWAN_SESSION_MAC_CMD_SIZE) {
+        return false;
+    }
+    for (uint32_t i = 0; i < nb_blobs; i++) {
+        length = blobs[i].len;
+        if (!lorawan_nvs_get(NULL, blobs[i].key, data, &length) || length != blobs[i].len) {
+            return false;
+        }
+        data += length;
+    }
+
+    data = scratch;
+    for (uint32_t i = 0; i < nb_blobs; i++) {
+        memcpy(blobs[i].data, data, blobs[i].len);
+        data += blobs[i].len;
+    }
+    lorawan_session_mac.srv_ack_req = flags[0] != 0;
+    lorawan_session_mac.next_tx = flags[1] != 0;
+    lorawan_session_mac.index = flags[2];
+    lorawan_session_mac.repeat_index = flags[3];
+    return true;
+}
+
+// a session left by firmware before the versioned store goes in the store,
+// once, and takes the place of any session there
+static void lorawan_legacy_upgrade (void *scratch) {
+    lora_session_counters_t counters;
+    uint32_t up;
+
+    if (lorawan_legacy_gone) {
+        return;
+    }
+    if (lorawan_legacy_get_u32("UPLNK", &up) && lorawan_legacy_read(scratch, &counters) &&
+        !lora_session_save(&lora_session, &counters, NULL)) {
+        // kept for the next boot
+        return;
+    }
+    // in the store now, incomplete, or none
+    lorawan_legacy_erase();
+    nvs_commit(modlora_nvs_handle);
+}
+
+static void lorawan_legacy_erase (void) {
+    if (!lorawan_legacy_gone) {
+        for (uint32_t i = 0; i < MP_ARRAY_SIZE(lorawan_legacy_keys); i++) {
+            nvs_erase_key(modlora_nvs_handle, lorawan_legacy_keys[i]);
+        }
+        lorawan_legacy_gone = true;
+    }
+}
+
+// keeps the RTC copy of the counters exact, from the LoRa task
+static void lorawan_session_uplink (void) {
+    lora_session_counters_t counters;
+
+    lorawan_session_counters(&counters);
+    lora_session_rtc_update(&lora_session_rtc, &counters);
+
+    if (lorawan_session_restored && lorawan_session_wake_to_tx_ms == 0) {
+        // since the boot, the wake up from deep sleep
+        lorawan_session_wake_to_tx_ms = mp_hal_ticks_ms();
+    }
+}
+
+// the record goes in the frame being aggregated, send() doesn't wait for it
+static int32_t lorawan_send_aggregated (const lora_tx_msg_t *msg, uint8_t width) {
+    lora_aggr_result_t result;
+
+    xSemaphoreTake(xTxSchedMutex, portMAX_DELAY);
+    // the frame it may close needs a place in the queue
+    if (lora_tx_sched_depth(&lora_tx_sched) == LORA_TX_SCHED_DEPTH) {
+        xSemaphoreGive(xTxSchedMutex);
+        return 0;
+    }
+    result = lora_aggr_put(&lora_aggr, msg, width, lora_task_ticks_ms(), &lora_aggr_frame);
+    if (result == E_LORA_AGGR_CLOSED) {
+        lora_tx_sched_put(&lora_tx_sched, &lora_aggr_frame);
+    }
+    xSemaphoreGive(xTxSchedMutex);
+    if (result == E_LORA_AGGR_INVALID) {
+        return -1;
+    }
+    // the LoRa task sets the timer for when the frame is due
+    lora_fsm_command_queued(&lora_fsm);
+    return msg->len;
+}
+
+// the frame being aggregated goes to the queue now
+static bool lorawan_flush (void) {
+    bool flushed = false;
+
+    xSemaphoreTake(xTxSchedMutex, portMAX_DELAY);
+    if (lora_tx_sched_depth(&lora_tx_sched) == LORA_TX_SCHED_DEPTH) {
+        xSemaphoreGive(xTxSchedMutex);
+        return false;
+    }
+    if (lora_aggr_flush(&lora_aggr, &lora_aggr_frame)) {
+        lora_tx_sched_put(&lora_tx_sched, &lora_aggr_frame);
+        flushed = true;
+    }
+    xSemaphoreGive(xTxSchedMutex);
+    if (flushed) {
+        lora_fsm_command_queued(&lora_fsm);
+    }
+    return true;
+}
+
+static int32_t lorawan_send (const byte *buf, uint32_t len, uint32_t timeout_ms, bool confirmed, uint32_t dr, uint32_t port,
+                             uint8_t priority, bool coalesce, uint32_t deadline_ms, bool aggregate, uint8_t width) {
+    lora_tx_msg_t msg;
+    uint32_t id;
+
+    memset(&msg, 0, sizeof(msg) - sizeof(msg.data));
+    memcpy (msg.data, buf, len);
+    msg.len = len;
+    msg.dr = dr;
+    msg.priority = priority;
+    msg.coalesce = coalesce;
+    if (deadline_ms > 0) {
+        msg.has_deadline = true;
+        msg.deadline = lora_task_ticks_ms() + deadline_ms;
+    }
     if (lora_obj.ComplianceTest.Enabled && lora_obj.ComplianceTest.Running) {
-        cmd_data.info.tx.port = 224;  // MAC commands port
+        msg.port = 224;  // MAC commands port
         if (lora_obj.ComplianceTest.IsTxConfirmed) {
-            cmd_data.info.tx.confirmed = true;
+            msg.confirmed = true;
         } else {
-            cmd_data.info.tx.confirmed = false;
+            msg.confirmed = false;
         }
+        msg.coalesce = false;
     } else {
-        cmd_data.info.tx.confirmed = confirmed;
-        cmd_data.info.tx.port = port;    // data port
-    }
-
-    if (timeout_ms < 0) {
-        // blocking mode
-        timeout_ms = portMAX_DELAY;
+        msg.confirmed = confirmed;
+        msg.port = port;    // data port
+        if (aggregate) {
+            return lorawan_send_aggregated(&msg, width);
+        }
     }
 
-    xEventGroupClearBits(LoRaEvents, LORA_STATUS_COMPLETED | LORA_STATUS_ERROR | LORA_STATUS_MSG_SIZE);
-
-    // just pass to the LoRa queue
-    if (!xQueueSend(xCmdQueue, (void *)&cmd_data, (TickType_t)(timeout_ms / portTICK_PERIOD_MS))) {
+    // the LoRa task sends it when the duty cycle allows
+    xSemaphoreTake(xTxSchedMutex, portMAX_DELAY);
+    id = lora_tx_sched_put(&lora_tx_sched, &msg);
+    xSemaphoreGive(xTxSchedMutex);
+    if (id == 0) {
         return 0;
     }
+    lora_fsm_command_queued(&lora_fsm);
 
     // validate the message size with the requested data rate
     if (false == ValidatePayloadLength(len, dr, 0)) {
@@ -495,16 +969,21 @@ static int32_t lorawan_send (const byte *buf, uint32_t len, uint32_t timeout_ms,
     }
 
     if (timeout_ms != 0) {
-        uint32_t result = xEventGroupWaitBits(LoRaEvents,
-                                              LORA_STATUS_COMPLETED | LORA_STATUS_ERROR | LORA_STATUS_MSG_SIZE,
-                                              pdTRUE,   // clear on exit
-                                              pdFALSE,  // do not wait for all bits
-                                              (TickType_t)portMAX_DELAY);
-
-        if (result & LORA_STATUS_MSG_SIZE) {
-            return -1;
-        } else if (result & LORA_STATUS_ERROR) {
-            return 0;
+        // the uplinks queued before it end first; the id is checked again now
+        // and then in case another caller cleared the bits
+        while ((int32_t)(lora_tx_done_id - id) < 0) {
+            xEventGroupWaitBits(LoRaEvents,
+                                LORA_STATUS_COMPLETED | LORA_STATUS_ERROR | LORA_STATUS_MSG_SIZE,
+                                pdTRUE,   // clear on exit
+                                pdFALSE,  // do not wait for all bits
+                                (TickType_t)(100 / portTICK_PERIOD_MS));
+        }
+        if (lora_tx_done_id == id) {
+            if (lora_tx_done_status & LORA_STATUS_MSG_SIZE) {
+                return -1;
+            } else if (lora_tx_done_status & LORA_STATUS_ERROR) {
+                return 0;
+            }
         }
     }
     // return the number of bytes sent
@@ -513,6 +992,12 @@ static int32_t lorawan_send (const byte *buf, uint32_t len, uint32_t timeout_ms,
 
 static void McpsConfirm (McpsConfirm_t *McpsConfirm) {
     uint32_t status = LORA_STATUS_COMPLETED;
+
+    if (McpsConfirm->TxTimeOnAir > 0) {
+        // every retry of a confirmed uplink was on air as long
+        lora_tx_sched_spent(McpsConfirm->UpLinkFrequency, McpsConfirm->TxTimeOnAir * MAX(1, McpsConfirm->NbRetries));
+        lorawan_session_uplink();
+    }
     if (McpsConfirm->Status == LORAMAC_EVENT_INFO_STATUS_OK) {
         // save the values before calling the event handler
         lora_obj.sftx = McpsConfirm->Datarate;
@@ -528,8 +1013,8 @@ static void McpsConfirm (McpsConfirm_t *McpsConfirm) {
                 if (lora_obj.trigger & MODLORA_TX_EVENT) {
                     mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
                 }
-                lora_obj.state = E_LORA_STATE_IDLE;
-                xEventGroupSetBits(LoRaEvents, status);
+                lora_fsm_set_state(&lora_fsm, E_LORA_STATE_IDLE);
+                lora_tx_end(status);
                 break;
             }
             case MCPS_CONFIRMED:
@@ -539,8 +1024,8 @@ static void McpsConfirm (McpsConfirm_t *McpsConfirm) {
                     if (lora_obj.trigger & MODLORA_TX_EVENT) {
                         mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
                     }
-                    lora_obj.state = E_LORA_STATE_IDLE;
-                    xEventGroupSetBits(LoRaEvents, status);
+                    lora_fsm_set_state(&lora_fsm, E_LORA_STATE_IDLE);
+                    lora_tx_end(status);
                 } else {
                     // the ack wasn't received, so the stack will re-transmit
                 }
@@ -555,9 +1040,9 @@ static void McpsConfirm (McpsConfirm_t *McpsConfirm) {
         if (lora_obj.trigger & MODLORA_TX_FAILED_EVENT) {
             mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
         }
-        lora_obj.state = E_LORA_STATE_IDLE;
+        lora_fsm_set_state(&lora_fsm, E_LORA_STATE_IDLE);
         status |= LORA_STATUS_ERROR;
-        xEventGroupSetBits(LoRaEvents, status);
+        lora_tx_end(status);
     }
 #if defined(FIPY) || defined(LOPY4)
     xSemaphoreGive(xLoRaSigfoxSem);
@@ -620,12 +1105,14 @@ static void McpsIndication (McpsIndication_t *mcpsIndication) {
     // printf("MCPS indication!=%d :%d\n", mcpsIndication->BufferSize, mcpsIndication->Port);
 
     if (mcpsIndication->RxData && mcpsIndication->BufferSize > 0) {
-        if (mcpsIndication->Port > 0 && mcpsIndication->Port < 224) {
+        if (lora_fuota_enabled && lora_fuota_input(lora_fuota, mcpsIndication->Port, mcpsIndication->Buffer,
+                                                   mcpsIndication->BufferSize, mcpsIndication->Multicast)) {
+            // taken by the FUOTA packages
+        } else if (mcpsIndication->Port > 0 && mcpsIndication->Port < 224) {
             if (mcpsIndication->BufferSize <= LORA_PAYLOAD_SIZE_MAX) {
-                memcpy((void *)rx_data_isr.data, mcpsIndication->Buffer, mcpsIndication->BufferSize);
-                rx_data_isr.len = mcpsIndication->BufferSize;
-                rx_data_isr.port = mcpsIndication->Port;
-                xQueueSend(xRxQueue, (void *)&rx_data_isr, 0);
+                if (lora_rx_ring_put(&lora_rx_ring, mcpsIndication->Buffer, mcpsIndication->BufferSize, mcpsIndication->Port)) {
+                    xSemaphoreGive(xRxSem);
+                }
                 lora_obj.events |= MODLORA_RX_EVENT;
                 if (lora_obj.trigger & MODLORA_RX_EVENT) {
                     mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
@@ -652,7 +1139,7 @@ static void McpsIndication (McpsIndication_t *mcpsIndication) {
                         lora_obj.ComplianceTest.State = 1;
 
                         // flush the rx queue
-                        xQueueReset(xRxQueue);
+                        lora_rx_ring_flush(&lora_rx_ring);
 
                         // enable ADR during test mode
                         MibRequestConfirm_t mibReq;
@@ -698,10 +1185,9 @@ static void McpsIndication (McpsIndication_t *mcpsIndication) {
                     case 4: // (vii)
                         // return the payload
                         if (bDoEcho) {
-                            if (mcpsIndication->BufferSize <= LORA_PAYLOAD_SIZE_MAX) {
-                                memcpy((void *)rx_data_isr.data, mcpsIndication->Buffer, mcpsIndication->BufferSize);
-                                rx_data_isr.len = mcpsIndication->BufferSize;
-                                xQueueSend(xRxQueue, (void *)&rx_data_isr, 0);
+                            if (mcpsIndication->BufferSize <= LORA_PAYLOAD_SIZE_MAX &&
+                                lora_rx_ring_put(&lora_rx_ring, mcpsIndication->Buffer, mcpsIndication->BufferSize, mcpsIndication->Port)) {
+                                xSemaphoreGive(xRxSem);
                             }
                         } else {
                             // set the state back to 1
@@ -711,7 +1197,7 @@ static void McpsIndication (McpsIndication_t *mcpsIndication) {
                         break;
                     case 5: // (viii)
                         // trigger a link check
-                        lora_obj.state = E_LORA_STATE_LINK_CHECK;
+                        lora_fsm_set_state(&lora_fsm, E_LORA_STATE_LINK_CHECK);
                         // printf("Link check\n");
                         break;
                     case 6: // (ix)
@@ -772,7 +1258,7 @@ static void OnTxNextActReqTimerEvent(void) {
             lora_obj.ComplianceTest.Running = false;
             lora_obj.ComplianceTest.DownLinkCounter = 0;
         } else {
-            lora_obj.state = E_LORA_STATE_JOIN;
+            lora_fsm_set_state(&lora_fsm, E_LORA_STATE_JOIN);
         }
     }
 }
@@ -787,408 +1273,368 @@ static void MlmeIndication( MlmeIndication_t *mlmeIndication )
             OnTxNextActReqTimerEvent( );
             break;
         }
+        case MLME_BEACON:
+        {// The class B beacon was acquired, or lost and the MAC is back in class A
+            if (mlmeIndication->Status == LORAMAC_EVENT_INFO_STATUS_BEACON_LOST) {
+                lora_obj.device_class = CLASS_A;
+            }
+            lora_obj.events |= MODLORA_BEACON_EVENT;
+            if (lora_obj.trigger & MODLORA_BEACON_EVENT) {
+                mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
+            }
+            break;
+        }
         default:
             break;
     }
 }
 
 static void TASK_LoRa (void *pvParameters) {
+    lora_obj.pwr_mode = E_LORA_MODE_ALWAYS_ON;
+
+    for ( ; ; ) {
+        // sleeps until there's something to do
+        lora_fsm_step(&lora_fsm);
+        TimerLowPowerHandler();
+    }
+}
+
+static lora_fsm_cmd_result_t lora_task_command (bool retry) {
     MibRequestConfirm_t mibReq;
-    MlmeReq_t mlmeReq;
     McpsReq_t mcpsReq;
     bool isReset;
 
-    lora_obj.state = E_LORA_STATE_NOINIT;
-    lora_obj.pwr_mode = E_LORA_MODE_ALWAYS_ON;
+    // a command kept for a retry is still in task_cmd_data
+    if (!retry && !xQueueReceive(xCmdQueue, &task_cmd_data, 0)) {
+        // then the next uplink, if its time has come
+        if (!lora_tx_sched_next()) {
+            return E_LORA_FSM_CMD_NONE;
+        }
+    }
 
-    for ( ; ; ) {
-        vTaskDelay (2 / portTICK_PERIOD_MS);
+    switch (task_cmd_data.cmd) {
+    case E_LORA_CMD_INIT:
+        isReset = lora_fsm.state == E_LORA_STATE_RESET? true:false;
+        // save the new configuration first
+        lora_set_config(&task_cmd_data);
+        if (task_cmd_data.info.init.stack_mode == E_LORA_STACK_MODE_LORAWAN) {
+            LoRaMacPrimitives.MacMcpsConfirm = McpsConfirm;
+            LoRaMacPrimitives.MacMcpsIndication = McpsIndication;
+            LoRaMacPrimitives.MacMlmeConfirm = MlmeConfirm;
+            LoRaMacPrimitives.MacMlmeIndication = MlmeIndication;
+            LoRaMacCallbacks.GetBatteryLevel = BoardGetBatteryLevel;
+            LoRaMacCallbacks.GetGpsTime = lora_gps_time;
+            // the MAC's frames aren't captured
+            lora_capture_on = false;
+            LoRaMacInitialization(&LoRaMacPrimitives, &LoRaMacCallbacks, task_cmd_data.info.init.region);
+            lorawan_session_setup(task_cmd_data.info.init.region);
+
+            // the session of nvram_restore(), before the settings below which
+            // depend on the MAC parameters it holds
+            lorawan_session_restored = false;
+            if (lora_obj.joined && !lorawan_session_load()) {
+                // incomplete, or from another firmware, the MAC starts over
+                LoRaMacInitialization(&LoRaMacPrimitives, &LoRaMacCallbacks, task_cmd_data.info.init.region);
+                lora_obj.joined = false;
+            }
 
-        if(lora_obj.reset)
-        {
-            Radio.Reset();
-            lora_obj.state = E_LORA_STATE_RESET;
-            lora_obj.reset = false;
-        }
-        switch (lora_obj.state) {
-        case E_LORA_STATE_NOINIT:
-        case E_LORA_STATE_IDLE:
-        case E_LORA_STATE_RX:
-        case E_LORA_STATE_SLEEP:
-        case E_LORA_STATE_RESET:
-            // receive from the command queue and act accordingly
-            if (xQueueReceive(xCmdQueue, &task_cmd_data, 0)) {
-                switch (task_cmd_data.cmd) {
-                case E_LORA_CMD_INIT:
-                    isReset = lora_obj.state == E_LORA_STATE_RESET? true:false;
-                    // save the new configuration first
-                    lora_set_config(&task_cmd_data);
-                    if (task_cmd_data.info.init.stack_mode == E_LORA_STACK_MODE_LORAWAN) {
-                        LoRaMacPrimitives.MacMcpsConfirm = McpsConfirm;
-                        LoRaMacPrimitives.MacMcpsIndication = McpsIndication;
-                        LoRaMacPrimitives.MacMlmeConfirm = MlmeConfirm;
-                        LoRaMacPrimitives.MacMlmeIndication = MlmeIndication;
-                        LoRaMacCallbacks.GetBatteryLevel = BoardGetBatteryLevel;
-                        LoRaMacInitialization(&LoRaMacPrimitives, &LoRaMacCallbacks, task_cmd_data.info.init.region);
-
-                        TimerStop(&TxNextActReqTimer);
-                        TimerInit(&TxNextActReqTimer, OnTxNextActReqTimerEvent);
-                        TimerSetValue(&TxNextActReqTimer, OVER_THE_AIR_ACTIVATION_DUTYCYCLE);
+            TimerStop(&TxNextActReqTimer);
+            TimerInit(&TxNextActReqTimer, OnTxNextActReqTimerEvent);
+            TimerSetValue(&TxNextActReqTimer, OVER_THE_AIR_ACTIVATION_DUTYCYCLE);
+            TimerInit(&FuotaSessionTimer, lora_fuota_session_step);
+            TimerStop(&TxSchedTimer);
+            TimerInit(&TxSchedTimer, OnTxSchedTimerEvent);
+            lora_fuota_session.group = -1;
+            lora_fuota_session.running = false;
 
-                        mibReq.Type = MIB_ADR;
-                        mibReq.Param.AdrEnable = task_cmd_data.info.init.adr;
-                        LoRaMacMibSetRequestConfirm(&mibReq);
+            mibReq.Type = MIB_ADR;
+            mibReq.Param.AdrEnable = task_cmd_data.info.init.adr;
+            LoRaMacMibSetRequestConfirm(&mibReq);
 
-                        mibReq.Type = MIB_PUBLIC_NETWORK;
-                        mibReq.Param.EnablePublicNetwork = task_cmd_data.info.init.public;
-                        LoRaMacMibSetRequestConfirm(&mibReq);
+            mibReq.Type = MIB_PUBLIC_NETWORK;
+            mibReq.Param.EnablePublicNetwork = task_cmd_data.info.init.public;
+            LoRaMacMibSetRequestConfirm(&mibReq);
 
-                        mibReq.Type = MIB_DEVICE_CLASS;
-                        mibReq.Param.Class = task_cmd_data.info.init.device_class;
-                        LoRaMacMibSetRequestConfirm(&mibReq);
+            mibReq.Type = MIB_DEVICE_CLASS;
+            mibReq.Param.Class = task_cmd_data.info.init.device_class;
+            LoRaMacMibSetRequestConfirm(&mibReq);
 
-                        LoRaMacTestSetDutyCycleOn(false);
+            LoRaMacTestSetDutyCycleOn(false);
 
-                        // check if we have already joined the network
-                        if (lora_obj.joined) {
-                            uint32_t length;
-                            bool result = true;
-                            result &= modlora_nvs_get_uint(E_LORA_NVS_ELE_NET_ID, (uint32_t *)&lora_obj.net_id);
-                            result &= modlora_nvs_get_uint(E_LORA_NVS_ELE_DEVADDR, (uint32_t *)&lora_obj.u.abp.DevAddr);
-                            length = 16;
-                            result &= modlora_nvs_get_blob(E_LORA_NVS_ELE_NWSKEY, (void *)lora_obj.u.abp.NwkSKey, &length);
-                            length = 16;
-                            result &= modlora_nvs_get_blob(E_LORA_NVS_ELE_APPSKEY, (void *)lora_obj.u.abp.AppSKey, &length);
-
-                            uint32_t uplinks, downlinks;
-                            result &= modlora_nvs_get_uint(E_LORA_NVS_ELE_UPLINK, &uplinks);
-                            result &= modlora_nvs_get_uint(E_LORA_NVS_ELE_DWLINK, &downlinks);
-                            result &= modlora_nvs_get_uint(E_LORA_NVS_ELE_ADR_ACKS, LoRaMacGetAdrAckCounter());
-
-                            if (result) {
-                                mibReq.Type = MIB_UPLINK_COUNTER;
-                                mibReq.Param.UpLinkCounter = uplinks;
-                                LoRaMacMibSetRequestConfirm( &mibReq );
-
-                                mibReq.Type = MIB_DOWNLINK_COUNTER;
-                                mibReq.Param.DownLinkCounter = downlinks;
-                                LoRaMacMibSetRequestConfirm( &mibReq );
-
-                                // write the MAC params directly from the NVRAM
-                                length = sizeof(LoRaMacParams_t);
-                                modlora_nvs_get_blob(E_LORA_NVS_ELE_MAC_PARAMS, (void *)LoRaMacGetMacParams(), &length);
-
-                                // write the channel list directly from the NVRAM
-                                ChannelParams_t *channels;
-                                LoRaMacGetChannelList(&channels, &length);
-                                modlora_nvs_get_blob(E_LORA_NVS_ELE_CHANNELS, channels, &length);
-
-                                // write the channel mask directly from the NVRAM
-                                uint16_t *channelmask;
-                                if (LoRaMacGetChannelsMask(&channelmask, &length)) {
-                                    modlora_nvs_get_blob(E_LORA_NVS_ELE_CHANNELMASK, channelmask, &length);
-                                }
-
-                                // write the channel mask remaining directly from the NVRAM
-                                if (LoRaMacGetChannelsMaskRemaining(&channelmask, &length)) {
-                                    modlora_nvs_get_blob(E_LORA_NVS_ELE_CHANNELMASK_REMAINING, channelmask, &length);
-                                }
-
-                                uint32_t srv_ack_req;
-                                modlora_nvs_get_uint(E_LORA_NVS_ELE_ACK_REQ, (uint32_t *)&srv_ack_req);
-                                bool *ack_req = LoRaMacGetSrvAckRequested();
-                                if (srv_ack_req) {
-                                    *ack_req = true;
-                                } else {
-                                    *ack_req = false;
-                                }
-
-                                uint32_t mac_cmd_next_tx;
-                                modlora_nvs_get_uint(E_LORA_NVS_MAC_NXT_TX, (uint32_t *)&mac_cmd_next_tx);
-                                bool *next_tx = LoRaMacGetMacCmdNextTx();
-                                if (mac_cmd_next_tx) {
-                                    *next_tx = true;
-                                } else {
-                                    *next_tx = false;
-                                }
-
-                                uint32_t mac_cmd_buffer_idx;
-                                modlora_nvs_get_uint(E_LORA_NVS_MAC_CMD_BUF_IDX, (uint32_t *)&mac_cmd_buffer_idx);
-                                uint8_t *buffer_idx = LoRaMacGetMacCmdBufferIndex();
-                                *buffer_idx = mac_cmd_buffer_idx;
-
-                                modlora_nvs_get_uint(E_LORA_NVS_MAC_CMD_BUF_RPT_IDX, (uint32_t *)&mac_cmd_buffer_idx);
-                                buffer_idx = LoRaMacGetMacCmdBufferRepeatIndex();
-                                *buffer_idx = mac_cmd_buffer_idx;
-
-                                // write the buffered MAC commads directly from NVRAM
-                                length = 128;
-                                modlora_nvs_get_blob(E_LORA_NVS_ELE_MAC_BUF, (void *)LoRaMacGetMacCmdBuffer(), &length);
-
-                                // write the buffered MAC commads to repeat directly from NVRAM
-                                length = 128;
-                                modlora_nvs_get_blob(E_LORA_NVS_ELE_MAC_RPT_BUF, (void *)LoRaMacGetMacCmdBufferRepeat(), &length);
-
-                                lora_obj.activation = E_LORA_ACTIVATION_ABP;
-                                lora_obj.state = E_LORA_STATE_JOIN;
-                                // clear the joined flag until the nvram_save method is called again
-                                modlora_nvs_set_uint(E_LORA_NVS_ELE_JOINED, (uint32_t)false);
-                            } else {
-                                lora_obj.state = E_LORA_STATE_IDLE;
-                            }
-                        } else {
-                            lora_obj.state = E_LORA_STATE_IDLE;
-                        }
-                    } else {
-                        // radio initialization
-                        RadioEvents.TxDone = OnTxDone;
-                        RadioEvents.RxDone = OnRxDone;
-                        RadioEvents.TxTimeout = OnTxTimeout;
-                        RadioEvents.RxTimeout = OnRxTimeout;
-                        RadioEvents.RxError = OnRxError;
-                        Radio.Init(&RadioEvents);
-
-                        // radio configuration
-                        lora_radio_setup(&task_cmd_data.info.init);
-                        lora_obj.state = E_LORA_STATE_IDLE;
-                    }
-                    lora_obj.joined = false;
-                    if (lora_obj.state == E_LORA_STATE_IDLE) {
-                        xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
-                    }
-                    if (isReset) {
-                        xEventGroupSetBits(LoRaEvents, LORA_STATUS_RESET_DONE);
-                    }
-                    break;
-                case E_LORA_CMD_JOIN:
-                    lora_obj.joined = false;
-                    lora_obj.activation = task_cmd_data.info.join.activation;
-                    if (lora_obj.activation == E_LORA_ACTIVATION_OTAA) {
-                        memcpy((void *)lora_obj.u.otaa.DevEui, task_cmd_data.info.join.u.otaa.DevEui, sizeof(lora_obj.u.otaa.DevEui));
-                        memcpy((void *)lora_obj.u.otaa.AppEui, task_cmd_data.info.join.u.otaa.AppEui, sizeof(lora_obj.u.otaa.AppEui));
-                        memcpy((void *)lora_obj.u.otaa.AppKey, task_cmd_data.info.join.u.otaa.AppKey, sizeof(lora_obj.u.otaa.AppKey));
-                        lora_obj.otaa_dr = task_cmd_data.info.join.otaa_dr;
-                    } else {
-                        lora_obj.net_id = DEF_LORAWAN_NETWORK_ID;
-                        lora_obj.u.abp.DevAddr = task_cmd_data.info.join.u.abp.DevAddr;
-                        memcpy((void *)lora_obj.u.abp.AppSKey, task_cmd_data.info.join.u.abp.AppSKey, sizeof(lora_obj.u.abp.AppSKey));
-                        memcpy((void *)lora_obj.u.abp.NwkSKey, task_cmd_data.info.join.u.abp.NwkSKey, sizeof(lora_obj.u.abp.NwkSKey));
-                    }
-                    lora_obj.state = E_LORA_STATE_JOIN;
-                    break;
-                case E_LORA_CMD_TX:
-                    // implement Listen-before-Talk LBT, only for LoRa RAW (not LoRaWAN)
-                    if (lora_lbt_is_free()) {
-                        // no activity detected on Lora, so send the pack now
-
-                        // taking sigfox semaphore blocks ?!?!?
-                        // maybe, in the end of TX sempahore has to be released sooner
+            if (lora_obj.joined) {
+                lora_obj.activation = E_LORA_ACTIVATION_ABP;
+                lora_fsm.state = E_LORA_STATE_JOIN;
+            } else {
+                lora_fsm.state = E_LORA_STATE_IDLE;
+            }
+        } else {
+            // radio initialization
+            RadioEvents.TxDone = OnTxDone;
+            RadioEvents.RxDone = OnRxDone;
+            RadioEvents.TxTimeout = OnTxTimeout;
+            RadioEvents.RxTimeout = OnRxTimeout;
+            RadioEvents.RxError = OnRxError;
+            Radio.Init(&RadioEvents);
+
+            // radio configuration
+            lora_radio_setup(&task_cmd_data.info.init);
+            lora_fsm.state = E_LORA_STATE_IDLE;
+        }
+        lora_obj.joined = false;
+        lora_tx_sched_setup();
+        if (lora_fsm.state == E_LORA_STATE_IDLE) {
+            xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
+        }
+        if (isReset) {
+            xEventGroupSetBits(LoRaEvents, LORA_STATUS_RESET_DONE);
+        }
+        break;
+    case E_LORA_CMD_JOIN:
+        lora_obj.joined = false;
+        lora_obj.activation = task_cmd_data.info.join.activation;
+        if (lora_obj.activation == E_LORA_ACTIVATION_OTAA) {
+            memcpy((void *)lora_obj.u.otaa.DevEui, task_cmd_data.info.join.u.otaa.DevEui, sizeof(lora_obj.u.otaa.DevEui));
+            memcpy((void *)lora_obj.u.otaa.AppEui, task_cmd_data.info.join.u.otaa.AppEui, sizeof(lora_obj.u.otaa.AppEui));
+            memcpy((void *)lora_obj.u.otaa.AppKey, task_cmd_data.info.join.u.otaa.AppKey, sizeof(lora_obj.u.otaa.AppKey));
+            lora_obj.otaa_dr = task_cmd_data.info.join.otaa_dr;
+        } else {
+            lora_obj.net_id = DEF_LORAWAN_NETWORK_ID;
+            lora_obj.u.abp.DevAddr = task_cmd_data.info.join.u.abp.DevAddr;
+            memcpy((void *)lora_obj.u.abp.AppSKey, task_cmd_data.info.join.u.abp.AppSKey, sizeof(lora_obj.u.abp.AppSKey));
+            memcpy((void *)lora_obj.u.abp.NwkSKey, task_cmd_data.info.join.u.abp.NwkSKey, sizeof(lora_obj.u.abp.NwkSKey));
+        }
+        lora_fsm.state = E_LORA_STATE_JOIN;
+        break;
+    case E_LORA_CMD_TX:
+        // implement Listen-before-Talk LBT, only for LoRa RAW (not LoRaWAN)
+        if (lora_lbt_is_free()) {
+            // no activity detected on Lora, so send the pack now
+
+            // taking sigfox semaphore blocks ?!?!?
+            // maybe, in the end of TX sempahore has to be released sooner
 //                        #if defined(FIPY) || defined(LOPY4)
 //                            xSemaphoreTake(xLoRaSigfoxSem, portMAX_DELAY);
 //                        #endif
-                        Radio.Send(task_cmd_data.info.tx.data, task_cmd_data.info.tx.len);
-                        lora_obj.state = E_LORA_STATE_TX;
-                    } else {
-                        // activity detected on Lora, so put the TX command back on queue on Front
-                        // to be executed on next Lora task
-                        xQueueSendToFront(xCmdQueue, (void *)&task_cmd_data, (TickType_t)portMAX_DELAY);
-                    }
-                    break;
-                case E_LORA_CMD_CONFIG_CHANNEL:
-                    if (task_cmd_data.info.channel.add) {
-                        ChannelParams_t channel =
-                        { task_cmd_data.info.channel.frequency, 0, {((task_cmd_data.info.channel.dr_max << 4) | task_cmd_data.info.channel.dr_min)}, 0};
-                        ChannelAddParams_t channelAdd = { &channel, task_cmd_data.info.channel.index };
-                        RegionChannelManualAdd(lora_obj.region, &channelAdd);
-                    } else {
-                        ChannelRemoveParams_t channelRemove = { task_cmd_data.info.channel.index };
-                        RegionChannelsManualRemove(lora_obj.region, &channelRemove);
-                    }
-                    xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
-                    break;
-                case E_LORA_CMD_LORAWAN_TX: {
-                        LoRaMacTxInfo_t txInfo;
-                        EventBits_t status = 0;
-                        bool empty_frame = false;
-                        int8_t mac_datarate = 0;
-
-                        // set the new data rate before checking if Tx is possible, but store the current one
-                        if (!lora_obj.adr) {
-                            mibReq.Type = MIB_CHANNELS_DATARATE;
-                            LoRaMacMibGetRequestConfirm( &mibReq );
-                            mac_datarate = mibReq.Param.ChannelsDatarate;
-                            mibReq.Param.ChannelsDatarate = task_cmd_data.info.tx.dr;
-                            LoRaMacMibSetRequestConfirm( &mibReq );
-                        }
-
-                        if (LoRaMacQueryTxPossible (task_cmd_data.info.tx.len, &txInfo) != LORAMAC_STATUS_OK) {
-                            // send an empty frame in order to flush MAC commands
-                            mcpsReq.Type = MCPS_UNCONFIRMED;
-                            mcpsReq.Req.Unconfirmed.fBuffer = NULL;
-                            mcpsReq.Req.Unconfirmed.fBufferSize = 0;
-                            mcpsReq.Req.Unconfirmed.Datarate = task_cmd_data.info.tx.dr;
-                            empty_frame = true;
-                            status |= LORA_STATUS_MSG_SIZE;
-                        } else {
-                            if (task_cmd_data.info.tx.confirmed) {
-                                mcpsReq.Type = MCPS_CONFIRMED;
-                                mcpsReq.Req.Confirmed.fPort = task_cmd_data.info.tx.port;
-                                mcpsReq.Req.Confirmed.fBuffer = task_cmd_data.info.tx.data;
-                                mcpsReq.Req.Confirmed.fBufferSize = task_cmd_data.info.tx.len;
-                                mcpsReq.Req.Confirmed.NbTrials = lora_obj.tx_retries + 1;
-                                mcpsReq.Req.Confirmed.Datarate = task_cmd_data.info.tx.dr;
-                            } else {
-                                mcpsReq.Type = MCPS_UNCONFIRMED;
-                                mcpsReq.Req.Unconfirmed.fPort = task_cmd_data.info.tx.port;
-                                mcpsReq.Req.Unconfirmed.fBuffer = task_cmd_data.info.tx.data;
-                                mcpsReq.Req.Unconfirmed.fBufferSize = task_cmd_data.info.tx.len;
-                                mcpsReq.Req.Unconfirmed.Datarate = task_cmd_data.info.tx.dr;
-                            }
-                        }
-                    #if defined(FIPY) || defined(LOPY4)
-                        xSemaphoreTake(xLoRaSigfoxSem, portMAX_DELAY);
-                    #endif
-
-                        // set back the original datarate
-                        if (!lora_obj.adr) {
-                            mibReq.Param.ChannelsDatarate = mac_datarate;
-                            LoRaMacMibSetRequestConfirm( &mibReq );
-                        }
-
-                        if (LoRaMacMcpsRequest(&mcpsReq) != LORAMAC_STATUS_OK || empty_frame) {
-                            // the command has failed, send the response now
-                            lora_obj.state = E_LORA_STATE_IDLE;
-                            status |= LORA_STATUS_ERROR;
-                            xEventGroupSetBits(LoRaEvents, status);
-                        #if defined(FIPY) || defined(LOPY4)
-                            xSemaphoreGive(xLoRaSigfoxSem);
-                        #endif
-                        } else {
-                            lora_obj.state = E_LORA_STATE_TX;
-                        }
-                    }
-                    break;
-                case E_LORA_CMD_SLEEP:
-                    Radio.Sleep();
-                    lora_obj.state = E_LORA_STATE_SLEEP;
-                    xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
-                #if defined(FIPY) || defined(LOPY4)
-                    xSemaphoreGive(xLoRaSigfoxSem);
-                #endif
-                    break;
-                case E_LORA_CMD_WAKE_UP:
-                    // just enable the receiver again
-                    Radio.Rx(LORA_RX_TIMEOUT);
-                    lora_obj.state = E_LORA_STATE_RX;
-                    xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
-                #if defined(FIPY) || defined(LOPY4)
-                    xSemaphoreGive(xLoRaSigfoxSem);
-                #endif
-                    break;
-                default:
-                    break;
-                }
-//            } else if (lora_obj.state == E_LORA_STATE_IDLE && lora_obj.stack_mode == E_LORA_STACK_MODE_LORA) {
-//                Radio.Rx(LORA_RX_TIMEOUT);
-//                lora_obj.state = E_LORA_STATE_RX;
+            Radio.Send(task_cmd_data.info.tx.data, task_cmd_data.info.tx.len);
+            lora_fsm.state = E_LORA_STATE_TX;
+        } else {
+            // activity detected on Lora, so keep the TX command, it's tried again shortly
+            return E_LORA_FSM_CMD_RETRY;
+        }
+        break;
+    case E_LORA_CMD_CONFIG_CHANNEL:
+        if (task_cmd_data.info.channel.add) {
+            ChannelParams_t channel =
+            { task_cmd_data.info.channel.frequency, 0, {((task_cmd_data.info.channel.dr_max << 4) | task_cmd_data.info.channel.dr_min)}, 0};
+            ChannelAddParams_t channelAdd = { &channel, task_cmd_data.info.channel.index };
+            RegionChannelManualAdd(lora_obj.region, &channelAdd);
+        } else {
+            ChannelRemoveParams_t channelRemove = { task_cmd_data.info.channel.index };
+            RegionChannelsManualRemove(lora_obj.region, &channelRemove);
+        }
+        xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
+        break;
+    case E_LORA_CMD_LORAWAN_TX: {
+            LoRaMacTxInfo_t txInfo;
+            EventBits_t status = 0;
+            bool empty_frame = false;
+            int8_t mac_datarate = 0;
+
+            // set the new data rate before checking if Tx is possible, but store the current one
+            if (!lora_obj.adr) {
+                mibReq.Type = MIB_CHANNELS_DATARATE;
+                LoRaMacMibGetRequestConfirm( &mibReq );
+                mac_datarate = mibReq.Param.ChannelsDatarate;
+                mibReq.Param.ChannelsDatarate = task_cmd_data.info.tx.dr;
+                LoRaMacMibSetRequestConfirm( &mibReq );
             }
-            break;
-        case E_LORA_STATE_JOIN:
-            TimerStop( &TxNextActReqTimer );
-            if (!lora_obj.joined) {
-                if (lora_obj.activation == E_LORA_ACTIVATION_OTAA) {
-                #if defined(FIPY) || defined(LOPY4)
-                    xSemaphoreTake(xLoRaSigfoxSem, portMAX_DELAY);
-                #endif
-                    mibReq.Type = MIB_NETWORK_ACTIVATION;
-                    mibReq.Param.NetworkActivation = ACTIVATION_TYPE_OTAA;
-                    LoRaMacMibSetRequestConfirm( &mibReq );
-                    
-                    TimerStart( &TxNextActReqTimer );
-                    mlmeReq.Type = MLME_JOIN;
-                    mlmeReq.Req.Join.DevEui = (uint8_t *)lora_obj.u.otaa.DevEui;
-                    mlmeReq.Req.Join.AppEui = (uint8_t *)lora_obj.u.otaa.AppEui;
-                    mlmeReq.Req.Join.AppKey = (uint8_t *)lora_obj.u.otaa.AppKey;
-                    mlmeReq.Req.Join.NbTrials = 1;
-                    mlmeReq.Req.Join.DR = (uint8_t) lora_obj.otaa_dr;
-                    LoRaMacMlmeRequest( &mlmeReq );
+
+            if (LoRaMacQueryTxPossible (task_cmd_data.info.tx.len, &txInfo) != LORAMAC_STATUS_OK) {
+                // send an empty frame in order to flush MAC commands
+                mcpsReq.Type = MCPS_UNCONFIRMED;
+                mcpsReq.Req.Unconfirmed.fBuffer = NULL;
+                mcpsReq.Req.Unconfirmed.fBufferSize = 0;
+                mcpsReq.Req.Unconfirmed.Datarate = task_cmd_data.info.tx.dr;
+                empty_frame = true;
+                status |= LORA_STATUS_MSG_SIZE;
+            } else {
+                if (task_cmd_data.info.tx.confirmed) {
+                    mcpsReq.Type = MCPS_CONFIRMED;
+                    mcpsReq.Req.Confirmed.fPort = task_cmd_data.info.tx.port;
+                    mcpsReq.Req.Confirmed.fBuffer = task_cmd_data.info.tx.data;
+                    mcpsReq.Req.Confirmed.fBufferSize = task_cmd_data.info.tx.len;
+                    mcpsReq.Req.Confirmed.NbTrials = lora_obj.tx_retries + 1;
+                    mcpsReq.Req.Confirmed.Datarate = task_cmd_data.info.tx.dr;
                 } else {
-                    mibReq.Type = MIB_NETWORK_ACTIVATION;
-                    mibReq.Param.NetworkActivation = ACTIVATION_TYPE_ABP;
-                    LoRaMacMibSetRequestConfirm( &mibReq );
-                    
-                    mibReq.Type = MIB_NET_ID;
-                    mibReq.Param.NetID = lora_obj.net_id;
-                    LoRaMacMibSetRequestConfirm( &mibReq );
-
-                    mibReq.Type = MIB_DEV_ADDR;
-                    mibReq.Param.DevAddr = (uint32_t)lora_obj.u.abp.DevAddr;
-                    LoRaMacMibSetRequestConfirm( &mibReq );
-
-                    mibReq.Type = MIB_NWK_SKEY;
-                    mibReq.Param.NwkSKey = (uint8_t *)lora_obj.u.abp.NwkSKey;
-                    LoRaMacMibSetRequestConfirm( &mibReq );
-
-                    mibReq.Type = MIB_APP_SKEY;
-                    mibReq.Param.AppSKey = (uint8_t *)lora_obj.u.abp.AppSKey;
-                    LoRaMacMibSetRequestConfirm( &mibReq );
-
-                    mibReq.Type = MIB_NETWORK_JOINED;
-                    mibReq.Param.IsNetworkJoined = true;
-                    LoRaMacMibSetRequestConfirm( &mibReq );
-                    lora_obj.joined = true;
-                    lora_obj.ComplianceTest.State = 1;
+                    mcpsReq.Type = MCPS_UNCONFIRMED;
+                    mcpsReq.Req.Unconfirmed.fPort = task_cmd_data.info.tx.port;
+                    mcpsReq.Req.Unconfirmed.fBuffer = task_cmd_data.info.tx.data;
+                    mcpsReq.Req.Unconfirmed.fBufferSize = task_cmd_data.info.tx.len;
+                    mcpsReq.Req.Unconfirmed.Datarate = task_cmd_data.info.tx.dr;
                 }
             }
-            xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
-            lora_obj.state = E_LORA_STATE_IDLE;
-            break;
-        case E_LORA_STATE_LINK_CHECK:
-            mlmeReq.Type = MLME_LINK_CHECK;
-            LoRaMacMlmeRequest(&mlmeReq);
-            lora_obj.state = E_LORA_STATE_IDLE;
-            break;
-        case E_LORA_STATE_RX_DONE:
-        case E_LORA_STATE_RX_TIMEOUT:
-        case E_LORA_STATE_RX_ERROR:
-            // we need to perform a mode transition in order to clear the TxRx FIFO
-            Radio.Sleep();
-            //lora_obj.state = E_LORA_STATE_IDLE;
-            lora_obj.state = E_LORA_STATE_RX;
-            Radio.Rx(LORA_RX_TIMEOUT);
-            break;
-        case E_LORA_STATE_TX:
-            break;
-        case E_LORA_STATE_TX_DONE:
-            // we need to perform a mode transition in order to clear the TxRx FIFO
-            Radio.Sleep();
-            xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
-            //lora_obj.state = E_LORA_STATE_IDLE;
-            lora_obj.state = E_LORA_STATE_RX;
-            Radio.Rx(LORA_RX_TIMEOUT);
-        #if defined(FIPY) || defined(LOPY4)
-            xSemaphoreGive(xLoRaSigfoxSem);
-        #endif
-            break;
-        case E_LORA_STATE_TX_TIMEOUT:
-            // we need to perform a mode transition in order to clear the TxRx FIFO
-            Radio.Sleep();
-            xEventGroupSetBits(LoRaEvents, LORA_STATUS_ERROR);
-            //lora_obj.state = E_LORA_STATE_IDLE;
-            lora_obj.state = E_LORA_STATE_RX;
-            Radio.Rx(LORA_RX_TIMEOUT);
         #if defined(FIPY) || defined(LOPY4)
-            xSemaphoreGive(xLoRaSigfoxSem);
+            xSemaphoreTake(xLoRaSigfoxSem, portMAX_DELAY);
         #endif
-            break;
-        default:
-            break;
+
+            // set back the original datarate
+            if (!lora_obj.adr) {
+                mibReq.Param.ChannelsDatarate = mac_datarate;
+                LoRaMacMibSetRequestConfirm( &mibReq );
+            }
+
+            if (LoRaMacMcpsRequest(&mcpsReq) != LORAMAC_STATUS_OK || empty_frame) {
+                // the command has failed, send the response now
+                lora_fsm.state = E_LORA_STATE_IDLE;
+                status |= LORA_STATUS_ERROR;
+                lora_tx_end(status);
+            #if defined(FIPY) || defined(LOPY4)
+                xSemaphoreGive(xLoRaSigfoxSem);
+            #endif
+            } else {
+                lora_fsm.state = E_LORA_STATE_TX;
+            }
         }
+        break;
+    case E_LORA_CMD_SLEEP:
+        Radio.Sleep();
+        lora_fsm.state = E_LORA_STATE_SLEEP;
+        xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
+    #if defined(FIPY) || defined(LOPY4)
+        xSemaphoreGive(xLoRaSigfoxSem);
+    #endif
+        break;
+    case E_LORA_CMD_WAKE_UP:
+        // just enable the receiver again
+        Radio.Rx(LORA_RX_TIMEOUT);
+        lora_fsm.state = E_LORA_STATE_RX;
+        xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
+    #if defined(FIPY) || defined(LOPY4)
+        xSemaphoreGive(xLoRaSigfoxSem);
+    #endif
+        break;
+    case E_LORA_CMD_CLASS_B:
+        LoRaMacSetPingSlotPeriodicity(task_cmd_data.info.class_b.periodicity);
+        xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
+        break;
+    default:
+        break;
+    }
+    return E_LORA_FSM_CMD_DONE;
+}
 
-        TimerLowPowerHandler();
+static void lora_task_mac_state (lora_state_t state) {
+    MibRequestConfirm_t mibReq;
+    MlmeReq_t mlmeReq;
+
+    switch (state) {
+    case E_LORA_STATE_JOIN:
+        TimerStop( &TxNextActReqTimer );
+        if (!lora_obj.joined) {
+            if (lora_obj.activation == E_LORA_ACTIVATION_OTAA) {
+            #if defined(FIPY) || defined(LOPY4)
+                xSemaphoreTake(xLoRaSigfoxSem, portMAX_DELAY);
+            #endif
+                mibReq.Type = MIB_NETWORK_ACTIVATION;
+                mibReq.Param.NetworkActivation = ACTIVATION_TYPE_OTAA;
+                LoRaMacMibSetRequestConfirm( &mibReq );
+                
+                TimerStart( &TxNextActReqTimer );
+                mlmeReq.Type = MLME_JOIN;
+                mlmeReq.Req.Join.DevEui = (uint8_t *)lora_obj.u.otaa.DevEui;
+                mlmeReq.Req.Join.AppEui = (uint8_t *)lora_obj.u.otaa.AppEui;
+                mlmeReq.Req.Join.AppKey = (uint8_t *)lora_obj.u.otaa.AppKey;
+                mlmeReq.Req.Join.NbTrials = 1;
+                mlmeReq.Req.Join.DR = (uint8_t) lora_obj.otaa_dr;
+                LoRaMacMlmeRequest( &mlmeReq );
+            } else {
+                mibReq.Type = MIB_NETWORK_ACTIVATION;
+                mibReq.Param.NetworkActivation = ACTIVATION_TYPE_ABP;
+                LoRaMacMibSetRequestConfirm( &mibReq );
+                
+                mibReq.Type = MIB_NET_ID;
+                mibReq.Param.NetID = lora_obj.net_id;
+                LoRaMacMibSetRequestConfirm( &mibReq );
+
+                mibReq.Type = MIB_DEV_ADDR;
+                mibReq.Param.DevAddr = (uint32_t)lora_obj.u.abp.DevAddr;
+                LoRaMacMibSetRequestConfirm( &mibReq );
+
+                mibReq.Type = MIB_NWK_SKEY;
+                mibReq.Param.NwkSKey = (uint8_t *)lora_obj.u.abp.NwkSKey;
+                LoRaMacMibSetRequestConfirm( &mibReq );
+
+                mibReq.Type = MIB_APP_SKEY;
+                mibReq.Param.AppSKey = (uint8_t *)lora_obj.u.abp.AppSKey;
+                LoRaMacMibSetRequestConfirm( &mibReq );
+
+                mibReq.Type = MIB_NETWORK_JOINED;
+                mibReq.Param.IsNetworkJoined = true;
+                LoRaMacMibSetRequestConfirm( &mibReq );
+                lora_obj.joined = true;
+                lora_obj.ComplianceTest.State = 1;
+            }
+        }
+        xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED);
+        lora_fsm.state = E_LORA_STATE_IDLE;
+        break;
+    case E_LORA_STATE_LINK_CHECK:
+        mlmeReq.Type = MLME_LINK_CHECK;
+        LoRaMacMlmeRequest(&mlmeReq);
+        lora_fsm.state = E_LORA_STATE_IDLE;
+        break;
+    default:
+        break;
     }
 }
 
+static uint32_t lora_task_wait (uint32_t timeout_ms) {
+    uint32_t events = 0;
+    TickType_t ticks = (timeout_ms == LORA_FSM_WAIT_FOREVER) ? portMAX_DELAY : (timeout_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+
+    xTaskNotifyWait(0, 0xFFFFFFFF, &events, ticks);
+    return events;
+}
+
+static void lora_task_notify (uint32_t events) {
+    xTaskNotify(xLoRaTaskHndl, events, eSetBits);
+}
+
+static uint32_t lora_task_ticks_ms (void) {
+    return mp_hal_ticks_ms_non_blocking();
+}
+
+static void lora_task_radio_reset (void) {
+    Radio.Reset();
+}
+
+static void lora_task_radio_sleep (void) {
+    Radio.Sleep();
+}
+
+static void lora_task_radio_rx (void) {
+    Radio.Rx(LORA_RX_TIMEOUT);
+}
+
+static void lora_task_tx_end (bool timeout) {
+    xEventGroupSetBits(LoRaEvents, timeout ? LORA_STATUS_ERROR : LORA_STATUS_COMPLETED);
+#if defined(FIPY) || defined(LOPY4)
+    xSemaphoreGive(xLoRaSigfoxSem);
+#endif
+}
+
+// the radio callbacks run in its interrupt handler
+static IRAM_ATTR void lora_state_from_isr (lora_state_t state) {
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+    lora_fsm.state = state;
+    xTaskNotifyFromISR(xLoRaTaskHndl, LORA_FSM_EVENT_STATE, eSetBits, &xHigherPriorityTaskWoken);
+    if (xHigherPriorityTaskWoken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+
 static void TASK_LoRa_Timer (void *pvParameters) {
 
     for(;;)
@@ -1251,7 +1697,7 @@ static IRAM_ATTR void OnTxDone (void) {
     if (lora_obj.trigger & MODLORA_TX_EVENT) {
         mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
     }
-    lora_obj.state = E_LORA_STATE_TX_DONE;
+    lora_state_from_isr(E_LORA_STATE_TX_DONE);
 }
 
 static IRAM_ATTR void OnRxDone (uint8_t *payload, uint32_t timestamp, uint16_t size, int16_t rssi, int8_t snr, uint8_t sf) {
@@ -1259,10 +1705,15 @@ static IRAM_ATTR void OnRxDone (uint8_t *payload, uint32_t timestamp, uint16_t s
     lora_obj.rssi = rssi;
     lora_obj.snr = snr;
     lora_obj.sfrx = sf;
-    if (size <= LORA_PAYLOAD_SIZE_MAX) {
-        memcpy((void *)rx_data_isr.data, payload, size);
-        rx_data_isr.len = size;
-        xQueueSendFromISR(xRxQueue, (void *)&rx_data_isr, NULL);
+    if (lora_capture_on) {
+        lora_capture_rec_t rec = {
+            .timestamp = timestamp, .frequency = lora_obj.frequency,
+            .rssi = rssi, .snr = snr, .sf = sf, .len = size
+        };
+        lora_capture_put(&lora_capture, &rec);
+    }
+    if (size <= LORA_PAYLOAD_SIZE_MAX && lora_rx_ring_put(&lora_rx_ring, payload, size, 0)) {
+        xSemaphoreGiveFromISR(xRxSem, NULL);
     }
 
     lora_obj.events |= MODLORA_RX_EVENT;
@@ -1270,19 +1721,22 @@ static IRAM_ATTR void OnRxDone (uint8_t *payload, uint32_t timestamp, uint16_t s
         mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
     }
 
-    lora_obj.state = E_LORA_STATE_RX_DONE;
+    lora_state_from_isr(E_LORA_STATE_RX_DONE);
 }
 
 static IRAM_ATTR void OnTxTimeout (void) {
-    lora_obj.state = E_LORA_STATE_TX_TIMEOUT;
+    lora_state_from_isr(E_LORA_STATE_TX_TIMEOUT);
 }
 
 static IRAM_ATTR void OnRxTimeout (void) {
-    lora_obj.state = E_LORA_STATE_RX_TIMEOUT;
+    lora_state_from_isr(E_LORA_STATE_RX_TIMEOUT);
 }
 
 static IRAM_ATTR void OnRxError (void) {
-    lora_obj.state = E_LORA_STATE_RX_ERROR;
+    if (lora_capture_on) {
+        lora_capture_error(&lora_capture);
+    }
+    lora_state_from_isr(E_LORA_STATE_RX_ERROR);
 }
 
 static void lora_radio_setup (lora_init_cmd_data_t *init_data) {
@@ -1313,10 +1767,10 @@ static void lora_radio_setup (lora_init_cmd_data_t *init_data) {
     if (init_data->power_mode == E_LORA_MODE_ALWAYS_ON) {
         // start listening
         Radio.Rx(LORA_RX_TIMEOUT);
-        lora_obj.state = E_LORA_STATE_RX;
+        lora_fsm.state = E_LORA_STATE_RX;
     } else {
         Radio.Sleep();
-        lora_obj.state = E_LORA_STATE_SLEEP;
+        lora_fsm.state = E_LORA_STATE_SLEEP;
     }
 }
 
@@ -1487,8 +1941,7 @@ static void lora_validate_power_mode (uint8_t power_mode) {
 }
 
 static void lora_validate_device_class (DeviceClass_t device_class) {
-    // CLASS_B is not implemented
-    if (device_class != CLASS_A && device_class != CLASS_C) {
+    if (device_class != CLASS_A && device_class != CLASS_B && device_class != CLASS_C) {
         nlr_raise(mp_obj_new_exception_msg_varg(&mp_type_ValueError, "invalid device_class %d", device_class));
     }
 }
@@ -1546,6 +1999,7 @@ static void lora_send_cmd (lora_cmd_data_t *cmd_data) {
     xEventGroupClearBits(LoRaEvents, LORA_STATUS_COMPLETED | LORA_STATUS_ERROR | LORA_STATUS_MSG_SIZE);
 
     xQueueSend(xCmdQueue, (void *)cmd_data, (TickType_t)portMAX_DELAY);
+    lora_fsm_command_queued(&lora_fsm);
 
     uint32_t result = xEventGroupWaitBits(LoRaEvents,
                                           LORA_STATUS_COMPLETED | LORA_STATUS_ERROR,
@@ -1586,6 +2040,7 @@ static int32_t lora_send (const byte *buf, uint32_t len, uint32_t timeout_ms) {
         //printf("Q full\n");
         return 0;
     }
+    lora_fsm_command_queued(&lora_fsm);
 
     lora_obj.sftx = lora_obj.sf;
 
@@ -1609,57 +2064,28 @@ static int32_t lora_send (const byte *buf, uint32_t len, uint32_t timeout_ms) {
 }
 
 static int32_t lora_recv (byte *buf, uint32_t len, int32_t timeout_ms, uint32_t *port) {
-    lora_rx_data_t rx_data;
-
-    if (timeout_ms < 0) {
-        // blocking mode
-        timeout_ms = portMAX_DELAY;
-    }
+    TickType_t timeout = (timeout_ms < 0) ? portMAX_DELAY : (TickType_t)(timeout_ms / portTICK_PERIOD_MS);
+    TickType_t start = xTaskGetTickCount();
+    uint8_t rx_port;
 
-    // if there's a partial packet pending
-    if (lora_partial_rx_packet.size > 0) {
-        // adjust the len
-        uint32_t available_len = lora_partial_rx_packet.size - lora_partial_rx_packet.index;
-        if (available_len < len) {
-            len = available_len;
-        }
-
-        // get the available data
-        memcpy(buf, (void *)&lora_partial_rx_packet.data[lora_partial_rx_packet.index], len);
-        if (port != NULL) {
-            *port = rx_data.port;
-        }
-
-        // update the index and size values
-        lora_partial_rx_packet.index += len;
-        if (lora_partial_rx_packet.index == lora_partial_rx_packet.size) {
-            // there's no more data left
-            lora_partial_rx_packet.size = 0;
-        }
-        // return the number of bytes received
-        return len;
-    } else if (xQueueReceive(xRxQueue, &rx_data, (TickType_t)(timeout_ms / portTICK_PERIOD_MS))) {
-        // adjust the len
-        if (rx_data.len < len) {
-            len = rx_data.len;
-        }
-
-        // get the available data
-        memcpy(buf, rx_data.data, len);
-        if (port != NULL) {
-            *port = rx_data.port;
+    for ( ; ; ) {
+        // the payload goes straight from the ring to the caller's buffer; if
+        // it's shorter than the packet the rest comes with the next calls
+        int32_t n = lora_rx_ring_read(&lora_rx_ring, buf, len, &rx_port);
+        if (n >= 0) {
+            if (port != NULL) {
+                *port = rx_port;
+            }
+            // return the number of bytes received
+            return n;
         }
 
-        // copy the remainder to the partial data buffer
-        int32_t r_len = rx_data.len - len;
-        if (r_len > 0) {
-            memcpy((void *)lora_partial_rx_packet.data, &rx_data.data[len], r_len);
-            lora_partial_rx_packet.size = r_len;
-            lora_partial_rx_packet.index = 0;
-            lora_partial_rx_packet.port = rx_data.port;
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) {
+            break;
         }
-        // return the number of bytes received
-        return len;
+        // a stale give just makes us look again
+        xSemaphoreTake(xRxSem, (timeout == portMAX_DELAY) ? portMAX_DELAY : timeout - elapsed);
     }
     // non-blocking sockects do not thrown timeout errors
     if (timeout_ms == 0) {
@@ -1670,22 +2096,408 @@ static int32_t lora_recv (byte *buf, uint32_t len, int32_t timeout_ms, uint32_t
 }
 
 static bool lora_rx_any (void) {
-    lora_rx_data_t rx_data;
-    if (lora_partial_rx_packet.size > 0) {
-        return true;
-    } else if (xQueuePeek(xRxQueue, &rx_data, (TickType_t)0)) {
-        return true;
-    }
-    return false;
+    return lora_rx_ring_any(&lora_rx_ring);
 }
 
 static bool lora_tx_space (void) {
+    if (lora_obj.stack_mode == E_LORA_STACK_MODE_LORAWAN) {
+        return lora_tx_sched_depth(&lora_tx_sched) < LORA_TX_SCHED_DEPTH;
+    }
     if (uxQueueSpacesAvailable(xCmdQueue) > 0) {
         return true;
     }
     return false;
 }
 
+// the answers of the FUOTA packages are queued from the LoRa task itself, so
+// they don't wait for room; the server asks again if one is lost
+static void lora_fuota_send (void *ctx, uint8_t port, const uint8_t *data, uint32_t len) {
+    lora_cmd_data_t cmd_data;
+    MibRequestConfirm_t mibReq;
+
+    mibReq.Type = MIB_CHANNELS_DATARATE;
+    LoRaMacMibGetRequestConfirm(&mibReq);
+
+    cmd_data.cmd = E_LORA_CMD_LORAWAN_TX;
+    memcpy(cmd_data.info.tx.data, data, len);
+    cmd_data.info.tx.len = len;
+    cmd_data.info.tx.port = port;
+    cmd_data.info.tx.dr = mibReq.Param.ChannelsDatarate;
+    cmd_data.info.tx.confirmed = false;
+    if (xQueueSend(xCmdQueue, (void *)&cmd_data, 0)) {
+        lora_fsm_command_queued(&lora_fsm);
+    }
+}
+
+static void lora_fuota_encrypt (void *ctx, const uint8_t *key, const uint8_t *in, uint8_t *out) {
+    lora_aes_key_t k;
+    lora_aes_key(key, &k);
+    lora_aes_encrypt(&k, in, out);
+}
+
+static void lora_fuota_mc_set (void *ctx, uint8_t id, const lora_fuota_mc_group_t *group) {
+    MulticastParams_t *channelParam = &lora_fuota_mc[id];
+
+    if (lora_fuota_mc_linked[id]) {
+        LoRaMacMulticastChannelUnlink(channelParam);
+        lora_fuota_mc_linked[id] = false;
+    }
+    if (lora_fuota_session.group == id) {
+        TimerStop(&FuotaSessionTimer);
+        lora_fuota_session_stop();
+    }
+    if (group != NULL) {
+        channelParam->Next = NULL;
+        channelParam->Address = group->addr;
+        channelParam->DownLinkCounter = group->min_fcnt;
+        memcpy(channelParam->NwkSKey, group->nwk_skey, sizeof(channelParam->NwkSKey));
+        memcpy(channelParam->AppSKey, group->app_skey, sizeof(channelParam->AppSKey));
+        lora_fuota_mc_linked[id] = (LoRaMacMulticastChannelLink(channelParam) == LORAMAC_STATUS_OK);
+    }
+}
+
+static void lora_fuota_mc_session (void *ctx, uint8_t id, const lora_fuota_mc_group_t *group, uint32_t start_in) {
+    TimerStop(&FuotaSessionTimer);
+    lora_fuota_session_stop();
+    lora_fuota_session.group = id;
+    lora_fuota_session.wait_s = start_in;
+    lora_fuota_session_step();
+}
+
+static bool lora_fuota_freq_ok (void *ctx, uint32_t freq) {
+    return Radio.CheckRfFrequency(freq);
+}
+
+static bool lora_fuota_dr_ok (void *ctx, uint8_t dr) {
+    VerifyParams_t verify;
+
+    verify.DatarateParams.Datarate = dr;
+    verify.DatarateParams.DownlinkDwellTime = 0;
+    return RegionVerify(lora_obj.region, &verify, PHY_RX_DR);
+}
+
+// from the RTC, if it was set (by NTP for instance); GPS time started on
+// 6 Jan 1980 and doesn't count the 18 leap seconds since
+static uint32_t lora_fuota_gps_time (void *ctx) {
+    time_t now = time(NULL);
+
+    if (now < 1577836800) {     // 2020, it wasn't set
+        return 0;
+    }
+    return now - 315964800 + 18;
+}
+
+// the MAC seeds the class B beacon search with it
+static uint32_t lora_gps_time (void) {
+    return lora_fuota_gps_time(NULL);
+}
+
+// the block goes to the next OTA partition, the scratch area of the decoder
+// in what's left of it after the image
+static int32_t lora_fuota_block_open (void *ctx, uint32_t size, uint32_t frag_size) {
+    uint32_t slot_size = updater_slot_size();
+
+    if (size > slot_size) {
+        return -1;
+    }
+    uint32_t max_lost = MIN((slot_size - size) / frag_size, LORA_FRAG_MAX_LOST);
+    if (!updater_frag_start(size + max_lost * frag_size)) {
+        return -1;
+    }
+    lora_fuota_updated = false;
+    return max_lost;
+}
+
+static bool lora_fuota_block_write (void *ctx, uint32_t offset, const uint8_t *buf, uint32_t len) {
+    return updater_frag_write(offset, buf, len);
+}
+
+static bool lora_fuota_block_read (void *ctx, uint32_t offset, uint8_t *buf, uint32_t len) {
+    return updater_frag_read(offset, buf, len);
+}
+
+// the image is checked and booted from on the next reset, which is left to
+// the application
+static void lora_fuota_block_done (void *ctx, uint32_t size, uint32_t descriptor) {
+    lora_fuota_updated = updater_frag_finish(size);
+    lora_obj.events |= MODLORA_FUOTA_EVENT;
+    if (lora_obj.trigger & MODLORA_FUOTA_EVENT) {
+        mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
+    }
+}
+
+// The timer of the class C session: it waits for the start, in steps the
+// timer can take, switches to class C on the group's channel, and back to
+// the class the device had when the session times out.
+static void lora_fuota_session_step (void) {
+    MibRequestConfirm_t mibReq;
+
+    if (lora_fuota_session.group < 0) {
+        return;
+    }
+    if (lora_fuota_session.wait_s == 0) {
+        if (lora_fuota_session.running) {
+            lora_fuota_session_stop();
+            return;
+        }
+        const lora_fuota_mc_group_t *group = &lora_fuota->groups[lora_fuota_session.group];
+
+        mibReq.Type = MIB_DEVICE_CLASS;
+        LoRaMacMibGetRequestConfirm(&mibReq);
+        lora_fuota_session.prev_class = mibReq.Param.Class;
+        mibReq.Type = MIB_RX2_CHANNEL;
+        LoRaMacMibGetRequestConfirm(&mibReq);
+        lora_fuota_session.prev_rx2 = mibReq.Param.Rx2Channel;
+
+        mibReq.Param.Rx2Channel.Frequency = group->freq;
+        mibReq.Param.Rx2Channel.Datarate = group->dr;
+        LoRaMacMibSetRequestConfirm(&mibReq);
+        mibReq.Type = MIB_DEVICE_CLASS;
+        mibReq.Param.Class = CLASS_C;
+        LoRaMacMibSetRequestConfirm(&mibReq);
+
+        lora_fuota_session.running = true;
+        lora_fuota_session.wait_s = group->timeout;
+    }
+    uint32_t step = MIN(lora_fuota_session.wait_s, MODLORA_FUOTA_TIMER_STEP_S);
+    lora_fuota_session.wait_s -= step;
+    TimerSetValue(&FuotaSessionTimer, step * 1000);
+    TimerStart(&FuotaSessionTimer);
+}
+
+static void lora_fuota_session_stop (void) {
+    MibRequestConfirm_t mibReq;
+
+    if (lora_fuota_session.running) {
+        mibReq.Type = MIB_RX2_CHANNEL;
+        mibReq.Param.Rx2Channel = lora_fuota_session.prev_rx2;
+        LoRaMacMibSetRequestConfirm(&mibReq);
+        mibReq.Type = MIB_DEVICE_CLASS;
+        mibReq.Param.Class = lora_fuota_session.prev_class;
+        LoRaMacMibSetRequestConfirm(&mibReq);
+    }
+    lora_fuota_session.running = false;
+    lora_fuota_session.group = -1;
+}
+
+static uint32_t lora_region_time_on_air (uint8_t dr, uint32_t len) {
+    const uint8_t *datarates;
+    const uint32_t *bandwidths;
+
+    switch (lora_obj.region) {
+    case LORAMAC_REGION_AS923:
+        datarates = DataratesAS923;
+        bandwidths = BandwidthsAS923;
+        break;
+    case LORAMAC_REGION_AU915:
+        datarates = DataratesAU915;
+        bandwidths = BandwidthsAU915;
+        break;
+    case LORAMAC_REGION_US915:
+        datarates = DataratesUS915;
+        bandwidths = BandwidthsUS915;
+        break;
+    case LORAMAC_REGION_US915_HYBRID:
+        datarates = DataratesUS915_HYBRID;
+        bandwidths = BandwidthsUS915_HYBRID;
+        break;
+    case LORAMAC_REGION_CN470:
+        datarates = DataratesCN470;
+        bandwidths = BandwidthsCN470;
+        break;
+    case LORAMAC_REGION_IN865:
+        datarates = DataratesIN865;
+        bandwidths = BandwidthsIN865;
+        break;
+    case LORAMAC_REGION_EU433:
+        datarates = DataratesEU433;
+        bandwidths = BandwidthsEU433;
+        break;
+    case LORAMAC_REGION_EU868:
+    default:
+        datarates = DataratesEU868;
+        bandwidths = BandwidthsEU868;
+        break;
+    }
+    return lora_tx_sched_air_time(datarates[dr & 0x0F], bandwidths[dr & 0x0F], len + LORA_TX_SCHED_FRAME_OVERHEAD);
+}
+
+static uint32_t lora_region_max_payload (uint8_t dr) {
+    GetPhyParams_t getPhy;
+    PhyParam_t phyParam;
+
+    getPhy.Attribute = PHY_MAX_PAYLOAD;
+    getPhy.Datarate = dr;
+    getPhy.UplinkDwellTime = LoRaMacGetMacParams()->UplinkDwellTime;
+    phyParam = RegionGetPhyParam(lora_obj.region, &getPhy);
+    return phyParam.Value;
+}
+
+// with ADR the MAC sends at its own data rate, not the socket's
+static uint8_t lora_tx_sched_datarate (uint8_t dr) {
+    MibRequestConfirm_t mibReq;
+
+    if (!lora_obj.adr) {
+        return dr;
+    }
+    mibReq.Type = MIB_CHANNELS_DATARATE;
+    LoRaMacMibGetRequestConfirm(&mibReq);
+    return mibReq.Param.ChannelsDatarate;
+}
+
+static uint32_t lora_tx_sched_time_on_air (void *ctx, uint8_t dr, uint32_t len) {
+    return lora_region_time_on_air(lora_tx_sched_datarate(dr), len);
+}
+
+static uint32_t lora_tx_sched_max_payload (void *ctx, uint8_t dr) {
+    return lora_region_max_payload(lora_tx_sched_datarate(dr));
+}
+
+// the bands of the enabled channels
+static uint32_t lora_tx_sched_bands_in_use (void *ctx) {
+    ChannelParams_t *channels;
+    uint16_t *channelmask;
+    uint32_t length, mask_length;
+    uint32_t bands = 0;
+
+    LoRaMacGetChannelList(&channels, &length);
+    if (!LoRaMacGetChannelsMask(&channelmask, &mask_length)) {
+        return 0;
+    }
+    length /= sizeof(ChannelParams_t);
+    mask_length /= sizeof(uint16_t);
+    for (uint32_t i = 0; i < length && (i / 16) < mask_length; i++) {
+        if (channels[i].Frequency != 0 && (channelmask[i / 16] & (1 << (i % 16)))) {
+            bands |= 1 << channels[i].Band;
+        }
+    }
+    return bands;
+}
+
+static void lora_tx_sched_expired (void *ctx, const lora_tx_msg_t *msg) {
+    lora_obj.events |= MODLORA_TX_FAILED_EVENT;
+    if (lora_obj.trigger & MODLORA_TX_FAILED_EVENT) {
+        mp_irq_queue_interrupt(lora_callback_handler, (void *)&lora_obj);
+    }
+    lora_tx_done_status = LORA_STATUS_COMPLETED | LORA_STATUS_ERROR;
+    lora_tx_done_id = msg->id;
+    xEventGroupSetBits(LoRaEvents, LORA_STATUS_COMPLETED | LORA_STATUS_ERROR);
+}
+
+// drops the uplinks left from before, and sets the duty cycles of the
+// region's bands; each keeps the credit of a frame of the most bytes at the
+// slowest data rate
+static void lora_tx_sched_setup (void) {
+    static const Band_t bands_eu868[] = { EU868_BAND0, EU868_BAND1, EU868_BAND2, EU868_BAND3, EU868_BAND4 };
+    static const Band_t bands_eu433[] = { EU433_BAND0 };
+    const Band_t *bands = NULL;
+    uint32_t nb_bands = 0;
+    uint32_t now = lora_task_ticks_ms();
+
+    xSemaphoreTake(xTxSchedMutex, portMAX_DELAY);
+    lora_tx_sched_flush(&lora_tx_sched);
+    lora_aggr_drop(&lora_aggr);
+    // a send() waiting for one of them gives up
+    lora_tx_sending_id = 0;
+    lora_tx_done_status = LORA_STATUS_COMPLETED | LORA_STATUS_ERROR;
+    lora_tx_done_id = lora_tx_sched.next_id - 1;
+    if (lora_obj.region == LORAMAC_REGION_EU868) {
+        bands = bands_eu868;
+        nb_bands = MP_ARRAY_SIZE(bands_eu868);
+    } else if (lora_obj.region == LORAMAC_REGION_EU433) {
+        bands = bands_eu433;
+        nb_bands = MP_ARRAY_SIZE(bands_eu433);
+    }
+    uint32_t frame = lora_region_time_on_air(DR_0, lora_region_max_payload(DR_0));
+    for (uint32_t i = 0; i < LORA_TX_SCHED_BANDS; i++) {
+        if (i < nb_bands) {
+            lora_tx_sched_set_band(&lora_tx_sched, i, bands[i].DCycle, bands[i].DCycle * frame, now);
+        } else {
+            lora_tx_sched_set_band(&lora_tx_sched, i, 0, 0, now);
+        }
+    }
+    xSemaphoreGive(xTxSchedMutex);
+}
+
+// moves the next uplink to task_cmd_data if its time has come, otherwise
+// sets the timer for when it will
+static bool lora_tx_sched_next (void) {
+    uint32_t wait = LORA_TX_SCHED_NEVER;
+    uint32_t aggr_wait = LORA_TX_SCHED_NEVER;
+    uint32_t now = lora_task_ticks_ms();
+    bool ready;
+
+    if (lora_obj.stack_mode != E_LORA_STACK_MODE_LORAWAN) {
+        return false;
+    }
+    xSemaphoreTake(xTxSchedMutex, portMAX_DELAY);
+    // the aggregated frame joins the queue when it's due, once there's room;
+    // one with a deadline goes as early as the queue would keep it
+    if (lora_tx_sched_depth(&lora_tx_sched) < LORA_TX_SCHED_DEPTH) {
+        uint32_t lead = (lora_aggr.frame.has_deadline) ? lora_tx_sched_eta_msg(&lora_tx_sched, &lora_aggr.frame, now) : 0;
+        if (lora_aggr_due(&lora_aggr, now, lead, &lora_aggr_frame, &aggr_wait)) {
+            lora_tx_sched_put(&lora_tx_sched, &lora_aggr_frame);
+        }
+    }
+    ready = lora_tx_sched_take(&lora_tx_sched, now, &lora_tx_sched_msg, &wait);
+    xSemaphoreGive(xTxSchedMutex);
+
+    // with an uplink going, the queue is looked at again when it ends
+    wait = MIN(wait, aggr_wait);
+    TimerStop(&TxSchedTimer);
+    if (wait != LORA_TX_SCHED_NEVER) {
+        TimerSetValue(&TxSchedTimer, wait);
+        TimerStart(&TxSchedTimer);
+    }
+    if (!ready) {
+        return false;
+    }
+
+    task_cmd_data.cmd = E_LORA_CMD_LORAWAN_TX;
+    memcpy(task_cmd_data.info.tx.data, lora_tx_sched_msg.data, lora_tx_sched_msg.len);
+    task_cmd_data.info.tx.len = lora_tx_sched_msg.len;
+    task_cmd_data.info.tx.port = lora_tx_sched_msg.port;
+    task_cmd_data.info.tx.dr = lora_tx_sched_msg.dr;
+    task_cmd_data.info.tx.confirmed = lora_tx_sched_msg.confirmed;
+    lora_tx_sending_id = lora_tx_sched_msg.id;
+    return true;
+}
+
+// charges the band of the channel on frequency, the MAC picked it
+static void lora_tx_sched_spent (uint32_t frequency, uint32_t air_time) {
+    ChannelParams_t *channels;
+    uint32_t length;
+
+    LoRaMacGetChannelList(&channels, &length);
+    length /= sizeof(ChannelParams_t);
+    for (uint32_t i = 0; i < length; i++) {
+        if (channels[i].Frequency == frequency) {
+            xSemaphoreTake(xTxSchedMutex, portMAX_DELAY);
+            lora_tx_sched_sent(&lora_tx_sched, channels[i].Band, air_time, lora_task_ticks_ms());
+            xSemaphoreGive(xTxSchedMutex);
+            break;
+        }
+    }
+}
+
+// an uplink ended; a send() waiting for it returns, and the next one may go
+static void lora_tx_end (EventBits_t status) {
+    if (lora_tx_sending_id != 0) {
+        lora_tx_done_status = status;
+        lora_tx_done_id = lora_tx_sending_id;
+        lora_tx_sending_id = 0;
+    }
+    xEventGroupSetBits(LoRaEvents, status);
+    if (lora_tx_sched_depth(&lora_tx_sched) > 0) {
+        lora_fsm_command_queued(&lora_fsm);
+    }
+}
+
+static void OnTxSchedTimerEvent (void) {
+    TimerStop(&TxSchedTimer);
+    lora_fsm_command_queued(&lora_fsm);
+}
+
 /******************************************************************************/
 // Micro Python bindings; LoRa class
 
@@ -1828,7 +2640,7 @@ STATIC mp_obj_t lora_make_new(const mp_obj_type_t *type, mp_uint_t n_args, mp_ui
     }
 
     // run the constructor if the peripehral is not initialized or extra parameters are given
-    if (n_kw > 0 || self->state == E_LORA_STATE_NOINIT) {
+    if (n_kw > 0 || lora_fsm.state == E_LORA_STATE_NOINIT) {
         // start the peripheral
         lora_init_helper(self, &args[1]);
         // register it as a network card
@@ -2080,6 +2892,187 @@ STATIC mp_obj_t lora_compliance_test(mp_uint_t n_args, const mp_obj_t *args) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lora_compliance_test_obj, 1, 4, lora_compliance_test);
 
+STATIC mp_obj_t lora_fuota_cmd(mp_uint_t n_args, const mp_obj_t *args) {
+    // get
+    if (n_args == 1) {
+        static const qstr lora_fuota_info_fields[] = {
+            MP_QSTR_enabled, MP_QSTR_session, MP_QSTR_fragments, MP_QSTR_received,
+            MP_QSTR_missing, MP_QSTR_class_c, MP_QSTR_updated
+        };
+
+        mp_obj_t fuota_tuple[7];
+        bool session = lora_fuota != NULL && lora_fuota->session.active;
+        fuota_tuple[0] = mp_obj_new_bool(lora_fuota_enabled);
+        fuota_tuple[1] = session ? mp_obj_new_int(lora_fuota->session.index) : mp_const_none;
+        fuota_tuple[2] = mp_obj_new_int(session ? lora_fuota->session.nb_frag : 0);
+        fuota_tuple[3] = mp_obj_new_int(session ? lora_fuota->frag.stats.frames : 0);
+        fuota_tuple[4] = mp_obj_new_int(session ? lora_frag_missing(&lora_fuota->frag) : 0);
+        fuota_tuple[5] = mp_obj_new_bool(lora_fuota_session.running);
+        fuota_tuple[6] = mp_obj_new_bool(lora_fuota_updated);
+
+        return mp_obj_new_attrtuple(lora_fuota_info_fields, 7, fuota_tuple);
+    } else {    // set
+        if (args[1] != mp_const_none) {     // enable with the GenAppKey, or disable
+            mp_buffer_info_t bufinfo;
+            mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_READ);
+            if (bufinfo.len != 16) {
+                nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, mpexception_value_invalid_arguments));
+            }
+            if (lora_fuota == NULL) {
+                lora_fuota = heap_caps_malloc(sizeof(lora_fuota_t), MALLOC_CAP_8BIT);
+                if (lora_fuota == NULL) {
+                    mp_raise_OSError(MP_ENOMEM);
+                }
+            }
+            lora_fuota_enabled = false;
+            lora_fuota_init(lora_fuota, &lora_fuota_ops, NULL, bufinfo.buf);
+            lora_fuota_enabled = true;
+        } else if (lora_fuota_enabled) {
+            lora_fuota_enabled = false;
+            for (uint8_t id = 0; id < LORA_FUOTA_MC_GROUPS; id++) {
+                lora_fuota_mc_set(NULL, id, NULL);
+            }
+        }
+        return mp_const_none;
+    }
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lora_fuota_obj, 1, 2, lora_fuota_cmd);
+
+STATIC mp_obj_t lora_tx_queue(mp_obj_t self_in) {
+    static const qstr lora_tx_queue_info_fields[] = {
+        MP_QSTR_depth, MP_QSTR_eta, MP_QSTR_queued, MP_QSTR_sent,
+        MP_QSTR_expired, MP_QSTR_coalesced, MP_QSTR_aggregated, MP_QSTR_air_saved
+    };
+    lora_tx_sched_stats_t stats;
+    lora_aggr_stats_t aggr_stats;
+    uint32_t depth, eta;
+
+    xSemaphoreTake(xTxSchedMutex, portMAX_DELAY);
+    depth = lora_tx_sched_depth(&lora_tx_sched);
+    eta = lora_tx_sched_eta(&lora_tx_sched, lora_task_ticks_ms());
+    stats = lora_tx_sched.stats;
+    aggr_stats = lora_aggr.stats;
+    xSemaphoreGive(xTxSchedMutex);
+
+    mp_obj_t tx_queue_tuple[8];
+    tx_queue_tuple[0] = mp_obj_new_int(depth);
+    // ms until the next uplink may go
+    tx_queue_tuple[1] = (eta == LORA_TX_SCHED_NEVER) ? mp_const_none : mp_obj_new_int(eta);
+    tx_queue_tuple[2] = mp_obj_new_int_from_uint(stats.queued);
+    tx_queue_tuple[3] = mp_obj_new_int_from_uint(stats.sent);
+    tx_queue_tuple[4] = mp_obj_new_int_from_uint(stats.expired);
+    tx_queue_tuple[5] = mp_obj_new_int_from_uint(stats.coalesced);
+    tx_queue_tuple[6] = mp_obj_new_int_from_uint(aggr_stats.records);
+    // ms on air the aggregated records would have taken more, a frame each
+    tx_queue_tuple[7] = mp_obj_new_int((int32_t)(aggr_stats.air_alone - aggr_stats.air_sent));
+
+    return mp_obj_new_attrtuple(lora_tx_queue_info_fields, 8, tx_queue_tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(lora_tx_queue_obj, lora_tx_queue);
+
+STATIC mp_obj_t lora_class_b(mp_uint_t n_args, const mp_obj_t *args) {
+    static const qstr lora_class_b_info_fields[] = {
+        MP_QSTR_state, MP_QSTR_beacon_time, MP_QSTR_periodicity, MP_QSTR_missed,
+        MP_QSTR_beacons, MP_QSTR_lost, MP_QSTR_lat, MP_QSTR_lng
+    };
+    lora_class_b_t class_b;
+
+    if (lora_obj.stack_mode != E_LORA_STACK_MODE_LORAWAN) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_request_not_possible));
+    }
+    if (n_args > 1) {
+        mp_int_t periodicity = mp_obj_get_int(args[1]);
+        if (periodicity < 0 || periodicity > LORA_CLASS_B_PERIODICITY_MAX) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, mpexception_value_invalid_arguments));
+        }
+        lora_cmd_data_t cmd_data;
+        cmd_data.cmd = E_LORA_CMD_CLASS_B;
+        cmd_data.info.class_b.periodicity = periodicity;
+        lora_send_cmd (&cmd_data);
+        return mp_const_none;
+    }
+
+    // a snapshot, the task updates it as the beacons come
+    memcpy(&class_b, LoRaMacGetClassB(), sizeof(class_b));
+
+    mp_obj_t class_b_tuple[8];
+    class_b_tuple[0] = mp_obj_new_int(class_b.state);
+    class_b_tuple[1] = (class_b.state == E_LORA_CLASS_B_LOCKED) ? mp_obj_new_int_from_uint(class_b.beacon_time) : mp_const_none;
+    class_b_tuple[2] = mp_obj_new_int(class_b.periodicity);
+    class_b_tuple[3] = mp_obj_new_int_from_uint(class_b.missed);
+    class_b_tuple[4] = mp_obj_new_int_from_uint(class_b.stats.beacons);
+    class_b_tuple[5] = mp_obj_new_int_from_uint(class_b.stats.lost);
+    // as sent by the gateway, in 2^-23 half turns
+    class_b_tuple[6] = mp_obj_new_int(class_b.beacon.lat);
+    class_b_tuple[7] = mp_obj_new_int(class_b.beacon.lng);
+
+    return mp_obj_new_attrtuple(lora_class_b_info_fields, 8, class_b_tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lora_class_b_obj, 1, 2, lora_class_b);
+
+STATIC mp_obj_t lora_capture_state(mp_uint_t n_args, const mp_obj_t *args) {
+    static const qstr lora_capture_info_fields[] = {
+        MP_QSTR_enabled, MP_QSTR_pending, MP_QSTR_captured, MP_QSTR_dropped,
+        MP_QSTR_errors, MP_QSTR_high_water
+    };
+
+    if (n_args > 1) {
+        if (mp_obj_is_true(args[1])) {
+            if (lora_obj.stack_mode != E_LORA_STACK_MODE_LORA) {
+                nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_request_not_possible));
+            }
+            if (lora_capture_recs == NULL) {
+                lora_capture_recs = heap_caps_malloc(LORA_CAPTURE_RECORDS * sizeof(lora_capture_rec_t), MALLOC_CAP_8BIT);
+                if (lora_capture_recs == NULL) {
+                    mp_raise_OSError(MP_ENOMEM);
+                }
+            }
+            // a new capture, the records and counts of the last one go
+            if (!lora_capture_on) {
+                lora_capture_init(&lora_capture, lora_capture_recs, LORA_CAPTURE_RECORDS);
+                lora_capture_on = true;
+            }
+        } else {
+            // what was captured can still be read
+            lora_capture_on = false;
+        }
+        return mp_const_none;
+    }
+
+    mp_obj_t capture_tuple[6];
+    capture_tuple[0] = mp_obj_new_bool(lora_capture_on);
+    capture_tuple[1] = mp_obj_new_int_from_uint(lora_capture_recs ? lora_capture_count(&lora_capture) : 0);
+    capture_tuple[2] = mp_obj_new_int_from_uint(lora_capture.stats.captured);
+    capture_tuple[3] = mp_obj_new_int_from_uint(lora_capture.stats.dropped);
+    capture_tuple[4] = mp_obj_new_int_from_uint(lora_capture.stats.errors);
+    capture_tuple[5] = mp_obj_new_int_from_uint(lora_capture.stats.high_water);
+
+    return mp_obj_new_attrtuple(lora_capture_info_fields, 6, capture_tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lora_capture_state_obj, 1, 2, lora_capture_state);
+
+// the records as they're in memory, 16 bytes each, "<IIhbBHBx" for ustruct:
+// into buf, as many as fit, or in a new bytes object, all of them
+STATIC mp_obj_t lora_capture_read_records(mp_uint_t n_args, const mp_obj_t *args) {
+    if (lora_capture_recs == NULL) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_request_not_possible));
+    }
+    if (n_args > 1) {
+        mp_buffer_info_t bufinfo;
+        mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_WRITE);
+        return mp_obj_new_int_from_uint(lora_capture_read(&lora_capture, bufinfo.buf, bufinfo.len / sizeof(lora_capture_rec_t)));
+    }
+
+    vstr_t vstr;
+    uint32_t count = lora_capture_count(&lora_capture);
+    vstr_init_len(&vstr, count * sizeof(lora_capture_rec_t));
+    // more may have come since, they're left for the next read
+    count = lora_capture_read(&lora_capture, vstr.buf, count);
+    vstr.len = count * sizeof(lora_capture_rec_t);
+    return mp_obj_new_str_from_vstr(&mp_type_bytes, &vstr);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lora_capture_read_obj, 1, 2, lora_capture_read_records);
+
 STATIC mp_obj_t lora_tx_power (mp_uint_t n_args, const mp_obj_t *args) {
     lora_obj_t *self = args[0];
     if (n_args == 1) {
@@ -2209,7 +3202,7 @@ STATIC mp_obj_t lora_stats(mp_obj_t self_in) {
     static const qstr lora_stats_info_fields[] = {
         MP_QSTR_rx_timestamp, MP_QSTR_rssi, MP_QSTR_snr, MP_QSTR_sfrx, MP_QSTR_sftx,
         MP_QSTR_tx_trials, MP_QSTR_tx_power, MP_QSTR_tx_time_on_air, MP_QSTR_tx_counter,
-        MP_QSTR_tx_frequency
+        MP_QSTR_tx_frequency, MP_QSTR_rx_dropped, MP_QSTR_rx_dropped_bytes
     };
 
     if (self->snr & 0x80)  { // the SNR sign bit is 1
@@ -2221,7 +3214,7 @@ STATIC mp_obj_t lora_stats(mp_obj_t self_in) {
         snr = (self->snr & 0xFF) / 4;
     }
 
-    mp_obj_t stats_tuple[10];
+    mp_obj_t stats_tuple[12];
     stats_tuple[0] = mp_obj_new_int_from_uint(self->rx_timestamp);
     stats_tuple[1] = mp_obj_new_int(self->rssi);
     stats_tuple[2] = mp_obj_new_float(snr);
@@ -2232,6 +3225,9 @@ STATIC mp_obj_t lora_stats(mp_obj_t self_in) {
     stats_tuple[7] = mp_obj_new_int(self->tx_time_on_air);
     stats_tuple[8] = mp_obj_new_int(self->tx_counter);
     stats_tuple[9] = mp_obj_new_int(self->tx_frequency);
+    // the packets lost because MicroPython didn't read them fast enough
+    stats_tuple[10] = mp_obj_new_int_from_uint(lora_rx_ring.stats.dropped);
+    stats_tuple[11] = mp_obj_new_int_from_uint(lora_rx_ring.stats.dropped_bytes);
 
     return mp_obj_new_attrtuple(lora_stats_info_fields, sizeof(stats_tuple) / sizeof(stats_tuple[0]), stats_tuple);
 }
@@ -2365,14 +3361,25 @@ STATIC MP_DEFINE_CONST_FUN_OBJ_2(lora_set_battery_level_obj, lora_set_battery_le
 
 STATIC mp_obj_t lora_nvram_save (mp_obj_t self_in) {
     LoRaMacRegion_t region = 0xFF;
+    uint32_t joined = 0xFF;
     modlora_nvs_get_uint(E_LORA_NVS_ELE_REGION, &region);
     // if the region doesn't match, erase the previous stored data
     if (region != lora_obj.region) {
         lora_nvram_erase(NULL);
     }
-    LoRaMacNvsSave();
-    modlora_nvs_set_uint(E_LORA_NVS_ELE_REGION, (uint32_t)lora_obj.region);
-    modlora_nvs_set_uint(E_LORA_NVS_ELE_JOINED, (uint32_t)lora_obj.joined);
+    // only what changed since the last save is written
+    if (lora_obj.joined && !lorawan_session_store()) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_operation_failed));
+    }
+    // a legacy session left there is older than this one
+    lorawan_legacy_erase();
+    if (region != lora_obj.region) {
+        modlora_nvs_set_uint(E_LORA_NVS_ELE_REGION, (uint32_t)lora_obj.region);
+    }
+    modlora_nvs_get_uint(E_LORA_NVS_ELE_JOINED, &joined);
+    if (joined != lora_obj.joined) {
+        modlora_nvs_set_uint(E_LORA_NVS_ELE_JOINED, (uint32_t)lora_obj.joined);
+    }
     if (ESP_OK != nvs_commit(modlora_nvs_handle)) {
         nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_operation_failed));
     }
@@ -2410,14 +3417,45 @@ STATIC mp_obj_t lora_nvram_restore (mp_obj_t self_in) {
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(lora_nvram_restore_obj, lora_nvram_restore);
 
 STATIC mp_obj_t lora_nvram_erase (mp_obj_t self_in) {
+    lora_session_forget(&lora_session);
+    memset(&lora_session_rtc, 0, sizeof(lora_session_rtc));
     if (ESP_OK != nvs_erase_all(modlora_nvs_handle)) {
         nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_operation_failed));
     }
+    lorawan_legacy_gone = true;
     nvs_commit(modlora_nvs_handle);
     return mp_const_none;
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(lora_nvram_erase_obj, lora_nvram_erase);
 
+STATIC mp_obj_t lora_nvram_stats (mp_obj_t self_in) {
+    static const qstr lora_nvram_stats_info_fields[] = {
+        MP_QSTR_saves, MP_QSTR_writes, MP_QSTR_bytes, MP_QSTR_skipped,
+        MP_QSTR_from_rtc, MP_QSTR_restore_ms, MP_QSTR_wake_to_tx_ms
+    };
+    lora_session_stats_t stats = lora_session.stats;
+
+    mp_obj_t nvram_stats_tuple[7];
+    nvram_stats_tuple[0] = mp_obj_new_int_from_uint(stats.saves);
+    // the keys written and their size, the fields that hadn't changed
+    nvram_stats_tuple[1] = mp_obj_new_int_from_uint(stats.writes);
+    nvram_stats_tuple[2] = mp_obj_new_int_from_uint(stats.bytes);
+    nvram_stats_tuple[3] = mp_obj_new_int_from_uint(stats.skipped);
+    if (lorawan_session_restored) {
+        nvram_stats_tuple[4] = mp_obj_new_bool(stats.from_rtc);
+        nvram_stats_tuple[5] = mp_obj_new_int_from_uint(lorawan_session_restore_ms);
+        // ms from the boot to the end of the first uplink
+        nvram_stats_tuple[6] = (lorawan_session_wake_to_tx_ms) ? mp_obj_new_int_from_uint(lorawan_session_wake_to_tx_ms) : mp_const_none;
+    } else {
+        nvram_stats_tuple[4] = mp_const_false;
+        nvram_stats_tuple[5] = mp_const_none;
+        nvram_stats_tuple[6] = mp_const_none;
+    }
+
+    return mp_obj_new_attrtuple(lora_nvram_stats_info_fields, 7, nvram_stats_tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(lora_nvram_stats_obj, lora_nvram_stats);
+
 // return time-on-air (milisec) for the current Lora settings, specifying pack_len
 STATIC mp_obj_t lora_airtime (mp_obj_t self_in, mp_obj_t pack_len_obj) {
     int len = mp_obj_get_int(pack_len_obj);
@@ -2438,7 +3476,7 @@ STATIC mp_obj_t lora_reset (mp_obj_t self_in) {
         vTaskDelay (100 / portTICK_PERIOD_MS);
     }
 
-    self->reset = true;
+    lora_fsm_reset(&lora_fsm);
 
     lora_get_config (&cmd_data);
     cmd_data.cmd = E_LORA_CMD_INIT;
@@ -2476,6 +3514,11 @@ STATIC const mp_map_elem_t lora_locals_dict_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR_remove_channel),        (mp_obj_t)&lora_remove_channel_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_mac),                   (mp_obj_t)&lora_mac_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_compliance_test),       (mp_obj_t)&lora_compliance_test_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_fuota),                 (mp_obj_t)&lora_fuota_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_tx_queue),              (mp_obj_t)&lora_tx_queue_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_class_b),               (mp_obj_t)&lora_class_b_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_capture),               (mp_obj_t)&lora_capture_state_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_capture_read),          (mp_obj_t)&lora_capture_read_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_callback),              (mp_obj_t)&lora_callback_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_events),                (mp_obj_t)&lora_events_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_ischannel_free),        (mp_obj_t)&lora_ischannel_free_obj },
@@ -2483,6 +3526,7 @@ STATIC const mp_map_elem_t lora_locals_dict_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR_nvram_save),            (mp_obj_t)&lora_nvram_save_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_nvram_restore),         (mp_obj_t)&lora_nvram_restore_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_nvram_erase),           (mp_obj_t)&lora_nvram_erase_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_nvram_stats),           (mp_obj_t)&lora_nvram_stats_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_airtime),               (mp_obj_t)&lora_airtime_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_reset),                 (mp_obj_t)&lora_reset_obj },
 
@@ -2516,8 +3560,11 @@ STATIC const mp_map_elem_t lora_locals_dict_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR_RX_PACKET_EVENT),     MP_OBJ_NEW_SMALL_INT(MODLORA_RX_EVENT) },
     { MP_OBJ_NEW_QSTR(MP_QSTR_TX_PACKET_EVENT),     MP_OBJ_NEW_SMALL_INT(MODLORA_TX_EVENT) },
     { MP_OBJ_NEW_QSTR(MP_QSTR_TX_FAILED_EVENT),     MP_OBJ_NEW_SMALL_INT(MODLORA_TX_FAILED_EVENT) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_FUOTA_EVENT),         MP_OBJ_NEW_SMALL_INT(MODLORA_FUOTA_EVENT) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_BEACON_EVENT),        MP_OBJ_NEW_SMALL_INT(MODLORA_BEACON_EVENT) },
 
     { MP_OBJ_NEW_QSTR(MP_QSTR_CLASS_A),             MP_OBJ_NEW_SMALL_INT(CLASS_A) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_CLASS_B),             MP_OBJ_NEW_SMALL_INT(CLASS_B) },
     { MP_OBJ_NEW_QSTR(MP_QSTR_CLASS_C),             MP_OBJ_NEW_SMALL_INT(CLASS_C) },
 
     { MP_OBJ_NEW_QSTR(MP_QSTR_AS923),               MP_OBJ_NEW_SMALL_INT(LORAMAC_REGION_AS923) },
@@ -2555,7 +3602,7 @@ const mod_network_nic_type_t mod_network_nic_type_lora = {
 //// Micro Python bindings; LoRa socket
 
 static int lora_socket_socket (mod_network_socket_obj_t *s, int *_errno) {
-    if (lora_obj.state == E_LORA_STATE_NOINIT) {
+    if (lora_fsm.state == E_LORA_STATE_NOINIT) {
         *_errno = MP_ENETDOWN;
         return -1;
     }
@@ -2588,6 +3635,7 @@ static int lora_socket_socket (mod_network_socket_obj_t *s, int *_errno) {
 
     // port number 2 is the default one
     LORAWAN_SOCKET_SET_PORT(s->sock_base.u.sd, 2);
+    s->sock_base.deadline = 0;
     return 0;
 }
 
@@ -2623,7 +3671,12 @@ static int lora_socket_send (mod_network_socket_obj_t *s, const byte *buf, mp_ui
                 n_bytes = lorawan_send (buf, len, s->sock_base.timeout,
                                         LORAWAN_SOCKET_IS_CONFIRMED(s->sock_base.u.sd),
                                         LORAWAN_SOCKET_GET_DR(s->sock_base.u.sd),
-                                        LORAWAN_SOCKET_GET_PORT(s->sock_base.u.sd));
+                                        LORAWAN_SOCKET_GET_PORT(s->sock_base.u.sd),
+                                        LORAWAN_SOCKET_GET_PRIORITY(s->sock_base.u.sd),
+                                        LORAWAN_SOCKET_IS_COALESCE(s->sock_base.u.sd),
+                                        s->sock_base.deadline,
+                                        LORAWAN_SOCKET_IS_AGGREGATE(s->sock_base.u.sd),
+                                        LORAWAN_SOCKET_GET_PACK(s->sock_base.u.sd));
             } else {
                 *_errno = MP_ENETDOWN;
                 return -1;
@@ -2704,6 +3757,40 @@ static int lora_socket_setsockopt(mod_network_socket_obj_t *s, mp_uint_t level,
             return -1;
         }
         LORAWAN_SOCKET_SET_DR(s->sock_base.u.sd, *(uint8_t *)optval);
+    } else if (opt == SO_LORAWAN_PRIORITY) {
+        if (*(uint32_t *)optval >= LORA_TX_SCHED_PRIORITIES) {
+            *_errno = MP_EOPNOTSUPP;
+            return -1;
+        }
+        LORAWAN_SOCKET_SET_PRIORITY(s->sock_base.u.sd, *(uint8_t *)optval);
+    } else if (opt == SO_LORAWAN_DEADLINE) {
+        // ms from the send() call, 0 for none
+        s->sock_base.deadline = *(uint32_t *)optval;
+    } else if (opt == SO_LORAWAN_COALESCE) {
+        if (*(uint8_t *)optval) {
+            LORAWAN_SOCKET_SET_COALESCE(s->sock_base.u.sd);
+        } else {
+            LORAWAN_SOCKET_CLR_COALESCE(s->sock_base.u.sd);
+        }
+    } else if (opt == SO_LORAWAN_AGGREGATE) {
+        // ms a frame waits for more records, 0 to send each on its own; the
+        // sockets share the frame, and the last time set
+        uint32_t hold = *(uint32_t *)optval;
+        if (hold > 0) {
+            xSemaphoreTake(xTxSchedMutex, portMAX_DELAY);
+            lora_aggr_set_hold(&lora_aggr, hold);
+            xSemaphoreGive(xTxSchedMutex);
+            LORAWAN_SOCKET_SET_AGGREGATE(s->sock_base.u.sd);
+        } else {
+            LORAWAN_SOCKET_CLR_AGGREGATE(s->sock_base.u.sd);
+        }
+    } else if (opt == SO_LORAWAN_PACK) {
+        uint32_t width = *(uint32_t *)optval;
+        if (width != 0 && width != 1 && width != 2 && width != 4) {
+            *_errno = MP_EOPNOTSUPP;
+            return -1;
+        }
+        LORAWAN_SOCKET_SET_PACK(s->sock_base.u.sd, width);
     } else {
         *_errno = MP_EOPNOTSUPP;
         return -1;
@@ -2762,6 +3849,11 @@ static int lora_socket_ioctl (mod_network_socket_obj_t *s, mp_uint_t request, mp
         if ((flags & MP_STREAM_POLL_WR) && lora_tx_space()) {
             ret |= MP_STREAM_POLL_WR;
         }
+    } else if (request == MP_STREAM_FLUSH) {
+        if (!lorawan_flush()) {
+            *_errno = MP_EAGAIN;
+            ret = MP_STREAM_ERROR;
+        }
     } else {
         *_errno = MP_EINVAL;
         ret = MP_STREAM_ERROR;
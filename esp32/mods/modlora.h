@@ -18,7 +18,8 @@
  ******************************************************************************/
 #define LORA_PAYLOAD_SIZE_MAX                                   (255)
 #define LORA_CMD_QUEUE_SIZE_MAX                                 (7)
-#define LORA_DATA_QUEUE_SIZE_MAX                                (7)
+#define LORA_RX_RING_SIZE                                       (2048)  // a power of 2
+#define LORA_CAPTURE_RECORDS                                    (512)   // a power of 2, 16 bytes each
 #define LORA_CB_QUEUE_SIZE_MAX                                  (7)
 #define LORA_STACK_SIZE                                         (4096)
 #define LORA_TIMER_STACK_SIZE                                   (3072)
@@ -41,28 +42,12 @@ typedef enum {
     E_LORA_CMD_LORAWAN_TX,
     E_LORA_CMD_SLEEP,
     E_LORA_CMD_WAKE_UP,
+    E_LORA_CMD_CLASS_B,
 } lora_cmd_t;
 
 typedef enum {
     E_LORA_NVS_ELE_JOINED = 0,
-    E_LORA_NVS_ELE_UPLINK,
-    E_LORA_NVS_ELE_DWLINK,
-    E_LORA_NVS_ELE_DEVADDR,
-    E_LORA_NVS_ELE_NWSKEY,
-    E_LORA_NVS_ELE_APPSKEY,
-    E_LORA_NVS_ELE_NET_ID,
-    E_LORA_NVS_ELE_ADR_ACKS,
-    E_LORA_NVS_ELE_MAC_PARAMS,
-    E_LORA_NVS_ELE_CHANNELS,
-    E_LORA_NVS_ELE_ACK_REQ,
-    E_LORA_NVS_MAC_NXT_TX,
-    E_LORA_NVS_MAC_CMD_BUF_IDX,
-    E_LORA_NVS_MAC_CMD_BUF_RPT_IDX,
-    E_LORA_NVS_ELE_MAC_BUF,
-    E_LORA_NVS_ELE_MAC_RPT_BUF,
     E_LORA_NVS_ELE_REGION,
-    E_LORA_NVS_ELE_CHANNELMASK,
-    E_LORA_NVS_ELE_CHANNELMASK_REMAINING,
     E_LORA_NVS_NUM_KEYS
 } e_lora_nvs_key_t;
 
@@ -120,11 +105,16 @@ typedef struct {
     bool        add;
 } lora_config_channel_cmd_data_t;
 
+typedef struct {
+    uint8_t     periodicity;
+} lora_class_b_cmd_data_t;
+
 typedef union {
     lora_init_cmd_data_t                init;
     lora_join_cmd_data_t                join;
     lora_tx_cmd_data_t                  tx;
     lora_config_channel_cmd_data_t      channel;
+    lora_class_b_cmd_data_t             class_b;
 } lora_cmd_info_u_t;
 
 typedef struct {
@@ -134,12 +124,6 @@ typedef struct {
 
 ///////////////////////////////////////////
 
-typedef struct {
-    uint8_t data[LORA_PAYLOAD_SIZE_MAX + 1];
-    uint8_t len;
-    uint8_t port;
-} lora_rx_data_t;
-
 typedef void ( *modlora_timerCallback )( void );
 /******************************************************************************
  EXPORTED DATA
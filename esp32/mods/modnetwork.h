@@ -107,6 +107,7 @@ typedef struct _mod_network_socket_base_t {
     mod_network_sock_conn_status_t conn_status;
     int err;
     uint8_t domain;
+    uint32_t deadline;          // LoRaWAN: ms a queued uplink may wait from send(), 0 for none
 } mod_network_socket_base_t;
 
 typedef struct _mod_network_socket_obj_t {
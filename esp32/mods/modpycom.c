@@ -173,33 +173,73 @@ STATIC mp_obj_t mod_pycom_rgb_led (mp_obj_t o_color) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(mod_pycom_rgb_led_obj, mod_pycom_rgb_led);
 
-STATIC mp_obj_t mod_pycom_ota_start (void) {
-    if (!updater_start()) {
+STATIC mp_obj_t mod_pycom_ota_start (size_t n_args, const mp_obj_t *args) {
+    if (n_args == 0) {
+        if (!updater_start()) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_operation_failed));
+        }
+        return mp_const_none;
+    }
+
+    // ota_start(size, sha256, [chunk_size]) starts or resumes a chunked update
+    // and returns the index of the first chunk to send
+    mp_buffer_info_t digest;
+    if (n_args < 2) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_TypeError, mpexception_num_type_invalid_arguments));
+    }
+    mp_get_buffer_raise(args[1], &digest, MP_BUFFER_READ);
+    if (digest.len != 32) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, mpexception_value_invalid_arguments));
+    }
+    int ret = updater_session_start(mp_obj_get_int(args[0]), (n_args > 2) ? mp_obj_get_int(args[2]) : 0, digest.buf);
+    if (ret < 0) {
         nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_operation_failed));
     }
-    return mp_const_none;
+    return mp_obj_new_int(ret);
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_pycom_ota_start_obj, mod_pycom_ota_start);
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_pycom_ota_start_obj, 0, 3, mod_pycom_ota_start);
 
-STATIC mp_obj_t mod_pycom_ota_write (mp_obj_t data) {
+STATIC mp_obj_t mod_pycom_ota_write (size_t n_args, const mp_obj_t *args) {
     mp_buffer_info_t bufinfo;
-    mp_get_buffer_raise(data, &bufinfo, MP_BUFFER_READ);
-
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+
+    if (n_args > 1) {
+        // ota_write(data, chunk, [sha256]) returns the index of the next chunk to send
+        mp_buffer_info_t digest = { .buf = NULL };
+        if (n_args > 2) {
+            mp_get_buffer_raise(args[2], &digest, MP_BUFFER_READ);
+            if (digest.len != 32) {
+                nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, mpexception_value_invalid_arguments));
+            }
+        }
+        int ret = updater_session_write(mp_obj_get_int(args[1]), bufinfo.buf, bufinfo.len, digest.buf);
+        if (ret < 0) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_operation_failed));
+        }
+        return mp_obj_new_int(ret);
+    }
     if (!updater_write(bufinfo.buf, bufinfo.len)) {
         nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_operation_failed));
     }
     return mp_const_none;
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_1(mod_pycom_ota_write_obj, mod_pycom_ota_write);
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_pycom_ota_write_obj, 1, 3, mod_pycom_ota_write);
 
 STATIC mp_obj_t mod_pycom_ota_finish (void) {
-    if (!updater_finish()) {
+    if (!(updater_session_active() ? updater_session_finish() : updater_finish())) {
         nlr_raise(mp_obj_new_exception_msg(&mp_type_OSError, mpexception_os_operation_failed));
     }
     return mp_const_none;
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_pycom_ota_finish_obj, mod_pycom_ota_finish);
 
+// forgets the progress of a chunked update, the next ota_start() starts over
+STATIC mp_obj_t mod_pycom_ota_abort (void) {
+    updater_session_abort();
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_pycom_ota_abort_obj, mod_pycom_ota_abort);
+
 STATIC mp_obj_t mod_pycom_ota_verify (void) {
     bool ret_val = updater_verify();
     return mp_obj_new_bool(ret_val);
@@ -1017,6 +1057,7 @@ STATIC const mp_map_elem_t pycom_module_globals_table[] = {
         { MP_OBJ_NEW_QSTR(MP_QSTR_ota_start),                       (mp_obj_t)&mod_pycom_ota_start_obj },
         { MP_OBJ_NEW_QSTR(MP_QSTR_ota_write),                       (mp_obj_t)&mod_pycom_ota_write_obj },
         { MP_OBJ_NEW_QSTR(MP_QSTR_ota_finish),                      (mp_obj_t)&mod_pycom_ota_finish_obj },
+        { MP_OBJ_NEW_QSTR(MP_QSTR_ota_abort),                       (mp_obj_t)&mod_pycom_ota_abort_obj },
         { MP_OBJ_NEW_QSTR(MP_QSTR_ota_verify),                      (mp_obj_t)&mod_pycom_ota_verify_obj },
         { MP_OBJ_NEW_QSTR(MP_QSTR_ota_slot),                        (mp_obj_t)&mod_pycom_ota_slot_obj },
         { MP_OBJ_NEW_QSTR(MP_QSTR_diff_update_enabled),             (mp_obj_t)&mod_pycom_diff_update_enabled_obj },
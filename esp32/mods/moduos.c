@@ -43,6 +43,7 @@
 #include "py/nlr.h"
 #include "py/objtuple.h"
 #include "py/objstr.h"
+#include "py/mperrno.h"
 #include "py/runtime.h"
 #include "timeutils.h"
 #include "lib/oofatfs/ff.h"
@@ -170,6 +171,63 @@ STATIC mp_obj_t os_urandom(mp_obj_t num) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(os_urandom_obj, os_urandom);
 
+// Tunes the file system mounted at path, eg uos.fsconfig('/flash', block_cycles=100);
+// returns its current settings.  Only LittleFS volumes can be tuned.
+STATIC mp_obj_t os_fsconfig(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+    const char *path = mp_obj_str_get_str(pos_args[0]);
+    for (mp_vfs_mount_t *vfs = MP_STATE_VM(vfs_mount_table); vfs != NULL; vfs = vfs->next) {
+        if (!strcmp(vfs->str, path)) {
+            mp_obj_t dest[2];
+            mp_load_method_maybe(vfs->obj, MP_QSTR_fsconfig, dest);
+            if (dest[0] == MP_OBJ_NULL) {
+                mp_raise_OSError(MP_EOPNOTSUPP);
+            }
+            // pass the remaining arguments on to the VFS object's method
+            size_t n_kw = kw_args->used;
+            size_t n_call = 2 + (n_args - 1) + 2 * n_kw;
+            mp_obj_t *call_args = m_new(mp_obj_t, n_call);
+            call_args[0] = dest[0];
+            call_args[1] = dest[1];
+            memcpy(&call_args[2], &pos_args[1], (n_args - 1) * sizeof(mp_obj_t));
+            mp_obj_t *kw = &call_args[2 + n_args - 1];
+            for (size_t i = 0; i < kw_args->alloc; i++) {
+                if (MP_MAP_SLOT_IS_FILLED(kw_args, i)) {
+                    *kw++ = kw_args->table[i].key;
+                    *kw++ = kw_args->table[i].value;
+                }
+            }
+            mp_obj_t res = mp_call_method_n_kw(n_args - 1, n_kw, call_args);
+            m_del(mp_obj_t, call_args, n_call);
+            return res;
+        }
+    }
+    mp_raise_OSError(MP_ENODEV);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(os_fsconfig_obj, 1, os_fsconfig);
+
+#if MICROPY_PORT_SFLASH_FTL
+// Erase counts of the flash blocks under /flash: (min, max, total, counts)
+// with counts a tuple of the count of each data block
+STATIC mp_obj_t os_flash_wear(void) {
+    sflash_ftl_stats_t stats;
+    if (!sflash_disk_get_ftl_stats(&stats)) {
+        mp_raise_OSError(MP_ENODEV);
+    }
+    mp_obj_tuple_t *counts = MP_OBJ_TO_PTR(mp_obj_new_tuple(stats.n_blocks, NULL));
+    for (uint32_t i = 0; i < stats.n_blocks; i++) {
+        counts->items[i] = mp_obj_new_int_from_uint(stats.erase_counts[i]);
+    }
+    mp_obj_t tuple[4] = {
+        mp_obj_new_int_from_uint(stats.min_erases),
+        mp_obj_new_int_from_uint(stats.max_erases),
+        mp_obj_new_int_from_uint(stats.total_erases),
+        MP_OBJ_FROM_PTR(counts),
+    };
+    return mp_obj_new_tuple(4, tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(os_flash_wear_obj, os_flash_wear);
+#endif
+
 STATIC mp_obj_t os_dupterm(uint n_args, const mp_obj_t *args) {
     if (n_args == 0) {
         if (MP_STATE_PORT(mp_os_stream_o) == MP_OBJ_NULL) {
@@ -211,6 +269,7 @@ STATIC const mp_rom_map_elem_t os_module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_statvfs),         MP_ROM_PTR(&mp_vfs_statvfs_obj) },
     { MP_ROM_QSTR(MP_QSTR_getfree),         MP_ROM_PTR(&mp_vfs_getfree_obj) },
     { MP_ROM_QSTR(MP_QSTR_fsformat),        MP_ROM_PTR(&mp_vfs_fsformat_obj) },
+    { MP_ROM_QSTR(MP_QSTR_fsconfig),        MP_ROM_PTR(&os_fsconfig_obj) },
     { MP_ROM_QSTR(MP_QSTR_unlink),          MP_ROM_PTR(&mp_vfs_remove_obj) },
 
     { MP_ROM_QSTR(MP_QSTR_sync),            MP_ROM_PTR(&mod_os_sync_obj) },
@@ -222,7 +281,10 @@ STATIC const mp_rom_map_elem_t os_module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_mount),           MP_ROM_PTR(&mp_vfs_mount_obj) },
     { MP_ROM_QSTR(MP_QSTR_umount),          MP_ROM_PTR(&mp_vfs_umount_obj) },
     { MP_ROM_QSTR(MP_QSTR_mkfat),          MP_ROM_PTR(&mp_fat_vfs_type) },
-    { MP_ROM_QSTR(MP_QSTR_dupterm),         MP_ROM_PTR(&os_dupterm_obj) }
+    { MP_ROM_QSTR(MP_QSTR_dupterm),         MP_ROM_PTR(&os_dupterm_obj) },
+    #if MICROPY_PORT_SFLASH_FTL
+    { MP_ROM_QSTR(MP_QSTR_flash_wear),      MP_ROM_PTR(&os_flash_wear_obj) },
+    #endif
 };
 
 STATIC MP_DEFINE_CONST_DICT(os_module_globals, os_module_globals_table);
@@ -509,6 +509,38 @@ STATIC mp_obj_t socket_recv(mp_obj_t self_in, mp_obj_t len_in) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_2(socket_recv_obj, socket_recv);
 
+// method socket.recv_into(buf[, nbytes])
+// receives straight into buf, nothing is allocated
+STATIC mp_obj_t socket_recv_into(size_t n_args, const mp_obj_t *args) {
+    mod_network_socket_obj_t *self = args[0];
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_WRITE);
+    mp_uint_t len = bufinfo.len;
+    if (n_args > 2) {
+        mp_int_t nbytes = mp_obj_get_int(args[2]);
+        if (nbytes > 0 && (mp_uint_t)nbytes < len) {
+            len = nbytes;
+        }
+    }
+    int _errno;
+    MP_THREAD_GIL_EXIT();
+    mp_int_t ret = self->sock_base.nic_type->n_recv(self, bufinfo.buf, len, &_errno);
+    MP_THREAD_GIL_ENTER();
+    if (ret < 0) {
+        if (_errno == MP_EAGAIN || _errno == MBEDTLS_ERR_SSL_TIMEOUT ) {
+            if (self->sock_base.timeout > 0) {
+                nlr_raise(mp_obj_new_exception_msg(&mp_type_TimeoutError, "timed out"));
+            } else {
+                ret = 0;        // non-blocking socket
+            }
+        } else {
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+        }
+    }
+    return mp_obj_new_int(ret);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(socket_recv_into_obj, 2, 3, socket_recv_into);
+
 // method socket.sendto(bytes, address)
 STATIC mp_obj_t socket_sendto(mp_obj_t self_in, mp_obj_t data_in, mp_obj_t addr_in) {
     mod_network_socket_obj_t *self = self_in;
@@ -794,6 +826,7 @@ STATIC const mp_map_elem_t socket_locals_dict_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR_send),            (mp_obj_t)&socket_send_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_sendall),         (mp_obj_t)&socket_send_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_recv),            (mp_obj_t)&socket_recv_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_recv_into),       (mp_obj_t)&socket_recv_into_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_sendto),          (mp_obj_t)&socket_sendto_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_recvfrom),        (mp_obj_t)&socket_recvfrom_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_setsockopt),      (mp_obj_t)&socket_setsockopt_obj },
@@ -819,11 +852,13 @@ STATIC const mp_map_elem_t raw_socket_locals_dict_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR_send),            (mp_obj_t)&socket_send_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_sendto),          (mp_obj_t)&socket_sendto_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_recv),            (mp_obj_t)&socket_recv_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_recv_into),       (mp_obj_t)&socket_recv_into_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_recvfrom),        (mp_obj_t)&socket_recvfrom_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_settimeout),      (mp_obj_t)&socket_settimeout_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_bind),            (mp_obj_t)&socket_bind_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_setblocking),     (mp_obj_t)&socket_setblocking_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_setsockopt),      (mp_obj_t)&socket_setsockopt_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_flush),           (mp_obj_t)&mp_stream_flush_obj },
 };
 #else   // SIPY
 STATIC const mp_map_elem_t raw_socket_locals_dict_table[] = {
@@ -1041,6 +1076,11 @@ STATIC const mp_map_elem_t mp_module_usocket_globals_table[] = {
 #if defined(LOPY) || defined (LOPY4) || defined(FIPY)
     { MP_OBJ_NEW_QSTR(MP_QSTR_SO_CONFIRMED),    MP_OBJ_NEW_SMALL_INT(SO_LORAWAN_CONFIRMED) },
     { MP_OBJ_NEW_QSTR(MP_QSTR_SO_DR),           MP_OBJ_NEW_SMALL_INT(SO_LORAWAN_DR) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_PRIORITY),     MP_OBJ_NEW_SMALL_INT(SO_LORAWAN_PRIORITY) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_DEADLINE),     MP_OBJ_NEW_SMALL_INT(SO_LORAWAN_DEADLINE) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_COALESCE),     MP_OBJ_NEW_SMALL_INT(SO_LORAWAN_COALESCE) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_AGGREGATE),    MP_OBJ_NEW_SMALL_INT(SO_LORAWAN_AGGREGATE) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_PACK),         MP_OBJ_NEW_SMALL_INT(SO_LORAWAN_PACK) },
 #endif
 #if defined(SIPY) || defined (LOPY4) || defined(FIPY)
      { MP_OBJ_NEW_QSTR(MP_QSTR_SO_RX),          MP_OBJ_NEW_SMALL_INT(SO_SIGFOX_RX) },
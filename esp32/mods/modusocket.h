@@ -53,6 +53,11 @@
 #define SO_SIGFOX_TX_REPEAT                 (0xF0005)
 #define SO_SIGFOX_OOB                       (0xF0006)
 #define SO_SIGFOX_BIT                       (0xF0007)
+#define SO_LORAWAN_PRIORITY                 (0xF0008)
+#define SO_LORAWAN_DEADLINE                 (0xF0009)
+#define SO_LORAWAN_COALESCE                 (0xF000A)
+#define SO_LORAWAN_AGGREGATE                (0xF000B)
+#define SO_LORAWAN_PACK                     (0xF000C)
 
 /* chars for storing an IPv6 address 39 chars + zero end string
 * ex: ABCD:ABCD:ABCD:ABCD:ABCD:ABCD:ABCD:ABCD 4*8+7=39 chars */
@@ -75,7 +75,12 @@ STATIC mp_obj_t pyb_flash_ioctl(mp_obj_t self, mp_obj_t cmd_in, mp_obj_t arg_in)
         case BP_IOCTL_DEINIT: sflash_disk_flush(); return MP_OBJ_NEW_SMALL_INT(0);
         case BP_IOCTL_SYNC: sflash_disk_flush(); return MP_OBJ_NEW_SMALL_INT(0);
         case BP_IOCTL_SEC_COUNT:
+            #if MICROPY_PORT_SFLASH_FTL
+            // the FTL keeps some blocks for itself
+            return MP_OBJ_NEW_SMALL_INT(sflash_get_sector_count());
+            #else
             return (spi_flash_get_chip_size() > (4 * 1024 * 1024)) ? MP_OBJ_NEW_SMALL_INT(SFLASH_FS_SECTOR_COUNT_8MB) : MP_OBJ_NEW_SMALL_INT(SFLASH_FS_SECTOR_COUNT_4MB);
+            #endif
         case BP_IOCTL_SEC_SIZE: return MP_OBJ_NEW_SMALL_INT(SFLASH_FS_SECTOR_SIZE);
         default: return mp_const_none;
     }
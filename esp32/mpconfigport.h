@@ -40,6 +40,7 @@
 #define __INCLUDED_MPCONFIGPORT_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include "mp_pycom_err.h"
 
 // options to control how Micro Python is built
@@ -48,6 +49,11 @@
 #define MICROPY_EMIT_X64                            (0)
 #define MICROPY_EMIT_THUMB                          (0)
 #define MICROPY_EMIT_INLINE_THUMB                   (0)
+// py/asmxtensa.c emits call0 ABI code (callx0, ret.n), but the firmware is
+// built for the windowed ABI, so native code called from C would corrupt the
+// register window: leave the xtensa emitters off until there is a windowed one
+#define MICROPY_EMIT_XTENSA                         (0)
+#define MICROPY_EMIT_INLINE_XTENSA                  (0)
 #define MICROPY_MEM_STATS                           (0)
 #define MICROPY_DEBUG_PRINTERS                      (1)
 #define MICROPY_ENABLE_GC                           (1)
@@ -80,6 +86,10 @@
 #define MICROPY_PY_CMATH                            (1)
 #define MICROPY_PY_IO                               (1)
 #define MICROPY_PY_IO_FILEIO                        (1)
+#define MICROPY_PY_IO_BUFFEREDREADER                (1)
+#define MICROPY_PY_IO_BUFFEREDWRITER                (1)
+#define MICROPY_VFS_WRITEBEHIND                     (1)
+#define MICROPY_VFS_WRITEBEHIND_TASK                (1)
 #define MICROPY_PY_STRUCT                           (1)
 #define MICROPY_PY_SYS                              (1)
 #define MICROPY_PY_THREAD                           (1)
@@ -141,6 +151,7 @@
 #define MICROPY_FATFS_REENTRANT                     (1)
 #define MICROPY_FATFS_TIMEOUT                       (5000)
 #define MICROPY_FATFS_SYNC_T                        SemaphoreHandle_t
+#define MICROPY_FATFS_DIRCACHE                      (1024) // objects of the largest directory looked up by hash
 
 #define MICROPY_VFS                                 (1)
 #define MICROPY_VFS_FAT                             (1)
@@ -173,6 +184,11 @@ typedef long mp_off_t;
 
 #define MP_PLAT_PRINT_STRN(str, len)                mp_hal_stdout_tx_strn_cooked(str, len)
 
+// native code (from @micropython.native/viper or .mpy files) must run from IRAM
+void *esp_native_code_commit(void *buf, size_t len);
+void esp_native_code_free_all(void);
+#define MP_PLAT_COMMIT_EXEC(buf, len)               esp_native_code_commit(buf, len)
+
 // extra built in names to add to the global namespace
 #define MICROPY_PORT_BUILTINS \
     { MP_OBJ_NEW_QSTR(MP_QSTR_help),  (mp_obj_t)&mp_builtin_help_obj },   \
@@ -262,6 +278,11 @@ extern const struct _mp_obj_module_t mp_module_uqueue;
 #define MICROPY_HW_MCU_NAME                                     "ESP32"
 #define MICROPY_PORT_SFLASH_BLOCK_COUNT_4MB                     127
 #define MICROPY_PORT_SFLASH_BLOCK_COUNT_8MB                     1024
+// Put the FAT volume on a wear-levelling flash translation layer.  This
+// changes the on-flash layout, so an existing FAT filesystem is reformatted.
+#ifndef MICROPY_PORT_SFLASH_FTL
+#define MICROPY_PORT_SFLASH_FTL                                 (0)
+#endif
 
 #define DEFAULT_AP_PASSWORD                                     "www.pycom.io"
 #define DEFAULT_AP_CHANNEL                                      (6)
@@ -81,6 +81,7 @@
 #include "freertos/queue.h"
 
 #include "extmod/vfs_fat.h"
+#include "extmod/vfs_writebehind.h"
 
 #include "ff.h"
 #include "diskio.h"
@@ -375,10 +376,16 @@ soft_reset:
 
 soft_reset_exit:
 
+    // write out the queued data of write-behind files before their objects go away
+    mp_vfs_wb_deinit();
     machtimer_deinit();
 #if MICROPY_PY_THREAD
     mp_irq_kill();
     mp_thread_deinit();
+#endif
+#if MICROPY_EMIT_NATIVE
+    // no code object of the old heap is left to run it
+    esp_native_code_free_all();
 #endif
     mpsleep_signal_soft_reset();
     mp_printf(&mp_plat_print, "PYB: soft reboot\n");
@@ -435,6 +442,17 @@ STATIC void mptask_init_sflash_filesystem_fatfs(void) {
     vfs_fat->flags = 0;
     pyb_flash_init_vfs(vfs_fat);
 
+    #if FF_USE_DIRCACHE
+    // outside of the MicroPython heap, so it's kept across soft resets
+    static DWORD *dircache = NULL;
+    if (dircache == NULL) {
+        dircache = malloc(MICROPY_FATFS_DIRCACHE * sizeof(DWORD));
+    }
+    if (dircache != NULL) {
+        f_dircache(&vfs_fat->fs.fatfs, dircache, MICROPY_FATFS_DIRCACHE);
+    }
+    #endif
+
     FILINFO fno;
 
     // Create it if needed, and mount it on /flash.
@@ -515,7 +533,7 @@ STATIC void mptask_init_sflash_filesystem_littlefs(void) {
     lfs_t *littlefsptr = &(vfs_littlefs->fs.littlefs.lfs);
 
     //Initialize the block device
-    sflash_disk_init();
+    sflash_disk_init_littlefs();
     //Initialize the VFS object with the block device's functions
     pyb_flash_init_vfs_littlefs(vfs_littlefs);
 
@@ -61,8 +61,6 @@ extern TaskHandle_t svTaskHandle;
  DECLARE PUBLIC FUNCTIONS
  ******************************************************************************/
 void TASK_Servers (void *pvParameters) {
-    bool cycle = false;
-
     strcpy (servers_user, SERVERS_DEF_USER);
     strcpy (servers_pass, SERVERS_DEF_PASS);
 
@@ -99,11 +97,10 @@ void TASK_Servers (void *pvParameters) {
             modusocket_close_all_user_sockets();
         }
 
-        if (cycle) {
-            telnet_run();
-        } else {
-            ftp_run();
-        }
+        telnet_run();
+        // while it runs, the FTP server waits for its sockets for up to one
+        // cycle, which also paces the loop
+        bool waited = ftp_run();
 
         if (sleep_sockets) {
 //            pybwdt_srv_sleeping(true);  //  FIXME
@@ -125,8 +122,9 @@ void TASK_Servers (void *pvParameters) {
         }
 
         // move to the next cycle
-        cycle = cycle ? false : true;
-        vTaskDelay (SERVERS_CYCLE_TIME_MS / portTICK_PERIOD_MS);
+        if (!waited) {
+            vTaskDelay (SERVERS_CYCLE_TIME_MS / portTICK_PERIOD_MS);
+        }
     }
 }
 
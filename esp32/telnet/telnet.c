@@ -15,6 +15,7 @@
 #include "py/mphal.h"
 #include "readline.h"
 #include "telnet.h"
+#include "telnet_proto.h"
 #include "serverstask.h"
 
 #include "esp_heap_caps.h"
@@ -43,21 +44,15 @@
 #define TELNET_PORT                         23
 // rxRindex and rxWindex must be uint8_t and TELNET_RX_BUFFER_SIZE == 256
 #define TELNET_RX_BUFFER_SIZE               256
+// output queue, must be a power of 2
+#define TELNET_TX_BUFFER_SIZE               2048
 #define TELNET_MAX_CLIENTS                  1
 #define TELNET_TX_RETRIES_MAX               50
-#define TELNET_WAIT_TIME_MS                 2
 #define TELNET_LOGIN_RETRIES_MAX            3
-#define TELNET_CYCLE_TIME_MS                (SERVERS_CYCLE_TIME_MS * 2)
-
-#define SE 240
-#define AYT 246
-#define IAC 255
-#define SB 250
-#define WILL 251
-#define WONT 252
-#define DO 253
-#define DONT 254
-#define TRANSMIT_BINARY 0
+
+#define IAC TELNET_PROTO_IAC
+#define WILL TELNET_PROTO_WILL
+#define WONT TELNET_PROTO_WONT
 #define ECHO 1
 #define SUPPRESS_GO_AHEAD 3
 #define LINEMODE 34
@@ -100,7 +95,7 @@ typedef union {
 
 typedef struct {
     uint8_t             *rxBuffer;
-    uint32_t            timeout;
+    uint32_t            rx_time;            // ms tick of the last data received
     telnet_state_t      state;
     telnet_substate_t   substate;
     int32_t             sd;
@@ -110,21 +105,17 @@ typedef struct {
     uint8_t             rxWindex;
     uint8_t             rxRindex;
 
-    // used to store incoming chars in cases the reception needs to be
-    // completed later
-    uint8_t             rxIncompleteLen;
-
     uint8_t             txRetries;
     uint8_t             loginRetries;
     bool                enabled;
     bool                credentialsValid;
-    bool                binary_mode;
 } telnet_data_t;
 
 /******************************************************************************
  DECLARE PRIVATE DATA
  ******************************************************************************/
 static telnet_data_t telnet_data;
+static telnet_proto_t telnet_proto;
 static const char* telnet_welcome_msg       = "MicroPython " MICROPY_GIT_TAG " on " MICROPY_BUILD_DATE "; " MICROPY_HW_BOARD_NAME " with " MICROPY_HW_MCU_NAME "\r\n";
 static const char* telnet_request_user      = "Login as: ";
 static const char* telnet_request_password  = "Password: ";
@@ -146,15 +137,27 @@ static telnet_result_t telnet_recv_text_non_blocking (void *buff, int32_t Maxlen
 static void telnet_process (void);
 static int telnet_process_credential (char *credential, int32_t rxLen);
 static void telnet_parse_input (uint8_t *str, int32_t *len);
-static bool telnet_send_with_retries (int32_t sd, const void *pBuf, int32_t len);
+static void telnet_proto_interrupt (void);
+static void telnet_proto_safe_boot (void);
+static int telnet_proto_interrupt_char (void);
+static void telnet_proto_wait (void);
 static void telnet_reset_buffer (void);
 
+static const telnet_proto_ops_t telnet_proto_ops = {
+    .interrupt = telnet_proto_interrupt,
+    .safe_boot = telnet_proto_safe_boot,
+    .interrupt_char = telnet_proto_interrupt_char,
+    .ticks_ms = mp_hal_ticks_ms,
+    .wait = telnet_proto_wait,
+};
+
 /******************************************************************************
  DEFINE PUBLIC FUNCTIONS
  ******************************************************************************/
 void telnet_init (void) {
-    // allocate memory for the receive buffer (from the RTOS heap)
+    // allocate memory for the receive and send buffers (from the RTOS heap)
     telnet_data.rxBuffer = malloc(TELNET_RX_BUFFER_SIZE);
+    telnet_proto_init(&telnet_proto, &telnet_proto_ops, malloc(TELNET_TX_BUFFER_SIZE), TELNET_TX_BUFFER_SIZE);
     telnet_data.state = E_TELNET_STE_DISABLED;
 }
 
@@ -251,7 +254,13 @@ void telnet_run (void) {
     }
 
     if (telnet_data.state >= E_TELNET_STE_CONNECTED) {
-        if (telnet_data.timeout++ > (servers_get_timeout() / TELNET_CYCLE_TIME_MS)) {
+        // replies to the client's commands, and the REPL output when it's due
+        if (telnet_proto_flush(&telnet_proto, telnet_data.n_sd) < 0) {
+            telnet_reset();
+            return;
+        }
+        // by the clock, telnet_run() is called at no fixed rate
+        if (mp_hal_ticks_ms() - telnet_data.rx_time > servers_get_timeout()) {
             telnet_reset();
         }
     }
@@ -259,7 +268,8 @@ void telnet_run (void) {
 
 void telnet_tx_strn (const char *str, int len) {
     if (telnet_data.n_sd > 0 && telnet_data.state == E_TELNET_STE_LOGGED_IN && len > 0) {
-        telnet_send_with_retries(telnet_data.n_sd, str, len);
+        // queued, and sent by the servers task from telnet_run
+        telnet_proto_write(&telnet_proto, str, len);
     }
 }
 
@@ -289,6 +299,7 @@ void telnet_disable (void) {
 
 void telnet_reset (void) {
     // close the connection and start all over again
+    telnet_proto_close(&telnet_proto);
     servers_close_socket(&telnet_data.n_sd);
     servers_close_socket(&telnet_data.sd);
     telnet_data.state = E_TELNET_STE_START;
@@ -373,18 +384,21 @@ static void telnet_wait_for_connection (void) {
         option |= O_NONBLOCK;
         fcntl(telnet_data.n_sd, F_SETFL, option);
 
+        // the output is coalesced before it's sent
+        option = 1;
+        setsockopt(telnet_data.n_sd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
         // client connected, so go on
         telnet_data.rxWindex = 0;
         telnet_data.rxRindex = 0;
         telnet_data.txRetries = 0;
-        telnet_data.rxIncompleteLen = 0;
+        telnet_proto_open(&telnet_proto);
 
         telnet_data.state = E_TELNET_STE_CONNECTED;
         telnet_data.substate.connected = E_TELNET_STE_SUB_WELCOME;
         telnet_data.credentialsValid = true;
         telnet_data.loginRetries = 0;
-        telnet_data.timeout = 0;
-        telnet_data.binary_mode = false;
+        telnet_data.rx_time = mp_hal_ticks_ms();
     }
 }
 
@@ -411,7 +425,7 @@ static telnet_result_t telnet_recv_text_non_blocking (void *buff, int32_t Maxlen
     *rxLen = recv(telnet_data.n_sd, buff, Maxlen, 0);
     // if there's data received, parse it
     if (*rxLen > 0) {
-        telnet_data.timeout = 0;
+        telnet_data.rx_time = mp_hal_ticks_ms();
         telnet_parse_input (buff, rxLen);
         if (*rxLen > 0) {
             return E_TELNET_RESULT_OK;
@@ -459,123 +473,26 @@ static int telnet_process_credential (char *credential, int32_t rxLen) {
     return 0;
 }
 
-static uint8_t telnet_get_reply_verb(uint8_t verb) {
-    if (verb < DO) {
-        // translate a will into do and a won't into don't
-        return verb + (DO - WILL);
-    } else {
-        // if not, translate a do into will and don't into won't
-        return verb - (DO - WILL);
-    }
+static void telnet_parse_input (uint8_t *str, int32_t *len) {
+    *len = telnet_proto_parse(&telnet_proto, str, *len, telnet_data.state == E_TELNET_STE_LOGGED_IN);
 }
 
-static int telnet_process_IAC (uint8_t **strR, uint8_t **strW, int32_t *len, uint32_t remaining) {
-    if (remaining >= 2)  {
-        switch (*((*strR) + 1)) {
-            case IAC:
-                // double IAC char (0xFF) means escaped 0xFF
-                **strW = 0xFF;
-                (*strW)++;
-                (*strR) += 2;
-                (*len)--;
-                return 0;
-
-            case AYT:
-                // reply to the AYT with an echo of the IAC AYT
-                telnet_tx_strn((char *) *strR, 2);
-                (*strR) += 2;
-                (*len) -= 2;
-                return 0;
-        }
-    }
-
-    if (remaining >= 3) {
-        if (*((*strR) + 2) == TRANSMIT_BINARY) {
-            uint8_t option = *((*strR) + 1);
-            if (option == WILL) telnet_data.binary_mode = true;
-            if (option == WONT) telnet_data.binary_mode = false;
-            *((*strR) + 1) = telnet_get_reply_verb(option);
-            telnet_tx_strn((char *) *strR, 3);
-        }
-        (*strR) += 3;
-        (*len) -= 3;
-        return 0;
-    } else {
-        // not enough characters to continue
-        *len -= remaining;
-        return remaining;
-    }
-    return 0;
+static void telnet_proto_interrupt (void) {
+    mp_keyboard_interrupt();
 }
 
-static void telnet_parse_input (uint8_t *str, int32_t *len) {
-    int32_t b_len = *len;
-    uint8_t *b_str = str - telnet_data.rxIncompleteLen;
-
-    *len += telnet_data.rxIncompleteLen;
-    b_len = *len;
-
-    for (uint8_t *_str = b_str; _str < b_str + b_len; ) {
-        uint8_t ch = *_str;
-        if (ch == IAC) {
-            uint32_t remaining = b_len - (_str - b_str);
-            telnet_data.rxIncompleteLen = telnet_process_IAC(&_str, &str, len, remaining);
-            if (telnet_data.rxIncompleteLen > 0) {
-                break;
-            }
-            continue;
-        }
-
-        if (telnet_data.binary_mode == true) {
-            *str++ = *_str++;
-            continue;
-        }
-
-        // in this case the server is not operating in binary mode
-        if (ch > 127 || ch == 0 || (telnet_data.state == E_TELNET_STE_LOGGED_IN &&
-            (ch == mp_interrupt_char || ch == CHAR_CTRL_F))) {
-            if (ch == mp_interrupt_char) {
-                mp_keyboard_interrupt();
-            } else if (ch == CHAR_CTRL_F) {
-                *str++ = CHAR_CTRL_D;
-                mp_hal_reset_safe_and_boot(false);
-                _str++;
-                continue;
-            }
-            // skip this char
-            (*len)--;
-            _str++;
-        } else {
-            *str++ = *_str++;
-        }
-    }
+static void telnet_proto_safe_boot (void) {
+    mp_hal_reset_safe_and_boot(false);
 }
 
-static bool telnet_send_with_retries (int32_t sd, const void *pBuf, int32_t len) {
-    int32_t retries = 0;
-    uint32_t delay = TELNET_WAIT_TIME_MS;
-
-    do {
-        // make it blocking
-        uint32_t option = fcntl(sd, F_GETFL, 0);
-        option &= ~O_NONBLOCK;
-        fcntl(sd, F_SETFL, option);
-        if (send(sd, pBuf, len, 0) > 0) {
-            // make it non-blocking again
-            option |= O_NONBLOCK;
-            fcntl(sd, F_SETFL, option);
-            return true;
-        } else if (EAGAIN != errno) {
-            // make it non-blocking again
-            option |= O_NONBLOCK;
-            fcntl(sd, F_SETFL, option);
-            return false;
-        }
-        // start with the default delay and increment it on each retry
-        mp_hal_delay_ms(delay++);
-    } while (++retries <= TELNET_TX_RETRIES_MAX);
+static int telnet_proto_interrupt_char (void) {
+    return mp_interrupt_char;
+}
 
-    return false;
+static void telnet_proto_wait (void) {
+    // without giving up the GIL, so that output of other threads keeps its
+    // order; the servers task drains the queue meanwhile
+    vTaskDelay(1);
 }
 
 static void telnet_reset_buffer (void) {
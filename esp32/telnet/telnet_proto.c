@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#include "telnet_proto.h"
+
+/******************************************************************************
+ DEFINE PRIVATE CONSTANTS
+ ******************************************************************************/
+#define TELNET_PROTO_CTRL_D             (0x04)
+#define TELNET_PROTO_CTRL_F             (0x06)
+
+/******************************************************************************
+ DEFINE PRIVATE TYPES
+ ******************************************************************************/
+typedef enum {
+    E_TELNET_PROTO_RX_DATA = 0,
+    E_TELNET_PROTO_RX_IAC,              // after an IAC
+    E_TELNET_PROTO_RX_OPTION,           // after IAC and WILL, WONT, DO or DONT
+    E_TELNET_PROTO_RX_SB,               // in a subnegotiation, skipped up to IAC SE
+    E_TELNET_PROTO_RX_SB_IAC,
+} telnet_proto_rx_state_t;
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static void telnet_proto_reply(telnet_proto_t *p, const uint8_t *data, uint32_t len);
+static uint8_t telnet_proto_reply_verb(uint8_t verb);
+static uint32_t telnet_proto_load(volatile uint32_t *v);
+static void telnet_proto_store(volatile uint32_t *v, uint32_t value);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void telnet_proto_init(telnet_proto_t *p, const telnet_proto_ops_t *ops, uint8_t *buf, uint32_t size) {
+    memset(p, 0, sizeof(*p));
+    p->ops = ops;
+    p->tx_buf = buf;
+    p->tx_size = size;
+}
+
+void telnet_proto_open(telnet_proto_t *p) {
+    p->rx_state = E_TELNET_PROTO_RX_DATA;
+    p->binary_mode = false;
+    p->ctrl_len = 0;
+    p->tx_stalled = false;
+    p->tx_aging = false;
+    telnet_proto_store(&p->tx_tail, telnet_proto_load(&p->tx_head));
+    p->tx_open = true;
+}
+
+void telnet_proto_close(telnet_proto_t *p) {
+    p->tx_open = false;
+    p->ctrl_len = 0;
+    telnet_proto_store(&p->tx_tail, telnet_proto_load(&p->tx_head));
+}
+
+int telnet_proto_parse(telnet_proto_t *p, uint8_t *buf, int len, bool logged_in) {
+    int interrupt_char = p->ops->interrupt_char();
+    uint8_t *w = buf;
+
+    // w never gets ahead of the byte being read, so this can be done in place
+    for (int i = 0; i < len; i++) {
+        uint8_t ch = buf[i];
+        switch (p->rx_state) {
+        case E_TELNET_PROTO_RX_DATA:
+            if (ch == TELNET_PROTO_IAC) {
+                p->rx_state = E_TELNET_PROTO_RX_IAC;
+            } else if (p->binary_mode) {
+                *w++ = ch;
+            } else if (ch > 127 || ch == 0) {
+                // skip it
+            } else if (logged_in && ch == interrupt_char) {
+                p->ops->interrupt();
+            } else if (logged_in && ch == TELNET_PROTO_CTRL_F) {
+                *w++ = TELNET_PROTO_CTRL_D;
+                p->ops->safe_boot();
+            } else {
+                *w++ = ch;
+            }
+            break;
+        case E_TELNET_PROTO_RX_IAC:
+            p->rx_state = E_TELNET_PROTO_RX_DATA;
+            if (ch == TELNET_PROTO_IAC) {
+                // double IAC char (0xFF) means escaped 0xFF
+                *w++ = 0xFF;
+            } else if (ch == TELNET_PROTO_AYT) {
+                // reply to the AYT with an echo of the IAC AYT
+                const uint8_t reply[] = { TELNET_PROTO_IAC, TELNET_PROTO_AYT };
+                telnet_proto_reply(p, reply, sizeof(reply));
+            } else if (ch >= TELNET_PROTO_WILL) {
+                p->rx_verb = ch;
+                p->rx_state = E_TELNET_PROTO_RX_OPTION;
+            } else if (ch == TELNET_PROTO_SB) {
+                p->rx_state = E_TELNET_PROTO_RX_SB;
+            }
+            break;
+        case E_TELNET_PROTO_RX_OPTION:
+            p->rx_state = E_TELNET_PROTO_RX_DATA;
+            if (ch == TELNET_PROTO_TRANSMIT_BINARY) {
+                if (p->rx_verb == TELNET_PROTO_WILL) {
+                    p->binary_mode = true;
+                } else if (p->rx_verb == TELNET_PROTO_WONT) {
+                    p->binary_mode = false;
+                }
+                const uint8_t reply[] = { TELNET_PROTO_IAC, telnet_proto_reply_verb(p->rx_verb), ch };
+                telnet_proto_reply(p, reply, sizeof(reply));
+            }
+            break;
+        case E_TELNET_PROTO_RX_SB:
+            if (ch == TELNET_PROTO_IAC) {
+                p->rx_state = E_TELNET_PROTO_RX_SB_IAC;
+            }
+            break;
+        case E_TELNET_PROTO_RX_SB_IAC:
+            p->rx_state = (ch == TELNET_PROTO_SE) ? E_TELNET_PROTO_RX_DATA : E_TELNET_PROTO_RX_SB;
+            break;
+        default:
+            p->rx_state = E_TELNET_PROTO_RX_DATA;
+            break;
+        }
+    }
+    return w - buf;
+}
+
+uint32_t telnet_proto_write(telnet_proto_t *p, const void *data, uint32_t len) {
+    const uint8_t *src = data;
+    uint32_t done = 0;
+    uint32_t seen_tail = 0;
+    uint32_t since = 0;
+    bool waited = false;
+
+    p->stats.writes++;
+    while (done < len && p->tx_open) {
+        uint32_t head = p->tx_head;
+        uint32_t tail = telnet_proto_load(&p->tx_tail);
+
+        if (p->tx_stalled) {
+            if (tail == p->tx_stalled_tail) {
+                break;
+            }
+            // the client took something, back to normal
+            p->tx_stalled = false;
+        }
+
+        uint32_t room = p->tx_size - (head - tail);
+        if (room == 0) {
+            uint32_t now = p->ops->ticks_ms();
+            if (!waited || tail != seen_tail) {
+                waited = true;
+                seen_tail = tail;
+                since = now;
+            } else if (now - since >= TELNET_PROTO_TX_STALL_MS) {
+                p->tx_stalled = true;
+                p->tx_stalled_tail = tail;
+                break;
+            }
+            p->tx_waiting = true;
+            p->stats.waits++;
+            p->ops->wait();
+            continue;
+        }
+
+        uint32_t n = len - done < room ? len - done : room;
+        uint32_t off = head & (p->tx_size - 1);
+        uint32_t first = p->tx_size - off < n ? p->tx_size - off : n;
+        memcpy(p->tx_buf + off, src + done, first);
+        memcpy(p->tx_buf, src + done + first, n - first);
+        telnet_proto_store(&p->tx_head, head + n);
+        done += n;
+    }
+    p->tx_waiting = false;
+    p->stats.dropped += len - done;
+    return done;
+}
+
+int telnet_proto_flush(telnet_proto_t *p, int sd) {
+    int result;
+
+    // the replies go first, and nothing else until they're out
+    if (p->ctrl_len > 0) {
+        result = send(sd, p->ctrl, p->ctrl_len, 0);
+        if (result < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        p->ctrl_len -= result;
+        memmove(p->ctrl, p->ctrl + result, p->ctrl_len);
+        if (p->ctrl_len > 0) {
+            return 0;
+        }
+    }
+
+    uint32_t tail = p->tx_tail;
+    uint32_t pending = telnet_proto_load(&p->tx_head) - tail;
+    if (pending == 0) {
+        p->tx_aging = false;
+        return 0;
+    }
+
+    // hold small amounts back for a moment, more output may follow
+    uint32_t now = p->ops->ticks_ms();
+    if (!p->tx_aging) {
+        p->tx_aging = true;
+        p->tx_since = now;
+    }
+    if (pending < TELNET_PROTO_TX_BATCH && !p->tx_waiting && now - p->tx_since < TELNET_PROTO_TX_DELAY_MS) {
+        return 0;
+    }
+
+    while (pending > 0) {
+        uint32_t off = tail & (p->tx_size - 1);
+        uint32_t n = p->tx_size - off < pending ? p->tx_size - off : pending;
+        result = send(sd, p->tx_buf + off, n, 0);
+        if (result < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        tail += result;
+        pending -= result;
+        telnet_proto_store(&p->tx_tail, tail);
+        p->stats.sends++;
+        p->stats.bytes += result;
+        if ((uint32_t)result < n) {
+            break;
+        }
+    }
+    if (pending == 0) {
+        p->tx_aging = false;
+    }
+    return 0;
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static void telnet_proto_reply(telnet_proto_t *p, const uint8_t *data, uint32_t len) {
+    // a client flooding us with commands loses some of the replies
+    if (p->ctrl_len + len <= TELNET_PROTO_CTRL_MAX) {
+        memcpy(p->ctrl + p->ctrl_len, data, len);
+        p->ctrl_len += len;
+    }
+}
+
+static uint8_t telnet_proto_reply_verb(uint8_t verb) {
+    if (verb < TELNET_PROTO_DO) {
+        // translate a will into do and a won't into don't
+        return verb + (TELNET_PROTO_DO - TELNET_PROTO_WILL);
+    } else {
+        // if not, translate a do into will and don't into won't
+        return verb - (TELNET_PROTO_DO - TELNET_PROTO_WILL);
+    }
+}
+
+// The head and tail are shared between the two tasks: the data in the
+// buffer must be visible before the index that hands it over.
+static uint32_t telnet_proto_load(volatile uint32_t *v) {
+    return __atomic_load_n(v, __ATOMIC_ACQUIRE);
+}
+
+static void telnet_proto_store(volatile uint32_t *v, uint32_t value) {
+    __atomic_store_n(v, value, __ATOMIC_RELEASE);
+}
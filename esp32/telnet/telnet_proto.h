@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef TELNET_PROTO_H_
+#define TELNET_PROTO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The protocol side of a telnet connection, with no dependency on the IDF:
+// the parser of the received bytes (IAC commands and option negotiation)
+// and the queue of REPL output.  Output is written to a ring buffer by the
+// MicroPython task and sent by the servers task, coalesced: the pending
+// bytes go out as soon as a batch of them is ready, or once the oldest has
+// waited TELNET_PROTO_TX_DELAY_MS.  A writer that finds the buffer full
+// waits for it to drain; if the client takes nothing for
+// TELNET_PROTO_TX_STALL_MS the output is dropped until it does.
+
+#define TELNET_PROTO_IAC                (255)
+#define TELNET_PROTO_DONT               (254)
+#define TELNET_PROTO_DO                 (253)
+#define TELNET_PROTO_WONT               (252)
+#define TELNET_PROTO_WILL               (251)
+#define TELNET_PROTO_SB                 (250)
+#define TELNET_PROTO_AYT                (246)
+#define TELNET_PROTO_SE                 (240)
+#define TELNET_PROTO_TRANSMIT_BINARY    (0)
+
+// Pending output sent without waiting for more; about a TCP segment.
+#ifndef TELNET_PROTO_TX_BATCH
+#define TELNET_PROTO_TX_BATCH           (1024)
+#endif
+
+#ifndef TELNET_PROTO_TX_DELAY_MS
+#define TELNET_PROTO_TX_DELAY_MS        (2)
+#endif
+
+#ifndef TELNET_PROTO_TX_STALL_MS
+#define TELNET_PROTO_TX_STALL_MS        (1500)
+#endif
+
+// Room for the replies to the client's commands, which are sent ahead of
+// the output.
+#define TELNET_PROTO_CTRL_MAX           (24)
+
+typedef struct _telnet_proto_ops_t {
+    // Ctrl-C (or whatever mp_interrupt_char is) and Ctrl-F, received while
+    // logged in and not in binary mode
+    void (*interrupt)(void);
+    void (*safe_boot)(void);
+    int (*interrupt_char)(void);        // -1 if none
+    uint32_t (*ticks_ms)(void);
+    // the writer waits a moment for the output to drain
+    void (*wait)(void);
+} telnet_proto_ops_t;
+
+typedef struct _telnet_proto_stats_t {
+    uint32_t writes;                    // calls to telnet_proto_write
+    uint32_t sends;                     // calls to send() that sent output
+    uint32_t bytes;                     // output sent
+    uint32_t waits;                     // times a writer waited for room
+    uint32_t dropped;                   // output dropped while the client was stalled
+} telnet_proto_stats_t;
+
+typedef struct _telnet_proto_t {
+    const telnet_proto_ops_t *ops;
+    uint8_t *tx_buf;
+    uint32_t tx_size;                   // a power of 2
+    // free running; the head is moved by the writer, the tail by the sender
+    volatile uint32_t tx_head;
+    volatile uint32_t tx_tail;
+    volatile bool tx_open;              // output is queued, a client is connected
+    volatile bool tx_waiting;           // a writer waits for room
+    bool tx_stalled;                    // output dropped, until the tail moves
+    uint32_t tx_stalled_tail;
+    bool tx_aging;                      // the sender has seen output pending
+    uint32_t tx_since;                  // since when
+    uint8_t rx_state;
+    uint8_t rx_verb;
+    bool binary_mode;
+    uint8_t ctrl_len;
+    uint8_t ctrl[TELNET_PROTO_CTRL_MAX];
+    telnet_proto_stats_t stats;
+} telnet_proto_t;
+
+// buf of size bytes (a power of 2) holds the output queue
+void telnet_proto_init(telnet_proto_t *p, const telnet_proto_ops_t *ops, uint8_t *buf, uint32_t size);
+
+// A client connected: resets the parser and starts queuing output.
+void telnet_proto_open(telnet_proto_t *p);
+
+// The client is gone: drops the queued output, writes are ignored.
+void telnet_proto_close(telnet_proto_t *p);
+
+// Parses len bytes received into buf, in place, and returns how many are
+// left as input.  A command split between two calls is carried over; the
+// replies are queued for telnet_proto_flush.
+int telnet_proto_parse(telnet_proto_t *p, uint8_t *buf, int len, bool logged_in);
+
+// Queues output, waiting for room if the buffer is full.  Returns the number
+// of bytes queued, less than len if the client stalled or went away.
+uint32_t telnet_proto_write(telnet_proto_t *p, const void *data, uint32_t len);
+
+// Sends the pending replies and, when due, the pending output on the
+// non-blocking socket sd.  Returns -1 if the socket failed, 0 otherwise.
+int telnet_proto_flush(telnet_proto_t *p, int sd);
+
+#endif /* TELNET_PROTO_H_ */
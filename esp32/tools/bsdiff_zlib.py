@@ -0,0 +1,91 @@
+#!/usr/bin/env python
+#
+# Copyright (c) 2020, Pycom Limited.
+#
+# This software is licensed under the GNU GPL version 3 or any
+# later version, with permitted additional terms. For more information
+# see the Pycom Licence v1.0 document supplied with this file, or
+# available at https://www.pycom.io/opensource/licensing
+#
+
+"""
+Convert a patch made by the bsdiff tool to one with zlib blocks.
+
+bsdiff compresses the three blocks of its patches with bzip2 -9, which takes
+about 2.3 MB of RAM to decompress as the updater does, so only boards with
+SPIRAM can apply them.  The converted patch ("BSDIFZ40") has the same header
+and blocks recompressed with zlib; each block then needs only its window,
+4 KB by default, and the updater applies it from the internal RAM:
+
+python bsdiff_zlib.py old-to-new.bsdiff old-to-new.patch
+
+"""
+
+import argparse
+import bz2
+import struct
+import sys
+import zlib
+
+HEADER_LEN = 32
+MAGIC_BZIP2 = b'BSDIFF40'
+MAGIC_ZLIB = b'BSDIFZ40'
+
+
+def offtin(buf):
+    # bsdiff's signed magnitude offsets
+    x = struct.unpack('<Q', buf)[0]
+    if x & (1 << 63):
+        return -(x & ~(1 << 63))
+    return x
+
+
+def offtout(x):
+    if x < 0:
+        return struct.pack('<Q', -x | (1 << 63))
+    return struct.pack('<Q', x)
+
+
+def deflate(data, wbits, level):
+    z = zlib.compressobj(level, zlib.DEFLATED, wbits)
+    return z.compress(data) + z.flush()
+
+
+def convert(patch, wbits=12, level=9):
+    if len(patch) < HEADER_LEN or patch[:8] != MAGIC_BZIP2:
+        raise ValueError('not a BSDIFF40 patch')
+    ctrl_len = offtin(patch[8:16])
+    diff_len = offtin(patch[16:24])
+    new_size = offtin(patch[24:32])
+    if ctrl_len < 0 or diff_len < 0 or new_size < 0 or HEADER_LEN + ctrl_len + diff_len > len(patch):
+        raise ValueError('corrupt BSDIFF40 header')
+
+    blocks = (patch[HEADER_LEN:HEADER_LEN + ctrl_len],
+              patch[HEADER_LEN + ctrl_len:HEADER_LEN + ctrl_len + diff_len],
+              patch[HEADER_LEN + ctrl_len + diff_len:])
+    ctrl, diff, extra = [deflate(bz2.decompress(b), wbits, level) for b in blocks]
+    return MAGIC_ZLIB + offtout(len(ctrl)) + offtout(len(diff)) + offtout(new_size) + ctrl + diff + extra
+
+
+def main():
+    cmd_parser = argparse.ArgumentParser(description='Convert a bsdiff patch to zlib blocks, for boards without SPIRAM.')
+    cmd_parser.add_argument('bsdiff_patch', help='the patch made by bsdiff')
+    cmd_parser.add_argument('patch', help='the converted patch to write')
+    cmd_parser.add_argument('--wbits', type=int, default=12, choices=range(9, 16),
+                            help='log2 of the zlib window, which the board allocates for each block (default: 12)')
+    cmd_parser.add_argument('--level', type=int, default=9, choices=range(1, 10), help='zlib level (default: 9)')
+    args = cmd_parser.parse_args()
+
+    with open(args.bsdiff_patch, 'rb') as f:
+        patch = f.read()
+    try:
+        patch = convert(patch, args.wbits, args.level)
+    except (ValueError, IOError, OSError) as e:
+        sys.stderr.write('%s: %s\n' % (args.bsdiff_patch, e))
+        sys.exit(1)
+    with open(args.patch, 'wb') as f:
+        f.write(patch)
+
+
+if __name__ == "__main__":
+    main()
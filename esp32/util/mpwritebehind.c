@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+// Flush task of the write-behind files (io.WriteBehind, see
+// extmod/vfs_writebehind.c).  The file systems take their own locks (the FAT
+// volume is re-entrant and LittleFS has a mutex) so the task writes to them
+// without the GIL.  That only holds for the files on a native block device:
+// the SD card and user block devices are driven from Python, and other
+// streams (sockets, UART) may raise or allocate, so they can't be wrapped.
+
+#include "py/mpconfig.h"
+#include "py/runtime.h"
+#include "py/mpthread.h"
+#include "extmod/vfs_writebehind.h"
+#include "extmod/vfs_fat.h"
+#include "vfs_littlefs.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#if MICROPY_VFS_WRITEBEHIND_TASK
+
+#define WRITEBEHIND_TASK_STACK_SIZE     (4096)
+// below the MicroPython task, so the flush task runs while Python waits
+#define WRITEBEHIND_TASK_PRIORITY       (MP_THREAD_PRIORITY - 1)
+// a waiting writer checks its queue again at least this often
+#define WRITEBEHIND_WAIT_MS             (10)
+
+static TaskHandle_t wb_task_handle;
+static SemaphoreHandle_t wb_work;       // given when there is data to write
+static SemaphoreHandle_t wb_done;       // given each time the task has written something
+
+static void TASK_WriteBehind(void *pvParameters) {
+    for (;;) {
+        xSemaphoreTake(wb_work, portMAX_DELAY);
+        while (mp_vfs_wb_task_run()) {
+            xSemaphoreGive(wb_done);
+        }
+        // also wakes writers waiting on a queue that failed
+        xSemaphoreGive(wb_done);
+    }
+}
+
+void mp_vfs_wb_task_notify(void) {
+    if (wb_task_handle == NULL) {
+        wb_work = xSemaphoreCreateBinary();
+        wb_done = xSemaphoreCreateBinary();
+        if (wb_work == NULL || wb_done == NULL) {
+            mp_raise_msg(&mp_type_MemoryError, "can't create write-behind task");
+        }
+        if (xTaskCreatePinnedToCore(TASK_WriteBehind, "WriteBehind", WRITEBEHIND_TASK_STACK_SIZE / sizeof(StackType_t),
+                NULL, WRITEBEHIND_TASK_PRIORITY, &wb_task_handle, 1) != pdPASS) {
+            mp_raise_msg(&mp_type_MemoryError, "can't create write-behind task");
+        }
+    }
+    xSemaphoreGive(wb_work);
+}
+
+bool mp_vfs_wb_task_can_write(mp_obj_t stream) {
+    const mp_obj_type_t *type = mp_obj_get_type(stream);
+    if (type == &mp_type_vfs_fat_fileio || type == &mp_type_vfs_fat_textio) {
+        return (fat_vfs_file_mount(stream)->flags & FSUSER_NATIVE) != 0;
+    }
+    // LittleFS is only used for /flash
+    return type == &mp_type_vfs_lfs_fileio || type == &mp_type_vfs_lfs_textio;
+}
+
+void mp_vfs_wb_task_wait(void) {
+    MP_THREAD_GIL_EXIT();
+    xSemaphoreTake(wb_done, WRITEBEHIND_WAIT_MS / portTICK_PERIOD_MS);
+    MP_THREAD_GIL_ENTER();
+}
+
+#endif // MICROPY_VFS_WRITEBEHIND_TASK
@@ -37,13 +37,46 @@
 #include <db.h>
 #include <../../btree/btree.h>
 
+// set by the mp_stream_posix_*() calls
+extern int mp_stream_errno;
+
+// A page written during a batch, not yet written to the stream.
+typedef struct _btree_page_t {
+    off_t offset;
+    size_t len;
+    byte *data;
+} btree_page_t;
+
+// The stream berkeley-db reads and writes its pages through; it writes one
+// page per call, so the calls are counted as page writes.  During a batch
+// the pages written are held here instead, sorted by offset, and reads are
+// served from them: a page evicted from berkeley-db's cache again and again
+// is only written once, when the batch is committed.
+typedef struct _btree_stream_t {
+    mp_obj_t stream;
+    size_t writes;
+    size_t written;
+    bool batch;
+    off_t pos;                      // while batching
+    size_t n_pages;
+    size_t alloc_pages;
+    btree_page_t *pages;
+} btree_stream_t;
+
+STATIC int btree_stream_commit(btree_stream_t *s);
+
 typedef struct _mp_obj_btree_t {
     mp_obj_base_t base;
     DB *db;
+    btree_stream_t *stream;
     mp_obj_t start_key;
     mp_obj_t end_key;
+    // data of end_key (or of the prefix), extracted once when iteration starts
+    const byte *end_data;
+    size_t end_len;
     #define FLAG_END_KEY_INCL 1
     #define FLAG_DESC 2
+    #define FLAG_PREFIX 4
     #define FLAG_ITER_TYPE_MASK 0xc0
     #define FLAG_ITER_KEYS   0x40
     #define FLAG_ITER_VALUES 0x80
@@ -63,10 +96,11 @@ void __dbpanic(DB *db) {
     printf("__dbpanic(%p)\n", db);
 }
 
-STATIC mp_obj_btree_t *btree_new(DB *db) {
+STATIC mp_obj_btree_t *btree_new(DB *db, btree_stream_t *stream) {
     mp_obj_btree_t *o = m_new_obj(mp_obj_btree_t);
     o->base.type = &btree_type;
     o->db = db;
+    o->stream = stream;
     o->start_key = mp_const_none;
     o->end_key = mp_const_none;
     o->next_flags = 0;
@@ -79,18 +113,40 @@ STATIC void btree_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind
     mp_printf(print, "<btree %p>", self->db);
 }
 
+// Writes the dirty pages in the cache and, if a batch is open, the pages
+// it held back, each once and in order, then syncs the stream.  flush()
+// and commit() are the same, commit() says what it ends.
 STATIC mp_obj_t btree_flush(mp_obj_t self_in) {
     mp_obj_btree_t *self = MP_OBJ_TO_PTR(self_in);
-    return MP_OBJ_NEW_SMALL_INT(__bt_sync(self->db, 0));
+    int res = __bt_sync(self->db, 0);
+    if (res == RET_SUCCESS && self->stream->batch) {
+        res = btree_stream_commit(self->stream);
+    }
+    return MP_OBJ_NEW_SMALL_INT(res);
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(btree_flush_obj, btree_flush);
 
 STATIC mp_obj_t btree_close(mp_obj_t self_in) {
     mp_obj_btree_t *self = MP_OBJ_TO_PTR(self_in);
-    return MP_OBJ_NEW_SMALL_INT(__bt_close(self->db));
+    int res = __bt_close(self->db);
+    if (res == RET_SUCCESS && self->stream->batch) {
+        res = btree_stream_commit(self->stream);
+    }
+    return MP_OBJ_NEW_SMALL_INT(res);
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(btree_close_obj, btree_close);
 
+// The pages written to the stream since open(), and their bytes.
+STATIC mp_obj_t btree_stats(mp_obj_t self_in) {
+    mp_obj_btree_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_obj_t t[2] = {
+        mp_obj_new_int_from_uint(self->stream->writes),
+        mp_obj_new_int_from_uint(self->stream->written),
+    };
+    return mp_obj_new_tuple(2, t);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(btree_stats_obj, btree_stats);
+
 STATIC mp_obj_t btree_put(size_t n_args, const mp_obj_t *args) {
     (void)n_args;
     mp_obj_btree_t *self = MP_OBJ_TO_PTR(args[0]);
@@ -118,6 +174,67 @@ STATIC mp_obj_t btree_get(size_t n_args, const mp_obj_t *args) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btree_get_obj, 2, 3, btree_get);
 
+// Insert all (key, value) pairs from an iterable, one put each, in a batch:
+// the pages they write are held back until commit(), flush() or close(),
+// and then written once each, however often berkeley-db's cache evicted
+// them meanwhile.  Puts made while the batch is open are in it too.
+// The pages held take RAM, as many as the batch changes.
+// If sorted is set the keys must be strictly ascending.  That is all load()
+// adds; berkeley-db splits the rightmost leaf by starting a new page
+// whenever a key is appended to it, so sorted puts fill their pages
+// whichever way they're made.
+STATIC mp_obj_t btree_put_many(mp_obj_btree_t *self, mp_obj_t items_in, bool sorted) {
+    BTREE *t = self->db->internal;
+    btree_stream_t *s = self->stream;
+    if (!s->batch) {
+        s->pos = mp_stream_posix_lseek(MP_OBJ_TO_PTR(s->stream), 0, SEEK_CUR);
+        if (s->pos < 0) {
+            mp_raise_OSError(mp_stream_errno);
+        }
+        s->batch = true;
+    }
+    mp_obj_iter_buf_t iter_buf;
+    mp_obj_t iter = mp_getiter(items_in, &iter_buf);
+    mp_obj_t item;
+    // holding the previous key object keeps its data alive for the comparison
+    mp_obj_t prev_key_obj = MP_OBJ_NULL;
+    mp_int_t count = 0;
+    while ((item = mp_iternext(iter)) != MP_OBJ_STOP_ITERATION) {
+        mp_obj_t *kv;
+        mp_obj_get_array_fixed_n(item, 2, &kv);
+        DBT key, val;
+        key.data = (void*)mp_obj_str_get_data(kv[0], &key.size);
+        val.data = (void*)mp_obj_str_get_data(kv[1], &val.size);
+        if (sorted && prev_key_obj != MP_OBJ_NULL) {
+            DBT prev_key;
+            prev_key.data = (void*)mp_obj_str_get_data(prev_key_obj, &prev_key.size);
+            if (t->bt_cmp(&key, &prev_key) <= 0) {
+                mp_raise_ValueError("keys not sorted");
+            }
+        }
+        int res = __bt_put(self->db, &key, &val, 0);
+        CHECK_ERROR(res);
+        prev_key_obj = kv[0];
+        ++count;
+    }
+    return MP_OBJ_NEW_SMALL_INT(count);
+}
+
+STATIC mp_obj_t btree_update(mp_obj_t self_in, mp_obj_t items_in) {
+    mp_obj_btree_t *self = MP_OBJ_TO_PTR(self_in);
+    if (mp_obj_is_type(items_in, &mp_type_dict)) {
+        items_in = mp_call_function_0(mp_load_attr(items_in, MP_QSTR_items));
+    }
+    return btree_put_many(self, items_in, false);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(btree_update_obj, btree_update);
+
+STATIC mp_obj_t btree_load(mp_obj_t self_in, mp_obj_t items_in) {
+    mp_obj_btree_t *self = MP_OBJ_TO_PTR(self_in);
+    return btree_put_many(self, items_in, true);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(btree_load_obj, btree_load);
+
 STATIC mp_obj_t btree_seq(size_t n_args, const mp_obj_t *args) {
     mp_obj_btree_t *self = MP_OBJ_TO_PTR(args[0]);
     int flags = MP_OBJ_SMALL_INT_VALUE(args[1]);
@@ -154,6 +271,16 @@ STATIC mp_obj_t btree_init_iter(size_t n_args, const mp_obj_t *args, byte type)
             }
         }
     }
+    if (self->next_flags & FLAG_PREFIX) {
+        // iterate over the keys starting with start_key
+        if (self->start_key == mp_const_none || (self->next_flags & FLAG_DESC)) {
+            mp_raise_ValueError(NULL);
+        }
+        self->end_key = self->start_key;
+    }
+    if (self->end_key != mp_const_none) {
+        self->end_data = (const byte*)mp_obj_str_get_data(self->end_key, &self->end_len);
+    }
     return args[0];
 }
 
@@ -214,9 +341,15 @@ STATIC mp_obj_t btree_iternext(mp_obj_t self_in) {
     }
     CHECK_ERROR(res);
 
-    if (self->end_key != mp_const_none) {
+    if (self->flags & FLAG_PREFIX) {
+        if (key.size < self->end_len || memcmp(key.data, self->end_data, self->end_len) != 0) {
+            self->end_key = MP_OBJ_NULL;
+            return MP_OBJ_STOP_ITERATION;
+        }
+    } else if (self->end_key != mp_const_none) {
         DBT end_key;
-        end_key.data = (void*)mp_obj_str_get_data(self->end_key, &end_key.size);
+        end_key.data = (void*)self->end_data;
+        end_key.size = self->end_len;
         BTREE *t = self->db->internal;
         int cmp = t->bt_cmp(&key, &end_key);
         if (desc) {
@@ -298,12 +431,16 @@ STATIC mp_obj_t btree_binary_op(mp_binary_op_t op, mp_obj_t lhs_in, mp_obj_t rhs
 STATIC const mp_rom_map_elem_t btree_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&btree_close_obj) },
     { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&btree_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_commit), MP_ROM_PTR(&btree_flush_obj) },
     { MP_ROM_QSTR(MP_QSTR_get), MP_ROM_PTR(&btree_get_obj) },
     { MP_ROM_QSTR(MP_QSTR_put), MP_ROM_PTR(&btree_put_obj) },
     { MP_ROM_QSTR(MP_QSTR_seq), MP_ROM_PTR(&btree_seq_obj) },
     { MP_ROM_QSTR(MP_QSTR_keys), MP_ROM_PTR(&btree_keys_obj) },
     { MP_ROM_QSTR(MP_QSTR_values), MP_ROM_PTR(&btree_values_obj) },
     { MP_ROM_QSTR(MP_QSTR_items), MP_ROM_PTR(&btree_items_obj) },
+    { MP_ROM_QSTR(MP_QSTR_update), MP_ROM_PTR(&btree_update_obj) },
+    { MP_ROM_QSTR(MP_QSTR_load), MP_ROM_PTR(&btree_load_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&btree_stats_obj) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(btree_locals_dict, btree_locals_dict_table);
@@ -320,18 +457,190 @@ STATIC const mp_obj_type_t btree_type = {
     .locals_dict = (void*)&btree_locals_dict,
 };
 
+STATIC ssize_t btree_stream_write_through(btree_stream_t *s, const void *buf, size_t len) {
+    ssize_t res = mp_stream_posix_write(MP_OBJ_TO_PTR(s->stream), buf, len);
+    if (res > 0) {
+        s->writes++;
+        s->written += res;
+    }
+    return res;
+}
+
+// Index of the first page held at or after offset.
+STATIC size_t btree_stream_find(btree_stream_t *s, off_t offset) {
+    size_t lo = 0, hi = s->n_pages;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (s->pages[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Whether [offset, offset + len) overlaps a page held other than at i.
+STATIC bool btree_stream_overlaps(btree_stream_t *s, size_t i, off_t offset, size_t len) {
+    return (i > 0 && s->pages[i - 1].offset + (off_t)s->pages[i - 1].len > offset)
+        || (i < s->n_pages && s->pages[i].offset < offset + (off_t)len
+            && (s->pages[i].offset != offset || s->pages[i].len != len));
+}
+
+// Writes the pages held, in order, and ends the batch.  If a write fails
+// the pages not written are kept and the batch stays open.
+STATIC int btree_stream_commit(btree_stream_t *s) {
+    void *stream = MP_OBJ_TO_PTR(s->stream);
+    size_t i;
+    int res = 0;
+    for (i = 0; i < s->n_pages; i++) {
+        btree_page_t *p = &s->pages[i];
+        if (mp_stream_posix_lseek(stream, p->offset, SEEK_SET) < 0
+            || btree_stream_write_through(s, p->data, p->len) != (ssize_t)p->len) {
+            res = -1;
+            break;
+        }
+        m_del(byte, p->data, p->len);
+    }
+    s->n_pages -= i;
+    memmove(s->pages, s->pages + i, s->n_pages * sizeof(btree_page_t));
+    if (res == 0) {
+        m_del(btree_page_t, s->pages, s->alloc_pages);
+        s->pages = NULL;
+        s->alloc_pages = 0;
+        s->batch = false;
+        if (mp_stream_posix_lseek(stream, s->pos, SEEK_SET) < 0 || mp_stream_posix_fsync(stream) < 0) {
+            res = -1;
+        }
+    }
+    if (res < 0) {
+        errno = mp_stream_errno;
+    }
+    return res;
+}
+
+STATIC ssize_t btree_stream_read(void *stream, void *buf, size_t len) {
+    btree_stream_t *s = stream;
+    if (s->batch) {
+        size_t i = btree_stream_find(s, s->pos);
+        if (i < s->n_pages && s->pages[i].offset == s->pos && s->pages[i].len >= len) {
+            memcpy(buf, s->pages[i].data, len);
+            s->pos += len;
+            return len;
+        }
+        if (btree_stream_overlaps(s, i, s->pos, len) && btree_stream_commit(s) < 0) {
+            return -1;
+        }
+        if (mp_stream_posix_lseek(MP_OBJ_TO_PTR(s->stream), s->pos, SEEK_SET) < 0) {
+            return -1;
+        }
+    }
+    ssize_t res = mp_stream_posix_read(MP_OBJ_TO_PTR(s->stream), buf, len);
+    if (s->batch && res > 0) {
+        s->pos += res;
+    }
+    return res;
+}
+
+STATIC ssize_t btree_stream_write(void *stream, const void *buf, size_t len) {
+    btree_stream_t *s = stream;
+    if (s->batch) {
+        size_t i = btree_stream_find(s, s->pos);
+        if (i < s->n_pages && s->pages[i].offset == s->pos && s->pages[i].len == len) {
+            // written again since the last commit
+            memcpy(s->pages[i].data, buf, len);
+            s->pos += len;
+            return len;
+        }
+        if (!btree_stream_overlaps(s, i, s->pos, len)) {
+            byte *data = m_new_maybe(byte, len);
+            if (data != NULL && s->n_pages == s->alloc_pages) {
+                size_t alloc = s->alloc_pages * 2 + 8;
+                btree_page_t *pages = m_renew_maybe(btree_page_t, s->pages, s->alloc_pages, alloc, true);
+                if (pages == NULL) {
+                    m_del(byte, data, len);
+                    data = NULL;
+                } else {
+                    s->pages = pages;
+                    s->alloc_pages = alloc;
+                }
+            }
+            if (data != NULL) {
+                btree_page_t *p = &s->pages[i];
+                memmove(p + 1, p, (s->n_pages - i) * sizeof(btree_page_t));
+                p->offset = s->pos;
+                p->len = len;
+                p->data = data;
+                memcpy(data, buf, len);
+                s->n_pages++;
+                s->pos += len;
+                return len;
+            }
+        }
+        // out of RAM for the batch, or not a whole page: write out what is
+        // held, this too, and go on batching
+        off_t pos = s->pos;
+        if (btree_stream_commit(s) < 0) {
+            return -1;
+        }
+        s->batch = true;
+        if (mp_stream_posix_lseek(MP_OBJ_TO_PTR(s->stream), pos, SEEK_SET) < 0) {
+            return -1;
+        }
+        ssize_t res = btree_stream_write_through(s, buf, len);
+        s->pos = pos + (res > 0 ? res : 0);
+        return res;
+    }
+    return btree_stream_write_through(s, buf, len);
+}
+
+STATIC off_t btree_stream_lseek(void *stream, off_t offset, int whence) {
+    btree_stream_t *s = stream;
+    if (s->batch) {
+        // the pages held may go past the end of the stream
+        if (whence == SEEK_END) {
+            off_t end = mp_stream_posix_lseek(MP_OBJ_TO_PTR(s->stream), 0, SEEK_END);
+            if (end < 0) {
+                return -1;
+            }
+            if (s->n_pages > 0) {
+                btree_page_t *p = &s->pages[s->n_pages - 1];
+                if (p->offset + (off_t)p->len > end) {
+                    end = p->offset + p->len;
+                }
+            }
+            offset += end;
+        } else if (whence == SEEK_CUR) {
+            offset += s->pos;
+        }
+        s->pos = offset;
+        return offset;
+    }
+    return mp_stream_posix_lseek(MP_OBJ_TO_PTR(s->stream), offset, whence);
+}
+
+// berkeley-db syncs when its cache is flushed; a batch is synced when it
+// is committed
+STATIC int btree_stream_fsync(void *stream) {
+    btree_stream_t *s = stream;
+    if (s->batch) {
+        return 0;
+    }
+    return mp_stream_posix_fsync(MP_OBJ_TO_PTR(s->stream));
+}
+
 STATIC FILEVTABLE btree_stream_fvtable = {
-    mp_stream_posix_read,
-    mp_stream_posix_write,
-    mp_stream_posix_lseek,
-    mp_stream_posix_fsync
+    btree_stream_read,
+    btree_stream_write,
+    btree_stream_lseek,
+    btree_stream_fsync
 };
 
 STATIC mp_obj_t mod_btree_open(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
     static const mp_arg_t allowed_args[] = {
         { MP_QSTR_flags, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
-        { MP_QSTR_cachesize, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
-        { MP_QSTR_pagesize, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+        { MP_QSTR_cachesize, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = MICROPY_PY_BTREE_DEFAULT_CACHESIZE} },
+        { MP_QSTR_pagesize, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = MICROPY_PY_BTREE_DEFAULT_PAGESIZE} },
         { MP_QSTR_minkeypage, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
     };
 
@@ -352,11 +661,19 @@ STATIC mp_obj_t mod_btree_open(size_t n_args, const mp_obj_t *pos_args, mp_map_t
     openinfo.psize = args.pagesize.u_int;
     openinfo.minkeypage = args.minkeypage.u_int;
 
-    DB *db = __bt_open(MP_OBJ_TO_PTR(pos_args[0]), &btree_stream_fvtable, &openinfo, /*dflags*/0);
+    btree_stream_t *stream = m_new_obj(btree_stream_t);
+    stream->stream = pos_args[0];
+    stream->writes = 0;
+    stream->written = 0;
+    stream->batch = false;
+    stream->n_pages = 0;
+    stream->alloc_pages = 0;
+    stream->pages = NULL;
+    DB *db = __bt_open(stream, &btree_stream_fvtable, &openinfo, /*dflags*/0);
     if (db == NULL) {
         mp_raise_OSError(errno);
     }
-    return MP_OBJ_FROM_PTR(btree_new(db));
+    return MP_OBJ_FROM_PTR(btree_new(db, stream));
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_KW(mod_btree_open_obj, 1, mod_btree_open);
 
@@ -365,6 +682,7 @@ STATIC const mp_rom_map_elem_t mp_module_btree_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_open), MP_ROM_PTR(&mod_btree_open_obj) },
     { MP_ROM_QSTR(MP_QSTR_INCL), MP_ROM_INT(FLAG_END_KEY_INCL) },
     { MP_ROM_QSTR(MP_QSTR_DESC), MP_ROM_INT(FLAG_DESC) },
+    { MP_ROM_QSTR(MP_QSTR_PREFIX), MP_ROM_INT(FLAG_PREFIX) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(mp_module_btree_globals, mp_module_btree_globals_table);
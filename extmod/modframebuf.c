@@ -39,6 +39,9 @@ typedef struct _mp_obj_framebuf_t {
     void *buf;
     uint16_t width, height, stride;
     uint8_t format;
+    // bounding box of pixels changed through the drawing methods, empty if
+    // dirty_x0 >= dirty_x1 (the end coordinates are exclusive)
+    uint16_t dirty_x0, dirty_y0, dirty_x1, dirty_y1;
 } mp_obj_framebuf_t;
 
 typedef void (*setpixel_t)(const mp_obj_framebuf_t*, int, int, uint32_t);
@@ -75,16 +78,31 @@ STATIC uint32_t mono_horiz_getpixel(const mp_obj_framebuf_t *fb, int x, int y) {
 }
 
 STATIC void mono_horiz_fill_rect(const mp_obj_framebuf_t *fb, int x, int y, int w, int h, uint32_t col) {
-    int reverse = fb->format == FRAMEBUF_MHMSB;
     int advance = fb->stride >> 3;
-    while (w--) {
-        uint8_t *b = &((uint8_t*)fb->buf)[(x >> 3) + y * advance];
-        int offset = reverse ?  x & 7 : 7 - (x & 7);
-        for (int hh = h; hh; --hh) {
-            *b = (*b & ~(0x01 << offset)) | ((col != 0) << offset);
-            b += advance;
+    uint8_t fill = col ? 0xff : 0x00;
+    int bx0 = x >> 3;
+    int bx1 = (x + w - 1) >> 3;
+    // masks of the pixels covered in the first and last byte of each row
+    uint8_t m0, m1;
+    if (fb->format == FRAMEBUF_MHMSB) {
+        m0 = 0xff << (x & 7);
+        m1 = 0xff >> (7 - ((x + w - 1) & 7));
+    } else {
+        m0 = 0xff >> (x & 7);
+        m1 = 0xff << (7 - ((x + w - 1) & 7));
+    }
+    if (bx0 == bx1) {
+        m0 &= m1;
+    }
+    uint8_t *b = &((uint8_t*)fb->buf)[bx0 + y * advance];
+    while (h--) {
+        b[0] = (b[0] & ~m0) | (fill & m0);
+        if (bx1 > bx0) {
+            // whole bytes in the middle of the row
+            memset(b + 1, fill, bx1 - bx0 - 1);
+            b[bx1 - bx0] = (b[bx1 - bx0] & ~m1) | (fill & m1);
         }
-        ++x;
+        b += advance;
     }
 }
 
@@ -101,14 +119,22 @@ STATIC uint32_t mvlsb_getpixel(const mp_obj_framebuf_t *fb, int x, int y) {
 }
 
 STATIC void mvlsb_fill_rect(const mp_obj_framebuf_t *fb, int x, int y, int w, int h, uint32_t col) {
-    while (h--) {
+    uint8_t fill = col ? 0xff : 0x00;
+    int yend = y + h;
+    // each byte holds a column of 8 pixels, so do up to 8 rows at a time
+    while (y < yend) {
+        int bits = MIN(8 - (y & 7), yend - y);
+        uint8_t mask = ((1 << bits) - 1) << (y & 7);
         uint8_t *b = &((uint8_t*)fb->buf)[(y >> 3) * fb->stride + x];
-        uint8_t offset = y & 0x07;
-        for (int ww = w; ww; --ww) {
-            *b = (*b & ~(0x01 << offset)) | ((col != 0) << offset);
-            ++b;
+        if (mask == 0xff) {
+            memset(b, fill, w);
+        } else {
+            for (int ww = w; ww; --ww) {
+                *b = (*b & ~mask) | (fill & mask);
+                ++b;
+            }
         }
-        ++y;
+        y += bits;
     }
 }
 
@@ -124,11 +150,25 @@ STATIC uint32_t rgb565_getpixel(const mp_obj_framebuf_t *fb, int x, int y) {
 
 STATIC void rgb565_fill_rect(const mp_obj_framebuf_t *fb, int x, int y, int w, int h, uint32_t col) {
     uint16_t *b = &((uint16_t*)fb->buf)[x + y * fb->stride];
-    while (h--) {
-        for (int ww = w; ww; --ww) {
-            *b++ = col;
+    if ((col & 0xff) == ((col >> 8) & 0xff)) {
+        // both bytes of the colour are the same (eg black, white)
+        while (h--) {
+            memset(b, col & 0xff, w * 2);
+            b += fb->stride;
         }
-        b += fb->stride - w;
+        return;
+    }
+    // Fill the first row by repeatedly doubling the filled part, so that
+    // memcpy can do the bulk of the work a word at a time, then copy that
+    // row to the remaining ones.
+    b[0] = col;
+    for (int n = 1; n < w;) {
+        int c = MIN(n, w - n);
+        memcpy(b + n, b, c * 2);
+        n += c;
+    }
+    for (uint16_t *row = b + fb->stride; --h; row += fb->stride) {
+        memcpy(row, b, w * 2);
     }
 }
 
@@ -244,7 +284,29 @@ static inline uint32_t getpixel(const mp_obj_framebuf_t *fb, int x, int y) {
     return formats[fb->format].getpixel(fb, x, y);
 }
 
-STATIC void fill_rect(const mp_obj_framebuf_t *fb, int x, int y, int w, int h, uint32_t col) {
+// Extend the dirty region to include the given rectangle (clipped to the framebuffer)
+STATIC void mark_dirty(mp_obj_framebuf_t *fb, int x, int y, int w, int h) {
+    int xend = MIN(fb->width, x + w);
+    int yend = MIN(fb->height, y + h);
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    if (x >= xend || y >= yend) {
+        return;
+    }
+    if (fb->dirty_x0 >= fb->dirty_x1) {
+        fb->dirty_x0 = x;
+        fb->dirty_y0 = y;
+        fb->dirty_x1 = xend;
+        fb->dirty_y1 = yend;
+    } else {
+        fb->dirty_x0 = MIN(fb->dirty_x0, x);
+        fb->dirty_y0 = MIN(fb->dirty_y0, y);
+        fb->dirty_x1 = MAX(fb->dirty_x1, xend);
+        fb->dirty_y1 = MAX(fb->dirty_y1, yend);
+    }
+}
+
+STATIC void fill_rect(mp_obj_framebuf_t *fb, int x, int y, int w, int h, uint32_t col) {
     if (h < 1 || w < 1 || x + w <= 0 || y + h <= 0 || y >= fb->height || x >= fb->width) {
         // No operation needed.
         return;
@@ -257,6 +319,37 @@ STATIC void fill_rect(const mp_obj_framebuf_t *fb, int x, int y, int w, int h, u
     y = MAX(y, 0);
 
     formats[fb->format].fill_rect(fb, x, y, xend - x, yend - y, col);
+    mark_dirty(fb, x, y, xend - x, yend - y);
+}
+
+// Number of bits per pixel for formats that store pixels along rows, 0 for MVLSB
+STATIC int horiz_bits_per_pixel(const mp_obj_framebuf_t *fb) {
+    switch (fb->format) {
+        case FRAMEBUF_RGB565: return 16;
+        case FRAMEBUF_GS8: return 8;
+        case FRAMEBUF_GS4_HMSB: return 4;
+        case FRAMEBUF_GS2_HMSB: return 2;
+        case FRAMEBUF_MHLSB: case FRAMEBUF_MHMSB: return 1;
+        default: return 0;
+    }
+}
+
+// Move a 2D array of bytes (rows of units bytes, row_stride apart) by (dx, dy),
+// leaving the vacated area untouched.  Rows are moved with memmove in an order
+// that doesn't overwrite rows still to be moved.
+STATIC void scroll_bytes(uint8_t *buf, int row_stride, int units, int rows, int dx, int dy) {
+    size_t n = units - (dx < 0 ? -dx : dx);
+    uint8_t *dst = buf + MAX(dx, 0);
+    const uint8_t *src = buf + MAX(-dx, 0);
+    if (dy > 0) {
+        for (int r = rows - 1; r >= dy; --r) {
+            memmove(dst + r * row_stride, src + (r - dy) * row_stride, n);
+        }
+    } else {
+        for (int r = 0; r < rows + dy; ++r) {
+            memmove(dst + r * row_stride, src + (r - dy) * row_stride, n);
+        }
+    }
 }
 
 STATIC mp_obj_t framebuf_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
@@ -273,6 +366,9 @@ STATIC mp_obj_t framebuf_make_new(const mp_obj_type_t *type, size_t n_args, size
     o->width = mp_obj_get_int(args[1]);
     o->height = mp_obj_get_int(args[2]);
     o->format = mp_obj_get_int(args[3]);
+    o->dirty_x0 = o->dirty_y0 = 0;
+    o->dirty_x1 = o->width;
+    o->dirty_y1 = o->height;
     if (n_args >= 5) {
         o->stride = mp_obj_get_int(args[4]);
     } else {
@@ -314,7 +410,7 @@ STATIC mp_int_t framebuf_get_buffer(mp_obj_t self_in, mp_buffer_info_t *bufinfo,
 STATIC mp_obj_t framebuf_fill(mp_obj_t self_in, mp_obj_t col_in) {
     mp_obj_framebuf_t *self = MP_OBJ_TO_PTR(self_in);
     mp_int_t col = mp_obj_get_int(col_in);
-    formats[self->format].fill_rect(self, 0, 0, self->width, self->height, col);
+    fill_rect(self, 0, 0, self->width, self->height, col);
     return mp_const_none;
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_2(framebuf_fill_obj, framebuf_fill);
@@ -346,6 +442,7 @@ STATIC mp_obj_t framebuf_pixel(size_t n_args, const mp_obj_t *args) {
         } else {
             // set
             setpixel(self, x, y, mp_obj_get_int(args[3]));
+            mark_dirty(self, x, y, 1, 1);
         }
     }
     return mp_const_none;
@@ -407,6 +504,7 @@ STATIC mp_obj_t framebuf_line(size_t n_args, const mp_obj_t *args) {
     mp_obj_framebuf_t *self = MP_OBJ_TO_PTR(args[0]);
     mp_int_t x1 = mp_obj_get_int(args[1]);
     mp_int_t y1 = mp_obj_get_int(args[2]);
+    const mp_int_t x1_in = x1, y1_in = y1;
     mp_int_t x2 = mp_obj_get_int(args[3]);
     mp_int_t y2 = mp_obj_get_int(args[4]);
     mp_int_t col = mp_obj_get_int(args[5]);
@@ -463,6 +561,8 @@ STATIC mp_obj_t framebuf_line(size_t n_args, const mp_obj_t *args) {
         setpixel(self, x2, y2, col);
     }
 
+    mark_dirty(self, MIN(x1_in, x2), MIN(y1_in, y2), (x1_in < x2 ? x2 - x1_in : x1_in - x2) + 1, (y1_in < y2 ? y2 - y1_in : y1_in - y2) + 1);
+
     return mp_const_none;
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(framebuf_line_obj, 6, 6, framebuf_line);
@@ -495,6 +595,55 @@ STATIC mp_obj_t framebuf_blit(size_t n_args, const mp_obj_t *args) {
     int x0end = MIN(self->width, x + source->width);
     int y0end = MIN(self->height, y + source->height);
 
+    mark_dirty(self, x0, y0, x0end - x0, y0end - y0);
+
+    if (self->format == source->format
+        && (self->format == FRAMEBUF_RGB565 || self->format == FRAMEBUF_GS8)) {
+        // Whole bytes per pixel, so copy row by row.
+        int bpp = self->format == FRAMEBUF_RGB565 ? 2 : 1;
+        size_t dst_stride = self->stride * bpp;
+        size_t src_stride = source->stride * bpp;
+        size_t n = (x0end - x0) * bpp;
+        uint8_t *dst = (uint8_t*)self->buf + y0 * dst_stride + x0 * bpp;
+        const uint8_t *src = (const uint8_t*)source->buf + y1 * src_stride + x1 * bpp;
+        int h = y0end - y0;
+        if (key == -1) {
+            // memmove so that blitting a framebuffer onto itself works; if the
+            // destination is after the source go bottom-up.
+            if (dst > src) {
+                dst += (h - 1) * dst_stride;
+                src += (h - 1) * src_stride;
+                for (; h; --h, dst -= dst_stride, src -= src_stride) {
+                    memmove(dst, src, n);
+                }
+            } else {
+                for (; h; --h, dst += dst_stride, src += src_stride) {
+                    memmove(dst, src, n);
+                }
+            }
+        } else if (bpp == 2) {
+            // transparent blit: skip pixels with the key colour
+            for (; h; --h, dst += dst_stride, src += src_stride) {
+                uint16_t *d = (uint16_t*)dst;
+                const uint16_t *s = (const uint16_t*)src;
+                for (int w = x0end - x0; w; --w, ++d, ++s) {
+                    if (*s != (uint32_t)key) {
+                        *d = *s;
+                    }
+                }
+            }
+        } else {
+            for (; h; --h, dst += dst_stride, src += src_stride) {
+                for (size_t i = 0; i < n; ++i) {
+                    if (src[i] != (uint32_t)key) {
+                        dst[i] = src[i];
+                    }
+                }
+            }
+        }
+        return mp_const_none;
+    }
+
     for (; y0 < y0end; ++y0) {
         int cx1 = x1;
         for (int cx0 = x0; cx0 < x0end; ++cx0) {
@@ -514,6 +663,24 @@ STATIC mp_obj_t framebuf_scroll(mp_obj_t self_in, mp_obj_t xstep_in, mp_obj_t ys
     mp_obj_framebuf_t *self = MP_OBJ_TO_PTR(self_in);
     mp_int_t xstep = mp_obj_get_int(xstep_in);
     mp_int_t ystep = mp_obj_get_int(ystep_in);
+    if (xstep <= -self->width || xstep >= self->width || ystep <= -self->height || ystep >= self->height) {
+        // everything scrolled out, nothing to move
+        return mp_const_none;
+    }
+    mark_dirty(self, xstep, ystep, self->width, self->height);
+
+    // Where the moved pixels occupy whole bytes the rows can be moved with memmove
+    int bits = horiz_bits_per_pixel(self);
+    if (bits != 0 && (xstep * bits) % 8 == 0 && (self->width * bits) % 8 == 0) {
+        scroll_bytes(self->buf, self->stride * bits / 8, self->width * bits / 8, self->height,
+            xstep * bits / 8, ystep);
+        return mp_const_none;
+    } else if (bits == 0 && ystep % 8 == 0 && self->height % 8 == 0) {
+        // MVLSB, move rows of 8-pixel-high bytes
+        scroll_bytes(self->buf, self->stride, self->width, self->height / 8, xstep, ystep / 8);
+        return mp_const_none;
+    }
+
     int sx, y, xend, yend, dx, dy;
     if (xstep < 0) {
         sx = 0;
@@ -553,6 +720,8 @@ STATIC mp_obj_t framebuf_text(size_t n_args, const mp_obj_t *args) {
         col = mp_obj_get_int(args[4]);
     }
 
+    mark_dirty(self, x0, y0, strlen(str) * 8, 8);
+
     // loop over chars
     for (; *str; ++str) {
         // get char and make sure its in range of font
@@ -580,6 +749,29 @@ STATIC mp_obj_t framebuf_text(size_t n_args, const mp_obj_t *args) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(framebuf_text_obj, 4, 5, framebuf_text);
 
+// Return the bounding box (x, y, w, h) of the pixels changed by drawing
+// methods since the last call, or None if there are none, so that a display
+// driver only needs to send that region.  The region is reset unless the
+// optional argument is False.  Writes made directly to the underlying buffer
+// are not tracked.
+STATIC mp_obj_t framebuf_dirty(size_t n_args, const mp_obj_t *args) {
+    mp_obj_framebuf_t *self = MP_OBJ_TO_PTR(args[0]);
+    if (self->dirty_x0 >= self->dirty_x1) {
+        return mp_const_none;
+    }
+    mp_obj_t tuple[4] = {
+        MP_OBJ_NEW_SMALL_INT(self->dirty_x0),
+        MP_OBJ_NEW_SMALL_INT(self->dirty_y0),
+        MP_OBJ_NEW_SMALL_INT(self->dirty_x1 - self->dirty_x0),
+        MP_OBJ_NEW_SMALL_INT(self->dirty_y1 - self->dirty_y0),
+    };
+    if (n_args == 1 || mp_obj_is_true(args[1])) {
+        self->dirty_x0 = self->dirty_x1 = 0;
+    }
+    return mp_obj_new_tuple(4, tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(framebuf_dirty_obj, 1, 2, framebuf_dirty);
+
 STATIC const mp_rom_map_elem_t framebuf_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_fill), MP_ROM_PTR(&framebuf_fill_obj) },
     { MP_ROM_QSTR(MP_QSTR_fill_rect), MP_ROM_PTR(&framebuf_fill_rect_obj) },
@@ -591,6 +783,7 @@ STATIC const mp_rom_map_elem_t framebuf_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_blit), MP_ROM_PTR(&framebuf_blit_obj) },
     { MP_ROM_QSTR(MP_QSTR_scroll), MP_ROM_PTR(&framebuf_scroll_obj) },
     { MP_ROM_QSTR(MP_QSTR_text), MP_ROM_PTR(&framebuf_text_obj) },
+    { MP_ROM_QSTR(MP_QSTR_dirty), MP_ROM_PTR(&framebuf_dirty_obj) },
 };
 STATIC MP_DEFINE_CONST_DICT(framebuf_locals_dict, framebuf_locals_dict_table);
 
@@ -614,6 +807,9 @@ STATIC mp_obj_t legacy_framebuffer1(size_t n_args, const mp_obj_t *args) {
     o->width = mp_obj_get_int(args[1]);
     o->height = mp_obj_get_int(args[2]);
     o->format = FRAMEBUF_MVLSB;
+    o->dirty_x0 = o->dirty_y0 = 0;
+    o->dirty_x1 = o->width;
+    o->dirty_y1 = o->height;
     if (n_args >= 4) {
         o->stride = mp_obj_get_int(args[3]);
     } else {
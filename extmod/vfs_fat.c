@@ -86,6 +86,14 @@ STATIC mp_obj_t fat_vfs_make_new(const mp_obj_type_t *type, size_t n_args, size_
         mp_load_method(args[0], MP_QSTR_count, vfs->u.old.count);
     }
 
+    #if FF_USE_DIRCACHE
+    // lookups in a large directory go through a hash of its names, if there's room for it
+    DWORD *dircache = m_new_maybe(DWORD, MICROPY_FATFS_DIRCACHE);
+    if (dircache != NULL) {
+        f_dircache(&vfs->fs.fatfs, dircache, MICROPY_FATFS_DIRCACHE);
+    }
+    #endif
+
     // mount the block device so the VFS methods can be used
     FRESULT res = f_mount(&vfs->fs.fatfs);
     if (res == FR_NO_FILESYSTEM) {
@@ -44,4 +44,6 @@ extern const mp_obj_type_t mp_type_vfs_fat_textio;
 
 MP_DECLARE_CONST_FUN_OBJ_3(fat_vfs_open_obj);
 
+fs_user_mount_t *fat_vfs_file_mount(mp_obj_t file);
+
 #endif // MICROPY_INCLUDED_EXTMOD_VFS_FAT_H
@@ -211,6 +211,12 @@ STATIC mp_obj_t file_open(fs_user_mount_t *vfs, const mp_obj_type_t *type, mp_ar
     return MP_OBJ_FROM_PTR(o);
 }
 
+// the mount holding an open file
+fs_user_mount_t *fat_vfs_file_mount(mp_obj_t self_in) {
+    pyb_file_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    return self->fp.obj.fs->drv;
+}
+
 STATIC mp_obj_t file_obj_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
     mp_arg_val_t arg_vals[FILE_OPEN_NUM_ARGS];
     mp_arg_parse_all_kw_array(n_args, n_kw, args, FILE_OPEN_NUM_ARGS, file_open_args, arg_vals);
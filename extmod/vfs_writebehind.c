@@ -0,0 +1,325 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Pycom Limited
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "py/runtime.h"
+#include "py/stream.h"
+#include "py/mperrno.h"
+#include "py/mpthread.h"
+#include "extmod/vfs_writebehind.h"
+
+#if MICROPY_VFS_WRITEBEHIND
+
+// The queue is a ring buffer.  The writer appends after the queued data and
+// the flush task (or the caller, without a task) writes out the oldest run
+// of it; both update the indices with the lock held, and the write to the
+// file is done without it, so the two never touch the same bytes.
+//
+// Queued data goes to the file strictly in order, and once a write fails the
+// rest of the queue is dropped and the error is returned by every later call.
+// So after a power loss the file holds everything written before the last
+// completed flush() plus, depending on the file system, a prefix of what was
+// written after it: never later data without the data before it.
+
+typedef struct _mp_obj_vfs_wb_t {
+    mp_obj_base_t base;
+    struct _mp_obj_vfs_wb_t *next;  // in the list of open write-behind files
+    mp_obj_t stream;
+    size_t alloc;
+    size_t head;                    // start of the queued data
+    size_t len;                     // bytes queued, including those being written out
+    bool busy;                      // the oldest run is being written out
+    bool closed;
+    int error;                      // errno of a failed write, 0 if none
+    byte buf[0];
+} mp_obj_vfs_wb_t;
+
+#if MICROPY_PY_THREAD
+STATIC mp_thread_mutex_t wb_mutex;
+STATIC bool wb_mutex_ready;
+#define WB_LOCK() mp_thread_mutex_lock(&wb_mutex, 1)
+#define WB_UNLOCK() mp_thread_mutex_unlock(&wb_mutex)
+#else
+#define WB_LOCK()
+#define WB_UNLOCK()
+#endif
+
+// Writes out the oldest contiguous run of queued data.  Called with the lock
+// held, which is released during the write.  Returns false if there was
+// nothing to do.
+STATIC bool wb_write_out(mp_obj_vfs_wb_t *self) {
+    if (self->busy || self->len == 0 || self->error != 0) {
+        return false;
+    }
+    size_t n = MIN(self->len, self->alloc - self->head);
+    const byte *data = &self->buf[self->head];
+    self->busy = true;
+    WB_UNLOCK();
+
+    // the stream's write function must report errors through errcode, as the
+    // VFS files do, since this may run in the flush task; the port only lets
+    // such streams be wrapped
+    int err = 0;
+    mp_uint_t out = mp_get_stream(self->stream)->write(self->stream, data, n, &err);
+    if (out == 0 && err == 0) {
+        err = MP_ENOSPC;
+    }
+
+    WB_LOCK();
+    self->busy = false;
+    if (out == MP_STREAM_ERROR || err != 0) {
+        self->error = err;
+        self->len = 0;
+    } else {
+        self->head = (self->head + out) % self->alloc;
+        self->len -= out;
+    }
+    if (self->len == 0) {
+        // start again at the beginning so the next write out is contiguous
+        self->head = 0;
+    }
+    return true;
+}
+
+// Waits for the queue to make progress; called with the lock held.
+STATIC void wb_wait(mp_obj_vfs_wb_t *self) {
+    #if MICROPY_VFS_WRITEBEHIND_TASK
+    (void)self;
+    WB_UNLOCK();
+    mp_vfs_wb_task_notify();
+    mp_vfs_wb_task_wait();
+    WB_LOCK();
+    #else
+    wb_write_out(self);
+    #endif
+}
+
+// Waits until all queued data has been written to the stream; returns the
+// errno of a failed write, or 0.
+STATIC int wb_drain(mp_obj_vfs_wb_t *self) {
+    WB_LOCK();
+    while (self->len > 0 && self->error == 0) {
+        wb_wait(self);
+    }
+    int err = self->error;
+    WB_UNLOCK();
+    return err;
+}
+
+STATIC mp_obj_t wb_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    mp_arg_check_num(n_args, n_kw, 1, 2, false);
+    mp_get_stream_raise(args[0], MP_STREAM_OP_WRITE | MP_STREAM_OP_IOCTL);
+    #if MICROPY_VFS_WRITEBEHIND_TASK
+    if (!mp_vfs_wb_task_can_write(args[0])) {
+        mp_raise_msg(&mp_type_OSError, "can't write behind this stream");
+    }
+    #endif
+    size_t alloc = MICROPY_PY_IO_BUFFER_SIZE;
+    if (n_args > 1) {
+        alloc = mp_obj_get_int(args[1]);
+    }
+    if (alloc == 0) {
+        mp_raise_ValueError(NULL);
+    }
+    mp_obj_vfs_wb_t *o = m_new_obj_var(mp_obj_vfs_wb_t, byte, alloc);
+    o->base.type = type;
+    o->stream = args[0];
+    o->alloc = alloc;
+    o->head = 0;
+    o->len = 0;
+    o->busy = false;
+    o->closed = false;
+    o->error = 0;
+
+    #if MICROPY_PY_THREAD
+    if (!wb_mutex_ready) {
+        mp_thread_mutex_init(&wb_mutex);
+        wb_mutex_ready = true;
+    }
+    #endif
+    // the list is a root pointer, which keeps the object alive while the
+    // flush task may be using it
+    WB_LOCK();
+    o->next = MP_STATE_VM(vfs_wb_list);
+    MP_STATE_VM(vfs_wb_list) = o;
+    WB_UNLOCK();
+    return MP_OBJ_FROM_PTR(o);
+}
+
+STATIC mp_uint_t wb_write(mp_obj_t self_in, const void *buf, mp_uint_t size, int *errcode) {
+    mp_obj_vfs_wb_t *self = MP_OBJ_TO_PTR(self_in);
+    if (self->closed) {
+        *errcode = MP_EBADF;
+        return MP_STREAM_ERROR;
+    }
+
+    const byte *src = buf;
+    mp_uint_t rem = size;
+    WB_LOCK();
+    while (rem > 0 && self->error == 0) {
+        size_t space = self->alloc - self->len;
+        if (space == 0) {
+            // the queue is full: wait for the oldest data to be written out
+            wb_wait(self);
+            continue;
+        }
+        size_t tail = (self->head + self->len) % self->alloc;
+        size_t n = MIN(MIN(space, self->alloc - tail), rem);
+        memcpy(&self->buf[tail], src, n);
+        self->len += n;
+        src += n;
+        rem -= n;
+    }
+    int err = self->error;
+    WB_UNLOCK();
+
+    if (err != 0) {
+        *errcode = err;
+        return MP_STREAM_ERROR;
+    }
+    #if MICROPY_VFS_WRITEBEHIND_TASK
+    mp_vfs_wb_task_notify();
+    #endif
+    return size;
+}
+
+STATIC mp_uint_t wb_read(mp_obj_t self_in, void *buf, mp_uint_t size, int *errcode) {
+    mp_obj_vfs_wb_t *self = MP_OBJ_TO_PTR(self_in);
+    if (self->closed) {
+        *errcode = MP_EBADF;
+        return MP_STREAM_ERROR;
+    }
+    // reads see all the data written so far
+    int err = wb_drain(self);
+    if (err != 0) {
+        *errcode = err;
+        return MP_STREAM_ERROR;
+    }
+    const mp_stream_p_t *stream_p = mp_get_stream(self->stream);
+    if (stream_p->read == NULL) {
+        *errcode = MP_EPERM;
+        return MP_STREAM_ERROR;
+    }
+    return stream_p->read(self->stream, buf, size, errcode);
+}
+
+STATIC mp_uint_t wb_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode) {
+    mp_obj_vfs_wb_t *self = MP_OBJ_TO_PTR(self_in);
+    if (self->closed) {
+        if (request == MP_STREAM_CLOSE) {
+            return 0;
+        }
+        *errcode = MP_EBADF;
+        return MP_STREAM_ERROR;
+    }
+
+    // Every request is a barrier: flush() returns once the queued data has
+    // been written and the file flushed, and seeks apply after the writes.
+    int err = wb_drain(self);
+
+    if (request == MP_STREAM_CLOSE) {
+        WB_LOCK();
+        for (mp_obj_vfs_wb_t **p = &MP_STATE_VM(vfs_wb_list); *p != NULL; p = &(*p)->next) {
+            if (*p == self) {
+                *p = self->next;
+                break;
+            }
+        }
+        self->closed = true;
+        WB_UNLOCK();
+        mp_uint_t res = mp_get_stream(self->stream)->ioctl(self->stream, request, arg, errcode);
+        if (err != 0) {
+            *errcode = err;
+            return MP_STREAM_ERROR;
+        }
+        return res;
+    }
+
+    if (err != 0) {
+        *errcode = err;
+        return MP_STREAM_ERROR;
+    }
+    return mp_get_stream(self->stream)->ioctl(self->stream, request, arg, errcode);
+}
+
+void mp_vfs_wb_deinit(void) {
+    while (MP_STATE_VM(vfs_wb_list) != NULL) {
+        int err;
+        wb_ioctl(MP_OBJ_FROM_PTR(MP_STATE_VM(vfs_wb_list)), MP_STREAM_CLOSE, 0, &err);
+    }
+}
+
+#if MICROPY_VFS_WRITEBEHIND_TASK
+bool mp_vfs_wb_task_run(void) {
+    bool progress = false;
+    WB_LOCK();
+    // a file can't be removed from the list while one of its writes is in
+    // progress, so the list can be followed across the unlocked writes
+    for (mp_obj_vfs_wb_t *wb = MP_STATE_VM(vfs_wb_list); wb != NULL; wb = wb->next) {
+        if (wb_write_out(wb)) {
+            progress = true;
+        }
+    }
+    WB_UNLOCK();
+    return progress;
+}
+#endif
+
+STATIC mp_obj_t wb___exit__(size_t n_args, const mp_obj_t *args) {
+    (void)n_args;
+    return mp_stream_close(args[0]);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(wb___exit___obj, 4, 4, wb___exit__);
+
+STATIC const mp_rom_map_elem_t wb_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&mp_stream_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&mp_stream_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&mp_stream_write_obj) },
+    { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&mp_stream_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&mp_stream_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR_seek), MP_ROM_PTR(&mp_stream_seek_obj) },
+    { MP_ROM_QSTR(MP_QSTR_tell), MP_ROM_PTR(&mp_stream_tell_obj) },
+    { MP_ROM_QSTR(MP_QSTR___enter__), MP_ROM_PTR(&mp_identity_obj) },
+    { MP_ROM_QSTR(MP_QSTR___exit__), MP_ROM_PTR(&wb___exit___obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(wb_locals_dict, wb_locals_dict_table);
+
+STATIC const mp_stream_p_t wb_stream_p = {
+    .read = wb_read,
+    .write = wb_write,
+    .ioctl = wb_ioctl,
+};
+
+const mp_obj_type_t mp_type_vfs_writebehind = {
+    { &mp_type_type },
+    .name = MP_QSTR_WriteBehind,
+    .make_new = wb_make_new,
+    .protocol = &wb_stream_p,
+    .locals_dict = (mp_obj_dict_t*)&wb_locals_dict,
+};
+
+#endif // MICROPY_VFS_WRITEBEHIND
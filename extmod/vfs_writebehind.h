@@ -0,0 +1,60 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Pycom Limited
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_EXTMOD_VFS_WRITEBEHIND_H
+#define MICROPY_INCLUDED_EXTMOD_VFS_WRITEBEHIND_H
+
+#include "py/obj.h"
+
+// io.WriteBehind(stream, size) queues writes to a file in a RAM buffer of the
+// given size and returns straight away; the queued data is written to the
+// file in order, and flush() waits for all of it to be written and then
+// flushes the file.  A port with a flush task sets
+// MICROPY_VFS_WRITEBEHIND_TASK and provides the mp_vfs_wb_task_* functions
+// below; otherwise the queue is written out by the caller when it fills up
+// and at flush().  The wrapped file must only be used through the wrapper.
+
+extern const mp_obj_type_t mp_type_vfs_writebehind;
+
+// Flushes and closes all open write-behind files, before a soft reset.
+void mp_vfs_wb_deinit(void);
+
+#if MICROPY_VFS_WRITEBEHIND_TASK
+// Provided by the port: wake the flush task, and block the calling thread
+// (without the GIL) until the task has made progress or a short timeout.
+void mp_vfs_wb_task_notify(void);
+void mp_vfs_wb_task_wait(void);
+
+// Provided by the port: whether the flush task can write to the stream.  It
+// does so without the GIL, a thread state or an nlr frame, so the stream's
+// write must not run any Python code, allocate from the heap or raise.
+bool mp_vfs_wb_task_can_write(mp_obj_t stream);
+
+// Called by the flush task without the GIL: writes out one chunk of every
+// file with queued data and returns false if there was nothing to write.
+bool mp_vfs_wb_task_run(void);
+#endif
+
+#endif // MICROPY_INCLUDED_EXTMOD_VFS_WRITEBEHIND_H
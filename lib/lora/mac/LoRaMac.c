@@ -46,6 +46,36 @@ Maintainer: Miguel Luis ( Semtech ), Gregory Cristian ( Semtech ) and Daniel Jae
  */
 static LoRaMacRegion_t LoRaMacRegion;
 
+/*!
+ * Most symbols the radio waits for a preamble in single reception mode
+ */
+#define CLASS_B_MAX_RX_SYMBOLS                      1023
+
+/*!
+ * Preamble length of the class B beacons
+ */
+#define CLASS_B_BEACON_PREAMBLE                     10
+
+/*!
+ * How far the GPS time read from the RTC may be off, in ms
+ */
+#define CLASS_B_GPS_TIME_ERROR                      1000
+
+/*!
+ * How far the time of a DeviceTimeAns may be off, in ms
+ */
+#define CLASS_B_DEVICE_TIME_ERROR                   100
+
+/*!
+ * Class B windows opening sooner than this are skipped, in ms
+ */
+#define CLASS_B_TIMER_LEAD                          5
+
+/*!
+ * Retry period of a beacon search that found the MAC busy, in ms
+ */
+#define CLASS_B_SCAN_RETRY                          1000
+
 /*!
  * LoRaMac duty cycle for the back-off procedure during the first hour.
  */
@@ -416,6 +446,45 @@ static uint8_t RxSlot = 0;
  */
 LoRaMacFlags_t LoRaMacFlags;
 
+/*!
+ * Class B receive windows
+ */
+typedef enum eClassBWindow
+{
+    CLASS_B_WINDOW_NONE,
+    CLASS_B_WINDOW_SCAN,
+    CLASS_B_WINDOW_SCAN_END,
+    CLASS_B_WINDOW_BEACON,
+    CLASS_B_WINDOW_PING,
+}ClassBWindow_t;
+
+/*!
+ * Class B beacon tracking and ping slots
+ */
+static lora_class_b_t ClassB;
+
+/*!
+ * Class B ping slot periodicity, a ping slot every 2^ClassBPeriodicity seconds
+ */
+static uint8_t ClassBPeriodicity = LORA_CLASS_B_PERIODICITY_MAX;
+
+/*!
+ * Opens the next class B window
+ */
+static TimerEvent_t ClassBTimer;
+
+/*!
+ * The window ClassBTimer opens, and the one the radio receives in
+ */
+static ClassBWindow_t ClassBNext = CLASS_B_WINDOW_NONE;
+static ClassBWindow_t ClassBWindow = CLASS_B_WINDOW_NONE;
+
+/*!
+ * Rx parameters and time uncertainty [ms] of the next class B window
+ */
+static RxConfigParams_t ClassBRxConfig;
+static uint32_t ClassBError;
+
 /*!
  * \brief Function to be executed on Radio Tx Done event
  */
@@ -635,6 +704,74 @@ static bool IsFPortAllowed( uint8_t fPort );
  */
 static void OpenContinuousRx2Window( void );
 
+/*!
+ * \brief Region parameters of the class B beacon, NULL if the region has none
+ */
+static const lora_class_b_region_t *ClassBRegion( void );
+
+/*!
+ * \brief Starts class B, the beacon acquisition first
+ */
+static void ClassBStart( void );
+
+/*!
+ * \brief Stops class B
+ */
+static void ClassBStop( void );
+
+/*!
+ * \brief Sets ClassBTimer for the next class B window
+ */
+static void ClassBSchedule( void );
+
+/*!
+ * \brief Function executed on ClassBTimer event, opens a class B window
+ */
+static void OnClassBTimerEvent( void );
+
+/*!
+ * \brief Rx parameters of a class B window
+ *
+ * \param [IN] datarate    Datarate of the window
+ * \param [IN] error       Time uncertainty [ms]
+ * \param [OUT] rxConfig   Window timeout and offset
+ */
+static void ClassBComputeWindow( int8_t datarate, uint32_t error, RxConfigParams_t *rxConfig );
+
+/*!
+ * \brief Sets the radio up for the beacon
+ *
+ * \param [IN] beaconTime    GPS time of the beacon, its channel in the hopping regions
+ * \param [IN] symbTimeout   Symbols to wait for the preamble
+ * \param [IN] rxContinuous  Receives until stopped
+ */
+static void ClassBBeaconRxConfig( uint32_t beaconTime, uint16_t symbTimeout, bool rxContinuous );
+
+/*!
+ * \brief Handles a frame received in a beacon window
+ */
+static void ClassBBeaconRxDone( uint8_t *payload, uint16_t size );
+
+/*!
+ * \brief Closes the class B window on a radio timeout or error
+ */
+static void ClassBRxEnd( void );
+
+/*!
+ * \brief The beacon wasn't received, back to class A once it's lost
+ */
+static void ClassBMissed( void );
+
+/*!
+ * \brief Closes a class B window the radio is needed for a transmission
+ */
+static void ClassBAbortWindow( void );
+
+/*!
+ * \brief Provides a MLME_BEACON indication
+ */
+static void ClassBIndication( LoRaMacEventInfoStatus_t status );
+
 static IRAM_ATTR void OnRadioTxDone( void )
 {
     GetPhyParams_t getPhy;
@@ -754,6 +891,17 @@ static void OnRadioRxDone( uint8_t *payload, uint32_t timestamp, uint16_t size,
 
     bool isMicOk = false;
 
+    if( ( ClassBWindow == CLASS_B_WINDOW_BEACON ) || ( ClassBWindow == CLASS_B_WINDOW_SCAN ) )
+    {
+        ClassBBeaconRxDone( payload, size );
+        return;
+    }
+    if( ClassBWindow == CLASS_B_WINDOW_PING )
+    {// The downlink is processed as the others
+        ClassBWindow = CLASS_B_WINDOW_NONE;
+        ClassBSchedule( );
+    }
+
     McpsConfirm.AckReceived = false;
     McpsIndication.TimeStamp = timestamp;
     McpsIndication.Rssi = rssi;
@@ -1147,6 +1295,12 @@ static void OnRadioTxTimeout( void )
 
 static void OnRadioRxError( void )
 {
+    if( ClassBWindow != CLASS_B_WINDOW_NONE )
+    {
+        ClassBRxEnd( );
+        return;
+    }
+
     if( LoRaMacDeviceClass != CLASS_C )
     {
         Radio.Sleep( );
@@ -1183,6 +1337,12 @@ static void OnRadioRxError( void )
 
 static void OnRadioRxTimeout( void )
 {
+    if( ClassBWindow != CLASS_B_WINDOW_NONE )
+    {
+        ClassBRxEnd( );
+        return;
+    }
+
     if( LoRaMacDeviceClass != CLASS_C )
     {
         Radio.Sleep( );
@@ -1269,6 +1429,10 @@ static void OnMacStateCheckTimerEvent( void )
                         UpLinkCounter = 0;
                         ChannelsNbRepCounter = 0;
                         LoRaMacState &= ~LORAMAC_TX_RUNNING;
+                        if( LoRaMacDeviceClass == CLASS_B )
+                        {
+                            ClassBStart( );
+                        }
                     }
                     else
                     {
@@ -1744,6 +1908,35 @@ static LoRaMacStatus_t AddMacCommand( uint8_t cmd, uint8_t p1, uint8_t p2 )
                 status = LORAMAC_STATUS_OK;
             }
             break;
+        case MOTE_MAC_DEVICE_TIME_REQ:
+            if( MacCommandsBufferIndex < bufLen )
+            {
+                MacCommandsBuffer[MacCommandsBufferIndex++] = cmd;
+                // No payload for this command
+                status = LORAMAC_STATUS_OK;
+            }
+            break;
+        case MOTE_MAC_PING_SLOT_INFO_REQ:
+            if( MacCommandsBufferIndex < ( bufLen - 1 ) )
+            {
+                MacCommandsBuffer[MacCommandsBufferIndex++] = cmd;
+                // Periodicity
+                MacCommandsBuffer[MacCommandsBufferIndex++] = p1 & 0x07;
+                status = LORAMAC_STATUS_OK;
+            }
+            break;
+        case MOTE_MAC_PING_SLOT_CHANNEL_ANS:
+        case MOTE_MAC_BEACON_FREQ_ANS:
+            if( MacCommandsBufferIndex < ( bufLen - 1 ) )
+            {
+                MacCommandsBuffer[MacCommandsBufferIndex++] = cmd;
+                // Status: Datarate OK, Channel frequency OK, or Beacon frequency OK
+                MacCommandsBuffer[MacCommandsBufferIndex++] = p1;
+                // This is a sticky MAC command answer. Setup indication
+                SetMlmeScheduleUplinkIndication( );
+                status = LORAMAC_STATUS_OK;
+            }
+            break;
         default:
             return LORAMAC_STATUS_SERVICE_UNKNOWN;
     }
@@ -1771,6 +1964,8 @@ static uint8_t ParseMacCommandsToRepeat( uint8_t* cmdBufIn, uint8_t length, uint
             // STICKY
             case MOTE_MAC_DL_CHANNEL_ANS:
             case MOTE_MAC_RX_PARAM_SETUP_ANS:
+            case MOTE_MAC_PING_SLOT_CHANNEL_ANS:
+            case MOTE_MAC_BEACON_FREQ_ANS:
             { // 1 byte payload
                 cmdBufOut[cmdCount++] = cmdBufIn[i++];
                 cmdBufOut[cmdCount++] = cmdBufIn[i];
@@ -1789,6 +1984,7 @@ static uint8_t ParseMacCommandsToRepeat( uint8_t* cmdBufIn, uint8_t length, uint
             }
             case MOTE_MAC_LINK_ADR_ANS:
             case MOTE_MAC_NEW_CHANNEL_ANS:
+            case MOTE_MAC_PING_SLOT_INFO_REQ:
             { // 1 byte payload
                 i++;
                 break;
@@ -1796,6 +1992,7 @@ static uint8_t ParseMacCommandsToRepeat( uint8_t* cmdBufIn, uint8_t length, uint
             case MOTE_MAC_TX_PARAM_SETUP_ANS:
             case MOTE_MAC_DUTY_CYCLE_ANS:
             case MOTE_MAC_LINK_CHECK_REQ:
+            case MOTE_MAC_DEVICE_TIME_REQ:
             { // 0 byte payload
                 break;
             }
@@ -1979,6 +2176,80 @@ static void ProcessMacCommands( uint8_t *payload, uint8_t macIndex, uint8_t comm
                     AddMacCommand( MOTE_MAC_DL_CHANNEL_ANS, status, 0 );
                 }
                 break;
+            case SRV_MAC_DEVICE_TIME_ANS:
+                {
+                    uint32_t seconds = ( uint32_t )payload[macIndex++];
+                    seconds |= ( uint32_t )payload[macIndex++] << 8;
+                    seconds |= ( uint32_t )payload[macIndex++] << 16;
+                    seconds |= ( uint32_t )payload[macIndex++] << 24;
+                    // 1/256 s
+                    uint32_t fraction = payload[macIndex++];
+
+                    // The network tells the GPS time at the end of the uplink
+                    if( ClassB.state == E_LORA_CLASS_B_ACQUIRE )
+                    {
+                        lora_class_b_set_time( &ClassB, seconds, AggregatedLastTxDoneTime - ( fraction * 1000 ) / 256, CLASS_B_DEVICE_TIME_ERROR );
+                        ClassBSchedule( );
+                    }
+                }
+                break;
+            case SRV_MAC_PING_SLOT_INFO_ANS:
+                // The network knows the ping slot periodicity
+                break;
+            case SRV_MAC_PING_SLOT_CHANNEL_REQ:
+                {
+                    VerifyParams_t verify;
+                    uint32_t frequency;
+                    int8_t datarate;
+                    status = 0x03;
+
+                    frequency = ( uint32_t )payload[macIndex++];
+                    frequency |= ( uint32_t )payload[macIndex++] << 8;
+                    frequency |= ( uint32_t )payload[macIndex++] << 16;
+                    frequency *= 100;
+                    datarate = payload[macIndex++] & 0x0F;
+
+                    // A frequency of 0 sets the default back
+                    if( ( frequency != 0 ) && ( Radio.CheckRfFrequency( frequency ) == false ) )
+                    {
+                        status &= 0xFE; // Channel frequency KO
+                    }
+                    verify.DatarateParams.Datarate = datarate;
+                    verify.DatarateParams.DownlinkDwellTime = LoRaMacParams.DownlinkDwellTime;
+                    if( RegionVerify( LoRaMacRegion, &verify, PHY_RX_DR ) == false )
+                    {
+                        status &= 0xFD; // Datarate KO
+                    }
+                    if( status == 0x03 )
+                    {
+                        ClassB.ping_freq = frequency;
+                        ClassB.ping_dr = datarate;
+                    }
+                    AddMacCommand( MOTE_MAC_PING_SLOT_CHANNEL_ANS, status, 0 );
+                }
+                break;
+            case SRV_MAC_BEACON_FREQ_REQ:
+                {
+                    uint32_t frequency;
+                    status = 0x01;
+
+                    frequency = ( uint32_t )payload[macIndex++];
+                    frequency |= ( uint32_t )payload[macIndex++] << 8;
+                    frequency |= ( uint32_t )payload[macIndex++] << 16;
+                    frequency *= 100;
+
+                    // A frequency of 0 sets the default back
+                    if( ( frequency != 0 ) && ( Radio.CheckRfFrequency( frequency ) == false ) )
+                    {
+                        status = 0x00; // Beacon frequency KO
+                    }
+                    else
+                    {
+                        ClassB.beacon_freq = frequency;
+                    }
+                    AddMacCommand( MOTE_MAC_BEACON_FREQ_ANS, status, 0 );
+                }
+                break;
             default:
                 // Unknown command. ABORT MAC commands processing
                 return;
@@ -1993,7 +2264,8 @@ LoRaMacStatus_t Send( LoRaMacHeader_t *macHdr, uint8_t fPort, void *fBuffer, uin
 
     fCtrl.Value = 0;
     fCtrl.Bits.FOptsLen      = 0;
-    fCtrl.Bits.FPending      = 0;
+    // In uplinks the bit tells the network the node listens to the ping slots
+    fCtrl.Bits.FPending      = ( LoRaMacDeviceClass == CLASS_B ) && ( ClassB.state == E_LORA_CLASS_B_LOCKED );
     fCtrl.Bits.Ack           = false;
     fCtrl.Bits.AdrAckReq     = false;
     fCtrl.Bits.Adr           = AdrCtrlOn;
@@ -2160,6 +2432,11 @@ static void ResetMacParameters( void )
     // Initialize channel index.
     Channel = 0;
     LastTxChannel = Channel;
+
+    // Class B starts again once joined, with the default channels
+    lora_class_b_init( &ClassB, ClassBRegion( ) );
+    ClassBNext = CLASS_B_WINDOW_NONE;
+    ClassBWindow = CLASS_B_WINDOW_NONE;
 }
 
 static bool IsFPortAllowed( uint8_t fPort )
@@ -2177,6 +2454,273 @@ static void OpenContinuousRx2Window( void )
     RxSlot = 2;
 }
 
+static const lora_class_b_region_t *ClassBRegion( void )
+{
+    switch( LoRaMacRegion )
+    {
+        case LORAMAC_REGION_EU868:
+            return &lora_class_b_eu868;
+        case LORAMAC_REGION_EU433:
+            return &lora_class_b_eu433;
+        case LORAMAC_REGION_AS923:
+            return &lora_class_b_as923;
+        case LORAMAC_REGION_US915:
+        case LORAMAC_REGION_US915_HYBRID:
+            return &lora_class_b_us915;
+        case LORAMAC_REGION_AU915:
+            return &lora_class_b_au915;
+        default:
+            return NULL;
+    }
+}
+
+static void ClassBStart( void )
+{
+    uint32_t gpsTime = 0;
+
+    lora_class_b_start( &ClassB, LoRaMacDevAddr, ClassBPeriodicity );
+    AddMacCommand( MOTE_MAC_PING_SLOT_INFO_REQ, ClassBPeriodicity, 0 );
+    // The answer comes with the next downlink, it's more precise than the RTC
+    AddMacCommand( MOTE_MAC_DEVICE_TIME_REQ, 0, 0 );
+
+    if( ( LoRaMacCallbacks != NULL ) && ( LoRaMacCallbacks->GetGpsTime != NULL ) )
+    {
+        gpsTime = LoRaMacCallbacks->GetGpsTime( );
+    }
+    if( gpsTime != 0 )
+    {
+        lora_class_b_set_time( &ClassB, gpsTime, TimerGetCurrentTime( ), CLASS_B_GPS_TIME_ERROR );
+    }
+    ClassBSchedule( );
+}
+
+static void ClassBStop( void )
+{
+    TimerStop( &ClassBTimer );
+    if( ClassBWindow != CLASS_B_WINDOW_NONE )
+    {
+        Radio.Sleep( );
+    }
+    ClassBNext = CLASS_B_WINDOW_NONE;
+    ClassBWindow = CLASS_B_WINDOW_NONE;
+    lora_class_b_stop( &ClassB );
+}
+
+static void ClassBSchedule( void )
+{
+    RxConfigParams_t pingConfig;
+    TimerTime_t now = TimerGetCurrentTime( );
+    TimerTime_t from = now;
+    uint32_t beaconAt, pingAt, error;
+    int32_t delay, pingDelay;
+
+    TimerStop( &ClassBTimer );
+    ClassBNext = CLASS_B_WINDOW_NONE;
+
+    for( ; ; )
+    {
+        if( ClassB.state == E_LORA_CLASS_B_OFF )
+        {
+            return;
+        }
+        if( lora_class_b_next_beacon( &ClassB, &beaconAt, &error ) == false )
+        {// Without the time, the beacon is searched for
+            ClassBNext = CLASS_B_WINDOW_SCAN;
+            TimerSetValue( &ClassBTimer, 1 );
+            TimerStart( &ClassBTimer );
+            return;
+        }
+        ClassBComputeWindow( ClassB.region->dr, error, &ClassBRxConfig );
+        delay = beaconAt + ClassBRxConfig.WindowOffset - now;
+        if( delay >= CLASS_B_TIMER_LEAD )
+        {
+            break;
+        }
+        // Too late for it
+        ClassBMissed( );
+    }
+    ClassBNext = CLASS_B_WINDOW_BEACON;
+    ClassBError = LoRaMacParams.SystemMaxRxError + error;
+
+    // The ping slots of the period come first
+    while( lora_class_b_next_ping( &ClassB, from, &pingAt, &error ) == true )
+    {
+        ClassBComputeWindow( lora_class_b_ping_dr( &ClassB ), error, &pingConfig );
+        pingDelay = pingAt + pingConfig.WindowOffset - now;
+        if( pingDelay < CLASS_B_TIMER_LEAD )
+        {
+            from = pingAt + 1;
+            continue;
+        }
+        if( pingDelay < delay )
+        {
+            ClassBNext = CLASS_B_WINDOW_PING;
+            ClassBRxConfig = pingConfig;
+            ClassBError = LoRaMacParams.SystemMaxRxError + error;
+            delay = pingDelay;
+        }
+        break;
+    }
+
+    TimerSetValue( &ClassBTimer, delay );
+    TimerStart( &ClassBTimer );
+}
+
+static void OnClassBTimerEvent( void )
+{
+    ClassBWindow_t next = ClassBNext;
+    bool busy = ( LoRaMacState != LORAMAC_IDLE ) || ( Radio.GetStatus( ) != RF_IDLE );
+
+    TimerStop( &ClassBTimer );
+    ClassBNext = CLASS_B_WINDOW_NONE;
+
+    switch( next )
+    {
+        case CLASS_B_WINDOW_SCAN:
+            if( busy == true )
+            {
+                ClassBNext = CLASS_B_WINDOW_SCAN;
+                TimerSetValue( &ClassBTimer, CLASS_B_SCAN_RETRY );
+                TimerStart( &ClassBTimer );
+                break;
+            }
+            // One channel for as many periods as the beacon hops over
+            ClassBBeaconRxConfig( 0, 0, true );
+            ClassBWindow = CLASS_B_WINDOW_SCAN;
+            Radio.Rx( 0 );
+            ClassBNext = CLASS_B_WINDOW_SCAN_END;
+            TimerSetValue( &ClassBTimer, LORA_CLASS_B_BEACON_INTERVAL * ClassB.region->hops );
+            TimerStart( &ClassBTimer );
+            break;
+        case CLASS_B_WINDOW_SCAN_END:
+            if( ClassBWindow == CLASS_B_WINDOW_SCAN )
+            {
+                Radio.Sleep( );
+                ClassBWindow = CLASS_B_WINDOW_NONE;
+            }
+            ClassBMissed( );
+            ClassBSchedule( );
+            break;
+        case CLASS_B_WINDOW_BEACON:
+            if( busy == true )
+            {
+                ClassBMissed( );
+                ClassBSchedule( );
+                break;
+            }
+            ClassBBeaconRxConfig( ClassB.beacon_time + LORA_CLASS_B_BEACON_INTERVAL / 1000, ClassBRxConfig.WindowTimeout, false );
+            ClassBWindow = CLASS_B_WINDOW_BEACON;
+            Radio.Rx( 2 * ClassBError + Radio.TimeOnAir( MODEM_LORA, ClassB.region->size ) );
+            break;
+        case CLASS_B_WINDOW_PING:
+            ClassBRxConfig.Channel = Channel;
+            ClassBRxConfig.Frequency = lora_class_b_ping_freq( &ClassB, ClassB.beacon_time );
+            ClassBRxConfig.DownlinkDwellTime = LoRaMacParams.DownlinkDwellTime;
+            ClassBRxConfig.RepeaterSupport = RepeaterSupport;
+            ClassBRxConfig.RxContinuous = false;
+            ClassBRxConfig.Window = 1;
+            if( ( busy == false ) &&
+                ( RegionRxConfig( LoRaMacRegion, &ClassBRxConfig, ( int8_t* )&McpsIndication.RxDatarate ) == true ) )
+            {
+                ClassBWindow = CLASS_B_WINDOW_PING;
+                RxWindowSetup( false, LoRaMacParams.MaxRxWindow );
+            }
+            else
+            {// The slot is skipped
+                ClassBSchedule( );
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void ClassBComputeWindow( int8_t datarate, uint32_t error, RxConfigParams_t *rxConfig )
+{
+    RegionComputeRxWindowParameters( LoRaMacRegion, datarate, LoRaMacParams.MinRxSymbols, LoRaMacParams.SystemMaxRxError + error, rxConfig );
+    rxConfig->WindowTimeout = MIN( rxConfig->WindowTimeout, CLASS_B_MAX_RX_SYMBOLS );
+}
+
+static void ClassBBeaconRxConfig( uint32_t beaconTime, uint16_t symbTimeout, bool rxContinuous )
+{
+    // Beacons have an implicit header, no CRC and the IQ not inverted
+    Radio.SetChannel( lora_class_b_beacon_freq( &ClassB, beaconTime ) );
+    Radio.SetRxConfig( MODEM_LORA, ClassB.region->bw, ClassB.region->sf, 1, 0, CLASS_B_BEACON_PREAMBLE, symbTimeout,
+                       true, ClassB.region->size, false, 0, 0, false, rxContinuous );
+}
+
+static void ClassBBeaconRxDone( uint8_t *payload, uint16_t size )
+{
+    // The beacon started its time on air ago
+    TimerTime_t startAt = TimerGetCurrentTime( ) - Radio.TimeOnAir( MODEM_LORA, size );
+    bool locked = ( ClassB.state == E_LORA_CLASS_B_LOCKED );
+
+    if( lora_class_b_beacon_rx( &ClassB, payload, size, startAt ) == true )
+    {
+        Radio.Sleep( );
+        ClassBWindow = CLASS_B_WINDOW_NONE;
+        if( locked == false )
+        {
+            ClassBIndication( LORAMAC_EVENT_INFO_STATUS_BEACON_LOCKED );
+        }
+        ClassBSchedule( );
+    }
+    else if( ClassBWindow == CLASS_B_WINDOW_BEACON )
+    {
+        ClassBRxEnd( );
+    }
+    // A search goes on
+}
+
+static void ClassBRxEnd( void )
+{
+    ClassBWindow_t window = ClassBWindow;
+
+    if( window == CLASS_B_WINDOW_SCAN )
+    {// Goes on until ClassBTimer ends it
+        return;
+    }
+    Radio.Sleep( );
+    ClassBWindow = CLASS_B_WINDOW_NONE;
+    if( window == CLASS_B_WINDOW_BEACON )
+    {
+        ClassBMissed( );
+    }
+    ClassBSchedule( );
+}
+
+static void ClassBMissed( void )
+{
+    if( lora_class_b_beacon_missed( &ClassB ) == false )
+    {// Back to class A
+        ClassBStop( );
+        LoRaMacDeviceClass = CLASS_A;
+        ClassBIndication( LORAMAC_EVENT_INFO_STATUS_BEACON_LOST );
+    }
+}
+
+static void ClassBAbortWindow( void )
+{
+    if( ClassBWindow != CLASS_B_WINDOW_NONE )
+    {
+        // A beacon missed that way is counted with the next schedule
+        ClassBWindow = CLASS_B_WINDOW_NONE;
+        Radio.Standby( );
+        ClassBSchedule( );
+    }
+}
+
+static void ClassBIndication( LoRaMacEventInfoStatus_t status )
+{
+    MlmeIndication.MlmeIndication = MLME_BEACON;
+    MlmeIndication.Status = status;
+    LoRaMacFlags.Bits.MlmeInd = 1;
+
+    // Trig OnMacCheckTimerEvent call as soon as possible
+    TimerSetValue( &MacStateCheckTimer, 1 );
+    TimerStart( &MacStateCheckTimer );
+}
+
 LoRaMacStatus_t PrepareFrame( LoRaMacHeader_t *macHdr, LoRaMacFrameCtrl_t *fCtrl, uint8_t fPort, void *fBuffer, uint16_t fBufferSize )
 {
     AdrNextParams_t adrNext;
@@ -2355,6 +2899,8 @@ LoRaMacStatus_t SendFrameOnChannel( uint8_t channel )
     txConfig.AntennaGain = LoRaMacParams.AntennaGain;
     txConfig.PktLen = LoRaMacBufferPktLen;
 
+    ClassBAbortWindow( );
+
     RegionTxConfig( LoRaMacRegion, &txConfig, &txPower, &TxTimeOnAir );
 
     MlmeConfirm.Status = LORAMAC_EVENT_INFO_STATUS_ERROR;
@@ -2547,6 +3093,7 @@ LoRaMacStatus_t LoRaMacInitialization( LoRaMacPrimitives_t *primitives, LoRaMacC
     TimerInit( &RxWindowTimer1, OnRxWindow1TimerEvent );
     TimerInit( &RxWindowTimer2, OnRxWindow2TimerEvent );
     TimerInit( &AckTimeoutTimer, OnAckTimeoutTimerEvent );
+    TimerInit( &ClassBTimer, OnClassBTimerEvent );
     //TimerInit( &RadioTxDoneClassCTimer, OnRxWindow2TimerEvent );
     //TimerSetValue( &RadioTxDoneClassCTimer, 1 );
 
@@ -2837,6 +3384,15 @@ LoRaMacStatus_t LoRaMacMibSetRequestConfirm( MibRequestConfirm_t *mibSet )
     {
         case MIB_DEVICE_CLASS:
         {
+            if( ( mibSet->Param.Class == CLASS_B ) && ( ClassBRegion( ) == NULL ) )
+            {
+                status = LORAMAC_STATUS_REGION_NOT_SUPPORTED;
+                break;
+            }
+            if( mibSet->Param.Class != CLASS_B )
+            {
+                ClassBStop( );
+            }
             LoRaMacDeviceClass = mibSet->Param.Class;
             switch( LoRaMacDeviceClass )
             {
@@ -2848,6 +3404,11 @@ LoRaMacStatus_t LoRaMacMibSetRequestConfirm( MibRequestConfirm_t *mibSet )
                 }
                 case CLASS_B:
                 {
+                    // Otherwise it starts once joined
+                    if( ( IsLoRaMacNetworkJoined == true ) && ( ClassB.state == E_LORA_CLASS_B_OFF ) )
+                    {
+                        ClassBStart( );
+                    }
                     break;
                 }
                 case CLASS_C:
@@ -2875,6 +3436,10 @@ LoRaMacStatus_t LoRaMacMibSetRequestConfirm( MibRequestConfirm_t *mibSet )
         case MIB_NETWORK_JOINED:
         {
             IsLoRaMacNetworkJoined = mibSet->Param.IsNetworkJoined;
+            if( ( IsLoRaMacNetworkJoined == true ) && ( LoRaMacDeviceClass == CLASS_B ) && ( ClassB.state == E_LORA_CLASS_B_OFF ) )
+            {
+                ClassBStart( );
+            }
             break;
         }
         case MIB_ADR:
@@ -3562,45 +4127,6 @@ void LoRaMacTestSetChannel( uint8_t channel )
     Channel = channel;
 }
 
-void LoRaMacNvsSave( void )
-{
-    ChannelParams_t *channels;
-    uint16_t *channelmask;
-    uint32_t size;
-
-    modlora_nvs_set_blob(E_LORA_NVS_ELE_MAC_PARAMS, &LoRaMacParams, sizeof(LoRaMacParams));
-    RegionGetChannels(LoRaMacRegion, &channels, &size);
-    modlora_nvs_set_blob(E_LORA_NVS_ELE_CHANNELS, channels, size);
-
-    if (RegionGetChannelMask(LoRaMacRegion, &channelmask, &size)) {
-        modlora_nvs_set_blob(E_LORA_NVS_ELE_CHANNELMASK, channelmask, size);
-    }
-
-    if (RegionGetChannelMaskRemaining(LoRaMacRegion, &channelmask, &size)) {
-        modlora_nvs_set_blob(E_LORA_NVS_ELE_CHANNELMASK_REMAINING, channelmask, size);
-    }
-
-    modlora_nvs_set_uint(E_LORA_NVS_ELE_ACK_REQ, SrvAckRequested);
-
-    modlora_nvs_set_uint(E_LORA_NVS_MAC_NXT_TX, MacCommandsInNextTx);
-    modlora_nvs_set_uint(E_LORA_NVS_MAC_CMD_BUF_IDX, MacCommandsBufferIndex);
-    modlora_nvs_set_uint(E_LORA_NVS_MAC_CMD_BUF_RPT_IDX, MacCommandsBufferToRepeatIndex);
-
-    modlora_nvs_set_blob(E_LORA_NVS_ELE_MAC_BUF, MacCommandsBuffer, sizeof(MacCommandsBuffer));
-    modlora_nvs_set_blob(E_LORA_NVS_ELE_MAC_RPT_BUF, MacCommandsBufferToRepeat, sizeof(MacCommandsBufferToRepeat));
-
-    modlora_nvs_set_uint(E_LORA_NVS_ELE_DWLINK, DownLinkCounter);
-    modlora_nvs_set_uint(E_LORA_NVS_ELE_UPLINK, UpLinkCounter);
-
-    modlora_nvs_set_blob(E_LORA_NVS_ELE_NWSKEY, LoRaMacNwkSKey, sizeof(LoRaMacNwkSKey));
-    modlora_nvs_set_blob(E_LORA_NVS_ELE_APPSKEY, LoRaMacAppSKey, sizeof(LoRaMacAppSKey));
-
-    modlora_nvs_set_uint(E_LORA_NVS_ELE_NET_ID, LoRaMacNetID);
-    modlora_nvs_set_uint(E_LORA_NVS_ELE_DEVADDR, LoRaMacDevAddr);
-
-    modlora_nvs_set_uint(E_LORA_NVS_ELE_ADR_ACKS, AdrAckCounter);
-}
-
 void LoRaMacGetChannelList(ChannelParams_t **channels, uint32_t *size) {
     RegionGetChannels(LoRaMacRegion, channels, size);
 }
@@ -3613,6 +4139,20 @@ bool LoRaMacGetChannelsMaskRemaining(uint16_t **channelmask, uint32_t *size) {
     return RegionGetChannelMaskRemaining(LoRaMacRegion, channelmask, size);
 }
 
+lora_class_b_t * LoRaMacGetClassB(void) {
+    return &ClassB;
+}
+
+void LoRaMacSetPingSlotPeriodicity(uint8_t periodicity) {
+    ClassBPeriodicity = MIN( periodicity, LORA_CLASS_B_PERIODICITY_MAX );
+    if( ClassB.state != E_LORA_CLASS_B_OFF )
+    {
+        lora_class_b_set_periodicity( &ClassB, ClassBPeriodicity );
+        AddMacCommand( MOTE_MAC_PING_SLOT_INFO_REQ, ClassBPeriodicity, 0 );
+        ClassBSchedule( );
+    }
+}
+
 LoRaMacParams_t * LoRaMacGetMacParams(void) {
     return &LoRaMacParams;
 }
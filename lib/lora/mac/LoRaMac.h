@@ -82,6 +82,8 @@
 #ifndef __LORAMAC_H__
 #define __LORAMAC_H__
 
+#include "lora_class_b.h"
+
 /*!
  * Check the Mac layer state every MAC_STATE_CHECK_TIMEOUT in ms
  */
@@ -447,7 +449,23 @@ typedef enum eLoRaMacMoteCmd
     /*!
      * DlChannelAns
      */
-    MOTE_MAC_DL_CHANNEL_ANS          = 0x0A
+    MOTE_MAC_DL_CHANNEL_ANS          = 0x0A,
+    /*!
+     * DeviceTimeReq
+     */
+    MOTE_MAC_DEVICE_TIME_REQ         = 0x0D,
+    /*!
+     * PingSlotInfoReq
+     */
+    MOTE_MAC_PING_SLOT_INFO_REQ      = 0x10,
+    /*!
+     * PingSlotChannelAns
+     */
+    MOTE_MAC_PING_SLOT_CHANNEL_ANS   = 0x11,
+    /*!
+     * BeaconFreqAns
+     */
+    MOTE_MAC_BEACON_FREQ_ANS         = 0x13
 }LoRaMacMoteCmd_t;
 
 /*!
@@ -493,6 +511,22 @@ typedef enum eLoRaMacSrvCmd
      * DlChannelReq
      */
     SRV_MAC_DL_CHANNEL_REQ           = 0x0A,
+    /*!
+     * DeviceTimeAns
+     */
+    SRV_MAC_DEVICE_TIME_ANS          = 0x0D,
+    /*!
+     * PingSlotInfoAns
+     */
+    SRV_MAC_PING_SLOT_INFO_ANS       = 0x10,
+    /*!
+     * PingSlotChannelReq
+     */
+    SRV_MAC_PING_SLOT_CHANNEL_REQ    = 0x11,
+    /*!
+     * BeaconFreqReq
+     */
+    SRV_MAC_BEACON_FREQ_REQ          = 0x13,
 }LoRaMacSrvCmd_t;
 
 /*!
@@ -648,6 +682,14 @@ typedef enum eLoRaMacEventInfoStatus
      * message integrity check failure
      */
     LORAMAC_EVENT_INFO_STATUS_MIC_FAIL,
+    /*!
+     * The node received a beacon and follows the ping slots
+     */
+    LORAMAC_EVENT_INFO_STATUS_BEACON_LOCKED,
+    /*!
+     * The node found no beacon, or lost it, and is back in class A
+     */
+    LORAMAC_EVENT_INFO_STATUS_BEACON_LOST,
 }LoRaMacEventInfoStatus_t;
 
 /*!
@@ -1018,7 +1060,13 @@ typedef enum eMlme
      * Indicates that the application shall perform an uplink as
      * soon as possible.
      */
-    MLME_SCHEDULE_UPLINK
+    MLME_SCHEDULE_UPLINK,
+    /*!
+     * Indicates that the class B beacon was acquired or lost
+     *
+     * LoRaWAN Specification V1.0.3, chapter 8
+     */
+    MLME_BEACON
 }Mlme_t;
 
 /*!
@@ -1140,6 +1188,10 @@ typedef struct sMlmeIndication
      * MLME-Indication type
      */
     Mlme_t MlmeIndication;
+    /*!
+     * Status of the operation
+     */
+    LoRaMacEventInfoStatus_t Status;
 }MlmeIndication_t;
 
 /*!
@@ -1768,6 +1820,12 @@ typedef struct sLoRaMacCallback
      *          to measure the battery level]
      */
     uint8_t ( *GetBatteryLevel )( void );
+    /*!
+     * \brief   Reads the GPS time, for the class B beacon acquisition
+     *
+     * \retval  Seconds since the GPS epoch, 0 if the time isn't known
+     */
+    uint32_t ( *GetGpsTime )( void );
 }LoRaMacCallback_t;
 
 /*!
@@ -2057,8 +2115,6 @@ LoRaMacStatus_t LoRaMacMcpsRequest( McpsReq_t *mcpsRequest );
  */
 bool ValidatePayloadLength( uint8_t lenN, int8_t datarate, uint8_t fOptsLen );
 
-void LoRaMacNvsSave( void );
-
 void LoRaMacGetChannelList(ChannelParams_t **channels, uint32_t *size);
 
 bool LoRaMacGetChannelsMask(uint16_t **channelmask, uint32_t *size);
@@ -2067,6 +2123,10 @@ bool LoRaMacGetChannelsMaskRemaining(uint16_t **channelmask, uint32_t *size);
 
 LoRaMacParams_t * LoRaMacGetMacParams(void);
 
+lora_class_b_t * LoRaMacGetClassB(void);
+
+void LoRaMacSetPingSlotPeriodicity(uint8_t periodicity);
+
 bool * LoRaMacGetSrvAckRequested(void);
 
 bool * LoRaMacGetMacCmdNextTx(void);
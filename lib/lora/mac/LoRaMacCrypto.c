@@ -21,8 +21,7 @@ Maintainer: Miguel Luis ( Semtech ), Gregory Cristian ( Semtech ) and Daniel Jae
 #include <stdint.h>
 #include "utilities.h"
 
-#include "lora/system/crypto/aes.h"
-#include "lora/system/crypto/cmac.h"
+#include "lora/system/crypto/lora_aes.h"
 
 #include "LoRaMacCrypto.h"
 
@@ -32,38 +31,31 @@ Maintainer: Miguel Luis ( Semtech ), Gregory Cristian ( Semtech ) and Daniel Jae
 #define LORAMAC_MIC_BLOCK_B0_SIZE                   16
 
 /*!
- * MIC field computation initial data
- */
-static uint8_t MicBlockB0[] = { 0x49, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-                              };
-
-/*!
- * Contains the computed MIC field.
+ * \brief Fills the B0 block of a MIC, or the A block of an encryption
  *
- * \remark Only the 4 first bytes are used
+ * \param [OUT] block           Block to fill
+ * \param [IN]  first           First byte, 0x49 for B0, 0x01 for A
+ * \param [IN]  address         Frame address
+ * \param [IN]  dir             Frame direction [0: uplink, 1: downlink]
+ * \param [IN]  sequenceCounter Frame sequence counter
  */
-static uint8_t Mic[16];
+static void LoRaMacCryptoBlock( uint8_t *block, uint8_t first, uint32_t address, uint8_t dir, uint32_t sequenceCounter )
+{
+    memset1( block, 0, LORAMAC_MIC_BLOCK_B0_SIZE );
+    block[0] = first;
 
-/*!
- * Encryption aBlock and sBlock
- */
-static uint8_t aBlock[] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-                          };
-static uint8_t sBlock[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-                          };
+    block[5] = dir;
 
-/*!
- * AES computation context variable
- */
-static aes_context AesContext;
+    block[6] = ( address ) & 0xFF;
+    block[7] = ( address >> 8 ) & 0xFF;
+    block[8] = ( address >> 16 ) & 0xFF;
+    block[9] = ( address >> 24 ) & 0xFF;
 
-/*!
- * CMAC computation context variable
- */
-static AES_CMAC_CTX AesCmacCtx[1];
+    block[10] = ( sequenceCounter ) & 0xFF;
+    block[11] = ( sequenceCounter >> 8 ) & 0xFF;
+    block[12] = ( sequenceCounter >> 16 ) & 0xFF;
+    block[13] = ( sequenceCounter >> 24 ) & 0xFF;
+}
 
 /*!
  * \brief Computes the LoRaMAC frame MIC field
@@ -78,75 +70,44 @@ static AES_CMAC_CTX AesCmacCtx[1];
  */
 void LoRaMacComputeMic( const uint8_t *buffer, uint16_t size, const uint8_t *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint32_t *mic )
 {
-    MicBlockB0[5] = dir;
-
-    MicBlockB0[6] = ( address ) & 0xFF;
-    MicBlockB0[7] = ( address >> 8 ) & 0xFF;
-    MicBlockB0[8] = ( address >> 16 ) & 0xFF;
-    MicBlockB0[9] = ( address >> 24 ) & 0xFF;
-
-    MicBlockB0[10] = ( sequenceCounter ) & 0xFF;
-    MicBlockB0[11] = ( sequenceCounter >> 8 ) & 0xFF;
-    MicBlockB0[12] = ( sequenceCounter >> 16 ) & 0xFF;
-    MicBlockB0[13] = ( sequenceCounter >> 24 ) & 0xFF;
-
-    MicBlockB0[15] = size & 0xFF;
-
-    AES_CMAC_Init( AesCmacCtx );
+    uint8_t micBlockB0[LORAMAC_MIC_BLOCK_B0_SIZE];
+    uint8_t cmac[16];
+    lora_aes_key_t aesKey;
 
-    AES_CMAC_SetKey( AesCmacCtx, key );
+    LoRaMacCryptoBlock( micBlockB0, 0x49, address, dir, sequenceCounter );
+    micBlockB0[15] = size & 0xFF;
 
-    AES_CMAC_Update( AesCmacCtx, MicBlockB0, LORAMAC_MIC_BLOCK_B0_SIZE );
+    lora_aes_key( key, &aesKey );
+    lora_aes_cmac( &aesKey, micBlockB0, buffer, size & 0xFF, cmac );
 
-    AES_CMAC_Update( AesCmacCtx, buffer, size & 0xFF );
-
-    AES_CMAC_Final( Mic, AesCmacCtx );
-
-    *mic = ( uint32_t )( ( uint32_t )Mic[3] << 24 | ( uint32_t )Mic[2] << 16 | ( uint32_t )Mic[1] << 8 | ( uint32_t )Mic[0] );
+    *mic = ( uint32_t )( ( uint32_t )cmac[3] << 24 | ( uint32_t )cmac[2] << 16 | ( uint32_t )cmac[1] << 8 | ( uint32_t )cmac[0] );
 }
 
 void LoRaMacPayloadEncrypt( const uint8_t *buffer, uint16_t size, const uint8_t *key, uint32_t address, uint8_t dir, uint32_t sequenceCounter, uint8_t *encBuffer )
 {
+    lora_aes_key_t aesKey;
+    uint8_t aBlock[16];
+    uint8_t sBlock[16];
     uint16_t i;
-    uint8_t bufferIndex = 0;
+    uint16_t bufferIndex = 0;
     uint16_t ctr = 1;
 
-    memset1( AesContext.ksch, '\0', 240 );
-    aes_set_key_lora( key, 16, &AesContext );
-
-    aBlock[5] = dir;
-
-    aBlock[6] = ( address ) & 0xFF;
-    aBlock[7] = ( address >> 8 ) & 0xFF;
-    aBlock[8] = ( address >> 16 ) & 0xFF;
-    aBlock[9] = ( address >> 24 ) & 0xFF;
-
-    aBlock[10] = ( sequenceCounter ) & 0xFF;
-    aBlock[11] = ( sequenceCounter >> 8 ) & 0xFF;
-    aBlock[12] = ( sequenceCounter >> 16 ) & 0xFF;
-    aBlock[13] = ( sequenceCounter >> 24 ) & 0xFF;
+    lora_aes_key( key, &aesKey );
+    LoRaMacCryptoBlock( aBlock, 0x01, address, dir, sequenceCounter );
 
-    while( size >= 16 )
+    while( size > 0 )
     {
-        aBlock[15] = ( ( ctr ) & 0xFF );
-        ctr++;
-        aes_encrypt_lora( aBlock, sBlock, &AesContext );
-        for( i = 0; i < 16; i++ )
-        {
-            encBuffer[bufferIndex + i] = buffer[bufferIndex + i] ^ sBlock[i];
-        }
-        size -= 16;
-        bufferIndex += 16;
-    }
+        uint16_t blockSize = ( size < 16 ) ? size : 16;
 
-    if( size > 0 )
-    {
         aBlock[15] = ( ( ctr ) & 0xFF );
-        aes_encrypt_lora( aBlock, sBlock, &AesContext );
-        for( i = 0; i < size; i++ )
+        ctr++;
+        lora_aes_encrypt( &aesKey, aBlock, sBlock );
+        for( i = 0; i < blockSize; i++ )
         {
             encBuffer[bufferIndex + i] = buffer[bufferIndex + i] ^ sBlock[i];
         }
+        size -= blockSize;
+        bufferIndex += blockSize;
     }
 }
 
@@ -157,46 +118,44 @@ void LoRaMacPayloadDecrypt( const uint8_t *buffer, uint16_t size, const uint8_t
 
 void LoRaMacJoinComputeMic( const uint8_t *buffer, uint16_t size, const uint8_t *key, uint32_t *mic )
 {
-    AES_CMAC_Init( AesCmacCtx );
+    uint8_t cmac[16];
+    lora_aes_key_t aesKey;
 
-    AES_CMAC_SetKey( AesCmacCtx, key );
+    lora_aes_key( key, &aesKey );
+    lora_aes_cmac( &aesKey, NULL, buffer, size & 0xFF, cmac );
 
-    AES_CMAC_Update( AesCmacCtx, buffer, size & 0xFF );
-
-    AES_CMAC_Final( Mic, AesCmacCtx );
-
-    *mic = ( uint32_t )( ( uint32_t )Mic[3] << 24 | ( uint32_t )Mic[2] << 16 | ( uint32_t )Mic[1] << 8 | ( uint32_t )Mic[0] );
+    *mic = ( uint32_t )( ( uint32_t )cmac[3] << 24 | ( uint32_t )cmac[2] << 16 | ( uint32_t )cmac[1] << 8 | ( uint32_t )cmac[0] );
 }
 
 void LoRaMacJoinDecrypt( const uint8_t *buffer, uint16_t size, const uint8_t *key, uint8_t *decBuffer )
 {
-    memset1( AesContext.ksch, '\0', 240 );
-    aes_set_key_lora( key, 16, &AesContext );
-    aes_encrypt_lora( buffer, decBuffer, &AesContext );
+    lora_aes_key_t aesKey;
+
+    lora_aes_key( key, &aesKey );
+    lora_aes_encrypt( &aesKey, buffer, decBuffer );
     // Check if optional CFList is included
     if( size >= 16 )
     {
-        aes_encrypt_lora( buffer + 16, decBuffer + 16, &AesContext );
+        lora_aes_encrypt( &aesKey, buffer + 16, decBuffer + 16 );
     }
 }
 
 void LoRaMacJoinComputeSKeys( const uint8_t *key, const uint8_t *appNonce, uint16_t devNonce, uint8_t *nwkSKey, uint8_t *appSKey )
 {
+    lora_aes_key_t aesKey;
     uint8_t nonce[16];
     uint8_t *pDevNonce = ( uint8_t * )&devNonce;
 
-    memset1( AesContext.ksch, '\0', 240 );
-    aes_set_key_lora( key, 16, &AesContext );
-
+    lora_aes_key( key, &aesKey );
     memset1( nonce, 0, sizeof( nonce ) );
     nonce[0] = 0x01;
     memcpy1( nonce + 1, appNonce, 6 );
     memcpy1( nonce + 7, pDevNonce, 2 );
-    aes_encrypt_lora( nonce, nwkSKey, &AesContext );
+    lora_aes_encrypt( &aesKey, nonce, nwkSKey );
 
     memset1( nonce, 0, sizeof( nonce ) );
     nonce[0] = 0x02;
     memcpy1( nonce + 1, appNonce, 6 );
     memcpy1( nonce + 7, pDevNonce, 2 );
-    aes_encrypt_lora( nonce, appSKey, &AesContext );
+    lora_aes_encrypt( &aesKey, nonce, appSKey );
 }
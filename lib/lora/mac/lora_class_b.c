@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lora_class_b.h"
+#include "lora/system/crypto/lora_aes.h"
+
+/******************************************************************************
+ DEFINE PRIVATE CONSTANTS
+ ******************************************************************************/
+#define LORA_CLASS_B_PERIOD_S           (LORA_CLASS_B_BEACON_INTERVAL / 1000)
+
+// beacons a search from a known time may miss before it gives up
+#define LORA_CLASS_B_ACQUIRE_TRIES      (4)
+
+/******************************************************************************
+ DECLARE PUBLIC DATA
+ ******************************************************************************/
+const lora_class_b_region_t lora_class_b_eu868 = {
+    .size = 17, .rfu1 = 2, .rfu2 = 0, .dr = 3, .sf = 9, .bw = 0,
+    .frequency = 869525000, .hop_step = 0, .hops = 1, .ping_dr = 3
+};
+
+const lora_class_b_region_t lora_class_b_eu433 = {
+    .size = 17, .rfu1 = 2, .rfu2 = 0, .dr = 3, .sf = 9, .bw = 0,
+    .frequency = 434665000, .hop_step = 0, .hops = 1, .ping_dr = 3
+};
+
+const lora_class_b_region_t lora_class_b_as923 = {
+    .size = 17, .rfu1 = 2, .rfu2 = 0, .dr = 3, .sf = 9, .bw = 0,
+    .frequency = 923400000, .hop_step = 0, .hops = 1, .ping_dr = 3
+};
+
+const lora_class_b_region_t lora_class_b_us915 = {
+    .size = 23, .rfu1 = 5, .rfu2 = 3, .dr = 8, .sf = 12, .bw = 2,
+    .frequency = 923300000, .hop_step = 600000, .hops = 8, .ping_dr = 8
+};
+
+const lora_class_b_region_t lora_class_b_au915 = {
+    .size = 23, .rfu1 = 5, .rfu2 = 3, .dr = 8, .sf = 12, .bw = 2,
+    .frequency = 923300000, .hop_step = 600000, .hops = 8, .ping_dr = 8
+};
+
+/******************************************************************************
+ DECLARE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t lora_class_b_get32(const uint8_t *buf);
+static int32_t lora_class_b_get24(const uint8_t *buf);
+static void lora_class_b_new_period(lora_class_b_t *cb);
+
+/******************************************************************************
+ DEFINE PUBLIC FUNCTIONS
+ ******************************************************************************/
+void lora_class_b_init(lora_class_b_t *cb, const lora_class_b_region_t *region) {
+    memset(cb, 0, sizeof(*cb));
+    cb->region = region;
+    cb->ping_dr = -1;
+}
+
+void lora_class_b_start(lora_class_b_t *cb, uint32_t dev_addr, uint8_t periodicity) {
+    cb->dev_addr = dev_addr;
+    cb->state = E_LORA_CLASS_B_ACQUIRE;
+    cb->missed = 0;
+    lora_class_b_set_periodicity(cb, periodicity);
+}
+
+void lora_class_b_stop(lora_class_b_t *cb) {
+    cb->state = E_LORA_CLASS_B_OFF;
+    cb->time_known = false;
+    cb->missed = 0;
+}
+
+void lora_class_b_set_periodicity(lora_class_b_t *cb, uint8_t periodicity) {
+    if (periodicity > LORA_CLASS_B_PERIODICITY_MAX) {
+        periodicity = LORA_CLASS_B_PERIODICITY_MAX;
+    }
+    cb->periodicity = periodicity;
+    if (cb->time_known) {
+        lora_class_b_new_period(cb);
+    }
+}
+
+void lora_class_b_set_time(lora_class_b_t *cb, uint32_t gps_s, uint32_t now, uint32_t error) {
+    // a beacon tells it better
+    if (cb->state == E_LORA_CLASS_B_LOCKED) {
+        return;
+    }
+    uint32_t into = gps_s % LORA_CLASS_B_PERIOD_S;
+    cb->beacon_time = gps_s - into;
+    cb->beacon_at = now - into * 1000;
+    cb->synced_at = now;
+    cb->sync_error = error;
+    cb->time_known = true;
+    lora_class_b_new_period(cb);
+}
+
+bool lora_class_b_beacon_rx(lora_class_b_t *cb, const uint8_t *buf, uint32_t len, uint32_t start_at) {
+    lora_class_b_beacon_t beacon;
+
+    if (cb->state == E_LORA_CLASS_B_OFF || !lora_class_b_parse(cb->region, buf, len, &beacon)) {
+        return false;
+    }
+    memcpy(&cb->beacon, &beacon, sizeof(beacon));
+    cb->beacon_time = beacon.time;
+    cb->beacon_at = start_at;
+    cb->synced_at = start_at;
+    cb->sync_error = 0;
+    cb->time_known = true;
+    cb->missed = 0;
+    cb->state = E_LORA_CLASS_B_LOCKED;
+    cb->stats.beacons++;
+    lora_class_b_new_period(cb);
+    return true;
+}
+
+bool lora_class_b_beacon_missed(lora_class_b_t *cb) {
+    if (cb->state == E_LORA_CLASS_B_OFF) {
+        return false;
+    }
+    cb->missed++;
+    cb->stats.missed++;
+    if (cb->time_known) {
+        // it came on time, the slots of its period are where they'd be
+        cb->beacon_time += LORA_CLASS_B_PERIOD_S;
+        cb->beacon_at += LORA_CLASS_B_BEACON_INTERVAL;
+        lora_class_b_new_period(cb);
+    }
+    if ((cb->state == E_LORA_CLASS_B_LOCKED && cb->missed >= LORA_CLASS_B_MAX_MISSED) ||
+        (cb->state == E_LORA_CLASS_B_ACQUIRE && cb->missed >= LORA_CLASS_B_ACQUIRE_TRIES)) {
+        if (cb->state == E_LORA_CLASS_B_LOCKED) {
+            cb->stats.lost++;
+        }
+        lora_class_b_stop(cb);
+        return false;
+    }
+    return true;
+}
+
+bool lora_class_b_next_beacon(lora_class_b_t *cb, uint32_t *at, uint32_t *error) {
+    if (cb->state == E_LORA_CLASS_B_OFF || !cb->time_known) {
+        return false;
+    }
+    *at = cb->beacon_at + LORA_CLASS_B_BEACON_INTERVAL;
+    *error = lora_class_b_error(cb, *at);
+    return true;
+}
+
+bool lora_class_b_next_ping(lora_class_b_t *cb, uint32_t from, uint32_t *at, uint32_t *error) {
+    if (cb->state != E_LORA_CLASS_B_LOCKED) {
+        return false;
+    }
+    uint32_t period = lora_class_b_ping_period(cb->periodicity);
+    uint32_t first = cb->beacon_at + LORA_CLASS_B_BEACON_RESERVED + cb->ping_offset * LORA_CLASS_B_SLOT_LEN;
+    uint32_t slot = cb->ping_offset;
+    int32_t late = from - first;
+
+    if (late > 0) {
+        uint32_t step = period * LORA_CLASS_B_SLOT_LEN;
+        slot += ((late + step - 1) / step) * period;
+    }
+    if (slot >= LORA_CLASS_B_SLOTS) {
+        return false;
+    }
+    *at = cb->beacon_at + LORA_CLASS_B_BEACON_RESERVED + slot * LORA_CLASS_B_SLOT_LEN;
+    *error = lora_class_b_error(cb, *at);
+    return true;
+}
+
+uint32_t lora_class_b_error(const lora_class_b_t *cb, uint32_t at) {
+    int32_t elapsed = at - cb->synced_at;
+    if (elapsed < 0) {
+        elapsed = -elapsed;
+    }
+    return cb->sync_error + (uint32_t)(((uint64_t)elapsed * LORA_CLASS_B_DRIFT_PPM + 999999) / 1000000);
+}
+
+uint32_t lora_class_b_beacon_freq(const lora_class_b_t *cb, uint32_t beacon_time) {
+    const lora_class_b_region_t *r = cb->region;
+    if (cb->beacon_freq) {
+        return cb->beacon_freq;
+    }
+    if (r->hop_step) {
+        return r->frequency + r->hop_step * ((beacon_time / LORA_CLASS_B_PERIOD_S) % r->hops);
+    }
+    return r->frequency;
+}
+
+uint32_t lora_class_b_ping_freq(const lora_class_b_t *cb, uint32_t beacon_time) {
+    const lora_class_b_region_t *r = cb->region;
+    if (cb->ping_freq) {
+        return cb->ping_freq;
+    }
+    if (r->hop_step) {
+        uint64_t channel = (uint64_t)(beacon_time / LORA_CLASS_B_PERIOD_S) + cb->dev_addr;
+        return r->frequency + r->hop_step * (uint32_t)(channel % r->hops);
+    }
+    return r->frequency;
+}
+
+uint8_t lora_class_b_ping_dr(const lora_class_b_t *cb) {
+    return (cb->ping_dr >= 0) ? cb->ping_dr : cb->region->ping_dr;
+}
+
+uint32_t lora_class_b_ping_period(uint8_t periodicity) {
+    // 2^12 slots over 2^(7 - periodicity) pings
+    return 1 << (5 + periodicity);
+}
+
+uint32_t lora_class_b_ping_offset(uint32_t beacon_time, uint32_t dev_addr, uint32_t ping_period) {
+    static const uint8_t zero_key[LORA_AES_KEY_SIZE] = { 0 };
+    uint8_t block[LORA_AES_BLOCK_SIZE] = { 0 };
+    lora_aes_key_t k;
+
+    for (uint32_t i = 0; i < 4; i++) {
+        block[i] = beacon_time >> (8 * i);
+        block[4 + i] = dev_addr >> (8 * i);
+    }
+    lora_aes_key(zero_key, &k);
+    lora_aes_encrypt(&k, block, block);
+    return (block[0] + block[1] * 256) % ping_period;
+}
+
+uint16_t lora_class_b_crc(const uint8_t *buf, uint32_t len) {
+    uint16_t crc = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)buf[i] << 8;
+        for (uint32_t j = 0; j < 8; j++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+bool lora_class_b_parse(const lora_class_b_region_t *region, const uint8_t *buf, uint32_t len, lora_class_b_beacon_t *beacon) {
+    if (len != region->size) {
+        return false;
+    }
+    uint32_t crc1_at = region->rfu1 + 4;
+    uint32_t gw_at = crc1_at + 2;
+    uint32_t crc2_at = len - 2;
+
+    if (lora_class_b_crc(buf, crc1_at) != (buf[crc1_at] | (buf[crc1_at + 1] << 8))) {
+        return false;
+    }
+    beacon->time = lora_class_b_get32(&buf[region->rfu1]);
+    // beacons start the periods of the GPS time
+    if (beacon->time % LORA_CLASS_B_PERIOD_S) {
+        return false;
+    }
+
+    // the gateway's part has its own CRC, it may be wrong on its own
+    if (lora_class_b_crc(&buf[gw_at], crc2_at - gw_at) == (buf[crc2_at] | (buf[crc2_at + 1] << 8))) {
+        beacon->info_desc = buf[gw_at];
+        beacon->lat = lora_class_b_get24(&buf[gw_at + 1]);
+        beacon->lng = lora_class_b_get24(&buf[gw_at + 4]);
+    } else {
+        beacon->info_desc = 0xFF;
+        beacon->lat = 0;
+        beacon->lng = 0;
+    }
+    return true;
+}
+
+/******************************************************************************
+ DEFINE PRIVATE FUNCTIONS
+ ******************************************************************************/
+static uint32_t lora_class_b_get32(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static int32_t lora_class_b_get24(const uint8_t *buf) {
+    int32_t v = buf[0] | (buf[1] << 8) | (buf[2] << 16);
+    // sign extended
+    return (v & 0x800000) ? (v - 0x1000000) : v;
+}
+
+static void lora_class_b_new_period(lora_class_b_t *cb) {
+    cb->ping_offset = lora_class_b_ping_offset(cb->beacon_time, cb->dev_addr, lora_class_b_ping_period(cb->periodicity));
+}
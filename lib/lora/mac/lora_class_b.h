@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_CLASS_B_H_
+#define LORA_CLASS_B_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The timing of LoRaWAN Class B (1.0.3, chapters 8 to 13), without the
+// radio: where the beacons and the ping slots fall on the local clock.
+//
+// The gateways send a beacon at the start of every 128 s period of the GPS
+// time.  Once one is received, the clock is known to the radio's precision,
+// and the uncertainty grows from there with the drift of the local clock,
+// which widens the windows.  A missed beacon is assumed to have come on time
+// and the ping slots go on, until two hours passed without one.
+//
+// The ping slots of a period start after the beacon reserved time, at an
+// offset drawn from the beacon time and the DevAddr with AES, then every
+// ping period slots.  Everything is in ms of the local clock, which wraps.
+
+#define LORA_CLASS_B_BEACON_INTERVAL    (128000)
+#define LORA_CLASS_B_BEACON_RESERVED    (2120)
+#define LORA_CLASS_B_BEACON_GUARD       (3000)
+#define LORA_CLASS_B_BEACON_WINDOW      (122880)
+#define LORA_CLASS_B_SLOT_LEN           (30)
+#define LORA_CLASS_B_SLOTS              (4096)
+
+// two hours of beacon-less operation
+#define LORA_CLASS_B_MAX_MISSED         (56)
+
+// how far the local clock may drift, in millionths
+#define LORA_CLASS_B_DRIFT_PPM          (100)
+
+#define LORA_CLASS_B_PERIODICITY_MAX    (7)
+
+// the beacon of a region
+typedef struct _lora_class_b_region_t {
+    uint8_t size;                       // of the frame
+    uint8_t rfu1;                       // bytes before the time
+    uint8_t rfu2;                       // bytes between the gateway info and the second CRC
+    uint8_t dr;
+    uint8_t sf;
+    uint8_t bw;                         // as the radio takes it, 0 for 125 kHz, 2 for 500 kHz
+    uint32_t frequency;                 // Hz, the first channel if it hops
+    uint32_t hop_step;                  // Hz, 0 if it doesn't hop
+    uint8_t hops;
+    uint8_t ping_dr;
+} lora_class_b_region_t;
+
+extern const lora_class_b_region_t lora_class_b_eu868;
+extern const lora_class_b_region_t lora_class_b_eu433;
+extern const lora_class_b_region_t lora_class_b_as923;
+extern const lora_class_b_region_t lora_class_b_us915;
+extern const lora_class_b_region_t lora_class_b_au915;
+
+typedef enum {
+    E_LORA_CLASS_B_OFF = 0,
+    E_LORA_CLASS_B_ACQUIRE,             // looking for a beacon
+    E_LORA_CLASS_B_LOCKED,
+} lora_class_b_state_t;
+
+typedef struct _lora_class_b_beacon_t {
+    uint32_t time;                      // GPS s
+    uint8_t info_desc;
+    int32_t lat;                        // 90 / 2^23 degrees
+    int32_t lng;                        // 180 / 2^23 degrees
+} lora_class_b_beacon_t;
+
+typedef struct _lora_class_b_stats_t {
+    uint32_t beacons;
+    uint32_t missed;
+    uint32_t lost;
+} lora_class_b_stats_t;
+
+typedef struct _lora_class_b_t {
+    const lora_class_b_region_t *region;
+    lora_class_b_state_t state;
+    uint32_t dev_addr;
+    uint8_t periodicity;                // a ping slot every 2^periodicity s
+    bool time_known;                    // beacon_time and beacon_at hold
+    uint32_t beacon_time;               // GPS s, of the current period
+    uint32_t beacon_at;                 // when it started
+    uint32_t synced_at;                 // when the clock was last set
+    uint32_t sync_error;                // ms it may be off by then
+    uint32_t ping_offset;               // slots, in the current period
+    uint32_t missed;                    // in a row
+    uint32_t beacon_freq;               // set by the network, 0 for the region's
+    uint32_t ping_freq;
+    int8_t ping_dr;                     // -1 for the region's
+    lora_class_b_beacon_t beacon;       // the last one received
+    lora_class_b_stats_t stats;
+} lora_class_b_t;
+
+void lora_class_b_init(lora_class_b_t *cb, const lora_class_b_region_t *region);
+
+// Starts looking for the beacon.
+void lora_class_b_start(lora_class_b_t *cb, uint32_t dev_addr, uint8_t periodicity);
+
+void lora_class_b_stop(lora_class_b_t *cb);
+
+void lora_class_b_set_periodicity(lora_class_b_t *cb, uint8_t periodicity);
+
+// The GPS time was gps_s at now, to error ms; the search for the beacon
+// needs a window that wide instead of a whole period.
+void lora_class_b_set_time(lora_class_b_t *cb, uint32_t gps_s, uint32_t now, uint32_t error);
+
+// A frame was received in a beacon window, its preamble started at
+// start_at.  Returns false if it isn't a beacon.
+bool lora_class_b_beacon_rx(lora_class_b_t *cb, const uint8_t *buf, uint32_t len, uint32_t start_at);
+
+// The beacon of the next period wasn't received.  Returns false once it's
+// been missing for too long, the state is back to off.
+bool lora_class_b_beacon_missed(lora_class_b_t *cb);
+
+// When the next beacon starts and how far off that may be.  False if the
+// time isn't known, the beacon is searched for with a whole period.
+bool lora_class_b_next_beacon(lora_class_b_t *cb, uint32_t *at, uint32_t *error);
+
+// The first ping slot of the current period that starts at or after from,
+// false if there's none left before the next beacon.
+bool lora_class_b_next_ping(lora_class_b_t *cb, uint32_t from, uint32_t *at, uint32_t *error);
+
+// ms the clock may be off by at time at
+uint32_t lora_class_b_error(const lora_class_b_t *cb, uint32_t at);
+
+uint32_t lora_class_b_beacon_freq(const lora_class_b_t *cb, uint32_t beacon_time);
+uint32_t lora_class_b_ping_freq(const lora_class_b_t *cb, uint32_t beacon_time);
+uint8_t lora_class_b_ping_dr(const lora_class_b_t *cb);
+
+// slots between two ping slots
+uint32_t lora_class_b_ping_period(uint8_t periodicity);
+
+uint32_t lora_class_b_ping_offset(uint32_t beacon_time, uint32_t dev_addr, uint32_t ping_period);
+
+// CRC-16/CCITT of the beacon fields
+uint16_t lora_class_b_crc(const uint8_t *buf, uint32_t len);
+
+bool lora_class_b_parse(const lora_class_b_region_t *region, const uint8_t *buf, uint32_t len, lora_class_b_beacon_t *beacon);
+
+#endif /* LORA_CLASS_B_H_ */
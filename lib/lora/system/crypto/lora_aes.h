@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020, Pycom Limited.
+ *
+ * This software is licensed under the GNU GPL version 3 or any
+ * later version, with permitted additional terms. For more information
+ * see the Pycom Licence v1.0 document supplied with this file, or
+ * available at https://www.pycom.io/opensource/licensing
+ */
+
+#ifndef LORA_AES_H_
+#define LORA_AES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// AES-128 encryption and CMAC for the LoRaWAN MAC.  The software backend is
+// table driven, one 32 bit table rotated for the four columns, and a backend
+// such as the ESP32 hardware AES can take its place.  The keys of a session
+// are only a few and used for every frame, so their schedules and CMAC
+// subkeys are kept in a small cache, looked up by the key.
+//
+// OnRadioRxDone checks MICs and decrypts from the radio interrupt while the
+// LoRa task computes those of its uplinks, so the cache is only touched in
+// a critical section and callers get their own copy of the schedule.  In an
+// interrupt the software backend is used whatever was set, a hardware one
+// may take a lock or live in flash.  The buffers may not be aligned.
+
+#define LORA_AES_BLOCK_SIZE             (16)
+#define LORA_AES_KEY_SIZE               (16)
+#define LORA_AES_ROUND_KEYS             (44)
+
+// NwkSKey, AppSKey and AppKey, and those of a multicast group
+#define LORA_AES_KEY_CACHE_SIZE         (6)
+
+typedef struct _lora_aes_key_t {
+    uint8_t key[LORA_AES_KEY_SIZE];
+    uint32_t rk[LORA_AES_ROUND_KEYS];   // the schedule of the software backend, always set
+    uint8_t k1[LORA_AES_BLOCK_SIZE];    // CMAC subkeys
+    uint8_t k2[LORA_AES_BLOCK_SIZE];
+    uint32_t used;
+    bool valid;
+} lora_aes_key_t;
+
+typedef struct _lora_aes_backend_t {
+    // prepares what encrypt needs from k->key, may be NULL
+    void (*set_key)(lora_aes_key_t *k);
+    // in and out may be the same block
+    void (*encrypt)(const lora_aes_key_t *k, const uint8_t *in, uint8_t *out);
+} lora_aes_backend_t;
+
+typedef struct _lora_aes_stats_t {
+    uint32_t hits;
+    uint32_t misses;
+} lora_aes_stats_t;
+
+extern const lora_aes_backend_t lora_aes_soft;
+
+// Switches the backend, and empties the cache.
+void lora_aes_set_backend(const lora_aes_backend_t *backend);
+
+// Copies the cached schedule of key to k, and computes it on a miss.
+void lora_aes_key(const uint8_t *key, lora_aes_key_t *k);
+
+// Forgets the keys.
+void lora_aes_flush(void);
+
+void lora_aes_encrypt(const lora_aes_key_t *k, const uint8_t *in, uint8_t *out);
+
+// The CMAC of an optional first block b0, then len bytes of data.
+void lora_aes_cmac(const lora_aes_key_t *k, const uint8_t *b0, const uint8_t *data, uint32_t len, uint8_t *mac);
+
+const lora_aes_stats_t *lora_aes_get_stats(void);
+
+#endif /* LORA_AES_H_ */
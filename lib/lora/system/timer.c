@@ -15,53 +15,27 @@ Maintainer: Miguel Luis and Gregory Cristian
 #include "board.h"
 #include "timer-board.h"
 #include "modlora.h"
+#include "lora_timer_heap.h"
 
 /*!
  * This flag is used to make sure we have looped through the main several time to avoid race issues
  */
 volatile uint8_t HasLoopedThroughMain = 0;
 
-/*!
- * Timers list head pointer
- */
-static TimerEvent_t *TimerListHead = NULL;
+static uint32_t TimerHeapNow( void );
+static void TimerHeapHwStart( uint32_t delay );
+static void TimerHeapExpired( TimerEvent_t *obj );
 
-/*!
- * \brief Adds or replace the head timer of the list.
- *
- * \remark The list is automatically sorted. The list head always contains the
- *         next timer to expire.
- *
- * \param [IN]  obj Timer object to be become the new head
- * \param [IN]  remainingTime Remaining time of the previous head to be replaced
- */
-static void TimerInsertNewHeadTimer( TimerEvent_t *obj, uint32_t remainingTime );
+static const lora_timer_heap_ops_t TimerHeapOps = {
+    .now = TimerHeapNow,
+    .hw_start = TimerHeapHwStart,
+    .expired = TimerHeapExpired,
+};
 
 /*!
- * \brief Adds a timer to the list.
- *
- * \remark The list is automatically sorted. The list head always contains the
- *         next timer to expire.
- *
- * \param [IN]  obj Timer object to be added to the list
- * \param [IN]  remainingTime Remaining time of the running head after which the object may be added
+ * Running timers, in a heap ordered by expiry time
  */
-static void TimerInsertTimer( TimerEvent_t *obj, uint32_t remainingTime );
-
-/*!
- * \brief Sets a timeout with the duration "timestamp"
- *
- * \param [IN] timestamp Delay duration
- */
-static void TimerSetTimeout( TimerEvent_t *obj );
-
-/*!
- * \brief Check if the Object to be added is not already in the list
- *
- * \param [IN] timestamp Delay duration
- * \retval true (the object is already in the list) or false
- */
-static bool TimerExists( TimerEvent_t *obj );
+static lora_timer_heap_t TimerHeap = { .ops = &TimerHeapOps };
 
 /*!
  * \brief Read the timer value of the currently running timer
@@ -73,279 +47,48 @@ TimerTime_t TimerGetValue( void );
 
 void TimerInit( TimerEvent_t *obj, void ( *callback )( void ) )
 {
+    // the MAC initializes its timers again when it's initialized again
+    TimerStop( obj );
+
     obj->Timestamp = 0;
     obj->ReloadValue = 0;
     obj->IsRunning = false;
     obj->Callback = callback;
-    obj->Next = NULL;
+    obj->Seq = 0;
+    obj->HeapIndex = 0;
 }
 
 IRAM_ATTR void TimerStart( TimerEvent_t *obj )
 {
-    uint32_t elapsedTime = 0;
-    uint32_t remainingTime = 0;
-
-    uint32_t ilevel = MICROPY_BEGIN_ATOMIC_SECTION();
-
-    if( ( obj == NULL ) || ( TimerExists( obj ) == true ) )
+    if( obj == NULL )
     {
-        MICROPY_END_ATOMIC_SECTION(ilevel);
         return;
     }
 
-    obj->Timestamp = obj->ReloadValue;
-    obj->IsRunning = false;
-
-    if( TimerListHead == NULL )
-    {
-        TimerInsertNewHeadTimer( obj, obj->Timestamp );
-    }
-    else
-    {
-        if( TimerListHead->IsRunning == true )
-        {
-            elapsedTime = TimerGetValue( );
-            if( elapsedTime > TimerListHead->Timestamp )
-            {
-                elapsedTime = TimerListHead->Timestamp; // security but should never occur
-            }
-            remainingTime = TimerListHead->Timestamp - elapsedTime;
-        }
-        else
-        {
-            remainingTime = TimerListHead->Timestamp;
-        }
-
-        if( obj->Timestamp < remainingTime )
-        {
-            TimerInsertNewHeadTimer( obj, remainingTime );
-        }
-        else
-        {
-             TimerInsertTimer( obj, remainingTime );
-        }
-    }
+    uint32_t ilevel = MICROPY_BEGIN_ATOMIC_SECTION();
+    lora_timer_heap_start( &TimerHeap, obj );
     MICROPY_END_ATOMIC_SECTION(ilevel);
 }
 
-static IRAM_ATTR void TimerInsertTimer( TimerEvent_t *obj, uint32_t remainingTime )
-{
-    uint32_t aggregatedTimestamp = 0;      // hold the sum of timestamps
-    uint32_t aggregatedTimestampNext = 0;  // hold the sum of timestamps up to the next event
-
-    TimerEvent_t* prev = TimerListHead;
-    TimerEvent_t* cur = TimerListHead->Next;
-
-    if( cur == NULL )
-    { // obj comes just after the head
-        obj->Timestamp -= remainingTime;
-        prev->Next = obj;
-        obj->Next = NULL;
-    }
-    else
-    {
-        aggregatedTimestamp = remainingTime;
-        aggregatedTimestampNext = remainingTime + cur->Timestamp;
-
-        while( prev != NULL )
-        {
-            if( aggregatedTimestampNext > obj->Timestamp )
-            {
-                obj->Timestamp -= aggregatedTimestamp;
-                if( cur != NULL )
-                {
-                    cur->Timestamp -= obj->Timestamp;
-                }
-                prev->Next = obj;
-                obj->Next = cur;
-                break;
-            }
-            else
-            {
-                prev = cur;
-                cur = cur->Next;
-                if( cur == NULL )
-                { // obj comes at the end of the list
-                    aggregatedTimestamp = aggregatedTimestampNext;
-                    obj->Timestamp -= aggregatedTimestamp;
-                    prev->Next = obj;
-                    obj->Next = NULL;
-                    break;
-                }
-                else
-                {
-                    aggregatedTimestamp = aggregatedTimestampNext;
-                    aggregatedTimestampNext = aggregatedTimestampNext + cur->Timestamp;
-                }
-            }
-        }
-    }
-}
-
-static IRAM_ATTR void TimerInsertNewHeadTimer( TimerEvent_t *obj, uint32_t remainingTime )
-{
-    TimerEvent_t* cur = TimerListHead;
-
-    if( cur != NULL )
-    {
-        cur->Timestamp = remainingTime - obj->Timestamp;
-        cur->IsRunning = false;
-    }
-
-    obj->Next = cur;
-    obj->IsRunning = true;
-    TimerListHead = obj;
-    TimerSetTimeout( TimerListHead );
-}
-
 IRAM_ATTR void TimerIrqHandler( void )
 {
-    uint32_t elapsedTime = 0;
-
-    // when all timers are stopped or expired, TimerListHead is NULL
-    if( TimerListHead == NULL )
-    {
-        return;
-    }
-
-    elapsedTime = TimerGetValue( );
-
-    if( elapsedTime >= TimerListHead->Timestamp )
-    {
-        TimerListHead->Timestamp = 0;
-    }
-    else
-    {
-        TimerListHead->Timestamp -= elapsedTime;
-    }
-
-    TimerListHead->IsRunning = false;
-
-    while( ( TimerListHead != NULL ) && ( TimerListHead->Timestamp == 0 ) )
-    {
-        TimerEvent_t* elapsedTimer = TimerListHead;
-        TimerListHead = TimerListHead->Next;
-
-        if( elapsedTimer->Callback != NULL )
-        {
-            // Callback will be processed out of the Interrupt context in a Thread
-            modlora_set_timer_callback(elapsedTimer->Callback);
-        }
-    }
-
-    // start the next TimerListHead if it exists
-    if( TimerListHead != NULL )
-    {
-        if( TimerListHead->IsRunning != true )
-        {
-            TimerListHead->IsRunning = true;
-            TimerSetTimeout( TimerListHead );
-        }
-    }
+    // every timer that's due expires here, their callbacks are processed
+    // out of the Interrupt context in a Thread
+    lora_timer_heap_expire( &TimerHeap );
 }
 
 IRAM_ATTR void TimerStop( TimerEvent_t *obj )
 {
-    uint32_t ilevel = MICROPY_BEGIN_ATOMIC_SECTION();
-
-    uint32_t elapsedTime = 0;
-    uint32_t remainingTime = 0;
-
-    TimerEvent_t* prev = TimerListHead;
-    TimerEvent_t* cur = TimerListHead;
-
-    // List is empty or the Obj to stop does not exist
-    if( ( TimerListHead == NULL ) || ( obj == NULL ) )
+    if( obj == NULL )
     {
-        MICROPY_END_ATOMIC_SECTION(ilevel);
         return;
     }
 
-    if( TimerListHead == obj ) // Stop the Head
-    {
-        if( TimerListHead->IsRunning == true ) // The head is already running
-        {
-            elapsedTime = TimerGetValue( );
-            if( elapsedTime > obj->Timestamp )
-            {
-                elapsedTime = obj->Timestamp;
-            }
-
-            remainingTime = obj->Timestamp - elapsedTime;
-
-            if( TimerListHead->Next != NULL )
-            {
-                TimerListHead->IsRunning = false;
-                TimerListHead = TimerListHead->Next;
-                TimerListHead->Timestamp += remainingTime;
-                TimerListHead->IsRunning = true;
-                TimerSetTimeout( TimerListHead );
-            }
-            else
-            {
-                TimerListHead = NULL;
-            }
-        }
-        else // Stop the head before it is started
-        {
-            if( TimerListHead->Next != NULL )
-            {
-                remainingTime = obj->Timestamp;
-                TimerListHead = TimerListHead->Next;
-                TimerListHead->Timestamp += remainingTime;
-            }
-            else
-            {
-                TimerListHead = NULL;
-            }
-        }
-    }
-    else // Stop an object within the list
-    {
-        remainingTime = obj->Timestamp;
-
-        while( cur != NULL )
-        {
-            if( cur == obj )
-            {
-                if( cur->Next != NULL )
-                {
-                    cur = cur->Next;
-                    prev->Next = cur;
-                    cur->Timestamp += remainingTime;
-                }
-                else
-                {
-                    cur = NULL;
-                    prev->Next = cur;
-                }
-                break;
-            }
-            else
-            {
-                prev = cur;
-                cur = cur->Next;
-            }
-        }
-    }
+    uint32_t ilevel = MICROPY_BEGIN_ATOMIC_SECTION();
+    lora_timer_heap_stop( &TimerHeap, obj );
     MICROPY_END_ATOMIC_SECTION(ilevel);
 }
 
-static IRAM_ATTR bool TimerExists( TimerEvent_t *obj )
-{
-    TimerEvent_t* cur = TimerListHead;
-
-    while( cur != NULL )
-    {
-        if( cur == obj )
-        {
-            return true;
-        }
-        cur = cur->Next;
-    }
-    return false;
-}
-
 void TimerReset( TimerEvent_t *obj )
 {
     TimerStop( obj );
@@ -355,7 +98,6 @@ void TimerReset( TimerEvent_t *obj )
 void IRAM_ATTR TimerSetValue( TimerEvent_t *obj, uint32_t value )
 {
     TimerStop( obj );
-    obj->Timestamp = value;
     obj->ReloadValue = value;
 }
 
@@ -369,10 +111,23 @@ IRAM_ATTR TimerTime_t TimerGetCurrentTime( void )
     return TimerHwGetTime( );
 }
 
-static IRAM_ATTR void TimerSetTimeout( TimerEvent_t *obj )
+static IRAM_ATTR uint32_t TimerHeapNow( void )
+{
+    return TimerHwGetTime( );
+}
+
+static IRAM_ATTR void TimerHeapHwStart( uint32_t delay )
 {
     HasLoopedThroughMain = 0;
-    TimerHwStart( obj->Timestamp );
+    TimerHwStart( delay );
+}
+
+static IRAM_ATTR void TimerHeapExpired( TimerEvent_t *obj )
+{
+    if( obj->Callback != NULL )
+    {
+        modlora_set_timer_callback( obj->Callback );
+    }
 }
 
 IRAM_ATTR TimerTime_t TimerGetElapsedTime( TimerTime_t savedTime )
@@ -382,7 +137,7 @@ IRAM_ATTR TimerTime_t TimerGetElapsedTime( TimerTime_t savedTime )
 
 void TimerLowPowerHandler( void )
 {
-    if( ( TimerListHead != NULL ) && ( TimerListHead->IsRunning == true ) )
+    if( TimerHeap.count > 0 )
     {
         if( HasLoopedThroughMain < 5 )
         {
@@ -20,11 +20,12 @@ Maintainer: Miguel Luis and Gregory Cristian
  */
 typedef struct TimerEvent_s
 {
-    uint32_t Timestamp;         //! Current timer value
+    uint32_t Timestamp;         //! Time the timer expires at, while running
     uint32_t ReloadValue;       //! Timer delay value
     bool IsRunning;             //! Is the timer currently running
     void ( *Callback )( void ); //! Timer IRQ callback function
-    struct TimerEvent_s *Next;  //! Pointer to the next Timer object.
+    uint32_t Seq;               //! Order of the start, among timers expiring together
+    uint16_t HeapIndex;         //! Place in the heap of running timers
 }TimerEvent_t;
 
 /*!
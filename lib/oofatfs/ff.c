@@ -2375,6 +2375,455 @@ static FRESULT dir_read (
 
 
 
+#if FF_USE_DIRCACHE
+/*-----------------------------------------------------------------------*/
+/* Directory cache                                                       */
+/*-----------------------------------------------------------------------*/
+/* The cache holds the large directories of the volume that were searched
+/  last, up to FF_DIRCACHE_DIRS of them, their items one directory after the
+/  other in the buffer: an item for each object, the 16-bit hash of its name
+/  in the upper half and the index of its first entry (LFN or SFN) in the
+/  lower, sorted. The least recently searched directory is dropped to make
+/  room for another. Names are hashed in upper case, the LFN if the object
+/  has one, else the SFN as it reads ("NAME.EXT"). A name with no item is
+/  not in the directory, but for the SFN of an object that has an LFN, which
+/  isn't hashed, and for names with non-ASCII characters, whose SFN can be
+/  converted differently: for names with '~' or non-ASCII characters the
+/  directory is scanned as before. */
+
+#if !FF_USE_LFN
+#error Wrong configuration: FF_USE_DIRCACHE needs FF_USE_LFN
+#endif
+
+#define DC_EMPTY    0
+#define DC_VALID    1
+#define DC_LARGE    2   /* Too many objects for the cache */
+
+static DWORD dc_term (  /* Hash of a character at a position, LFN parts can be added in any order */
+    UINT pos,
+    DWORD wc
+)
+{
+    DWORD x = (((DWORD)pos << 16) ^ wc) * 0x9E3779B1;
+    return x ^ (x >> 15);
+}
+
+
+static WORD dc_fold (
+    DWORD h,            /* Sum of the terms of the name */
+    UINT len            /* Length of the name */
+)
+{
+    h += dc_term(0xFFFF, len);
+    h *= 0x85EBCA77;
+    return (WORD)(h ^ (h >> 16));
+}
+
+
+static WORD dc_hash_lfn (   /* Hash of a name in the LFN working buffer */
+    const WCHAR* lfn,
+    int* sure           /* Cleared if a miss doesn't prove the name is missing */
+)
+{
+    DWORD h = 0;
+    WCHAR wc;
+    UINT i;
+
+    for (i = 0; lfn[i]; i++) {
+        wc = ff_wtoupper(lfn[i]);
+        if (wc == '~' || wc >= 0x80) *sure = 0;
+        h += dc_term(i, wc);
+    }
+    return dc_fold(h, i);
+}
+
+
+static WORD dc_hash_sfn (   /* Hash of an SFN as it reads, with the dot and without padding */
+    const BYTE* sfn,
+    int* sure
+)
+{
+    DWORD h = 0;
+    WCHAR wc;
+    UINT si, n = 0;
+
+    for (si = 0; si < 11; si++) {
+        wc = sfn[si];
+        if (wc == ' ') continue;
+        if (wc == RDDEM) wc = DDEM;
+        if (si == 8) h += dc_term(n++, '.');
+        if (wc == '~' || wc >= 0x80) *sure = 0;
+        if (wc >= 0x80) wc = ff_oem2uni(wc, CODEPAGE);
+        h += dc_term(n++, ff_wtoupper(wc));
+    }
+    return dc_fold(h, n);
+}
+
+
+static int dc_hash_part (   /* 1:valid LFN entry, 0:invalid (as pick_lfn) */
+    const BYTE* dir,    /* LFN entry */
+    DWORD* h,           /* Sum of the terms of the name */
+    UINT* len           /* Length of the name, set from the last part */
+)
+{
+    UINT i, s;
+    WCHAR wc, uc;
+
+
+    if (ld_word(dir + LDIR_FstClusLO) != 0) return 0;
+
+    i = ((dir[LDIR_Ord] & ~LLEF) - 1) * 13;
+
+    for (wc = 1, s = 0; s < 13; s++) {
+        uc = ld_word(dir + LfnOfs[s]);
+        if (wc != 0) {
+            if (i >= FF_MAX_LFN + 1) return 0;
+            if (uc != 0) *h += dc_term(i, ff_wtoupper(uc));
+            wc = uc; i++;
+        } else {
+            if (uc != 0xFFFF) return 0;
+        }
+    }
+    if (dir[LDIR_Ord] & LLEF) *len = wc ? i : i - 1;
+
+    return 1;
+}
+
+
+static void dc_reset (  /* Empty the cache */
+    FATFS* fs
+)
+{
+    UINT i;
+
+    fs->dc_cnt = 0;
+    for (i = 0; i < FF_DIRCACHE_DIRS; i++) fs->dc_dir[i].stat = DC_EMPTY;
+}
+
+
+static DCDIR* dc_dir (  /* Slot of the directory, NULL:not cached */
+    FATFS* fs,
+    DWORD clst          /* Start cluster of the directory */
+)
+{
+    UINT i;
+
+    for (i = 0; i < FF_DIRCACHE_DIRS; i++) {
+        if (fs->dc_dir[i].stat != DC_EMPTY && fs->dc_dir[i].clust == clst) return &fs->dc_dir[i];
+    }
+    return 0;
+}
+
+
+static void dc_move (   /* Move the items from pos to the end by n, the directories after d follow */
+    FATFS* fs,
+    DCDIR* d,           /* Directory the items are added to or taken from */
+    UINT pos,
+    int n
+)
+{
+    DCDIR *e;
+    UINT i;
+
+    if (n > 0) {
+        for (i = fs->dc_cnt; i > pos; i--) fs->dc_item[i - 1 + n] = fs->dc_item[i - 1];
+    } else {
+        for (i = pos; i < fs->dc_cnt; i++) fs->dc_item[i + n] = fs->dc_item[i];
+    }
+    fs->dc_cnt += n;
+    for (i = 0; i < FF_DIRCACHE_DIRS; i++) {    /* An empty directory comes before the others at its index */
+        e = &fs->dc_dir[i];
+        if (e != d && e->stat == DC_VALID && (e->ofs > d->ofs || (e->ofs == d->ofs && d->cnt == 0 && e->cnt > 0))) e->ofs += n;
+    }
+}
+
+
+static void dc_drop (   /* Take the directory out of the cache */
+    FATFS* fs,
+    DCDIR* d
+)
+{
+    if (d->stat == DC_VALID) dc_move(fs, d, d->ofs + d->cnt, -(int)d->cnt);
+    d->stat = DC_EMPTY;
+}
+
+
+static int dc_evict (   /* Drop the least recently searched directory with items but d, 0:none */
+    FATFS* fs,
+    DCDIR* d
+)
+{
+    DCDIR *lru = 0;
+    UINT i;
+
+    for (i = 0; i < FF_DIRCACHE_DIRS; i++) {
+        if (&fs->dc_dir[i] != d && fs->dc_dir[i].stat == DC_VALID && fs->dc_dir[i].cnt > 0
+            && (!lru || fs->dc_dir[i].used < lru->used)) lru = &fs->dc_dir[i];
+    }
+    if (!lru) return 0;
+    dc_drop(fs, lru);
+    return 1;
+}
+
+
+static DCDIR* dc_slot ( /* A free slot, the least recently searched directory dropped if none */
+    FATFS* fs
+)
+{
+    DCDIR *d = &fs->dc_dir[0];
+    UINT i;
+
+    for (i = 0; i < FF_DIRCACHE_DIRS; i++) {
+        if (fs->dc_dir[i].stat == DC_EMPTY) return &fs->dc_dir[i];
+        if (fs->dc_dir[i].used < d->used) d = &fs->dc_dir[i];
+    }
+    dc_drop(fs, d);
+    return d;
+}
+
+
+static void dc_large (  /* The directory doesn't fit, leave it to be scanned */
+    FATFS* fs,
+    DCDIR* d
+)
+{
+    dc_move(fs, d, d->ofs + d->cnt, -(int)d->cnt);
+    d->cnt = 0;
+    d->stat = DC_LARGE;
+}
+
+
+static FRESULT dc_build ( /* Scan the whole directory into the cache, after the other directories */
+    DIR* dp,
+    DCDIR* d            /* Free slot */
+)
+{
+    FRESULT res;
+    FATFS *fs = dp->obj.fs;
+    BYTE c, a, ord = 0xFF, sum = 0xFF;
+    DWORD h = 0, *item;
+    UINT i, j, gap, n, len = 0, top = 0;
+    int sure;
+    WORD key;
+
+
+    d->clust = dp->obj.sclust;
+    d->ofs = fs->dc_cnt;
+    d->cnt = 0;
+    d->stat = DC_VALID;
+    res = dir_sdi(dp, 0);
+    while (res == FR_OK) {
+        res = move_window(fs, dp->sect);
+        if (res != FR_OK) break;
+        c = dp->dir[DIR_Name];
+        if (c == 0) break;              /* Reached to end of table */
+        a = dp->dir[DIR_Attr] & AM_MASK;
+        if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {  /* An entry without valid data */
+            ord = 0xFF;
+        } else if (a == AM_LFN) {       /* An LFN entry is found */
+            if (c & LLEF) {             /* Is it start of an LFN sequence? */
+                sum = dp->dir[LDIR_Chksum];
+                c &= (BYTE)~LLEF; ord = c;
+                top = dp->dptr / SZDIRE;
+                h = 0; len = 0;
+            }
+            ord = (c == ord && sum == dp->dir[LDIR_Chksum] && dc_hash_part(dp->dir, &h, &len)) ? ord - 1 : 0xFF;
+        } else {                        /* An SFN entry is found */
+            if (ord == 0 && sum == sum_sfn(dp->dir)) {     /* With a valid LFN */
+                key = dc_fold(h, len);
+            } else {
+                top = dp->dptr / SZDIRE;
+                key = dc_hash_sfn(dp->dir, &sure);
+            }
+            if (fs->dc_cnt == fs->dc_max && !dc_evict(fs, d)) {   /* Doesn't fit with the directory alone */
+                dc_large(fs, d);
+                return FR_OK;
+            }
+            fs->dc_item[fs->dc_cnt++] = (DWORD)key << 16 | top;
+            d->cnt++;
+            ord = 0xFF;
+        }
+        res = dir_next(dp, 0);
+    }
+    if (res == FR_NO_FILE) res = FR_OK;     /* End of the directory */
+    if (res != FR_OK) {
+        dc_drop(fs, d);
+        return res;
+    }
+
+    item = fs->dc_item + d->ofs;
+    n = d->cnt;
+    for (gap = n / 2; gap > 0; gap /= 2) {  /* Shell sort the items */
+        for (i = gap; i < n; i++) {
+            h = item[i];
+            for (j = i; j >= gap && item[j - gap] > h; j -= gap) item[j] = item[j - gap];
+            item[j] = h;
+        }
+    }
+    return FR_OK;
+}
+
+
+static FRESULT dc_check (   /* FR_OK:the name is the object at the entry, FR_NO_FILE:it isn't */
+    DIR* dp,
+    UINT idx            /* Index of the first entry of the object */
+)
+{
+    FRESULT res;
+    FATFS *fs = dp->obj.fs;
+    BYTE c, a, ord = 0xFF, sum = 0xFF;
+
+
+    res = dir_sdi(dp, idx * SZDIRE);
+    dp->blk_ofs = 0xFFFFFFFF;
+    while (res == FR_OK) {          /* As dir_find, from the entry to the SFN */
+        res = move_window(fs, dp->sect);
+        if (res != FR_OK) break;
+        c = dp->dir[DIR_Name];
+        if (c == 0) return FR_NO_FILE;
+        dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;
+        if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) return FR_NO_FILE;
+        if (a == AM_LFN) {
+            if (!(dp->fn[NSFLAG] & NS_NOLFN)) {
+                if (c & LLEF) {
+                    sum = dp->dir[LDIR_Chksum];
+                    c &= (BYTE)~LLEF; ord = c;
+                    dp->blk_ofs = dp->dptr;
+                }
+                ord = (c == ord && sum == dp->dir[LDIR_Chksum] && cmp_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
+            }
+        } else {
+            if (ord == 0 && sum == sum_sfn(dp->dir)) return FR_OK;  /* LFN matched? */
+            if (!(dp->fn[NSFLAG] & NS_LOSS) && !mem_cmp(dp->dir, dp->fn, 11)) return FR_OK;    /* SFN matched? */
+            return FR_NO_FILE;
+        }
+        res = dir_next(dp, 0);
+    }
+    return res;
+}
+
+
+static int dc_find (    /* 1:*res is the result of the search, 0:the directory needs to be scanned */
+    DIR* dp,
+    FRESULT* res
+)
+{
+    FATFS *fs = dp->obj.fs;
+    DCDIR *d;
+    DWORD *item;
+    UINT i, lo, hi, mid;
+    int sure = 1;
+    WORD key;
+
+
+    d = dc_dir(fs, dp->obj.sclust);
+    if (!d) {
+        /* A directory that ends in its first sector is scanned as quickly */
+        *res = dir_sdi(dp, 0);
+        if (*res == FR_OK) *res = move_window(fs, dp->sect);
+        if (*res != FR_OK) return 1;
+        for (i = 0; i < SS(fs); i += SZDIRE) {
+            if (fs->win[i] == 0) return 0;
+        }
+        d = dc_slot(fs);
+        *res = dc_build(dp, d);
+        if (*res != FR_OK) return 1;
+    }
+    d->used = ++fs->dc_tick;
+    if (d->stat != DC_VALID) return 0;
+
+    key = (dp->fn[NSFLAG] & NS_NOLFN) ? dc_hash_sfn(dp->fn, &sure) : dc_hash_lfn(fs->lfnbuf, &sure);
+    item = fs->dc_item + d->ofs;
+    lo = 0; hi = d->cnt;
+    while (lo < hi) {               /* First item of the hash */
+        mid = (lo + hi) / 2;
+        if ((item[mid] >> 16) < key) lo = mid + 1; else hi = mid;
+    }
+    for (; lo < d->cnt && (item[lo] >> 16) == key; lo++) {
+        *res = dc_check(dp, item[lo] & 0xFFFF);
+        if (*res != FR_NO_FILE) return 1;
+    }
+    if (!sure) return 0;
+    *res = FR_NO_FILE;
+    return 1;
+}
+
+
+#if !FF_FS_READONLY
+static void dc_insert (
+    FATFS* fs,
+    DCDIR* d,
+    DWORD item
+)
+{
+    UINT lo = d->ofs, hi = d->ofs + d->cnt, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (fs->dc_item[mid] < item) lo = mid + 1; else hi = mid;
+    }
+    dc_move(fs, d, lo, 1);
+    fs->dc_item[lo] = item;
+    d->cnt++;
+}
+
+
+static void dc_register (   /* An object was registered to the directory */
+    DIR* dp,
+    UINT nlfn           /* Number of its LFN entries */
+)
+{
+    FATFS *fs = dp->obj.fs;
+    DCDIR *d = dc_dir(fs, dp->obj.sclust);
+    int sure;
+    WORD key;
+
+
+    if (!d || d->stat != DC_VALID) return;
+    if (fs->dc_cnt == fs->dc_max && !dc_evict(fs, d)) {
+        dc_large(fs, d);
+        return;
+    }
+    key = nlfn ? dc_hash_lfn(fs->lfnbuf, &sure) : dc_hash_sfn(dp->fn, &sure);
+    dc_insert(fs, d, (DWORD)key << 16 | (dp->dptr / SZDIRE - nlfn));
+}
+
+
+static void dc_remove ( /* The object found by dp is about to be removed from the directory */
+    DIR* dp
+)
+{
+    FATFS *fs = dp->obj.fs;
+    DCDIR *d = dc_dir(fs, dp->obj.sclust);
+    DWORD idx = ((dp->blk_ofs != 0xFFFFFFFF) ? dp->blk_ofs : dp->dptr) / SZDIRE, *item;
+    UINT i, n;
+
+
+    if (!d || d->stat != DC_VALID) return;
+    item = fs->dc_item + d->ofs;
+    for (i = n = 0; i < d->cnt; i++) {
+        if ((item[i] & 0xFFFF) != idx) item[n++] = item[i];
+    }
+    dc_move(fs, d, d->ofs + d->cnt, -(int)(d->cnt - n));
+    d->cnt = n;
+}
+
+
+static void dc_forget ( /* A directory was removed */
+    FATFS* fs,
+    DWORD clst
+)
+{
+    DCDIR *d = dc_dir(fs, clst);
+
+    if (d) dc_drop(fs, d);
+}
+#endif  /* !FF_FS_READONLY */
+
+#endif  /* FF_USE_DIRCACHE */
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
@@ -2413,6 +2862,11 @@ static FRESULT dir_find (   /* FR_OK(0):succeeded, !=0:error */
     }
 #endif
     /* On the FAT/FAT32 volume */
+#if FF_USE_DIRCACHE
+    if (fs->dc_item && dc_find(dp, &res)) return res;   /* Found in the directory cache */
+    res = dir_sdi(dp, 0);
+    if (res != FR_OK) return res;
+#endif
 #if FF_USE_LFN
     ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF; /* Reset LFN sequence */
 #endif
@@ -2551,6 +3005,9 @@ static FRESULT dir_register (   /* FR_OK:succeeded, FR_DENIED:no free entry or t
             dp->dir[DIR_NTres] = dp->fn[NSFLAG] & (NS_BODY | NS_EXT);   /* Put NT flag */
 #endif
             fs->wflag = 1;
+#if FF_USE_DIRCACHE
+            dc_register(dp, (sn[NSFLAG] & NS_LFN) ? (nlen + 12) / 13 : 0);
+#endif
         }
     }
 
@@ -2575,6 +3032,9 @@ static FRESULT dir_remove ( /* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 #if FF_USE_LFN      /* LFN configuration */
     DWORD last = dp->dptr;
 
+#if FF_USE_DIRCACHE
+    dc_remove(dp);
+#endif
     res = (dp->blk_ofs == 0xFFFFFFFF) ? FR_OK : dir_sdi(dp, dp->blk_ofs);   /* Goto top of the entry block if LFN is exist */
     if (res == FR_OK) {
         do {
@@ -3313,6 +3773,9 @@ static FRESULT find_volume (    /* FR_OK(0): successful, !=0: an error occurred
 
     fs->fs_type = fmt;      /* FAT sub-type */
     fs->id = ++Fsid;        /* Volume mount ID */
+#if FF_USE_DIRCACHE
+    dc_reset(fs);           /* Nothing cached of the volume */
+#endif
 #if FF_USE_LFN == 1
     fs->lfnbuf = LfnBuf;    /* Static LFN working buffer */
 #if FF_FS_EXFAT
@@ -4695,6 +5158,9 @@ FRESULT f_unlink (
             }
             if (res == FR_OK) {
                 res = dir_remove(&dj);          /* Remove the directory entry */
+#if FF_USE_DIRCACHE
+                if (res == FR_OK && (dj.obj.attr & AM_DIR)) dc_forget(fs, dclst);
+#endif
                 if (res == FR_OK && dclst != 0) {   /* Remove the cluster chain if exist */
 #if FF_FS_EXFAT
                     res = remove_chain(&obj, dclst, 0);
@@ -5916,6 +6382,27 @@ FRESULT f_fdisk (
 
 
 
+#if FF_USE_DIRCACHE
+/*-----------------------------------------------------------------------*/
+/* Give the Volume a Directory Cache                                     */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_dircache (
+    FATFS* fs,      /* Pointer to the file system object */
+    DWORD* buf,     /* Buffer for the cache (NULL:no cache) */
+    UINT n_item     /* Number of items the buffer holds, one per object of the directory */
+)
+{
+    fs->dc_item = n_item ? buf : 0;
+    fs->dc_max = n_item;
+    fs->dc_tick = 0;
+    dc_reset(fs);
+    return FR_OK;
+}
+#endif  /* FF_USE_DIRCACHE */
+
+
+
 #if FF_CODE_PAGE == 0
 /*-----------------------------------------------------------------------*/
 /* Set Active Codepage for the Path Name                                 */
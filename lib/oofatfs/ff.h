@@ -114,6 +114,20 @@ typedef DWORD FSIZE_t;
 
 
 
+#if FF_USE_DIRCACHE
+/* Directory cache slot, a directory whose items are in the cache */
+
+typedef struct {
+    DWORD   clust;          /* Start cluster of the directory (0:root) */
+    UINT    ofs;            /* Index of its first item in dc_item */
+    UINT    cnt;            /* Number of its items */
+    DWORD   used;           /* Lookup count of its last lookup */
+    BYTE    stat;           /* 0:empty, 1:valid, 2:directory too large */
+} DCDIR;
+#endif
+
+
+
 /* Filesystem object structure (FATFS) */
 
 typedef struct {
@@ -160,6 +174,13 @@ typedef struct {
     DWORD   database;       /* Data base sector */
 #if FF_FS_EXFAT
     DWORD   bitbase;        /* Allocation bitmap base sector */
+#endif
+#if FF_USE_DIRCACHE
+    DWORD*  dc_item;        /* Directory cache: name hash and entry index of the objects, sorted by directory (NULL:not used) */
+    UINT    dc_max;         /* Directory cache: number of items dc_item can hold */
+    UINT    dc_cnt;         /* Directory cache: number of items in use, of all the directories */
+    DWORD   dc_tick;        /* Directory cache: number of lookups, to find the least recently used directory */
+    DCDIR   dc_dir[FF_DIRCACHE_DIRS];   /* Directory cache: the directories */
 #endif
     DWORD   winsect;        /* Current sector appearing in the win[] */
     BYTE    win[FF_MAX_SS]; /* Disk access window for Directory, FAT (and file data at tiny cfg) */
@@ -309,6 +330,7 @@ FRESULT f_umount (FATFS* fs);                                       /* Unmount a
 FRESULT f_mkfs (FATFS *fs, BYTE opt, DWORD au, void* work, UINT len); /* Create a FAT volume */
 FRESULT f_fdisk (void *pdrv, const DWORD* szt, void* work);         /* Divide a physical drive into some partitions */
 FRESULT f_setcp (WORD cp);                                          /* Set current code page */
+FRESULT f_dircache (FATFS *fs, DWORD* buf, UINT n_item);            /* Give the volume a directory cache of n_item items */
 
 #define f_eof(fp) ((int)((fp)->fptr == (fp)->obj.objsize))
 #define f_error(fp) ((fp)->err)
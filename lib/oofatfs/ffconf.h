@@ -99,6 +99,23 @@
 /* This option switches f_forward() function. (0:Disable or 1:Enable) */
 
 
+#ifdef MICROPY_FATFS_DIRCACHE
+#define FF_USE_DIRCACHE ((MICROPY_FATFS_DIRCACHE) > 0)
+#else
+#define FF_USE_DIRCACHE 0
+#endif
+/* This option switches f_dircache() function, which gives a volume a table of the
+/  hashed names in a directory, so that objects in large directories are found
+/  without scanning them. (0:Disable or 1:Enable) Also FF_USE_LFN needs to be
+/  enabled to enable this option. */
+
+
+#define FF_DIRCACHE_DIRS    4
+/* Number of directories the directory cache holds at a time, sharing its buffer.
+/  A path is looked up a directory at a time, this many levels of large
+/  directories stay cached. */
+
+
 /*---------------------------------------------------------------------------/
 / Locale and Namespace Configurations
 /---------------------------------------------------------------------------*/
@@ -30,6 +30,8 @@
 #endif
 
 void mp_hal_set_interrupt_char(char c);
+// the reset char is only used by the Pycom ports, it's a no-op here
+static inline void mp_hal_set_reset_char(int c) { (void)c; }
 
 void mp_hal_stdio_mode_raw(void);
 void mp_hal_stdio_mode_orig(void);
@@ -266,6 +266,9 @@ STATIC void gc_sweep(void) {
     #if MICROPY_PY_GC_COLLECT_RETVAL
     MP_STATE_MEM(gc_collected) = 0;
     #endif
+    #if MICROPY_MEM_STATS
+    size_t live_blocks = 0;
+    #endif
     // free unmarked heads and their tails
     int free_tail = 0;
     for (size_t block = 0; block < MP_STATE_MEM(gc_alloc_table_byte_len) * BLOCKS_PER_ATB; block++) {
@@ -307,14 +310,28 @@ STATIC void gc_sweep(void) {
                     memset((void*)PTR_FROM_BLOCK(block), 0, BYTES_PER_BLOCK);
                     #endif
                 }
+                #if MICROPY_MEM_STATS
+                else {
+                    live_blocks++;
+                }
+                #endif
                 break;
 
             case AT_MARK:
                 ATB_MARK_TO_HEAD(block);
                 free_tail = 0;
+                #if MICROPY_MEM_STATS
+                live_blocks++;
+                #endif
                 break;
         }
     }
+    #if MICROPY_MEM_STATS
+    MP_STATE_MEM(gc_collect_count)++;
+    if (live_blocks * BYTES_PER_BLOCK > MP_STATE_MEM(gc_peak_bytes)) {
+        MP_STATE_MEM(gc_peak_bytes) = live_blocks * BYTES_PER_BLOCK;
+    }
+    #endif
 }
 
 void gc_collect_start(void) {
@@ -34,6 +34,7 @@
 #include "py/objarray.h"
 #include "py/objstringio.h"
 #include "py/frozenmod.h"
+#include "extmod/vfs_writebehind.h"
 
 #if MICROPY_PY_IO
 
@@ -114,8 +115,15 @@ typedef struct _mp_obj_bufwriter_t {
 } mp_obj_bufwriter_t;
 
 STATIC mp_obj_t bufwriter_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
-    mp_arg_check_num(n_args, n_kw, 2, 2, false);
-    size_t alloc = mp_obj_get_int(args[1]);
+    mp_arg_check_num(n_args, n_kw, 1, 2, false);
+    mp_get_stream_raise(args[0], MP_STREAM_OP_WRITE);
+    size_t alloc = MICROPY_PY_IO_BUFFER_SIZE;
+    if (n_args > 1) {
+        alloc = mp_obj_get_int(args[1]);
+    }
+    if (alloc == 0) {
+        mp_raise_ValueError(NULL);
+    }
     mp_obj_bufwriter_t *o = m_new_obj_var(mp_obj_bufwriter_t, byte, alloc);
     o->base.type = type;
     o->stream = args[0];
@@ -137,6 +145,22 @@ STATIC mp_uint_t bufwriter_write(mp_obj_t self_in, const void *buf, mp_uint_t si
             return org_size;
         }
 
+        if (self->len == 0) {
+            // Nothing buffered and at least a whole buffer's worth of data,
+            // so pass whole multiples of the buffer size straight through to
+            // the underlying stream without copying.
+            mp_uint_t direct = size - size % self->alloc;
+            mp_uint_t out_sz = mp_stream_write_exactly(self->stream, buf, direct, errcode);
+            (void)out_sz;
+            if (*errcode != 0) {
+                return MP_STREAM_ERROR;
+            }
+            assert(out_sz == direct);
+            buf = (byte*)buf + direct;
+            size -= direct;
+            continue;
+        }
+
         // Buffer flushing policy here is to flush entire buffer all the time.
         // This allows e.g. to have a block device as backing storage and write
         // entire block to it. memcpy below is not ideal and could be optimized
@@ -180,8 +204,26 @@ STATIC mp_obj_t bufwriter_flush(mp_obj_t self_in) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(bufwriter_flush_obj, bufwriter_flush);
 
+// Gather-write a sequence of buffers, coalescing them into as few writes
+// of the underlying stream as possible.
+STATIC mp_obj_t bufwriter_writelines(mp_obj_t self_in, mp_obj_t lines_in) {
+    mp_obj_t iter = mp_getiter(lines_in, NULL);
+    mp_obj_t item;
+    while ((item = mp_iternext(iter)) != MP_OBJ_STOP_ITERATION) {
+        mp_buffer_info_t bufinfo;
+        mp_get_buffer_raise(item, &bufinfo, MP_BUFFER_READ);
+        int err;
+        if (bufwriter_write(self_in, bufinfo.buf, bufinfo.len, &err) == MP_STREAM_ERROR) {
+            mp_raise_OSError(err);
+        }
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(bufwriter_writelines_obj, bufwriter_writelines);
+
 STATIC const mp_rom_map_elem_t bufwriter_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&mp_stream_write_obj) },
+    { MP_ROM_QSTR(MP_QSTR_writelines), MP_ROM_PTR(&bufwriter_writelines_obj) },
     { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&bufwriter_flush_obj) },
 };
 STATIC MP_DEFINE_CONST_DICT(bufwriter_locals_dict, bufwriter_locals_dict_table);
@@ -199,6 +241,208 @@ STATIC const mp_obj_type_t bufwriter_type = {
 };
 #endif // MICROPY_PY_IO_BUFFEREDWRITER
 
+#if MICROPY_PY_IO_BUFFEREDREADER
+typedef struct _mp_obj_bufreader_t {
+    mp_obj_base_t base;
+    mp_obj_t stream;
+    size_t alloc;
+    size_t pos; // start of the unread data in buf
+    size_t len; // end of the unread data in buf
+    byte buf[0];
+} mp_obj_bufreader_t;
+
+STATIC mp_obj_t bufreader_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    mp_arg_check_num(n_args, n_kw, 1, 2, false);
+    mp_get_stream_raise(args[0], MP_STREAM_OP_READ);
+    size_t alloc = MICROPY_PY_IO_BUFFER_SIZE;
+    if (n_args > 1) {
+        alloc = mp_obj_get_int(args[1]);
+    }
+    if (alloc == 0) {
+        mp_raise_ValueError(NULL);
+    }
+    mp_obj_bufreader_t *o = m_new_obj_var(mp_obj_bufreader_t, byte, alloc);
+    o->base.type = type;
+    o->stream = args[0];
+    o->alloc = alloc;
+    o->pos = 0;
+    o->len = 0;
+    return o;
+}
+
+// Do a single read of the underlying stream to append data to the buffer.
+// Returns the number of new bytes (0 on EOF) or MP_STREAM_ERROR.
+STATIC mp_uint_t bufreader_fill(mp_obj_bufreader_t *self, int *errcode) {
+    if (self->pos != 0) {
+        memmove(self->buf, self->buf + self->pos, self->len - self->pos);
+        self->len -= self->pos;
+        self->pos = 0;
+    }
+    const mp_stream_p_t *stream_p = mp_get_stream(self->stream);
+    mp_uint_t out_sz = stream_p->read(self->stream, self->buf + self->len, self->alloc - self->len, errcode);
+    if (out_sz != MP_STREAM_ERROR) {
+        self->len += out_sz;
+    }
+    return out_sz;
+}
+
+STATIC mp_uint_t bufreader_read(mp_obj_t self_in, void *buf, mp_uint_t size, int *errcode) {
+    mp_obj_bufreader_t *self = MP_OBJ_TO_PTR(self_in);
+
+    if (self->pos == self->len) {
+        self->pos = self->len = 0;
+        if (size >= self->alloc) {
+            // Large read with an empty buffer, go directly to the stream
+            const mp_stream_p_t *stream_p = mp_get_stream(self->stream);
+            return stream_p->read(self->stream, buf, size, errcode);
+        }
+        mp_uint_t out_sz = bufreader_fill(self, errcode);
+        if (out_sz == MP_STREAM_ERROR || out_sz == 0) {
+            return out_sz;
+        }
+    }
+
+    mp_uint_t avail = MIN(size, self->len - self->pos);
+    memcpy(buf, self->buf + self->pos, avail);
+    self->pos += avail;
+    return avail;
+}
+
+STATIC mp_uint_t bufreader_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode) {
+    mp_obj_bufreader_t *self = MP_OBJ_TO_PTR(self_in);
+    const mp_stream_p_t *stream_p = mp_get_stream(self->stream);
+    if (stream_p->ioctl == NULL) {
+        *errcode = MP_EINVAL;
+        return MP_STREAM_ERROR;
+    }
+    if (request == MP_STREAM_POLL && (arg & MP_STREAM_POLL_RD) && self->pos != self->len) {
+        // Buffered data is readable without touching the stream
+        mp_uint_t ret = stream_p->ioctl(self->stream, request, arg & ~MP_STREAM_POLL_RD, errcode);
+        if (ret == MP_STREAM_ERROR) {
+            return ret;
+        }
+        return ret | MP_STREAM_POLL_RD;
+    }
+    if (request == MP_STREAM_SEEK) {
+        // Account for data read ahead into the buffer and then drop it
+        struct mp_stream_seek_t *s = (struct mp_stream_seek_t*)arg;
+        if (s->whence == MP_SEEK_CUR) {
+            s->offset -= self->len - self->pos;
+        }
+        self->pos = self->len = 0;
+    }
+    return stream_p->ioctl(self->stream, request, arg, errcode);
+}
+
+// Fast readline: scan the buffer for the newline with memchr and copy whole
+// runs of data, only going to the stream when the buffer is exhausted.
+STATIC mp_obj_t bufreader_readline(size_t n_args, const mp_obj_t *args) {
+    mp_obj_bufreader_t *self = MP_OBJ_TO_PTR(args[0]);
+    const mp_stream_p_t *stream_p = mp_get_stream(self->stream);
+
+    mp_int_t max_size = -1;
+    if (n_args > 1) {
+        max_size = mp_obj_get_int(args[1]);
+    }
+
+    vstr_t vstr;
+    vstr_init(&vstr, max_size >= 0 ? (size_t)max_size : 16);
+
+    while (max_size != 0) {
+        if (self->pos == self->len) {
+            int error;
+            mp_uint_t out_sz = bufreader_fill(self, &error);
+            if (out_sz == MP_STREAM_ERROR) {
+                if (mp_is_nonblocking_error(error)) {
+                    if (vstr.len == 0) {
+                        // Same as stream_unbuffered_readline
+                        vstr_clear(&vstr);
+                        return mp_const_none;
+                    }
+                    break;
+                }
+                mp_raise_OSError(error);
+            }
+            if (out_sz == 0) {
+                break;
+            }
+        }
+        size_t n = self->len - self->pos;
+        if (max_size >= 0 && n > (size_t)max_size) {
+            n = max_size;
+        }
+        const byte *start = self->buf + self->pos;
+        const byte *nl = memchr(start, '\n', n);
+        if (nl != NULL) {
+            n = nl - start + 1;
+        }
+        vstr_add_strn(&vstr, (const char*)start, n);
+        self->pos += n;
+        if (max_size > 0) {
+            max_size -= n;
+        }
+        if (nl != NULL) {
+            break;
+        }
+    }
+
+    return mp_obj_new_str_from_vstr(stream_p->is_text ? &mp_type_str : &mp_type_bytes, &vstr);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bufreader_readline_obj, 1, 2, bufreader_readline);
+
+STATIC mp_obj_t bufreader_iternext(mp_obj_t self_in) {
+    mp_obj_t line = bufreader_readline(1, &self_in);
+    if (mp_obj_is_true(line)) {
+        return line;
+    }
+    return MP_OBJ_STOP_ITERATION;
+}
+
+// Return buffered data without consuming it, doing at most one read of the
+// stream if the buffer is empty (like CPython, the size arg is a hint only).
+STATIC mp_obj_t bufreader_peek(size_t n_args, const mp_obj_t *args) {
+    mp_obj_bufreader_t *self = MP_OBJ_TO_PTR(args[0]);
+    mp_int_t size = 0;
+    if (n_args > 1) {
+        size = mp_obj_get_int(args[1]);
+    }
+    if (self->pos == self->len || (size > 0 && (size_t)size > self->len - self->pos && self->len < self->alloc)) {
+        int error;
+        if (bufreader_fill(self, &error) == MP_STREAM_ERROR && !mp_is_nonblocking_error(error)) {
+            mp_raise_OSError(error);
+        }
+    }
+    return mp_obj_new_bytes(self->buf + self->pos, self->len - self->pos);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bufreader_peek_obj, 1, 2, bufreader_peek);
+
+STATIC const mp_rom_map_elem_t bufreader_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&mp_stream_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read1), MP_ROM_PTR(&mp_stream_read1_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&mp_stream_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readline), MP_ROM_PTR(&bufreader_readline_obj) },
+    { MP_ROM_QSTR(MP_QSTR_peek), MP_ROM_PTR(&bufreader_peek_obj) },
+    { MP_ROM_QSTR(MP_QSTR_seek), MP_ROM_PTR(&mp_stream_seek_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&mp_stream_close_obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(bufreader_locals_dict, bufreader_locals_dict_table);
+
+STATIC const mp_stream_p_t bufreader_stream_p = {
+    .read = bufreader_read,
+    .ioctl = bufreader_ioctl,
+};
+
+STATIC const mp_obj_type_t bufreader_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_BufferedReader,
+    .make_new = bufreader_make_new,
+    .getiter = mp_identity_getiter,
+    .iternext = bufreader_iternext,
+    .protocol = &bufreader_stream_p,
+    .locals_dict = (mp_obj_dict_t*)&bufreader_locals_dict,
+};
+#endif // MICROPY_PY_IO_BUFFEREDREADER
+
 #if MICROPY_PY_IO_RESOURCE_STREAM
 STATIC mp_obj_t resource_stream(mp_obj_t package_in, mp_obj_t path_in) {
     VSTR_FIXED(path_buf, MICROPY_ALLOC_PATH_MAX);
@@ -274,6 +518,12 @@ STATIC const mp_rom_map_elem_t mp_module_io_globals_table[] = {
     #if MICROPY_PY_IO_BUFFEREDWRITER
     { MP_ROM_QSTR(MP_QSTR_BufferedWriter), MP_ROM_PTR(&bufwriter_type) },
     #endif
+    #if MICROPY_PY_IO_BUFFEREDREADER
+    { MP_ROM_QSTR(MP_QSTR_BufferedReader), MP_ROM_PTR(&bufreader_type) },
+    #endif
+    #if MICROPY_VFS_WRITEBEHIND
+    { MP_ROM_QSTR(MP_QSTR_WriteBehind), MP_ROM_PTR(&mp_type_vfs_writebehind) },
+    #endif
 };
 
 STATIC MP_DEFINE_CONST_DICT(mp_module_io_globals, mp_module_io_globals_table);
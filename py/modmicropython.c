@@ -64,6 +64,18 @@ STATIC mp_obj_t mp_micropython_mem_peak(void) {
     return MP_OBJ_NEW_SMALL_INT(m_get_peak_bytes_allocated());
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_0(mp_micropython_mem_peak_obj, mp_micropython_mem_peak);
+
+#if MICROPY_ENABLE_GC
+// Returns (number of collections, peak live heap in bytes found by the GC)
+STATIC mp_obj_t mp_micropython_gc_stats(void) {
+    mp_obj_t tuple[2] = {
+        mp_obj_new_int_from_uint(MP_STATE_MEM(gc_collect_count)),
+        mp_obj_new_int_from_uint(MP_STATE_MEM(gc_peak_bytes)),
+    };
+    return mp_obj_new_tuple(2, tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mp_micropython_gc_stats_obj, mp_micropython_gc_stats);
+#endif
 #endif
 
 mp_obj_t mp_micropython_mem_info(size_t n_args, const mp_obj_t *args) {
@@ -176,6 +188,9 @@ STATIC const mp_rom_map_elem_t mp_module_micropython_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_mem_total), MP_ROM_PTR(&mp_micropython_mem_total_obj) },
     { MP_ROM_QSTR(MP_QSTR_mem_current), MP_ROM_PTR(&mp_micropython_mem_current_obj) },
     { MP_ROM_QSTR(MP_QSTR_mem_peak), MP_ROM_PTR(&mp_micropython_mem_peak_obj) },
+    #if MICROPY_ENABLE_GC
+    { MP_ROM_QSTR(MP_QSTR_gc_stats), MP_ROM_PTR(&mp_micropython_gc_stats_obj) },
+    #endif
 #endif
     { MP_ROM_QSTR(MP_QSTR_mem_info), MP_ROM_PTR(&mp_micropython_mem_info_obj) },
     { MP_ROM_QSTR(MP_QSTR_qstr_info), MP_ROM_PTR(&mp_micropython_qstr_info_obj) },
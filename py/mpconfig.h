@@ -758,6 +758,18 @@ typedef double mp_float_t;
 #define MICROPY_VFS_FAT (0)
 #endif
 
+// Whether to provide "io.WriteBehind", which queues writes to a file in RAM
+// and writes them out in the background
+#ifndef MICROPY_VFS_WRITEBEHIND
+#define MICROPY_VFS_WRITEBEHIND (0)
+#endif
+
+// Whether the port has a task that writes out the write-behind queues; if
+// not they are written out by the caller when full and at flush()
+#ifndef MICROPY_VFS_WRITEBEHIND_TASK
+#define MICROPY_VFS_WRITEBEHIND_TASK (0)
+#endif
+
 /*****************************************************************************/
 /* Fine control over Python builtins, classes, modules, etc                  */
 
@@ -1126,6 +1138,16 @@ typedef double mp_float_t;
 #define MICROPY_PY_IO_BUFFEREDWRITER (0)
 #endif
 
+// Whether to provide "io.BufferedReader" class
+#ifndef MICROPY_PY_IO_BUFFEREDREADER
+#define MICROPY_PY_IO_BUFFEREDREADER (0)
+#endif
+
+// Default buffer size of io.BufferedReader/BufferedWriter when not given
+#ifndef MICROPY_PY_IO_BUFFER_SIZE
+#define MICROPY_PY_IO_BUFFER_SIZE (256)
+#endif
+
 // Whether to provide "struct" module
 #ifndef MICROPY_PY_STRUCT
 #define MICROPY_PY_STRUCT (1)
@@ -1348,6 +1370,17 @@ typedef double mp_float_t;
 #define MICROPY_PY_BTREE (0)
 #endif
 
+// Default page cache size and page size (in bytes) used by btree.open() when
+// they are not given; 0 selects the defaults compiled into berkeley-db.
+// Dirty pages are only written back when evicted from the cache or on flush,
+// so a larger cache holds more writes back, for any put.
+#ifndef MICROPY_PY_BTREE_DEFAULT_CACHESIZE
+#define MICROPY_PY_BTREE_DEFAULT_CACHESIZE (0)
+#endif
+#ifndef MICROPY_PY_BTREE_DEFAULT_PAGESIZE
+#define MICROPY_PY_BTREE_DEFAULT_PAGESIZE (0)
+#endif
+
 /*****************************************************************************/
 /* Hooks for a port to add builtins                                          */
 
@@ -97,6 +97,13 @@ typedef struct _mp_state_mem_t {
     size_t gc_collected;
     #endif
 
+    #if MICROPY_MEM_STATS
+    // Number of collections done, and the highest amount of live (reachable)
+    // heap memory found by a collection.
+    size_t gc_collect_count;
+    size_t gc_peak_bytes;
+    #endif
+
     #if MICROPY_PY_THREAD
     // This is a global mutex used to make the GC thread-safe.
     mp_thread_mutex_t gc_mutex;
@@ -183,6 +190,10 @@ typedef struct _mp_state_vm_t {
     struct _mp_vfs_mount_t *vfs_mount_table;
     #endif
 
+    #if MICROPY_VFS_WRITEBEHIND
+    struct _mp_obj_vfs_wb_t *vfs_wb_list;
+    #endif
+
     //
     // END ROOT POINTER SECTION
     ////////////////////////////////////////////////////////////
@@ -0,0 +1,63 @@
+import uio as io
+
+try:
+    io.BytesIO
+    io.BufferedReader
+except AttributeError:
+    print('SKIP')
+    raise SystemExit
+
+# readline with lines shorter and longer than the buffer
+buf = io.BufferedReader(io.BytesIO(b"AT\r\nOK\r\n0123456789abcdef\r\n\r\nlast"), 8)
+print(buf.readline())
+print(buf.readline())
+print(buf.readline())
+print(buf.readline())
+print(buf.readline())
+print(buf.readline())
+
+# readline with a size limit
+buf = io.BufferedReader(io.BytesIO(b"foobar\nbaz\n"), 4)
+print(buf.readline(3))
+print(buf.readline(10))
+print(buf.readline(0))
+print(buf.readline())
+
+# read, read1 and readinto
+buf = io.BufferedReader(io.BytesIO(b"0123456789" * 4), 16)
+print(buf.read(3))
+print(buf.read1(100))
+ba = bytearray(20)
+print(buf.readinto(ba), ba)
+print(buf.read())
+print(buf.read())
+
+# peek doesn't consume data
+buf = io.BufferedReader(io.BytesIO(b"+CSQ: 21,99\r\n"), 4)
+print(buf.peek())
+print(buf.read(1))
+print(buf.peek(1))
+print(buf.readline())
+print(buf.peek())
+
+# iteration
+for l in io.BufferedReader(io.BytesIO(b"a\nbb\nccc"), 2):
+    print(l)
+
+# seek accounts for buffered data
+buf = io.BufferedReader(io.BytesIO(b"0123456789"), 4)
+print(buf.read(1))
+print(buf.seek(0, 1))
+print(buf.read(2))
+buf.seek(8)
+print(buf.read())
+
+# wrapping a stream that can't be read from
+try:
+    io.BufferedReader(1)
+except (OSError, TypeError):
+    print('OSError')
+try:
+    io.BufferedReader(io.BytesIO(), 0)
+except ValueError:
+    print('ValueError')
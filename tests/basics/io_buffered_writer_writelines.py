@@ -0,0 +1,35 @@
+import uio as io
+
+try:
+    io.BytesIO
+    io.BufferedWriter
+except AttributeError:
+    print('SKIP')
+    raise SystemExit
+
+# gather-write of several buffers
+bts = io.BytesIO()
+buf = io.BufferedWriter(bts, 8)
+buf.writelines([b"AT", b"+CSQ", bytearray(b"\r\n"), memoryview(b"xyz")])
+print(bts.getvalue())
+buf.flush()
+print(bts.getvalue())
+
+# writes larger than the buffer go through directly
+bts = io.BytesIO()
+buf = io.BufferedWriter(bts, 4)
+buf.write(b"ab")
+buf.write(b"0123456789")
+print(bts.getvalue())
+buf.write(b"0123456789")
+print(bts.getvalue())
+buf.flush()
+print(bts.getvalue())
+
+# default buffer size
+bts = io.BytesIO()
+buf = io.BufferedWriter(bts)
+buf.write(b"foo")
+print(bts.getvalue())
+buf.flush()
+print(bts.getvalue())
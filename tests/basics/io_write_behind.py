@@ -0,0 +1,54 @@
+import uio as io
+
+try:
+    io.BytesIO
+    io.WriteBehind
+except AttributeError:
+    print('SKIP')
+    raise SystemExit
+
+bts = io.BytesIO()
+wb = io.WriteBehind(bts, 8)
+
+# writes are queued until the queue is full or flushed
+print(wb.write(b"abc"))
+print(bts.getvalue())
+wb.write(b"defgh")
+print(bts.getvalue())
+wb.write(b"ij")
+print(bts.getvalue())
+wb.flush()
+print(bts.getvalue())
+
+# writes larger than the queue go out in order
+wb.write(b"0123456789" * 3)
+wb.flush()
+print(bts.getvalue())
+
+# seek and read see the queued data
+wb.write(b"XYZ")
+wb.seek(0)
+print(wb.read(4))
+print(bts.getvalue())
+
+# close writes out the queue and closes the stream
+bts = io.BytesIO()
+wb = io.WriteBehind(bts, 4)
+wb.write(b"12")
+print(bts.getvalue())
+with wb:
+    wb.write(b"345")
+try:
+    wb.write(b"6")
+except OSError:
+    print("OSError")
+
+# the stream must be writable
+try:
+    io.WriteBehind(1)
+except OSError:
+    print("OSError")
+try:
+    io.WriteBehind(io.BytesIO(), 0)
+except ValueError:
+    print("ValueError")
@@ -1,10 +1,28 @@
-import time
+try:
+    import utime as time
+except ImportError:
+    import time
+
+try:
+    from micropython import gc_stats
+except ImportError:
+    gc_stats = None
 
 
 ITERS = 20000000
 
 def run(f):
     t = time.time()
-    f(ITERS)
+    extra = f(ITERS)
     t = time.time() - t
-    print(t)
+    out = [t]
+    if gc_stats is not None:
+        # also report number of collections and peak live heap (bytes)
+        import gc
+        gc.collect()
+        n_gc, peak = gc_stats()
+        out += [n_gc - 1, peak]
+    # and whatever else the test counted, as name=value
+    if extra:
+        out += ['%s=%d' % kv for kv in sorted(extra.items())]
+    print(*out)
@@ -0,0 +1,22 @@
+# Inserting records in random order into a file-backed btree, one put at a time
+import bench
+import btree
+import uos
+
+DB = '/tmp/mpy-bench-btree'
+
+def test(num):
+    f = open(DB, 'w+b')
+    db = btree.open(f, pagesize=512, cachesize=8192)
+    for i in range(num // 4000):
+        # scatter keys with a multiplicative hash
+        k = (i * 2654435761) & 0xffffff
+        db[b'%08x' % k] = b'%d' % i
+    db.flush()
+    writes, written = db.stats()
+    db.close()
+    f.close()
+    uos.unlink(DB)
+    return {'page_writes': writes, 'bytes_written': written}
+
+bench.run(test)
@@ -0,0 +1,19 @@
+# Loading time-series style records in key order with load(), in one batch committed at the end
+import bench
+import btree
+import uos
+
+DB = '/tmp/mpy-bench-btree'
+
+def test(num):
+    f = open(DB, 'w+b')
+    db = btree.open(f, pagesize=512, cachesize=8192)
+    db.load((b'%08x' % i, b'%d' % i) for i in range(num // 4000))
+    db.commit()
+    writes, written = db.stats()
+    db.close()
+    f.close()
+    uos.unlink(DB)
+    return {'page_writes': writes, 'bytes_written': written}
+
+bench.run(test)
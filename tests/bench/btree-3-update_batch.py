@@ -0,0 +1,22 @@
+# Inserting the records of btree-1 in the same random order, with update() in batches committed every 500
+import bench
+import btree
+import uos
+
+DB = '/tmp/mpy-bench-btree'
+
+def test(num):
+    f = open(DB, 'w+b')
+    db = btree.open(f, pagesize=512, cachesize=8192)
+    n = num // 4000
+    for j in range(0, n, 500):
+        # scatter keys with a multiplicative hash
+        db.update((b'%08x' % ((i * 2654435761) & 0xffffff), b'%d' % i) for i in range(j, min(j + 500, n)))
+        db.commit()
+    writes, written = db.stats()
+    db.close()
+    f.close()
+    uos.unlink(DB)
+    return {'page_writes': writes, 'bytes_written': written}
+
+bench.run(test)
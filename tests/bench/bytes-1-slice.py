@@ -0,0 +1,10 @@
+# Slicing bytes, which copies the data
+import bench
+
+def test(num):
+    data = bytes(range(256)) * 8
+    for i in range(num // 10):
+        off = i & 1023
+        data[off:off + 64]
+
+bench.run(test)
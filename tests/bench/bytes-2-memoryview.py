@@ -0,0 +1,10 @@
+# Slicing a memoryview, which doesn't copy the data
+import bench
+
+def test(num):
+    data = memoryview(bytes(range(256)) * 8)
+    for i in range(num // 5):
+        off = i & 1023
+        data[off:off + 64]
+
+bench.run(test)
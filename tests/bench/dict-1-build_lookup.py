@@ -0,0 +1,17 @@
+# Building dicts with string keys and looking them up
+import bench
+
+def test(num):
+    keys = ['key%d' % i for i in range(64)]
+    for i in range(num // 2000):
+        d = {}
+        for k in keys:
+            d[k] = len(k)
+        s = 0
+        for k in keys:
+            s += d[k]
+        for k in keys:
+            if k in d:
+                del d[k]
+
+bench.run(test)
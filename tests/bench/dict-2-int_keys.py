@@ -0,0 +1,10 @@
+# Using a dict as a sparse int-keyed table
+import bench
+
+def test(num):
+    d = {}
+    for i in range(num // 8):
+        k = (i * 7) & 1023
+        d[k] = d.get(k, 0) + 1
+
+bench.run(test)
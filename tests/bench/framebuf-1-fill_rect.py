@@ -0,0 +1,12 @@
+# Filling rectangles of an RGB565 and a monochrome framebuffer
+import bench
+import framebuf
+
+def test(num):
+    fb = framebuf.FrameBuffer(bytearray(128 * 64 * 2), 128, 64, framebuf.RGB565)
+    mono = framebuf.FrameBuffer(bytearray(128 * 64 // 8), 128, 64, framebuf.MONO_VLSB)
+    for i in range(num // 1000):
+        fb.fill_rect(i & 31, i & 15, 96, 48, 0xf81f)
+        mono.fill_rect(i & 7, i & 7, 100, 50, i & 1)
+
+bench.run(test)
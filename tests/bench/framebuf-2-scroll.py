@@ -0,0 +1,10 @@
+# Scrolling an RGB565 framebuffer
+import bench
+import framebuf
+
+def test(num):
+    fb = framebuf.FrameBuffer(bytearray(128 * 64 * 2), 128, 64, framebuf.RGB565)
+    for i in range(num // 10000):
+        fb.scroll(1 - (i & 2), 1)
+
+bench.run(test)
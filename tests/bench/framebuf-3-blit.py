@@ -0,0 +1,13 @@
+# Blitting a sprite, with and without a transparent key colour
+import bench
+import framebuf
+
+def test(num):
+    fb = framebuf.FrameBuffer(bytearray(128 * 64 * 2), 128, 64, framebuf.RGB565)
+    spr = framebuf.FrameBuffer(bytearray(32 * 32 * 2), 32, 32, framebuf.RGB565)
+    spr.fill_rect(8, 8, 16, 16, 0x07e0)
+    for i in range(num // 1000):
+        fb.blit(spr, i & 63, i & 31)
+        fb.blit(spr, i & 31, i & 15, 0)
+
+bench.run(test)
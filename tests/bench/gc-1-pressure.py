@@ -0,0 +1,10 @@
+# Lots of short-lived small objects, forcing frequent collections
+import bench
+
+def test(num):
+    keep = [None] * 64
+    for i in range(num // 50):
+        t = (i, [i, i + 1], str(i))
+        keep[i & 63] = t
+
+bench.run(test)
@@ -0,0 +1,9 @@
+# Allocating and dropping large buffers (fragmentation)
+import bench
+
+def test(num):
+    keep = [None] * 8
+    for i in range(num // 40):
+        keep[i & 7] = bytearray(256 + (i & 15) * 256)
+
+bench.run(test)
@@ -0,0 +1,18 @@
+# Serialising a typical sensor report to JSON
+import bench
+try:
+    import ujson as json
+except ImportError:
+    import json
+
+def test(num):
+    report = {
+        'dev': 'lopy4-0123', 'fw': '1.20.2', 'seq': 0,
+        'readings': [{'t': 21.5 + i, 'rh': 40 + i, 'ok': True} for i in range(8)],
+        'tags': ['a', 'b', None],
+    }
+    for i in range(num // 500):
+        report['seq'] = i
+        json.dumps(report)
+
+bench.run(test)
@@ -0,0 +1,14 @@
+# Parsing a typical JSON downlink/config message
+import bench
+try:
+    import ujson as json
+except ImportError:
+    import json
+
+def test(num):
+    msg = ('{"dev": "lopy4-0123", "interval": 600, "thresholds": [1.5, 2.5, 3.5],'
+        ' "enabled": true, "name": "sensor \\"A\\"", "nested": {"x": [1, 2, {"y": null}]}}')
+    for i in range(num // 1500):
+        json.loads(msg)
+
+bench.run(test)
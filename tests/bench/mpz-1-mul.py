@@ -0,0 +1,10 @@
+# Arbitrary-precision multiplication
+import bench
+
+def test(num):
+    for i in range(num // 600):
+        x = 1
+        for j in range(1, 60):
+            x *= 123456789 + j
+
+bench.run(test)
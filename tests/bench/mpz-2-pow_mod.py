@@ -0,0 +1,9 @@
+# Arbitrary-precision modular exponentiation
+import bench
+
+def test(num):
+    m = (1 << 127) - 1
+    for i in range(num // 200):
+        pow(3 + i, 65537, m)
+
+bench.run(test)
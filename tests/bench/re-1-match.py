@@ -0,0 +1,17 @@
+# Matching AT-command responses with regular expressions
+import bench
+try:
+    import ure as re
+except ImportError:
+    import re
+
+def test(num):
+    r = re.compile(r'\+CSQ: (\d+),(\d+)')
+    lines = ['+CSQ: 21,99', 'OK', '+CEREG: 1,5', '+CSQ: 3,0']
+    for i in range(num // 100):
+        for l in lines:
+            m = r.match(l)
+            if m:
+                m.group(1)
+
+bench.run(test)
@@ -0,0 +1,10 @@
+# Building a string by repeated concatenation
+import bench
+
+def test(num):
+    for i in range(num // 10000):
+        s = ''
+        for j in range(100):
+            s += 'x%d,' % j
+
+bench.run(test)
@@ -0,0 +1,11 @@
+# Building a string by joining a list of parts
+import bench
+
+def test(num):
+    for i in range(num // 5000):
+        parts = []
+        for j in range(100):
+            parts.append('x%d,' % j)
+        ''.join(parts)
+
+bench.run(test)
@@ -0,0 +1,9 @@
+# Formatting log lines with str.format
+import bench
+
+def test(num):
+    fmt = '{} {:>5} {:.2f} {}'
+    for i in range(num // 64):
+        fmt.format('lvl', i, i / 3, 'msg')
+
+bench.run(test)
@@ -0,0 +1,22 @@
+# Reading AT-command style lines from a pipe
+import bench
+import uos
+import uio
+
+FIFO = '/tmp/mpy-bench-fifo'
+
+def test(num):
+    uos.system('rm -f %s; mkfifo %s' % (FIFO, FIFO))
+    uos.system("yes '+CSQ: 21,99' 2>/dev/null | head -n %d > %s &" % (num // 400, FIFO))
+    f = open(FIFO, 'rb')
+    f = uio.BufferedReader(f, 256)
+    n = 0
+    while True:
+        l = f.readline()
+        if not l:
+            break
+        n += 1
+    f.close()
+    uos.unlink(FIFO)
+
+bench.run(test)
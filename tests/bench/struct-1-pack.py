@@ -0,0 +1,13 @@
+# Packing binary sensor records
+import bench
+try:
+    import ustruct as struct
+except ImportError:
+    import struct
+
+def test(num):
+    pack = struct.pack
+    for i in range(num // 16):
+        pack('<IhHBf', i, -i & 0x7fff, i & 0xffff, i & 0xff, 1.5)
+
+bench.run(test)
@@ -0,0 +1,14 @@
+# Unpacking binary records from a larger buffer
+import bench
+try:
+    import ustruct as struct
+except ImportError:
+    import struct
+
+def test(num):
+    buf = bytes(range(256)) * 4
+    unpack_from = struct.unpack_from
+    for i in range(num // 1000):
+        unpack_from('<IhHB', buf, i & 0x3ff if (i & 0x3ff) < 1000 else 0)
+
+bench.run(test)
@@ -0,0 +1,35 @@
+# Looking up names that are missing from a FAT directory of 500 files on a RAM disk
+import bench
+try:
+    from uos import VfsFat
+except ImportError:
+    from uos_vfs import VfsFat
+
+class RAMFS:
+    def __init__(self, blocks):
+        self.data = bytearray(blocks * 512)
+    def readblocks(self, n, buf):
+        buf[:] = memoryview(self.data)[n * 512:n * 512 + len(buf)]
+    def writeblocks(self, n, buf):
+        self.data[n * 512:n * 512 + len(buf)] = buf
+    def ioctl(self, op, arg):
+        if op == 4:  # BP_IOCTL_SEC_COUNT
+            return len(self.data) // 512
+        if op == 5:  # BP_IOCTL_SEC_SIZE
+            return 512
+
+bdev = RAMFS(1024)
+VfsFat.mkfs(bdev)
+vfs = VfsFat(bdev)
+vfs.mkdir('/d')
+for i in range(500):
+    vfs.open('/d/sensor log %03d.csv' % i, 'w').close()
+
+def test(num):
+    for i in range(num // 2000):
+        try:
+            vfs.stat('/d/sensor log %03d.new' % i)
+        except OSError:
+            pass
+
+bench.run(test)
@@ -0,0 +1,38 @@
+# test the native and viper emitters, which run code from IRAM
+import array
+
+# the firmware only has them with an emitter for the windowed ABI
+try:
+    exec('@micropython.native\ndef f():\n    pass')
+except SyntaxError:
+    print('SKIP')
+    raise SystemExit
+
+@micropython.native
+def native_sum(a):
+    s = 0
+    for x in a:
+        s += x
+    return s
+
+@micropython.viper
+def viper_scale(buf: ptr16, n: int, k: int):
+    for i in range(n):
+        buf[i] = (buf[i] * k) >> 8
+
+@micropython.viper
+def viper_add(x: int, y: int) -> int:
+    return x + y
+
+a = array.array('H', [256, 512, 1024, 2048])
+viper_scale(a, len(a), 128)
+print(list(a))
+print(native_sum(a))
+print(viper_add(1, 2))
+
+# many small functions to exercise the IRAM allocator
+fs = []
+for i in range(20):
+    exec('@micropython.native\ndef f():\n    return %d' % i)
+    fs.append(f)
+print([f() for f in fs])
@@ -0,0 +1,46 @@
+# test btree bulk load, batched update and commit, and prefix iteration
+try:
+    import btree
+    import uio
+except ImportError:
+    print("SKIP")
+    raise SystemExit
+
+f = uio.BytesIO()
+db = btree.open(f, pagesize=512, cachesize=4096)
+
+# sorted bulk load
+print(db.load((b"k%03d" % i, b"v%d" % i) for i in range(200)))
+print(db[b"k000"], db[b"k199"], len(list(db.keys())))
+
+# keys must be strictly ascending
+try:
+    db.load([(b"z1", b"1"), (b"z0", b"0")])
+except ValueError:
+    print("ValueError")
+print(db[b"z1"], b"z0" in db)
+
+# batched update from an iterable of pairs or a dict
+print(db.update([(b"a2", b"2"), (b"a1", b"1")]))
+print(db.update({b"a3": b"3"}))
+print(list(db.items(b"a", b"b")))
+
+# the pages of a batch are written at commit, once each
+w = db.stats()[0]
+db.update((b"b%03d" % i, b"v%d" % i) for i in range(100))
+db[b"b000"] = b"y"
+print(db.stats()[0] == w, db[b"b000"], db[b"b099"])
+db.commit()
+print(db.stats()[0] > w)
+
+# prefix iteration
+print(list(db.keys(b"k19", None, btree.PREFIX)))
+print(list(db.values(b"a", None, btree.PREFIX)))
+print(list(db.keys(b"q", None, btree.PREFIX)))
+try:
+    db.keys(b"k", None, btree.PREFIX | btree.DESC)
+except ValueError:
+    print("ValueError")
+
+db.flush()
+db.close()
@@ -0,0 +1,73 @@
+# test dirty-region tracking and bulk fast paths of FrameBuffer
+try:
+    import framebuf
+except ImportError:
+    print("SKIP")
+    raise SystemExit
+
+w = 16
+h = 16
+buf = bytearray(w * h * 2)
+fbuf = framebuf.FrameBuffer(buf, w, h, framebuf.RGB565)
+
+# a new framebuffer is entirely dirty
+print(fbuf.dirty())
+print(fbuf.dirty())
+
+# single pixel, peek without clearing
+fbuf.pixel(3, 4, 1)
+print(fbuf.dirty(False))
+print(fbuf.dirty())
+
+# getting a pixel doesn't dirty anything
+fbuf.pixel(3, 4)
+print(fbuf.dirty())
+
+# regions accumulate and are clipped
+fbuf.fill_rect(-2, -2, 4, 4, 0x1234)
+fbuf.hline(10, 14, 20, 1)
+print(fbuf.dirty())
+
+# line, text
+fbuf.line(8, 2, 3, 9, 1)
+print(fbuf.dirty())
+fbuf.text('a', 12, 12)
+print(fbuf.dirty())
+
+# off-screen drawing
+fbuf.rect(20, 20, 3, 3, 1)
+print(fbuf.dirty())
+
+# fill and scroll
+fbuf.fill(0)
+print(fbuf.dirty())
+fbuf.scroll(2, -3)
+print(fbuf.dirty())
+fbuf.scroll(w, 0)
+print(fbuf.dirty())
+
+# blit
+src = framebuf.FrameBuffer(bytearray(4 * 4 * 2), 4, 4, framebuf.RGB565)
+fbuf.blit(src, 14, -1)
+print(fbuf.dirty())
+
+# fill_rect with a colour that has different bytes
+fbuf.fill_rect(1, 1, 5, 2, 0x1234)
+print(buf[:16 * 4])
+
+# blit onto itself, overlapping in both directions
+for fmt, bpp in ((framebuf.RGB565, 2), (framebuf.GS8, 1)):
+    b = bytearray(range(4 * 4 * bpp))
+    fb = framebuf.FrameBuffer(b, 4, 4, fmt)
+    fb.blit(fb, 1, 1)
+    print(b)
+    b = bytearray(range(4 * 4 * bpp))
+    fb = framebuf.FrameBuffer(b, 4, 4, fmt)
+    fb.blit(fb, -1, -1)
+    print(b)
+
+# keyed blit with the fast path
+b = bytearray(4)
+fb = framebuf.FrameBuffer(b, 4, 1, framebuf.GS8)
+fb.blit(framebuf.FrameBuffer(bytearray(b'\x01\x02\x01\x03'), 4, 1, framebuf.GS8), 0, 0, 1)
+print(b)
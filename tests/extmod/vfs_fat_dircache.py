@@ -0,0 +1,137 @@
+# Test name lookups in a directory large enough for the FAT directory cache.
+
+try:
+    import uerrno
+except ImportError:
+    print("SKIP")
+    raise SystemExit
+
+try:
+    from uos import VfsFat
+except ImportError:
+    try:
+        from uos_vfs import VfsFat
+    except ImportError:
+        print("SKIP")
+        raise SystemExit
+
+
+class RAMFS:
+
+    SEC_SIZE = 512
+
+    def __init__(self, blocks):
+        self.data = bytearray(blocks * self.SEC_SIZE)
+
+    def readblocks(self, n, buf):
+        buf[:] = self.data[n * self.SEC_SIZE:n * self.SEC_SIZE + len(buf)]
+
+    def writeblocks(self, n, buf):
+        self.data[n * self.SEC_SIZE:n * self.SEC_SIZE + len(buf)] = buf
+
+    def ioctl(self, op, arg):
+        if op == 4:  # BP_IOCTL_SEC_COUNT
+            return len(self.data) // self.SEC_SIZE
+        if op == 5:  # BP_IOCTL_SEC_SIZE
+            return self.SEC_SIZE
+
+
+try:
+    bdev = RAMFS(1024)
+except MemoryError:
+    print("SKIP")
+    raise SystemExit
+
+VfsFat.mkfs(bdev)
+vfs = VfsFat(bdev)
+
+
+def exists(name):
+    try:
+        vfs.stat(name)
+        return True
+    except OSError as e:
+        if e.args[0] != uerrno.ENOENT:
+            raise
+        return False
+
+
+def write(name, data):
+    with vfs.open(name, "w") as f:
+        f.write(data)
+
+
+def read(name):
+    with vfs.open(name, "r") as f:
+        return f.read()
+
+
+vfs.mkdir("/d")
+names = []
+for i in range(40):
+    names.append("/d/file%d.txt" % i)       # short name only
+    names.append("/d/Long Name %d.dat" % i)  # long name
+    names.append("/d/MiXeD%d.Py" % i)        # long name, short name without '~'
+for n in names:
+    write(n, n)
+
+print(len(list(vfs.ilistdir("/d"))))
+print(all(read(n) == n for n in names))
+print(all(exists(n.upper()) and exists(n.lower()) for n in names))
+print(exists("/d/file40.txt"), exists("/d/Long Name 40.dat"), exists("/d/file1.tx"))
+
+# short names are found too
+print(exists("/d/LONGNA~1.DAT"), exists("/d/MIXED0.PY"), exists("/d/FILE0.TXT"))
+
+# removed names are gone, their entries are reused
+for i in range(0, 40, 2):
+    vfs.remove("/d/file%d.txt" % i)
+    vfs.remove("/d/Long Name %d.dat" % i)
+print(exists("/d/file0.txt"), exists("/d/long name 0.dat"), exists("/d/file1.txt"))
+for i in range(20):
+    write("/d/new file %d" % i, "new")
+print(all(read("/d/New File %d" % i) == "new" for i in range(20)))
+print(exists("/d/file0.txt"), exists("/d/Long Name 1.dat"))
+
+# renames within the directory and to another one
+vfs.rename("/d/file1.txt", "/d/renamed one.txt")
+vfs.rename("/d/MiXeD1.Py", "/renamed.py")
+print(exists("/d/file1.txt"), read("/d/Renamed One.txt"))
+print(exists("/d/mixed1.py"), read("/renamed.py"))
+
+# a directory replaced by another one at the same place
+vfs.mkdir("/d/sub")
+for i in range(30):
+    write("/d/sub/s%d" % i, "s")
+print(exists("/d/sub/s29"), exists("/d/file3.txt"))
+for i in range(30):
+    vfs.remove("/d/sub/s%d" % i)
+vfs.rmdir("/d/sub")
+vfs.mkdir("/d/sub")
+print(exists("/d/sub/s29"), exists("/d/sub"))
+write("/d/sub/t", "t")
+print(exists("/d/sub/t"), exists("/d/sub/s0"))
+
+# mounted again
+vfs = VfsFat(bdev)
+print(exists("/d/new file 19"), exists("/d/MIXED39.PY"), exists("/d/file0.txt"))
+print(len(list(vfs.ilistdir("/d"))))
+
+# nested large directories, more levels than the cache holds at a time
+path = ""
+for level in range(6):
+    path += "/level %d" % level
+    vfs.mkdir(path)
+    for i in range(40):
+        write("%s/entry %d" % (path, i), path)
+print(all(read("%s/entry %d" % (path, i)) == path for i in range(40)))
+path = ""
+for level in range(6):
+    path += "/level %d" % level
+    print(exists(path + "/entry 39"), exists(path + "/entry 40"), exists(path.upper() + "/ENTRY 0"))
+vfs.remove("/level 0/level 1/entry 7")
+write("/level 0/level 1/level 2/entry 40", "x")
+vfs.rename("/level 0/entry 3", "/level 0/level 1/level 2/level 3/moved")
+print(exists("/level 0/level 1/entry 7"), exists("/level 0/level 1/entry 8"))
+print(exists("/level 0/level 1/level 2/entry 40"), exists("/level 0/entry 3"))
+print(read("/level 0/level 1/level 2/level 3/moved"))